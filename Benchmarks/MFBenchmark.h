@@ -0,0 +1,169 @@
+//
+//  MFBenchmark.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFBenchmark_h
+#define MIDIFish_MFBenchmark_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef __cplusplus
+#include <stdatomic.h>
+#endif
+
+/**
+ Minimal benchmark harness shared by the C and ObjC suites.
+
+ Each benchmark runs its body with a doubling iteration count until one run takes at least MF_BENCH_MIN_TIME seconds (env var, default 0.25), then reports that run as one JSON object per line on stdout:
+
+     {"suite":"core","benchmark":"parser.dense_cc","messages":..,"seconds":..,"msgs_per_sec":..,"ns_per_msg":..,"allocs_per_msg":..,"bytes_per_msg":..}
+
+ Allocations are counted by MFBenchmarkAllocCounter.c which must be linked in.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Bumped by every malloc/calloc/realloc. See MFBenchmarkAllocCounter.c */
+#ifdef __cplusplus
+// No _Atomic in C++ (before 23). Same object, read with the builtin the C11 atomics are made of
+extern uint64_t MFBenchmarkAllocCount;
+#define _MFBenchmarkAllocCountLoad() __atomic_load_n(&MFBenchmarkAllocCount, __ATOMIC_SEQ_CST)
+#else
+extern _Atomic uint64_t MFBenchmarkAllocCount;
+#define _MFBenchmarkAllocCountLoad() atomic_load(&MFBenchmarkAllocCount)
+#endif
+
+/** Body of a benchmark. Do `iterations` repetitions of the work */
+typedef void (*MFBenchmarkFunction)(void *context, uint64_t iterations);
+
+typedef struct MFBenchmarkSpec {
+    const char *suite;
+    const char *name;
+    uint64_t messagesPerIteration;
+    uint64_t bytesPerIteration;         // 0 to omit bytes_per_msg
+    MFBenchmarkFunction function;
+    void *context;
+} MFBenchmarkSpec;
+
+
+static inline uint64_t MFBenchmarkNowNanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//---------------------------------------------------------------------
+
+static inline void MFBenchmarkRun(const MFBenchmarkSpec *spec)
+{
+    const char *minTimeEnv = getenv("MF_BENCH_MIN_TIME");
+    const double minTime = minTimeEnv ? atof(minTimeEnv) : 0.25;
+
+    // Warm up caches, lazy inits etc
+    spec->function(spec->context, 1);
+
+    uint64_t iterations = 1, elapsed = 0, allocs = 0;
+    for (;;)
+    {
+        const uint64_t allocsBefore = _MFBenchmarkAllocCountLoad();
+        const uint64_t start = MFBenchmarkNowNanos();
+        spec->function(spec->context, iterations);
+        elapsed = MFBenchmarkNowNanos() - start;
+        allocs = _MFBenchmarkAllocCountLoad() - allocsBefore;
+
+        if (elapsed >= minTime * 1e9 || iterations >= (1ull << 40)) break;
+        iterations *= 2;
+    }
+
+    const double messages = (double)iterations * (double)spec->messagesPerIteration;
+    const double seconds = elapsed / 1e9;
+    printf("{\"suite\":\"%s\",\"benchmark\":\"%s\",\"messages\":%.0f,\"seconds\":%.6f,\"msgs_per_sec\":%.1f,\"ns_per_msg\":%.3f,\"allocs_per_msg\":%.4f",
+           spec->suite, spec->name, messages, seconds,
+           messages / seconds, elapsed / messages, allocs / messages);
+    if (spec->bytesPerIteration) {
+        printf(",\"bytes_per_msg\":%.2f", (double)spec->bytesPerIteration / spec->messagesPerIteration);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Streams
+/////////////////////////////////////////////////////////////////////////
+
+typedef enum MFBenchmarkStreamKind {
+    kMFBenchmarkStreamDenseCC,          // full 3-byte CCs, cycling channels so there's no running status
+    kMFBenchmarkStreamRunningStatus,    // one status then data pairs, as a fast controller sweep comes over the wire
+    kMFBenchmarkStreamLongSysex,        // back to back 4KB sysex dumps
+    kMFBenchmarkStreamAdversarial,      // seeded garbage: stray data, realtime mid-message, unterminated sysex
+} MFBenchmarkStreamKind;
+
+static inline const char *MFBenchmarkStreamName(MFBenchmarkStreamKind kind)
+{
+    switch (kind) {
+        case kMFBenchmarkStreamDenseCC:         return "dense_cc";
+        case kMFBenchmarkStreamRunningStatus:   return "running_status";
+        case kMFBenchmarkStreamLongSysex:       return "long_sysex";
+        case kMFBenchmarkStreamAdversarial:     return "adversarial";
+    }
+    return "unknown";
+}
+
+/** Fills `buffer` with `length` bytes of the given stream. Deterministic */
+static inline void MFBenchmarkMakeStream(MFBenchmarkStreamKind kind, uint8_t *buffer, size_t length)
+{
+    uint32_t seed = 0x12345678;
+    size_t i = 0;
+    switch (kind)
+    {
+        case kMFBenchmarkStreamDenseCC:
+            for (; i + 3 <= length; i += 3) {
+                buffer[i] = 0xB0 | ((i / 3) & 0x0F);
+                buffer[i+1] = (i / 48) & 0x7F;
+                buffer[i+2] = i & 0x7F;
+            }
+            break;
+
+        case kMFBenchmarkStreamRunningStatus:
+            buffer[i++] = 0xB0;
+            for (; i + 2 <= length; i += 2) {
+                buffer[i] = 1;
+                buffer[i+1] = (i / 2) & 0x7F;
+            }
+            break;
+
+        case kMFBenchmarkStreamLongSysex:
+            while (i < length) {
+                const size_t dumpLength = 4096;
+                buffer[i++] = 0xF0;
+                for (size_t j = 0; j < dumpLength - 2 && i < length - 1; j++) buffer[i++] = j & 0x7F;
+                buffer[i++] = 0xF7;
+            }
+            break;
+
+        case kMFBenchmarkStreamAdversarial:
+            for (; i < length; i++) {
+                seed = seed * 1664525u + 1013904223u;
+                buffer[i] = (uint8_t)(seed >> 24);
+            }
+            break;
+    }
+    // Pad any tail with realtime clocks which are always valid alone
+    for (; i < length; i++) buffer[i] = 0xF8;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+//
+//  MFBenchmarkAllocCounter.c
+//  MIDIFish
+//
+//
+
+#include "MFBenchmark.h"
+
+/**
+ Counts heap allocations for allocs_per_msg.
+
+ - glibc: overrides malloc & co. and forwards to the __libc_ versions.
+ - Apple: swaps the default malloc zone's function pointers at load so ObjC object allocations are included.
+
+ Don't combine with sanitizers which replace the allocator themselves.
+ */
+
+_Atomic uint64_t MFBenchmarkAllocCount = 0;
+
+#define _COUNT() atomic_fetch_add_explicit(&MFBenchmarkAllocCount, 1, memory_order_relaxed)
+
+
+#if defined(__APPLE__)
+
+#include <malloc/malloc.h>
+#include <mach/mach.h>
+
+static void *(*_origMalloc)(struct _malloc_zone_t *zone, size_t size);
+static void *(*_origCalloc)(struct _malloc_zone_t *zone, size_t count, size_t size);
+static void *(*_origRealloc)(struct _malloc_zone_t *zone, void *ptr, size_t size);
+
+static void *_MFCountingMalloc(struct _malloc_zone_t *zone, size_t size) { _COUNT(); return _origMalloc(zone, size); }
+static void *_MFCountingCalloc(struct _malloc_zone_t *zone, size_t count, size_t size) { _COUNT(); return _origCalloc(zone, count, size); }
+static void *_MFCountingRealloc(struct _malloc_zone_t *zone, void *ptr, size_t size) { _COUNT(); return _origRealloc(zone, ptr, size); }
+
+__attribute__((constructor))
+static void _MFInstallAllocCounter(void)
+{
+    malloc_zone_t *zone = malloc_default_zone();
+
+    // The zone struct is write protected after init
+    vm_address_t page = (vm_address_t)zone & ~(vm_address_t)(vm_page_size - 1);
+    vm_protect(mach_task_self(), page, vm_page_size, 0, VM_PROT_READ | VM_PROT_WRITE);
+    _origMalloc = zone->malloc;
+    _origCalloc = zone->calloc;
+    _origRealloc = zone->realloc;
+    zone->malloc = _MFCountingMalloc;
+    zone->calloc = _MFCountingCalloc;
+    zone->realloc = _MFCountingRealloc;
+    vm_protect(mach_task_self(), page, vm_page_size, 0, VM_PROT_READ);
+}
+
+#elif defined(__GLIBC__)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) { _COUNT(); return __libc_malloc(size); }
+void *calloc(size_t count, size_t size) { _COUNT(); return __libc_calloc(count, size); }
+void *realloc(void *ptr, size_t size) { _COUNT(); return __libc_realloc(ptr, size); }
+
+#else
+#warning "Allocation counting not supported on this platform. allocs_per_msg will read 0"
+#endif
@@ -0,0 +1,599 @@
+//
+//  MFCoreBenchmarks.c
+//  MIDIFish
+//
+//
+
+/**
+ Benchmarks for the portable C layers: parsing, batching, running status encoding, transforms, UMP translation, render queue hand-off, recording to a MIDI file and fan-out through the routing snapshot to a loopback backend. Builds on macOS and Linux. From the repo root:
+
+     cc -O2 -std=gnu11 -I MIDIFish -I MIDIFish/Private \
+        Benchmarks/MFCoreBenchmarks.c Benchmarks/MFBenchmarkAllocCounter.c \
+        MIDIFish/MFMIDIParser.c MIDIFish/MFMIDIBatch.c MIDIFish/MFMIDITypes.c \
+        MIDIFish/MFMIDIRunningStatus.c MIDIFish/MFMIDILoopbackBackend.c \
+        MIDIFish/MFMIDITransform.c MIDIFish/MFMIDIFileRecorder.c MIDIFish/MFMIDIUMP.c \
+        MIDIFish/MFMIDIRenderQueue.c \
+        MIDIFish/Private/_MFSendRoutes.c MIDIFish/Private/_MFRingBuffer.c \
+        -lpthread -lm -o mf_core_bench && ./mf_core_bench
+
+ Output is JSON lines. See MFBenchmark.h
+ */
+
+#include "MFBenchmark.h"
+#include "MFMIDIParser.h"
+#include "MFMIDIBatch.h"
+#include "MFMIDIRunningStatus.h"
+#include "MFMIDITransform.h"
+#include "MFMIDIFileRecorder.h"
+#include "MFMIDIUMP.h"
+#include "MFMIDIRenderQueue.h"
+#include "MFMIDILoopbackBackend.h"
+#include "_MFSendRoutes.h"
+
+static const size_t _kStreamLength = 64 * 1024;
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Parser
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    uint8_t *stream;
+    size_t length;
+    uint64_t eventCount;        // per feed of the whole stream
+} _ParserContext;
+
+static void _CountEvent(const MFMIDIParserEvent *event, void *context)
+{
+    (void)event;
+    (*(uint64_t *)context)++;
+}
+
+static void _BenchParser(void *context, uint64_t iterations)
+{
+    _ParserContext *ctx = context;
+    uint64_t count = 0;
+    MFMIDIParser parser;
+    MFMIDIParserInit(&parser, _CountEvent, &count);
+    for (uint64_t i = 0; i < iterations; i++) {
+        MFMIDIParserFeed(&parser, ctx->stream, ctx->length, i);
+        MFMIDIParserReset(&parser);
+    }
+}
+
+static void _RunParserBenchmarks(void)
+{
+    for (MFBenchmarkStreamKind kind = kMFBenchmarkStreamDenseCC; kind <= kMFBenchmarkStreamAdversarial; kind++)
+    {
+        _ParserContext ctx = { .stream = malloc(_kStreamLength), .length = _kStreamLength };
+        MFBenchmarkMakeStream(kind, ctx.stream, ctx.length);
+
+        // Count what one pass yields so we can report per message
+        MFMIDIParser parser;
+        MFMIDIParserInit(&parser, _CountEvent, &ctx.eventCount);
+        MFMIDIParserFeed(&parser, ctx.stream, ctx.length, 0);
+
+        char name[64];
+        snprintf(name, sizeof(name), "parser.%s", MFBenchmarkStreamName(kind));
+        MFBenchmarkSpec spec = { "core", name, ctx.eventCount, ctx.length, _BenchParser, &ctx };
+        MFBenchmarkRun(&spec);
+        free(ctx.stream);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Batch
+/////////////////////////////////////////////////////////////////////////
+
+static const uint64_t _kBatchMessages = 1000;
+
+static void _NoopFlush(MFMIDIBatch *batch, MIDIPacketList *packetList, void *context)
+{
+    (void)batch;
+    (*(uint64_t *)context) += packetList->numPackets;
+}
+
+static void _BenchBatch(void *context, uint64_t iterations)
+{
+    uint64_t packets = 0;
+    uint8_t buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        MFMIDIBatch batch;
+        MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _NoopFlush, &packets);
+        for (uint64_t m = 0; m < _kBatchMessages; m++) {
+            MFMIDIBatchAddControlChange(&batch, m & 0x0F, 1, m & 0x7F);
+        }
+        MFMIDIBatchFlush(&batch);
+    }
+    *(volatile uint64_t *)context = packets;
+}
+
+static void _RunBatchBenchmarks(void)
+{
+    uint64_t sink;
+    MFBenchmarkSpec spec = { "core", "batch.control_change", _kBatchMessages, _kBatchMessages * 3, _BenchBatch, &sink };
+    MFBenchmarkRun(&spec);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Running Status
+/////////////////////////////////////////////////////////////////////////
+
+/** Controller performances as they leave the send path: one packet per batch or coalescer flush */
+typedef enum {
+    _kControllerStreamFaderBank,        // coalescer flushes of 8 faders on one channel
+    _kControllerStreamKeyboard,         // notes (default velocity offs), mod wheel and pitchbend on one channel
+    _kControllerStreamMultiChannel,     // CCs and pitchbend spread over 4 channels
+    _kControllerStreamCount
+} _ControllerStreamKind;
+
+static const char *_kControllerStreamNames[_kControllerStreamCount] = { "fader_bank", "keyboard", "multi_channel" };
+
+typedef struct {
+    uint8_t list[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    uint8_t encoded[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    uint64_t messageCount;
+} _RunningStatusContext;
+
+/** Fills the packet list until the (session sized) buffer is full. Seeded so runs compare */
+static void _MakeControllerStream(_ControllerStreamKind kind, _RunningStatusContext *ctx)
+{
+    MIDIPacketList *packetList = (MIDIPacketList *)ctx->list;
+    MIDIPacket *packet = MIDIPacketListInit(packetList);
+    uint32_t seed = 0x5EED;
+    uint8_t faders[8] = { 0 };
+    int8_t heldNote = -1;
+    ctx->messageCount = 0;
+
+    for (MIDITimeStamp t = 1; ; t++)
+    {
+        uint8_t bytes[64];
+        size_t length = 0;
+        uint32_t messages = 0;
+
+        seed = seed * 1664525u + 1013904223u;
+        switch (kind)
+        {
+            case _kControllerStreamFaderBank:
+                for (uint8_t f = 0; f < 8; f++) {
+                    faders[f] = (faders[f] + 1 + ((seed >> (f * 3)) & 3)) & 0x7F;
+                    bytes[length++] = 0xB0; bytes[length++] = 7 + f; bytes[length++] = faders[f];
+                    messages++;
+                }
+                break;
+
+            case _kControllerStreamKeyboard:
+                if (heldNote >= 0 && (seed & 1)) {
+                    bytes[length++] = 0x80; bytes[length++] = (uint8_t)heldNote; bytes[length++] = 64;
+                    heldNote = -1;
+                    messages++;
+                }
+                if (heldNote < 0) {
+                    heldNote = 48 + ((seed >> 4) % 24);
+                    bytes[length++] = 0x90; bytes[length++] = (uint8_t)heldNote; bytes[length++] = 40 + ((seed >> 9) & 0x3F);
+                    messages++;
+                }
+                for (uint32_t n = (seed >> 16) & 3; n; n--) {
+                    bytes[length++] = 0xB0; bytes[length++] = 1; bytes[length++] = (seed >> (n * 5)) & 0x7F;
+                    messages++;
+                }
+                bytes[length++] = 0xE0; bytes[length++] = (seed >> 20) & 0x7F; bytes[length++] = 0x40;
+                messages++;
+                break;
+
+            default:
+                for (uint32_t n = 1 + ((seed >> 8) & 7); n; n--) {
+                    seed = seed * 1664525u + 1013904223u;
+                    const uint8_t channel = (seed >> 12) & 3;
+                    if (seed & 0x10000) {
+                        bytes[length++] = 0xE0 | channel; bytes[length++] = (seed >> 20) & 0x7F; bytes[length++] = (seed >> 24) & 0x7F;
+                    } else {
+                        bytes[length++] = 0xB0 | channel; bytes[length++] = 1 + ((seed >> 20) & 3); bytes[length++] = (seed >> 24) & 0x7F;
+                    }
+                    messages++;
+                }
+                break;
+        }
+
+        MIDIPacket *next = MIDIPacketListAdd(packetList, sizeof(ctx->list), packet, t, length, bytes);
+        if (!next) break;
+        packet = next;
+        ctx->messageCount += messages;
+    }
+}
+
+static void _BenchRunningStatus(void *context, uint64_t iterations)
+{
+    _RunningStatusContext *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MFMIDIRunningStatusEncodePacketList((const MIDIPacketList *)ctx->list, (MIDIPacketList *)ctx->encoded, sizeof(ctx->encoded), kMFMIDIRunningStatusOptionNoteOffAsNoteOn);
+    }
+}
+
+static size_t _PacketListDataBytes(const MIDIPacketList *packetList)
+{
+    size_t bytes = 0;
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 0; i < packetList->numPackets; i++) {
+        bytes += packet->length;
+        packet = MIDIPacketNext(packet);
+    }
+    return bytes;
+}
+
+/** Also reports the bytes saved and checks every packet parses back to the same messages */
+static void _RunRunningStatusBenchmarks(void)
+{
+    static _RunningStatusContext ctx;
+    for (_ControllerStreamKind kind = 0; kind < _kControllerStreamCount; kind++)
+    {
+        _MakeControllerStream(kind, &ctx);
+        _BenchRunningStatus(&ctx, 1);
+
+        const MIDIPacketList *original = (const MIDIPacketList *)ctx.list;
+        const MIDIPacketList *encoded = (const MIDIPacketList *)ctx.encoded;
+        const size_t inputBytes = _PacketListDataBytes(original);
+        const size_t outputBytes = _PacketListDataBytes(encoded);
+
+        bool roundTrips = original->numPackets == encoded->numPackets;
+        const MIDIPacket *a = &original->packet[0], *b = &encoded->packet[0];
+        for (UInt32 i = 0; roundTrips && i < original->numPackets; i++) {
+            roundTrips = MFMIDIRunningStatusVerify(a->data, a->length, b->data, b->length, kMFMIDIRunningStatusOptionNoteOffAsNoteOn);
+            a = MIDIPacketNext(a);
+            b = MIDIPacketNext(b);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "running_status.%s", _kControllerStreamNames[kind]);
+        MFBenchmarkSpec spec = { "core", name, ctx.messageCount, outputBytes, _BenchRunningStatus, &ctx };
+        MFBenchmarkRun(&spec);
+
+        printf("{\"suite\":\"core\",\"benchmark\":\"%s.bytes\",\"input_bytes\":%zu,\"output_bytes\":%zu,\"saved_pct\":%.1f,\"round_trips\":%s}\n",
+               name, inputBytes, outputBytes, 100.0 * (double)(inputBytes - outputBytes) / (double)inputBytes, roundTrips ? "true" : "false");
+        fflush(stdout);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Transform
+/////////////////////////////////////////////////////////////////////////
+
+typedef enum {
+    _kTransformRuleChannelMap,
+    _kTransformRuleVelocityCurve,
+    _kTransformRuleFilter,
+    _kTransformRuleAll,
+    _kTransformRuleCount
+} _TransformRule;
+
+static const char *_kTransformRuleNames[_kTransformRuleCount] = { "channel_map", "velocity_curve", "filter", "all" };
+
+typedef struct {
+    MFMIDITransform transform;
+    uint8_t *stream;
+    uint8_t *work;
+    size_t length;
+    size_t outputLength;
+} _TransformContext;
+
+static void _MakeTransform(_TransformRule rule, MFMIDITransform *transform)
+{
+    MFMIDITransformInit(transform);
+    if (rule == _kTransformRuleChannelMap || rule == _kTransformRuleAll) {
+        for (uint8_t ch = 0; ch < 16; ch++) MFMIDITransformMapChannel(transform, ch, 15 - ch);
+    }
+    if (rule == _kTransformRuleVelocityCurve || rule == _kTransformRuleAll) {
+        MFMIDITransformSetVelocityCurve(transform, 0xFFFF, 1.8f, 20, 127);
+    }
+    if (rule == _kTransformRuleFilter || rule == _kTransformRuleAll) {
+        MFMIDITransformDropTypes(transform, kMFMIDITransformTypeChannelPressure | kMFMIDITransformTypeActiveSensing | kMFMIDITransformTypeClock);
+        MFMIDITransformDropChannels(transform, 1 << 9);
+    }
+}
+
+/** In place so each pass transforms a fresh copy. The copy is part of the cost, as it would be for a send */
+static void _BenchTransform(void *context, uint64_t iterations)
+{
+    _TransformContext *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        MFMIDITransformState state = {0};
+        memcpy(ctx->work, ctx->stream, ctx->length);
+        ctx->outputLength = MFMIDITransformApply(&ctx->transform, &state, ctx->work, ctx->length);
+    }
+}
+
+/** Also reports the stream's bytes left after the filter and checks it still parses to no more messages than went in */
+static void _RunTransformBenchmarks(void)
+{
+    for (MFBenchmarkStreamKind kind = kMFBenchmarkStreamDenseCC; kind <= kMFBenchmarkStreamAdversarial; kind++)
+    {
+        for (_TransformRule rule = 0; rule < _kTransformRuleCount; rule++)
+        {
+            _TransformContext ctx = { .stream = malloc(_kStreamLength), .work = malloc(_kStreamLength), .length = _kStreamLength };
+            MFBenchmarkMakeStream(kind, ctx.stream, ctx.length);
+            _MakeTransform(rule, &ctx.transform);
+
+            uint64_t eventCount = 0;
+            MFMIDIParser parser;
+            MFMIDIParserInit(&parser, _CountEvent, &eventCount);
+            MFMIDIParserFeed(&parser, ctx.stream, ctx.length, 0);
+
+            char name[64];
+            snprintf(name, sizeof(name), "transform.%s.%s", _kTransformRuleNames[rule], MFBenchmarkStreamName(kind));
+            MFBenchmarkSpec spec = { "core", name, eventCount, ctx.length, _BenchTransform, &ctx };
+            MFBenchmarkRun(&spec);
+
+            printf("{\"suite\":\"core\",\"benchmark\":\"%s.bytes\",\"input_bytes\":%zu,\"output_bytes\":%zu}\n", name, ctx.length, ctx.outputLength);
+            fflush(stdout);
+            free(ctx.stream);
+            free(ctx.work);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+
+typedef struct {
+    MFMIDITransform transform;
+    _RunningStatusContext *source;
+    uint8_t work[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+} _TransformPacketListContext;
+
+static void _BenchTransformPacketList(void *context, uint64_t iterations)
+{
+    _TransformPacketListContext *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        memcpy(ctx->work, ctx->source->list, sizeof(ctx->work));
+        MFMIDITransformApplyToPacketList(&ctx->transform, NULL, (MIDIPacketList *)ctx->work);
+    }
+}
+
+/** As the session's send path has it: a controller's packet lists */
+static void _RunTransformPacketListBenchmarks(void)
+{
+    static _RunningStatusContext source;
+    static _TransformPacketListContext ctx;
+    for (_ControllerStreamKind kind = 0; kind < _kControllerStreamCount; kind++)
+    {
+        _MakeControllerStream(kind, &source);
+        _MakeTransform(_kTransformRuleAll, &ctx.transform);
+        ctx.source = &source;
+
+        char name[64];
+        snprintf(name, sizeof(name), "transform_packet_list.all.%s", _kControllerStreamNames[kind]);
+        MFBenchmarkSpec spec = { "core", name, source.messageCount, _PacketListDataBytes((const MIDIPacketList *)source.list), _BenchTransformPacketList, &ctx };
+        MFBenchmarkRun(&spec);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - UMP
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    MFMIDIUMPProtocol protocol;
+    uint8_t *stream;
+    size_t length;
+    uint32_t *words;            // the stream translated, for the way back
+    size_t wordCount;
+    uint8_t *bytes;
+} _UMPContext;
+
+static void _BenchUMPFromBytes(void *context, uint64_t iterations)
+{
+    _UMPContext *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MFMIDIUMPFromBytesState state = {0};
+        ctx->wordCount = MFMIDIUMPFromBytes(&state, ctx->protocol, 0, ctx->stream, ctx->length, ctx->words, ctx->length * 2, NULL);
+    }
+}
+
+static void _BenchUMPToBytes(void *context, uint64_t iterations)
+{
+    _UMPContext *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MFMIDIUMPToBytes(ctx->words, ctx->wordCount, ctx->bytes, ctx->wordCount * kMFMIDIUMPMaxBytesPerWord, NULL);
+    }
+}
+
+/** Whole buffers each way, per message in the stream. Also reports how many messages the parser finds after a round trip. Only the adversarial stream's differ, as its junk is dropped and its realtime moves within the sysex it interrupts */
+static void _RunUMPBenchmarks(void)
+{
+    const MFMIDIUMPProtocol protocols[] = { kMFMIDIUMPProtocolMIDI1, kMFMIDIUMPProtocolMIDI2 };
+    const char *protocolNames[] = { "midi1", "midi2" };
+    for (MFBenchmarkStreamKind kind = kMFBenchmarkStreamDenseCC; kind <= kMFBenchmarkStreamAdversarial; kind++)
+    {
+        for (size_t p = 0; p < sizeof(protocols) / sizeof(protocols[0]); p++)
+        {
+            _UMPContext ctx = {
+                .protocol = protocols[p],
+                .stream = malloc(_kStreamLength), .length = _kStreamLength,
+                .words = malloc(_kStreamLength * 2 * sizeof(uint32_t)),
+                .bytes = malloc(_kStreamLength * 2 * kMFMIDIUMPMaxBytesPerWord),
+            };
+            MFBenchmarkMakeStream(kind, ctx.stream, ctx.length);
+
+            uint64_t eventCount = 0, roundTripCount = 0;
+            MFMIDIParser parser;
+            MFMIDIParserInit(&parser, _CountEvent, &eventCount);
+            MFMIDIParserFeed(&parser, ctx.stream, ctx.length, 0);
+
+            char name[64];
+            snprintf(name, sizeof(name), "ump.from_bytes.%s.%s", protocolNames[p], MFBenchmarkStreamName(kind));
+            MFBenchmarkSpec spec = { "core", name, eventCount, ctx.length, _BenchUMPFromBytes, &ctx };
+            MFBenchmarkRun(&spec);
+
+            snprintf(name, sizeof(name), "ump.to_bytes.%s.%s", protocolNames[p], MFBenchmarkStreamName(kind));
+            MFBenchmarkSpec backSpec = { "core", name, eventCount, ctx.wordCount * sizeof(uint32_t), _BenchUMPToBytes, &ctx };
+            MFBenchmarkRun(&backSpec);
+
+            const size_t length = MFMIDIUMPToBytes(ctx.words, ctx.wordCount, ctx.bytes, ctx.wordCount * kMFMIDIUMPMaxBytesPerWord, NULL);
+            MFMIDIParserInit(&parser, _CountEvent, &roundTripCount);
+            MFMIDIParserFeed(&parser, ctx.bytes, length, 0);
+            printf("{\"suite\":\"core\",\"benchmark\":\"%s.words\",\"input_bytes\":%zu,\"words\":%zu,\"output_bytes\":%zu,\"messages\":%llu,\"round_trip_messages\":%llu}\n",
+                   name, ctx.length, ctx.wordCount, length, (unsigned long long)eventCount, (unsigned long long)roundTripCount);
+            fflush(stdout);
+
+            free(ctx.stream);
+            free(ctx.words);
+            free(ctx.bytes);
+        }
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - File Recording
+/////////////////////////////////////////////////////////////////////////
+
+static const char *_kRecorderPath = "mf_core_bench.mid";
+
+/** The send path's side only: the copy into the ring. The writer thread drains it alongside */
+static void _BenchFileRecorder(void *context, uint64_t iterations)
+{
+    MFMIDIFileRecorderRef recorder = context;
+    const uint8_t noteOn[3] = { 0x90, 60, 100 };
+    for (uint64_t i = 0; i < iterations; i++) {
+        MFMIDIFileRecorderRecord(recorder, 0, i * 1000, noteOn, sizeof(noteOn));
+    }
+}
+
+static void _RunFileRecorderBenchmarks(void)
+{
+    MFMIDIFileRecorderOptions options = { .format = 1, .trackCount = 2, .bufferCapacity = 4 * 1024 * 1024 };
+    MFMIDIFileRecorderRef recorder = MFMIDIFileRecorderCreate(_kRecorderPath, &options, 0);
+    if (!recorder) return;
+
+    MFBenchmarkSpec spec = { "core", "file_recorder.record", 1, 3, _BenchFileRecorder, recorder };
+    MFBenchmarkRun(&spec);
+
+    MFMIDIFileRecorderDestroy(recorder);
+    remove(_kRecorderPath);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Fan-out
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    const MFMIDIBackend *backend;
+    _MFSendRouterRef router;
+} _FanoutContext;
+
+/** Same loop as MFMIDISession's send path */
+static void _BenchFanout(void *context, uint64_t iterations)
+{
+    _FanoutContext *ctx = context;
+    uint8_t buffer[64] __attribute__((aligned(8)));
+    MIDIPacketList *packetList = (MIDIPacketList *)buffer;
+    const uint8_t noteOn[3] = { 0x90, 60, 100 };
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        MIDIPacket *packet = MIDIPacketListInit(packetList);
+        MIDIPacketListAdd(packetList, sizeof(buffer), packet, 0, 3, noteOn);
+
+        uint32_t token;
+        const _MFSendRoutes *routes = _MFSendRouterBeginRead(ctx->router, &token);
+        for (uint32_t t = 0; t < routes->count; t++) {
+            const _MFSendTarget *target = &routes->targets[t];
+            if (!(target->targetClass & _kMFSendTargetClassAll)) continue;
+            ctx->backend->send(ctx->backend->context, target->port, target->endpoint, packetList);
+        }
+        _MFSendRouterEndRead(ctx->router, token);
+    }
+}
+
+static void _RunFanoutBenchmarks(void)
+{
+    const uint32_t destinationCounts[] = { 1, 8, 64 };
+    for (size_t d = 0; d < sizeof(destinationCounts) / sizeof(destinationCounts[0]); d++)
+    {
+        const uint32_t count = destinationCounts[d];
+        MFMIDILoopbackRef loopback = MFMIDILoopbackCreate();
+        const MFMIDIBackend *backend = MFMIDILoopbackGetBackend(loopback);
+
+        MIDIClientRef client;
+        MIDIPortRef outPort;
+        backend->clientCreate(backend->context, "bench", NULL, NULL, &client);
+        backend->outputPortCreate(backend->context, client, "out", &outPort);
+
+        _MFSendRoutes *routes = _MFSendRoutesCreate(count);
+        for (uint32_t i = 0; i < count; i++) {
+            MIDIEndpointRef destination;
+            MFMIDILoopbackAddDevice(loopback, "dev", 0, NULL, &destination);
+            _MFSendRoutesAdd(routes, _kMFSendTargetKindSend, _kMFSendTargetClassLocal, destination, outPort, NULL, NULL, NULL, NULL);
+        }
+        _FanoutContext ctx = { backend, _MFSendRouterCreate() };
+        _MFSendRouterPublish(ctx.router, routes);
+
+        char name[64];
+        snprintf(name, sizeof(name), "fanout.routes.%u", count);
+        MFBenchmarkSpec spec = { "core", name, 1, 3, _BenchFanout, &ctx };
+        MFBenchmarkRun(&spec);
+
+        _MFSendRouterDestroy(ctx.router);
+        MFMIDILoopbackDestroy(loopback);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Render Queue
+/////////////////////////////////////////////////////////////////////////
+
+static const uint32_t _kRenderBufferMessages = 64;
+
+/** A 256 frame render buffer's worth of notes enqueued, as from the render thread, then drained into a batch as the session's timer does */
+static void _BenchRenderQueue(void *context, uint64_t iterations)
+{
+    MFMIDIRenderQueueRef queue = context;
+    uint64_t packets = 0;
+    uint8_t buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    MFMIDIBatch batch;
+    MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _NoopFlush, &packets);
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        MFMIDIRenderQueueBeginBuffer(queue, 1000000 + i * 5333333, 48000);
+        for (uint32_t m = 0; m < _kRenderBufferMessages; m++) {
+            MFMIDIRenderQueueEnqueueMessage(queue, m * 4, 0x90 | (m & 0x0F), 36 + (m & 0x3F), 100);
+        }
+        MFMIDIRenderQueueDrain(queue, &batch);
+        MFMIDIBatchFlush(&batch);
+    }
+    *(volatile uint64_t *)&packets = packets;
+}
+
+static void _RunRenderQueueBenchmarks(void)
+{
+    MFMIDIRenderQueueRef queue = MFMIDIRenderQueueCreate(0, 0, 0);
+    MFBenchmarkSpec spec = { "core", "render_queue.enqueue_drain", _kRenderBufferMessages, _kRenderBufferMessages * 3, _BenchRenderQueue, queue };
+    MFBenchmarkRun(&spec);
+    MFMIDIRenderQueueDestroy(queue);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    _RunParserBenchmarks();
+    _RunBatchBenchmarks();
+    _RunRunningStatusBenchmarks();
+    _RunTransformBenchmarks();
+    _RunTransformPacketListBenchmarks();
+    _RunUMPBenchmarks();
+    _RunRenderQueueBenchmarks();
+    _RunFileRecorderBenchmarks();
+    _RunFanoutBenchmarks();
+    return 0;
+}
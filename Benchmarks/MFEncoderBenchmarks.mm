@@ -0,0 +1,155 @@
+//
+//  MFEncoderBenchmarks.mm
+//  MIDIFish
+//
+//
+
+/**
+ MFMIDIEncoder.h's constexpr builders against the object path they stand in for: building a note on with `+messageWithType:channel:` and setters, with the C value constructors and with `MFMIDI::NoteOn()`, then sending each to one loopback destination.
+
+ Set up as for MFSessionBenchmarks.m: add this file plus MFBenchmarkAllocCounter.c to a Release scratch target alongside MIDIFish and call `MFRunEncoderBenchmarks()`. Define MF_BENCHMARK_MAIN to get a main() for a command line target.
+ */
+
+#import <Foundation/Foundation.h>
+#import "MIDIFish.h"
+#import "MFMIDIEncoder.h"
+#import "MFBenchmark.h"
+
+/** Keeps the encodes from being optimised away */
+static volatile uint8_t _sink;
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Encoding
+/////////////////////////////////////////////////////////////////////////
+
+static void _BenchEncodeObject(void *context, uint64_t iterations)
+{
+    @autoreleasepool {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypeNoteOn channel:i & 0x0F];
+            msg.key = i & 0x7F;
+            msg.velocity = 100;
+            _sink = msg.key;
+        }
+    }
+}
+
+static void _BenchEncodeValue(void *context, uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++) {
+        const MFMIDIMessageValue value = MFMIDIMessageValueMakeNoteOn(i & 0x0F, i & 0x7F, 100);
+        _sink = value.inlineBytes[1];
+    }
+}
+
+static void _BenchEncodeConstexpr(void *context, uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++) {
+        const auto msg = MFMIDI::NoteOn(i & 0x0F, i & 0x7F, 100);
+        _sink = msg.bytes[1];
+    }
+}
+
+/** All arguments constant, so there's nothing left to do but the store */
+static void _BenchEncodeConstant(void *context, uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; i++) {
+        constexpr auto msg = MFMIDI::NoteOn(9, 38, 127);
+        _sink = msg.bytes[1];
+    }
+}
+
+static void _RunEncodeBenchmarks(void)
+{
+    MFBenchmarkSpec object = { "encoder", "encode.object", 1, 3, _BenchEncodeObject, NULL };
+    MFBenchmarkRun(&object);
+
+    MFBenchmarkSpec value = { "encoder", "encode.value", 1, 3, _BenchEncodeValue, NULL };
+    MFBenchmarkRun(&value);
+
+    MFBenchmarkSpec constexprSpec = { "encoder", "encode.constexpr", 1, 3, _BenchEncodeConstexpr, NULL };
+    MFBenchmarkRun(&constexprSpec);
+
+    MFBenchmarkSpec constant = { "encoder", "encode.constexpr.constant", 1, 3, _BenchEncodeConstant, NULL };
+    MFBenchmarkRun(&constant);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Sending
+/////////////////////////////////////////////////////////////////////////
+
+static void _BenchSendObject(void *context, uint64_t iterations)
+{
+    MFMIDISession *session = (__bridge MFMIDISession *)context;
+    @autoreleasepool {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypeNoteOn channel:0];
+            msg.key = i & 0x7F;
+            msg.velocity = 100;
+            [session sendMIDIMessage:msg];
+        }
+    }
+}
+
+static void _BenchSendConvenience(void *context, uint64_t iterations)
+{
+    MFMIDISession *session = (__bridge MFMIDISession *)context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        [session sendNoteOn:i & 0x7F velocity:100];
+    }
+}
+
+static void _BenchSendEncoded(void *context, uint64_t iterations)
+{
+    MFMIDISession *session = (__bridge MFMIDISession *)context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MFMIDI::Send(session, MFMIDI::NoteOn(0, i & 0x7F, 100));
+    }
+}
+
+static void _RunSendBenchmarks(void)
+{
+    MFMIDILoopbackRef loopback = MFMIDILoopbackCreate();
+    MFMIDILoopbackAddDevice(loopback, "Device", 0, NULL, NULL);
+
+    @autoreleasepool {
+        MFMIDISession *session = [MFMIDISession sessionWithName:@"Benchmark" backend:MFMIDILoopbackGetBackend(loopback)];
+        session.autoEnableDestinations = YES;
+        session.autoEnableSources = NO;
+        [session refreshConnections];
+
+        MFBenchmarkSpec object = { "encoder", "send.object", 1, 3, _BenchSendObject, (__bridge void *)session };
+        MFBenchmarkRun(&object);
+
+        MFBenchmarkSpec convenience = { "encoder", "send.convenience", 1, 3, _BenchSendConvenience, (__bridge void *)session };
+        MFBenchmarkRun(&convenience);
+
+        MFBenchmarkSpec encoded = { "encoder", "send.constexpr", 1, 3, _BenchSendEncoded, (__bridge void *)session };
+        MFBenchmarkRun(&encoded);
+    }
+    MFMIDILoopbackDestroy(loopback);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Public
+/////////////////////////////////////////////////////////////////////////
+
+extern "C" void MFRunEncoderBenchmarks(void)
+{
+    _RunEncodeBenchmarks();
+    _RunSendBenchmarks();
+}
+
+#ifdef MF_BENCHMARK_MAIN
+int main(int argc, const char *argv[])
+{
+    @autoreleasepool {
+        MFRunEncoderBenchmarks();
+    }
+    return 0;
+}
+#endif
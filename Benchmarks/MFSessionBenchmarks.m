@@ -0,0 +1,349 @@
+//
+//  MFSessionBenchmarks.m
+//  MIDIFish
+//
+//
+
+/**
+ Benchmarks for the ObjC layer: MFMIDIMessage construction, messagesWithData: / messagesWithPacketList:, toMIDIPacketList: (cached and re-encoded after a mutation), MFMIDISession fan-out to 1/8/64 loopback destinations and thru routing.
+
+ MFMIDISession needs the same environment as your app (Audiobus headers, libextobjc's @weakify etc.), so the easiest way to run these is to add this file plus MFBenchmarkAllocCounter.c to a scratch target alongside MIDIFish and call `MFRunSessionBenchmarks()`, eg. from application:didFinishLaunching... Build it Release. Results go to stdout as JSON lines (see MFBenchmark.h).
+
+ Define MF_BENCHMARK_MAIN to get a main() for a command line target.
+ */
+
+#import <Foundation/Foundation.h>
+#import "MIDIFish.h"
+#import "MFBenchmark.h"
+
+static const size_t _kStreamLength = 16 * 1024;
+static const size_t _kSysexLength = 10 * 1024;
+
+/** A sysex message spanning several packet list chunks */
+static MFMIDIMessage *_MakeSysexMessage(void)
+{
+    NSMutableData *data = [NSMutableData dataWithLength:_kSysexLength];
+    UInt8 *bytes = data.mutableBytes;
+    for (size_t i = 1; i < _kSysexLength - 1; i++) bytes[i] = i & 0x7F;
+    bytes[0] = 0xF0;
+    bytes[_kSysexLength - 1] = 0xF7;
+    return [MFMIDIMessage messageWithData:[NSData dataWithData:data]];
+}
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Message Construction
+/////////////////////////////////////////////////////////////////////////
+
+static void _BenchSetters(void *context, uint64_t iterations)
+{
+    @autoreleasepool {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypeNoteOn channel:i & 0x0F];
+            msg.key = i & 0x7F;
+            msg.velocity = 100;
+        }
+    }
+}
+
+static void _BenchFromValue(void *context, uint64_t iterations)
+{
+    @autoreleasepool {
+        for (uint64_t i = 0; i < iterations; i++) {
+            (void)[MFMIDIMessage messageWithValue:MFMIDIMessageValueMakeNoteOn(i & 0x0F, i & 0x7F, 100)];
+        }
+    }
+}
+
+static void _BenchToPacketList(void *context, uint64_t iterations)
+{
+    MFMIDIMessage *msg = (__bridge MFMIDIMessage *)context;
+    __block uint64_t packets = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        [msg toMIDIPacketList:^(MIDIPacketList *packetList) {
+            packets += packetList->numPackets;
+        }];
+    }
+}
+
+/** Changing a byte throws away the cached lists so every pass encodes (and, for sysex, allocates) again */
+static void _BenchToPacketListMutated(void *context, uint64_t iterations)
+{
+    MFMIDIMessage *msg = (__bridge MFMIDIMessage *)context;
+    __block uint64_t packets = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        [msg setByte:i & 0x7F atIndex:1];
+        [msg toMIDIPacketList:^(MIDIPacketList *packetList) {
+            packets += packetList->numPackets;
+        }];
+    }
+}
+
+static void _RunMessageBenchmarks(void)
+{
+    MFBenchmarkSpec setters = { "session", "message.construct.setters", 1, 3, _BenchSetters, NULL };
+    MFBenchmarkRun(&setters);
+
+    MFBenchmarkSpec fromValue = { "session", "message.construct.value", 1, 3, _BenchFromValue, NULL };
+    MFBenchmarkRun(&fromValue);
+
+    MFMIDIMessage *msg = [MFMIDIMessage messageWithValue:MFMIDIMessageValueMakeControlChange(0, 7, 100)];
+    MFBenchmarkSpec toPacketList = { "session", "message.to_packet_list", 1, 3, _BenchToPacketList, (__bridge void *)msg };
+    MFBenchmarkRun(&toPacketList);
+
+    MFBenchmarkSpec toPacketListMutated = { "session", "message.to_packet_list.mutated", 1, 3, _BenchToPacketListMutated, (__bridge void *)msg };
+    MFBenchmarkRun(&toPacketListMutated);
+
+    // Encoded once then reused: 0 allocs/msg. Mutated: 1
+    MFMIDIMessage *sysex = _MakeSysexMessage();
+    MFBenchmarkSpec sysexToPacketList = { "session", "message.to_packet_list.sysex", 1, _kSysexLength, _BenchToPacketList, (__bridge void *)sysex };
+    MFBenchmarkRun(&sysexToPacketList);
+
+    MFBenchmarkSpec sysexMutated = { "session", "message.to_packet_list.sysex.mutated", 1, _kSysexLength, _BenchToPacketListMutated, (__bridge void *)sysex };
+    MFBenchmarkRun(&sysexMutated);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Parsing
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    __unsafe_unretained NSData *data;
+    MIDIPacketList *packetList;
+} _ParseContext;
+
+static void _BenchMessagesWithData(void *context, uint64_t iterations)
+{
+    _ParseContext *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        @autoreleasepool {
+            (void)[MFMIDIMessage messagesWithData:ctx->data];
+        }
+    }
+}
+
+static void _BenchMessagesWithPacketList(void *context, uint64_t iterations)
+{
+    _ParseContext *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        @autoreleasepool {
+            (void)[MFMIDIMessage messagesWithPacketList:ctx->packetList];
+        }
+    }
+}
+
+/** Chops the stream into 256 byte packets as a driver would */
+static MIDIPacketList *_CreatePacketList(NSData *data, size_t *outSize)
+{
+    const size_t chunk = 256;
+    const size_t size = sizeof(MIDIPacketList) + data.length + (data.length / chunk + 1) * (sizeof(MIDIPacket) + 4);
+    MIDIPacketList *packetList = malloc(size);
+    MIDIPacket *packet = MIDIPacketListInit(packetList);
+    for (size_t offset = 0; offset < data.length; offset += chunk) {
+        size_t length = MIN(chunk, data.length - offset);
+        packet = MIDIPacketListAdd(packetList, size, packet, offset, length, (const Byte *)data.bytes + offset);
+    }
+    *outSize = size;
+    return packetList;
+}
+
+static void _RunParseBenchmarks(void)
+{
+    for (MFBenchmarkStreamKind kind = kMFBenchmarkStreamDenseCC; kind <= kMFBenchmarkStreamAdversarial; kind++)
+    {
+        NSMutableData *data = [NSMutableData dataWithLength:_kStreamLength];
+        MFBenchmarkMakeStream(kind, data.mutableBytes, data.length);
+        size_t packetListSize;
+        _ParseContext ctx = { data, _CreatePacketList(data, &packetListSize) };
+        const uint64_t messageCount = [MFMIDIMessage messagesWithData:data].count;
+
+        char name[64];
+        snprintf(name, sizeof(name), "parse.messages_with_data.%s", MFBenchmarkStreamName(kind));
+        MFBenchmarkSpec withData = { "session", name, messageCount, data.length, _BenchMessagesWithData, &ctx };
+        MFBenchmarkRun(&withData);
+
+        snprintf(name, sizeof(name), "parse.messages_with_packet_list.%s", MFBenchmarkStreamName(kind));
+        MFBenchmarkSpec withPacketList = { "session", name, messageCount, data.length, _BenchMessagesWithPacketList, &ctx };
+        MFBenchmarkRun(&withPacketList);
+
+        free(ctx.packetList);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Fan-out
+/////////////////////////////////////////////////////////////////////////
+
+static void _BenchSendMessage(void *context, uint64_t iterations)
+{
+    MFMIDISession *session = (__bridge MFMIDISession *)context;
+    MFMIDIMessage *msg = [MFMIDIMessage messageWithValue:MFMIDIMessageValueMakeNoteOn(0, 60, 100)];
+    for (uint64_t i = 0; i < iterations; i++) {
+        [session sendMIDIMessage:msg];
+    }
+}
+
+/** The same sysex object every time, as for a preset sent to every destination. Encoded on the first send only */
+static void _BenchSendSysexMessage(void *context, uint64_t iterations)
+{
+    MFMIDISession *session = (__bridge MFMIDISession *)context;
+    MFMIDIMessage *msg = _MakeSysexMessage();
+    for (uint64_t i = 0; i < iterations; i++) {
+        [session sendMIDIMessage:msg];
+    }
+}
+
+static void _BenchSendValue(void *context, uint64_t iterations)
+{
+    MFMIDISession *session = (__bridge MFMIDISession *)context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MFMIDIMessageValue value = MFMIDIMessageValueMakeNoteOn(0, i & 0x7F, 100);
+        MFMIDISessionSendMessageValue(session, &value);
+    }
+}
+
+static void _RunFanoutBenchmarks(void)
+{
+    const uint32_t destinationCounts[] = { 1, 8, 64 };
+    for (size_t d = 0; d < sizeof(destinationCounts) / sizeof(destinationCounts[0]); d++)
+    {
+        const uint32_t count = destinationCounts[d];
+        MFMIDILoopbackRef loopback = MFMIDILoopbackCreate();
+        for (uint32_t i = 0; i < count; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "Device %u", i);
+            MFMIDILoopbackAddDevice(loopback, name, 0, NULL, NULL);
+        }
+
+        @autoreleasepool {
+            MFMIDISession *session = [MFMIDISession sessionWithName:@"Benchmark" backend:MFMIDILoopbackGetBackend(loopback)];
+            session.autoEnableDestinations = YES;
+            session.autoEnableSources = NO;
+            [session refreshConnections];
+
+            char name[64];
+            snprintf(name, sizeof(name), "fanout.send_message.%u", count);
+            MFBenchmarkSpec sendMessage = { "session", name, 1, 3, _BenchSendMessage, (__bridge void *)session };
+            MFBenchmarkRun(&sendMessage);
+
+            snprintf(name, sizeof(name), "fanout.send_value.%u", count);
+            MFBenchmarkSpec sendValue = { "session", name, 1, 3, _BenchSendValue, (__bridge void *)session };
+            MFBenchmarkRun(&sendValue);
+
+            snprintf(name, sizeof(name), "fanout.send_message.sysex.%u", count);
+            MFBenchmarkSpec sendSysex = { "session", name, 1, _kSysexLength, _BenchSendSysexMessage, (__bridge void *)session };
+            MFBenchmarkRun(&sendSysex);
+        }
+        MFMIDILoopbackDestroy(loopback);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Thru
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    MFMIDILoopbackRef loopback;
+    MIDIEndpointRef source;
+    const MIDIPacketList *packetList;
+} _ThruContext;
+
+/** A device playing a note into the session. With zero latency the loopback calls the read proc, and so the thru sends, synchronously */
+static void _BenchThruInject(void *context, uint64_t iterations)
+{
+    _ThruContext *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MFMIDILoopbackInject(ctx->loopback, ctx->source, ctx->packetList);
+    }
+}
+
+static void _RunThruBenchmarks(void)
+{
+    const uint32_t synthCount = 8;
+    MFMIDILoopbackRef loopback = MFMIDILoopbackCreate();
+    MIDIEndpointRef keyboard;
+    MFMIDILoopbackAddDevice(loopback, "Keyboard", 0, &keyboard, NULL);
+    for (uint32_t i = 0; i < synthCount; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Synth %u", i);
+        MFMIDILoopbackAddDevice(loopback, name, 0, NULL, NULL);
+    }
+    
+    Byte buffer[64] __attribute__((aligned(8)));
+    MIDIPacketList *packetList = (MIDIPacketList *)buffer;
+    const Byte noteOn[3] = { 0x90, 60, 100 };
+    MIDIPacketListAdd(packetList, sizeof(buffer), MIDIPacketListInit(packetList), 0, sizeof(noteOn), noteOn);
+    _ThruContext ctx = { loopback, keyboard, packetList };
+    
+    @autoreleasepool {
+        MFMIDISession *session = [MFMIDISession sessionWithName:@"Benchmark" backend:MFMIDILoopbackGetBackend(loopback)];
+        session.autoEnableDestinations = YES;
+        session.autoEnableSources = NO;
+        [session refreshConnections];
+        
+        // Only the keyboard is received from. Its own destination is left out of the routes as it would feed back
+        id<MFMIDISource> source = nil;
+        for (id<MFMIDISource> src in session.endpointSources) {
+            if ([src.name isEqualToString:@"Keyboard"]) source = src;
+        }
+        source.enabled = YES;
+        NSMutableArray *synths = [NSMutableArray array];
+        for (id<MFMIDIDestination> dest in session.endpointDestinations) {
+            if (![dest.name isEqualToString:@"Keyboard"]) [synths addObject:dest];
+        }
+        
+        // Receiving alone, then thru to one and to all the synths, then all through a filter. What thru adds to the latency is the difference from the first
+        MFBenchmarkSpec none = { "session", "thru.none", 1, 0, _BenchThruInject, &ctx };
+        MFBenchmarkRun(&none);
+        
+        [session setThruFromSource:source toDestination:synths[0] filter:NULL];
+        MFBenchmarkSpec one = { "session", "thru.1", 1, 0, _BenchThruInject, &ctx };
+        MFBenchmarkRun(&one);
+        
+        char name[64];
+        for (id<MFMIDIDestination> dest in synths) {
+            [session setThruFromSource:source toDestination:dest filter:NULL];
+        }
+        snprintf(name, sizeof(name), "thru.%u", synthCount);
+        MFBenchmarkSpec all = { "session", name, 1, 0, _BenchThruInject, &ctx };
+        MFBenchmarkRun(&all);
+        
+        MFMIDITransform filter;
+        MFMIDITransformInit(&filter);
+        MFMIDITransformDropTypes(&filter, kMFMIDITransformTypeControlChange | kMFMIDITransformTypeRealtime);
+        MFMIDITransformDropChannels(&filter, 0xFFFE);
+        for (id<MFMIDIDestination> dest in synths) {
+            [session setThruFromSource:source toDestination:dest filter:&filter];
+        }
+        snprintf(name, sizeof(name), "thru.%u.filtered", synthCount);
+        MFBenchmarkSpec filtered = { "session", name, 1, 0, _BenchThruInject, &ctx };
+        MFBenchmarkRun(&filtered);
+    }
+    MFMIDILoopbackDestroy(loopback);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Public
+/////////////////////////////////////////////////////////////////////////
+
+void MFRunSessionBenchmarks(void)
+{
+    _RunMessageBenchmarks();
+    _RunParseBenchmarks();
+    _RunFanoutBenchmarks();
+    _RunThruBenchmarks();
+}
+
+#ifdef MF_BENCHMARK_MAIN
+int main(int argc, const char *argv[])
+{
+    @autoreleasepool {
+        MFRunSessionBenchmarks();
+    }
+    return 0;
+}
+#endif
@@ -8,6 +8,8 @@
 
 #import "MFAudiobusDestination.h"
 #import "Audiobus/Audiobus.h"
+#import "MFMIDIMessage.h"
+#import "MFMIDIBatch.h"
 
 // Channelised Logging
 #undef echo
@@ -71,6 +73,35 @@
 
 //---------------------------------------------------------------------
 
+static void _MFAudiobusDestinationBatchFlush(MFMIDIBatch *batch, MIDIPacketList *packetList, void *context)
+{
+    ABMIDIPortSendPacketList((__bridge ABMIDISenderPort *)context, packetList);
+}
+
+- (void)sendMIDIMessages:(NSArray *)messages
+{
+    if (!self.enabled) {
+        echo(@"Skipping send messages on Audiobus destination %@ (disabled)", self)
+        return;
+    }
+    
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    MFMIDIBatch batch;
+    MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _MFAudiobusDestinationBatchFlush, (__bridge void *)_abMIDISenderPort);
+    
+    for (MFMIDIMessage *message in messages)
+    {
+        MFMIDIMessageValue value = message.messageValue;
+        if (!MFMIDIBatchAddValue(&batch, &value)) {
+            MFMIDIBatchFlush(&batch);
+            [self sendMIDIMessage:message];
+        }
+    }
+    MFMIDIBatchFlush(&batch);
+}
+
+//---------------------------------------------------------------------
+
 - (void)sendMIDIPacketList:(MIDIPacketList *)packetList
 {
     if (!self.enabled) {
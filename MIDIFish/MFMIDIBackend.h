@@ -0,0 +1,101 @@
+//
+//  MFMIDIBackend.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIBackend_h
+#define MIDIFish_MFMIDIBackend_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "MFMIDITypes.h"
+
+/**
+ The I/O layer under MFMIDISession: client/port creation and disposal, endpoint enumeration, sending and receiving, and endpoint add/remove notifications. It mirrors the subset of CoreMIDI the session uses, with the same ref types, read proc signature and error codes.
+
+ `MFMIDICoreMIDIBackend()` is the default. `MFMIDILoopbackBackend` simulates endpoints in-process so the session logic can be load tested and benchmarked without hardware (and the routing/batching code off Apple platforms).
+
+ All functions take the backend's `context` as their first argument.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum MFMIDIBackendNotification {
+    kMFMIDIBackendEndpointAdded,
+    kMFMIDIBackendEndpointRemoved,
+    kMFMIDIBackendEndpointPropertyChanged,      // eg. renamed. endpoint is 0 when it was a device or entity, which may affect any endpoint's display name
+} MFMIDIBackendNotification;
+
+typedef enum MFMIDIBackendEndpointType {
+    kMFMIDIBackendEndpointTypeSource,
+    kMFMIDIBackendEndpointTypeDestination,
+} MFMIDIBackendEndpointType;
+
+typedef void (*MFMIDIBackendNotifyProc)(MFMIDIBackendNotification notification, MFMIDIBackendEndpointType endpointType, MIDIEndpointRef endpoint, void *refCon);
+
+/** As MIDIReadProc for event lists */
+typedef void (*MFMIDIBackendEventReadProc)(const MIDIEventList *eventList, void *readProcRefCon, void *srcConnRefCon) MF_UMP_AVAILABLE;
+
+typedef struct MFMIDIBackend {
+    const char *name;
+    void *context;
+
+    /** Notifications are delivered on the thread the backend chooses (CoreMIDI: the run loop the client was created on) */
+    OSStatus (*clientCreate)(void *context, const char *name, MFMIDIBackendNotifyProc notifyProc, void *notifyRefCon, MIDIClientRef *outClient);
+
+    /** readProc may be called on a high priority thread. See MIDIInputPortCreate */
+    OSStatus (*inputPortCreate)(void *context, MIDIClientRef client, const char *name, MIDIReadProc readProc, void *refCon, MIDIPortRef *outPort);
+    OSStatus (*outputPortCreate)(void *context, MIDIClientRef client, const char *name, MIDIPortRef *outPort);
+
+    /** Virtual endpoints, ie. this app appearing as a source/destination to others. @{ */
+    OSStatus (*sourceCreate)(void *context, MIDIClientRef client, const char *name, MIDIEndpointRef *outSource);
+    OSStatus (*destinationCreate)(void *context, MIDIClientRef client, const char *name, MIDIReadProc readProc, void *refCon, MIDIEndpointRef *outDestination);
+    /** @} */
+
+    /** Tear down what the above created. Once they return the object's read proc isn't called again. Disposing a port disconnects its sources. Disposing the client disposes its ports and virtual endpoints and stops its notifications @{ */
+    OSStatus (*portDispose)(void *context, MIDIPortRef port);
+    OSStatus (*endpointDispose)(void *context, MIDIEndpointRef endpoint);
+    OSStatus (*clientDispose)(void *context, MIDIClientRef client);
+    /** @} */
+
+    ItemCount (*numberOfSources)(void *context);
+    MIDIEndpointRef (*getSource)(void *context, ItemCount index);
+    ItemCount (*numberOfDestinations)(void *context);
+    MIDIEndpointRef (*getDestination)(void *context, ItemCount index);
+
+    OSStatus (*portConnectSource)(void *context, MIDIPortRef port, MIDIEndpointRef source, void *connRefCon);
+    OSStatus (*portDisconnectSource)(void *context, MIDIPortRef port, MIDIEndpointRef source);
+
+    /** Send to a destination through an output port */
+    OSStatus (*send)(void *context, MIDIPortRef port, MIDIEndpointRef destination, const MIDIPacketList *packetList);
+    /** Distribute from one of our virtual sources to whoever's listening */
+    OSStatus (*received)(void *context, MIDIEndpointRef source, const MIDIPacketList *packetList);
+
+    /** UTF-8 display name into `buffer`. @return false if unknown */
+    bool (*getDisplayName)(void *context, MIDIObjectRef object, char *buffer, size_t bufferSize);
+
+    /** YES for the shared endpoints of the network (RTP-MIDI) session, which the session models per host */
+    bool (*isNetworkSessionEndpoint)(void *context, MIDIEndpointRef endpoint);
+
+    /** MIDI 2.0 (Universal MIDI Packet) equivalents of the above. Optional: NULL where the backend (or OS version) only does packet lists, in which case the session translates to and from MIDI 1.0 itself @{ */
+    OSStatus (*inputPortCreateWithProtocol)(void *context, MIDIClientRef client, const char *name, MIDIProtocolID protocol, MFMIDIBackendEventReadProc readProc, void *refCon, MIDIPortRef *outPort) MF_UMP_AVAILABLE;
+    OSStatus (*sendEventList)(void *context, MIDIPortRef port, MIDIEndpointRef destination, const MIDIEventList *eventList) MF_UMP_AVAILABLE;
+    OSStatus (*receivedEventList)(void *context, MIDIEndpointRef source, const MIDIEventList *eventList) MF_UMP_AVAILABLE;
+    /** @} */
+} MFMIDIBackend;
+
+
+#if defined(__APPLE__)
+/** Shared instance. Passes straight through to CoreMIDI */
+extern const MFMIDIBackend *MFMIDICoreMIDIBackend(void);
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
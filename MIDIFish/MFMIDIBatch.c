@@ -0,0 +1,49 @@
+//
+//  MFMIDIBatch.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIBatch.h"
+
+void MFMIDIBatchInit(MFMIDIBatch *batch, void *buffer, ByteCount bufferSize, MFMIDIBatchFlushHandler flushHandler, void *flushContext)
+{
+    batch->packetList = (MIDIPacketList *)buffer;
+    batch->bufferSize = bufferSize;
+    batch->flushHandler = flushHandler;
+    batch->flushContext = flushContext;
+    batch->currentPacket = MIDIPacketListInit(batch->packetList);
+    batch->messageCount = 0;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDIBatchAddBytes(MFMIDIBatch *batch, MIDITimeStamp timestamp, const UInt8 *bytes, ByteCount length)
+{
+    // MIDIPacketListAdd appends to the current packet when the timestamp matches and there's room
+    MIDIPacket *packet = MIDIPacketListAdd(batch->packetList, batch->bufferSize, batch->currentPacket, timestamp, length, bytes);
+
+    // Full? Send what we have and try again with an empty buffer
+    if (!packet && batch->messageCount)
+    {
+        MFMIDIBatchFlush(batch);
+        packet = MIDIPacketListAdd(batch->packetList, batch->bufferSize, batch->currentPacket, timestamp, length, bytes);
+    }
+    if (!packet) return false;
+
+    batch->currentPacket = packet;
+    batch->messageCount++;
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIBatchFlush(MFMIDIBatch *batch)
+{
+    if (!batch->messageCount) return;
+
+    batch->flushHandler(batch, batch->packetList, batch->flushContext);
+
+    batch->currentPacket = MIDIPacketListInit(batch->packetList);
+    batch->messageCount = 0;
+}
@@ -0,0 +1,76 @@
+//
+//  MFMIDIBatch.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIBatch_h
+#define MIDIFish_MFMIDIBatch_h
+
+#include "MFMIDITypes.h"
+#include <stdbool.h>
+#include "MFMIDIMessageValue.h"
+
+/**
+ Accumulates many messages into a single MIDIPacketList in a buffer you provide (usually on the stack) so they can be sent with one MIDISend per destination. Messages with the same timestamp are packed into the same MIDIPacket so they arrive back-to-back, ie atomically with respect to other senders.
+
+ If the buffer fills up the flush handler is called with what's there so far and the batch carries on, so only batches bigger than the buffer lose atomicity.
+
+ Usually you'd use `-[MFMIDISession sendBatch:]` rather than set one up yourself.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A comfortable stack size for a batch. Fits hundreds of channel messages */
+#define kMFMIDIBatchDefaultBufferSize 4096
+
+typedef struct MFMIDIBatch MFMIDIBatch;
+
+typedef void (*MFMIDIBatchFlushHandler)(MFMIDIBatch *batch, MIDIPacketList *packetList, void *context);
+
+/** Treat as opaque */
+struct MFMIDIBatch {
+    MIDIPacketList *packetList;
+    MIDIPacket *currentPacket;
+    ByteCount bufferSize;
+    UInt32 messageCount;            // since the last flush
+    MFMIDIBatchFlushHandler flushHandler;
+    void *flushContext;
+};
+
+
+/** @param buffer Must stay valid for the life of the batch. Should be 4-byte aligned */
+extern void MFMIDIBatchInit(MFMIDIBatch *batch, void *buffer, ByteCount bufferSize, MFMIDIBatchFlushHandler flushHandler, void *flushContext);
+
+/** Add raw bytes (one or more complete messages). @return false if it can't fit even in an empty buffer, in which case nothing is added */
+extern bool MFMIDIBatchAddBytes(MFMIDIBatch *batch, MIDITimeStamp timestamp, const UInt8 *bytes, ByteCount length);
+
+/** Add a message to be sent immediately (timestamp 0) */
+static inline bool MFMIDIBatchAddValue(MFMIDIBatch *batch, const MFMIDIMessageValue *value)
+{
+    return MFMIDIBatchAddBytes(batch, 0, MFMIDIMessageValueGetBytes(value), value->length);
+}
+
+/** Hands anything accumulated to the flush handler and resets. No-op when empty */
+extern void MFMIDIBatchFlush(MFMIDIBatch *batch);
+
+/** Shorthand for the common case of building RPNs, panics etc */
+static inline bool MFMIDIBatchAddControlChange(MFMIDIBatch *batch, UInt8 channel, UInt8 controller, UInt8 value)
+{
+    MFMIDIMessageValue msg = MFMIDIMessageValueMakeControlChange(channel, controller, value);
+    return MFMIDIBatchAddValue(batch, &msg);
+}
+
+static inline bool MFMIDIBatchIsEmpty(const MFMIDIBatch *batch)
+{
+    return batch->messageCount == 0;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
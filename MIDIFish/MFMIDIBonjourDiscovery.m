@@ -0,0 +1,243 @@
+//
+//  MFMIDIBonjourDiscovery.m
+//  MIDIFish
+//
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreMIDI/MIDINetworkSession.h>
+#import "MFMIDIDiscovery.h"
+
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <sys/types.h>
+#import <sys/socket.h>
+
+// Channelised Logging
+#undef echo
+#if LOG_MIDIFISH
+#   define echo(fmt, ...) NSLog((@"[MIDIFISH] " fmt), ##__VA_ARGS__);
+#else
+#   define echo(...)
+#endif
+#undef warn
+#define warn(fmt, ...) NSLog((@"[MIDIFISH] WARNING: " fmt), ##__VA_ARGS__);
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Driver
+/////////////////////////////////////////////////////////////////////////
+
+/** @private Owns the browser and the NSNetServices being resolved, and turns their delegate calls into the discovery callbacks */
+@interface _MFBonjourDiscoveryDriver : NSObject <NSNetServiceBrowserDelegate, NSNetServiceDelegate>
+{
+@public
+    const MFMIDIDiscoveryCallbacks *_callbacks;
+    void *_refCon;
+}
+@end
+
+@implementation _MFBonjourDiscoveryDriver
+{
+    NSNetServiceBrowser *_browser;
+    NSMutableDictionary *_found;        // name -> NSNetService. Resolves need the service the browser handed us
+    NSMutableDictionary *_resolving;    // name -> NSNetService. Removed before calling back so there's only ever one callback
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self) {
+        _found = [NSMutableDictionary dictionary];
+        _resolving = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)startBrowse
+{
+    // A new browser each time. Reusing a stopped one has been flaky
+    [_browser stop];
+    _browser = [[NSNetServiceBrowser alloc] init];
+    _browser.delegate = self;
+    [_found removeAllObjects];
+    [_browser searchForServicesOfType:MIDINetworkBonjourServiceType inDomain:@""];
+    return YES;
+}
+
+//---------------------------------------------------------------------
+
+- (void)stopBrowse
+{
+    [_browser stop];
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)resolveServiceWithName:(NSString *)name timeout:(NSTimeInterval)timeout
+{
+    NSNetService *service = _found[name];
+    if (!service) return NO;
+    _resolving[name] = service;
+    service.delegate = self;
+    [service resolveWithTimeout:timeout];
+    return YES;
+}
+
+//---------------------------------------------------------------------
+
+- (void)cancelResolveForServiceWithName:(NSString *)name
+{
+    NSNetService *service = _resolving[name];
+    [_resolving removeObjectForKey:name];
+    [service stop];
+}
+
+//---------------------------------------------------------------------
+
+/** Removes it from the resolving list. @return NO if it wasn't there, ie. it's been reported already or cancelled */
+- (BOOL)_finishResolveOf:(NSNetService *)service
+{
+    if (_resolving[service.name] != service) return NO;
+    [_resolving removeObjectForKey:service.name];
+    return YES;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - NSNetServiceBrowserDelegate
+/////////////////////////////////////////////////////////////////////////
+
+- (void)netServiceBrowser:(NSNetServiceBrowser *)aNetServiceBrowser didFindService:(NSNetService *)aNetService moreComing:(BOOL)moreComing
+{
+    if (aNetServiceBrowser != _browser) return;
+    echo("NETSERVICE: Found %@", aNetService);
+    _found[aNetService.name] = aNetService;
+    _callbacks->serviceFound(aNetService.name.UTF8String, aNetService.domain.UTF8String ?: "", moreComing, _refCon);
+}
+
+//---------------------------------------------------------------------
+
+- (void)netServiceBrowser:(NSNetServiceBrowser *)aNetServiceBrowser didNotSearch:(NSDictionary *)errorDict
+{
+    if (aNetServiceBrowser != _browser) return;
+    warn("NETSERVICE: NetServiceBrowser DID NOT SEARCH: %@", errorDict);
+    _callbacks->browseDidStop(_refCon);
+}
+
+//---------------------------------------------------------------------
+
+- (void)netServiceBrowserDidStopSearch:(NSNetServiceBrowser *)aNetServiceBrowser
+{
+    if (aNetServiceBrowser != _browser) return;
+    echo("NETSERVICE: NetServiceBrowser STOPPED");
+    _callbacks->browseDidStop(_refCon);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - NSNetServiceDelegate
+/////////////////////////////////////////////////////////////////////////
+
+- (void)netService:(NSNetService *)sender didNotResolve:(NSDictionary *)errorDict
+{
+    warn("NETSERVICE: %@ DID NOT RESOLVE. Error: %@", sender, errorDict);
+    if ([self _finishResolveOf:sender]) {
+        _callbacks->serviceDidNotResolve(sender.name.UTF8String, _refCon);
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)netServiceDidStop:(NSNetService *)sender
+{
+    // Sometimes this is called when there aren't any more addresses coming and we haven't found a good one
+    echo("NETSERVICE: %@ resolving STOPPED.", sender);
+    if ([self _finishResolveOf:sender]) {
+        _callbacks->serviceDidNotResolve(sender.name.UTF8String, _refCon);
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)netServiceDidResolveAddress:(NSNetService *)sender
+{
+    echo("NETSERVICE: %@ RESOLVED with %i addresses", sender, (int)sender.addresses.count);
+
+    // MIDINetworkSession won't take IPv6. Use the first IPv4 (https://developer.apple.com/library/mac/qa/qa1298/_index.html)
+    for (NSData *address in sender.addresses)
+    {
+        const struct sockaddr *socketAddress = (const struct sockaddr *)address.bytes;
+        if (address.length < sizeof(struct sockaddr_in) || socketAddress->sa_family != AF_INET) continue;
+
+        const struct sockaddr_in *inAddress = (const struct sockaddr_in *)socketAddress;
+        char buffer[INET_ADDRSTRLEN];
+        if (!inet_ntop(AF_INET, &inAddress->sin_addr, buffer, sizeof(buffer))) continue;
+
+        const uint16_t port = ntohs(inAddress->sin_port);
+        echo("NETSERVICE: %@ resolved to %s:%i", sender, buffer, (int)port);
+        if ([self _finishResolveOf:sender])
+        {
+            // Don't keep resolving now we have a legit IPv4 address
+            [sender stop];
+            _callbacks->serviceDidResolve(sender.name.UTF8String, buffer, port, _refCon);
+        }
+        return;
+    }
+    echo("NETSERVICE: %@ address did not resolve to IPv4. Hopefully there'll be another address...", sender);
+}
+
+@end
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Discovery Functions
+/////////////////////////////////////////////////////////////////////////
+
+static bool _MFBonjourStartBrowse(void *context, const MFMIDIDiscoveryCallbacks *callbacks, void *refCon)
+{
+    _MFBonjourDiscoveryDriver *driver = (__bridge _MFBonjourDiscoveryDriver *)context;
+    driver->_callbacks = callbacks;
+    driver->_refCon = refCon;
+    return [driver startBrowse];
+}
+
+static void _MFBonjourStopBrowse(void *context)
+{
+    [(__bridge _MFBonjourDiscoveryDriver *)context stopBrowse];
+}
+
+static bool _MFBonjourResolve(void *context, const char *name, const char *domain, double timeout)
+{
+    NSString *nameStr = @(name);
+    return nameStr && [(__bridge _MFBonjourDiscoveryDriver *)context resolveServiceWithName:nameStr timeout:timeout];
+}
+
+static void _MFBonjourCancelResolve(void *context, const char *name)
+{
+    NSString *nameStr = @(name);
+    if (nameStr) [(__bridge _MFBonjourDiscoveryDriver *)context cancelResolveForServiceWithName:nameStr];
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Public
+/////////////////////////////////////////////////////////////////////////
+
+const MFMIDIDiscovery *MFMIDIBonjourDiscovery(void)
+{
+    static MFMIDIDiscovery discovery = {
+        .name = "Bonjour",
+        .startBrowse = _MFBonjourStartBrowse,
+        .stopBrowse = _MFBonjourStopBrowse,
+        .resolve = _MFBonjourResolve,
+        .cancelResolve = _MFBonjourCancelResolve,
+    };
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        discovery.context = (__bridge_retained void *)[[_MFBonjourDiscoveryDriver alloc] init];
+    });
+    return &discovery;
+}
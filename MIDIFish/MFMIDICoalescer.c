@@ -0,0 +1,221 @@
+//
+//  MFMIDICoalescer.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDICoalescer.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+// Slot layout per channel: 128 CCs, 128 poly aftertouch keys, channel aftertouch, pitchbend
+#define _SLOTS_PER_CHANNEL      (128 + 128 + 1 + 1)
+#define _SLOT_COUNT             (16 * _SLOTS_PER_CHANNEL)
+#define _WORD_COUNT             ((_SLOT_COUNT + 63) / 64)
+
+struct MFMIDICoalescer {
+    _Atomic uint32_t slots[_SLOT_COUNT];        // status << 16 | data1 << 8 | data2
+    _Atomic uint64_t dirty[_WORD_COUNT];        // bit per slot
+    atomic_bool flushPending;
+    pthread_mutex_t flushLock;
+    uint32_t cursor;                            // slot to resume from after a budget-limited flush. Under flushLock
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+MFMIDICoalescerRef MFMIDICoalescerCreate(void)
+{
+    MFMIDICoalescerRef coalescer = calloc(1, sizeof(struct MFMIDICoalescer));
+    if (!coalescer) return NULL;
+    for (int i = 0; i < _SLOT_COUNT; i++) atomic_init(&coalescer->slots[i], 0);
+    for (int i = 0; i < _WORD_COUNT; i++) atomic_init(&coalescer->dirty[i], 0);
+    atomic_init(&coalescer->flushPending, false);
+    pthread_mutex_init(&coalescer->flushLock, NULL);
+    return coalescer;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDICoalescerDestroy(MFMIDICoalescerRef coalescer)
+{
+    if (!coalescer) return;
+    pthread_mutex_destroy(&coalescer->flushLock);
+    free(coalescer);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Adding
+/////////////////////////////////////////////////////////////////////////
+
+bool MFMIDICoalescerIsCoalescable(const MFMIDIMessageValue *message)
+{
+    if (message->length < 2 || message->length > 3) return false;
+
+    const uint8_t type = MFMIDIMessageValueGetType(message);
+    switch (type)
+    {
+        case 0xA0:      // poly aftertouch
+        case 0xD0:      // channel aftertouch
+        case 0xE0:      // pitchbend
+            return true;
+
+        case 0xB0:
+        {
+            // Data entry and (N)RPN selects are a transaction; the order and every value matter. Mode messages are commands
+            const uint8_t controller = MFMIDIMessageValueGetData1(message);
+            if (controller == 6 || controller == 38) return false;
+            if (controller >= 96 && controller <= 101) return false;
+            if (controller >= 120) return false;
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+//---------------------------------------------------------------------
+
+static inline uint32_t _SlotForMessage(const MFMIDIMessageValue *message)
+{
+    const uint32_t base = MFMIDIMessageValueGetChannel(message) * _SLOTS_PER_CHANNEL;
+    switch (MFMIDIMessageValueGetType(message)) {
+        case 0xB0:  return base + MFMIDIMessageValueGetData1(message);
+        case 0xA0:  return base + 128 + MFMIDIMessageValueGetData1(message);
+        case 0xD0:  return base + 256;
+        default:    return base + 257;  // 0xE0
+    }
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDICoalescerAdd(MFMIDICoalescerRef coalescer, const MFMIDIMessageValue *message)
+{
+    const uint32_t slot = _SlotForMessage(message);
+    const uint32_t packed = (uint32_t)MFMIDIMessageValueGetStatus(message) << 16
+                          | (uint32_t)MFMIDIMessageValueGetData1(message) << 8
+                          | (uint32_t)MFMIDIMessageValueGetData2(message);
+
+    // Value first, then mark it dirty (release) so a flusher that sees the bit sees the value
+    atomic_store_explicit(&coalescer->slots[slot], packed, memory_order_relaxed);
+    atomic_fetch_or_explicit(&coalescer->dirty[slot / 64], 1ull << (slot % 64), memory_order_release);
+
+    // A flush clears this *before* collecting, so if it's still set the pending flush will pick us up
+    return !atomic_exchange(&coalescer->flushPending, true);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Flushing
+/////////////////////////////////////////////////////////////////////////
+
+/** Takes the dirty slots in `mask` of word `w` into `out` until the budget runs out. @return false if it ran out (with *outStopSlot set) */
+static bool _CollectWord(MFMIDICoalescerRef coalescer, uint32_t w, uint64_t mask, uint32_t *out, uint32_t *count, size_t maxBytes, size_t *bytes, uint32_t *outStopSlot)
+{
+    uint64_t bits = atomic_load_explicit(&coalescer->dirty[w], memory_order_relaxed) & mask;
+    while (bits)
+    {
+        const uint32_t bit = (uint32_t)__builtin_ctzll(bits);
+        const uint32_t slot = w * 64 + bit;
+        bits &= bits - 1;
+
+        const uint32_t packed = atomic_load_explicit(&coalescer->slots[slot], memory_order_relaxed);
+        const uint8_t status = (uint8_t)(packed >> 16);
+        const uint32_t length = MFMIDIMessageLengthForStatus(status);
+        if (maxBytes && *bytes && *bytes + length > maxBytes) {     // always at least one so a tiny budget still progresses
+            *outStopSlot = slot;
+            return false;
+        }
+
+        // Claim it. If an Add races in after this it re-marks the slot and we'll send the newer value next time
+        const uint64_t old = atomic_fetch_and_explicit(&coalescer->dirty[w], ~(1ull << bit), memory_order_acquire);
+        if (!(old & (1ull << bit))) continue;
+
+        out[(*count)++] = atomic_load_explicit(&coalescer->slots[slot], memory_order_relaxed);
+        *bytes += length;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+/** Only the copying out of the slots is under the lock. The batch (and so its flush handler, which sends) gets them after it's released. @return -1 if `wait` is false and another flush holds the lock, else as MFMIDICoalescerFlush */
+static int _Flush(MFMIDICoalescerRef coalescer, MFMIDIBatch *batch, size_t maxBytes, bool wait)
+{
+    // Every slot at most once per flush
+    uint32_t collected[_SLOT_COUNT];
+    uint32_t count = 0;
+
+    if (wait) {
+        pthread_mutex_lock(&coalescer->flushLock);
+    } else if (pthread_mutex_trylock(&coalescer->flushLock) != 0) {
+        return -1;
+    }
+
+    // Clear first. See MFMIDICoalescerAdd
+    atomic_store(&coalescer->flushPending, false);
+
+    // Resume at the cursor: the top part of its word, the other words, then the bottom part of its word
+    const uint32_t startWord = coalescer->cursor / 64;
+    const uint64_t highMask = ~0ull << (coalescer->cursor % 64);
+    size_t bytes = 0;
+    uint32_t stopSlot = 0;
+    bool finished = _CollectWord(coalescer, startWord, highMask, collected, &count, maxBytes, &bytes, &stopSlot);
+    for (uint32_t n = 1; finished && n < _WORD_COUNT; n++) {
+        finished = _CollectWord(coalescer, (startWord + n) % _WORD_COUNT, ~0ull, collected, &count, maxBytes, &bytes, &stopSlot);
+    }
+    if (finished && highMask != ~0ull) {
+        finished = _CollectWord(coalescer, startWord, ~highMask, collected, &count, maxBytes, &bytes, &stopSlot);
+    }
+
+    coalescer->cursor = finished ? 0 : stopSlot;
+    if (!finished) atomic_store(&coalescer->flushPending, true);
+
+    pthread_mutex_unlock(&coalescer->flushLock);
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t packed = collected[i];
+        MFMIDIMessageValue msg = MFMIDIMessageValueMake((uint8_t)(packed >> 16), (uint8_t)(packed >> 8), (uint8_t)packed);
+        MFMIDIBatchAddValue(batch, &msg);
+    }
+    return !finished;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDICoalescerFlush(MFMIDICoalescerRef coalescer, MFMIDIBatch *batch, size_t maxBytes)
+{
+    return _Flush(coalescer, batch, maxBytes, true) > 0;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDICoalescerTryFlush(MFMIDICoalescerRef coalescer, MFMIDIBatch *batch)
+{
+    return _Flush(coalescer, batch, 0, false) >= 0;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDICoalescerHasPending(MFMIDICoalescerRef coalescer)
+{
+    return atomic_load(&coalescer->flushPending);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDICoalescerRemoveAll(MFMIDICoalescerRef coalescer)
+{
+    for (uint32_t w = 0; w < _WORD_COUNT; w++) {
+        atomic_store_explicit(&coalescer->dirty[w], 0, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,66 @@
+//
+//  MFMIDICoalescer.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDICoalescer_h
+#define MIDIFish_MFMIDICoalescer_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "MFMIDIMessageValue.h"
+#include "MFMIDIBatch.h"
+
+/**
+ Last-value-wins holding area for continuous controllers so a touch-rate stream of CCs, pitchbend or aftertouch goes out at a sensible rate instead of flooding a slow destination.
+
+ There's one slot per (channel, type, controller/key). Adding overwrites the slot; flushing sends each dirty slot's latest value once. Notes, program changes, sysex, system messages and the CCs that only make sense as part of a sequence (data entry, (N)RPN select, channel mode) are never coalesced - see `MFMIDICoalescerIsCoalescable`.
+
+ Adding is lock-free and allocation-free so it's safe from any thread, including concurrently with a flush. Flushes are serialised with a mutex, held only while the pending values are copied out (onto the stack, ~16KB), so don't flush from a realtime thread. Within a flush, messages come out grouped by channel and slot rather than in the order they were added, which is fine for independent controllers but is why anything order-sensitive passes through instead. `MFMIDISession` drives these from its coalescing policies.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MFMIDICoalescer *MFMIDICoalescerRef;
+
+/** NULL on allocation failure */
+extern MFMIDICoalescerRef MFMIDICoalescerCreate(void);
+extern void MFMIDICoalescerDestroy(MFMIDICoalescerRef coalescer);
+
+/** YES for CC (except 6, 38, 96-101 and 120-127), pitchbend, channel and poly aftertouch */
+extern bool MFMIDICoalescerIsCoalescable(const MFMIDIMessageValue *message);
+
+/**
+ Store the message in its slot, replacing any pending value. The message must be coalescable.
+ @return true if no flush was pending, in which case the caller should arrange one
+ */
+extern bool MFMIDICoalescerAdd(MFMIDICoalescerRef coalescer, const MFMIDIMessageValue *message);
+
+/**
+ Move pending messages into `batch`, up to `maxBytes` (0 = no limit). Picks up where the last budget-limited flush left off so no controller starves. The batch gets them (and may flush) after the coalescer's lock is released.
+ @return true if some were left pending because of the budget, in which case the caller should arrange another flush
+ */
+extern bool MFMIDICoalescerFlush(MFMIDICoalescerRef coalescer, MFMIDIBatch *batch, size_t maxBytes);
+
+/**
+ As MFMIDICoalescerFlush with no budget, unless another flush is underway, in which case it does nothing rather than wait. That one has taken, or is about to take, what's pending. For senders which only need what's pending out ahead of them and shouldn't block on a timed flush.
+ @return false if it didn't flush
+ */
+extern bool MFMIDICoalescerTryFlush(MFMIDICoalescerRef coalescer, MFMIDIBatch *batch);
+
+/** Cheap hint: true if anything has been added since the last flush began (or one left some behind) */
+extern bool MFMIDICoalescerHasPending(MFMIDICoalescerRef coalescer);
+
+/** Drop everything pending */
+extern void MFMIDICoalescerRemoveAll(MFMIDICoalescerRef coalescer);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
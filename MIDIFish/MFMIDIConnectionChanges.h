@@ -0,0 +1,29 @@
+//
+//  MFMIDIConnectionChanges.h
+//  MIDIFish
+//
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ The connections added and removed over a coalescing interval, as delivered to `MIDISession:connectionsDidChange:`. A connection added and removed again within the interval (or the reverse) appears in neither. Each array is in the order the changes happened.
+ */
+@interface MFMIDIConnectionChanges : NSObject
+
+/** [id<MFMIDISource>] @{ */
+@property (nonatomic, readonly) NSArray *addedSources;
+@property (nonatomic, readonly) NSArray *removedSources;
+/** @} */
+
+/** [id<MFMIDIDestination>] @{ */
+@property (nonatomic, readonly) NSArray *addedDestinations;
+@property (nonatomic, readonly) NSArray *removedDestinations;
+/** @} */
+
+- (instancetype)initWithAddedSources:(NSArray *)addedSources removedSources:(NSArray *)removedSources addedDestinations:(NSArray *)addedDestinations removedDestinations:(NSArray *)removedDestinations;
+
+/** YES if all four are empty */
+@property (nonatomic, readonly) BOOL isEmpty;
+
+@end
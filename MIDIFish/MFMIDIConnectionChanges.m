@@ -0,0 +1,37 @@
+//
+//  MFMIDIConnectionChanges.m
+//  MIDIFish
+//
+//
+
+#import "MFMIDIConnectionChanges.h"
+
+@implementation MFMIDIConnectionChanges
+
+- (instancetype)initWithAddedSources:(NSArray *)addedSources removedSources:(NSArray *)removedSources addedDestinations:(NSArray *)addedDestinations removedDestinations:(NSArray *)removedDestinations
+{
+    self = [super init];
+    if (self) {
+        _addedSources = [addedSources copy] ?: @[];
+        _removedSources = [removedSources copy] ?: @[];
+        _addedDestinations = [addedDestinations copy] ?: @[];
+        _removedDestinations = [removedDestinations copy] ?: @[];
+    }
+    return self;
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)isEmpty
+{
+    return !_addedSources.count && !_removedSources.count && !_addedDestinations.count && !_removedDestinations.count;
+}
+
+//---------------------------------------------------------------------
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@: +src %@, -src %@, +dest %@, -dest %@>", NSStringFromClass(self.class), _addedSources, _removedSources, _addedDestinations, _removedDestinations];
+}
+
+@end
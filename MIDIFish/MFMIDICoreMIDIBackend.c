@@ -0,0 +1,283 @@
+//
+//  MFMIDICoreMIDIBackend.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIBackend.h"
+
+#if defined(__APPLE__)
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Privates
+/////////////////////////////////////////////////////////////////////////
+
+/** Lives as long as the client. Listed so clientDispose can find it again as CoreMIDI won't give the refCon back */
+typedef struct _MFCoreMIDINotifyTrampoline {
+    MFMIDIBackendNotifyProc notifyProc;
+    void *refCon;
+    MIDIClientRef client;
+    struct _MFCoreMIDINotifyTrampoline *next;
+} _MFCoreMIDINotifyTrampoline;
+
+static _MFCoreMIDINotifyTrampoline *_trampolines;
+static pthread_mutex_t _trampolinesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _MFCoreMIDINotifyProc(const MIDINotification *message, void *refCon)
+{
+    const _MFCoreMIDINotifyTrampoline *trampoline = refCon;
+    
+    if (message->messageID == kMIDIMsgPropertyChanged)
+    {
+        const MIDIObjectPropertyChangeNotification *notif = (const MIDIObjectPropertyChangeNotification *)message;
+        if (notif->objectType == kMIDIObjectType_Source || notif->objectType == kMIDIObjectType_Destination) {
+            const MFMIDIBackendEndpointType type = notif->objectType == kMIDIObjectType_Source ? kMFMIDIBackendEndpointTypeSource : kMFMIDIBackendEndpointTypeDestination;
+            trampoline->notifyProc(kMFMIDIBackendEndpointPropertyChanged, type, (MIDIEndpointRef)notif->object, trampoline->refCon);
+        } else if (notif->objectType == kMIDIObjectType_Device || notif->objectType == kMIDIObjectType_Entity) {
+            // Endpoint display names are built from their device's and entity's
+            trampoline->notifyProc(kMFMIDIBackendEndpointPropertyChanged, kMFMIDIBackendEndpointTypeSource, 0, trampoline->refCon);
+        }
+        return;
+    }
+    
+    if (message->messageID != kMIDIMsgObjectAdded && message->messageID != kMIDIMsgObjectRemoved) return;
+
+    const MIDIObjectAddRemoveNotification *notif = (const MIDIObjectAddRemoveNotification *)message;
+    MFMIDIBackendEndpointType type;
+    if (notif->childType == kMIDIObjectType_Source) type = kMFMIDIBackendEndpointTypeSource;
+    else if (notif->childType == kMIDIObjectType_Destination) type = kMFMIDIBackendEndpointTypeDestination;
+    else return;
+
+    trampoline->notifyProc(message->messageID == kMIDIMsgObjectAdded ? kMFMIDIBackendEndpointAdded : kMFMIDIBackendEndpointRemoved,
+                           type,
+                           (MIDIEndpointRef)notif->child,
+                           trampoline->refCon);
+}
+
+//---------------------------------------------------------------------
+
+static CFStringRef _MFCreateCFString(const char *str)
+{
+    return CFStringCreateWithCString(kCFAllocatorDefault, str ?: "", kCFStringEncodingUTF8);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Backend Functions
+/////////////////////////////////////////////////////////////////////////
+
+static OSStatus _MFCoreMIDIClientCreate(void *context, const char *name, MFMIDIBackendNotifyProc notifyProc, void *notifyRefCon, MIDIClientRef *outClient)
+{
+    _MFCoreMIDINotifyTrampoline *trampoline = malloc(sizeof(_MFCoreMIDINotifyTrampoline));
+    if (!trampoline) return kMIDINotPermitted;
+    trampoline->notifyProc = notifyProc;
+    trampoline->refCon = notifyRefCon;
+
+    CFStringRef cfName = _MFCreateCFString(name);
+    OSStatus s = MIDIClientCreate(cfName, _MFCoreMIDINotifyProc, trampoline, outClient);
+    CFRelease(cfName);
+    if (s != noErr) {
+        free(trampoline);
+        return s;
+    }
+
+    trampoline->client = *outClient;
+    pthread_mutex_lock(&_trampolinesLock);
+    trampoline->next = _trampolines;
+    _trampolines = trampoline;
+    pthread_mutex_unlock(&_trampolinesLock);
+    return noErr;
+}
+
+static OSStatus _MFCoreMIDIInputPortCreate(void *context, MIDIClientRef client, const char *name, MIDIReadProc readProc, void *refCon, MIDIPortRef *outPort)
+{
+    CFStringRef cfName = _MFCreateCFString(name);
+    OSStatus s = MIDIInputPortCreate(client, cfName, readProc, refCon, outPort);
+    CFRelease(cfName);
+    return s;
+}
+
+static OSStatus _MFCoreMIDIOutputPortCreate(void *context, MIDIClientRef client, const char *name, MIDIPortRef *outPort)
+{
+    CFStringRef cfName = _MFCreateCFString(name);
+    OSStatus s = MIDIOutputPortCreate(client, cfName, outPort);
+    CFRelease(cfName);
+    return s;
+}
+
+static OSStatus _MFCoreMIDISourceCreate(void *context, MIDIClientRef client, const char *name, MIDIEndpointRef *outSource)
+{
+    CFStringRef cfName = _MFCreateCFString(name);
+    OSStatus s = MIDISourceCreate(client, cfName, outSource);
+    CFRelease(cfName);
+    return s;
+}
+
+static OSStatus _MFCoreMIDIDestinationCreate(void *context, MIDIClientRef client, const char *name, MIDIReadProc readProc, void *refCon, MIDIEndpointRef *outDestination)
+{
+    CFStringRef cfName = _MFCreateCFString(name);
+    OSStatus s = MIDIDestinationCreate(client, cfName, readProc, refCon, outDestination);
+    CFRelease(cfName);
+    return s;
+}
+
+//---------------------------------------------------------------------
+
+static OSStatus _MFCoreMIDIPortDispose(void *context, MIDIPortRef port)
+{
+    return MIDIPortDispose(port);
+}
+
+static OSStatus _MFCoreMIDIEndpointDispose(void *context, MIDIEndpointRef endpoint)
+{
+    return MIDIEndpointDispose(endpoint);
+}
+
+static OSStatus _MFCoreMIDIClientDispose(void *context, MIDIClientRef client)
+{
+    OSStatus s = MIDIClientDispose(client);
+    if (s != noErr) return s;
+
+    // No more notifications so its trampoline can go
+    pthread_mutex_lock(&_trampolinesLock);
+    for (_MFCoreMIDINotifyTrampoline **link = &_trampolines; *link; link = &(*link)->next)
+    {
+        if ((*link)->client == client) {
+            _MFCoreMIDINotifyTrampoline *trampoline = *link;
+            *link = trampoline->next;
+            free(trampoline);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_trampolinesLock);
+    return noErr;
+}
+
+//---------------------------------------------------------------------
+
+static ItemCount _MFCoreMIDINumberOfSources(void *context) { return MIDIGetNumberOfSources(); }
+static MIDIEndpointRef _MFCoreMIDIGetSource(void *context, ItemCount index) { return MIDIGetSource(index); }
+static ItemCount _MFCoreMIDINumberOfDestinations(void *context) { return MIDIGetNumberOfDestinations(); }
+static MIDIEndpointRef _MFCoreMIDIGetDestination(void *context, ItemCount index) { return MIDIGetDestination(index); }
+
+static OSStatus _MFCoreMIDIPortConnectSource(void *context, MIDIPortRef port, MIDIEndpointRef source, void *connRefCon)
+{
+    return MIDIPortConnectSource(port, source, connRefCon);
+}
+
+static OSStatus _MFCoreMIDIPortDisconnectSource(void *context, MIDIPortRef port, MIDIEndpointRef source)
+{
+    return MIDIPortDisconnectSource(port, source);
+}
+
+static OSStatus _MFCoreMIDISend(void *context, MIDIPortRef port, MIDIEndpointRef destination, const MIDIPacketList *packetList)
+{
+    return MIDISend(port, destination, packetList);
+}
+
+static OSStatus _MFCoreMIDIReceived(void *context, MIDIEndpointRef source, const MIDIPacketList *packetList)
+{
+    return MIDIReceived(source, packetList);
+}
+
+//---------------------------------------------------------------------
+
+/** CoreMIDI takes a block for event lists. This makes one calling the proc, so callers stay plain C */
+MF_UMP_AVAILABLE
+static OSStatus _MFCoreMIDIInputPortCreateWithProtocol(void *context, MIDIClientRef client, const char *name, MIDIProtocolID protocol, MFMIDIBackendEventReadProc readProc, void *refCon, MIDIPortRef *outPort)
+{
+    CFStringRef cfName = _MFCreateCFString(name);
+    OSStatus s = MIDIInputPortCreateWithProtocol(client, cfName, protocol, outPort, ^(const MIDIEventList *eventList, void *srcConnRefCon) {
+        readProc(eventList, refCon, srcConnRefCon);
+    });
+    CFRelease(cfName);
+    return s;
+}
+
+MF_UMP_AVAILABLE
+static OSStatus _MFCoreMIDISendEventList(void *context, MIDIPortRef port, MIDIEndpointRef destination, const MIDIEventList *eventList)
+{
+    return MIDISendEventList(port, destination, eventList);
+}
+
+MF_UMP_AVAILABLE
+static OSStatus _MFCoreMIDIReceivedEventList(void *context, MIDIEndpointRef source, const MIDIEventList *eventList)
+{
+    return MIDIReceivedEventList(source, eventList);
+}
+
+//---------------------------------------------------------------------
+
+static bool _MFCoreMIDIGetDisplayName(void *context, MIDIObjectRef object, char *buffer, size_t bufferSize)
+{
+    CFStringRef string = NULL;
+    if (MIDIObjectGetStringProperty(object, kMIDIPropertyDisplayName, &string) != noErr || !string) return false;
+    Boolean ok = CFStringGetCString(string, buffer, (CFIndex)bufferSize, kCFStringEncodingUTF8);
+    CFRelease(string);
+    return ok;
+}
+
+//---------------------------------------------------------------------
+
+static bool _MFCoreMIDIIsNetworkSessionEndpoint(void *context, MIDIEndpointRef endpoint)
+{
+    MIDIEntityRef entity = 0;
+    MIDIEndpointGetEntity(endpoint, &entity);
+
+    // Ask for the one key rather than copying the entity's whole property tree
+    CFDictionaryRef session = NULL;
+    if (MIDIObjectGetDictionaryProperty(entity, CFSTR("apple.midirtp.session"), &session) != noErr || !session) return false;
+    CFRelease(session);
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Public
+/////////////////////////////////////////////////////////////////////////
+
+static const MFMIDIBackend _kCoreMIDIBackend = {
+    .name = "CoreMIDI",
+    .context = NULL,
+    .clientCreate = _MFCoreMIDIClientCreate,
+    .inputPortCreate = _MFCoreMIDIInputPortCreate,
+    .outputPortCreate = _MFCoreMIDIOutputPortCreate,
+    .sourceCreate = _MFCoreMIDISourceCreate,
+    .destinationCreate = _MFCoreMIDIDestinationCreate,
+    .portDispose = _MFCoreMIDIPortDispose,
+    .endpointDispose = _MFCoreMIDIEndpointDispose,
+    .clientDispose = _MFCoreMIDIClientDispose,
+    .numberOfSources = _MFCoreMIDINumberOfSources,
+    .getSource = _MFCoreMIDIGetSource,
+    .numberOfDestinations = _MFCoreMIDINumberOfDestinations,
+    .getDestination = _MFCoreMIDIGetDestination,
+    .portConnectSource = _MFCoreMIDIPortConnectSource,
+    .portDisconnectSource = _MFCoreMIDIPortDisconnectSource,
+    .send = _MFCoreMIDISend,
+    .received = _MFCoreMIDIReceived,
+    .getDisplayName = _MFCoreMIDIGetDisplayName,
+    .isNetworkSessionEndpoint = _MFCoreMIDIIsNetworkSessionEndpoint,
+};
+
+const MFMIDIBackend *MFMIDICoreMIDIBackend(void)
+{
+    // The event list functions only where the OS has them, so the session knows to translate otherwise
+    static MFMIDIBackend backend;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        backend = _kCoreMIDIBackend;
+        if (__builtin_available(macOS 11.0, iOS 14.0, *)) {
+            backend.inputPortCreateWithProtocol = _MFCoreMIDIInputPortCreateWithProtocol;
+            backend.sendEventList = _MFCoreMIDISendEventList;
+            backend.receivedEventList = _MFCoreMIDIReceivedEventList;
+        }
+    });
+    return &backend;
+}
+
+#endif
@@ -0,0 +1,64 @@
+//
+//  MFMIDIDiscovery.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIDiscovery_h
+#define MIDIFish_MFMIDIDiscovery_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ How MFMIDISession finds network MIDI (RTP-MIDI, "Apple MIDI") hosts: browse for services, then resolve each found one into an IPv4 address and port.
+
+ `MFMIDIBonjourDiscovery()` is the default, on NSNetServiceBrowser/NSNetService. Supply your own to find hosts some other way or, being plain C, to drive the session's refresh logic with a fake browser off Apple platforms.
+
+ The session starts a browse at each refresh and stops it when a service is reported with `moreComing` false. It resolves every service found, several at once, and stops waiting for any that take too long (see `cancelResolve`).
+
+ All functions take the discovery's `context` as their first argument. Call the callbacks on the thread the calls were made on (the session's, ie. main), though calling back from inside a call is fine.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MFMIDIDiscoveryCallbacks {
+    /** A service was found. `moreComing` as for NSNetServiceBrowser: false when that's all for now */
+    void (*serviceFound)(const char *name, const char *domain, bool moreComing, void *refCon);
+
+    /** The browse stopped, whether asked to or not */
+    void (*browseDidStop)(void *refCon);
+
+    /** A resolve finished with a usable address, eg. "192.168.0.4". At most one of these and `serviceDidNotResolve` per resolve */
+    void (*serviceDidResolve)(const char *name, const char *address, uint16_t port, void *refCon);
+    void (*serviceDidNotResolve)(const char *name, void *refCon);
+} MFMIDIDiscoveryCallbacks;
+
+typedef struct MFMIDIDiscovery {
+    const char *name;
+    void *context;
+
+    /** @return false if it couldn't start, in which case `browseDidStop` isn't called. The callbacks struct must outlive the browse and its resolves */
+    bool (*startBrowse)(void *context, const MFMIDIDiscoveryCallbacks *callbacks, void *refCon);
+    void (*stopBrowse)(void *context);
+
+    /** Resolve a found service, giving up after `timeout` seconds. @return false if it couldn't start (no callback is made) */
+    bool (*resolve)(void *context, const char *name, const char *domain, double timeout);
+
+    /** Stop resolving. No callback is made for it */
+    void (*cancelResolve)(void *context, const char *name);
+} MFMIDIDiscovery;
+
+
+#if defined(__APPLE__)
+/** Shared instance, so one session at a time. Browses for MIDINetworkBonjourServiceType in the default domains on the main run loop. IPv6 addresses are skipped as MIDINetworkSession won't take them */
+extern const MFMIDIDiscovery *MFMIDIBonjourDiscovery(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
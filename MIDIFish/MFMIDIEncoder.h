@@ -0,0 +1,183 @@
+//
+//  MFMIDIEncoder.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIEncoder_h
+#define MIDIFish_MFMIDIEncoder_h
+
+/**
+ Compile-time message encoders for C++ and ObjC++.
+
+ Each builder is `constexpr` and returns exactly the message's bytes in a fixed size `MFMIDI::Encoded<N>`, so with constant arguments the message is itself a constant and sending it is a matter of storing a few bytes. No objects, no length lookups, no allocation.
+
+ Channels are 0-15, data 0-127 and 14bit values 0-16383. Wherever a message is evaluated at compile time, eg. assigned to a `constexpr` variable or checked in a `static_assert`, an out of range argument is a compile error. At run time it asserts in debug builds and is masked in release, like the C constructors in MFMIDIMessageValue.h.
+
+ ````
+ constexpr auto kAccent = MFMIDI::NoteOn(9, 38, 127);      // MFMIDI::NoteOn(16, ...) won't compile
+ MFMIDI::Send(session, kAccent);
+ MFMIDI::Enqueue(renderQueue, frame, MFMIDI::ControlChange(0, 74, cutoff));
+ ````
+
+ Header only, and empty unless compiled as C++.
+ */
+
+#ifdef __cplusplus
+
+#include "MFMIDIMessageValue.h"
+#include "MFMIDIBatch.h"
+#include "MFMIDIRenderQueue.h"
+#include <stdint.h>
+#include <assert.h>
+
+#ifdef __OBJC__
+#import "MFMIDISession.h"
+#endif
+
+namespace MFMIDI {
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** A complete message of N bytes */
+template <uint32_t N>
+struct Encoded
+{
+    uint8_t bytes[N];
+
+    static constexpr uint32_t length() { return N; }
+
+    constexpr uint8_t status() const { return bytes[0]; }
+
+    /** For the session's and batches' value-type API. Inline, so valid beyond the `Encoded` */
+    constexpr MFMIDIMessageValue value() const
+    {
+        return MFMIDIMessageValue{ N, { bytes[0], _byteAt(1), _byteAt(2) }, nullptr };
+    }
+
+    constexpr operator MFMIDIMessageValue() const { return value(); }
+
+    constexpr uint8_t _byteAt(uint32_t index) const { return index < N ? bytes[index] : 0; }
+};
+
+static_assert(sizeof(Encoded<3>) == 3, "Encoded messages are just their bytes");
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Range Checking
+/////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+/** Deliberately not constexpr. Reaching it during constant evaluation fails the compile at the offending argument */
+inline void OutOfRange(const char *what)
+{
+    (void)what;
+    assert(!"MIDI value out of range");
+}
+
+constexpr uint8_t Checked(unsigned value, unsigned max, const char *what)
+{
+    return value <= max ? (uint8_t)value : (OutOfRange(what), (uint8_t)(value & max));
+}
+
+constexpr uint8_t Channel(unsigned channel) { return Checked(channel, 0x0F, "channel"); }
+constexpr uint8_t Data(unsigned data) { return Checked(data, 0x7F, "data byte"); }
+
+constexpr uint16_t Checked14(unsigned value)
+{
+    return value <= 0x3FFF ? (uint16_t)value : (OutOfRange("14bit value"), (uint16_t)(value & 0x3FFF));
+}
+
+constexpr Encoded<3> Voice3(uint8_t type, unsigned channel, unsigned data1, unsigned data2)
+{
+    return Encoded<3>{ { (uint8_t)(type | Channel(channel)), Data(data1), Data(data2) } };
+}
+
+constexpr Encoded<2> Voice2(uint8_t type, unsigned channel, unsigned data1)
+{
+    return Encoded<2>{ { (uint8_t)(type | Channel(channel)), Data(data1) } };
+}
+
+} // namespace detail
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Channel Voice
+/////////////////////////////////////////////////////////////////////////
+
+constexpr Encoded<3> NoteOn(unsigned channel, unsigned key, unsigned velocity) { return detail::Voice3(0x90, channel, key, velocity); }
+
+constexpr Encoded<3> NoteOff(unsigned channel, unsigned key, unsigned velocity = 0) { return detail::Voice3(0x80, channel, key, velocity); }
+
+constexpr Encoded<3> PolyphonicAftertouch(unsigned channel, unsigned key, unsigned pressure) { return detail::Voice3(0xA0, channel, key, pressure); }
+
+constexpr Encoded<3> ControlChange(unsigned channel, unsigned controller, unsigned value) { return detail::Voice3(0xB0, channel, controller, value); }
+
+constexpr Encoded<2> ProgramChange(unsigned channel, unsigned programNumber) { return detail::Voice2(0xC0, channel, programNumber); }
+
+constexpr Encoded<2> ChannelAftertouch(unsigned channel, unsigned pressure) { return detail::Voice2(0xD0, channel, pressure); }
+
+/** 0-16383, 8192 = center */
+constexpr Encoded<3> Pitchbend(unsigned channel, unsigned value)
+{
+    return detail::Voice3(0xE0, channel, detail::Checked14(value) & 0x7F, detail::Checked14(value) >> 7);
+}
+
+/** CC 123. The spec fixes the value at 0. The session sends the same */
+constexpr Encoded<3> AllNotesOff(unsigned channel) { return ControlChange(channel, 123, 0); }
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - System
+/////////////////////////////////////////////////////////////////////////
+
+/** In MIDI beats (16ths) since the start of the song, 0-16383 */
+constexpr Encoded<3> SongPosition(unsigned beats)
+{
+    return Encoded<3>{ { 0xF2, (uint8_t)(detail::Checked14(beats) & 0x7F), (uint8_t)(detail::Checked14(beats) >> 7) } };
+}
+
+constexpr Encoded<2> SongSelect(unsigned song) { return Encoded<2>{ { 0xF3, detail::Data(song) } }; }
+
+constexpr Encoded<1> TimingClock() { return Encoded<1>{ { 0xF8 } }; }
+constexpr Encoded<1> Start() { return Encoded<1>{ { 0xFA } }; }
+constexpr Encoded<1> Continue() { return Encoded<1>{ { 0xFB } }; }
+constexpr Encoded<1> Stop() { return Encoded<1>{ { 0xFC } }; }
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Sending
+/////////////////////////////////////////////////////////////////////////
+
+/** MFMIDIBatchAddBytes() for an encoded message */
+template <uint32_t N>
+inline bool Add(MFMIDIBatch *batch, const Encoded<N> &message, MIDITimeStamp timestamp = 0)
+{
+    return MFMIDIBatchAddBytes(batch, timestamp, message.bytes, N);
+}
+
+/** MFMIDIRenderQueueEnqueue() for an encoded message. Wait-free */
+template <uint32_t N>
+inline bool Enqueue(MFMIDIRenderQueueRef queue, uint32_t sampleOffset, const Encoded<N> &message)
+{
+    return MFMIDIRenderQueueEnqueue(queue, sampleOffset, message.bytes, N);
+}
+
+#ifdef __OBJC__
+/** MFMIDISessionSendMessageValue(). @throws MFNonFatalException on send error */
+template <uint32_t N>
+inline void Send(MFMIDISession *session, const Encoded<N> &message)
+{
+    const MFMIDIMessageValue value = message.value();
+    MFMIDISessionSendMessageValue(session, &value);
+}
+#endif
+
+} // namespace MFMIDI
+
+#endif // __cplusplus
+
+#endif
@@ -0,0 +1,316 @@
+//
+//  MFMIDIFilePlayer.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIFilePlayer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+#define _DEFAULT_TEMPO 500000
+
+typedef struct _MFTrackCursor {
+    const uint8_t *start;               // the chunk's data
+    const uint8_t *end;
+    const uint8_t *pos;                 // the next event, after its delta
+    uint64_t tick;                      // of the next event
+    uint8_t runningStatus;
+    bool isEnded;
+} _MFTrackCursor;
+
+struct MFMIDIFilePlayer {
+    int fd;
+    const uint8_t *map;
+    size_t size;
+
+    uint16_t format;
+    uint16_t division;
+    uint16_t trackCount;
+    _MFTrackCursor *tracks;
+
+    // The tempo map so far. Times are from the last change
+    uint32_t tempo;                     // microseconds per quarter note
+    uint64_t tempoTick;
+    uint64_t tempoTime;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Parsing
+/////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t _MFReadBE(const uint8_t *p, unsigned byteCount)
+{
+    uint32_t value = 0;
+    for (unsigned i = 0; i < byteCount; i++) value = (value << 8) | p[i];
+    return value;
+}
+
+//---------------------------------------------------------------------
+
+/** Reads a variable length quantity, at most 4 bytes. false if it runs past the end */
+static inline bool _MFReadVLQ(const uint8_t **pos, const uint8_t *end, uint32_t *outValue)
+{
+    uint32_t value = 0;
+    for (unsigned i = 0; i < 4 && *pos < end; i++)
+    {
+        const uint8_t byte = *(*pos)++;
+        value = (value << 7) | (byte & 0x7F);
+        if (!(byte & 0x80)) {
+            *outValue = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+//---------------------------------------------------------------------
+
+/** Reads the delta to the cursor's next event. Ends the track if there isn't one */
+static void _MFTrackAdvance(_MFTrackCursor *track)
+{
+    uint32_t delta;
+    if (track->pos >= track->end || !_MFReadVLQ(&track->pos, track->end, &delta) || track->pos >= track->end) {
+        track->isEnded = true;
+        return;
+    }
+    track->tick += delta;
+}
+
+//---------------------------------------------------------------------
+
+static uint64_t _MFTimeForTick(MFMIDIFilePlayerRef player, uint64_t tick)
+{
+    // SMPTE: the top byte is minus the frame rate (29 meaning 29.97 drop frame), the bottom ticks per frame
+    if (player->division & 0x8000)
+    {
+        const int8_t fps = (int8_t)(player->division >> 8);
+        const double framesPerSecond = fps == -29 ? 29.97 : -fps;
+        const double ticksPerSecond = framesPerSecond * (player->division & 0xFF);
+        return ticksPerSecond > 0 ? (uint64_t)(tick * (1e9 / ticksPerSecond)) : 0;
+    }
+
+    const uint64_t ticks = tick - player->tempoTick;
+    const uint16_t division = player->division ? player->division : 1;
+    return player->tempoTime + ticks * player->tempo * 1000 / division;
+}
+
+//---------------------------------------------------------------------
+
+/**
+ Decodes the track's next event into `outEvent`, moving past it
+ @return true if it's one to call back for, false for a meta event or if the track ended (check `isEnded`)
+ */
+static bool _MFTrackReadEvent(MFMIDIFilePlayerRef player, _MFTrackCursor *track, MFMIDIFileEvent *outEvent)
+{
+    const uint8_t *end = track->end;
+    uint8_t status = *track->pos;
+    uint32_t length;
+
+    switch (status)
+    {
+        case 0xFF: {
+            // Meta. Only tempo and the end of the track matter here
+            track->pos++;
+            if (track->pos >= end) break;
+            const uint8_t type = *track->pos++;
+            if (!_MFReadVLQ(&track->pos, end, &length) || length > (size_t)(end - track->pos)) break;
+            const uint8_t *data = track->pos;
+            track->pos += length;
+            if (type == 0x2F) break;
+            if (type == 0x51 && length == 3) {
+                player->tempoTime = _MFTimeForTick(player, track->tick);
+                player->tempoTick = track->tick;
+                player->tempo = _MFReadBE(data, 3);
+            }
+            _MFTrackAdvance(track);
+            return false;
+        }
+
+        case 0xF0:
+        case 0xF7: {
+            track->pos++;
+            track->runningStatus = 0;
+            if (!_MFReadVLQ(&track->pos, end, &length) || length > (size_t)(end - track->pos)) break;
+            outEvent->kind = status == 0xF0 ? kMFMIDIFileEventSysex : kMFMIDIFileEventEscape;
+            outEvent->message = MFMIDIMessageValueMakeWithBytes(track->pos, length);
+            track->pos += length;
+            _MFTrackAdvance(track);
+            return true;
+        }
+
+        default: {
+            // A message, maybe with running status
+            if (status & 0x80) {
+                track->pos++;
+                if (status < 0xF0) track->runningStatus = status;
+            } else if (track->runningStatus) {
+                status = track->runningStatus;
+            } else {
+                break;
+            }
+
+            const uint32_t messageLength = MFMIDIMessageLengthForStatus(status);
+            const uint32_t dataLength = messageLength ? messageLength - 1 : 0;
+            if (dataLength > (size_t)(end - track->pos)) break;
+            for (uint32_t i = 0; i < dataLength; i++) {
+                if (track->pos[i] & 0x80) goto ended;
+            }
+            outEvent->kind = kMFMIDIFileEventMessage;
+            outEvent->message = MFMIDIMessageValueMake(status, dataLength > 0 ? track->pos[0] : 0, dataLength > 1 ? track->pos[1] : 0);
+            track->pos += dataLength;
+            _MFTrackAdvance(track);
+            return true;
+        }
+    }
+
+ended:
+    track->isEnded = true;
+    return false;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+/////////////////////////////////////////////////////////////////////////
+
+MFMIDIFilePlayerRef MFMIDIFilePlayerOpen(const char *path)
+{
+    MFMIDIFilePlayerRef player = calloc(1, sizeof(struct MFMIDIFilePlayer));
+    if (!player) return NULL;
+    player->fd = open(path, O_RDONLY);
+    if (player->fd < 0) goto fail;
+
+    struct stat st;
+    if (fstat(player->fd, &st) != 0 || st.st_size < 14) goto fail;
+    player->size = (size_t)st.st_size;
+    void *map = mmap(NULL, player->size, PROT_READ, MAP_PRIVATE, player->fd, 0);
+    if (map == MAP_FAILED) goto fail;
+    player->map = map;
+
+    // MThd, which may be longer than the 6 bytes we know
+    const uint8_t *p = player->map, *end = player->map + player->size;
+    const uint32_t headerLength = _MFReadBE(p + 4, 4);
+    if (memcmp(p, "MThd", 4) != 0 || headerLength < 6 || headerLength > player->size - 8) goto fail;
+    player->format = (uint16_t)_MFReadBE(p + 8, 2);
+    const uint16_t declaredTrackCount = (uint16_t)_MFReadBE(p + 10, 2);
+    player->division = (uint16_t)_MFReadBE(p + 12, 2);
+    if (player->format > 1) goto fail;     // format 2's tracks are separate sequences, not one to merge
+    p += 8 + headerLength;
+
+    player->tracks = calloc(declaredTrackCount ? declaredTrackCount : 1, sizeof(_MFTrackCursor));
+    if (!player->tracks) goto fail;
+
+    // MTrks in order, skipping chunks we don't know. The last may be cut short
+    while (player->trackCount < declaredTrackCount && end - p >= 8)
+    {
+        const uint32_t chunkLength = _MFReadBE(p + 4, 4);
+        const uint8_t *data = p + 8;
+        const uint8_t *chunkEnd = chunkLength > (size_t)(end - data) ? end : data + chunkLength;
+        if (memcmp(p, "MTrk", 4) == 0) {
+            _MFTrackCursor *track = &player->tracks[player->trackCount++];
+            track->start = data;
+            track->end = chunkEnd;
+        }
+        p = chunkEnd;
+    }
+
+    MFMIDIFilePlayerRewind(player);
+    return player;
+
+fail:
+    MFMIDIFilePlayerClose(player);
+    return NULL;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIFilePlayerClose(MFMIDIFilePlayerRef player)
+{
+    if (!player) return;
+    if (player->map) munmap((void *)player->map, player->size);
+    if (player->fd >= 0) close(player->fd);
+    free(player->tracks);
+    free(player);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIFilePlayerRewind(MFMIDIFilePlayerRef player)
+{
+    player->tempo = _DEFAULT_TEMPO;
+    player->tempoTick = 0;
+    player->tempoTime = 0;
+    for (uint16_t t = 0; t < player->trackCount; t++)
+    {
+        _MFTrackCursor *track = &player->tracks[t];
+        track->pos = track->start;
+        track->tick = 0;
+        track->runningStatus = 0;
+        track->isEnded = false;
+        _MFTrackAdvance(track);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Playing
+/////////////////////////////////////////////////////////////////////////
+
+uint64_t MFMIDIFilePlayerRender(MFMIDIFilePlayerRef player, uint64_t untilTime, MFMIDIFilePlayerCallback callback, void *context)
+{
+    for (;;)
+    {
+        // The earliest track. A handful so a scan beats a heap
+        _MFTrackCursor *next = NULL;
+        uint16_t nextIndex = 0;
+        for (uint16_t t = 0; t < player->trackCount; t++)
+        {
+            _MFTrackCursor *track = &player->tracks[t];
+            if (!track->isEnded && (!next || track->tick < next->tick)) {
+                next = track;
+                nextIndex = t;
+            }
+        }
+        if (!next) return kMFMIDIFilePlayerFinished;
+
+        // Tempo changes only come into it from their tick on, so this holds till the next one
+        const uint64_t time = _MFTimeForTick(player, next->tick);
+        if (time > untilTime) return time;
+
+        MFMIDIFileEvent event;
+        event.time = time;
+        event.track = nextIndex;
+        if (_MFTrackReadEvent(player, next, &event) && callback) callback(&event, context);
+    }
+}
+
+//---------------------------------------------------------------------
+
+uint16_t MFMIDIFilePlayerGetFormat(MFMIDIFilePlayerRef player)
+{
+    return player->format;
+}
+
+//---------------------------------------------------------------------
+
+uint16_t MFMIDIFilePlayerGetTrackCount(MFMIDIFilePlayerRef player)
+{
+    return player->trackCount;
+}
+
+//---------------------------------------------------------------------
+
+uint16_t MFMIDIFilePlayerGetDivision(MFMIDIFilePlayerRef player)
+{
+    return player->division;
+}
@@ -0,0 +1,75 @@
+//
+//  MFMIDIFilePlayer.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIFilePlayer_h
+#define MIDIFish_MFMIDIFilePlayer_h
+
+#include "MFMIDIMessageValue.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Reads a Standard MIDI File (format 0 or 1) as a single time ordered stream of events, eg. to play one back through `-[MFMIDISession playMIDIFileAtPath:completion:]`.
+
+ The file is memory mapped rather than read in, and events are decoded as they're rendered straight from the map, so opening a file of any size costs the same and nothing is allocated while playing. Tracks are merged by tick (ties go in track order) and ticks converted to nanoseconds from the start following the tempo changes as they come, or the SMPTE division if the file has one.
+
+ Malformed files play up to where they go wrong: a track stops at the first event that doesn't make sense or runs off the end of its chunk.
+
+ For one thread at a time.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MFMIDIFilePlayer *MFMIDIFilePlayerRef;
+
+typedef enum MFMIDIFileEventKind {
+    kMFMIDIFileEventMessage,            // a channel (or unescaped system) message. Running status is expanded so it's always complete
+    kMFMIDIFileEventSysex,              // an F0 event. The bytes are what follow the F0, which isn't included
+    kMFMIDIFileEventEscape,             // an F7 event: a sysex continuation or anything else to go out as is
+} MFMIDIFileEventKind;
+
+typedef struct MFMIDIFileEvent {
+    uint64_t time;                      // nanoseconds from the start of the file
+    uint16_t track;
+    MFMIDIFileEventKind kind;
+    MFMIDIMessageValue message;         // sysex and escapes point into the map. Valid until the player's closed
+} MFMIDIFileEvent;
+
+typedef void (*MFMIDIFilePlayerCallback)(const MFMIDIFileEvent *event, void *context);
+
+/** Sentinel returned by `MFMIDIFilePlayerRender` once every track has ended */
+#define kMFMIDIFilePlayerFinished UINT64_MAX
+
+
+/** NULL if it can't be opened or isn't an SMF */
+extern MFMIDIFilePlayerRef MFMIDIFilePlayerOpen(const char *path);
+extern void MFMIDIFilePlayerClose(MFMIDIFilePlayerRef player);
+
+/**
+ Calls back for each event due by `untilTime` in order, and moves past them. Meta events (tempo etc.) are consumed along the way and not called back for
+ @param untilTime Nanoseconds from the start
+ @return The time of the next event, or `kMFMIDIFilePlayerFinished`
+ */
+extern uint64_t MFMIDIFilePlayerRender(MFMIDIFilePlayerRef player, uint64_t untilTime, MFMIDIFilePlayerCallback callback, void *context);
+
+/** Back to the start */
+extern void MFMIDIFilePlayerRewind(MFMIDIFilePlayerRef player);
+
+extern uint16_t MFMIDIFilePlayerGetFormat(MFMIDIFilePlayerRef player);
+/** Tracks found, which may be fewer than the header says if the file's cut short */
+extern uint16_t MFMIDIFilePlayerGetTrackCount(MFMIDIFilePlayerRef player);
+/** As in the header: ticks per quarter note, or a negative SMPTE format with ticks per frame in the low byte */
+extern uint16_t MFMIDIFilePlayerGetDivision(MFMIDIFilePlayerRef player);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,394 @@
+//
+//  MFMIDIFileRecorder.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIFileRecorder.h"
+#include "MFMIDIParser.h"
+#include "_MFRingBuffer.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+#define _DEFAULT_DIVISION 960
+#define _DEFAULT_TEMPO 500000
+#define _DEFAULT_BUFFER_CAPACITY (64 * 1024)
+#define _WRITER_POLL_INTERVAL_USECS 5000
+#define _COPY_BUFFER_SIZE (64 * 1024)
+
+struct MFMIDIFileRecorder;
+
+/** A track in the file. Track 0 writes to the file itself, the others to their own temp file until finish */
+typedef struct _MFFileTrack {
+    FILE *file;
+    char *tempPath;                     // NULL for track 0
+    uint64_t lastTick;
+    uint32_t length;                    // bytes of events so far
+} _MFFileTrack;
+
+/** A track recorded to. Format 0 parses each separately but writes them all to the one file track */
+typedef struct _MFInputTrack {
+    struct MFMIDIFileRecorder *recorder;
+    MFMIDIParser parser;
+    _MFFileTrack *fileTrack;
+} _MFInputTrack;
+
+struct MFMIDIFileRecorder {
+    // Producers
+    _MFRingBufferRef ring;
+    atomic_flag writeLock;              // the ring is single producer
+    _Atomic bool isFinishing;
+
+    // Writer thread
+    pthread_t thread;
+    bool isThreadRunning;
+    uint64_t startTime;
+    double ticksPerHostTick;
+    uint16_t inputTrackCount;
+    _MFInputTrack *inputTracks;
+    bool hasIOError;                    // only read once the thread's joined
+
+    // The file
+    char *path;
+    uint16_t fileTrackCount;
+    _MFFileTrack *fileTracks;
+    long firstTrackLengthOffset;
+    bool isFinished;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Writing
+/////////////////////////////////////////////////////////////////////////
+
+static void _MFWriteBytes(MFMIDIFileRecorderRef rec, _MFFileTrack *track, const void *bytes, size_t length)
+{
+    if (!length) return;
+    if (fwrite(bytes, 1, length, track->file) != length) rec->hasIOError = true;
+    track->length += (uint32_t)length;
+}
+
+//---------------------------------------------------------------------
+
+static void _MFWriteVLQ(MFMIDIFileRecorderRef rec, _MFFileTrack *track, uint32_t value)
+{
+    // 7 bits per byte, most significant first, all but the last with the top bit set
+    uint8_t bytes[5];
+    int i = sizeof(bytes) - 1;
+    bytes[i] = value & 0x7F;
+    while (value >>= 7) bytes[--i] = 0x80 | (value & 0x7F);
+    _MFWriteBytes(rec, track, &bytes[i], sizeof(bytes) - i);
+}
+
+//---------------------------------------------------------------------
+
+static void _MFWriteBE(uint8_t *out, uint32_t value, unsigned byteCount)
+{
+    for (unsigned i = 0; i < byteCount; i++) {
+        out[i] = (uint8_t)(value >> (8 * (byteCount - 1 - i)));
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** Delta time to `tick`, keeping the track in order should times go backwards (eg. a send timestamped in the past) */
+static void _MFWriteDelta(MFMIDIFileRecorderRef rec, _MFFileTrack *track, uint64_t tick)
+{
+    if (tick < track->lastTick) tick = track->lastTick;
+    uint64_t delta = tick - track->lastTick;
+
+    // Deltas max out at 28 bits. Bridge longer gaps with empty escapes
+    while (delta > 0x0FFFFFFF) {
+        _MFWriteVLQ(rec, track, 0x0FFFFFFF);
+        _MFWriteBytes(rec, track, (const uint8_t[]){ 0xF7, 0x00 }, 2);
+        delta -= 0x0FFFFFFF;
+    }
+    _MFWriteVLQ(rec, track, (uint32_t)delta);
+    track->lastTick = tick;
+}
+
+//---------------------------------------------------------------------
+
+static void _MFWriteMeta(MFMIDIFileRecorderRef rec, _MFFileTrack *track, uint8_t type, const void *data, uint32_t length)
+{
+    _MFWriteDelta(rec, track, track->lastTick);
+    _MFWriteBytes(rec, track, (const uint8_t[]){ 0xFF, type }, 2);
+    _MFWriteVLQ(rec, track, length);
+    _MFWriteBytes(rec, track, data, length);
+}
+
+//---------------------------------------------------------------------
+
+static void _MFRecorderParserCallback(const MFMIDIParserEvent *event, void *context)
+{
+    _MFInputTrack *input = context;
+    MFMIDIFileRecorderRef rec = input->recorder;
+    _MFFileTrack *track = input->fileTrack;
+
+    const uint8_t *bytes = MFMIDIMessageValueGetBytes(&event->message);
+    uint32_t length = event->message.length;
+    if (!length) return;    // the terminator of a sysex cut short
+
+    const uint64_t tick = event->timestamp <= rec->startTime ? 0 : (uint64_t)((double)(event->timestamp - rec->startTime) * rec->ticksPerHostTick + 0.5);
+    _MFWriteDelta(rec, track, tick);
+
+    if (event->sysexFlags & kMFMIDIParserSysexBegins)
+    {
+        // F0 <length> <the rest>. Anything after the first fragment follows as F7 continuations
+        _MFWriteBytes(rec, track, bytes, 1);
+        _MFWriteVLQ(rec, track, length - 1);
+        _MFWriteBytes(rec, track, bytes + 1, length - 1);
+    }
+    else if (event->sysexFlags || bytes[0] >= 0xF0 || bytes[0] < 0x80)
+    {
+        // Continuations (a middle fragment has no flags but starts with data), system common and realtime as escapes
+        _MFWriteBytes(rec, track, (const uint8_t[]){ 0xF7 }, 1);
+        _MFWriteVLQ(rec, track, length);
+        _MFWriteBytes(rec, track, bytes, length);
+    }
+    else
+    {
+        // Channel messages in full. No running status keeps the writer simple at a byte each
+        _MFWriteBytes(rec, track, bytes, length);
+    }
+}
+
+//---------------------------------------------------------------------
+
+static void _MFRecorderDrain(MFMIDIFileRecorderRef rec)
+{
+    _MFRingBufferRecord record;
+    while (_MFRingBufferPeek(rec->ring, &record))
+    {
+        _MFInputTrack *input = &rec->inputTracks[record.tag];
+        MFMIDIParserFeed(&input->parser, record.bytes, record.length, record.timestamp);
+        _MFRingBufferConsume(rec->ring);
+    }
+}
+
+//---------------------------------------------------------------------
+
+static void *_MFRecorderThread(void *context)
+{
+    MFMIDIFileRecorderRef rec = context;
+
+    // Check before draining so everything recorded before finish is written
+    for (;;) {
+        const bool isFinishing = atomic_load_explicit(&rec->isFinishing, memory_order_acquire);
+        _MFRecorderDrain(rec);
+        if (isFinishing) break;
+        usleep(_WRITER_POLL_INTERVAL_USECS);
+    }
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+/////////////////////////////////////////////////////////////////////////
+
+MFMIDIFileRecorderRef MFMIDIFileRecorderCreate(const char *path, const MFMIDIFileRecorderOptions *options, uint64_t startTime)
+{
+    MFMIDIFileRecorderOptions opts = options ? *options : (MFMIDIFileRecorderOptions){ 0 };
+    if (opts.format > 1) return NULL;
+    if (!opts.ticksPerQuarterNote || opts.ticksPerQuarterNote > 0x7FFF) opts.ticksPerQuarterNote = _DEFAULT_DIVISION;
+    if (!opts.microsecondsPerQuarterNote || opts.microsecondsPerQuarterNote > 0xFFFFFF) opts.microsecondsPerQuarterNote = _DEFAULT_TEMPO;
+    if (!opts.bufferCapacity) opts.bufferCapacity = _DEFAULT_BUFFER_CAPACITY;
+    if (!opts.timebaseNumer || !opts.timebaseDenom) opts.timebaseNumer = opts.timebaseDenom = 1;
+    if (!opts.trackCount) opts.trackCount = 1;
+
+    MFMIDIFileRecorderRef rec = calloc(1, sizeof(struct MFMIDIFileRecorder));
+    if (!rec) return NULL;
+    atomic_flag_clear(&rec->writeLock);
+    rec->startTime = startTime;
+    rec->inputTrackCount = opts.trackCount;
+    rec->fileTrackCount = opts.format == 0 ? 1 : opts.trackCount;
+    rec->ticksPerHostTick = (double)opts.timebaseNumer / opts.timebaseDenom        // ns
+                          * opts.ticksPerQuarterNote / (opts.microsecondsPerQuarterNote * 1000.0);
+
+    rec->path = strdup(path);
+    rec->ring = _MFRingBufferCreate(opts.bufferCapacity);
+    rec->inputTracks = calloc(rec->inputTrackCount, sizeof(_MFInputTrack));
+    rec->fileTracks = calloc(rec->fileTrackCount, sizeof(_MFFileTrack));
+    if (!rec->path || !rec->ring || !rec->inputTracks || !rec->fileTracks) goto fail;
+
+    // Track 0 goes straight after the header, its length patched at the end. The rest stream to temp files
+    for (uint16_t t = 0; t < rec->fileTrackCount; t++)
+    {
+        _MFFileTrack *track = &rec->fileTracks[t];
+        if (t == 0) {
+            track->file = fopen(path, "wb");
+        } else {
+            const size_t size = strlen(path) + 16;
+            if (!(track->tempPath = malloc(size))) goto fail;
+            snprintf(track->tempPath, size, "%s.%u.tmp", path, t);
+            track->file = fopen(track->tempPath, "w+b");
+        }
+        if (!track->file) goto fail;
+    }
+
+    uint8_t header[22] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6 };
+    _MFWriteBE(&header[8], opts.format, 2);
+    _MFWriteBE(&header[10], rec->fileTrackCount, 2);
+    _MFWriteBE(&header[12], opts.ticksPerQuarterNote, 2);
+    memcpy(&header[14], "MTrk\0\0\0\0", 8);
+    if (fwrite(header, 1, sizeof(header), rec->fileTracks[0].file) != sizeof(header)) goto fail;
+    rec->firstTrackLengthOffset = 18;
+
+    // The tempo the times were converted at, then the names
+    uint8_t tempo[3];
+    _MFWriteBE(tempo, opts.microsecondsPerQuarterNote, 3);
+    _MFWriteMeta(rec, &rec->fileTracks[0], 0x51, tempo, 3);
+    for (uint16_t t = 0; opts.trackNames && t < rec->fileTrackCount; t++)
+    {
+        const char *name = opts.trackNames[t];
+        if (name) _MFWriteMeta(rec, &rec->fileTracks[t], 0x03, name, (uint32_t)strlen(name));
+    }
+
+    for (uint16_t t = 0; t < rec->inputTrackCount; t++)
+    {
+        _MFInputTrack *input = &rec->inputTracks[t];
+        input->recorder = rec;
+        input->fileTrack = &rec->fileTracks[opts.format == 0 ? 0 : t];
+        MFMIDIParserInit(&input->parser, _MFRecorderParserCallback, input);
+    }
+
+    if (pthread_create(&rec->thread, NULL, _MFRecorderThread, rec) != 0) goto fail;
+    rec->isThreadRunning = true;
+    return rec;
+
+fail:
+    // Nothing to salvage. Don't leave a stub behind
+    rec->isFinished = true;
+    const bool isFileCreated = rec->fileTracks && rec->fileTracks[0].file;
+    MFMIDIFileRecorderDestroy(rec);
+    if (isFileCreated) remove(path);
+    return NULL;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIFileRecorderDestroy(MFMIDIFileRecorderRef recorder)
+{
+    if (!recorder) return;
+    MFMIDIFileRecorderFinish(recorder);
+
+    for (uint16_t t = 0; recorder->fileTracks && t < recorder->fileTrackCount; t++)
+    {
+        _MFFileTrack *track = &recorder->fileTracks[t];
+        if (track->file) fclose(track->file);
+        if (track->tempPath) {
+            remove(track->tempPath);
+            free(track->tempPath);
+        }
+    }
+    free(recorder->fileTracks);
+    free(recorder->inputTracks);
+    _MFRingBufferDestroy(recorder->ring);
+    free(recorder->path);
+    free(recorder);
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDIFileRecorderFinish(MFMIDIFileRecorderRef recorder)
+{
+    MFMIDIFileRecorderRef rec = recorder;
+    if (rec->isFinished) return !rec->hasIOError;
+    rec->isFinished = true;
+
+    atomic_store_explicit(&rec->isFinishing, true, memory_order_release);
+    if (rec->isThreadRunning) {
+        pthread_join(rec->thread, NULL);
+        rec->isThreadRunning = false;
+    }
+
+    // End every track. A sysex still open is left truncated
+    for (uint16_t t = 0; t < rec->fileTrackCount; t++)
+    {
+        _MFFileTrack *track = &rec->fileTracks[t];
+        _MFWriteMeta(rec, track, 0x2F, NULL, 0);
+    }
+
+    // Append the others to the file, each with its header
+    FILE *file = rec->fileTracks[0].file;
+    uint8_t *copyBuffer = rec->fileTrackCount > 1 ? malloc(_COPY_BUFFER_SIZE) : NULL;
+    if (rec->fileTrackCount > 1 && !copyBuffer) rec->hasIOError = true;
+    for (uint16_t t = 1; t < rec->fileTrackCount && copyBuffer; t++)
+    {
+        _MFFileTrack *track = &rec->fileTracks[t];
+        uint8_t header[8] = { 'M', 'T', 'r', 'k' };
+        _MFWriteBE(&header[4], track->length, 4);
+        if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) rec->hasIOError = true;
+
+        rewind(track->file);
+        size_t count;
+        while ((count = fread(copyBuffer, 1, _COPY_BUFFER_SIZE, track->file)) > 0) {
+            if (fwrite(copyBuffer, 1, count, file) != count) rec->hasIOError = true;
+        }
+        if (ferror(track->file)) rec->hasIOError = true;
+
+        fclose(track->file);
+        track->file = NULL;
+        remove(track->tempPath);
+    }
+    free(copyBuffer);
+
+    // Now track 0's length is known
+    uint8_t length[4];
+    _MFWriteBE(length, rec->fileTracks[0].length, 4);
+    if (fseek(file, rec->firstTrackLengthOffset, SEEK_SET) != 0 || fwrite(length, 1, 4, file) != 4) rec->hasIOError = true;
+    if (fclose(file) != 0) rec->hasIOError = true;
+    rec->fileTracks[0].file = NULL;
+
+    return !rec->hasIOError;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Recording
+/////////////////////////////////////////////////////////////////////////
+
+bool MFMIDIFileRecorderRecord(MFMIDIFileRecorderRef recorder, uint16_t track, uint64_t time, const uint8_t *bytes, size_t length)
+{
+    if (track >= recorder->inputTrackCount || length > UINT32_MAX) return false;
+    if (atomic_load_explicit(&recorder->isFinishing, memory_order_relaxed)) return false;
+    if (!length) return true;
+
+    // Brief. Just the copy into the ring
+    while (atomic_flag_test_and_set_explicit(&recorder->writeLock, memory_order_acquire)) {}
+    const bool isWritten = _MFRingBufferWrite(recorder->ring, time, 0, track, bytes, (uint32_t)length);
+    atomic_flag_clear_explicit(&recorder->writeLock, memory_order_release);
+    return isWritten;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDIFileRecorderRecordPacketList(MFMIDIFileRecorderRef recorder, uint16_t track, const MIDIPacketList *packetList, uint64_t now)
+{
+    bool isAllWritten = true;
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 0; i < packetList->numPackets; i++, packet = MIDIPacketNext(packet))
+    {
+        const uint64_t time = packet->timeStamp ? packet->timeStamp : now;
+        if (!MFMIDIFileRecorderRecord(recorder, track, time, packet->data, packet->length)) isAllWritten = false;
+    }
+    return isAllWritten;
+}
+
+//---------------------------------------------------------------------
+
+uint64_t MFMIDIFileRecorderDroppedCount(MFMIDIFileRecorderRef recorder)
+{
+    _MFRingBufferStats stats;
+    _MFRingBufferGetStats(recorder->ring, &stats);
+    return stats.droppedRecordCount;
+}
@@ -0,0 +1,76 @@
+//
+//  MFMIDIFileRecorder.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIFileRecorder_h
+#define MIDIFish_MFMIDIFileRecorder_h
+
+#include "MFMIDITypes.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Streams timestamped MIDI to a Standard MIDI File (format 0 or 1) as it happens, eg. a session's traffic for debugging or "replay last take".
+
+ Recording copies the bytes into a fixed size ring and returns; a background thread parses them per track (running status, interleaved realtime and sysex across packets are all fine) and writes SMF events through buffered file I/O. So memory stays bounded however long it runs and recording never touches the disk. If the writer falls behind and the ring fills, messages are dropped and counted rather than blocking, see `MFMIDIFileRecorderDroppedCount`.
+
+ Format 1 keeps tracks apart (MIDISession records what it sends on track 0 and what it receives on track 1) by streaming tracks after the first to temp files beside the output which are appended when it finishes. Format 0 merges everything into one track. Times are converted at a fixed tempo so ticks map straight to time. Sysex goes as F0 (and F7 continuation) events; system common and realtime as F7 escapes.
+
+ Recording is safe from any thread, several at once, with no allocation, I/O or blocking beyond a very short spin between concurrent recorders. The rest is for one thread at a time.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MFMIDIFileRecorder *MFMIDIFileRecorderRef;
+
+typedef struct MFMIDIFileRecorderOptions {
+    uint16_t format;                    // 0 or 1
+    uint16_t trackCount;                // format 1. Format 0 has 1
+    uint16_t ticksPerQuarterNote;       // 0 for 960
+    uint32_t microsecondsPerQuarterNote;// the tempo written to the file. 0 for 500000 (120 BPM)
+    size_t bufferCapacity;              // the ring, in bytes. 0 for 64KB
+    const char *const *trackNames;      // optional, `trackCount` of them (NULLs allowed)
+    uint32_t timebaseNumer;             // times are host ticks: ns = ticks * numer / denom. 0s for nanoseconds
+    uint32_t timebaseDenom;
+} MFMIDIFileRecorderOptions;
+
+
+/**
+ Creates the file and starts the writer thread
+ @param startTime In host ticks. Tick 0 of the file; anything recorded as earlier goes at 0
+ @return NULL if the file(s) can't be created or on allocation failure
+ */
+extern MFMIDIFileRecorderRef MFMIDIFileRecorderCreate(const char *path, const MFMIDIFileRecorderOptions *options, uint64_t startTime);
+
+/** Finishes if it hasn't been */
+extern void MFMIDIFileRecorderDestroy(MFMIDIFileRecorderRef recorder);
+
+/**
+ Record bytes sent or received at `time` (host ticks). Any number of messages, or part of one, continuing from the last bytes recorded to `track`. Real-time safe, see above
+ @return false if it was dropped (the ring is full, `track` is out of range or it's finished)
+ */
+extern bool MFMIDIFileRecorderRecord(MFMIDIFileRecorderRef recorder, uint16_t track, uint64_t time, const uint8_t *bytes, size_t length);
+
+/** Each packet at its own timestamp, or `now` for those with 0 (ie. "now" as CoreMIDI has it). @return false if any were dropped */
+extern bool MFMIDIFileRecorderRecordPacketList(MFMIDIFileRecorderRef recorder, uint16_t track, const MIDIPacketList *packetList, uint64_t now);
+
+/** Messages lost to a full ring so far */
+extern uint64_t MFMIDIFileRecorderDroppedCount(MFMIDIFileRecorderRef recorder);
+
+/**
+ Stop recording, write out what's left and close the file. Later records are dropped. Blocks while it writes
+ @return false on an I/O error at any point, in which case the file is incomplete
+ */
+extern bool MFMIDIFileRecorderFinish(MFMIDIFileRecorderRef recorder);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,889 @@
+//
+//  MFMIDILoopbackBackend.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDILoopbackBackend.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** Refs are indices into the object table offset by this so 0 is never valid */
+static const MIDIObjectRef _kRefBase = 0x10000;
+
+static const OSStatus _kErrNoMemory = -108;     // memFullErr
+
+typedef enum _MFLoopbackObjectKind {
+    _kMFLoopbackClient,
+    _kMFLoopbackInputPort,
+    _kMFLoopbackOutputPort,
+    _kMFLoopbackSource,
+    _kMFLoopbackDestination,
+} _MFLoopbackObjectKind;
+
+/** Clients, ports and endpoints share one ref space like CoreMIDI's. Never reused */
+typedef struct _MFLoopbackObject {
+    _MFLoopbackObjectKind kind;
+    bool alive;
+    bool isVirtual;                 // created by a client rather than a simulated device
+    char name[64];
+    MIDIObjectRef owner;            // client, for ports & virtual endpoints
+    MIDIEndpointRef cable;          // device endpoints: the other end
+    uint64_t latencyNanos;          // device destinations
+
+    MIDIReadProc readProc;          // input ports & virtual destinations
+    void *refCon;
+
+    MFMIDIBackendNotifyProc notifyProc;     // clients
+    void *notifyRefCon;
+
+    _Atomic uint64_t packetCount;
+    _Atomic uint64_t byteCount;
+    _Atomic uint64_t deliveredPacketCount;
+} _MFLoopbackObject;
+
+typedef struct _MFLoopbackConnection {
+    MIDIPortRef port;
+    MIDIEndpointRef source;
+    void *connRefCon;
+} _MFLoopbackConnection;
+
+/** A packet list in transit down a cable with latency */
+typedef struct _MFLoopbackDelivery {
+    uint64_t deliverAt;
+    uint64_t sequence;
+    MIDIEndpointRef source;
+    MIDIPacketList *packetList;     // owned copy
+} _MFLoopbackDelivery;
+
+struct MFMIDILoopback {
+    MFMIDIBackend backend;
+
+    // Sends & enumeration take it for reading, changes for writing
+    pthread_rwlock_t lock;
+    _MFLoopbackObject *objects;
+    size_t objectCount, objectCapacity;
+    MIDIEndpointRef *sources, *destinations;        // alive, in creation order
+    size_t sourceCount, destinationCount;
+    _MFLoopbackConnection *connections;
+    size_t connectionCount, connectionCapacity;
+
+    // Delayed deliveries. Min-heap on (deliverAt, sequence)
+    pthread_mutex_t deliveryLock;
+    pthread_cond_t deliveryCond;
+    pthread_cond_t idleCond;
+    _MFLoopbackDelivery *pending;
+    size_t pendingCount, pendingCapacity;
+    uint64_t nextSequence;
+    bool delivering;
+    bool stopping;
+    pthread_t deliveryThread;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Privates
+/////////////////////////////////////////////////////////////////////////
+
+static uint64_t _MFLoopbackNowNanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+//---------------------------------------------------------------------
+
+static _MFLoopbackObject *_MFLoopbackGetObject(MFMIDILoopbackRef lb, MIDIObjectRef ref, _MFLoopbackObjectKind kind)
+{
+    if (ref < _kRefBase || ref - _kRefBase >= lb->objectCount) return NULL;
+    _MFLoopbackObject *obj = &lb->objects[ref - _kRefBase];
+    return (obj->alive && obj->kind == kind) ? obj : NULL;
+}
+
+//---------------------------------------------------------------------
+
+/** WRITE LOCKED. @return 0 on allocation failure */
+static MIDIObjectRef _MFLoopbackAddObject(MFMIDILoopbackRef lb, _MFLoopbackObjectKind kind, const char *name, MIDIObjectRef owner)
+{
+    if (lb->objectCount == lb->objectCapacity)
+    {
+        size_t newCapacity = lb->objectCapacity ? lb->objectCapacity * 2 : 64;
+        _MFLoopbackObject *objects = realloc(lb->objects, newCapacity * sizeof(_MFLoopbackObject));
+        if (!objects) return 0;
+
+        // The endpoint lists can never outgrow the object table so size them alongside
+        MIDIEndpointRef *sources = realloc(lb->sources, newCapacity * sizeof(MIDIEndpointRef));
+        if (sources) lb->sources = sources;
+        MIDIEndpointRef *destinations = realloc(lb->destinations, newCapacity * sizeof(MIDIEndpointRef));
+        if (destinations) lb->destinations = destinations;
+        lb->objects = objects;
+        if (!sources || !destinations) return 0;
+        lb->objectCapacity = newCapacity;
+    }
+
+    _MFLoopbackObject *obj = &lb->objects[lb->objectCount];
+    memset(obj, 0, sizeof(*obj));
+    obj->kind = kind;
+    obj->alive = true;
+    obj->owner = owner;
+    strncpy(obj->name, name ?: "", sizeof(obj->name) - 1);
+
+    MIDIObjectRef ref = _kRefBase + (MIDIObjectRef)lb->objectCount++;
+    if (kind == _kMFLoopbackSource) lb->sources[lb->sourceCount++] = ref;
+    if (kind == _kMFLoopbackDestination) lb->destinations[lb->destinationCount++] = ref;
+    return ref;
+}
+
+//---------------------------------------------------------------------
+
+static void _MFLoopbackRemoveRef(MIDIEndpointRef *list, size_t *count, MIDIEndpointRef ref)
+{
+    for (size_t i = 0; i < *count; i++) {
+        if (list[i] == ref) {
+            memmove(&list[i], &list[i + 1], (*count - i - 1) * sizeof(MIDIEndpointRef));
+            (*count)--;
+            return;
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** WRITE LOCKED */
+static void _MFLoopbackKillEndpoint(MFMIDILoopbackRef lb, MIDIEndpointRef ref)
+{
+    _MFLoopbackObject *obj = &lb->objects[ref - _kRefBase];
+    obj->alive = false;
+
+    if (obj->kind == _kMFLoopbackSource)
+    {
+        _MFLoopbackRemoveRef(lb->sources, &lb->sourceCount, ref);
+
+        // Drop its connections
+        size_t kept = 0;
+        for (size_t i = 0; i < lb->connectionCount; i++) {
+            if (lb->connections[i].source != ref) lb->connections[kept++] = lb->connections[i];
+        }
+        lb->connectionCount = kept;
+    }
+    else
+    {
+        _MFLoopbackRemoveRef(lb->destinations, &lb->destinationCount, ref);
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** WRITE LOCKED. Its connections go with it */
+static void _MFLoopbackKillPort(MFMIDILoopbackRef lb, MIDIPortRef ref)
+{
+    lb->objects[ref - _kRefBase].alive = false;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < lb->connectionCount; i++) {
+        if (lb->connections[i].port != ref) lb->connections[kept++] = lb->connections[i];
+    }
+    lb->connectionCount = kept;
+}
+
+//---------------------------------------------------------------------
+
+/**
+ Tell clients (except `excludeClient`) about endpoint changes. Must NOT be locked as handlers typically re-enumerate.
+ */
+static void _MFLoopbackNotify(MFMIDILoopbackRef lb, MIDIClientRef excludeClient, MFMIDIBackendNotification notification, const MIDIEndpointRef *endpoints, size_t endpointCount)
+{
+    typedef struct { MFMIDIBackendNotifyProc proc; void *refCon; } _Handler;
+
+    // Snapshot the clients so handlers are free to take the lock
+    pthread_rwlock_rdlock(&lb->lock);
+    size_t clientCount = 0;
+    for (size_t i = 0; i < lb->objectCount; i++) {
+        if (lb->objects[i].alive && lb->objects[i].kind == _kMFLoopbackClient) clientCount++;
+    }
+    _Handler *clients = clientCount ? malloc(clientCount * sizeof(_Handler)) : NULL;
+    size_t n = 0;
+    _MFLoopbackObjectKind *kinds = malloc((endpointCount ?: 1) * sizeof(_MFLoopbackObjectKind));
+    for (size_t i = 0; clients && i < lb->objectCount; i++)
+    {
+        const _MFLoopbackObject *obj = &lb->objects[i];
+        if (obj->alive && obj->kind == _kMFLoopbackClient && _kRefBase + i != excludeClient && obj->notifyProc) {
+            clients[n++] = (_Handler){ obj->notifyProc, obj->notifyRefCon };
+        }
+    }
+    for (size_t j = 0; kinds && j < endpointCount; j++) {
+        kinds[j] = lb->objects[endpoints[j] - _kRefBase].kind;
+    }
+    pthread_rwlock_unlock(&lb->lock);
+
+    for (size_t i = 0; kinds && i < n; i++)
+    {
+        for (size_t j = 0; j < endpointCount; j++)
+        {
+            MFMIDIBackendEndpointType type = kinds[j] == _kMFLoopbackSource ? kMFMIDIBackendEndpointTypeSource : kMFMIDIBackendEndpointTypeDestination;
+            clients[i].proc(notification, type, endpoints[j], clients[i].refCon);
+        }
+    }
+    free(clients);
+    free(kinds);
+}
+
+//---------------------------------------------------------------------
+
+/** READ LOCKED. Hand the packets to every port listening to the source */
+static void _MFLoopbackDeliverFromSource(MFMIDILoopbackRef lb, MIDIEndpointRef source, const MIDIPacketList *packetList)
+{
+    for (size_t i = 0; i < lb->connectionCount; i++)
+    {
+        const _MFLoopbackConnection *conn = &lb->connections[i];
+        if (conn->source != source) continue;
+
+        const _MFLoopbackObject *port = _MFLoopbackGetObject(lb, conn->port, _kMFLoopbackInputPort);
+        if (port && port->readProc) port->readProc(packetList, port->refCon, conn->connRefCon);
+    }
+}
+
+//---------------------------------------------------------------------
+
+static size_t _MFPacketListSize(const MIDIPacketList *packetList)
+{
+    if (packetList->numPackets == 0) return sizeof(UInt32);
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 1; i < packetList->numPackets; i++) packet = MIDIPacketNext(packet);
+    return (size_t)((uintptr_t)&packet->data[packet->length] - (uintptr_t)packetList);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Delivery Thread
+/////////////////////////////////////////////////////////////////////////
+
+static inline bool _MFDeliveryIsEarlier(const _MFLoopbackDelivery *a, const _MFLoopbackDelivery *b)
+{
+    return a->deliverAt < b->deliverAt || (a->deliverAt == b->deliverAt && a->sequence < b->sequence);
+}
+
+/** DELIVERY LOCKED */
+static bool _MFLoopbackEnqueue(MFMIDILoopbackRef lb, _MFLoopbackDelivery delivery)
+{
+    if (lb->pendingCount == lb->pendingCapacity)
+    {
+        size_t newCapacity = lb->pendingCapacity ? lb->pendingCapacity * 2 : 256;
+        _MFLoopbackDelivery *pending = realloc(lb->pending, newCapacity * sizeof(_MFLoopbackDelivery));
+        if (!pending) return false;
+        lb->pending = pending;
+        lb->pendingCapacity = newCapacity;
+    }
+
+    delivery.sequence = lb->nextSequence++;
+    size_t idx = lb->pendingCount++;
+    while (idx > 0) {
+        size_t parent = (idx - 1) / 2;
+        if (!_MFDeliveryIsEarlier(&delivery, &lb->pending[parent])) break;
+        lb->pending[idx] = lb->pending[parent];
+        idx = parent;
+    }
+    lb->pending[idx] = delivery;
+    return true;
+}
+
+/** DELIVERY LOCKED */
+static _MFLoopbackDelivery _MFLoopbackDequeue(MFMIDILoopbackRef lb)
+{
+    _MFLoopbackDelivery top = lb->pending[0];
+    _MFLoopbackDelivery item = lb->pending[--lb->pendingCount];
+    size_t idx = 0;
+    for (;;) {
+        size_t child = idx * 2 + 1;
+        if (child >= lb->pendingCount) break;
+        if (child + 1 < lb->pendingCount && _MFDeliveryIsEarlier(&lb->pending[child + 1], &lb->pending[child])) child++;
+        if (!_MFDeliveryIsEarlier(&lb->pending[child], &item)) break;
+        lb->pending[idx] = lb->pending[child];
+        idx = child;
+    }
+    if (lb->pendingCount) lb->pending[idx] = item;
+    return top;
+}
+
+//---------------------------------------------------------------------
+
+static void *_MFLoopbackDeliveryThread(void *arg)
+{
+    MFMIDILoopbackRef lb = arg;
+
+    pthread_mutex_lock(&lb->deliveryLock);
+    while (!lb->stopping)
+    {
+        if (lb->pendingCount == 0) {
+            pthread_cond_broadcast(&lb->idleCond);
+            pthread_cond_wait(&lb->deliveryCond, &lb->deliveryLock);
+            continue;
+        }
+
+        const uint64_t now = _MFLoopbackNowNanos();
+        if (lb->pending[0].deliverAt > now)
+        {
+            // Condvars time out against the wall clock
+            const uint64_t waitNanos = lb->pending[0].deliverAt - now;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t nsec = (uint64_t)ts.tv_nsec + waitNanos;
+            ts.tv_sec += (time_t)(nsec / 1000000000ull);
+            ts.tv_nsec = (long)(nsec % 1000000000ull);
+            pthread_cond_timedwait(&lb->deliveryCond, &lb->deliveryLock, &ts);
+            continue;
+        }
+
+        _MFLoopbackDelivery delivery = _MFLoopbackDequeue(lb);
+        lb->delivering = true;
+        pthread_mutex_unlock(&lb->deliveryLock);
+
+        pthread_rwlock_rdlock(&lb->lock);
+        const _MFLoopbackObject *source = _MFLoopbackGetObject(lb, delivery.source, _kMFLoopbackSource);
+        if (source) {
+            _MFLoopbackDeliverFromSource(lb, delivery.source, delivery.packetList);
+            atomic_fetch_add_explicit(&lb->objects[source->cable - _kRefBase].deliveredPacketCount, delivery.packetList->numPackets, memory_order_relaxed);
+        }
+        pthread_rwlock_unlock(&lb->lock);
+        free(delivery.packetList);
+
+        pthread_mutex_lock(&lb->deliveryLock);
+        lb->delivering = false;
+    }
+    pthread_mutex_unlock(&lb->deliveryLock);
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Backend Functions
+/////////////////////////////////////////////////////////////////////////
+
+static OSStatus _MFLoopbackClientCreate(void *context, const char *name, MFMIDIBackendNotifyProc notifyProc, void *notifyRefCon, MIDIClientRef *outClient)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_wrlock(&lb->lock);
+    MIDIClientRef ref = _MFLoopbackAddObject(lb, _kMFLoopbackClient, name, 0);
+    if (ref) {
+        lb->objects[ref - _kRefBase].notifyProc = notifyProc;
+        lb->objects[ref - _kRefBase].notifyRefCon = notifyRefCon;
+    }
+    pthread_rwlock_unlock(&lb->lock);
+
+    if (!ref) return _kErrNoMemory;
+    *outClient = ref;
+    return noErr;
+}
+
+//---------------------------------------------------------------------
+
+/** Ports & virtual endpoints */
+static OSStatus _MFLoopbackCreateOwnedObject(MFMIDILoopbackRef lb, _MFLoopbackObjectKind kind, MIDIClientRef client, const char *name, MIDIReadProc readProc, void *refCon, MIDIObjectRef *outRef)
+{
+    pthread_rwlock_wrlock(&lb->lock);
+    if (!_MFLoopbackGetObject(lb, client, _kMFLoopbackClient)) {
+        pthread_rwlock_unlock(&lb->lock);
+        return kMIDIInvalidClient;
+    }
+    MIDIObjectRef ref = _MFLoopbackAddObject(lb, kind, name, client);
+    if (ref) {
+        _MFLoopbackObject *obj = &lb->objects[ref - _kRefBase];
+        obj->readProc = readProc;
+        obj->refCon = refCon;
+        obj->isVirtual = (kind == _kMFLoopbackSource || kind == _kMFLoopbackDestination);
+    }
+    pthread_rwlock_unlock(&lb->lock);
+
+    if (!ref) return _kErrNoMemory;
+    *outRef = ref;
+    return noErr;
+}
+
+static OSStatus _MFLoopbackInputPortCreate(void *context, MIDIClientRef client, const char *name, MIDIReadProc readProc, void *refCon, MIDIPortRef *outPort)
+{
+    return _MFLoopbackCreateOwnedObject(context, _kMFLoopbackInputPort, client, name, readProc, refCon, outPort);
+}
+
+static OSStatus _MFLoopbackOutputPortCreate(void *context, MIDIClientRef client, const char *name, MIDIPortRef *outPort)
+{
+    return _MFLoopbackCreateOwnedObject(context, _kMFLoopbackOutputPort, client, name, NULL, NULL, outPort);
+}
+
+static OSStatus _MFLoopbackSourceCreate(void *context, MIDIClientRef client, const char *name, MIDIEndpointRef *outSource)
+{
+    OSStatus s = _MFLoopbackCreateOwnedObject(context, _kMFLoopbackSource, client, name, NULL, NULL, outSource);
+    if (s == noErr) _MFLoopbackNotify(context, client, kMFMIDIBackendEndpointAdded, outSource, 1);
+    return s;
+}
+
+static OSStatus _MFLoopbackDestinationCreate(void *context, MIDIClientRef client, const char *name, MIDIReadProc readProc, void *refCon, MIDIEndpointRef *outDestination)
+{
+    OSStatus s = _MFLoopbackCreateOwnedObject(context, _kMFLoopbackDestination, client, name, readProc, refCon, outDestination);
+    if (s == noErr) _MFLoopbackNotify(context, client, kMFMIDIBackendEndpointAdded, outDestination, 1);
+    return s;
+}
+
+//---------------------------------------------------------------------
+
+/** Deliveries hold the read lock while they call read procs, so by the time these have the write lock nothing is still calling into what they dispose */
+static OSStatus _MFLoopbackPortDispose(void *context, MIDIPortRef port)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_wrlock(&lb->lock);
+    const bool found = _MFLoopbackGetObject(lb, port, _kMFLoopbackInputPort) || _MFLoopbackGetObject(lb, port, _kMFLoopbackOutputPort);
+    if (found) _MFLoopbackKillPort(lb, port);
+    pthread_rwlock_unlock(&lb->lock);
+    return found ? noErr : kMIDIInvalidPort;
+}
+
+static OSStatus _MFLoopbackEndpointDispose(void *context, MIDIEndpointRef endpoint)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_wrlock(&lb->lock);
+    _MFLoopbackObject *obj = _MFLoopbackGetObject(lb, endpoint, _kMFLoopbackSource) ?: _MFLoopbackGetObject(lb, endpoint, _kMFLoopbackDestination);
+    if (!obj || !obj->isVirtual) {
+        pthread_rwlock_unlock(&lb->lock);
+        return obj ? kMIDIWrongEndpointType : kMIDIUnknownEndpoint;
+    }
+    const MIDIClientRef owner = obj->owner;
+    _MFLoopbackKillEndpoint(lb, endpoint);
+    pthread_rwlock_unlock(&lb->lock);
+
+    // As when it was created, the owner isn't told
+    _MFLoopbackNotify(lb, owner, kMFMIDIBackendEndpointRemoved, &endpoint, 1);
+    return noErr;
+}
+
+static OSStatus _MFLoopbackClientDispose(void *context, MIDIClientRef client)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_wrlock(&lb->lock);
+    if (!_MFLoopbackGetObject(lb, client, _kMFLoopbackClient)) {
+        pthread_rwlock_unlock(&lb->lock);
+        return kMIDIInvalidClient;
+    }
+    lb->objects[client - _kRefBase].alive = false;
+
+    // Its ports and virtual endpoints go too. Other clients hear about the endpoints
+    MIDIEndpointRef *removed = malloc(lb->objectCount * sizeof(MIDIEndpointRef));
+    size_t removedCount = 0;
+    for (size_t i = 0; i < lb->objectCount; i++)
+    {
+        const _MFLoopbackObject *obj = &lb->objects[i];
+        if (!obj->alive || obj->owner != client) continue;
+
+        const MIDIObjectRef ref = _kRefBase + (MIDIObjectRef)i;
+        if (obj->kind == _kMFLoopbackInputPort || obj->kind == _kMFLoopbackOutputPort) {
+            _MFLoopbackKillPort(lb, ref);
+        } else {
+            _MFLoopbackKillEndpoint(lb, ref);
+            if (removed) removed[removedCount++] = ref;
+        }
+    }
+    pthread_rwlock_unlock(&lb->lock);
+
+    if (removedCount) _MFLoopbackNotify(lb, 0, kMFMIDIBackendEndpointRemoved, removed, removedCount);
+    free(removed);
+    return noErr;
+}
+
+//---------------------------------------------------------------------
+
+static ItemCount _MFLoopbackNumberOfSources(void *context)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_rdlock(&lb->lock);
+    ItemCount count = lb->sourceCount;
+    pthread_rwlock_unlock(&lb->lock);
+    return count;
+}
+
+static MIDIEndpointRef _MFLoopbackGetSource(void *context, ItemCount index)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_rdlock(&lb->lock);
+    MIDIEndpointRef ref = index < lb->sourceCount ? lb->sources[index] : 0;
+    pthread_rwlock_unlock(&lb->lock);
+    return ref;
+}
+
+static ItemCount _MFLoopbackNumberOfDestinations(void *context)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_rdlock(&lb->lock);
+    ItemCount count = lb->destinationCount;
+    pthread_rwlock_unlock(&lb->lock);
+    return count;
+}
+
+static MIDIEndpointRef _MFLoopbackGetDestination(void *context, ItemCount index)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_rdlock(&lb->lock);
+    MIDIEndpointRef ref = index < lb->destinationCount ? lb->destinations[index] : 0;
+    pthread_rwlock_unlock(&lb->lock);
+    return ref;
+}
+
+//---------------------------------------------------------------------
+
+static OSStatus _MFLoopbackPortConnectSource(void *context, MIDIPortRef port, MIDIEndpointRef source, void *connRefCon)
+{
+    MFMIDILoopbackRef lb = context;
+    OSStatus s = noErr;
+
+    pthread_rwlock_wrlock(&lb->lock);
+    if (!_MFLoopbackGetObject(lb, port, _kMFLoopbackInputPort)) s = kMIDIInvalidPort;
+    else if (!_MFLoopbackGetObject(lb, source, _kMFLoopbackSource)) s = kMIDIUnknownEndpoint;
+    else
+    {
+        if (lb->connectionCount == lb->connectionCapacity)
+        {
+            size_t newCapacity = lb->connectionCapacity ? lb->connectionCapacity * 2 : 64;
+            _MFLoopbackConnection *connections = realloc(lb->connections, newCapacity * sizeof(_MFLoopbackConnection));
+            if (connections) {
+                lb->connections = connections;
+                lb->connectionCapacity = newCapacity;
+            } else {
+                s = _kErrNoMemory;
+            }
+        }
+        if (s == noErr) {
+            lb->connections[lb->connectionCount++] = (_MFLoopbackConnection){ port, source, connRefCon };
+        }
+    }
+    pthread_rwlock_unlock(&lb->lock);
+    return s;
+}
+
+static OSStatus _MFLoopbackPortDisconnectSource(void *context, MIDIPortRef port, MIDIEndpointRef source)
+{
+    MFMIDILoopbackRef lb = context;
+    OSStatus s = kMIDINoConnection;
+
+    pthread_rwlock_wrlock(&lb->lock);
+    for (size_t i = 0; i < lb->connectionCount; i++)
+    {
+        if (lb->connections[i].port == port && lb->connections[i].source == source) {
+            lb->connections[i] = lb->connections[--lb->connectionCount];
+            s = noErr;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&lb->lock);
+    return s;
+}
+
+//---------------------------------------------------------------------
+
+static OSStatus _MFLoopbackSend(void *context, MIDIPortRef port, MIDIEndpointRef destination, const MIDIPacketList *packetList)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_rdlock(&lb->lock);
+
+    _MFLoopbackObject *dest = _MFLoopbackGetObject(lb, destination, _kMFLoopbackDestination);
+    if (!_MFLoopbackGetObject(lb, port, _kMFLoopbackOutputPort)) {
+        pthread_rwlock_unlock(&lb->lock);
+        return kMIDIInvalidPort;
+    }
+    if (!dest) {
+        pthread_rwlock_unlock(&lb->lock);
+        return kMIDIUnknownEndpoint;
+    }
+
+    size_t byteCount = 0;
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 0; i < packetList->numPackets; i++, packet = MIDIPacketNext(packet)) byteCount += packet->length;
+    atomic_fetch_add_explicit(&dest->packetCount, packetList->numPackets, memory_order_relaxed);
+    atomic_fetch_add_explicit(&dest->byteCount, byteCount, memory_order_relaxed);
+
+    OSStatus s = noErr;
+    if (dest->isVirtual)
+    {
+        // Someone's virtual destination. Straight to its read proc
+        if (dest->readProc) dest->readProc(packetList, dest->refCon, NULL);
+    }
+    else if (dest->latencyNanos == 0)
+    {
+        _MFLoopbackDeliverFromSource(lb, dest->cable, packetList);
+        atomic_fetch_add_explicit(&dest->deliveredPacketCount, packetList->numPackets, memory_order_relaxed);
+    }
+    else
+    {
+        // Down the cable. The copy is freed by the delivery thread
+        size_t size = _MFPacketListSize(packetList);
+        _MFLoopbackDelivery delivery = { .deliverAt = _MFLoopbackNowNanos() + dest->latencyNanos, .source = dest->cable, .packetList = malloc(size) };
+        if (delivery.packetList)
+        {
+            memcpy(delivery.packetList, packetList, size);
+            pthread_mutex_lock(&lb->deliveryLock);
+            bool queued = _MFLoopbackEnqueue(lb, delivery);
+            pthread_cond_signal(&lb->deliveryCond);
+            pthread_mutex_unlock(&lb->deliveryLock);
+            if (!queued) {
+                free(delivery.packetList);
+                s = _kErrNoMemory;
+            }
+        }
+        else s = _kErrNoMemory;
+    }
+
+    pthread_rwlock_unlock(&lb->lock);
+    return s;
+}
+
+//---------------------------------------------------------------------
+
+static OSStatus _MFLoopbackReceived(void *context, MIDIEndpointRef source, const MIDIPacketList *packetList)
+{
+    MFMIDILoopbackRef lb = context;
+    pthread_rwlock_rdlock(&lb->lock);
+
+    const _MFLoopbackObject *src = _MFLoopbackGetObject(lb, source, _kMFLoopbackSource);
+    OSStatus s = noErr;
+    if (!src) s = kMIDIUnknownEndpoint;
+    else if (!src->isVirtual) s = kMIDIWrongEndpointType;
+    else _MFLoopbackDeliverFromSource(lb, source, packetList);
+
+    pthread_rwlock_unlock(&lb->lock);
+    return s;
+}
+
+//---------------------------------------------------------------------
+
+static bool _MFLoopbackGetDisplayName(void *context, MIDIObjectRef object, char *buffer, size_t bufferSize)
+{
+    MFMIDILoopbackRef lb = context;
+    bool found = false;
+    pthread_rwlock_rdlock(&lb->lock);
+    if (object >= _kRefBase && object - _kRefBase < lb->objectCount && bufferSize)
+    {
+        strncpy(buffer, lb->objects[object - _kRefBase].name, bufferSize - 1);
+        buffer[bufferSize - 1] = '\0';
+        found = true;
+    }
+    pthread_rwlock_unlock(&lb->lock);
+    return found;
+}
+
+static bool _MFLoopbackIsNetworkSessionEndpoint(void *context, MIDIEndpointRef endpoint)
+{
+    (void)context; (void)endpoint;
+    return false;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+MFMIDILoopbackRef MFMIDILoopbackCreate(void)
+{
+    MFMIDILoopbackRef lb = calloc(1, sizeof(struct MFMIDILoopback));
+    if (!lb) return NULL;
+
+    lb->backend = (MFMIDIBackend){
+        .name = "Loopback",
+        .context = lb,
+        .clientCreate = _MFLoopbackClientCreate,
+        .inputPortCreate = _MFLoopbackInputPortCreate,
+        .outputPortCreate = _MFLoopbackOutputPortCreate,
+        .sourceCreate = _MFLoopbackSourceCreate,
+        .destinationCreate = _MFLoopbackDestinationCreate,
+        .portDispose = _MFLoopbackPortDispose,
+        .endpointDispose = _MFLoopbackEndpointDispose,
+        .clientDispose = _MFLoopbackClientDispose,
+        .numberOfSources = _MFLoopbackNumberOfSources,
+        .getSource = _MFLoopbackGetSource,
+        .numberOfDestinations = _MFLoopbackNumberOfDestinations,
+        .getDestination = _MFLoopbackGetDestination,
+        .portConnectSource = _MFLoopbackPortConnectSource,
+        .portDisconnectSource = _MFLoopbackPortDisconnectSource,
+        .send = _MFLoopbackSend,
+        .received = _MFLoopbackReceived,
+        .getDisplayName = _MFLoopbackGetDisplayName,
+        .isNetworkSessionEndpoint = _MFLoopbackIsNetworkSessionEndpoint,
+    };
+
+    pthread_rwlock_init(&lb->lock, NULL);
+    pthread_mutex_init(&lb->deliveryLock, NULL);
+    pthread_cond_init(&lb->deliveryCond, NULL);
+    pthread_cond_init(&lb->idleCond, NULL);
+
+    if (pthread_create(&lb->deliveryThread, NULL, _MFLoopbackDeliveryThread, lb) != 0) {
+        pthread_rwlock_destroy(&lb->lock);
+        pthread_mutex_destroy(&lb->deliveryLock);
+        pthread_cond_destroy(&lb->deliveryCond);
+        pthread_cond_destroy(&lb->idleCond);
+        free(lb);
+        return NULL;
+    }
+    return lb;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDILoopbackDestroy(MFMIDILoopbackRef lb)
+{
+    if (!lb) return;
+
+    pthread_mutex_lock(&lb->deliveryLock);
+    lb->stopping = true;
+    pthread_cond_broadcast(&lb->deliveryCond);
+    pthread_mutex_unlock(&lb->deliveryLock);
+    pthread_join(lb->deliveryThread, NULL);
+
+    for (size_t i = 0; i < lb->pendingCount; i++) free(lb->pending[i].packetList);
+    free(lb->pending);
+    free(lb->objects);
+    free(lb->sources);
+    free(lb->destinations);
+    free(lb->connections);
+
+    pthread_rwlock_destroy(&lb->lock);
+    pthread_mutex_destroy(&lb->deliveryLock);
+    pthread_cond_destroy(&lb->deliveryCond);
+    pthread_cond_destroy(&lb->idleCond);
+    free(lb);
+}
+
+//---------------------------------------------------------------------
+
+const MFMIDIBackend *MFMIDILoopbackGetBackend(MFMIDILoopbackRef lb)
+{
+    return &lb->backend;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Simulation
+/////////////////////////////////////////////////////////////////////////
+
+bool MFMIDILoopbackAddDevice(MFMIDILoopbackRef lb, const char *name, uint64_t latencyNanos, MIDIEndpointRef *outSource, MIDIEndpointRef *outDestination)
+{
+    pthread_rwlock_wrlock(&lb->lock);
+    MIDIEndpointRef endpoints[2];
+    endpoints[0] = _MFLoopbackAddObject(lb, _kMFLoopbackSource, name, 0);
+    endpoints[1] = endpoints[0] ? _MFLoopbackAddObject(lb, _kMFLoopbackDestination, name, 0) : 0;
+    if (!endpoints[1])
+    {
+        if (endpoints[0]) _MFLoopbackKillEndpoint(lb, endpoints[0]);
+        pthread_rwlock_unlock(&lb->lock);
+        return false;
+    }
+    lb->objects[endpoints[0] - _kRefBase].cable = endpoints[1];
+    lb->objects[endpoints[1] - _kRefBase].cable = endpoints[0];
+    lb->objects[endpoints[1] - _kRefBase].latencyNanos = latencyNanos;
+    pthread_rwlock_unlock(&lb->lock);
+
+    if (outSource) *outSource = endpoints[0];
+    if (outDestination) *outDestination = endpoints[1];
+
+    _MFLoopbackNotify(lb, 0, kMFMIDIBackendEndpointAdded, endpoints, 2);
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDILoopbackRemoveDevice(MFMIDILoopbackRef lb, MIDIEndpointRef endpoint)
+{
+    pthread_rwlock_wrlock(&lb->lock);
+    _MFLoopbackObject *obj = _MFLoopbackGetObject(lb, endpoint, _kMFLoopbackSource) ?: _MFLoopbackGetObject(lb, endpoint, _kMFLoopbackDestination);
+    if (!obj || obj->isVirtual) {
+        pthread_rwlock_unlock(&lb->lock);
+        return false;
+    }
+    MIDIEndpointRef endpoints[2] = { endpoint, obj->cable };
+    _MFLoopbackKillEndpoint(lb, endpoints[0]);
+    _MFLoopbackKillEndpoint(lb, endpoints[1]);
+    pthread_rwlock_unlock(&lb->lock);
+
+    _MFLoopbackNotify(lb, 0, kMFMIDIBackendEndpointRemoved, endpoints, 2);
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDILoopbackRenameDevice(MFMIDILoopbackRef lb, MIDIEndpointRef endpoint, const char *name)
+{
+    pthread_rwlock_wrlock(&lb->lock);
+    _MFLoopbackObject *obj = _MFLoopbackGetObject(lb, endpoint, _kMFLoopbackSource) ?: _MFLoopbackGetObject(lb, endpoint, _kMFLoopbackDestination);
+    if (!obj || obj->isVirtual) {
+        pthread_rwlock_unlock(&lb->lock);
+        return false;
+    }
+    MIDIEndpointRef endpoints[2] = { endpoint, obj->cable };
+    for (int i = 0; i < 2; i++) {
+        _MFLoopbackObject *end = &lb->objects[endpoints[i] - _kRefBase];
+        memset(end->name, 0, sizeof(end->name));
+        strncpy(end->name, name ?: "", sizeof(end->name) - 1);
+    }
+    pthread_rwlock_unlock(&lb->lock);
+
+    _MFLoopbackNotify(lb, 0, kMFMIDIBackendEndpointPropertyChanged, endpoints, 2);
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDILoopbackSetLatency(MFMIDILoopbackRef lb, MIDIEndpointRef endpoint, uint64_t latencyNanos)
+{
+    pthread_rwlock_wrlock(&lb->lock);
+    _MFLoopbackObject *obj = _MFLoopbackGetObject(lb, endpoint, _kMFLoopbackDestination);
+    if (!obj) {
+        _MFLoopbackObject *src = _MFLoopbackGetObject(lb, endpoint, _kMFLoopbackSource);
+        if (src && !src->isVirtual) obj = _MFLoopbackGetObject(lb, src->cable, _kMFLoopbackDestination);
+    }
+    bool ok = obj && !obj->isVirtual;
+    if (ok) obj->latencyNanos = latencyNanos;
+    pthread_rwlock_unlock(&lb->lock);
+    return ok;
+}
+
+//---------------------------------------------------------------------
+
+OSStatus MFMIDILoopbackInject(MFMIDILoopbackRef lb, MIDIEndpointRef source, const MIDIPacketList *packetList)
+{
+    pthread_rwlock_rdlock(&lb->lock);
+    OSStatus s = noErr;
+    if (!_MFLoopbackGetObject(lb, source, _kMFLoopbackSource)) s = kMIDIUnknownEndpoint;
+    else _MFLoopbackDeliverFromSource(lb, source, packetList);
+    pthread_rwlock_unlock(&lb->lock);
+    return s;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDILoopbackGetStats(MFMIDILoopbackRef lb, MIDIEndpointRef destination, MFMIDILoopbackEndpointStats *outStats)
+{
+    pthread_rwlock_rdlock(&lb->lock);
+    bool ok = destination >= _kRefBase && destination - _kRefBase < lb->objectCount && lb->objects[destination - _kRefBase].kind == _kMFLoopbackDestination;
+    if (ok)
+    {
+        _MFLoopbackObject *obj = &lb->objects[destination - _kRefBase];
+        outStats->packetCount = atomic_load_explicit(&obj->packetCount, memory_order_relaxed);
+        outStats->byteCount = atomic_load_explicit(&obj->byteCount, memory_order_relaxed);
+        outStats->deliveredPacketCount = atomic_load_explicit(&obj->deliveredPacketCount, memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&lb->lock);
+    return ok;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDILoopbackWaitUntilIdle(MFMIDILoopbackRef lb)
+{
+    pthread_mutex_lock(&lb->deliveryLock);
+    while (lb->pendingCount || lb->delivering) {
+        pthread_cond_wait(&lb->idleCond, &lb->deliveryLock);
+    }
+    pthread_mutex_unlock(&lb->deliveryLock);
+}
@@ -0,0 +1,71 @@
+//
+//  MFMIDILoopbackBackend.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDILoopbackBackend_h
+#define MIDIFish_MFMIDILoopbackBackend_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "MFMIDIBackend.h"
+
+/**
+ In-process MFMIDIBackend for load testing and benchmarking without hardware. Plain C + pthreads so it builds anywhere.
+
+ Simulated "devices" each have a source and a destination joined by a loopback cable: whatever is sent to the destination comes back out of the source after the device's latency and is delivered to every input port connected to it. Zero latency delivers synchronously on the sending thread; otherwise a delivery thread plays the role of the driver. Devices can be plugged and unplugged at any time, which notifies clients as CoreMIDI would.
+
+ Virtual sources/destinations created through the backend behave as with CoreMIDI. The exception is that notifications are delivered synchronously on the thread making the change, and the client creating a virtual endpoint isn't notified about it (CoreMIDI's notification arrives later, by which time the session knows it's its own).
+
+ Read procs must not create or remove endpoints or ports.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MFMIDILoopback *MFMIDILoopbackRef;
+
+typedef struct MFMIDILoopbackEndpointStats {
+    uint64_t packetCount;       // sent to the destination
+    uint64_t byteCount;
+    uint64_t deliveredPacketCount;  // came out the other end of the cable
+} MFMIDILoopbackEndpointStats;
+
+
+extern MFMIDILoopbackRef MFMIDILoopbackCreate(void);
+
+/** Stops the delivery thread. Anything still in transit is dropped */
+extern void MFMIDILoopbackDestroy(MFMIDILoopbackRef loopback);
+
+/** Valid for the life of the loopback. Pass to `-[MFMIDISession initWithName:backend:]` */
+extern const MFMIDIBackend *MFMIDILoopbackGetBackend(MFMIDILoopbackRef loopback);
+
+/** Plug in a device. Either out param may be NULL. @return false on allocation failure */
+extern bool MFMIDILoopbackAddDevice(MFMIDILoopbackRef loopback, const char *name, uint64_t latencyNanos, MIDIEndpointRef *outSource, MIDIEndpointRef *outDestination);
+
+/** Unplug the device owning the given source or destination. @return false if it isn't a device endpoint */
+extern bool MFMIDILoopbackRemoveDevice(MFMIDILoopbackRef loopback, MIDIEndpointRef endpoint);
+
+/** Rename the device owning the given source or destination, which notifies clients as a property change on both. @return false if it isn't a device endpoint */
+extern bool MFMIDILoopbackRenameDevice(MFMIDILoopbackRef loopback, MIDIEndpointRef endpoint, const char *name);
+
+/** Pass the device's source or destination */
+extern bool MFMIDILoopbackSetLatency(MFMIDILoopbackRef loopback, MIDIEndpointRef endpoint, uint64_t latencyNanos);
+
+/** Simulate a device sending to us, ie. deliver from its source right away */
+extern OSStatus MFMIDILoopbackInject(MFMIDILoopbackRef loopback, MIDIEndpointRef source, const MIDIPacketList *packetList);
+
+/** For destinations. @return false if unknown */
+extern bool MFMIDILoopbackGetStats(MFMIDILoopbackRef loopback, MIDIEndpointRef destination, MFMIDILoopbackEndpointStats *outStats);
+
+/** Blocks until every delayed delivery has been made */
+extern void MFMIDILoopbackWaitUntilIdle(MFMIDILoopbackRef loopback);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
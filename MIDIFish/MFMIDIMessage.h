@@ -8,6 +8,8 @@
 
 #import <Foundation/Foundation.h>
 #import <CoreMIDI/CoreMIDI.h>
+#import "MFMIDIMessageValue.h"
+#import "MFMIDIParser.h"
 
 /////////////////////////////////////////////////////////////////////////
 #pragma mark - Defs
@@ -21,7 +23,19 @@ typedef NS_ENUM(UInt8, MFMIDIMessageType) {
     kMFMIDIMessageTypeProgramChange                     = 0xC0,
     kMFMIDIMessageTypeChannelAftertouch                 = 0xD0,
     kMFMIDIMessageTypePitchbend                         = 0xE0,
-    kMFMIDIMessageTypeSysex                             = 0xF0
+    kMFMIDIMessageTypeSysex                             = 0xF0,
+    
+    // System Common & Realtime. These have no channel so the type is the full status byte
+    kMFMIDIMessageTypeMTCQuarterFrame                   = 0xF1,
+    kMFMIDIMessageTypeSongPosition                      = 0xF2,
+    kMFMIDIMessageTypeSongSelect                        = 0xF3,
+    kMFMIDIMessageTypeTuneRequest                       = 0xF6,
+    kMFMIDIMessageTypeTimingClock                       = 0xF8,
+    kMFMIDIMessageTypeStart                             = 0xFA,
+    kMFMIDIMessageTypeContinue                          = 0xFB,
+    kMFMIDIMessageTypeStop                              = 0xFC,
+    kMFMIDIMessageTypeActiveSensing                     = 0xFE,
+    kMFMIDIMessageTypeSystemReset                       = 0xFF
 };
 
 
@@ -29,7 +43,11 @@ typedef NS_ENUM(UInt8, MFMIDIMessageType) {
 #pragma mark -
 /////////////////////////////////////////////////////////////////////////
 
+/**
+ Thin ObjC wrapper around `MFMIDIMessageValue`. Messages of 3 bytes or less are stored inline; longer ones (and any message whose `data` property has been accessed) are backed by an NSMutableData.
 
+ For high-rate sending prefer building an `MFMIDIMessageValue` on the stack and using `-[MFMIDISession sendMIDIMessageValue:]` which avoids the object allocation altogether.
+ */
 @interface MFMIDIMessage : NSObject <NSCopying>
 
 
@@ -55,6 +73,11 @@ typedef NS_ENUM(UInt8, MFMIDIMessageType) {
  */
 + (instancetype)messageWithData:(NSData *)data;
 
+/**
+ Create a Message from a value type. Inline values are copied into the message; out-of-line bytes are copied into a new data buffer (as the value doesn't own them)
+ */
++ (instancetype)messageWithValue:(MFMIDIMessageValue)value;
+
 /**
   Creates a new message with the given packet.
 
@@ -70,6 +93,8 @@ typedef NS_ENUM(UInt8, MFMIDIMessageType) {
 
  Example: (data)[0x90, 10, 127, 0x80, 10, 0] -> messages would
  result in 2 messages being made, one a note on, another a note off.
+ 
+ Uses `MFMIDIParser` so running status is expanded, system common/realtime messages are included (in the order they occur, even from within a sysex) and a sysex missing its EOX is returned as-is. For incremental parsing of a live stream use `MFMIDIParser` directly.
 
  @param data The data to parse.
 
@@ -77,6 +102,8 @@ typedef NS_ENUM(UInt8, MFMIDIMessageType) {
  */
 + (NSArray *)messagesWithData:(NSData *)data;
 + (NSArray *)messagesWithPacket:(MIDIPacket *)packet;
+
+/** As above but parser state carries across the packets so running status and sysex spanning packets are handled. Returns nil if there are no messages */
 + (NSArray *)messagesWithPacketList:(MIDIPacketList *)list;
 
 
@@ -99,10 +126,10 @@ typedef NS_ENUM(UInt8, MFMIDIMessageType) {
 /** The length of the data of this message in bytes */
 @property (nonatomic, readonly) NSUInteger length;
 
-/** The MIDI Channel 0-15 */
+/** The MIDI Channel 0-15. Always 0 for system messages */
 @property (nonatomic) UInt8 channel;
 
-/** NoteOn, Pitchbend, etc */
+/** NoteOn, Pitchbend, etc. For system messages (0xF0 and up) it is the full status byte */
 @property (nonatomic) MFMIDIMessageType type;
 
 /// The full first byte. For most messages its the type (msb) + channel (lsb)
@@ -135,12 +162,15 @@ typedef NS_ENUM(UInt8, MFMIDIMessageType) {
  */
 @property (nonatomic) UInt16 doublePrecisionValue, pitchbendValue;
 
-/// The wrapped mutable data object. You can still mutate it even though its readonly
+/// The wrapped mutable data object. You can still mutate it even though its readonly. NOTE: for short messages this creates the data object on first access and moves the message over to it, and as the bytes can then change at any time the message stops caching its packet lists, so avoid in performance critical code
 @property (nonatomic, readonly) NSMutableData *data;
 
-/// The mutableBytes on the NSMutableData
+/// The raw bytes of the message (inline storage or the mutableBytes on the NSMutableData). Writable, so as with `data` the packet lists are no longer cached. Prefer the setters or `messageValue` for reading
 @property (nonatomic, readonly) UInt8 *bytes;
 
+/// Value-type view of the message. For out-of-line messages it points into this object's storage so only use it while the message is alive and unmutated
+@property (nonatomic, readonly) MFMIDIMessageValue messageValue;
+
 
 
 /////////////////////////////////////////////////////////////////////////
@@ -149,14 +179,16 @@ typedef NS_ENUM(UInt8, MFMIDIMessageType) {
 
 /**
  Sets a single byte at a given place in the message's data buffer.
- The message will grow if it needs to.
+ The message will grow if it needs to. Discards the cached packet lists.
 
  @param byte  The value to apply.
  @param index The index at which to
  */
 - (void)setByte:(UInt8)byte atIndex:(NSUInteger)index;
 
-/** Need to use a block here as packet lists have a scope and their handling needs to occur within the same scope or EXC_BAD_ACCESS will happen sometimes */
+/** Need to use a block here as packet lists have a scope and their handling needs to occur within the same scope or EXC_BAD_ACCESS will happen sometimes. Messages too long for one buffer (~4KB, ie big sysex) are handed over as several consecutive packet lists, so there's no size limit.
+
+ The lists are encoded on the first call and handed out again by later ones, so sending a message to the session, an Audiobus destination and so on encodes it once. Short messages are encoded within the object, long ones allocate once. Setters and `setByte:atIndex:` discard them. Don't modify the lists */
 - (void)toMIDIPacketList:(void(^)(MIDIPacketList *packetList))packetListHandler;
 
 
@@ -6,13 +6,86 @@
 //
 //
 #import "MFMIDIMessage.h"
+#import "MFMIDIBatch.h"
+#import "MFMIDISysexTransfer.h"
+#import <stdatomic.h>
+#import <stddef.h>
+
+/** toMIDIPacketList: hands messages over as lists of one packet, chunks of this size for long ones */
+#define _PACKET_LIST_CHUNK_SIZE         kMFMIDIBatchDefaultBufferSize
+#define _PACKET_LIST_HEADER_SIZE        (offsetof(MIDIPacketList, packet) + offsetof(MIDIPacket, data))
+#define _PACKET_LIST_CHUNK_DATA_SIZE    (_PACKET_LIST_CHUNK_SIZE - _PACKET_LIST_HEADER_SIZE)
+
+/** Room for a list of one short message in the object itself */
+#define _INLINE_PACKET_LIST_WORDS       3
+_Static_assert(_PACKET_LIST_HEADER_SIZE + kMFMIDIMessageValueInlineCapacity <= _INLINE_PACKET_LIST_WORDS * sizeof(uint64_t), "Short messages' packet list must fit inline");
+
+static inline NSUInteger _MFPacketListChunkCount(NSUInteger length)
+{
+    return (length + _PACKET_LIST_CHUNK_DATA_SIZE - 1) / _PACKET_LIST_CHUNK_DATA_SIZE;
+}
+
+@interface MFMIDIMessage ()
+/** Takes `data` as its own storage. No one else may write to it */
+- (instancetype)_initWithOwnedData:(NSMutableData *)data;
+@end
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Parser Callback
+/////////////////////////////////////////////////////////////////////////
+
+/** Context for the MFMIDIParser callback used by the `messagesWith...` methods. The objects are retained by the caller's stack */
+typedef struct {
+    __unsafe_unretained NSMutableArray *messages;
+    __unsafe_unretained NSMutableData *sysex;       // accumulates sysex fragments
+} _MFParsedMessageCollector;
+
+static void _MFCollectParsedMessage(const MFMIDIParserEvent *event, void *context)
+{
+    _MFParsedMessageCollector *collector = (_MFParsedMessageCollector *)context;
+    const MFMIDIMessageValue *value = &event->message;
+    
+    // Complete messages (incl. sysex that arrived in one piece) are copied straight into new objects
+    const uint32_t wholeSysex = kMFMIDIParserSysexBegins | kMFMIDIParserSysexEnds;
+    if (!event->sysexFlags || ((event->sysexFlags & wholeSysex) == wholeSysex && !(event->sysexFlags & kMFMIDIParserSysexTruncated)))
+    {
+        [collector->messages addObject:[MFMIDIMessage messageWithValue:*value]];
+        return;
+    }
+    
+    // Otherwise stitch the fragments back together
+    [collector->sysex appendBytes:MFMIDIMessageValueGetBytes(value) length:value->length];
+    if ((event->sysexFlags & kMFMIDIParserSysexEnds) && collector->sysex.length)
+    {
+        [collector->messages addObject:[[MFMIDIMessage alloc] _initWithOwnedData:[NSMutableData dataWithData:collector->sysex]]];
+        collector->sysex.length = 0;
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark -
+/////////////////////////////////////////////////////////////////////////
 
 /** 
  Lots of snippets adapted from https://github.com/JRHeaton/MIDIKit. Thank you!
  */
 @implementation MFMIDIMessage
 {
-    NSMutableData *_data;
+    MFMIDIMessageValue _value;  // inline storage. Unused once _data is set
+    NSMutableData *_data;       // out-of-line storage, nil for short messages
+    
+    // The packet lists toMIDIPacketList: hands out are encoded once and reused by every send, until setByte:atIndex: changes the message. NULL when not yet encoded. Points at _inlinePacketList for short messages, otherwise malloc'd
+    _Atomic(Byte *) _packetLists;
+    uint64_t _inlinePacketList[_INLINE_PACKET_LIST_WORDS];
+    atomic_bool _inlinePacketListClaimed;   // a send has taken _inlinePacketList to encode into. Only it writes there
+    BOOL _storageShared;        // others can write the bytes directly (`data`, `bytes` or their own NSMutableData) so they're never cached
+}
+
+/** For our own reads. Unlike `bytes` it doesn't give up the cached packet lists, as nothing is written through it */
+static inline const UInt8 *_MFMIDIMessageBytes(MFMIDIMessage *self)
+{
+    return self->_data ? (const UInt8 *)self->_data.bytes : self->_value.inlineBytes;
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -23,10 +96,7 @@
 {
     self = [super init];
     if (self) {
-        _data = [NSMutableData dataWithCapacity:3];
-        ((UInt8 *)_data.mutableBytes)[0] = 0;
-        ((UInt8 *)_data.mutableBytes)[1] = 0;
-        ((UInt8 *)_data.mutableBytes)[2] = 0;
+        _value = MFMIDIMessageValueMakeWithBytes(NULL, 0);
     }
     return self;
 }
@@ -63,9 +133,47 @@
 - (instancetype)initWithData:(NSData *)data
 {
     NSParameterAssert(data);
+    NSMutableData *mutableData = [data isKindOfClass:[NSMutableData class]] ? (NSMutableData *)data : data.mutableCopy;
+    self = [self _initWithOwnedData:mutableData];
+    if (self) {
+        _storageShared = (mutableData == data);     // the caller can still write to it
+    }
+    return self;
+}
+
+- (instancetype)_initWithOwnedData:(NSMutableData *)data
+{
     self = [super init];
     if (self) {
-        _data = [data isKindOfClass:[NSMutableData class]] ? data : data.mutableCopy;
+        _data = data;
+    }
+    return self;
+}
+
+//---------------------------------------------------------------------
+
+- (void)dealloc
+{
+    [self _invalidatePacketLists];
+}
+
+//---------------------------------------------------------------------
+
++ (instancetype)messageWithValue:(MFMIDIMessageValue)value
+{
+    return [[self alloc] initWithValue:value];
+}
+
+/** @private */
+- (instancetype)initWithValue:(MFMIDIMessageValue)value
+{
+    if(!(self = [self init])) return nil;
+    
+    if (MFMIDIMessageValueIsInline(&value)) {
+        _value = value;
+    } else {
+        // We don't own out-of-line bytes so take a copy
+        _data = [NSMutableData dataWithBytes:value.outOfLineBytes length:value.length];
     }
     return self;
 }
@@ -82,8 +190,11 @@
 {
     if(!(self = [self init])) return nil;
     
-    [self.data setLength:packet->length];
-    memcpy(self.bytes, packet->data, packet->length);
+    if (packet->length <= kMFMIDIMessageValueInlineCapacity) {
+        _value = MFMIDIMessageValueMakeWithBytes(packet->data, packet->length);
+    } else {
+        _data = [NSMutableData dataWithBytes:packet->data length:packet->length];
+    }
     
     return self;
 }
@@ -102,55 +213,13 @@
 + (NSArray *)messagesWithData:(NSData *)data
 {
     NSMutableArray *me = [NSMutableArray array];
+    NSMutableData *sysex = [NSMutableData data];
+    _MFParsedMessageCollector collector = { me, sysex };
     
-    static const NSUInteger NUM_TYPES = 8;
-    static MFMIDIMessageType handledTypes[NUM_TYPES] = {
-        kMFMIDIMessageTypeNoteOff,
-        kMFMIDIMessageTypeNoteOn,
-        kMFMIDIMessageTypePolyphonicAftertouch,
-        kMFMIDIMessageTypeControlChange,
-        kMFMIDIMessageTypeProgramChange,
-        kMFMIDIMessageTypeChannelAftertouch,
-        kMFMIDIMessageTypePitchbend,
-        kMFMIDIMessageTypeSysex
-    };
-    
-    // Run through the loop, check the type byte, and handle the data accordingly building messages along the way
-    UInt8 *buff = (UInt8 *)data.bytes;
-    UInt8 off = 0;
-    while(off < data.length) {
-        UInt8 *buf = &buff[off];
-        
-        bool found = false;
-        for(int i=0;i<NUM_TYPES;++i) {
-            MFMIDIMessageType type = handledTypes[i];
-            
-            if((buf[0] & 0xf0) == type) {
-                UInt8 goodLen = (data.length - off);
-                switch (type) {
-                    case kMFMIDIMessageTypeSysex:
-                        for(NSUInteger x=0;x<goodLen;++x) {
-                            if(buf[x] == 0xF7) { // EOX
-                                goodLen = x + 1;
-                                goto done;
-                            }
-                        }
-                        
-                        break;
-                    default: goodLen = MIN(3, goodLen); // standard MIDI message
-                }
-            done:
-                [me addObject:[MFMIDIMessage messageWithData:[NSData dataWithBytes:buf length:goodLen]]];
-                
-                off += goodLen;
-                found = true;
-            }
-        }
-        if (found)
-            found = false;
-        else
-            off++;
-    }
+    MFMIDIParser parser;
+    MFMIDIParserInit(&parser, _MFCollectParsedMessage, &collector);
+    MFMIDIParserFeed(&parser, data.bytes, data.length, 0);
+    MFMIDIParserFlush(&parser, 0);
     
     return me;
 }
@@ -164,13 +233,20 @@
 
 + (NSArray *)messagesWithPacketList:(MIDIPacketList *)list {
     NSMutableArray *me = [NSMutableArray array];
+    NSMutableData *sysex = [NSMutableData data];
+    _MFParsedMessageCollector collector = { me, sysex };
+    
+    // One parser for the whole list so state carries from packet to packet
+    MFMIDIParser parser;
+    MFMIDIParserInit(&parser, _MFCollectParsedMessage, &collector);
     
     MIDIPacket *packet = &list->packet[0];
     for (int i=0;i<list->numPackets;++i) {
-        [me addObjectsFromArray:[self messagesWithPacket:packet]];
+        MFMIDIParserFeed(&parser, packet->data, packet->length, packet->timeStamp);
         
         packet = MIDIPacketNext(packet);
     }
+    MFMIDIParserFlush(&parser, 0);
     
     return me.count ? me.copy : nil;
 }
@@ -180,16 +256,34 @@
 - (id)copyWithZone:(NSZone *)zone
 {
     // Be sure to copy the bytes too
-    NSMutableData *dataCopy = [NSMutableData dataWithBytes:self.data.bytes length:self.data.length];
-    MFMIDIMessage *copy = [[self.class allocWithZone:zone] initWithData:dataCopy];
+    if (!_data) {
+        return [[self.class allocWithZone:zone] initWithValue:_value];
+    }
+    NSMutableData *dataCopy = [NSMutableData dataWithBytes:_data.bytes length:_data.length];
+    MFMIDIMessage *copy = [[self.class allocWithZone:zone] _initWithOwnedData:dataCopy];
     return copy;
 }
 
 //---------------------------------------------------------------------
 
+- (NSUInteger)hash
+{
+    NSUInteger hash = self.length;
+    for (NSUInteger i=0; i<MIN(self.length, 8); ++i) {
+        hash = hash * 31 + _MFMIDIMessageBytes(self)[i];
+    }
+    return hash;
+}
+
+//---------------------------------------------------------------------
+
 - (BOOL)isEqual:(id)object
 {
-    return [object isKindOfClass:[MFMIDIMessage class]] && [self.data isEqualToData:((MFMIDIMessage *)object).data];
+    if (![object isKindOfClass:[MFMIDIMessage class]]) return NO;
+    
+    // Compare raw bytes so as not to force either message onto out-of-line storage
+    MFMIDIMessage *other = object;
+    return self.length == other.length && memcmp(_MFMIDIMessageBytes(self), _MFMIDIMessageBytes(other), self.length) == 0;
 }
 
 //---------------------------------------------------------------------
@@ -204,13 +298,24 @@
     switch (self.type) {
         case kMFMIDIMessageTypeSysex:
             typeName = @"Sysex";
-            dataInfo = [self _hexStringForData:self.data maxByteCount:20];
+            dataInfo = [self _hexStringForBytes:_MFMIDIMessageBytes(self) length:self.length maxByteCount:20];
             goto rawstyle;
         
         default:
             typeName = @"Unknown";
-            dataInfo = [self _hexStringForData:self.data maxByteCount:20];
+            dataInfo = [self _hexStringForBytes:_MFMIDIMessageBytes(self) length:self.length maxByteCount:20];
             goto rawstyle;
+        
+        case kMFMIDIMessageTypeMTCQuarterFrame:  typeName = @"MTC Quarter Frame"; goto systemstyle;
+        case kMFMIDIMessageTypeSongPosition:     typeName = @"Song Position"; goto systemstyle;
+        case kMFMIDIMessageTypeSongSelect:       typeName = @"Song Select"; goto systemstyle;
+        case kMFMIDIMessageTypeTuneRequest:      typeName = @"Tune Request"; goto systemstyle;
+        case kMFMIDIMessageTypeTimingClock:      typeName = @"Timing Clock"; goto systemstyle;
+        case kMFMIDIMessageTypeStart:            typeName = @"Start"; goto systemstyle;
+        case kMFMIDIMessageTypeContinue:         typeName = @"Continue"; goto systemstyle;
+        case kMFMIDIMessageTypeStop:             typeName = @"Stop"; goto systemstyle;
+        case kMFMIDIMessageTypeActiveSensing:    typeName = @"Active Sensing"; goto systemstyle;
+        case kMFMIDIMessageTypeSystemReset:      typeName = @"System Reset"; goto systemstyle;
             
         case kMFMIDIMessageTypeChannelAftertouch:
             typeName = @"Channel Aftertouch";
@@ -251,7 +356,7 @@
     
 friendlystyle:
     if(self.type != kMFMIDIMessageTypeSysex && self.length > 3) {
-        dataInfo = [dataInfo stringByAppendingString:[self _hexStringForData:self.data maxByteCount:20]];
+        dataInfo = [dataInfo stringByAppendingString:[self _hexStringForBytes:_MFMIDIMessageBytes(self) length:self.length maxByteCount:20]];
     }
     return [NSString stringWithFormat:@"<%@: ch=%i, %@>", typeName, (int)self.channel, dataInfo];
 
@@ -259,6 +364,9 @@ friendlystyle:
 rawstyle:
     return [NSString stringWithFormat:@"<%@ status=0x%x, length=0x%lx, %@>", typeName, self.status, (unsigned long)self.length, dataInfo];
 
+systemstyle:
+    return [NSString stringWithFormat:@"<%@: %@>", typeName, [self _hexStringForBytes:_MFMIDIMessageBytes(self) length:self.length maxByteCount:20]];
+
 }
 
 
@@ -271,7 +379,7 @@ rawstyle:
 {
     if(!self.length) return YES;
     for(NSUInteger i=0;i<self.length;++i) {
-        if(self.bytes[i]) return NO;
+        if(_MFMIDIMessageBytes(self)[i]) return NO;
     }
     return YES;
 }
@@ -280,12 +388,12 @@ rawstyle:
 
 - (NSUInteger)length
 {
-    return self.data.length;
+    return _data ? _data.length : _value.length;
 }
 
 //---------------------------------------------------------------------
 
-- (UInt8)channel { return self.length ? (self.status & 0x0F) : 0; }
+- (UInt8)channel { return (self.length && self.status < 0xF0) ? (self.status & 0x0F) : 0; }
 
 - (void)setChannel:(UInt8)channel
 {
@@ -298,17 +406,20 @@ rawstyle:
 
 - (MFMIDIMessageType)type
 {
-    return self.length ? (MFMIDIMessageType)(self.status & 0xF0) : 0;
+    if (!self.length) return 0;
+    UInt8 status = self.status;
+    return (MFMIDIMessageType)(status < 0xF0 ? (status & 0xF0) : status);
 }
 
 - (void)setType:(MFMIDIMessageType)type
 {
-    [self setByte:(type | self.channel) atIndex:0];
+    // System messages have no channel
+    [self setByte:(type >= 0xF0 ? type : (type | self.channel)) atIndex:0];
 }
 
 //---------------------------------------------------------------------
 
-- (UInt8)status { return self.length ? self.bytes[0] : 0; }
+- (UInt8)status { return self.length ? _MFMIDIMessageBytes(self)[0] : 0; }
 
 - (void)setStatus:(UInt8)status
 {
@@ -318,9 +429,9 @@ rawstyle:
 //---------------------------------------------------------------------
 
 // All these are the same
-- (UInt8)key { return self.length > 1 ? self.bytes[1] : 0; }
-- (UInt8)controller { return self.length > 1 ? self.bytes[1] : 0; }
-- (UInt8)data1 { return self.length > 1 ? self.bytes[1] : 0; }
+- (UInt8)key { return self.length > 1 ? _MFMIDIMessageBytes(self)[1] : 0; }
+- (UInt8)controller { return self.length > 1 ? _MFMIDIMessageBytes(self)[1] : 0; }
+- (UInt8)data1 { return self.length > 1 ? _MFMIDIMessageBytes(self)[1] : 0; }
 
 - (void)setKey:(UInt8)val { [self setByte:val & 0x7f atIndex:1]; }
 - (void)setController:(UInt8)val { [self setByte:val & 0x7f atIndex:1]; }
@@ -328,12 +439,12 @@ rawstyle:
 
 //---------------------------------------------------------------------
 
-- (UInt8)velocity { return self.length > 2 ? self.bytes[2] : 0; }
-- (UInt8)value { return self.length > 2 ? self.bytes[2] : 0; }
-- (UInt8)programNumber { return self.length > 2 ? self.bytes[2] : 0; }
-- (UInt8)channelPressure { return self.length > 2 ? self.bytes[2] : 0; }
-- (UInt8)keyPressure { return self.length > 2 ? self.bytes[2] : 0; }
-- (UInt8)data2 { return self.length > 2 ? self.bytes[2] : 0; }
+- (UInt8)velocity { return self.length > 2 ? _MFMIDIMessageBytes(self)[2] : 0; }
+- (UInt8)value { return self.length > 2 ? _MFMIDIMessageBytes(self)[2] : 0; }
+- (UInt8)programNumber { return self.length > 2 ? _MFMIDIMessageBytes(self)[2] : 0; }
+- (UInt8)channelPressure { return self.length > 2 ? _MFMIDIMessageBytes(self)[2] : 0; }
+- (UInt8)keyPressure { return self.length > 2 ? _MFMIDIMessageBytes(self)[2] : 0; }
+- (UInt8)data2 { return self.length > 2 ? _MFMIDIMessageBytes(self)[2] : 0; }
 
 - (void)setVelocity:(UInt8)val { [self setByte:val & 0x7f atIndex:2]; }
 - (void)setValue:(UInt8)val { [self setByte:val & 0x7f atIndex:2]; }
@@ -344,8 +455,8 @@ rawstyle:
 
 //---------------------------------------------------------------------
 
-- (UInt16)doublePrecisionValue { return (self.bytes[2] << 7) + self.bytes[1]; }
-- (UInt16)pitchbendValue { return (self.bytes[2] << 7) + self.bytes[1]; }
+- (UInt16)doublePrecisionValue { return (_MFMIDIMessageBytes(self)[2] << 7) + _MFMIDIMessageBytes(self)[1]; }
+- (UInt16)pitchbendValue { return (_MFMIDIMessageBytes(self)[2] << 7) + _MFMIDIMessageBytes(self)[1]; }
 
 - (void)setDoublePrecisionValue:(UInt16)value
 {
@@ -360,11 +471,35 @@ rawstyle:
 
 //---------------------------------------------------------------------
 
-- (NSMutableData *)data { return _data; }
+- (NSMutableData *)data
+{
+    // Move over to out-of-line storage for good as the caller may mutate it
+    if (!_data) {
+        _data = [NSMutableData dataWithBytes:_value.inlineBytes length:_value.length];
+    }
+    [self _shareStorage];
+    return _data;
+}
 
 //---------------------------------------------------------------------
 
-- (UInt8 *)bytes { return (UInt8 *)_data.mutableBytes; }
+- (UInt8 *)bytes
+{
+    [self _shareStorage];
+    return _data ? (UInt8 *)_data.mutableBytes : _value.inlineBytes;
+}
+
+//---------------------------------------------------------------------
+
+- (MFMIDIMessageValue)messageValue
+{
+    if (!_data) return _value;
+    
+    MFMIDIMessageValue value = MFMIDIMessageValueMakeWithBytes(NULL, 0);
+    value.length = (uint32_t)_data.length;
+    value.outOfLineBytes = _data.bytes;
+    return value;
+}
 
 
 /////////////////////////////////////////////////////////////////////////
@@ -374,11 +509,24 @@ rawstyle:
 
 - (void)setByte:(UInt8)byte atIndex:(NSUInteger)idx
 {
-    if (idx >= self.length)
+    [self _invalidatePacketLists];
+    
+    // Fast path: stays inline
+    if (!_data && idx < kMFMIDIMessageValueInlineCapacity)
     {
-        [self.data setLength:idx+1];
+        _value.inlineBytes[idx] = byte;
+        if (idx >= _value.length) _value.length = (uint32_t)idx + 1;
+        return;
+    }
+    
+    // Out-of-line, but still ours alone unless it was already shared
+    if (!_data) {
+        _data = [NSMutableData dataWithBytes:_value.inlineBytes length:_value.length];
+    }
+    if (idx >= _data.length) {
+        _data.length = idx + 1;
     }
-    self.bytes[idx] = byte;
+    ((UInt8 *)_data.mutableBytes)[idx] = byte;
 }
 
 //---------------------------------------------------------------------
@@ -395,29 +543,105 @@ rawstyle:
 
 - (void)toMIDIPacketList:(void (^)(MIDIPacketList *))packetListHandler
 {
-    // Form a MIDIPacketList (thanks PGMIDI!)
-    NSParameterAssert(self.length < 65536);
-    Byte packetBuffer[self.length + 100];
-    MIDIPacketList *packetList = (MIDIPacketList *)packetBuffer;
-    MIDIPacket     *packet     = MIDIPacketListInit(packetList);
+    const NSUInteger length = self.length;
+    const Byte *lists = _storageShared ? NULL : [self _encodedPacketLists];
+    if (lists)
+    {
+        for (NSUInteger i=0; i<_MFPacketListChunkCount(length); ++i) {
+            packetListHandler((MIDIPacketList *)(lists + i * _PACKET_LIST_CHUNK_SIZE));
+        }
+        return;
+    }
     
-    packet = MIDIPacketListAdd(packetList, sizeof(packetBuffer), packet, 0, self.length, self.bytes);
+    // The bytes could change behind our back, or another send is encoding the cached copy, so encode them afresh in a fixed stack buffer whatever the length. Longer messages go out as consecutive chunks
+    Byte packetBuffer[_PACKET_LIST_CHUNK_SIZE] __attribute__((aligned(8)));
+    MIDIPacketList *packetList = (MIDIPacketList *)packetBuffer;
     
-    packetListHandler(packetList);
+    const UInt8 *bytes = _MFMIDIMessageBytes(self);
+    size_t offset = 0;
+    while (MFMIDIPacketListFillChunk(packetList, sizeof(packetBuffer), 0, bytes, length, &offset)) {
+        packetListHandler(packetList);
+    }
 }
 
 /////////////////////////////////////////////////////////////////////////
 #pragma mark - Additional Privates
 /////////////////////////////////////////////////////////////////////////
 
-- (NSString *)_hexStringForData:(NSData *)data maxByteCount:(NSUInteger)max
+/**
+ Encodes the packet lists on first use, chunks `_PACKET_LIST_CHUNK_SIZE` apart, and publishes them only once they're complete.
+ 
+ Concurrent first sends of a long message may both encode; one's copy is published and the other's freed. For a short message the first to claim `_inlinePacketList` encodes into it and the others get NULL, so they encode on their own stacks rather than write to it while it's being read.
+ @return NULL for an empty message, when another send holds the inline list or if out of memory
+ */
+- (const Byte *)_encodedPacketLists
+{
+    Byte *lists = atomic_load_explicit(&_packetLists, memory_order_acquire);
+    if (lists) return lists;
+    
+    const NSUInteger length = self.length;
+    const NSUInteger count = _MFPacketListChunkCount(length);
+    if (!count) return NULL;
+    
+    // All chunks but the last are full. That one only needs room for what's left
+    const size_t lastListSize = _PACKET_LIST_HEADER_SIZE + (length - (count - 1) * _PACKET_LIST_CHUNK_DATA_SIZE);
+    if (_data) {
+        lists = malloc((count - 1) * _PACKET_LIST_CHUNK_SIZE + lastListSize);
+        if (!lists) return NULL;
+    } else {
+        bool unclaimed = false;
+        if (!atomic_compare_exchange_strong_explicit(&_inlinePacketListClaimed, &unclaimed, true, memory_order_acq_rel, memory_order_relaxed)) {
+            return NULL;
+        }
+        lists = (Byte *)_inlinePacketList;
+    }
+    
+    const UInt8 *bytes = _MFMIDIMessageBytes(self);
+    size_t offset = 0;
+    for (NSUInteger i=0; i<count; ++i) {
+        const size_t listSize = (i < count - 1) ? _PACKET_LIST_CHUNK_SIZE : lastListSize;
+        MFMIDIPacketListFillChunk((MIDIPacketList *)(lists + i * _PACKET_LIST_CHUNK_SIZE), listSize, 0, bytes, length, &offset);
+    }
+    
+    // The claim makes the inline list ours alone, so only malloc'd ones can lose
+    Byte *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&_packetLists, &expected, lists, memory_order_acq_rel, memory_order_acquire))
+    {
+        free(lists);
+        return expected;
+    }
+    return lists;
+}
+
+//---------------------------------------------------------------------
+
+/** Not thread safe with sends of the message, as no mutation is */
+- (void)_invalidatePacketLists
+{
+    Byte *lists = atomic_exchange_explicit(&_packetLists, NULL, memory_order_acq_rel);
+    if (lists && lists != (Byte *)_inlinePacketList) free(lists);
+    atomic_store_explicit(&_inlinePacketListClaimed, false, memory_order_release);
+}
+
+//---------------------------------------------------------------------
+
+/** Someone outside can write the bytes from now on so the cache can't be trusted to be current */
+- (void)_shareStorage
+{
+    _storageShared = YES;
+    [self _invalidatePacketLists];
+}
+
+//---------------------------------------------------------------------
+
+- (NSString *)_hexStringForBytes:(const UInt8 *)bytes length:(NSUInteger)length maxByteCount:(NSUInteger)max
 {
     NSMutableString *str = [NSMutableString string];
     
-    for(NSUInteger i=0;i<MIN(max, data.length); ++i) {
-        BOOL atDataEnd = (i == (data.length - 1));
+    for(NSUInteger i=0;i<MIN(max, length); ++i) {
+        BOOL atDataEnd = (i == (length - 1));
         BOOL atMax = (i == (max - 1));
-        [str appendFormat:@"0x%02X%@", ((unsigned char *)data.bytes)[i], (atMax && !atDataEnd) ? @", ..." : (atDataEnd ? @"" : @" ")];
+        [str appendFormat:@"0x%02X%@", bytes[i], (atMax && !atDataEnd) ? @", ..." : (atDataEnd ? @"" : @" ")];
     }
     
     return str;
@@ -0,0 +1,185 @@
+//
+//  MFMIDIMessageValue.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIMessageValue_h
+#define MIDIFish_MFMIDIMessageValue_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Plain C value-type message for the send hot path.
+
+ Channel voice and short system messages (<= 3 bytes) are held inline so they can be built on the stack and sent without touching the heap. Anything longer (ie sysex) points out-of-line to bytes owned by someone else - the value does NOT retain or copy them so the bytes need to outlive it.
+
+ `MFMIDIMessage` is a thin ObjC wrapper around this. Use it directly from C/ObjC++ or via `-[MFMIDISession sendMIDIMessageValue:]` / `MFMIDISessionSendMessageValue()`. C++ can build them at compile time with MFMIDIEncoder.h.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** Max bytes held inline. Enough for any MIDI 1.0 message other than sysex */
+#define kMFMIDIMessageValueInlineCapacity 3
+
+typedef struct MFMIDIMessageValue {
+    uint32_t length;
+    uint8_t inlineBytes[kMFMIDIMessageValueInlineCapacity];
+    const uint8_t *outOfLineBytes;      // NULL unless length > inline capacity. Not owned.
+} MFMIDIMessageValue;
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Protocol Helpers
+/////////////////////////////////////////////////////////////////////////
+
+/** Full length of a message in bytes (status included) given its status byte. 0 for sysex (variable length) and for data bytes (ie not a status) */
+static inline uint32_t MFMIDIMessageLengthForStatus(uint8_t status)
+{
+    if (status < 0x80) return 0;
+    if (status < 0xF0) {
+        // Program Change and Channel Aftertouch are the two 2-byte voice messages
+        uint8_t type = status & 0xF0;
+        return (type == 0xC0 || type == 0xD0) ? 2 : 3;
+    }
+    switch (status) {
+        case 0xF1: case 0xF3: return 2;     // MTC quarter frame, Song Select
+        case 0xF2: return 3;                // Song Position
+        case 0xF0: return 0;                // Sysex
+        default: return 1;                  // Tune request, EOX, realtime and undefined
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Construction
+/////////////////////////////////////////////////////////////////////////
+
+/** Raw construction. Length is derived from the status byte. Data bytes are masked to 7bit */
+static inline MFMIDIMessageValue MFMIDIMessageValueMake(uint8_t status, uint8_t data1, uint8_t data2)
+{
+    MFMIDIMessageValue v;
+    uint32_t len = MFMIDIMessageLengthForStatus(status);
+    v.length = len ? len : 1;
+    v.inlineBytes[0] = status;
+    v.inlineBytes[1] = len > 1 ? (data1 & 0x7F) : 0;
+    v.inlineBytes[2] = len > 2 ? (data2 & 0x7F) : 0;
+    v.outOfLineBytes = NULL;
+    return v;
+}
+
+/** Wraps (does NOT copy) an arbitrary byte buffer, usually sysex. Buffers short enough to fit are copied inline instead */
+static inline MFMIDIMessageValue MFMIDIMessageValueMakeWithBytes(const uint8_t *bytes, uint32_t length)
+{
+    MFMIDIMessageValue v = { 0, { 0, 0, 0 }, NULL };
+    v.length = length;
+    if (length <= kMFMIDIMessageValueInlineCapacity) {
+        for (uint32_t i = 0; i < length; i++) v.inlineBytes[i] = bytes[i];
+    } else {
+        v.outOfLineBytes = bytes;
+    }
+    return v;
+}
+
+/** Builds a channel voice message with a known length directly, rather than looking it up from the status as MFMIDIMessageValueMake() does. With the session's current channel it comes down to a few stores */
+static inline MFMIDIMessageValue _MFMIDIMessageValueMakeVoice(uint8_t type, uint32_t length, uint8_t channel, uint8_t data1, uint8_t data2)
+{
+    MFMIDIMessageValue v = { length, { (uint8_t)(type | (channel & 0x0F)), (uint8_t)(data1 & 0x7F), (uint8_t)(data2 & 0x7F) }, NULL };
+    return v;
+}
+
+/** Channel voice convenience constructors. Channel is 0-15, values 7bit except where noted @{ */
+static inline MFMIDIMessageValue MFMIDIMessageValueMakeNoteOn(uint8_t channel, uint8_t key, uint8_t velocity)
+{
+    return _MFMIDIMessageValueMakeVoice(0x90, 3, channel, key, velocity);
+}
+
+static inline MFMIDIMessageValue MFMIDIMessageValueMakeNoteOff(uint8_t channel, uint8_t key, uint8_t velocity)
+{
+    return _MFMIDIMessageValueMakeVoice(0x80, 3, channel, key, velocity);
+}
+
+static inline MFMIDIMessageValue MFMIDIMessageValueMakePolyphonicAftertouch(uint8_t channel, uint8_t key, uint8_t pressure)
+{
+    return _MFMIDIMessageValueMakeVoice(0xA0, 3, channel, key, pressure);
+}
+
+static inline MFMIDIMessageValue MFMIDIMessageValueMakeControlChange(uint8_t channel, uint8_t controller, uint8_t value)
+{
+    return _MFMIDIMessageValueMakeVoice(0xB0, 3, channel, controller, value);
+}
+
+static inline MFMIDIMessageValue MFMIDIMessageValueMakeProgramChange(uint8_t channel, uint8_t programNumber)
+{
+    return _MFMIDIMessageValueMakeVoice(0xC0, 2, channel, programNumber, 0);
+}
+
+static inline MFMIDIMessageValue MFMIDIMessageValueMakeChannelAftertouch(uint8_t channel, uint8_t pressure)
+{
+    return _MFMIDIMessageValueMakeVoice(0xD0, 2, channel, pressure, 0);
+}
+
+/** 14bit value 0-16383. 8192 = center */
+static inline MFMIDIMessageValue MFMIDIMessageValueMakePitchbend(uint8_t channel, uint16_t value)
+{
+    return _MFMIDIMessageValueMakeVoice(0xE0, 3, channel, value & 0x7F, (value >> 7) & 0x7F);
+}
+/** @} */
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Accessors
+/////////////////////////////////////////////////////////////////////////
+
+/** Pointer to the message bytes, inline or out-of-line. Only valid for as long as the value (and any out-of-line buffer) is */
+static inline const uint8_t *MFMIDIMessageValueGetBytes(const MFMIDIMessageValue *v)
+{
+    return v->outOfLineBytes ? v->outOfLineBytes : v->inlineBytes;
+}
+
+static inline bool MFMIDIMessageValueIsInline(const MFMIDIMessageValue *v)
+{
+    return v->outOfLineBytes == NULL;
+}
+
+static inline uint8_t MFMIDIMessageValueGetStatus(const MFMIDIMessageValue *v)
+{
+    return v->length ? MFMIDIMessageValueGetBytes(v)[0] : 0;
+}
+
+/** The type nibble for channel messages (0x80-0xE0) or the full status for system ones */
+static inline uint8_t MFMIDIMessageValueGetType(const MFMIDIMessageValue *v)
+{
+    uint8_t status = MFMIDIMessageValueGetStatus(v);
+    return status < 0xF0 ? (status & 0xF0) : status;
+}
+
+static inline uint8_t MFMIDIMessageValueGetChannel(const MFMIDIMessageValue *v)
+{
+    return MFMIDIMessageValueGetStatus(v) & 0x0F;
+}
+
+static inline uint8_t MFMIDIMessageValueGetData1(const MFMIDIMessageValue *v)
+{
+    return v->length > 1 ? MFMIDIMessageValueGetBytes(v)[1] : 0;
+}
+
+static inline uint8_t MFMIDIMessageValueGetData2(const MFMIDIMessageValue *v)
+{
+    return v->length > 2 ? MFMIDIMessageValueGetBytes(v)[2] : 0;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
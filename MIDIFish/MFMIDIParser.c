@@ -0,0 +1,221 @@
+//
+//  MFMIDIParser.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIParser.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Status Table
+/////////////////////////////////////////////////////////////////////////
+
+/** Per-status info packed into a byte: the low nibble is the full message length (0 = variable) and the high bits classify it. Indexed by (status - 0x80) */
+enum {
+    _kSetsRunningStatus     = 0x10,
+    _kClearsRunningStatus   = 0x20,
+    _kSysexStart            = 0x40,
+    _kRealtime              = 0x80,
+    _kLengthMask            = 0x0F
+};
+
+#define _V3     (_kSetsRunningStatus | 3)
+#define _V2     (_kSetsRunningStatus | 2)
+#define _ROW(x) x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x
+
+static const uint8_t _kStatusInfo[128] = {
+    _ROW(_V3),      // 0x80 Note Off
+    _ROW(_V3),      // 0x90 Note On
+    _ROW(_V3),      // 0xA0 Poly Aftertouch
+    _ROW(_V3),      // 0xB0 Control Change
+    _ROW(_V2),      // 0xC0 Program Change
+    _ROW(_V2),      // 0xD0 Channel Aftertouch
+    _ROW(_V3),      // 0xE0 Pitchbend
+
+    _kSysexStart | _kClearsRunningStatus,   // 0xF0 Sysex
+    _kClearsRunningStatus | 2,              // 0xF1 MTC Quarter Frame
+    _kClearsRunningStatus | 3,              // 0xF2 Song Position
+    _kClearsRunningStatus | 2,              // 0xF3 Song Select
+    _kClearsRunningStatus | 1,              // 0xF4 undefined
+    _kClearsRunningStatus | 1,              // 0xF5 undefined
+    _kClearsRunningStatus | 1,              // 0xF6 Tune Request
+    _kClearsRunningStatus | 1,              // 0xF7 EOX (stray ones are handled separately)
+    _kRealtime | 1,                         // 0xF8 Timing Clock
+    _kRealtime | 1,                         // 0xF9 undefined
+    _kRealtime | 1,                         // 0xFA Start
+    _kRealtime | 1,                         // 0xFB Continue
+    _kRealtime | 1,                         // 0xFC Stop
+    _kRealtime | 1,                         // 0xFD undefined
+    _kRealtime | 1,                         // 0xFE Active Sensing
+    _kRealtime | 1                          // 0xFF System Reset
+};
+
+#undef _V3
+#undef _V2
+#undef _ROW
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Privates
+/////////////////////////////////////////////////////////////////////////
+
+static inline void _MFMIDIParserEmit(MFMIDIParser *parser, const uint8_t *bytes, uint32_t length, uint32_t sysexFlags, uint64_t timestamp)
+{
+    MFMIDIParserEvent event;
+    event.message = MFMIDIMessageValueMakeWithBytes(bytes, length);
+    event.sysexFlags = sysexFlags;
+    event.timestamp = timestamp;
+    parser->callback(&event, parser->context);
+}
+
+//---------------------------------------------------------------------
+
+/** Delivers [start, end) as a sysex fragment. Empty fragments are skipped unless they terminate the sysex */
+static inline void _MFMIDIParserEmitSysexFragment(MFMIDIParser *parser, const uint8_t *start, const uint8_t *end, uint32_t endFlags, uint64_t timestamp)
+{
+    uint32_t length = (uint32_t)(end - start);
+    if (!length && !endFlags) return;
+
+    uint32_t flags = endFlags;
+    if (parser->sysexLength == 0) flags |= kMFMIDIParserSysexBegins;
+    parser->sysexLength += length;
+
+    _MFMIDIParserEmit(parser, start, length, flags, timestamp);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Public Functions
+/////////////////////////////////////////////////////////////////////////
+
+void MFMIDIParserInit(MFMIDIParser *parser, MFMIDIParserCallback callback, void *context)
+{
+    parser->callback = callback;
+    parser->context = context;
+    parser->droppedByteCount = 0;
+    MFMIDIParserReset(parser);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIParserReset(MFMIDIParser *parser)
+{
+    parser->runningStatus = 0;
+    parser->pendingLength = 0;
+    parser->expectedLength = 0;
+    parser->inSysex = false;
+    parser->sysexLength = 0;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIParserFeed(MFMIDIParser *parser, const uint8_t *bytes, size_t length, uint64_t timestamp)
+{
+    // Start of the sysex fragment within *this* buffer. A sysex continuing from a previous feed starts at the top
+    const uint8_t *sysexStart = bytes;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        const uint8_t byte = bytes[i];
+
+        /////////////////////////////////////////
+        // DATA BYTES
+        /////////////////////////////////////////
+
+        if (byte < 0x80)
+        {
+            if (parser->inSysex) continue;     // delivered in bulk as part of the fragment
+
+            if (!parser->expectedLength)
+            {
+                // Running status
+                if (!parser->runningStatus) {
+                    parser->droppedByteCount++;
+                    continue;
+                }
+                parser->pending[0] = parser->runningStatus;
+                parser->pendingLength = 1;
+                parser->expectedLength = _kStatusInfo[parser->runningStatus - 0x80] & _kLengthMask;
+            }
+
+            parser->pending[parser->pendingLength++] = byte;
+            if (parser->pendingLength == parser->expectedLength) {
+                _MFMIDIParserEmit(parser, parser->pending, parser->pendingLength, 0, timestamp);
+                parser->expectedLength = 0;
+            }
+            continue;
+        }
+
+        /////////////////////////////////////////
+        // STATUS BYTES
+        /////////////////////////////////////////
+
+        const uint8_t info = _kStatusInfo[byte - 0x80];
+
+        // Realtime may interrupt anything without affecting it. Split the sysex fragment around it if need be
+        if (info & _kRealtime)
+        {
+            if (parser->inSysex) {
+                _MFMIDIParserEmitSysexFragment(parser, sysexStart, &bytes[i], 0, timestamp);
+                sysexStart = &bytes[i + 1];
+            }
+            _MFMIDIParserEmit(parser, &bytes[i], 1, 0, timestamp);
+            continue;
+        }
+
+        // Any other status ends a sysex. EOX properly, anything else truncates it
+        if (parser->inSysex)
+        {
+            parser->inSysex = false;
+            if (byte == 0xF7) {
+                _MFMIDIParserEmitSysexFragment(parser, sysexStart, &bytes[i + 1], kMFMIDIParserSysexEnds, timestamp);
+                continue;
+            }
+            _MFMIDIParserEmitSysexFragment(parser, sysexStart, &bytes[i], kMFMIDIParserSysexEnds | kMFMIDIParserSysexTruncated, timestamp);
+        }
+
+        // Anything partially collected is abandoned
+        parser->expectedLength = 0;
+        parser->pendingLength = 0;
+        parser->runningStatus = (info & _kSetsRunningStatus) ? byte : 0;
+
+        if (info & _kSysexStart)
+        {
+            parser->inSysex = true;
+            parser->sysexLength = 0;
+            sysexStart = &bytes[i];
+            continue;
+        }
+
+        if (byte == 0xF7) {
+            parser->droppedByteCount++;     // stray EOX
+            continue;
+        }
+
+        const uint8_t expected = info & _kLengthMask;
+        if (expected == 1) {
+            _MFMIDIParserEmit(parser, &bytes[i], 1, 0, timestamp);
+        } else {
+            parser->pending[0] = byte;
+            parser->pendingLength = 1;
+            parser->expectedLength = expected;
+        }
+    }
+
+    // Hand over what we have of an unfinished sysex. It continues on the next feed
+    if (parser->inSysex) {
+        _MFMIDIParserEmitSysexFragment(parser, sysexStart, &bytes[length], 0, timestamp);
+    }
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIParserFlush(MFMIDIParser *parser, uint64_t timestamp)
+{
+    if (parser->inSysex) {
+        parser->inSysex = false;
+        _MFMIDIParserEmitSysexFragment(parser, NULL, NULL, kMFMIDIParserSysexEnds | kMFMIDIParserSysexTruncated, timestamp);
+    }
+    parser->pendingLength = 0;
+    parser->expectedLength = 0;
+}
@@ -0,0 +1,86 @@
+//
+//  MFMIDIParser.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIParser_h
+#define MIDIFish_MFMIDIParser_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "MFMIDIMessageValue.h"
+
+/**
+ Incremental MIDI 1.0 byte stream parser. Plain C with no platform dependencies.
+
+ Feed it buffers (eg one per MIDIPacket) and it calls back once per message. State carries over between feeds so running status, messages split across packets and multi-packet sysex all work. It never allocates.
+
+ - Channel messages are delivered as inline `MFMIDIMessageValue`s (running status is expanded so the status byte is always present)
+ - System common and realtime messages are delivered too. Realtime bytes may appear anywhere, including inside other messages and sysex, and are delivered at the point they occur
+ - Sysex is delivered as one or more fragments which point directly into the buffer you fed in (no copying). See `MFMIDIParserSysexFlags`. The pointer is only valid for the duration of the callback.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** Describes which part of a sysex message a fragment is. A complete sysex within one buffer has both Begins and Ends. Neither means it's a middle fragment */
+typedef enum MFMIDIParserSysexFlags {
+    kMFMIDIParserSysexNone      = 0,
+    kMFMIDIParserSysexBegins    = 1 << 0,   // fragment starts with 0xF0
+    kMFMIDIParserSysexEnds      = 1 << 1,   // last fragment of this sysex
+    kMFMIDIParserSysexTruncated = 1 << 2    // ended without an EOX (0xF7), ie interrupted by another status or flushed
+} MFMIDIParserSysexFlags;
+
+typedef struct MFMIDIParserEvent {
+    MFMIDIMessageValue message;
+    uint32_t sysexFlags;                    // MFMIDIParserSysexFlags. 0 for non-sysex messages
+    uint64_t timestamp;                     // As passed to MFMIDIParserFeed
+} MFMIDIParserEvent;
+
+typedef void (*MFMIDIParserCallback)(const MFMIDIParserEvent *event, void *context);
+
+/** Treat as opaque. It's only public so it can live on the stack or inline in another struct */
+typedef struct MFMIDIParser {
+    MFMIDIParserCallback callback;
+    void *context;
+
+    uint8_t runningStatus;                  // 0 when none
+    uint8_t pending[3];                     // the channel/common message being collected
+    uint8_t pendingLength;
+    uint8_t expectedLength;                 // 0 when not collecting
+
+    bool inSysex;
+    uint32_t sysexLength;                   // total sysex bytes delivered so far (across feeds)
+
+    uint64_t droppedByteCount;              // orphaned data bytes with no status to apply to
+} MFMIDIParser;
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Functions
+/////////////////////////////////////////////////////////////////////////
+
+extern void MFMIDIParserInit(MFMIDIParser *parser, MFMIDIParserCallback callback, void *context);
+
+/** Forget running status and any partial message (without delivering it) */
+extern void MFMIDIParserReset(MFMIDIParser *parser);
+
+/** Parse the bytes, calling back for each complete message or sysex fragment */
+extern void MFMIDIParserFeed(MFMIDIParser *parser, const uint8_t *bytes, size_t length, uint64_t timestamp);
+
+/** Call when the stream ends (or you are about to discard the parser) to terminate any in-progress sysex with an empty Ends|Truncated fragment. Partial channel messages are dropped */
+extern void MFMIDIParserFlush(MFMIDIParser *parser, uint64_t timestamp);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
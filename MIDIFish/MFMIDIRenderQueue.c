@@ -0,0 +1,146 @@
+//
+//  MFMIDIRenderQueue.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIRenderQueue.h"
+#include "_MFRingBuffer.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+struct MFMIDIRenderQueue {
+    _MFRingBufferRef ring;
+    double ticksPerSecond;
+
+    // Producer only
+    uint64_t bufferHostTime;            // 0 for now
+    double ticksPerSample;
+
+    // Consumer only
+    MIDITimeStamp lastTimeStamp;
+
+    atomic_uint_fast64_t drainDroppedCount;     // too big for the batch. The ring counts its own
+
+    // Set before use
+    MFMIDIRenderQueueWakeFunction wake;
+    void *wakeContext;
+    atomic_bool sleeping;                       // consumer sets, first enqueue after clears and wakes
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+MFMIDIRenderQueueRef MFMIDIRenderQueueCreate(size_t capacity, uint32_t timebaseNumer, uint32_t timebaseDenom)
+{
+    MFMIDIRenderQueueRef queue = calloc(1, sizeof(struct MFMIDIRenderQueue));
+    if (!queue) return NULL;
+
+    queue->ring = _MFRingBufferCreate(capacity ? capacity : kMFMIDIRenderQueueDefaultCapacity);
+    if (!queue->ring) {
+        free(queue);
+        return NULL;
+    }
+
+    queue->ticksPerSecond = timebaseNumer && timebaseDenom ? 1e9 * timebaseDenom / timebaseNumer : 1e9;
+    atomic_init(&queue->drainDroppedCount, 0);
+    atomic_init(&queue->sleeping, false);
+    return queue;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIRenderQueueDestroy(MFMIDIRenderQueueRef queue)
+{
+    if (!queue) return;
+    _MFRingBufferDestroy(queue->ring);
+    free(queue);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIRenderQueueSetWakeFunction(MFMIDIRenderQueueRef queue, MFMIDIRenderQueueWakeFunction wake, void *context)
+{
+    queue->wake = wake;
+    queue->wakeContext = context;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Producer
+/////////////////////////////////////////////////////////////////////////
+
+void MFMIDIRenderQueueBeginBuffer(MFMIDIRenderQueueRef queue, uint64_t hostTime, double sampleRate)
+{
+    queue->bufferHostTime = hostTime;
+    if (sampleRate > 0) queue->ticksPerSample = queue->ticksPerSecond / sampleRate;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDIRenderQueueEnqueue(MFMIDIRenderQueueRef queue, uint32_t sampleOffset, const uint8_t *bytes, size_t length)
+{
+    if (!length) return true;
+
+    // Too long for any ring. Clamped so the ring drops and counts it
+    if (length > UINT32_MAX) length = UINT32_MAX;
+
+    const uint64_t timeStamp = queue->bufferHostTime ? queue->bufferHostTime + (uint64_t)(sampleOffset * queue->ticksPerSample) : 0;
+    const bool written = _MFRingBufferWrite(queue->ring, timeStamp, 0, 0, bytes, (uint32_t)length);
+
+    // Once per sleep. The fence pairs with the one in Sleep: either the consumer's last look at the ring sees this write or we see it sleeping
+    if (queue->wake) {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&queue->sleeping, memory_order_relaxed) && atomic_exchange_explicit(&queue->sleeping, false, memory_order_relaxed)) {
+            queue->wake(queue->wakeContext);
+        }
+    }
+    return written;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Consumer
+/////////////////////////////////////////////////////////////////////////
+
+size_t MFMIDIRenderQueueDrain(MFMIDIRenderQueueRef queue, MFMIDIBatch *batch)
+{
+    size_t count = 0;
+    _MFRingBufferRecord record;
+    while (_MFRingBufferPeek(queue->ring, &record))
+    {
+        // Packet lists have to be in time order
+        if (record.timestamp < queue->lastTimeStamp) MFMIDIBatchFlush(batch);
+        queue->lastTimeStamp = record.timestamp;
+
+        if (!MFMIDIBatchAddBytes(batch, record.timestamp, record.bytes, record.length)) {
+            atomic_fetch_add_explicit(&queue->drainDroppedCount, 1, memory_order_relaxed);
+        }
+        _MFRingBufferConsume(queue->ring);
+        count++;
+    }
+    return count;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDIRenderQueueSleep(MFMIDIRenderQueueRef queue)
+{
+    atomic_store_explicit(&queue->sleeping, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+//---------------------------------------------------------------------
+
+uint64_t MFMIDIRenderQueueDroppedCount(MFMIDIRenderQueueRef queue)
+{
+    _MFRingBufferStats stats;
+    _MFRingBufferGetStats(queue->ring, &stats);
+    return stats.droppedRecordCount + atomic_load_explicit(&queue->drainDroppedCount, memory_order_relaxed);
+}
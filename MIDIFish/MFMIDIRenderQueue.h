@@ -0,0 +1,98 @@
+//
+//  MFMIDIRenderQueue.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIRenderQueue_h
+#define MIDIFish_MFMIDIRenderQueue_h
+
+#include "MFMIDITypes.h"
+#include "MFMIDIBatch.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Hands MIDI generated in an audio render callback to a thread that can send it.
+
+ The render thread marks the start of each buffer with its host time and sample rate, then enqueues messages at sample offsets within it. Offsets become host time timestamps there and then and the bytes are copied into a fixed size ring, so enqueuing is wait-free: no locks, allocation, ObjC, logging or exceptions, and a bounded number of steps. If the ring is full the message is dropped and counted. Another thread drains it into an `MFMIDIBatch` and sends that, timestamps and all, so CoreMIDI plays each message at its sample.
+
+ One producer thread and one consumer thread at a time. Use a queue per render thread. `-[MFMIDISession createRenderQueue]` makes one the session drains for you.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MFMIDIRenderQueue *MFMIDIRenderQueueRef;
+
+/** Ring size when 0 is passed to create */
+#define kMFMIDIRenderQueueDefaultCapacity (64 * 1024)
+
+
+/**
+ @param capacity The ring, in bytes. 0 for kMFMIDIRenderQueueDefaultCapacity. Each message costs 24 bytes plus its length rounded up to 8
+ @param timebaseNumer Host ticks to ns, as mach_timebase_info. 0s for nanoseconds
+ @return NULL on allocation failure
+ */
+extern MFMIDIRenderQueueRef MFMIDIRenderQueueCreate(size_t capacity, uint32_t timebaseNumer, uint32_t timebaseDenom);
+
+/** Neither side may be using it */
+extern void MFMIDIRenderQueueDestroy(MFMIDIRenderQueueRef queue);
+
+/** Called on the render thread, so must be real-time safe too, eg. `dispatch_source_merge_data` */
+typedef void (*MFMIDIRenderQueueWakeFunction)(void *context);
+
+/** Lets a consumer stop polling while the queue's idle: the first enqueue after `MFMIDIRenderQueueSleep` calls `wake`. Set it before either side starts. NULL for none */
+extern void MFMIDIRenderQueueSetWakeFunction(MFMIDIRenderQueueRef queue, MFMIDIRenderQueueWakeFunction wake, void *context);
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Producer
+/////////////////////////////////////////////////////////////////////////
+
+/**
+ Start of a render buffer. Wait-free
+ @param hostTime When its first sample plays, ie. the render callback's AudioTimeStamp mHostTime. 0 sends what follows as soon as possible, ignoring the offsets
+ */
+extern void MFMIDIRenderQueueBeginBuffer(MFMIDIRenderQueueRef queue, uint64_t hostTime, double sampleRate);
+
+/**
+ Queue one or more whole messages (sysex included) to play `sampleOffset` samples into the current buffer. Wait-free, but for calling the wake function when the consumer's asleep. Enqueue in time order; the drain starts a new packet list when time goes backwards. Whatever doesn't fit the draining batch's buffer (kMFMIDIBatchDefaultBufferSize for the session's) is dropped then, so send sysex dumps with `sendSysex:...`
+ @return false if it was dropped as the ring is full
+ */
+extern bool MFMIDIRenderQueueEnqueue(MFMIDIRenderQueueRef queue, uint32_t sampleOffset, const uint8_t *bytes, size_t length);
+
+/** For the usual 1-3 byte message, its length going by `status`. Unused data bytes are ignored. @return false as above or for a sysex or data byte `status` */
+static inline bool MFMIDIRenderQueueEnqueueMessage(MFMIDIRenderQueueRef queue, uint32_t sampleOffset, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    const uint32_t length = MFMIDIMessageLengthForStatus(status);
+    if (!length) return false;
+    const uint8_t bytes[3] = { status, data1, data2 };
+    return MFMIDIRenderQueueEnqueue(queue, sampleOffset, bytes, length);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Consumer
+/////////////////////////////////////////////////////////////////////////
+
+/**
+ Moves everything queued into `batch` with its timestamp, flushing it first when time goes backwards. Doesn't flush at the end, so several queues can share a batch (flush between them to keep each list in order). Messages too big for the batch are dropped and counted
+ @return Number of enqueues drained
+ */
+extern size_t MFMIDIRenderQueueDrain(MFMIDIRenderQueueRef queue, MFMIDIBatch *batch);
+
+/** Arms the wake function for the next enqueue, once. Drain again after: whatever was enqueued before this won't wake you */
+extern void MFMIDIRenderQueueSleep(MFMIDIRenderQueueRef queue);
+
+/** Messages dropped so far, on either side. Safe from any thread */
+extern uint64_t MFMIDIRenderQueueDroppedCount(MFMIDIRenderQueueRef queue);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
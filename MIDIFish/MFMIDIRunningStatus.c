@@ -0,0 +1,235 @@
+//
+//  MFMIDIRunningStatus.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIRunningStatus.h"
+#include "MFMIDIMessageValue.h"
+#include "MFMIDIParser.h"
+#include <stdlib.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Encoding
+/////////////////////////////////////////////////////////////////////////
+
+#define _PUT(b) do { if (o == outCapacity) return 0; out[o++] = (b); } while (0)
+
+size_t MFMIDIRunningStatusEncode(const uint8_t *bytes, size_t length, uint8_t *out, size_t outCapacity, uint32_t options)
+{
+    size_t o = 0;
+    size_t i = 0;
+    uint8_t inStatus = 0;       // the input's running status
+    uint8_t outStatus = 0;      // what a receiver of the output has as its running status. Differs from inStatus after a note off conversion
+
+    while (i < length)
+    {
+        const uint8_t byte = bytes[i];
+
+        // Realtime can go anywhere and changes nothing
+        if (byte >= 0xF8) {
+            _PUT(byte);
+            i++;
+            continue;
+        }
+
+        // Sysex goes verbatim up to whatever ends it
+        if (byte == 0xF0)
+        {
+            _PUT(byte);
+            i++;
+            while (i < length && (bytes[i] < 0x80 || bytes[i] >= 0xF8)) {
+                _PUT(bytes[i]);
+                i++;
+            }
+            if (i < length && bytes[i] == 0xF7) {
+                _PUT(0xF7);
+                i++;
+            }
+            inStatus = outStatus = 0;
+            continue;
+        }
+
+        // Other system messages cancel running status. Their data bytes follow via the stray data path below
+        if (byte >= 0xF0) {
+            _PUT(byte);
+            i++;
+            inStatus = outStatus = 0;
+            continue;
+        }
+
+        // A channel message, with its status or using the input's running status
+        uint8_t status;
+        if (byte & 0x80) {
+            status = inStatus = byte;
+            i++;
+        } else if (inStatus) {
+            status = inStatus;
+        } else {
+            // Data with no channel status to apply to. Verbatim so a receiver makes of it what it would have anyway
+            _PUT(byte);
+            i++;
+            continue;
+        }
+
+        // Look ahead for the data, stepping over any interleaved realtime
+        const uint32_t dataLength = MFMIDIMessageLengthForStatus(status) - 1;
+        uint8_t data[2];
+        uint32_t n = 0;
+        size_t end = i;
+        while (n < dataLength && end < length)
+        {
+            const uint8_t b = bytes[end];
+            if (b >= 0xF8) {
+                end++;
+                continue;
+            }
+            if (b & 0x80) break;    // cut short by another status
+            data[n++] = b;
+            end++;
+        }
+
+        // Note off with the default velocity -> note on velocity 0, if the receiver is already in note on running status
+        uint8_t outByte = status;
+        bool converted = false;
+        if ((options & kMFMIDIRunningStatusOptionNoteOffAsNoteOn) &&
+            n == 2 && (status & 0xF0) == 0x80 && data[1] == 64 &&
+            outStatus == (0x90 | (status & 0x0F)))
+        {
+            outByte = outStatus;
+            converted = true;
+        }
+
+        if (outByte != outStatus) {
+            _PUT(outByte);
+            outStatus = outByte;
+        }
+
+        // Then the rest in its original order, realtime and all
+        for (uint32_t k = 0; i < end; i++) {
+            const uint8_t b = bytes[i];
+            if (b < 0x80 && ++k == 2 && converted) {
+                _PUT(0);
+            } else {
+                _PUT(b);
+            }
+        }
+
+        // A partial message gets abandoned by the receiver when the next status comes so that status mustn't be left out
+        if (n < dataLength) outStatus = 0;
+    }
+
+    return o;
+}
+
+#undef _PUT
+
+//---------------------------------------------------------------------
+
+bool MFMIDIRunningStatusEncodePacketList(const MIDIPacketList *packetList, MIDIPacketList *outPacketList, ByteCount outSize, uint32_t options)
+{
+    const uintptr_t end = (uintptr_t)outPacketList + outSize;
+    if (outSize < sizeof(UInt32)) return false;
+
+    // Output packets are never longer than their input so with enough room for the input, each starts no later than its input did
+    MIDIPacket *outPacket = MIDIPacketListInit(outPacketList);
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 0; i < packetList->numPackets; i++)
+    {
+        if ((uintptr_t)outPacket->data > end) return false;
+
+        const size_t capacity = end - (uintptr_t)outPacket->data;
+        const size_t length = MFMIDIRunningStatusEncode(packet->data, packet->length, outPacket->data, capacity, options);
+        if (!length && packet->length) return false;
+
+        outPacket->timeStamp = packet->timeStamp;
+        outPacket->length = (UInt16)length;
+        outPacketList->numPackets++;
+
+        outPacket = MIDIPacketNext(outPacket);
+        packet = MIDIPacketNext(packet);
+    }
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Verification
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    uint8_t *bytes;             // flags, length, message bytes... per event
+    size_t length;
+    size_t capacity;
+    uint32_t options;
+    bool failed;
+} _MFEventLog;
+
+static void _MFEventLogAppend(_MFEventLog *log, const void *bytes, size_t length)
+{
+    if (log->failed) return;
+    if (log->length + length > log->capacity)
+    {
+        size_t capacity = log->capacity ? log->capacity * 2 : 256;
+        while (capacity < log->length + length) capacity *= 2;
+        uint8_t *grown = realloc(log->bytes, capacity);
+        if (!grown) {
+            log->failed = true;
+            return;
+        }
+        log->bytes = grown;
+        log->capacity = capacity;
+    }
+    memcpy(&log->bytes[log->length], bytes, length);
+    log->length += length;
+}
+
+static void _MFEventLogCollect(const MFMIDIParserEvent *event, void *context)
+{
+    _MFEventLog *log = context;
+    const uint8_t *bytes = MFMIDIMessageValueGetBytes(&event->message);
+    uint8_t message[3];
+    const uint32_t length = event->message.length;
+
+    // Log both spellings of a default velocity note off the same way
+    if (!event->sysexFlags && length == 3 && (log->options & kMFMIDIRunningStatusOptionNoteOffAsNoteOn))
+    {
+        memcpy(message, bytes, 3);
+        if ((message[0] & 0xF0) == 0x90 && message[2] == 0) {
+            message[0] = 0x80 | (message[0] & 0x0F);
+            message[2] = 64;
+        }
+        bytes = message;
+    }
+
+    _MFEventLogAppend(log, &event->sysexFlags, sizeof(event->sysexFlags));
+    _MFEventLogAppend(log, &length, sizeof(length));
+    _MFEventLogAppend(log, bytes, length);
+}
+
+static bool _MFEventLogParse(_MFEventLog *log, const uint8_t *bytes, size_t length)
+{
+    MFMIDIParser parser;
+    MFMIDIParserInit(&parser, _MFEventLogCollect, log);
+    MFMIDIParserFeed(&parser, bytes, length, 0);
+    MFMIDIParserFlush(&parser, 0);
+    return !log->failed;
+}
+
+//---------------------------------------------------------------------
+
+bool MFMIDIRunningStatusVerify(const uint8_t *original, size_t originalLength, const uint8_t *encoded, size_t encodedLength, uint32_t options)
+{
+    _MFEventLog a = { NULL, 0, 0, options, false };
+    _MFEventLog b = { NULL, 0, 0, options, false };
+
+    bool same = _MFEventLogParse(&a, original, originalLength) &&
+                _MFEventLogParse(&b, encoded, encodedLength) &&
+                a.length == b.length &&
+                (!a.length || memcmp(a.bytes, b.bytes, a.length) == 0);
+
+    free(a.bytes);
+    free(b.bytes);
+    return same;
+}
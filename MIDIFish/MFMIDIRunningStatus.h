@@ -0,0 +1,56 @@
+//
+//  MFMIDIRunningStatus.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIRunningStatus_h
+#define MIDIFish_MFMIDIRunningStatus_h
+
+#include "MFMIDITypes.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Re-encodes outgoing MIDI with running status: a channel message with the same status byte as the one before it is sent without it, so a run of CCs on one channel costs 2 bytes each rather than 3. Optionally a note off with the default release velocity (64) becomes a note on with velocity 0, which means as much to any receiver and lets a stream of notes share a single status byte.
+
+ Running status never spans packets (CoreMIDI doesn't guarantee it survives between them) so the saving comes from packets holding several messages, ie batches and coalescer flushes. It's reset by sysex and system common messages. Realtime bytes pass through untouched, wherever they are.
+
+ The output is never longer than the input and always parses (with MFMIDIParser or anything else) to the same messages, see `MFMIDIRunningStatusVerify`. `MFMIDISession` applies it per destination class, see `networkRunningStatusEnabled`.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum MFMIDIRunningStatusOptions {
+    kMFMIDIRunningStatusOptionNone              = 0,
+    kMFMIDIRunningStatusOptionNoteOffAsNoteOn   = 1 << 0,   // 8n kk 40 -> 9n kk 00 when that saves a byte
+} MFMIDIRunningStatusOptions;
+
+
+/**
+ Encode one packet's worth of bytes. Any running status the input already uses is understood.
+ @param out Must not overlap `bytes`
+ @return The encoded length or 0 if it doesn't fit in `outCapacity` (which can't happen when it's >= `length`)
+ */
+extern size_t MFMIDIRunningStatusEncode(const uint8_t *bytes, size_t length, uint8_t *out, size_t outCapacity, uint32_t options);
+
+/**
+ Encode every packet of `packetList` into `outPacketList`, keeping the timestamps. Packets are never merged or split.
+ @return false if it doesn't fit in `outSize`. An `outSize` at least the size of the input always fits
+ */
+extern bool MFMIDIRunningStatusEncodePacketList(const MIDIPacketList *packetList, MIDIPacketList *outPacketList, ByteCount outSize, uint32_t options);
+
+/**
+ Parses both with MFMIDIParser and checks they produce the same messages, counting a note off with velocity 64 and a note on with velocity 0 as the same when `options` allows the conversion. For tests and benchmarks; it allocates.
+ */
+extern bool MFMIDIRunningStatusVerify(const uint8_t *original, size_t originalLength, const uint8_t *encoded, size_t encodedLength, uint32_t options);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
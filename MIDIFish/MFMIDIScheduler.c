@@ -0,0 +1,197 @@
+//
+//  MFMIDIScheduler.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIScheduler.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+static const size_t _kInitialCapacity = 256;
+
+/** Binary min-heap on (hostTime, sequence) */
+struct MFMIDIScheduler {
+    pthread_mutex_t lock;
+    MFMIDISchedulerEvent *heap;
+    size_t count;
+    size_t capacity;
+    uint64_t nextSequence;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Heap Privates
+/////////////////////////////////////////////////////////////////////////
+
+static inline bool _MFEventIsEarlier(const MFMIDISchedulerEvent *a, const MFMIDISchedulerEvent *b)
+{
+    return a->hostTime < b->hostTime || (a->hostTime == b->hostTime && a->sequence < b->sequence);
+}
+
+static void _MFHeapSiftUp(MFMIDISchedulerEvent *heap, size_t idx)
+{
+    MFMIDISchedulerEvent item = heap[idx];
+    while (idx > 0) {
+        size_t parent = (idx - 1) / 2;
+        if (!_MFEventIsEarlier(&item, &heap[parent])) break;
+        heap[idx] = heap[parent];
+        idx = parent;
+    }
+    heap[idx] = item;
+}
+
+static void _MFHeapSiftDown(MFMIDISchedulerEvent *heap, size_t count, size_t idx)
+{
+    MFMIDISchedulerEvent item = heap[idx];
+    for (;;) {
+        size_t child = idx * 2 + 1;
+        if (child >= count) break;
+        if (child + 1 < count && _MFEventIsEarlier(&heap[child + 1], &heap[child])) child++;
+        if (!_MFEventIsEarlier(&heap[child], &item)) break;
+        heap[idx] = heap[child];
+        idx = child;
+    }
+    heap[idx] = item;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+MFMIDISchedulerRef MFMIDISchedulerCreate(void)
+{
+    MFMIDISchedulerRef scheduler = calloc(1, sizeof(struct MFMIDIScheduler));
+    if (!scheduler) return NULL;
+
+    scheduler->heap = malloc(_kInitialCapacity * sizeof(MFMIDISchedulerEvent));
+    if (!scheduler->heap) {
+        free(scheduler);
+        return NULL;
+    }
+    scheduler->capacity = _kInitialCapacity;
+    pthread_mutex_init(&scheduler->lock, NULL);
+    return scheduler;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDISchedulerDestroy(MFMIDISchedulerRef scheduler)
+{
+    if (!scheduler) return;
+    MFMIDISchedulerRemoveAll(scheduler);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler->heap);
+    free(scheduler);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Public Functions
+/////////////////////////////////////////////////////////////////////////
+
+bool MFMIDISchedulerSchedule(MFMIDISchedulerRef scheduler, const MFMIDIMessageValue *message, uint64_t hostTime)
+{
+    MFMIDISchedulerEvent event;
+    event.hostTime = hostTime;
+    event.message = *message;
+
+    // Take ownership of long messages as the caller's buffer may be gone by the time we send
+    if (!MFMIDIMessageValueIsInline(message)) {
+        uint8_t *copy = malloc(message->length);
+        if (!copy) return false;
+        memcpy(copy, message->outOfLineBytes, message->length);
+        event.message.outOfLineBytes = copy;
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    if (scheduler->count == scheduler->capacity) {
+        size_t newCapacity = scheduler->capacity * 2;
+        MFMIDISchedulerEvent *newHeap = realloc(scheduler->heap, newCapacity * sizeof(MFMIDISchedulerEvent));
+        if (!newHeap) {
+            pthread_mutex_unlock(&scheduler->lock);
+            MFMIDISchedulerReleaseEvents(&event, 1);
+            return false;
+        }
+        scheduler->heap = newHeap;
+        scheduler->capacity = newCapacity;
+    }
+
+    event.sequence = scheduler->nextSequence++;
+    scheduler->heap[scheduler->count] = event;
+    _MFHeapSiftUp(scheduler->heap, scheduler->count);
+    scheduler->count++;
+
+    pthread_mutex_unlock(&scheduler->lock);
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+size_t MFMIDISchedulerPopDue(MFMIDISchedulerRef scheduler, uint64_t horizon, MFMIDISchedulerEvent *outEvents, size_t maxEvents)
+{
+    size_t popped = 0;
+
+    pthread_mutex_lock(&scheduler->lock);
+    while (popped < maxEvents && scheduler->count && scheduler->heap[0].hostTime <= horizon)
+    {
+        outEvents[popped++] = scheduler->heap[0];
+        scheduler->count--;
+        if (scheduler->count) {
+            scheduler->heap[0] = scheduler->heap[scheduler->count];
+            _MFHeapSiftDown(scheduler->heap, scheduler->count, 0);
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return popped;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDISchedulerReleaseEvents(MFMIDISchedulerEvent *events, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (!MFMIDIMessageValueIsInline(&events[i].message)) {
+            free((void *)events[i].message.outOfLineBytes);
+            events[i].message.outOfLineBytes = NULL;
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+
+uint64_t MFMIDISchedulerNextEventTime(MFMIDISchedulerRef scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    uint64_t time = scheduler->count ? scheduler->heap[0].hostTime : kMFMIDISchedulerNoEvent;
+    pthread_mutex_unlock(&scheduler->lock);
+    return time;
+}
+
+//---------------------------------------------------------------------
+
+size_t MFMIDISchedulerCount(MFMIDISchedulerRef scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    size_t count = scheduler->count;
+    pthread_mutex_unlock(&scheduler->lock);
+    return count;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDISchedulerRemoveAll(MFMIDISchedulerRef scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    MFMIDISchedulerReleaseEvents(scheduler->heap, scheduler->count);
+    scheduler->count = 0;
+    pthread_mutex_unlock(&scheduler->lock);
+}
@@ -0,0 +1,64 @@
+//
+//  MFMIDIScheduler.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIScheduler_h
+#define MIDIFish_MFMIDIScheduler_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "MFMIDIMessageValue.h"
+
+/**
+ Time-ordered queue of future MIDI events. Plain C, no platform dependencies.
+
+ It knows nothing about clocks: you schedule events at a host time and periodically ask for everything due before some horizon (ie now + lookahead). The caller then hands them to the output with their own future timestamps so the OS does the accurate timing. `MFMIDISession` drives one from a timer using mach host time.
+
+ Events scheduled for the same time come out in the order they were scheduled. Scheduling and popping are thread-safe (a mutex guards the queue, so don't schedule from a realtime thread).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MFMIDIScheduler *MFMIDISchedulerRef;
+
+typedef struct MFMIDISchedulerEvent {
+    uint64_t hostTime;
+    uint64_t sequence;                  // tie-breaker for equal times
+    MFMIDIMessageValue message;         // out-of-line bytes are owned by the event. See MFMIDISchedulerReleaseEvents
+} MFMIDISchedulerEvent;
+
+/** Returned by the time getters when the queue is empty */
+#define kMFMIDISchedulerNoEvent UINT64_MAX
+
+
+extern MFMIDISchedulerRef MFMIDISchedulerCreate(void);
+extern void MFMIDISchedulerDestroy(MFMIDISchedulerRef scheduler);
+
+/** Queue a message. Out-of-line bytes are copied. @return false on allocation failure */
+extern bool MFMIDISchedulerSchedule(MFMIDISchedulerRef scheduler, const MFMIDIMessageValue *message, uint64_t hostTime);
+
+/** Remove up to maxEvents which are due at or before `horizon`, earliest first. Call `MFMIDISchedulerReleaseEvents` on them when done. @return Number written to outEvents */
+extern size_t MFMIDISchedulerPopDue(MFMIDISchedulerRef scheduler, uint64_t horizon, MFMIDISchedulerEvent *outEvents, size_t maxEvents);
+
+/** Frees any out-of-line storage held by popped events */
+extern void MFMIDISchedulerReleaseEvents(MFMIDISchedulerEvent *events, size_t count);
+
+/** Host time of the earliest event or kMFMIDISchedulerNoEvent */
+extern uint64_t MFMIDISchedulerNextEventTime(MFMIDISchedulerRef scheduler);
+
+extern size_t MFMIDISchedulerCount(MFMIDISchedulerRef scheduler);
+
+/** Drop everything that hasn't been popped */
+extern void MFMIDISchedulerRemoveAll(MFMIDISchedulerRef scheduler);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
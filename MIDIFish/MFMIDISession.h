@@ -10,9 +10,49 @@
 #import <CoreMIDI/MIDINetworkSession.h>
 
 #import "MFProtocols.h"
+#import "MFMIDIConnectionChanges.h"
 #import "MFMIDIMessage.h"
+#import "MFMIDIMessageValue.h"
+#import "MFMIDIBatch.h"
+#import "MFMIDIUMP.h"
+#import "MFMIDIRenderQueue.h"
+#import "MFMIDIScheduler.h"
+#import "MFMIDICoalescer.h"
+#import "MFMIDIRunningStatus.h"
+#import "MFMIDITransform.h"
+#import "MFMIDISysexTransfer.h"
+#import "MFMIDIBackend.h"
+#import "MFMIDIStateStorage.h"
+#import "MFMIDIDiscovery.h"
+#import "MFMIDITrafficStatistics.h"
 #import "MFAudiobusDestination.h"
 
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** Receive counters, aggregated across all sources */
+typedef struct MFMIDIReceiveStatistics {
+    uint64_t receivedPacketCount;
+    uint64_t receivedByteCount;
+    uint64_t droppedPacketCount;        // receive buffer overflows, ie messages weren't drained quickly enough
+    uint64_t droppedByteCount;
+    uint64_t highWaterMark;             // most bytes ever waiting in any one receive buffer
+} MFMIDIReceiveStatistics;
+
+/** How continuous controllers are coalesced for a class of destinations. See `networkCoalescingPolicy` */
+typedef struct MFMIDICoalescingPolicy {
+    NSTimeInterval interval;            // least time between sends of coalesced messages. 0 = off, everything goes straight out
+    NSUInteger maxBytesPerInterval;     // 0 = no limit. The rest wait for the next interval
+} MFMIDICoalescingPolicy;
+
+NS_INLINE MFMIDICoalescingPolicy MFMIDICoalescingPolicyMake(NSTimeInterval interval, NSUInteger maxBytesPerInterval)
+{
+    MFMIDICoalescingPolicy policy = { interval, maxBytesPerInterval };
+    return policy;
+}
+
+
 /////////////////////////////////////////////////////////////////////////
 #pragma mark -
 /////////////////////////////////////////////////////////////////////////
@@ -32,6 +72,17 @@
 /** Create a new client. Won't have any connections until you call `refresh...` @throws MFNonFatalException if unable to create MIDI Client or In/Out ports */
 - (instancetype)initWithName:(NSString *)name;
 
+/** As above but with the given I/O backend instead of CoreMIDI, eg. a `MFMIDILoopbackBackend` for load testing. The backend must outlive the session. Network sessions are only available with CoreMIDI @{ */
++ (instancetype)sessionWithName:(NSString *)name backend:(const MFMIDIBackend *)backend;
+- (instancetype)initWithName:(NSString *)name backend:(const MFMIDIBackend *)backend;
+/** @} */
+
+/** As above, persisting connection states, manual network connections and resolved network addresses in `stateStorage` rather than `MFMIDIUserDefaultsStateStorage()`. NULL for no persistence. The storage must outlive the session */
+- (instancetype)initWithName:(NSString *)name backend:(const MFMIDIBackend *)backend stateStorage:(const MFMIDIStateStorage *)stateStorage;
+
+/** Designated. As above, finding network hosts with `discovery` rather than `MFMIDIBonjourDiscovery()`. NULL for no network browsing (manual connections only). The discovery must outlive the session */
+- (instancetype)initWithName:(NSString *)name backend:(const MFMIDIBackend *)backend stateStorage:(const MFMIDIStateStorage *)stateStorage discovery:(const MFMIDIDiscovery *)discovery;
+
 
 
 /////////////////////////////////////////////////////////////////////////
@@ -49,9 +100,12 @@
 // TODO:
 @property (nonatomic, readonly) BOOL coreMIDIReceiveEnabled;
 
-/** Stores enabled states for connections (in NSUserDefaults) and restores them upon re-discovery / re-creation (ie does NOT add them on launch, only sets them when found) */
+/** Stores enabled states for connections (in the session's state storage, NSUserDefaults by default) and restores them upon re-discovery / re-creation (ie does NOT add them on launch, only sets them when found) */
 @property (nonatomic) BOOL restorePreviousConnectionStates;
 
+/** Stored connection states not seen for this long are forgotten at the next refresh, so devices long gone don't accumulate. Seconds. Default is a year. 0 keeps them forever */
+@property (nonatomic) NSTimeInterval connectionStateMaxAge;
+
 /** Default=YES. YES means ignore the endpoint which shares the same name as this device. */
 @property (nonatomic) BOOL excludeSelfInNetworkScan;
 
@@ -66,9 +120,17 @@
 @property (nonatomic) BOOL autoEnableSources;
 /** @} */
 
-/** YES when a Bonjour browse is in effect (via refresh) */
+/** YES while the network part of a refresh is in progress: browsing, then resolving what was found. Hosts resolved on a previous launch are connected at the start of a refresh and dropped at the end if they don't turn up */
 @property (nonatomic, readonly) BOOL isRefreshing;
 
+/** Queue the connection and refresh delegate methods are called on, in order, so UI updates needn't run on the thread CoreMIDI notifies on. Should be serial. Default nil, ie. synchronously on that thread (main for CoreMIDI) */
+@property (nonatomic, strong) dispatch_queue_t connectionEventQueue;
+
+/** Seconds over which connection adds/removes are collected into a single `MIDISession:connectionsDidChange:`, sent instead of the individual didAdd/didRemove methods, so plugging in a hub or a refresh costs one UI reload rather than one per connection. Delivered on `connectionEventQueue` (main if nil). Pending changes are sent early ahead of refresh begin/progress/end. Default 0, ie. off */
+@property (nonatomic) NSTimeInterval connectionChangeCoalescingInterval;
+
+// The connection lists are immutable snapshots. Hold on to and enumerate them freely while connections come and go
+
 /**
  Getter for just the *network* sources.
  @return Array of id<MFMIDISource, MFMIDINetworkConnection>
@@ -115,6 +177,46 @@
 /** The default channel that will be used for the shorthand methods below */
 @property (nonatomic) UInt8 midiChannel;
 
+/** 
+ Incoming MIDI is copied into lock-free buffers on the CoreMIDI thread and delivered to the delegates' `MIDISource:didReceiveMessage:` (and `MIDISource:didReceiveUMPWords:count:`) from this queue, polled every `receivePollInterval`. Default is the main queue. Set to nil to turn off automatic delivery and poll with `drainReceivedMessages:` yourself
+ */
+@property (nonatomic, strong) dispatch_queue_t receiveDeliveryQueue;
+
+/** Seconds between drains of the receive buffers when `receiveDeliveryQueue` is set. Default 0.005 */
+@property (nonatomic) NSTimeInterval receivePollInterval;
+
+/** Overflow and throughput counters for the receive buffers */
+@property (nonatomic, readonly) MFMIDIReceiveStatistics receiveStatistics;
+
+/** Send/receive counters, send latency and receive jitter summed over every connection the session has seen (jitter is the worst one's). See MFMIDITrafficStatistics.h and `trafficStatisticsForConnection:` */
+@property (nonatomic, readonly) MFMIDITrafficStatistics trafficStatistics;
+
+/**
+ Optional rate limiting of continuous controllers (CC, pitchbend, channel & poly aftertouch) sent via `sendMIDIMessageValue:`, `sendMIDIMessage:` and the convenience methods. Touch handlers can fire these far faster than a congested WiFi link can carry them. With a policy on, each (channel, controller/key) keeps only its latest value and they go out at most once per `interval` (and `maxBytesPerInterval`), with an isolated change going straight out.
+ 
+ Notes, program changes, sysex, (N)RPN/data entry and mode CCs are never coalesced, and anything not coalesced (including batches and packet lists) first flushes what's pending so the ordering you'd expect between eg. a pitchbend and the next note holds. That's cheap when nothing's pending, and it won't wait on a timed flush already underway on another thread. Timestamped (scheduled) sends aren't coalesced.
+ 
+ Network destinations share one endpoint and so one policy. Local means hardware, app and virtual endpoints and Audiobus. Both default to off. Eg. `MFMIDICoalescingPolicyMake(0.01, 300)` suits Network MIDI. @{
+ */
+@property (nonatomic) MFMIDICoalescingPolicy networkCoalescingPolicy;
+@property (nonatomic) MFMIDICoalescingPolicy localCoalescingPolicy;
+/** @} */
+
+/**
+ Send with running status to a class of destinations, ie. leave out the status byte of a channel message when it's the same as the last one's in the packet. Note offs with velocity 64 go as note on velocity 0 so they share the note on status too. See MFMIDIRunningStatus.h.
+ 
+ Only packets carrying several messages get smaller (batches, `sendMIDIMessages:` and coalescing flushes, where a bank of faders on one channel goes from 3 bytes per CC to 2) so this pairs well with a coalescing policy. Worth turning on for Network MIDI and DIN-speed hardware; USB has its own fixed-size framing so gains nothing. Traffic statistics count the bytes actually sent. Both default to NO. @{
+ */
+@property (nonatomic) BOOL networkRunningStatusEnabled;
+@property (nonatomic) BOOL localRunningStatusEnabled;
+/** @} */
+
+/** How far ahead of their time scheduled messages are handed to CoreMIDI (with their future timestamp). Larger means fewer wakeups and more tolerance of scheduling hiccups but later response to `cancelScheduledMessages`. Default 0.05 */
+@property (nonatomic) NSTimeInterval scheduleLookahead;
+
+/** Seconds between drains of the render queues (see `createRenderQueue`). Keep it well under the audio output latency so messages reach CoreMIDI before their timestamps. Default 0.001 */
+@property (nonatomic) NSTimeInterval renderQueueDrainInterval;
+
 
 /////////////////////////////////////////////////////////////////////////
 #pragma mark - Public Methods
@@ -123,12 +225,28 @@
 - (void)addDelegate:(id<MFMIDISessionDelegate>)delegate;
 - (void)removeDelegate:(id<MFMIDISessionDelegate>)delegate;
 
-/** Re-scan the connected devices (instantaneous) and Network (async) updating connections list. If called while scanning then a cancel is called first */
+/** Re-scan the connected devices (instantaneous) and Network (async) updating connections list. Network hosts are connected on their last good address straight away and confirmed as Bonjour resolves them, several at once. If called while scanning then a cancel is called first */
 - (void)refreshConnections;
 
 /** Cancel a refresh (relevant for network only really) */
 - (void)cancelRefresh;
 
+/** Connection state and manual connection changes are written to the state storage a second or so after they happen. This writes any pending ones now and blocks until done, eg. when the app is backgrounded */
+- (void)savePersistentState;
+
+/** 
+ Deliver everything received since the last drain. The handler is called once per source with its messages in arrival order. Messages from disabled sources are discarded. Only needed when `receiveDeliveryQueue` is nil, though safe to call anytime
+ 
+ Network sources all share one CoreMIDI endpoint so their messages are attributed to the first enabled Network Source.
+ 
+ @return The number of messages delivered
+ */
+- (NSUInteger)drainReceivedMessages:(void (^)(id<MFMIDISource> source, NSArray *messages))handler;
+
+/** As above, also handing `UMPHandler` everything as Universal MIDI Packets, before `handler`. MIDI 1.0 sources' messages are translated to MIDI 2.0 channel voice. Either handler may be skipped for a source with nothing for it */
+- (NSUInteger)drainReceivedMessages:(void (^)(id<MFMIDISource> source, NSArray *messages))handler
+                         UMPHandler:(void (^)(id<MFMIDISource> source, const uint32_t *words, NSUInteger count))UMPHandler;
+
 /** 
  Create/add Virtual Destination (as a MIDISource, locally). WARNING: It's only enabled if autoEnabledSources is set to YES. To enable manually, catch the return value and set the `enabled` property.
  
@@ -159,6 +277,72 @@
 - (NSUInteger)enabledSourcesCountIncludeVirtual:(BOOL)includeVirtual;
 - (NSUInteger)enabledDestinationsCountIncludeVirtual:(BOOL)includeVirtual;
 
+/** 
+ Snapshot of a connection's traffic: messages and bytes sent, send errors by OSStatus, messages dropped while `coreMIDISendEnabled` was NO, send-call latency and receive jitter histograms. Cheap (no locks on the MIDI paths) so leave it on and read it when someone reports lag.
+ 
+ Counters follow the endpoint so they carry over when a device is unplugged and comes back. Network connections all go through the one MIDINetworkSession endpoint so they report the session-wide network figures (sources and destinations separately). All zeros for a connection that hasn't sent or received anything
+ */
+- (MFMIDITrafficStatistics)trafficStatisticsForConnection:(id<MFMIDIConnection>)connection;
+
+
+#pragma mark Transforms
+
+/**
+ Rewrite messages on their way out or in: channel maps, note on velocity curves and type/channel filters, compiled into lookup tables and applied in place with no allocation, so they cost next to nothing on the send path. See MFMIDITransform.h. The transform is copied; pass NULL to remove it.
+ 
+ The send transform applies to everything sent (before running status) and the receive transform to everything received, before the messages are parsed. @{
+ */
+- (void)setSendTransform:(const MFMIDITransform *)transform;
+- (void)setReceiveTransform:(const MFMIDITransform *)transform;
+/** @} */
+
+/**
+ A transform for one connection, after the session's: what's sent to a destination or received from a source. It follows the endpoint so carries over when a device is unplugged and comes back. Network connections all share the MIDINetworkSession endpoints so share a transform per direction, as with traffic statistics.
+ 
+ Sysex sent with `sendSysex:...` is only subject to the transforms' sysex filters as it goes in chunks
+ */
+- (void)setTransform:(const MFMIDITransform *)transform forConnection:(id<MFMIDIConnection>)connection;
+
+
+#pragma mark Thru Routing
+
+/**
+ A routing matrix: forward what `source` receives straight on to `destination` from CoreMIDI's thread as it arrives, with no MFMIDIMessages, allocation or hop to `receiveDeliveryQueue`, so it adds next to nothing to the latency of the send itself. An unfiltered route hands on the packet list CoreMIDI gave us as it is; a filtered one sends a filtered copy made on the stack. It's received as usual as well.
+ 
+ `filter` is typically type and channel filters (see MFMIDITransform.h) but can be any transform. It's copied; NULL passes everything. The destination's own transform applies after it. The send transform, coalescing, running status and recording don't: thru isn't sent by the app.
+ 
+ Routes follow the endpoints like transforms so come back with a device, and forward while both ends are enabled. Network connections share the MIDINetworkSession endpoints so a route from or to one is from or to them all. Changes are picked up atomically by the next packet. Setting an existing route replaces its filter. @{
+ */
+- (void)setThruFromSource:(id<MFMIDISource>)source toDestination:(id<MFMIDIConnection>)destination filter:(const MFMIDITransform *)filter;
+- (void)removeThruFromSource:(id<MFMIDISource>)source toDestination:(id<MFMIDIConnection>)destination;
+- (void)removeAllThruRoutes;
+- (BOOL)hasThruFromSource:(id<MFMIDISource>)source toDestination:(id<MFMIDIConnection>)destination;
+/** @} */
+
+
+#pragma mark Recording & Playback
+
+/**
+ Record everything sent (track 0, after the send transform) and received (track 1, after the receive transforms) to a format 1 Standard MIDI File, eg. for debugging or "replay last take". Messages are copied into a bounded buffer on the send and receive paths and written out from a background thread, so it costs little and memory doesn't grow however long it runs. If the disk can't keep up messages are dropped, and logged when it stops. See MFMIDIFileRecorder.h. Stops any recording already going.
+ @return NO if the file can't be created
+ */
+- (BOOL)startRecordingToFileAtPath:(NSString *)path;
+
+/** Write out the rest and close the file. Blocks while it does. @return NO if there was an error writing, in which case the file is incomplete */
+- (BOOL)stopRecording;
+
+@property (nonatomic, readonly) BOOL isRecording;
+
+/**
+ Play a Standard MIDI File (format 0 or 1) to the enabled destinations. The file is memory mapped and its events handed to CoreMIDI timestamped, `scheduleLookahead` ahead, as with scheduled sending, so timing is as accurate as the drivers'. Replaces anything already playing. See MFMIDIFilePlayer.h
+ @param completion Optional. Called on the main queue with YES once the last event has gone out or NO if it was stopped or replaced
+ @return NO if the file can't be opened or isn't an SMF
+ */
+- (BOOL)playMIDIFileAtPath:(NSString *)path completion:(void (^)(BOOL completed))completion;
+
+/** Stop sending the file's events. Those already handed to CoreMIDI still play, so follow with `releaseActiveNotes` to silence any left sounding */
+- (void)stopPlayback;
+
 
 #pragma mark Audiobus
 
@@ -171,8 +355,81 @@
 
 
 
+#pragma mark Value-type Sending
+
+/** Allocation-free equivalent of `sendMIDIMessage:` for messages that fit inline (<= 3 bytes). Longer ones fall back to the object path. @throws MFNonFatalException on send error */
+- (void)sendMIDIMessageValue:(MFMIDIMessageValue)value;
+
+
+#pragma mark Scheduled Sending
+
+/**
+ Queue a message to be sent at a future host time (`mach_absolute_time()` units, as per MIDITimeStamp). It's handed to CoreMIDI `scheduleLookahead` before it's due, timestamped, so CoreMIDI and the drivers take care of the accurate timing rather than whichever thread we happen to be on. Past times are sent straight away. Message bytes are copied so the message may be reused immediately. Send errors are logged rather than thrown since they happen on the scheduler's queue. @{
+ */
+- (void)sendMIDIMessage:(MFMIDIMessage *)message atHostTime:(MIDITimeStamp)hostTime;
+- (void)sendMIDIMessageValue:(MFMIDIMessageValue)value atHostTime:(MIDITimeStamp)hostTime;
+/** @} */
+
+/** Drop all scheduled messages which haven't been handed to CoreMIDI yet (ie those more than `scheduleLookahead` away) */
+- (void)cancelScheduledMessages;
+
+/** Send anything being held back by the coalescing policies now, ignoring their byte budgets. Errors are logged */
+- (void)flushCoalescedMessages;
+
+
+#pragma mark Sysex Streaming
+
+/**
+ Stream a long sysex message (patch banks, firmware dumps) to the enabled destinations in small chunks, paced at `bytesPerSecond` per destination, rather than in one go as `sendMIDIMessage:` does. Returns straight away; chunks go out from a timer on the scheduler's queue. No size limit and the data is only retained, not copied.
+ 
+ The destinations are those enabled when you call it. One that goes away or errors part way gets no more and the rest carry on. Keep other messages away from them until it completes as they'd land inside the sysex. See MFMIDISysexTransfer.h.
+ 
+ @param bytesPerSecond Per destination. 0 sends chunks back to back. A DIN cable carries ~3000; many devices need it slower to keep up
+ @param progress Optional. Called on the main queue as chunks go out, with bytes summed over the destinations
+ @param completion Optional. Called on the main queue with noErr if every destination got all of it, otherwise a failed destination's error (`kMFMIDISysexTransferCancelledErr` if cancelled)
+ */
+- (void)sendSysex:(NSData *)sysex bytesPerSecond:(NSUInteger)bytesPerSecond progress:(void (^)(NSUInteger bytesSent, NSUInteger totalBytes))progress completion:(void (^)(OSStatus status))completion;
+
+/** Stop any sysex transfers in progress. Their completions get `kMFMIDISysexTransferCancelledErr` */
+- (void)cancelSysexTransfers;
+
+
+#pragma mark Render Thread Sending
+
+/**
+ For sending from an audio render callback, where `sendMIDIMessage:` and the like aren't safe as they may allocate, lock, log and throw. Queue raw bytes at sample offsets with `MFMIDIRenderQueueBeginBuffer()` and `MFMIDIRenderQueueEnqueue()`, which are wait-free. See MFMIDIRenderQueue.h.
+ 
+ The session drains its queues every `renderQueueDrainInterval` on a high priority (but not real-time) thread and sends to every destination, Audiobus included, with the timestamps so CoreMIDI plays each message on its sample. Coalescing doesn't apply. Errors are logged. Once they've all been empty for a while it stops polling, and the next enqueue wakes it with a `dispatch_source_merge_data` (no locks or allocation) rather than being wait-free.
+ 
+ Make one per render thread, here rather than on it as this allocates. The session owns it until `destroyRenderQueue:` or the session goes.
+ @return NULL on allocation failure
+ */
+- (MFMIDIRenderQueueRef)createRenderQueue;
+
+/** Sends whatever's left in it then frees it, on the session's drain thread. The render thread must have stopped using it. Call when an audio unit is uninitialised, say, rather than holding the queue till the session goes */
+- (void)destroyRenderQueue:(MFMIDIRenderQueueRef)queue;
+
+
+#pragma mark Batch Sending
+
+/**
+ Build several messages into one packet list and send it with a single send per destination when the block returns. Use for chords, RPNs and anything else which should arrive together without other senders' messages in between. The batch lives on the stack (`kMFMIDIBatchDefaultBufferSize`) so no allocation occurs. The block is called synchronously. Add messages with `MFMIDIBatchAddValue()` etc.
+ @throws MFNonFatalException on send error
+ */
+- (void)sendBatch:(void (^)(MFMIDIBatch *batch))builder;
+
+
+#pragma mark MIDI 2.0 (UMP) Sending
+
+/**
+ Send Universal MIDI Packets (see MFMIDIUMP.h), eg. MIDI 2.0 notes with 16-bit velocities, to all enabled destinations. Where the backend takes event lists (CoreMIDI on iOS 14 / macOS 11 and later) they go as they are, so CoreMIDI can pass them on whole to MIDI 2.0 destinations and scale them down for the rest. Otherwise, and for Audiobus, destinations with a transform and the recorder, they're translated to MIDI 1.0 here first. `words` should be whole messages. Sent immediately, after anything coalesced.
+ @throws MFNonFatalException on send error
+ */
+- (void)sendUMPWords:(const uint32_t *)words count:(NSUInteger)count;
+
+
 #pragma mark MIDI Convenience Methods
-/** @name Convenience Methods  */
+/** @name Convenience Methods. These all use the allocation-free value path  */
 
 /** Send MIDI Note On/Off message with note value and velocity (both 7bit 0..127) @{ */
 - (void)sendNoteOn:(UInt8)key velocity:(UInt8)velocity;
@@ -191,12 +448,22 @@
 - (void)sendChannelAftertouch:(UInt8)pressure;
 - (void)sendPolyphonicAftertouch:(UInt8)key pressure:(UInt8)pressure;
 
-/** MIDI All Notes Off Message (CC:123) */
+/** MIDI All Notes Off Message (CC:123, value 0 as the spec requires, same as `MFMIDI::AllNotesOff`) */
 - (void)sendAllNotesOffForCurrentChannel;
 
+/** All Notes Off on all 16 channels in a single batch */
 - (void)sendAllNotesOffForAllChannels;
 
-/** TODO:  */
+/**
+ Panic, precisely: note offs for just the notes each destination has sounding, in one batched packet list per destination. The session tracks note ons and offs on the send path (as sent, ie. after transforms) so this works on synths which ignore CC 123, and sends nothing at all when nothing's sounding.
+ 
+ It's done for you when a destination is disabled or goes away. Network hosts share one endpoint so they share the tracking: releasing for one releases for all. Scheduled notes already handed to CoreMIDI count as sounding, so `cancelScheduledMessages` first. @{
+ */
+- (void)releaseActiveNotes;
+- (void)releaseActiveNotesForConnection:(id<MFMIDIDestination>)destination;
+/** @} */
+
+/** Sent as a single batch so the parameter number and value can't be interleaved with other senders' CCs. The Data Entry LSB (CC 38) is omitted when valueLSB is 0 */
 - (void)sendRPNWithMSB:(UInt8)msb LSB:(UInt8)lsb valueMSB:(UInt8)valueMSB valueLSB:(UInt8)valueLSB;
 - (void)sendNRPNWithMSB:(UInt8)msb LSB:(UInt8)lsb valueMSB:(UInt8)valueMSB valueLSB:(UInt8)valueLSB;
 
@@ -206,4 +473,20 @@
 @end
 
 
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - C API
+/////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** C/ObjC++ entry point for the value-type send. Same as `-[MFMIDISession sendMIDIMessageValue:]` minus the ObjC dispatch and the struct copy. @throws MFNonFatalException on send error */
+extern void MFMIDISessionSendMessageValue(MFMIDISession *session, const MFMIDIMessageValue *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+
 
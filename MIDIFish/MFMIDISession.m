@@ -24,12 +24,21 @@
 #import "_MFMIDIEndpointDestination.h"
 #import "_MFMIDINetworkSource.h"
 #import "_MFMIDINetworkDestination.h"
-
-// @TEMP
-#import <netinet/in.h>
-#import <arpa/inet.h>
-#import <sys/types.h>
-#import <sys/socket.h>
+#import "_MFMIDIReceiveQueue.h"
+#import "_MFSendRoutes.h"
+#import "_MFTrafficStats.h"
+#import "_MFActiveNotes.h"
+#import "_MFConnectionStateStore.h"
+#import "_MFConnectionRegistry.h"
+#import "_MFEndpointInfoCache.h"
+#import "_MFNetDiscovery.h"
+#import "_MFDelegateDispatcher.h"
+#import "MFMIDIBackend.h"
+#import "MFMIDIFileRecorder.h"
+#import "MFMIDIFilePlayer.h"
+
+#import <mach/mach_time.h>
+#import <stdatomic.h>
 
 // Channelised Logging
 #undef echo
@@ -46,7 +55,7 @@
 #pragma mark - Defs
 /////////////////////////////////////////////////////////////////////////
 
-/** Convert MIDIEndpointsRefs to object. In 64bit they are integers. in 32bit they are struct pointers :(. Note they need to compare well as they are placed in arrays and checked with `containsObject:` */
+/** Convert MIDIEndpointsRefs to object. In 64bit they are integers. in 32bit they are struct pointers :(. Note they need to compare and hash well as they key the connection registry */
 //#if __LP64__
 #define _EP2Obj(endpoint) @(endpoint);
 //#else
@@ -57,23 +66,139 @@
 /** Timeout for resolving Bonjour names into IP/Port addresses. 5 was too short sometimes */
 static const NSTimeInterval _NETSERVICE_RESOLVE_TIMEOUT = 15;   // seconds
 
+/** How long to wait on a resolve when we've an address from last time. We're already connected on that so don't hold up the refresh */
+static const NSTimeInterval _NETSERVICE_CACHED_RESOLVE_DEADLINE = 2;    // seconds
+
+/** How often resolve deadlines are checked during a refresh */
+static const NSTimeInterval _NETSERVICE_DEADLINE_CHECK_INTERVAL = 0.25;     // seconds
+
 /** When refresh is called whilst refreshing, cancelRefresh is called and then refresh is called again  after this time delay */
 static const NSTimeInterval _REFRESH_RETRY_TIME_AFTER_STOP = 0.5;
 
+/** Size of each receive ring (one for the input port, one per virtual destination). Big enough for a few full-size packets */
+static const size_t _RECEIVE_RING_CAPACITY = 256 * 1024;      // bytes
+
+static const NSTimeInterval _RECEIVE_POLL_INTERVAL_DEFAULT = 0.005;   // seconds
+
+static const NSTimeInterval _SCHEDULE_LOOKAHEAD_DEFAULT = 0.05;     // seconds
+
+static const NSTimeInterval _RENDER_QUEUE_DRAIN_INTERVAL_DEFAULT = 0.001;     // seconds
+static const NSTimeInterval _RENDER_QUEUE_IDLE_BEFORE_SLEEP = 0.1;          // seconds of empty drains before the timer's suspended
+
+static const NSTimeInterval _CONNECTION_STATE_MAX_AGE_DEFAULT = 365 * 24 * 60 * 60;     // seconds
+
+/** Changes to the persisted state are written this long after the first of them, so a burst (eg. a refresh) costs one write */
+static const NSTimeInterval _STATE_SAVE_DELAY = 1.0;     // seconds
+
+/** Index into the coalescer ivars per destination class */
+enum { _COALESCER_LOCAL, _COALESCER_NETWORK, _COALESCER_COUNT };
+static const _MFSendTargetClass _kCoalescerTargetClass[_COALESCER_COUNT] = { _kMFSendTargetClassLocal, _kMFSendTargetClassNetwork };
+
+/** Tracks of the files `startRecordingToFileAtPath:` writes */
+enum { _RECORDER_TRACK_SENT, _RECORDER_TRACK_RECEIVED, _RECORDER_TRACK_COUNT };
+
+/** Bytes of the event lists `sendUMPWords:count:` sends. Small enough that a full one's MIDI 1.0 translation always fits a kMFMIDIBatchDefaultBufferSize packet list */
+#define _UMP_EVENT_LIST_SIZE 1024
+
+/** Events popped from the scheduler per pass. A define as it sizes a stack array (inside a block, so no VLAs) */
+#define _SCHEDULER_POP_CHUNK 64
+
 
 // C callbacks: definitions are near their ObjC counterparts
-static void _MFMIDINotifyProc(const MIDINotification *message, void *refCon);
+static void _MFMIDINotifyProc(MFMIDIBackendNotification notification, MFMIDIBackendEndpointType endpointType, MIDIEndpointRef endpoint, void *refCon);
 static void _MFMIDIReadProc(const MIDIPacketList *pktlist, void *readProcRefCon, void *srcConnRefCon);
+static void _MFMIDIEventReadProc(const MIDIEventList *eventList, void *readProcRefCon, void *srcConnRefCon) MF_UMP_AVAILABLE;
+static const _MFNetDiscoveryCallbacks _kMFNetDiscoveryCallbacks;
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Host Time
+/////////////////////////////////////////////////////////////////////////
+
+static mach_timebase_info_data_t _MFTimebase(void)
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        mach_timebase_info(&timebase);
+    });
+    return timebase;
+}
+
+static inline uint64_t _MFHostTicksFromSeconds(NSTimeInterval seconds)
+{
+    mach_timebase_info_data_t tb = _MFTimebase();
+    return (uint64_t)(seconds * NSEC_PER_SEC * tb.denom / tb.numer);
+}
+
+static inline uint64_t _MFNanosFromHostTicks(uint64_t ticks)
+{
+    mach_timebase_info_data_t tb = _MFTimebase();
+    return ticks * tb.numer / tb.denom;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Sysex Transfer State
+/////////////////////////////////////////////////////////////////////////
+
+/** @private One `sendSysex:...` in progress. _schedulerQueue only */
+@interface _MFSysexTransferState : NSObject
+{
+@public
+    MFMIDISysexTransferRef _transfer;
+    NSData *_sysex;                                 // the transfer points into it
+    NSData *_targets;                               // _MFSendTarget per destination index, as they were at the start
+    void (^_progress)(NSUInteger, NSUInteger);
+    void (^_completion)(OSStatus);
+    
+    // Only during a step
+    __unsafe_unretained MFMIDISession *_session;
+    const _MFSendRoutes *_routes;
+}
+@end
+
+@implementation _MFSysexTransferState
+- (void)dealloc
+{
+    MFMIDISysexTransferDestroy(_transfer);
+}
+@end
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - File Playback State
+/////////////////////////////////////////////////////////////////////////
+
+/** @private One `playMIDIFileAtPath:...`. _schedulerQueue only */
+@interface _MFFilePlaybackState : NSObject
+{
+@public
+    MFMIDIFilePlayerRef _player;
+    uint64_t _startTime;                            // host time of the file's time 0
+    void (^_completion)(BOOL);
+}
+@end
+
+@implementation _MFFilePlaybackState
+- (void)dealloc
+{
+    MFMIDIFilePlayerClose(_player);
+}
+@end
 
-static NSString * const _kUserDefsKeyEnabledStates = @"co.air-craft.MIDIFish.connectionsEnabledStates";
-static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish.manualConnections";
+static OSStatus _MFMIDISessionSysexSend(void *context, uint32_t destinationIndex, const MIDIPacketList *packetList);
+static OSStatus _MFMIDISessionSendChunkToClasses(MFMIDISession *session, const MIDIPacketList *packetList, uint32_t targetClasses, uint8_t chunkedStatus);
+static inline void _MFMIDISessionFlushPendingCoalesced(MFMIDISession *session);
+static void _MFMIDISessionRenderQueueWake(void *context);
+static size_t _MFMIDISessionDrainRenderQueues(MFMIDISession *session, NSArray *renderQueues);
 
 
 /////////////////////////////////////////////////////////////////////////
 #pragma mark - Private Extensions
 /////////////////////////////////////////////////////////////////////////
 
-@interface MFMIDISession () <NSNetServiceBrowserDelegate, NSNetServiceDelegate>
+@interface MFMIDISession ()
 @property (nonatomic, readwrite) BOOL isRefreshing;
 @property (nonatomic, readwrite) NSMutableArray *audiobusDestinations;
 @end
@@ -106,34 +231,83 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
  2: addNetworkConnectionWithHost:  -- used by netBrowserDidFind as well
  3:
  
- TODOS:
- - Persistence should probably have a built in clean out mechanism for ones that havent appeared in say a year. Very low priority for now.
  */
 @implementation MFMIDISession
 {
     ABAudiobusController *_abController;    // @TODO: Make this less dependent on AB libs
                                             // Audiobus tells us when to ignore CoreMIDI
     
+    const MFMIDIBackend *_backend;          // all I/O goes through here
+    _MFEndpointInfoCacheRef _endpointInfo;  // endpoint names etc. Invalidated from the notify proc
     MIDIClientRef _clientRef;
     MIDIPortRef _outputPortRef;
     MIDIPortRef _inputPortRef;
     
-    // These are the actualy CoreMIDI endpoints which are separate in both code and concept from our "Connection" objects. Note, property backing ivars _endpointSources/Destinations represent our MIDIConnections objects which have their own endpoint (as opposed to Network ones which all share 1 endpoint). These ivars INCLUDE the network endpoint while the endpoint* properties do not.
-    NSMutableArray *_destinationEndpoints;    // [@(MIDIEndpointRef)]
-    NSMutableArray *_sourceEndpoints;  // [@(MIDIEndpointRef)]
+    // Our Connection objects (which back the public array properties) plus the actual CoreMIDI endpoints, which are separate in both code and concept. Endpoint connections have their own endpoint while Network ones all share 1. The registry's raw endpoint sets INCLUDE the network endpoint while the endpoint* properties do not.
+    _MFConnectionRegistry *_registry;
     
-    NSMutableArray *_delegates;
+    _MFDelegateDispatcher *_delegateDispatcher;    // delegates with their cached capabilities. Connection & refresh events go through it
     
-    NSNetServiceBrowser *_netBrowser;
     MIDINetworkSession *_midiNetSession;
-    BOOL _isBrowsingForNetworkConnections;
-    NSMutableArray *_netConxToRemove;   // tracking var for notifying delegates after a rescan
-    
-    NSUserDefaults *_userDefs;
-    
-    // The trackers for knowing when a net scan has finished
-    BOOL _netServiceBrowserIsSearching;
-    NSMutableArray *_netServicesAwaitingResolve;
+    _MFNetDiscoveryRef _netDiscovery;   // NULL without a discovery. See _MFNetDiscovery.h
+    dispatch_source_t _netDeadlineTimer;    // checks resolve deadlines while refreshing
+    NSMutableSet *_netConxToRemove;   // tracking var for notifying delegates after a rescan. Connections made on remembered addresses stay in it until confirmed
+    
+    // Persisted enabled states and manual network connections. Saves are write-behind on _stateSaveQueue
+    _MFConnectionStateStoreRef _stateStore;
+    dispatch_queue_t _stateSaveQueue;
+    
+    // Receive. The read procs write into the queue's rings; a timer drains them on receiveDeliveryQueue
+    _MFMIDIReceiveQueue *_receiveQueue;
+    dispatch_source_t _receiveTimer;
+    uint32_t _networkReceiveID;             // all network sources share one endpoint & ID
+    BOOL _networkReceiveConnected;
+    
+    // Flat snapshot of send targets rebuilt on connection changes. See _rebuildSendRoutes
+    _MFSendRouterRef _sendRouter;
+    
+    // MFMIDITransforms (as NSData) set by the user. The send routes and receive queue have copies. Under @synchronized(_connectionTransforms)
+    NSData *_sendTransform;
+    NSMutableDictionary *_connectionTransforms;     // traffic stats key -> transform
+    
+    // The thru matrix: source traffic stats key -> (destination key -> filter NSData or NSNull). Under @synchronized(_connectionTransforms) and built into the send routes like the transforms
+    NSMutableDictionary *_thruRoutes;
+    atomic_bool _thruActive;                        // the published routes have some. Saves the read procs a snapshot read when not
+    
+    // Per endpoint / Audiobus port traffic counters. Entries live as long as the session. See _trafficStatsForKey:
+    _MFTrafficStatsTableRef _trafficStats;
+    
+    // Notes sounding per endpoint / Audiobus port, keyed and kept like the traffic stats. See _activeNotesForKey:
+    _MFActiveNotesTableRef _activeNotes;
+    
+    // Scheduled sends. The timer and armed time are only touched on _schedulerQueue
+    MFMIDISchedulerRef _scheduler;
+    dispatch_queue_t _schedulerQueue;
+    dispatch_source_t _schedulerTimer;
+    uint64_t _schedulerArmedTime;
+    
+    // Continuous controller coalescing per destination class. Flushes run on _schedulerQueue (and on the sender's thread when something order-sensitive needs to go after them)
+    MFMIDICoalescerRef _coalescers[_COALESCER_COUNT];
+    MFMIDICoalescingPolicy _coalescingPolicies[_COALESCER_COUNT];
+    atomic_uint _coalescedClasses;                  // _MFSendTargetClass bits with a policy on. Read on the send path
+    atomic_uint _coalescerPendingClasses;           // _MFSendTargetClass bits with something held back. Set on add, cleared as a flush starts
+    _Atomic uint64_t _coalescerLastFlushTime[_COALESCER_COUNT];   // written on _schedulerQueue, read by senders arming the timer
+    dispatch_source_t _coalescerTimers[_COALESCER_COUNT];         // one shot, re-armed by senders. Made up front so arming doesn't allocate
+    
+    atomic_uint _runningStatusClasses;              // _MFSendTargetClass bits to send with running status. Read on the send path
+    
+    NSMutableArray *_sysexTransfers;                // [_MFSysexTransferState]. _schedulerQueue only
+    
+    // Render thread sends. Drained by the timer on _schedulerQueue. The array and timer are only touched there
+    NSMutableArray *_renderQueues;                  // [NSValue(MFMIDIRenderQueueRef)]
+    dispatch_source_t _renderQueueTimer;
+    BOOL _renderQueueTimerSuspended;                // no queues, or they've been idle a while
+    NSUInteger _renderQueueIdleDrains;
+    dispatch_source_t _renderQueueWakeSource;       // merged by the first enqueue on a sleeping queue. Made up front as the queues hold it
+    
+    // The recorder is in the send routes and receive queue too. Under @synchronized(_connectionTransforms) like the other things the routes are built from
+    MFMIDIFileRecorderRef _recorder;
+    _MFFilePlaybackState *_playback;                // _schedulerQueue only
 }
 
 //---------------------------------------------------------------------
@@ -145,39 +319,108 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 
 //---------------------------------------------------------------------
 
++ (instancetype)sessionWithName:(NSString *)name backend:(const MFMIDIBackend *)backend
+{
+    return [[self alloc] initWithName:name backend:backend];
+}
+
+//---------------------------------------------------------------------
+
 - (instancetype)initWithName:(NSString *)name
 {
+    return [self initWithName:name backend:MFMIDICoreMIDIBackend()];
+}
+
+//---------------------------------------------------------------------
+
+- (instancetype)initWithName:(NSString *)name backend:(const MFMIDIBackend *)backend
+{
+    return [self initWithName:name backend:backend stateStorage:MFMIDIUserDefaultsStateStorage()];
+}
+
+//---------------------------------------------------------------------
+
+- (instancetype)initWithName:(NSString *)name backend:(const MFMIDIBackend *)backend stateStorage:(const MFMIDIStateStorage *)stateStorage
+{
+    return [self initWithName:name backend:backend stateStorage:stateStorage discovery:MFMIDIBonjourDiscovery()];
+}
+
+//---------------------------------------------------------------------
+
+- (instancetype)initWithName:(NSString *)name backend:(const MFMIDIBackend *)backend stateStorage:(const MFMIDIStateStorage *)stateStorage discovery:(const MFMIDIDiscovery *)discovery
+{
+    NSParameterAssert(backend);
     self = [super init];
     if (self) {
-        _netServicesAwaitingResolve = [NSMutableArray array];
+        _backend = backend;
+        _endpointInfo = _MFEndpointInfoCacheCreate(backend);
+        if (!_endpointInfo) {
+            @throw [MFNonFatalException exceptionWithOSStatus:0 reason:@"Unable to create endpoint info cache (out of memory)"];
+        }
         _name = name;
-        _netBrowser = [[NSNetServiceBrowser alloc] init];
-        _netBrowser.delegate = self;
         _excludeSelfInNetworkScan = YES;
         _persistManualNetworkConnections = YES;
-        _endpointSources = (id)[NSArray array];
-        _endpointDestinations = (id)[NSArray array];
-        _networkSources = (id)[NSArray array];
-        _networkDestinations = (id)[NSArray array];
-        _virtualDestinations = (id)[NSArray array];
-        _virtualSources = (id)[NSArray array];
-        _destinationEndpoints = [NSMutableArray array];
-        _sourceEndpoints = [NSMutableArray array];
-        _delegates = [NSMutableArray array];
+        _registry = [[_MFConnectionRegistry alloc] init];
+        _delegateDispatcher = [[_MFDelegateDispatcher alloc] initWithSession:self];
         _midiNetSession = [MIDINetworkSession defaultSession];
-        _userDefs = [NSUserDefaults standardUserDefaults];
+        _stateStore = _MFConnectionStateStoreCreate(stateStorage, (int64_t)[NSDate date].timeIntervalSince1970);
+        if (!_stateStore) {
+            @throw [MFNonFatalException exceptionWithOSStatus:0 reason:@"Unable to create connection state store (out of memory)"];
+        }
+        if (discovery) {
+            _netDiscovery = _MFNetDiscoveryCreate(discovery, _stateStore, &_kMFNetDiscoveryCallbacks, (__bridge void *)self);
+            if (!_netDiscovery) {
+                @throw [MFNonFatalException exceptionWithOSStatus:0 reason:@"Unable to create network discovery (out of memory)"];
+            }
+        }
+        _stateSaveQueue = dispatch_queue_create("co.air-craft.MIDIFish.stateSave", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_stateSaveQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+        _connectionStateMaxAge = _CONNECTION_STATE_MAX_AGE_DEFAULT;
         _audiobusDestinations = [NSMutableArray array];
         
         _midiNetSession.connectionPolicy = MIDINetworkConnectionPolicy_Anyone;
         
         _coreMIDISendEnabled = YES;
+        _sendRouter = _MFSendRouterCreate();
+        _connectionTransforms = [NSMutableDictionary dictionary];
+        _thruRoutes = [NSMutableDictionary dictionary];
+        atomic_init(&_thruActive, false);
+        mach_timebase_info_data_t timebase = _MFTimebase();
+        _trafficStats = _MFTrafficStatsTableCreate(timebase.numer, timebase.denom);
+        _activeNotes = _MFActiveNotesTableCreate();
+        
+        _receiveQueue = [[_MFMIDIReceiveQueue alloc] initWithRingCapacity:_RECEIVE_RING_CAPACITY];
+        _receiveQueue.inputPortContext->thruRefCon = (__bridge void *)self;
+        _receiveDeliveryQueue = dispatch_get_main_queue();
+        _receivePollInterval = _RECEIVE_POLL_INTERVAL_DEFAULT;
+        _networkReceiveID = [_receiveQueue reserveSourceID];
+        [self _registerReceiveSource:_midiNetSession forID:_networkReceiveID key:_midiNetSession.sourceEndpoint];
+        
+        _scheduler = MFMIDISchedulerCreate();
+        _scheduleLookahead = _SCHEDULE_LOOKAHEAD_DEFAULT;
+        _schedulerArmedTime = kMFMIDISchedulerNoEvent;
+        _schedulerQueue = dispatch_queue_create("co.air-craft.MIDIFish.scheduler", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_schedulerQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+        
+        for (int i=0; i<_COALESCER_COUNT; i++) {
+            _coalescers[i] = MFMIDICoalescerCreate();
+            atomic_init(&_coalescerLastFlushTime[i], 0);
+            _coalescerTimers[i] = [self _createCoalescerTimerForIndex:i];
+        }
+        atomic_init(&_coalescedClasses, 0);
+        atomic_init(&_coalescerPendingClasses, 0);
+        atomic_init(&_runningStatusClasses, 0);
+        _sysexTransfers = [NSMutableArray array];
+        _renderQueues = [NSMutableArray array];
+        _renderQueueDrainInterval = _RENDER_QUEUE_DRAIN_INTERVAL_DEFAULT;
+        _renderQueueWakeSource = [self _createRenderQueueWakeSource];
         
         // Create the MIDI I/O structure
         OSStatus s;
         NSString *portName, *format;
         
         echo("Creating MIDI Client with name \"%@\"", name);
-        s = MIDIClientCreate((__bridge CFStringRef)_name, _MFMIDINotifyProc, (__bridge void *)self, &_clientRef);
+        s = _backend->clientCreate(_backend->context, _name.UTF8String, _MFMIDINotifyProc, (__bridge void *)self, &_clientRef);
         _MFCheckErr(s, @"Unable to create MIDI Client");
         
         
@@ -185,7 +428,17 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
                                    @"MIDIFish: Text appended to MIDIClient name for the Input Port name");
         portName = [NSString stringWithFormat:format, _name];
         echo("Creating MIDI Input Port with name \"%@\"", portName);
-        s = MIDIInputPortCreate(_clientRef, (__bridge CFStringRef)portName, _MFMIDIReadProc, (__bridge void *)self, &_inputPortRef);
+        // MIDI 2.0 where we can so high resolution sources come through whole. MIDI 1.0 ones scale up and back down exactly
+        BOOL isInputPortCreated = NO;
+        if (@available(macOS 11.0, iOS 14.0, *)) {
+            if (_backend->inputPortCreateWithProtocol) {
+                s = _backend->inputPortCreateWithProtocol(_backend->context, _clientRef, portName.UTF8String, kMIDIProtocol_2_0, _MFMIDIEventReadProc, _receiveQueue.inputPortContext, &_inputPortRef);
+                isInputPortCreated = YES;
+            }
+        }
+        if (!isInputPortCreated) {
+            s = _backend->inputPortCreate(_backend->context, _clientRef, portName.UTF8String, _MFMIDIReadProc, _receiveQueue.inputPortContext, &_inputPortRef);
+        }
         _MFCheckErr(s, @"Unable to create MIDI Input Port");
         
         
@@ -193,28 +446,184 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
                                    @"MIDIFish: Text appended to MIDIClient name for the Output Port name");
         portName = [NSString stringWithFormat:format, _name];
         echo("Creating MIDI Output Port with name \"%@\"", portName);
-        s = MIDIOutputPortCreate(_clientRef, (__bridge CFStringRef)portName, &_outputPortRef);
+        s = _backend->outputPortCreate(_backend->context, _clientRef, portName.UTF8String, &_outputPortRef);
         _MFCheckErr(s, @"Unable to create MIDI Ouput Port");
         
-        self.networkEnabled = YES;
+        // MIDINetworkSession is CoreMIDI's own so only applies there
+        if (_backend == MFMIDICoreMIDIBackend()) {
+            self.networkEnabled = YES;
+        }
     }
     return self;
 }
 
 
 
+//---------------------------------------------------------------------
+
+- (void)dealloc
+{
+    // First, so no read or notify proc calls in while what they use is freed. The receive queue's contexts go with it after this
+    [self _disposeMIDIIO];
+    
+    if (_receiveTimer) dispatch_source_cancel(_receiveTimer);
+    if (_schedulerTimer) dispatch_source_cancel(_schedulerTimer);
+    for (int i=0; i<_COALESCER_COUNT; i++) {
+        dispatch_source_cancel(_coalescerTimers[i]);
+    }
+    if (_netDeadlineTimer) dispatch_source_cancel(_netDeadlineTimer);
+    _MFNetDiscoveryDestroy(_netDiscovery);
+    
+    dispatch_source_cancel(_renderQueueWakeSource);
+    if (_renderQueueTimer) {
+        dispatch_source_cancel(_renderQueueTimer);
+        // A suspended source can't be released
+        if (_renderQueueTimerSuspended) dispatch_resume(_renderQueueTimer);
+    }
+    
+    // Let anything in flight on the queue finish before pulling the scheduler (and render queues) out from under it
+    MFMIDISchedulerRef scheduler = _scheduler;
+    NSArray *renderQueues = _renderQueues;
+    dispatch_async(_schedulerQueue, ^{
+        MFMIDISchedulerDestroy(scheduler);
+        for (NSValue *val in renderQueues) {
+            MFMIDIRenderQueueDestroy(val.pointerValue);
+        }
+    });
+    
+    _MFSendRouterDestroy(_sendRouter);
+    if (_recorder) {
+        [_receiveQueue setRecorder:NULL track:0];
+        MFMIDIFileRecorderDestroy(_recorder);
+    }
+    _MFTrafficStatsTableDestroy(_trafficStats);
+    _MFActiveNotesTableDestroy(_activeNotes);
+    for (int i=0; i<_COALESCER_COUNT; i++) {
+        MFMIDICoalescerDestroy(_coalescers[i]);
+    }
+    
+    // Pending saves bail once we're gone (and this may be the last of them releasing us) so write directly
+    if (!_MFConnectionStateStoreSave(_stateStore)) {
+        warn("Failed to save connection states");
+    }
+    _MFConnectionStateStoreDestroy(_stateStore);
+    _MFEndpointInfoCacheDestroy(_endpointInfo);
+}
+
+
+
 /////////////////////////////////////////////////////////////////////////
 #pragma mark - Properties
 /////////////////////////////////////////////////////////////////////////
 
-- (BOOL)networkEnabled { return _midiNetSession.enabled; }
+// Immutable snapshots from the registry
+- (NSArray *)endpointSources { return [_registry connectionsInList:_kMFConnectionListEndpointSources]; }
+- (NSArray *)endpointDestinations { return [_registry connectionsInList:_kMFConnectionListEndpointDestinations]; }
+- (NSArray *)networkSources { return [_registry connectionsInList:_kMFConnectionListNetworkSources]; }
+- (NSArray *)networkDestinations { return [_registry connectionsInList:_kMFConnectionListNetworkDestinations]; }
+- (NSArray *)virtualSources { return [_registry connectionsInList:_kMFConnectionListVirtualSources]; }
+- (NSArray *)virtualDestinations { return [_registry connectionsInList:_kMFConnectionListVirtualDestinations]; }
+
+//---------------------------------------------------------------------
+
+- (BOOL)networkEnabled { return _backend == MFMIDICoreMIDIBackend() && _midiNetSession.enabled; }
 - (void)setNetworkEnabled:(BOOL)networkEnabled
 {
+    if (_backend != MFMIDICoreMIDIBackend()) {
+        warn("Network sessions are only available with the CoreMIDI backend (using %s)", _backend->name);
+        return;
+    }
     echo("%@abling MIDINetworkSession", networkEnabled ? @"En" : @"Dis");
 
     _midiNetSession.enabled = networkEnabled;
 }
 
+//---------------------------------------------------------------------
+
+- (void)setReceiveDeliveryQueue:(dispatch_queue_t)receiveDeliveryQueue
+{
+    _receiveDeliveryQueue = receiveDeliveryQueue;
+    
+    // Restart it on the new queue (if it was running)
+    if (_receiveTimer) {
+        dispatch_source_cancel(_receiveTimer);
+        _receiveTimer = nil;
+        [self _startReceiveTimerIfNeeded];
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (dispatch_queue_t)connectionEventQueue { return _delegateDispatcher.queue; }
+- (void)setConnectionEventQueue:(dispatch_queue_t)connectionEventQueue
+{
+    _delegateDispatcher.queue = connectionEventQueue;
+}
+
+//---------------------------------------------------------------------
+
+- (NSTimeInterval)connectionChangeCoalescingInterval { return _delegateDispatcher.coalescingInterval; }
+- (void)setConnectionChangeCoalescingInterval:(NSTimeInterval)connectionChangeCoalescingInterval
+{
+    _delegateDispatcher.coalescingInterval = MAX(connectionChangeCoalescingInterval, 0);
+}
+
+//---------------------------------------------------------------------
+
+- (void)setReceivePollInterval:(NSTimeInterval)receivePollInterval
+{
+    _receivePollInterval = receivePollInterval;
+    if (_receiveTimer) {
+        dispatch_source_set_timer(_receiveTimer, DISPATCH_TIME_NOW, (uint64_t)(receivePollInterval * NSEC_PER_SEC), (uint64_t)(receivePollInterval * 0.2 * NSEC_PER_SEC));
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)setRenderQueueDrainInterval:(NSTimeInterval)renderQueueDrainInterval
+{
+    _renderQueueDrainInterval = renderQueueDrainInterval;
+    @weakify(self);
+    dispatch_async(_schedulerQueue, ^{
+        @strongify(self);
+        if (self->_renderQueueTimer) {
+            dispatch_source_set_timer(self->_renderQueueTimer, DISPATCH_TIME_NOW, (uint64_t)(renderQueueDrainInterval * NSEC_PER_SEC), (uint64_t)(renderQueueDrainInterval * 0.1 * NSEC_PER_SEC));
+        }
+    });
+}
+
+//---------------------------------------------------------------------
+
+- (MFMIDIReceiveStatistics)receiveStatistics
+{
+    return _receiveQueue.statistics;
+}
+
+//---------------------------------------------------------------------
+
+- (MFMIDICoalescingPolicy)localCoalescingPolicy { return _coalescingPolicies[_COALESCER_LOCAL]; }
+- (void)setLocalCoalescingPolicy:(MFMIDICoalescingPolicy)policy { [self _setCoalescingPolicy:policy forIndex:_COALESCER_LOCAL]; }
+
+- (MFMIDICoalescingPolicy)networkCoalescingPolicy { return _coalescingPolicies[_COALESCER_NETWORK]; }
+- (void)setNetworkCoalescingPolicy:(MFMIDICoalescingPolicy)policy { [self _setCoalescingPolicy:policy forIndex:_COALESCER_NETWORK]; }
+
+//---------------------------------------------------------------------
+
+- (BOOL)localRunningStatusEnabled { return (atomic_load(&_runningStatusClasses) & _kMFSendTargetClassLocal) != 0; }
+- (void)setLocalRunningStatusEnabled:(BOOL)enabled { [self _setRunningStatusEnabled:enabled forClass:_kMFSendTargetClassLocal]; }
+
+- (BOOL)networkRunningStatusEnabled { return (atomic_load(&_runningStatusClasses) & _kMFSendTargetClassNetwork) != 0; }
+- (void)setNetworkRunningStatusEnabled:(BOOL)enabled { [self _setRunningStatusEnabled:enabled forClass:_kMFSendTargetClassNetwork]; }
+
+//---------------------------------------------------------------------
+
+- (MFMIDITrafficStatistics)trafficStatistics
+{
+    MFMIDITrafficStatistics stats;
+    _MFTrafficStatsTableSnapshotAll(_trafficStats, &stats);
+    return stats;
+}
+
 
 
 /////////////////////////////////////////////////////////////////////////
@@ -223,14 +632,14 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 
 - (void)addDelegate:(id<MFMIDISessionDelegate>)delegate
 {
-    [_delegates addObject:delegate];
+    [_delegateDispatcher addDelegate:delegate];
 }
 
 //---------------------------------------------------------------------
 
 - (void)removeDelegate:(id<MFMIDISessionDelegate>)delegate
 {
-    [_delegates removeObject:delegate];
+    [_delegateDispatcher removeDelegate:delegate];
 }
 
 //---------------------------------------------------------------------
@@ -248,25 +657,40 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
     }
     
     [self _notifyDelegatesConnectionRefreshDidBegin];
+    
+    // Forget long gone connections before we look up the current ones
+    if (_MFConnectionStateStorePrune(_stateStore, [self _stateStoreNow], (int64_t)_connectionStateMaxAge)) {
+        [self _scheduleStateSave];
+    }
 
     // Enable to more easily debug the "repeat refresh causes MIDINetworkConnectio bad access on deconstruct" errors
-//    _networkDestinations = @[];
-//    _networkSources = @[];
-//    _destinationEndpoints = @[].mutableCopy;
-//    _sourceEndpoints = @[].mutableCopy;
+//    _registry = [[_MFConnectionRegistry alloc] init];
     
     // Rescan endpoints/direct connections and
     [self _refreshConnectionsForMIDIEndpoints];
     
     // For network, re-add persisted manuals and initiate a network scan if enabled
     // Otherwise send "End" straight away if network is disabled
-    if (self.networkEnabled)
+    if (self.networkEnabled && _netDiscovery)
     {
+        self.isRefreshing = YES; // use setter to invoke KVO
+        
+        // Grab a copy of existing net conx to report removals to delegate when done
+        _netConxToRemove = [NSMutableSet set];
+        [_netConxToRemove addObjectsFromArray:self.networkSources];
+        [_netConxToRemove addObjectsFromArray:self.networkDestinations];
+        
         if (_persistManualNetworkConnections) {
             [self _restoreManualNetworkConnections];
         }
         
-        [_netBrowser searchForServicesOfType:MIDINetworkBonjourServiceType inDomain:@""];
+        // Connects remembered hosts straight away then browses. May end before it returns
+        // Don't use UIDevice.currentDevice.name as apparently it can be different: http://stackoverflow.com/questions/7723801/apple-bonjour-how-can-i-tell-which-published-service-is-my-own/31526432?noredirect=1#comment51654025_31526432
+        const char *excludeName = _excludeSelfInNetworkScan ? _midiNetSession.networkName.UTF8String : NULL;
+        _MFNetDiscoveryBegin(_netDiscovery, excludeName, _NETSERVICE_RESOLVE_TIMEOUT, _NETSERVICE_CACHED_RESOLVE_DEADLINE, [self _stateStoreNow]);
+        if (_MFNetDiscoveryIsRefreshing(_netDiscovery)) {
+            [self _startNetDeadlineTimer];
+        }
     }
     else
     {
@@ -276,6 +700,15 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 
 //---------------------------------------------------------------------
 
+- (void)savePersistentState
+{
+    dispatch_sync(_stateSaveQueue, ^{
+        [self _saveStateStore];
+    });
+}
+
+//---------------------------------------------------------------------
+
 - (void)cancelRefresh
 {
     if (!self.networkEnabled) {
@@ -289,13 +722,54 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
     
     echo("Cancelling (net) refresh"); // just net b/c the other is instantaneous
     
-    // Stop the netService resolves too
-    for (NSNetService *netService in _netServicesAwaitingResolve.copy) {
-        [netService stop];
+    // Stops the browse and the resolves, then ends the refresh as usual
+    _MFNetDiscoveryCancel(_netDiscovery);
+}
+
+//---------------------------------------------------------------------
+
+- (NSUInteger)drainReceivedMessages:(void (^)(id<MFMIDISource>, NSArray *))handler
+{
+    return [self drainReceivedMessages:handler UMPHandler:nil];
+}
+
+//---------------------------------------------------------------------
+
+- (NSUInteger)drainReceivedMessages:(void (^)(id<MFMIDISource>, NSArray *))handler UMPHandler:(void (^)(id<MFMIDISource>, const uint32_t *, NSUInteger))UMPHandler
+{
+    NSParameterAssert(handler);
+    
+    void (^queueUMPHandler)(id, const uint32_t *, NSUInteger) = nil;
+    if (UMPHandler) {
+        queueUMPHandler = ^(id source, const uint32_t *words, NSUInteger count) {
+            source = [self _deliverableReceiveSource:source];
+            if (source) UMPHandler(source, words, count);
+        };
     }
-    [_netServicesAwaitingResolve removeAllObjects];
+    
+    return [_receiveQueue drainWithHandler:^(id source, NSArray *messages) {
+        source = [self _deliverableReceiveSource:source];
+        if (source) handler(source, messages);
+    } UMPHandler:queueUMPHandler];
+}
+
+//---------------------------------------------------------------------
 
-    [_netBrowser stop];
+/** Who received MIDI goes to for a source the receive queue knows. nil to discard it */
+- (id<MFMIDISource>)_deliverableReceiveSource:(id)source
+{
+    // Network traffic can't be attributed to a host. Hand it to the first enabled one
+    if (source == _midiNetSession) {
+        source = nil;
+        for (_MFMIDINetworkSource *netSrc in self.networkSources) {
+            if (netSrc.enabled) {
+                source = netSrc;
+                break;
+            }
+        }
+    }
+    
+    return [source enabled] ? source : nil;
 }
 
 //---------------------------------------------------------------------
@@ -303,17 +777,17 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 - (id<MFMIDIDestination>)createVirtualSourceWithName:(NSString *)name
 {
     // Check whether one exists already with the given name
-    NSPredicate *pred = [NSPredicate predicateWithFormat:@"name == %@", name];
-    NSArray *matching = [_virtualSources filteredArrayUsingPredicate:pred];
-    if (matching.count > 0) {
+    id<MFMIDIDestination> existing = [_registry connectionInList:_kMFConnectionListVirtualSources withName:name];
+    if (existing) {
         warn("Virtual Source already exists with name %@", name);
-        return matching[0];
+        return existing;
     }
     
     MIDIEndpointRef endpoint;
-    _MFCheckErr(MIDISourceCreate(_clientRef,
-                                 (__bridge CFStringRef)name,
-                                 &endpoint),
+    _MFCheckErr(_backend->sourceCreate(_backend->context,
+                                       _clientRef,
+                                       name.UTF8String,
+                                       &endpoint),
                 @"Could not create Virtual Source with name %@", name);
     
     echo("Creating MIDI Source with endpoint %i for Virtual Source with name \"%@\"", (int)endpoint, name);
@@ -321,7 +795,8 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
     // Create the Object
     _MFMIDIEndpointDestination *vsource = [self _connectDestinationEndpoint:endpoint];
     vsource.isVirtualConnection = YES;
-    _virtualSources = (id)[_virtualSources arrayByAddingObject:vsource];
+    [_registry addConnection:vsource toList:_kMFConnectionListVirtualSources];
+    [self _rebuildSendRoutes];     // now it's flagged virtual it needs MIDIReceived rather than MIDISend
     
     return vsource;
 }
@@ -331,27 +806,35 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 - (id<MFMIDISource>)createVirtualDestinationWithName:(NSString *)name
 {
     // Check whether one exists already with the given name
-    NSPredicate *pred = [NSPredicate predicateWithFormat:@"name == %@", name];
-    NSArray *matching = [_virtualDestinations filteredArrayUsingPredicate:pred];
-    if (matching.count > 0) {
+    id<MFMIDISource> existing = [_registry connectionInList:_kMFConnectionListVirtualDestinations withName:name];
+    if (existing) {
         warn("Virtual Destination already exists with name %@", name);
-        return matching[0];
+        return existing;
     }
     
     echo("Creating Virtual Destination with name \"%@\"", name);
 
+    // Virtual destinations have their own read proc so they get their own ring (keeps it single producer)
+    uint32_t receiveID = [_receiveQueue reserveSourceID];
+    _MFMIDIReceiveContext *receiveContext = [_receiveQueue addContextForSourceID:receiveID];
+    receiveContext->thruRefCon = (__bridge void *)self;
+    
     MIDIEndpointRef endpoint;
-    _MFCheckErr(MIDIDestinationCreate(_clientRef,
-                                      (__bridge CFStringRef)name,
-                                      _MFMIDIReadProc,
-                                      (__bridge void *)self,
-                                      &endpoint),
+    _MFCheckErr(_backend->destinationCreate(_backend->context,
+                                            _clientRef,
+                                            name.UTF8String,
+                                            _MFMIDIReadProc,
+                                            receiveContext,
+                                            &endpoint),
                 @"Could not create Virtual Destination with name %@", name);
     
     // Create the Object
     _MFMIDIEndpointSource *vdest = [self _connectSourceEndpoint:endpoint];
     vdest.isVirtualConnection = YES;
-    _virtualDestinations = (id)[_virtualDestinations arrayByAddingObject:vdest];
+    [_registry addConnection:vdest toList:_kMFConnectionListVirtualDestinations];
+    
+    [self _registerReceiveSource:vdest forID:receiveID key:endpoint];
+    [self _startReceiveTimerIfNeeded];
     
     return vdest;
 }
@@ -373,21 +856,13 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
     
     [self _storeConnectionEnabledState:conn];
     
-    // Store in userdefs if specified
+    // Persist if specified
     if (_persistManualNetworkConnections)
     {
-        echo("...Storing Connection in UserDefs");
-        
-        NSMutableDictionary *manualConns = [[_userDefs objectForKey:_kUserDefsKeyManualConnections] mutableCopy];
-        // Create dict of none previously
-        if (manualConns == nil) {
-            echo("...First ever entry!");
-            manualConns = [NSMutableDictionary new];
+        echo("...Storing Connection");
+        if (_MFConnectionStateStoreSetManualHost(_stateStore, name.UTF8String, address.UTF8String, (uint16_t)port)) {
+            [self _scheduleStateSave];
         }
-        manualConns[name] = @{ @"address": address, @"port": @(port) };
-        
-        [_userDefs setObject:manualConns forKey:_kUserDefsKeyManualConnections];
-        [_userDefs synchronize];
     }
     
     return conns;
@@ -400,21 +875,8 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
     echo("Removing connection and persistence for Manual Network Connection '%@'", name);
     
     // Find the connections
-    _MFMIDINetworkConnection *source, *destination;
-    for (_MFMIDINetworkConnection *conn in _networkSources)
-    {
-        if ([conn.name isEqual:name]) {
-            source = conn;
-            break;
-        }
-    }
-    for (_MFMIDINetworkConnection *conn in _networkDestinations)
-    {
-        if ([conn.name isEqual:name]) {
-            destination = conn;
-            break;
-        }
-    }
+    _MFMIDINetworkConnection *source = [_registry connectionInList:_kMFConnectionListNetworkSources withName:name];
+    _MFMIDINetworkConnection *destination = [_registry connectionInList:_kMFConnectionListNetworkDestinations withName:name];
     
     // Sanity check
     NSAssert(source && destination, @"Something's weird. We dont have a complete pair: source=%@, destination=%@", source, destination);
@@ -423,20 +885,13 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
     destination.enabled = NO;
     
     // Remove them from the connections list
-    NSPredicate *pred = [NSPredicate predicateWithFormat:@"SELF != %@", source];
-    _networkSources = [_networkSources filteredArrayUsingPredicate:pred];
-    NSPredicate *pred2 = [NSPredicate predicateWithFormat:@"SELF != %@", destination];
-    _networkDestinations = [_networkDestinations filteredArrayUsingPredicate:pred2];
+    [_registry removeConnection:source fromList:_kMFConnectionListNetworkSources];
+    [_registry removeConnection:destination fromList:_kMFConnectionListNetworkDestinations];
+    [self _rebuildSendRoutes];
     
-    // Remove from the UserDefs if set
-    if (_persistManualNetworkConnections)
-    {
-        NSMutableDictionary *manualConns = [[_userDefs objectForKey:_kUserDefsKeyManualConnections] mutableCopy];
-        if (manualConns && [manualConns objectForKey:name]) {
-            [manualConns removeObjectForKey:name];
-            [_userDefs setObject:manualConns forKey:_kUserDefsKeyManualConnections];
-            [_userDefs synchronize];
-        }
+    // Remove from persistence if set
+    if (_persistManualNetworkConnections && _MFConnectionStateStoreRemoveManualHost(_stateStore, name.UTF8String)) {
+        [self _scheduleStateSave];
     }
 }
 
@@ -444,20 +899,9 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 
 - (NSUInteger)availableSourcesCountIncludeVirtual:(BOOL)includeVirtual
 {
-    NSArray *connections = [_networkSources arrayByAddingObjectsFromArray:_endpointSources];
-    
-    if (includeVirtual) return connections.count;
-    
-    NSUInteger cnt = 0;
-    for (id<MFMIDIConnection> conn in connections) {
-        if ([conn isKindOfClass:[_MFCoreMIDIConnection class]]) {
-            if (!((_MFCoreMIDIConnection *)conn).isVirtualConnection) {
-                cnt++;
-            }
-        } else {
-            cnt++;
-        }
-    }
+    // Virtual Destinations are local Endpoint Sources
+    NSUInteger cnt = [_registry countOfList:_kMFConnectionListNetworkSources] + [_registry countOfList:_kMFConnectionListEndpointSources];
+    if (!includeVirtual) cnt -= [_registry countOfList:_kMFConnectionListVirtualDestinations];
     return cnt;
 }
 
@@ -465,21 +909,9 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 
 - (NSUInteger)availableDestinationsCountIncludeVirtual:(BOOL)includeVirtual
 {
-    NSArray *connections = [_networkDestinations arrayByAddingObjectsFromArray:_endpointDestinations];
-    connections = [connections arrayByAddingObjectsFromArray:_audiobusDestinations];
-    
-    if (includeVirtual) return connections.count;
-    
-    NSUInteger cnt = 0;
-    for (id<MFMIDIConnection> conn in connections) {
-        if ([conn isKindOfClass:[_MFCoreMIDIConnection class]]) {
-            if (!((_MFCoreMIDIConnection *)conn).isVirtualConnection) {
-                cnt++;
-            }
-        } else {
-            cnt++;
-        }
-    }
+    // Virtual Sources are local Endpoint Destinations. Audiobus ones are never virtual
+    NSUInteger cnt = [_registry countOfList:_kMFConnectionListNetworkDestinations] + [_registry countOfList:_kMFConnectionListEndpointDestinations] + _audiobusDestinations.count;
+    if (!includeVirtual) cnt -= [_registry countOfList:_kMFConnectionListVirtualSources];
     return cnt;
 }
 
@@ -487,12 +919,12 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 
 - (NSUInteger)enabledSourcesCountIncludeVirtual:(BOOL)includeVirtual
 {
-    NSArray *connections = [_networkSources arrayByAddingObjectsFromArray:_endpointSources];
-    
     NSUInteger cnt = 0;
-    for (_MFCoreMIDIConnection *conn in connections) {
-        if (conn.enabled && (includeVirtual || !conn.isVirtualConnection))
-            cnt++;
+    for (NSArray *connections in @[self.networkSources, self.endpointSources]) {
+        for (_MFCoreMIDIConnection *conn in connections) {
+            if (conn.enabled && (includeVirtual || !conn.isVirtualConnection))
+                cnt++;
+        }
     }
     return cnt;
 }
@@ -501,990 +933,2550 @@ static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish
 
 - (NSUInteger)enabledDestinationsCountIncludeVirtual:(BOOL)includeVirtual
 {
-    NSArray *connections = [_networkDestinations arrayByAddingObjectsFromArray:_endpointDestinations];
-    connections = [connections arrayByAddingObjectsFromArray:_audiobusDestinations];
-    
     NSUInteger cnt = 0;
-    for (id<MFMIDIConnection> conn in connections) {
-        if (!conn.enabled) continue;
-        if (!includeVirtual && [conn isKindOfClass:[_MFCoreMIDIConnection class]] && ((_MFCoreMIDIConnection *)conn).isVirtualConnection)
-            continue;
-        cnt++;
+    for (NSArray *connections in @[self.networkDestinations, self.endpointDestinations, _audiobusDestinations]) {
+        for (id<MFMIDIConnection> conn in connections) {
+            if (!conn.enabled) continue;
+            if (!includeVirtual && [conn isKindOfClass:[_MFCoreMIDIConnection class]] && ((_MFCoreMIDIConnection *)conn).isVirtualConnection)
+                continue;
+            cnt++;
+        }
     }
     return cnt;
 }
 
+//---------------------------------------------------------------------
+
+- (MFMIDITrafficStatistics)trafficStatisticsForConnection:(id<MFMIDIConnection>)connection
+{
+    MFMIDITrafficStatistics stats = {0};
+    uint64_t key = [self _trafficStatsKeyForConnection:connection];
+    _MFTrafficStats *liveStats = key ? _MFTrafficStatsTableFind(_trafficStats, key) : NULL;
+    if (liveStats) _MFTrafficStatsSnapshot(liveStats, &stats);
+    return stats;
+}
+
 
 
 /////////////////////////////////////////////////////////////////////////
-#pragma mark - Audiobus
+#pragma mark - Transforms
 /////////////////////////////////////////////////////////////////////////
 
-- (void)assignAudiobusController:(ABAudiobusController *)abController
+- (void)setSendTransform:(const MFMIDITransform *)transform
 {
-    NSParameterAssert(abController);
-    _abController = abController;
-    
-    // Handle core midi enable/disable
-    @weakify(self);
-    [_abController setEnableSendingCoreMIDIBlock:^(BOOL enableCoreMIDI) {
-        _coreMIDISendEnabled = enableCoreMIDI;
-        @strongify(self);
-        echo("CoreMIDI Enabled = %@", self->_coreMIDISendEnabled?@"YES":@"NO");
-    }];
+    @synchronized(_connectionTransforms) {
+        _sendTransform = transform ? [NSData dataWithBytes:transform length:sizeof(MFMIDITransform)] : nil;
+    }
+    [self _rebuildSendRoutes];
 }
 
 //---------------------------------------------------------------------
 
-- (void)addAudiobusDestination:(MFAudiobusDestination *)abDestination
+- (void)setReceiveTransform:(const MFMIDITransform *)transform
 {
-    if ([_audiobusDestinations containsObject:abDestination]) {
-        NSAssert(NO, @"Already contains the given MFAudiobusDestination");
-    }
-    
-    [_audiobusDestinations addObject: abDestination];
+    [_receiveQueue setTransform:transform];
 }
 
 //---------------------------------------------------------------------
 
-- (MFAudiobusDestination *)createAudiobusSenderPortWithName:(NSString *)name title:(NSString *)title
+- (void)setTransform:(const MFMIDITransform *)transform forConnection:(id<MFMIDIConnection>)connection
 {
-    NSAssert(_abController, @"Must call assignAudiobusController: first!");
-    MFAudiobusDestination *abDest = [[MFAudiobusDestination alloc] initWithName:name title:title controller:_abController];
-    [self addAudiobusDestination:abDest];
-    return abDest;
-}
+    const uint64_t key = [self _trafficStatsKeyForConnection:connection];
+    if (!key) {
+        warn("Transforms aren't supported for connection %@", connection);
+        return;
+    }
+    
+    @synchronized(_connectionTransforms) {
+        if (transform) {
+            _connectionTransforms[@(key)] = [NSData dataWithBytes:transform length:sizeof(MFMIDITransform)];
+        } else {
+            [_connectionTransforms removeObjectForKey:@(key)];
+        }
+    }
+    
+    // Sources have it from their next drain, destinations from the next send
+    if ([connection conformsToProtocol:@protocol(MFMIDISource)]) {
+        uint32_t receiveID = [connection isKindOfClass:_MFMIDINetworkSource.class] ? _networkReceiveID : [_receiveQueue sourceIDForSource:connection];
+        if (receiveID) [_receiveQueue setTransform:[self _transformForKey:key].bytes forSourceID:receiveID];
+    } else {
+        [self _rebuildSendRoutes];
+    }
+}
 
 
 
 /////////////////////////////////////////////////////////////////////////
-#pragma mark - <MFMIDIMessageSender>
+#pragma mark - Recording & Playback
 /////////////////////////////////////////////////////////////////////////
 
-/** 
- @throws MFNonFatalException on send error. Will attempt to send to all relevant connections b4 throwing the exception
- */
-- (void)sendMIDIMessage:(MFMIDIMessage *)message
+- (BOOL)startRecordingToFileAtPath:(NSString *)path
 {
-    echo(@"Sending MIDI Message %@", message);
+    [self stopRecording];
+    
+    const mach_timebase_info_data_t timebase = _MFTimebase();
+    const char *trackNames[_RECORDER_TRACK_COUNT] = { "Sent", "Received" };
+    MFMIDIFileRecorderOptions options = {
+        .format = 1,
+        .trackCount = _RECORDER_TRACK_COUNT,
+        .trackNames = trackNames,
+        .timebaseNumer = timebase.numer,
+        .timebaseDenom = timebase.denom,
+    };
+    MFMIDIFileRecorderRef recorder = MFMIDIFileRecorderCreate(path.fileSystemRepresentation, &options, mach_absolute_time());
+    if (!recorder) {
+        warn("Failed to create MIDI file at %@", path);
+        return NO;
+    }
     
-    [message toMIDIPacketList:^(MIDIPacketList *packetList) {
-        // Most efficient for now is to loop through _destinations sending to the endpoints of those which are enabled skipping the network ones. Then doing *1* network one at the end if available (as they share the same endpoint
-        if (_coreMIDISendEnabled) {
-            OSStatus res = noErr;
-            for (_MFCoreMIDIConnection *conx in _endpointDestinations)
-            {
-                if (!conx.enabled) continue;
-                
-                // MIDI Source acts the other way aroud
-                OSStatus s;
-                if (conx.isVirtualConnection) {
-                    s = MIDIReceived(conx.endpoint, packetList);
-                } else {
-                    s = MIDISend(_outputPortRef, conx.endpoint, packetList);
-                }
-                
-                if (res == noErr && s != noErr) res = s;    // track the first error
-            }
-            
-            // Network Conx
-            // (No loop required as NetworkMIDI sends to them all)
-            if (self.networkDestinations.count > 0)
-            {
-                MIDIEndpointRef endpoint = [(_MFCoreMIDIConnection *)self.networkDestinations[0] endpoint];
-                OSStatus s = MIDISend(_outputPortRef, endpoint, packetList);
-                if (res == noErr && s != noErr) res = s;    // track the first error
-            }
-            
-            // Except on error
-            if (res != noErr) {
-                @throw [MFNonFatalException exceptionWithOSStatus:res reason:@"Error sending midi message"];
-            }
-        }
-        
-        // Do audiobus destinations
-        for (MFAudiobusDestination *abDest in _audiobusDestinations) {
-            [abDest sendMIDIPacketList:packetList];
-        }
-    }]; // end toMIDIPacketList
+    @synchronized(_connectionTransforms) {
+        _recorder = recorder;
+    }
+    [self _rebuildSendRoutes];
+    [_receiveQueue setRecorder:recorder track:_RECORDER_TRACK_RECEIVED];
+    return YES;
 }
 
-/////////////////////////////////////////////////////////////////////////
-#pragma mark - MIDI Convenience Methods
-/////////////////////////////////////////////////////////////////////////
+//---------------------------------------------------------------------
 
-- (void)sendNoteOn:(UInt8)key velocity:(UInt8)velocity
+- (BOOL)stopRecording
 {
-    MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypeNoteOn channel:_midiChannel];
-    msg.key = key;
-    msg.velocity = velocity;
-    [self sendMIDIMessage:msg];
+    MFMIDIFileRecorderRef recorder;
+    @synchronized(_connectionTransforms) {
+        recorder = _recorder;
+        _recorder = NULL;
+    }
+    if (!recorder) return YES;
+    
+    // Once both have let go nothing can be mid-record
+    [self _rebuildSendRoutes];
+    [_receiveQueue setRecorder:NULL track:0];
+    
+    const BOOL ok = MFMIDIFileRecorderFinish(recorder);
+    const uint64_t dropped = MFMIDIFileRecorderDroppedCount(recorder);
+    MFMIDIFileRecorderDestroy(recorder);
     
+    if (!ok) warn("Error writing MIDI file. It's incomplete");
+    if (dropped) warn("%llu messages weren't recorded as the file couldn't keep up", dropped);
+    return ok;
 }
 
 //---------------------------------------------------------------------
 
-- (void)sendNoteOff:(UInt8)key velocity:(UInt8)velocity
+- (BOOL)isRecording
 {
-    MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypeNoteOff channel:_midiChannel];
-    msg.key= key;
-    msg.velocity = velocity;
-    [self sendMIDIMessage:msg];
+    @synchronized(_connectionTransforms) {
+        return _recorder != NULL;
+    }
 }
 
 //---------------------------------------------------------------------
 
-- (void)sendCC:(UInt8)ccNumber value:(UInt8)value
+- (BOOL)playMIDIFileAtPath:(NSString *)path completion:(void (^)(BOOL))completion
 {
-    MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypeControlChange channel:_midiChannel];
-    msg.controller = ccNumber;
-    msg.value = value;
-    [self sendMIDIMessage:msg];
+    MFMIDIFilePlayerRef player = MFMIDIFilePlayerOpen(path.fileSystemRepresentation);
+    if (!player) {
+        warn("Couldn't open MIDI file at %@", path);
+        return NO;
+    }
+    
+    _MFFilePlaybackState *state = [_MFFilePlaybackState new];
+    state->_player = player;
+    state->_completion = [completion copy];
+    
+    @weakify(self);
+    dispatch_async(_schedulerQueue, ^{
+        @strongify(self);
+        if (!self) return;
+        if (self->_playback) [self _finishPlayback:self->_playback completed:NO];
+        
+        // Time 0 a lookahead from now so the first events aren't late
+        state->_startTime = mach_absolute_time() + _MFHostTicksFromSeconds(self->_scheduleLookahead);
+        self->_playback = state;
+        [self _stepPlayback:state];
+    });
+    return YES;
 }
 
 //---------------------------------------------------------------------
 
-- (void)sendPitchbend:(UInt16)value
+- (void)stopPlayback
 {
-    MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypePitchbend channel:_midiChannel];
-    msg.pitchbendValue = value;
-    [self sendMIDIMessage:msg];
+    @weakify(self);
+    dispatch_async(_schedulerQueue, ^{
+        @strongify(self);
+        if (self->_playback) [self _finishPlayback:self->_playback completed:NO];
+    });
 }
 
-//---------------------------------------------------------------------
 
-- (void)sendProgramChange:(UInt8)value
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Audiobus
+/////////////////////////////////////////////////////////////////////////
+
+- (void)assignAudiobusController:(ABAudiobusController *)abController
 {
-    MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypeProgramChange channel:_midiChannel];
-    msg.programNumber = value;
-    [self sendMIDIMessage:msg];
+    NSParameterAssert(abController);
+    _abController = abController;
+    
+    // Handle core midi enable/disable
+    @weakify(self);
+    [_abController setEnableSendingCoreMIDIBlock:^(BOOL enableCoreMIDI) {
+        _coreMIDISendEnabled = enableCoreMIDI;
+        @strongify(self);
+        echo("CoreMIDI Enabled = %@", self->_coreMIDISendEnabled?@"YES":@"NO");
+    }];
 }
 
 //---------------------------------------------------------------------
 
-- (void)sendChannelAftertouch:(UInt8)pressure
+- (void)addAudiobusDestination:(MFAudiobusDestination *)abDestination
 {
-    MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypeChannelAftertouch channel:_midiChannel];
-    msg.channelPressure = pressure;
-    [self sendMIDIMessage:msg];
+    if ([_audiobusDestinations containsObject:abDestination]) {
+        NSAssert(NO, @"Already contains the given MFAudiobusDestination");
+    }
+    
+    [_audiobusDestinations addObject: abDestination];
+    [self _rebuildSendRoutes];
 }
 
 //---------------------------------------------------------------------
 
-- (void)sendPolyphonicAftertouch:(UInt8)key pressure:(UInt8)pressure
+- (MFAudiobusDestination *)createAudiobusSenderPortWithName:(NSString *)name title:(NSString *)title
 {
-    MFMIDIMessage *msg = [MFMIDIMessage messageWithType:kMFMIDIMessageTypePolyphonicAftertouch channel:_midiChannel];
-    msg.key = key;
-    msg.keyPressure = pressure;
-    [self sendMIDIMessage:msg];
+    NSAssert(_abController, @"Must call assignAudiobusController: first!");
+    MFAudiobusDestination *abDest = [[MFAudiobusDestination alloc] initWithName:name title:title controller:_abController];
+    [self addAudiobusDestination:abDest];
+    return abDest;
 }
 
-//---------------------------------------------------------------------
 
-- (void)sendAllNotesOffForCurrentChannel
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - <MFMIDIMessageSender>
+/////////////////////////////////////////////////////////////////////////
+
+/** 
+ @throws MFNonFatalException on send error. Will attempt to send to all relevant connections b4 throwing the exception
+ */
+- (void)sendMIDIMessage:(MFMIDIMessage *)message
 {
-    [self sendCC:123 value:127];
+    echo(@"Sending MIDI Message %@", message);
+    
+    // Short ones take the value path, which also does the coalescing
+    if (message.length <= kMFMIDIMessageValueInlineCapacity) {
+        MFMIDIMessageValue value = message.messageValue;
+        MFMIDISessionSendMessageValue(self, &value);
+        return;
+    }
+    
+    // Long ones (sysex in practice) go in chunks which the transforms take or leave whole. Nothing more goes after an error
+    _MFMIDISessionFlushPendingCoalesced(self);
+    const UInt8 status = message.bytes[0];
+    __block OSStatus res = noErr;
+    [message toMIDIPacketList:^(MIDIPacketList *packetList) {
+        if (res == noErr) res = _MFMIDISessionSendChunkToClasses(self, packetList, _kMFSendTargetClassAll, status);
+    }];
+    if (res != noErr) {
+        @throw [MFNonFatalException exceptionWithOSStatus:res reason:@"Error sending midi message"];
+    }
 }
 
 //---------------------------------------------------------------------
 
-- (void)sendAllNotesOffForAllChannels
+/** One destination, recorded in its traffic stats. Dropping because Audiobus has CoreMIDI disabled isn't an error */
+static inline OSStatus _MFSendPacketListToTarget(const _MFSendTarget *target, const MFMIDIBackend *backend, const MIDIPacketList *packetList, uint32_t messageCount, uint32_t byteCount, BOOL coreMIDISendEnabled)
 {
-    NSUInteger currentChan = self.midiChannel;
+    // Audiobus has taken over from CoreMIDI
+    if (!coreMIDISendEnabled && target->kind != _kMFSendTargetKindAudiobus) {
+        if (target->stats) _MFTrafficStatsRecordDrop(target->stats, messageCount, byteCount);
+        return noErr;
+    }
     
-    for (NSUInteger i=0; i<=15; i++)
+    OSStatus s = noErr;
+    const uint64_t start = mach_absolute_time();
+    switch (target->kind)
     {
-        self.midiChannel = i;
-        [self sendAllNotesOffForCurrentChannel];
+        case _kMFSendTargetKindSend:
+            s = backend->send(backend->context, target->port, target->endpoint, packetList);
+            break;
+        case _kMFSendTargetKindReceived:
+            s = backend->received(backend->context, target->endpoint, packetList);
+            break;
+        case _kMFSendTargetKindAudiobus:
+            // Audiobus only delivers to whatever is connected to the port so no enabled check needed
+            ABMIDIPortSendPacketList((__bridge ABMIDISenderPort *)target->audiobusPort, packetList);
+            break;
     }
-    
-    self.midiChannel = currentChan;
+    if (target->stats) _MFTrafficStatsRecordSend(target->stats, messageCount, byteCount, s, mach_absolute_time() - start);
+    if (target->activeNotes && s == noErr) _MFActiveNotesTrackPacketList(target->activeNotes, packetList);
+    return s;
 }
 
 //---------------------------------------------------------------------
 
-- (void)sendRPNWithMSB:(UInt8)msb LSB:(UInt8)lsb valueMSB:(UInt8)valueMSB valueLSB:(UInt8)valueLSB
+static size_t _MFPacketListSize(const MIDIPacketList *packetList)
+{
+    if (packetList->numPackets == 0) return sizeof(UInt32);
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 1; i < packetList->numPackets; i++) packet = MIDIPacketNext(packet);
+    return (size_t)((uintptr_t)&packet->data[packet->length] - (uintptr_t)packetList);
+}
+
+/**
+ Transforms need a writable copy of the list. This makes one on the stack in `buffer` and applies `transform` to it. Lists too big for the buffer are bulk sysex in practice so are left as they are, or dropped if the transform drops sysex. Real-time safe
+ @param state Carries over from the stream's previous list (see MFMIDITransformApply). NULL for sends, which are whole messages
+ @param chunkedStatus For a send that's one chunk of a long message, that message's first byte so a sysex is taken or left whole (see MFMIDITransformApplyToMessageChunk). 0 otherwise
+ @return The list to send, `packetList` or the copy. NULL if the transform left nothing
+ */
+static const MIDIPacketList *_MFTransformPacketList(const MFMIDITransform *transform, MFMIDITransformState *state, uint8_t chunkedStatus, const MIDIPacketList *packetList, Byte *buffer, size_t bufferSize)
 {
-    // @TODO: Make it possible to send these in a single packet to ensure thread safety
-    [self sendCC:101 value:msb];
-    [self sendCC:100 value:lsb];
-    [self sendCC:6 value:valueMSB];
-    if (valueLSB) {
-        [self sendCC:38 value:valueLSB];
+    const size_t size = _MFPacketListSize(packetList);
+    if (size > bufferSize) {
+        return MFMIDITransformDropsStatus(transform, 0xF0) ? NULL : packetList;
     }
+    
+    MIDIPacketList *copy = (MIDIPacketList *)buffer;
+    memcpy(copy, packetList, size);
+    const size_t length = chunkedStatus ? MFMIDITransformApplyToMessageChunk(transform, chunkedStatus, copy) : MFMIDITransformApplyToPacketList(transform, state, copy);
+    return length ? copy : NULL;
 }
 
 //---------------------------------------------------------------------
 
-- (void)sendNRPNWithMSB:(UInt8)msb LSB:(UInt8)lsb valueMSB:(UInt8)valueMSB valueLSB:(UInt8)valueLSB
+/** One destination through its own transform, if it has one, recounting for the stats what the transform left. `chunkedStatus` as _MFTransformPacketList */
+static inline OSStatus _MFSendPacketListThroughTarget(const _MFSendTarget *target, const MFMIDIBackend *backend, const MIDIPacketList *packetList, uint32_t messageCount, uint32_t byteCount, BOOL coreMIDISendEnabled, uint8_t chunkedStatus)
 {
-    // @TODO: Make it possible to send these in a single packet to ensure thread safety
-    [self sendCC:99 value:msb];
-    [self sendCC:98 value:lsb];
-    [self sendCC:6 value:valueMSB];
-    if (valueLSB) {
-        [self sendCC:38 value:valueLSB];
+    if (!target->transform) {
+        return _MFSendPacketListToTarget(target, backend, packetList, messageCount, byteCount, coreMIDISendEnabled);
     }
+    
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    const MIDIPacketList *transformed = _MFTransformPacketList(target->transform, NULL, chunkedStatus, packetList, buffer, sizeof(buffer));
+    if (!transformed) return noErr;
+    
+    uint32_t transformedMessageCount, transformedByteCount;
+    _MFTrafficStatsCountPacketList(transformed, &transformedMessageCount, &transformedByteCount);
+    if (transformedByteCount == byteCount) transformedMessageCount = messageCount;     // nothing dropped. Running status may hide some from the count
+    return _MFSendPacketListToTarget(target, backend, transformed, transformedMessageCount, transformedByteCount, coreMIDISendEnabled);
 }
 
-/////////////////////////////////////////////////////////////////////////
-#pragma mark - MIDI Callback Procs
-/////////////////////////////////////////////////////////////////////////
+//---------------------------------------------------------------------
 
-static void _MFMIDINotifyProc(const MIDINotification *message, void *refCon)
+/** The hot loop. No ObjC messaging, locks or allocation so it's safe from any thread, concurrently with the notify proc changing connections. Every destination's outcome goes into its traffic stats with the given counts, recounted for one with its own transform. @return The first error */
+static OSStatus _MFSendPacketListToRoutes(const _MFSendRoutes *routes, const MFMIDIBackend *backend, const MIDIPacketList *packetList, uint32_t messageCount, uint32_t byteCount, BOOL coreMIDISendEnabled, uint32_t targetClasses, uint8_t chunkedStatus)
 {
-    //if (message->child == virtualDestinationEndpoint || notification->child == virtualSourceEndpoint) return;
+    OSStatus res = noErr;
     
-    MFMIDISession *self = (__bridge MFMIDISession *)refCon;
-    switch (message->messageID)
+    for (uint32_t i=0; i<routes->count; ++i)
     {
-        case kMIDIMsgObjectAdded:
-        {
-            // Choose the source/destination and wire it in
-            const MIDIObjectAddRemoveNotification *notif = (const MIDIObjectAddRemoveNotification *)message;
-            MIDIEndpointRef endpoint = (MIDIEndpointRef)notif->child;
-            
-            echo("CoreMIDI reported ADDED endpoint %i", (int)endpoint);
+        const _MFSendTarget *target = &routes->targets[i];
+        if (!(target->targetClass & targetClasses)) continue;
+        
+        OSStatus s = _MFSendPacketListThroughTarget(target, backend, packetList, messageCount, byteCount, coreMIDISendEnabled, chunkedStatus);
+        if (res == noErr && s != noErr) res = s;    // track the first error
+    }
+    
+    return res;
+}
 
-            // Skip if it's a virtual one as we were the ones who added it
-            if ([self _endpointIsForVirtualConnection:endpoint]) {
-                echo("...skipping as it's virtual");
-                return;
-            }
-            
-            if (notif->childType == kMIDIObjectType_Destination)
-                [self _connectDestinationEndpoint:endpoint];
-            else if (notif->childType == kMIDIObjectType_Source)
-                [self _connectSourceEndpoint:endpoint];
-            break;
+//---------------------------------------------------------------------
+
+/** Sends to the routes of `targetClasses` through the session's transform, re-encoding with running status for the classes that want it. `chunkedStatus` as _MFTransformPacketList. Safe from any thread. @return The first error */
+static OSStatus _MFMIDISessionSendChunkToClasses(MFMIDISession *session, const MIDIPacketList *packetList, uint32_t targetClasses, uint8_t chunkedStatus)
+{
+    OSStatus res = noErr;
+    uint32_t token;
+    const _MFSendRoutes *routes = _MFSendRouterBeginRead(session->_sendRouter, &token);
+    
+    // The session's transform goes first, for everyone
+    Byte transformBuffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    if (routes->transform) {
+        packetList = _MFTransformPacketList(routes->transform, NULL, chunkedStatus, packetList, transformBuffer, sizeof(transformBuffer));
+        if (!packetList) {
+            _MFSendRouterEndRead(session->_sendRouter, token);
+            return noErr;
         }
-        case kMIDIMsgObjectRemoved:
+    }
+    
+    // Once per logical send. A message held back from a coalescing class goes out to the others first, then to it when flushed, but every send includes the local class once
+    if (routes->recorder && (targetClasses & _kMFSendTargetClassLocal)) {
+        MFMIDIFileRecorderRecordPacketList(routes->recorder, _RECORDER_TRACK_SENT, packetList, mach_absolute_time());
+    }
+    
+    // Messages are counted from the original as running status hides status bytes
+    uint32_t messageCount, byteCount;
+    _MFTrafficStatsCountPacketList(packetList, &messageCount, &byteCount);
+    
+    // A single message has nothing to gain. Lists too big for the stack buffer are bulk sysex which doesn't either
+    const uint32_t runningStatusClasses = atomic_load_explicit(&session->_runningStatusClasses, memory_order_relaxed) & targetClasses;
+    if (runningStatusClasses && byteCount > 3)
+    {
+        Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+        MIDIPacketList *encoded = (MIDIPacketList *)buffer;
+        if (MFMIDIRunningStatusEncodePacketList(packetList, encoded, sizeof(buffer), kMFMIDIRunningStatusOptionNoteOffAsNoteOn))
         {
-            // Choose the source/destination and wire it in
-            const MIDIObjectAddRemoveNotification *notif = (const MIDIObjectAddRemoveNotification *)message;
-            MIDIEndpointRef endpoint = (MIDIEndpointRef)notif->child;
-            echo("CoreMIDI reported REMOVED endpoint %i", (int)endpoint);
-
-            // virtual should never be but if it is then it's reversed terminology when local
-            if ([self _endpointIsForVirtualConnection:endpoint])
-            {
-                echo("...it's for a virtual!?!");
-                if (notif->childType == kMIDIObjectType_Destination)
-                    [self _disconnectSourceEndpoint:endpoint];
-                else if (notif->childType == kMIDIObjectType_Source)
-                    [self _disconnectDestinationEndpoint:endpoint];
-                break;
-            }
-            
-            if (notif->childType == kMIDIObjectType_Destination)
-                [self _disconnectDestinationEndpoint:endpoint];
-            else if (notif->childType == kMIDIObjectType_Source)
-                [self _disconnectSourceEndpoint:endpoint];
-            break;
+            uint32_t unused, encodedByteCount;
+            _MFTrafficStatsCountPacketList(encoded, &unused, &encodedByteCount);
+            res = _MFSendPacketListToRoutes(routes, session->_backend, encoded, messageCount, encodedByteCount, session->_coreMIDISendEnabled, runningStatusClasses, chunkedStatus);
+            targetClasses &= ~runningStatusClasses;
         }
-        default:
-        case kMIDIMsgSetupChanged:
-        case kMIDIMsgPropertyChanged:
-        case kMIDIMsgThruConnectionsChanged:
-        case kMIDIMsgSerialPortOwnerChanged:
-        case kMIDIMsgIOError:
-            echo("CoreMIDI Notification with messageID %i", (int)message->messageID);
-            break;
     }
+    
+    if (targetClasses) {
+        OSStatus s = _MFSendPacketListToRoutes(routes, session->_backend, packetList, messageCount, byteCount, session->_coreMIDISendEnabled, targetClasses, chunkedStatus);
+        if (res == noErr) res = s;
+    }
+    
+    _MFSendRouterEndRead(session->_sendRouter, token);
+    return res;
 }
 
-//---------------------------------------------------------------------
-
-static void _MFMIDIReadProc(const MIDIPacketList *pktlist, void *readProcRefCon, void *srcConnRefCon)
+/** Whole messages */
+static inline OSStatus _MFMIDISessionSendToClasses(MFMIDISession *session, const MIDIPacketList *packetList, uint32_t targetClasses)
 {
-    id<MFMIDISource>self = (__bridge id<MFMIDISource>)srcConnRefCon;
-    // @TODO: Source Read
+    return _MFMIDISessionSendChunkToClasses(session, packetList, targetClasses, 0);
 }
 
+//---------------------------------------------------------------------
 
+typedef struct {
+    const _MFSendTarget *target;
+    const MFMIDIBackend *backend;
+    BOOL coreMIDISendEnabled;
+    OSStatus status;            // the first error
+} _MFNoteOffFlushContext;
 
-/////////////////////////////////////////////////////////////////////////
-#pragma mark - NSNetServiceBrowser & NSNetService Delegates
-/////////////////////////////////////////////////////////////////////////
+static void _MFNoteOffBatchFlush(MFMIDIBatch *batch, MIDIPacketList *packetList, void *context)
+{
+    _MFNoteOffFlushContext *ctx = context;
+    uint32_t messageCount, byteCount;
+    _MFTrafficStatsCountPacketList(packetList, &messageCount, &byteCount);
+    OSStatus s = _MFSendPacketListToTarget(ctx->target, ctx->backend, packetList, messageCount, byteCount, ctx->coreMIDISendEnabled);
+    if (ctx->status == noErr) ctx->status = s;
+}
 
-- (void)netServiceBrowserWillSearch:(NSNetServiceBrowser *)aNetServiceBrowser
+/** Note offs for the notes in `bits` (see _MFActiveNotes) in as few packet lists as fit the stack buffer. Straight to the target, past the transforms, as the tracker has what they let through. Real-time safe. @return The first error */
+static OSStatus _MFSendNoteOffsToTarget(const _MFSendTarget *target, const MFMIDIBackend *backend, BOOL coreMIDISendEnabled, const uint64_t bits[_kMFActiveNotesWordCount])
 {
-    echo("NETSERVICE: NetServiceBrowser BEGAN");
-    self.isRefreshing = YES; // use setter to invoke KVO
-    _netServiceBrowserIsSearching = YES;
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    _MFNoteOffFlushContext ctx = { target, backend, coreMIDISendEnabled, noErr };
+    MFMIDIBatch batch;
+    MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _MFNoteOffBatchFlush, &ctx);
     
-    // No need to notify delegates as it happens on the refresh method (in case network is disabled)
-    
-    // Grab a copy of existing net conx to report removals to delegate when done
-    _netConxToRemove = [NSMutableArray array];
-    [_netConxToRemove addObjectsFromArray:self.networkSources];
-    [_netConxToRemove addObjectsFromArray:self.networkDestinations];
-    
-    // Note we tell delegates on the scan refresh as it's not just network
+    for (unsigned w=0; w<_kMFActiveNotesWordCount; ++w)
+    {
+        for (uint64_t word = bits[w]; word; word &= word - 1)
+        {
+            const UInt8 noteOff[3] = { 0x80 | (w / 2), (UInt8)((w % 2) * 64 + __builtin_ctzll(word)), 0 };
+            MFMIDIBatchAddBytes(&batch, 0, noteOff, sizeof(noteOff));
+        }
+    }
+    MFMIDIBatchFlush(&batch);
+    return ctx.status;
 }
 
 //---------------------------------------------------------------------
 
-- (void)netServiceBrowser:(NSNetServiceBrowser *)aNetServiceBrowser didFindService:(NSNetService *)aNetService moreComing:(BOOL)moreComing
+/** Ahead of anything not coalesced. Only touches the classes holding something back and doesn't wait on a timed flush that's already underway - that one has taken what's pending */
+static inline void _MFMIDISessionFlushPendingCoalesced(MFMIDISession *session)
 {
-    // Ignore the local device if specified
-    // Don't use UIDevice.currentDevice.name as apparently it can be different: http://stackoverflow.com/questions/7723801/apple-bonjour-how-can-i-tell-which-published-service-is-my-own/31526432?noredirect=1#comment51654025_31526432
-    if (_excludeSelfInNetworkScan && [aNetService.name isEqualToString:_midiNetSession.networkName])
-    {
-        echo("NETSERVICE: Browser will ignore self '%@'", aNetService.name);
-    }
-    else
-    {
-        echo("NETSERVICE: Found %@. Resolving...", aNetService);
-        
-        // See Special Notes in README about NSNetService. In short we need to resolve manually into IP/Port and create a connection with those
-        
-        [_netServicesAwaitingResolve addObject:aNetService];
-        aNetService.delegate = self;
-        [aNetService resolveWithTimeout:_NETSERVICE_RESOLVE_TIMEOUT];
-    }
-    
-    // If that's it then stop the browser (it's manually controlled)
-    if (!moreComing) {
-        echo("...no more coming. Stopping NetServiceBrowser search.");
-        [_netBrowser stop];
+    const uint32_t pendingClasses = atomic_load_explicit(&session->_coalescerPendingClasses, memory_order_acquire);
+    if (!pendingClasses) return;
+    for (int i=0; i<_COALESCER_COUNT; i++) {
+        if (pendingClasses & _kCoalescerTargetClass[i]) {
+            [session _tryFlushCoalescerForIndex:i];
+        }
     }
 }
 
 //---------------------------------------------------------------------
 
-- (void)netServiceBrowser:(NSNetServiceBrowser *)aNetServiceBrowser didNotSearch:(NSDictionary *)errorDict
+/**
+ Fans the packet list out to all enabled destinations. Everything ends up here.
+ @throws MFNonFatalException on send error. Will attempt to send to all relevant connections b4 throwing the exception
+ */
+- (void)sendMIDIPacketList:(MIDIPacketList *)packetList
+{
+    // Whatever coalescing is holding back goes first so this can't overtake it (eg. a note after its pitchbend)
+    _MFMIDISessionFlushPendingCoalesced(self);
+    [self _sendPacketList:packetList toClasses:_kMFSendTargetClassAll];
+}
+
+//---------------------------------------------------------------------
+
+/** @throws MFNonFatalException on send error, after attempting all the targets */
+- (void)_sendPacketList:(const MIDIPacketList *)packetList toClasses:(uint32_t)targetClasses
 {
-    // Happens when search is called when already searching. Shouldnt be the case if our code works.
-    warn("NETSERVICE: NetServiceBrowser DID NOT SEARCH: %@", errorDict);
-    _netServiceBrowserIsSearching = NO;
-    [self _checkWhetherAllNetRefreshActivityHasStoppedAndHandleCleanup];
+    OSStatus res = _MFMIDISessionSendToClasses(self, packetList, targetClasses);
+    
+    // Except on error
+    if (res != noErr) {
+        @throw [MFNonFatalException exceptionWithOSStatus:res reason:@"Error sending midi message"];
+    }
 }
 
 //---------------------------------------------------------------------
 
-- (void)netServiceBrowserDidStopSearch:(NSNetServiceBrowser *)aNetServiceBrowser
+- (void)sendMIDIMessages:(NSArray *)messages
 {
-    echo("NETSERVICE: NetServiceBrowser STOPPED");
-    _netServiceBrowserIsSearching = NO;
-    [self _checkWhetherAllNetRefreshActivityHasStoppedAndHandleCleanup];
+    [self sendBatch:^(MFMIDIBatch *batch) {
+        for (MFMIDIMessage *message in messages)
+        {
+            MFMIDIMessageValue value = message.messageValue;
+            if (!MFMIDIBatchAddValue(batch, &value)) {
+                // Too big for a batch (ie large sysex) so it goes on its own, in order
+                MFMIDIBatchFlush(batch);
+                [self sendMIDIMessage:message];
+            }
+        }
+    }];
 }
 
 //---------------------------------------------------------------------
 
-- (void)netService:(NSNetService *)sender didNotResolve:(NSDictionary *)errorDict
+static void _MFMIDISessionBatchFlush(MFMIDIBatch *batch, MIDIPacketList *packetList, void *context)
 {
-    warn("NETSERVICE: %@ DID NOT RESOLVE. Adding to MIDINetworkSession anyway as a fallback (using the NSNetService) Error: %@", sender, errorDict);
+    [(__bridge MFMIDISession *)context sendMIDIPacketList:packetList];
+}
 
-    // Ignore the local device if specified. Do it here too to prevent it messing up the trackers below
-    // Don't use UIDevice.currentDevice.name as apparently it can be different: http://stackoverflow.com/questions/7723801/apple-bonjour-how-can-i-tell-which-published-service-is-my-own/31526432?noredirect=1#comment51654025_31526432
-    if (_excludeSelfInNetworkScan && [sender.name isEqualToString:_midiNetSession.networkName]) {
-        return;
-    }
+- (void)sendBatch:(void (^)(MFMIDIBatch *))builder
+{
+    NSParameterAssert(builder);
     
-    // Fallback - at least it will show up in MIDI Network Setup's "Directory"
-    // @TODO: ???
-    MIDINetworkHost *host = [MIDINetworkHost hostWithName:sender.name netService:sender];
-    NSArray *pair = [self _addNetworkConnectionWithHost:host];
-    _MFMIDINetworkConnection *src = pair[0], *dest = pair[1];
-    [_netConxToRemove removeObject:src];
-    [_netConxToRemove removeObject:dest];
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    MFMIDIBatch batch;
+    MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _MFMIDISessionBatchFlush, (__bridge void *)self);
     
-    // Remove it from our list and cleanup if done
-    [_netServicesAwaitingResolve removeObject:sender];
+    builder(&batch);
     
-    [self _checkWhetherAllNetRefreshActivityHasStoppedAndHandleCleanup];
+    MFMIDIBatchFlush(&batch);
 }
 
 //---------------------------------------------------------------------
 
-- (void)netServiceWillResolve:(NSNetService *)sender
+- (MFMIDIRenderQueueRef)createRenderQueue
 {
-//    echo("NETSERVICE: WILL RESOLVE %@", sender);
+    const mach_timebase_info_data_t timebase = _MFTimebase();
+    MFMIDIRenderQueueRef queue = MFMIDIRenderQueueCreate(0, timebase.numer, timebase.denom);
+    if (!queue) {
+        warn("Failed to allocate a render queue");
+        return NULL;
+    }
+    
+    @weakify(self);
+    dispatch_async(_schedulerQueue, ^{
+        @strongify(self);
+        if (!self) return;
+        [self->_renderQueues addObject:[NSValue valueWithPointer:queue]];
+        [self _resumeRenderQueueTimer];
+    });
+    MFMIDIRenderQueueSetWakeFunction(queue, _MFMIDISessionRenderQueueWake, (__bridge void *)_renderQueueWakeSource);
+    return queue;
 }
 
 //---------------------------------------------------------------------
 
-- (void)netServiceDidStop:(NSNetService *)sender
+- (void)destroyRenderQueue:(MFMIDIRenderQueueRef)queue
 {
-    echo("NETSERVICE: %@ resolving STOPPED.", sender);
-    
-    // Remove it from our list and cleanup if done
-    [_netServicesAwaitingResolve removeObject:sender];
+    if (!queue) return;
     
-    // ~~Don't do the cleanup here as this is called BEFORE didResolve~~
-    // Ok thats true but sometimes this is called when there aren't any more addresses coming and we haven't found a good one, so we need to do it here. It's no big deal the connection will be removed and then immediately re-added if it is found again.
-    
-    [self _checkWhetherAllNetRefreshActivityHasStoppedAndHandleCleanup];
+    @weakify(self);
+    dispatch_async(_schedulerQueue, ^{
+        @strongify(self);
+        if (!self) return;      // dealloc has it
+        
+        NSValue *val = [NSValue valueWithPointer:queue];
+        if (![self->_renderQueues containsObject:val]) {
+            warn("Not one of this session's render queues");
+            return;
+        }
+        _MFMIDISessionDrainRenderQueues(self, @[val]);
+        [self->_renderQueues removeObject:val];
+        MFMIDIRenderQueueDestroy(queue);
+        
+        if (!self->_renderQueues.count) [self _suspendRenderQueueTimer];
+    });
 }
 
 //---------------------------------------------------------------------
 
-- (void)netServiceDidResolveAddress:(NSNetService *)sender
+/** Whether a target can have UMP as it is. Transforms work on MIDI 1.0 and Audiobus only takes packet lists */
+MF_UMP_AVAILABLE
+static inline BOOL _MFSendTargetTakesEventLists(const _MFSendTarget *target, const MFMIDIBackend *backend)
 {
-    // Ignore the local device if specified
-    // Don't use UIDevice.currentDevice.name as apparently it can be different: http://stackoverflow.com/questions/7723801/apple-bonjour-how-can-i-tell-which-published-service-is-my-own/31526432?noredirect=1#comment51654025_31526432
-    if (_excludeSelfInNetworkScan && [sender.name isEqualToString:_midiNetSession.networkName])
+    if (target->transform) return NO;
+    switch (target->kind)
     {
-        echo("NETSERVICE: Resolve will ignore self '%@'", sender.name);
-        return;
+        case _kMFSendTargetKindSend: return backend->sendEventList != NULL;
+        case _kMFSendTargetKindReceived: return backend->receivedEventList != NULL;
+        case _kMFSendTargetKindAudiobus: return NO;
     }
+    return NO;
+}
 
-    uint16_t port;
-    NSString *ipAddress = nil;
-    
-    echo("NETSERVICE: %@ RESOLVED with %i addresses", sender, (int)sender.addresses.count);
+/** As _MFSendPacketListToTarget for an event list. `packetList` is its MIDI 1.0 translation, which the stats count and the note tracking follows */
+MF_UMP_AVAILABLE
+static OSStatus _MFSendEventListToTarget(const _MFSendTarget *target, const MFMIDIBackend *backend, const MIDIEventList *eventList, const MIDIPacketList *packetList, uint32_t messageCount, uint32_t byteCount, BOOL coreMIDISendEnabled)
+{
+    if (!coreMIDISendEnabled) {
+        if (target->stats) _MFTrafficStatsRecordDrop(target->stats, messageCount, byteCount);
+        return noErr;
+    }
     
-    for (NSData *address in sender.addresses)
-    {
-        // Resolve into IP:port. If it's IPv6 the skip...
-        struct sockaddr *socketAddress = (struct sockaddr *)[address bytes];
-        char buffer[256];
+    const uint64_t start = mach_absolute_time();
+    const OSStatus s = target->kind == _kMFSendTargetKindSend
+        ? backend->sendEventList(backend->context, target->port, target->endpoint, eventList)
+        : backend->receivedEventList(backend->context, target->endpoint, eventList);
+    if (target->stats) _MFTrafficStatsRecordSend(target->stats, messageCount, byteCount, s, mach_absolute_time() - start);
+    if (target->activeNotes && s == noErr) _MFActiveNotesTrackPacketList(target->activeNotes, packetList);
+    return s;
+}
 
-        /* Only continue if this is an IPv4 address. */
-        // Oh thank you: https://developer.apple.com/library/mac/qa/qa1298/_index.html
-        
-        // Experimental IPv6 connections (doesnt work with MIDI Network Setup)
-        // Just log for now
-        if (socketAddress && socketAddress->sa_family == AF_INET6) {
-            if (inet_ntop(AF_INET6, &((struct sockaddr_in *)
-                                      socketAddress)->sin_addr, buffer, sizeof(buffer)))
-            {
-                port = ntohs(((struct sockaddr_in *)socketAddress)->sin_port);
-                
-                echo("NETSERVICE: IPv6 address %s:%i resolved for %@", buffer, (int)port, sender);
-                
-                //            ipAddress = [NSString stringWithUTF8String:buffer];
-                //            [sender stop];
-            }
-        }
-        
-        
-        if (socketAddress && socketAddress->sa_family == AF_INET)
-        {
-            if (inet_ntop(AF_INET, &((struct sockaddr_in *)
-                                     socketAddress)->sin_addr, buffer, sizeof(buffer)))
-            {
-                port = ntohs(((struct sockaddr_in *)socketAddress)->sin_port);
-                
-                ipAddress = [NSString stringWithUTF8String:buffer];
-                
-                break;
-            }
-        }
+/** Sends an event list of at most _UMP_EVENT_LIST_SIZE to every destination, as it is where it can be, otherwise translated. No running status on this path. Safe from any thread. @return The first error */
+MF_UMP_AVAILABLE
+static OSStatus _MFMIDISessionSendEventList(MFMIDISession *session, const MIDIEventList *eventList)
+{
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    MIDIPacketList *packetList = (MIDIPacketList *)buffer;
+    MFMIDIUMPEventListToPacketList(eventList, packetList, sizeof(buffer));
+    
+    uint32_t token;
+    const _MFSendRoutes *routes = _MFSendRouterBeginRead(session->_sendRouter, &token);
+    
+    // The session's transform is for everyone and works on MIDI 1.0, so then it all goes that way
+    if (routes->transform) {
+        _MFSendRouterEndRead(session->_sendRouter, token);
+        return packetList->numPackets ? _MFMIDISessionSendToClasses(session, packetList, _kMFSendTargetClassAll) : noErr;
     }
     
-    if (!ipAddress)
-    {
-        echo("NETSERVICE: %@ address did not resolve to IPv4. Hopefully there'll be another address...", sender)
+    if (routes->recorder && packetList->numPackets) {
+        MFMIDIFileRecorderRecordPacketList(routes->recorder, _RECORDER_TRACK_SENT, packetList, mach_absolute_time());
     }
-    else
+    
+    uint32_t messageCount, byteCount;
+    _MFTrafficStatsCountPacketList(packetList, &messageCount, &byteCount);
+    
+    OSStatus res = noErr;
+    for (uint32_t i=0; i<routes->count; ++i)
     {
-        echo("NETSERVICE: %@ resolved to %@:%i", sender, ipAddress, port);
-        
-        // Connect to MIDI
-        // Handles delegate (if it's not an existing connection). Returns the created or existing conx pair
-        NSArray *pair = [self _addNetworkConnectionWithName:sender.name address:ipAddress port:port];
-        _MFMIDINetworkConnection *src = pair[0], *dest = pair[1];
-        [_netConxToRemove removeObject:src];
-        [_netConxToRemove removeObject:dest];
-
-        // Don't keep resolving if we have a legit IPv4 address.
-        [sender stop];
-        
-        // Cleanup check happens in the Stop delegate methods
+        const _MFSendTarget *target = &routes->targets[i];
+        OSStatus s;
+        if (_MFSendTargetTakesEventLists(target, session->_backend)) {
+            s = _MFSendEventListToTarget(target, session->_backend, eventList, packetList, messageCount, byteCount, session->_coreMIDISendEnabled);
+        } else if (packetList->numPackets) {
+            // Nothing in MIDI 1.0 for what's in it (eg. per note controllers) leaves nothing to send
+            s = _MFSendPacketListThroughTarget(target, session->_backend, packetList, messageCount, byteCount, session->_coreMIDISendEnabled, 0);
+        } else {
+            continue;
+        }
+        if (res == noErr && s != noErr) res = s;
     }
+    
+    _MFSendRouterEndRead(session->_sendRouter, token);
+    return res;
 }
 
-//---------------------------------------------------------------------
-
-/** Checks that both the NetServiceBrowsers AND the NetService resolves have all completed and if so, updates conx, resets flags and notifies the delegates */
-- (void)_checkWhetherAllNetRefreshActivityHasStoppedAndHandleCleanup
+/** Chops the words into event lists, never splitting a message. @return The first error */
+MF_UMP_AVAILABLE
+static OSStatus _MFMIDISessionSendUMP(MFMIDISession *session, const uint32_t *words, NSUInteger count)
 {
-    if (_netServicesAwaitingResolve.count > 0 ||
-        _netServiceBrowserIsSearching)
+    Byte buffer[_UMP_EVENT_LIST_SIZE] __attribute__((aligned(8)));
+    MIDIEventList *eventList = (MIDIEventList *)buffer;
+    MIDIEventPacket *packet = MIDIEventListInit(eventList, kMIDIProtocol_2_0);
+    OSStatus res = noErr;
+    
+    for (NSUInteger i = 0; i < count; )
     {
-        echo("NETSERVICE: Still resolving...");
-    }
-    else
+        const size_t messageWords = MFMIDIUMPWordCountForFirstWord(words[i]);
+        if (messageWords > count - i) break;
+        
+        MIDIEventPacket *added = MIDIEventListAdd(eventList, sizeof(buffer), packet, 0, messageWords, &words[i]);
+        if (!added) {
+            // Full. Send it and start another
+            OSStatus s = _MFMIDISessionSendEventList(session, eventList);
+            if (res == noErr) res = s;
+            packet = MIDIEventListInit(eventList, kMIDIProtocol_2_0);
+            continue;
+        }
+        packet = added;
+        i += messageWords;
+    }
+    
+    if (eventList->numPackets) {
+        OSStatus s = _MFMIDISessionSendEventList(session, eventList);
+        if (res == noErr) res = s;
+    }
+    return res;
+}
+
+//---------------------------------------------------------------------
+
+/** @throws MFNonFatalException on send error, after attempting all the targets */
+- (void)sendUMPWords:(const uint32_t *)words count:(NSUInteger)count
+{
+    NSParameterAssert(words || !count);
+    
+    // As sendMIDIPacketList:
+    _MFMIDISessionFlushPendingCoalesced(self);
+    
+    if (@available(macOS 11.0, iOS 14.0, *)) {
+        if (_backend->sendEventList) {
+            OSStatus res = _MFMIDISessionSendUMP(self, words, count);
+            if (res != noErr) {
+                @throw [MFNonFatalException exceptionWithOSStatus:res reason:@"Error sending midi message"];
+            }
+            return;
+        }
+    }
+    
+    // No event lists here so it's all MIDI 1.0
+    [self sendBatch:^(MFMIDIBatch *batch) {
+        for (NSUInteger i = 0; i < count; )
+        {
+            const size_t messageWords = MFMIDIUMPWordCountForFirstWord(words[i]);
+            if (messageWords > count - i) break;
+            uint8_t bytes[kMFMIDIUMPMaxBytesPerWord * 4];
+            const size_t length = MFMIDIUMPToBytes(&words[i], messageWords, bytes, sizeof(bytes), NULL);
+            if (length) MFMIDIBatchAddBytes(batch, 0, bytes, length);
+            i += messageWords;
+        }
+    }];
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendMIDIMessageValue:(MFMIDIMessageValue)value
+{
+    MFMIDISessionSendMessageValue(self, &value);
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendMIDIMessage:(MFMIDIMessage *)message atHostTime:(MIDITimeStamp)hostTime
+{
+    // Scheduler copies any out-of-line bytes
+    [self sendMIDIMessageValue:message.messageValue atHostTime:hostTime];
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendMIDIMessageValue:(MFMIDIMessageValue)value atHostTime:(MIDITimeStamp)hostTime
+{
+    if (!MFMIDISchedulerSchedule(_scheduler, &value, hostTime)) {
+        warn("Failed to schedule message (out of memory)");
+        return;
+    }
+    
+    @weakify(self);
+    dispatch_async(_schedulerQueue, ^{
+        @strongify(self);
+        [self _armSchedulerTimerForEventTime:hostTime];
+    });
+}
+
+//---------------------------------------------------------------------
+
+- (void)cancelScheduledMessages
+{
+    MFMIDISchedulerRemoveAll(_scheduler);
+}
+
+//---------------------------------------------------------------------
+
+- (void)flushCoalescedMessages
+{
+    for (int i=0; i<_COALESCER_COUNT; i++) {
+        if (MFMIDICoalescerHasPending(_coalescers[i])) {
+            [self _flushCoalescerForIndex:i withBudget:NO];
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendSysex:(NSData *)sysex bytesPerSecond:(NSUInteger)bytesPerSecond progress:(void (^)(NSUInteger, NSUInteger))progress completion:(void (^)(OSStatus))completion
+{
+    NSParameterAssert(sysex.length);
+    
+    _MFSysexTransferState *state = [_MFSysexTransferState new];
+    state->_sysex = [sysex copy];       // just a retain unless it's mutable
+    state->_progress = [progress copy];
+    state->_completion = [completion copy];
+    
+    // Remember the destinations. Each step sends to whichever of them are still in the routes
+    uint32_t token;
+    const _MFSendRoutes *routes = _MFSendRouterBeginRead(_sendRouter, &token);
+    state->_targets = [NSData dataWithBytes:routes->targets length:routes->count * sizeof(_MFSendTarget)];
+    if (routes->recorder) MFMIDIFileRecorderRecord(routes->recorder, _RECORDER_TRACK_SENT, mach_absolute_time(), state->_sysex.bytes, state->_sysex.length);
+    _MFSendRouterEndRead(_sendRouter, token);
+    
+    const uint32_t destinationCount = (uint32_t)(state->_targets.length / sizeof(_MFSendTarget));
+    state->_transfer = MFMIDISysexTransferCreate(state->_sysex.bytes, state->_sysex.length, destinationCount, kMFMIDISysexDefaultChunkSize, (uint32_t)MIN(bytesPerSecond, UINT32_MAX), _MFMIDISessionSysexSend, (__bridge void *)state);
+    if (!state->_transfer) {
+        warn("Failed to start sysex transfer (out of memory)");
+        return;
+    }
+    
+    @weakify(self);
+    dispatch_async(_schedulerQueue, ^{
+        @strongify(self);
+        if (!self) return;
+        [self->_sysexTransfers addObject:state];
+        [self _stepSysexTransfer:state];
+    });
+}
+
+//---------------------------------------------------------------------
+
+- (void)cancelSysexTransfers
+{
+    @weakify(self);
+    dispatch_async(_schedulerQueue, ^{
+        @strongify(self);
+        for (_MFSysexTransferState *state in self->_sysexTransfers.copy) {
+            MFMIDISysexTransferCancel(state->_transfer, kMFMIDISysexTransferCancelledErr);
+            [self _finishSysexTransfer:state];
+        }
+    });
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDISessionSendMessageValue(MFMIDISession *session, const MFMIDIMessageValue *value)
+{
+    // Continuous controllers wait in the slots of any class that's coalescing. The other classes get them now
+    uint32_t directClasses = _kMFSendTargetClassAll;
+    const uint32_t coalescedClasses = atomic_load_explicit(&session->_coalescedClasses, memory_order_relaxed);
+    if (coalescedClasses && MFMIDICoalescerIsCoalescable(value))
+    {
+        for (int i=0; i<_COALESCER_COUNT; i++) {
+            if (!(coalescedClasses & _kCoalescerTargetClass[i])) continue;
+            if (MFMIDICoalescerAdd(session->_coalescers[i], value)) {
+                atomic_fetch_or_explicit(&session->_coalescerPendingClasses, _kCoalescerTargetClass[i], memory_order_release);
+                [session _scheduleCoalescerFlushForIndex:i];
+            }
+        }
+        directClasses &= ~coalescedClasses;
+        if (!directClasses) return;
+    }
+    
+    // Short messages go in a fixed stack buffer. Only sysex needs a bigger one
+    if (value->length <= kMFMIDIMessageValueInlineCapacity)
+    {
+        Byte packetBuffer[sizeof(MIDIPacketList) + kMFMIDIMessageValueInlineCapacity];
+        MIDIPacketList *packetList = (MIDIPacketList *)packetBuffer;
+        MIDIPacket *packet = MIDIPacketListInit(packetList);
+        MIDIPacketListAdd(packetList, sizeof(packetBuffer), packet, 0, value->length, MFMIDIMessageValueGetBytes(value));
+        
+        if (directClasses == _kMFSendTargetClassAll) {
+            [session sendMIDIPacketList:packetList];
+        } else {
+            [session _sendPacketList:packetList toClasses:directClasses];
+        }
+    }
+    else
+    {
+        MFMIDIMessage *msg = [MFMIDIMessage messageWithValue:*value];
+        [session sendMIDIMessage:msg];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - MIDI Convenience Methods
+/////////////////////////////////////////////////////////////////////////
+
+// Built straight onto the stack and sent without going through sendMIDIMessageValue:'s dispatch
+
+- (void)sendNoteOn:(UInt8)key velocity:(UInt8)velocity
+{
+    MFMIDIMessageValue msg = MFMIDIMessageValueMakeNoteOn(_midiChannel, key, velocity);
+    MFMIDISessionSendMessageValue(self, &msg);
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendNoteOff:(UInt8)key velocity:(UInt8)velocity
+{
+    MFMIDIMessageValue msg = MFMIDIMessageValueMakeNoteOff(_midiChannel, key, velocity);
+    MFMIDISessionSendMessageValue(self, &msg);
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendCC:(UInt8)ccNumber value:(UInt8)value
+{
+    MFMIDIMessageValue msg = MFMIDIMessageValueMakeControlChange(_midiChannel, ccNumber, value);
+    MFMIDISessionSendMessageValue(self, &msg);
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendPitchbend:(UInt16)value
+{
+    MFMIDIMessageValue msg = MFMIDIMessageValueMakePitchbend(_midiChannel, value);
+    MFMIDISessionSendMessageValue(self, &msg);
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendProgramChange:(UInt8)value
+{
+    MFMIDIMessageValue msg = MFMIDIMessageValueMakeProgramChange(_midiChannel, value);
+    MFMIDISessionSendMessageValue(self, &msg);
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendChannelAftertouch:(UInt8)pressure
+{
+    MFMIDIMessageValue msg = MFMIDIMessageValueMakeChannelAftertouch(_midiChannel, pressure);
+    MFMIDISessionSendMessageValue(self, &msg);
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendPolyphonicAftertouch:(UInt8)key pressure:(UInt8)pressure
+{
+    MFMIDIMessageValue msg = MFMIDIMessageValueMakePolyphonicAftertouch(_midiChannel, key, pressure);
+    MFMIDISessionSendMessageValue(self, &msg);
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendAllNotesOffForCurrentChannel
+{
+    [self sendCC:123 value:0];
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendAllNotesOffForAllChannels
+{
+    [self sendBatch:^(MFMIDIBatch *batch) {
+        for (UInt8 ch=0; ch<=15; ch++) {
+            MFMIDIBatchAddControlChange(batch, ch, 123, 0);
+        }
+    }];
+}
+
+//---------------------------------------------------------------------
+
+- (void)releaseActiveNotes
+{
+    [self _releaseActiveNotes:NULL];
+}
+
+//---------------------------------------------------------------------
+
+- (void)releaseActiveNotesForConnection:(id<MFMIDIDestination>)destination
+{
+    const uint64_t key = [self _trafficStatsKeyForConnection:destination];
+    if (!key) return;
+    _MFActiveNotes *notes = [self _activeNotesForKey:key];
+    if (notes) [self _releaseActiveNotes:notes];
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendRPNWithMSB:(UInt8)msb LSB:(UInt8)lsb valueMSB:(UInt8)valueMSB valueLSB:(UInt8)valueLSB
+{
+    UInt8 ch = _midiChannel;
+    [self sendBatch:^(MFMIDIBatch *batch) {
+        MFMIDIBatchAddControlChange(batch, ch, 101, msb);
+        MFMIDIBatchAddControlChange(batch, ch, 100, lsb);
+        MFMIDIBatchAddControlChange(batch, ch, 6, valueMSB);
+        if (valueLSB) {
+            MFMIDIBatchAddControlChange(batch, ch, 38, valueLSB);
+        }
+    }];
+}
+
+//---------------------------------------------------------------------
+
+- (void)sendNRPNWithMSB:(UInt8)msb LSB:(UInt8)lsb valueMSB:(UInt8)valueMSB valueLSB:(UInt8)valueLSB
+{
+    UInt8 ch = _midiChannel;
+    [self sendBatch:^(MFMIDIBatch *batch) {
+        MFMIDIBatchAddControlChange(batch, ch, 99, msb);
+        MFMIDIBatchAddControlChange(batch, ch, 98, lsb);
+        MFMIDIBatchAddControlChange(batch, ch, 6, valueMSB);
+        if (valueLSB) {
+            MFMIDIBatchAddControlChange(batch, ch, 38, valueLSB);
+        }
+    }];
+}
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Thru Routing
+/////////////////////////////////////////////////////////////////////////
+
+- (void)setThruFromSource:(id<MFMIDISource>)source toDestination:(id<MFMIDIConnection>)destination filter:(const MFMIDITransform *)filter
+{
+    const uint64_t sourceKey = [self _trafficStatsKeyForConnection:source];
+    const uint64_t destinationKey = [self _trafficStatsKeyForConnection:destination];
+    if (!sourceKey || !destinationKey) {
+        warn("Thru isn't supported from %@ to %@", source, destination);
+        return;
+    }
+    
+    @synchronized(_connectionTransforms) {
+        NSMutableDictionary *destinations = _thruRoutes[@(sourceKey)];
+        if (!destinations) {
+            destinations = [NSMutableDictionary dictionary];
+            _thruRoutes[@(sourceKey)] = destinations;
+        }
+        destinations[@(destinationKey)] = filter ? [NSData dataWithBytes:filter length:sizeof(MFMIDITransform)] : [NSNull null];
+    }
+    [self _rebuildSendRoutes];
+}
+
+//---------------------------------------------------------------------
+
+- (void)removeThruFromSource:(id<MFMIDISource>)source toDestination:(id<MFMIDIConnection>)destination
+{
+    const uint64_t sourceKey = [self _trafficStatsKeyForConnection:source];
+    const uint64_t destinationKey = [self _trafficStatsKeyForConnection:destination];
+    
+    @synchronized(_connectionTransforms) {
+        NSMutableDictionary *destinations = _thruRoutes[@(sourceKey)];
+        if (!destinations[@(destinationKey)]) return;
+        [destinations removeObjectForKey:@(destinationKey)];
+        if (!destinations.count) [_thruRoutes removeObjectForKey:@(sourceKey)];
+    }
+    [self _rebuildSendRoutes];
+}
+
+//---------------------------------------------------------------------
+
+- (void)removeAllThruRoutes
+{
+    @synchronized(_connectionTransforms) {
+        if (!_thruRoutes.count) return;
+        [_thruRoutes removeAllObjects];
+    }
+    [self _rebuildSendRoutes];
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)hasThruFromSource:(id<MFMIDISource>)source toDestination:(id<MFMIDIConnection>)destination
+{
+    const uint64_t sourceKey = [self _trafficStatsKeyForConnection:source];
+    const uint64_t destinationKey = [self _trafficStatsKeyForConnection:destination];
+    @synchronized(_connectionTransforms) {
+        return _thruRoutes[@(sourceKey)][@(destinationKey)] != nil;
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** One thru route. A filtered one goes through a copy on the stack, carrying the source's filter state on from `state` */
+static OSStatus _MFSendPacketListAlongThruRoute(const _MFThruRoute *route, const _MFSendTarget *target, const MFMIDIBackend *backend, const MIDIPacketList *packetList, uint32_t messageCount, uint32_t byteCount, BOOL coreMIDISendEnabled, MFMIDITransformState *state)
+{
+    if (!route->filter) {
+        return _MFSendPacketListThroughTarget(target, backend, packetList, messageCount, byteCount, coreMIDISendEnabled, 0);
+    }
+    
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    const MIDIPacketList *filtered = _MFTransformPacketList(route->filter, state, 0, packetList, buffer, sizeof(buffer));
+    if (!filtered) return noErr;
+    
+    uint32_t filteredMessageCount, filteredByteCount;
+    _MFTrafficStatsCountPacketList(filtered, &filteredMessageCount, &filteredByteCount);
+    if (filteredByteCount == byteCount) filteredMessageCount = messageCount;
+    return _MFSendPacketListThroughTarget(target, backend, filtered, filteredMessageCount, filteredByteCount, coreMIDISendEnabled, 0);
+}
+
+//---------------------------------------------------------------------
+
+/**
+ Forwards what a source's read proc got along its thru routes, ahead of queuing it for receive. On CoreMIDI's thread so no ObjC messaging, locks or allocation. Unfiltered routes to destinations without a transform of their own are handed `packetList` itself, uncopied.
+ 
+ Errors end up in the destinations' traffic stats as there's no one to throw to
+ */
+static void _MFMIDISessionThru(MFMIDISession *session, const MIDIPacketList *packetList, uint32_t sourceID)
+{
+    uint32_t token;
+    const _MFSendRoutes *routes = _MFSendRouterBeginRead(session->_sendRouter, &token);
+    _MFThruSource *source = _MFSendRoutesFindThruSource(routes, sourceID);
+    if (source)
+    {
+        uint32_t messageCount, byteCount;
+        _MFTrafficStatsCountPacketList(packetList, &messageCount, &byteCount);
+        
+        // Every filter starts from where the stream was and, as filters don't change how it's parsed, ends up in the same place
+        MFMIDITransformState nextState = source->filterState;
+        for (uint32_t i = 0; i < source->routeCount; i++)
+        {
+            const _MFThruRoute *route = &routes->thruRoutes[source->firstRoute + i];
+            MFMIDITransformState state = source->filterState;
+            _MFSendPacketListAlongThruRoute(route, &routes->targets[route->targetIndex], session->_backend, packetList, messageCount, byteCount, session->_coreMIDISendEnabled, &state);
+            if (route->filter) nextState = state;
+        }
+        source->filterState = nextState;
+    }
+    _MFSendRouterEndRead(session->_sendRouter, token);
+}
+
+//---------------------------------------------------------------------
+
+/** As above from the MIDI 2.0 input port. Unfiltered routes to destinations that take event lists get `eventList` as it is. The rest, and the stats, have its MIDI 1.0 translation */
+MF_UMP_AVAILABLE
+static void _MFMIDISessionThruEventList(MFMIDISession *session, const MIDIEventList *eventList, uint32_t sourceID)
+{
+    uint32_t token;
+    const _MFSendRoutes *routes = _MFSendRouterBeginRead(session->_sendRouter, &token);
+    _MFThruSource *source = _MFSendRoutesFindThruSource(routes, sourceID);
+    if (!source) {
+        _MFSendRouterEndRead(session->_sendRouter, token);
+        return;
+    }
+    
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    MIDIPacketList *packetList = (MIDIPacketList *)buffer;
+    MFMIDIUMPEventListToPacketList(eventList, packetList, sizeof(buffer));
+    
+    uint32_t messageCount, byteCount;
+    _MFTrafficStatsCountPacketList(packetList, &messageCount, &byteCount);
+    
+    MFMIDITransformState nextState = source->filterState;
+    for (uint32_t i = 0; i < source->routeCount; i++)
+    {
+        const _MFThruRoute *route = &routes->thruRoutes[source->firstRoute + i];
+        const _MFSendTarget *target = &routes->targets[route->targetIndex];
+        if (!route->filter && _MFSendTargetTakesEventLists(target, session->_backend)) {
+            _MFSendEventListToTarget(target, session->_backend, eventList, packetList, messageCount, byteCount, session->_coreMIDISendEnabled);
+        } else if (packetList->numPackets) {
+            MFMIDITransformState state = source->filterState;
+            _MFSendPacketListAlongThruRoute(route, target, session->_backend, packetList, messageCount, byteCount, session->_coreMIDISendEnabled, &state);
+            if (route->filter) nextState = state;
+        }
+    }
+    source->filterState = nextState;
+    
+    _MFSendRouterEndRead(session->_sendRouter, token);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - MIDI Callback Procs
+/////////////////////////////////////////////////////////////////////////
+
+static void _MFMIDINotifyProc(MFMIDIBackendNotification notification, MFMIDIBackendEndpointType endpointType, MIDIEndpointRef endpoint, void *refCon)
+{
+    MFMIDISession *self = (__bridge MFMIDISession *)refCon;
+    switch (notification)
+    {
+        case kMFMIDIBackendEndpointAdded:
+        {
+            echo("Backend reported ADDED endpoint %i", (int)endpoint);
+
+            // Skip if it's a virtual one as we were the ones who added it
+            if ([self _endpointIsForVirtualConnection:endpoint]) {
+                echo("...skipping as it's virtual");
+                return;
+            }
+            
+            // Choose the source/destination and wire it in
+            if (endpointType == kMFMIDIBackendEndpointTypeDestination)
+                [self _connectDestinationEndpoint:endpoint];
+            else
+                [self _connectSourceEndpoint:endpoint];
+            break;
+        }
+        case kMFMIDIBackendEndpointRemoved:
+        {
+            echo("Backend reported REMOVED endpoint %i", (int)endpoint);
+
+            // virtual should never be but if it is then it's reversed terminology when local
+            if ([self _endpointIsForVirtualConnection:endpoint])
+            {
+                echo("...it's for a virtual!?!");
+                if (endpointType == kMFMIDIBackendEndpointTypeDestination)
+                    [self _disconnectSourceEndpoint:endpoint];
+                else
+                    [self _disconnectDestinationEndpoint:endpoint];
+            }
+            else
+            {
+                if (endpointType == kMFMIDIBackendEndpointTypeDestination)
+                    [self _disconnectDestinationEndpoint:endpoint];
+                else
+                    [self _disconnectSourceEndpoint:endpoint];
+            }
+            
+            // After the above's logging. Refs can be reused
+            _MFEndpointInfoCacheInvalidate(self->_endpointInfo, endpoint);
+            break;
+        }
+        case kMFMIDIBackendEndpointPropertyChanged:
+        {
+            // Names may have changed. 0 means it was a device or entity so any of them might have
+            echo("Backend reported PROPERTY CHANGE on endpoint %i", (int)endpoint);
+            _MFEndpointInfoCacheInvalidate(self->_endpointInfo, endpoint);
+            break;
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** Runs on CoreMIDI's high priority thread. Must not allocate, lock or message ObjC so just forward along any thru routes and copy the raw packets into the lock-free ring. readProcRefCon is the ring's context and srcConnRefCon is the source ID (NULL for virtual destinations) */
+static void _MFMIDIReadProc(const MIDIPacketList *pktlist, void *readProcRefCon, void *srcConnRefCon)
+{
+    _MFMIDIReceiveContext *context = readProcRefCon;
+    __unsafe_unretained MFMIDISession *session = (__bridge MFMIDISession *)context->thruRefCon;
+    if (session && atomic_load_explicit(&session->_thruActive, memory_order_relaxed)) {
+        _MFMIDISessionThru(session, pktlist, _MFMIDIReceiveContextSourceID(context, srcConnRefCon));
+    }
+    _MFMIDIReceiveContextWritePacketList(context, pktlist, srcConnRefCon);
+}
+
+/** As above for the MIDI 2.0 input port */
+static void _MFMIDIEventReadProc(const MIDIEventList *eventList, void *readProcRefCon, void *srcConnRefCon)
+{
+    _MFMIDIReceiveContext *context = readProcRefCon;
+    __unsafe_unretained MFMIDISession *session = (__bridge MFMIDISession *)context->thruRefCon;
+    if (session && atomic_load_explicit(&session->_thruActive, memory_order_relaxed)) {
+        _MFMIDISessionThruEventList(session, eventList, _MFMIDIReceiveContextSourceID(context, srcConnRefCon));
+    }
+    _MFMIDIReceiveContextWriteEventList(context, eventList, srcConnRefCon);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Network Discovery
+/////////////////////////////////////////////////////////////////////////
+
+static double _MFNetDiscoveryNowProc(void *refCon)
+{
+    return (double)_MFNanosFromHostTicks(mach_absolute_time()) / NSEC_PER_SEC;
+}
+
+static void _MFNetDiscoveryHostAvailableProc(const char *name, const char *address, uint16_t port, bool confirmed, void *refCon)
+{
+    MFMIDISession *self = (__bridge MFMIDISession *)refCon;
+    NSString *nameStr = @(name), *addressStr = @(address);
+    if (nameStr && addressStr) [self _netDiscoveryHostAvailableWithName:nameStr address:addressStr port:port confirmed:confirmed];
+}
+
+static void _MFNetDiscoveryHostUnresolvedProc(const char *name, const char *domain, void *refCon)
+{
+    MFMIDISession *self = (__bridge MFMIDISession *)refCon;
+    NSString *nameStr = @(name), *domainStr = @(domain);
+    if (nameStr && domainStr) [self _netDiscoveryHostUnresolvedWithName:nameStr domain:domainStr];
+}
+
+static void _MFNetDiscoveryProgressProc(size_t settled, size_t outstanding, void *refCon)
+{
+    [(__bridge MFMIDISession *)refCon _notifyDelegatesConnectionRefreshDidProgressWithResolvedCount:settled pendingCount:outstanding];
+}
+
+static void _MFNetDiscoveryDidEndProc(void *refCon)
+{
+    [(__bridge MFMIDISession *)refCon _handleNetworkRefreshDidEnd];
+}
+
+static void _MFNetDiscoveryStoreNeedsSaveProc(void *refCon)
+{
+    [(__bridge MFMIDISession *)refCon _scheduleStateSave];
+}
+
+static const _MFNetDiscoveryCallbacks _kMFNetDiscoveryCallbacks = {
+    .now = _MFNetDiscoveryNowProc,
+    .hostAvailable = _MFNetDiscoveryHostAvailableProc,
+    .hostUnresolved = _MFNetDiscoveryHostUnresolvedProc,
+    .progress = _MFNetDiscoveryProgressProc,
+    .didEnd = _MFNetDiscoveryDidEndProc,
+    .storeNeedsSave = _MFNetDiscoveryStoreNeedsSaveProc,
+};
+
+//---------------------------------------------------------------------
+
+/** Unconfirmed ones are on an address remembered from last time which Bonjour hasn't vouched for (yet). They're removed at the end of the refresh unless it does */
+- (void)_netDiscoveryHostAvailableWithName:(NSString *)name address:(NSString *)address port:(uint16_t)port confirmed:(BOOL)confirmed
+{
+    echo("NETSERVICE: %@ %@ at %@:%i", name, confirmed ? @"resolved" : @"remembered", address, (int)port);
+    
+    // Connect to MIDI
+    // Handles delegate (if it's not an existing connection). Returns the created or existing conx pair
+    NSArray *pair = [self _addNetworkConnectionWithName:name address:address port:port];
+    if (confirmed) {
+        [_netConxToRemove removeObject:pair[0]];
+        [_netConxToRemove removeObject:pair[1]];
+    } else {
+        [_netConxToRemove addObjectsFromArray:pair];
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)_netDiscoveryHostUnresolvedWithName:(NSString *)name domain:(NSString *)domain
+{
+    warn("NETSERVICE: %@ DID NOT RESOLVE. Adding to MIDINetworkSession anyway as a fallback (by service name)", name);
+    
+    // Fallback - at least it will show up in MIDI Network Setup's "Directory"
+    MIDINetworkHost *host = [MIDINetworkHost hostWithName:name netServiceName:name netServiceDomain:domain];
+    NSArray *pair = [self _addNetworkConnectionWithHost:host];
+    [_netConxToRemove removeObject:pair[0]];
+    [_netConxToRemove removeObject:pair[1]];
+}
+
+//---------------------------------------------------------------------
+
+- (void)_startNetDeadlineTimer
+{
+    if (_netDeadlineTimer) return;
+    
+    _netDeadlineTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+    const uint64_t interval = (uint64_t)(_NETSERVICE_DEADLINE_CHECK_INTERVAL * NSEC_PER_SEC);
+    dispatch_source_set_timer(_netDeadlineTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+    @weakify(self);
+    dispatch_source_set_event_handler(_netDeadlineTimer, ^{
+        @strongify(self);
+        if (self) _MFNetDiscoveryCheckDeadlines(self->_netDiscovery);
+    });
+    dispatch_resume(_netDeadlineTimer);
+}
+
+//---------------------------------------------------------------------
+
+/** Browse done and every service found has settled (or it was cancelled). Removes the connections which didn't turn up, resets flags and notifies the delegates */
+- (void)_handleNetworkRefreshDidEnd
+{
+    echo("NETSERVICE: All done! Cleaning up...");
+    if (_netDeadlineTimer) {
+        dispatch_source_cancel(_netDeadlineTimer);
+        _netDeadlineTimer = nil;
+    }
+
+    // First remove manual connections so they dont get cleaned up
+    [_netConxToRemove filterUsingPredicate:[NSPredicate predicateWithBlock:^BOOL(_MFMIDINetworkConnection *conx, NSDictionary *bindings) {
+        return !conx.isManualConnection;
+    }]];
+    
+    echo("...cleaning out old connections no longer present: %@", _netConxToRemove);
+    for (_MFMIDINetworkConnection *conx in _netConxToRemove)
+    {
+        const _MFConnectionList list = [conx conformsToProtocol:@protocol(MFMIDISource)] ? _kMFConnectionListNetworkSources : _kMFConnectionListNetworkDestinations;
+        [_registry removeConnection:conx fromList:list];
+    }
+    [self _rebuildSendRoutes];
+    
+    for (_MFMIDINetworkConnection *conx in _netConxToRemove)
+    {
+        [self _notifyDelegatesAboutConnection:conx didConnect:NO];
+    }
+    _netConxToRemove = nil;
+    
+    echo("...updating flags, notifying delegates");
+    self.isRefreshing = NO;
+    [self _notifyDelegatesConnectionsRefreshDidEnd];
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Protected
+/////////////////////////////////////////////////////////////////////////
+
+/** Adds/removes the Connection's host to the MIDINetworkSession. Updates the enabled flag in both it and the it's corresponding source/destination pair since they are coupled */
+- (void)_setStateForNetworkConnection:(_MFMIDINetworkConnection *)conx toEnabled:(BOOL)toEnabled
+{
+    // Check that it isn't (happens quite frequently given the coupling of NetworkDests and NetworkSources enabled states
+    if (conx.enabled == toEnabled) {
+        echo("Connection %@ is already %@abled", conx, toEnabled?@"en":@"dis");
+        return;
+    }
+    
+    // Find the other in the pair to update it's flag
+    _MFMIDINetworkSource *src;
+    _MFMIDINetworkDestination *dest;
+    
+    if ([conx isMemberOfClass:_MFMIDINetworkSource.class])
+    {
+        src = (id)conx;
+        for (_MFMIDINetworkDestination *aDest in self.networkDestinations) {
+            if ([aDest hasSameHostAs:src])
+            {
+                dest = aDest;
+                break;
+            }
+        }
+    } else {
+        dest = (id)conx;
+        for (_MFMIDINetworkSource *aSrc in self.networkSources) {
+            if ([aSrc hasSameHostAs:dest])
+            {
+                src = aSrc;
+                break;
+            }
+        }
+    }
+
+    // They should ALWAYS be in pairs
+    NSAssert(src, @"Source missing from pair. Details:\nconx: %@\nsrc: %@\ndest: %@", conx, self.networkSources, self.networkDestinations);
+    NSAssert(dest, @"Destination missing from pair. Details:\nconx: %@\nsrc: %@\ndest: %@", conx, self.networkSources, self.networkDestinations);
+    
+    // Add just one as it enabled both of them
+    if (toEnabled) {
+        echo("Enabled NetworkConnection with host %@", dest.midiNetworkConnection.host);
+        [_midiNetSession addConnection:dest.midiNetworkConnection];
+    } else {
+        // Before it goes. The hosts share the one endpoint so this releases the notes on the others too, but better that than leave them hanging on this one
+        echo("Disabling NetworkConnection with host %@", dest.midiNetworkConnection.host);
+        [self releaseActiveNotesForConnection:dest];
+        [_midiNetSession removeConnection:dest.midiNetworkConnection];
+    }
+    
+    // Update the flags without invoking the setters (again) and store if set to do so
+    [src _setEnabledFlag:toEnabled];
+    [dest _setEnabledFlag:toEnabled];
+    [self _updateNetworkReceiveConnection];
+    if (_restorePreviousConnectionStates)
+    {
+        [self _storeConnectionEnabledState:src];
+        [self _storeConnectionEnabledState:dest];
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)_setStateForEndpointConnection:(_MFMIDIEndpointConnection *)conx toEnabled:(BOOL)toEnabled
+{
+    // Whatever it's playing would hang once it's out of the routes
+    const BOOL isDestination = [conx isKindOfClass:_MFMIDIEndpointDestination.class];
+    if (isDestination && !toEnabled && conx.enabled) {
+        [self releaseActiveNotesForConnection:(id)conx];
+    }
+    
+    [conx _setEnabledFlag:toEnabled];
+    
+    if (isDestination) {
+        [self _rebuildSendRoutes];
+    }
+    
+    // Sources need wiring to the input port. Virtual ones receive through their own read proc
+    if ([conx isKindOfClass:_MFMIDIEndpointSource.class] && !conx.isVirtualConnection) {
+        [self _setReceiveConnected:toEnabled forSource:(_MFMIDIEndpointSource *)conx];
+    }
+    if (_restorePreviousConnectionStates)
+        [self _storeConnectionEnabledState:conx];
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Additional Privates
+/////////////////////////////////////////////////////////////////////////
+
+/** Scans CoreMIDIs Endpoints updating our list and making MIDIConnection objects for non-network connections. Also removes Endpoints and related Connections no longer available and notifies delegates of connection changes. Does NOT do a Bonjour rescan. This is a synchronous operation. */
+- (void)_refreshConnectionsForMIDIEndpoints
+{
+    echo("Scanning Endpoints...");
+    
+    const NSUInteger destinationCnt = _backend->numberOfDestinations(_backend->context);
+    const NSUInteger sourceCnt      = _backend->numberOfSources(_backend->context);
+    
+    // Track which endpoints are added/removed so we can do our delegate notifications
+    NSMutableSet *srcEndpointsToRemove = [_registry endpointsForDiffingIsSource:YES];
+    NSMutableSet *destEndpointsToRemove = [_registry endpointsForDiffingIsSource:NO];
+    
+    /////////////////////////////////////////
+    // DESTINATIONS
+    /////////////////////////////////////////
+    
+    echo(@"...%i destination(s) found", (int)destinationCnt);
+    for (NSUInteger index = 0; index < destinationCnt; ++index)
+    {
+        MIDIEndpointRef endpoint = _backend->getDestination(_backend->context, index);
+        NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
+        
+        // Skip virtuals
+        if ([_registry isVirtualEndpoint:endpoint]) {
+            [srcEndpointsToRemove removeObject:endpointObj]; //see notes below
+            echo("...Endpoint %@ is Virtual, skipping", endpointObj);
+            continue;
+        }
+        
+        // Already exists? Remove from remove list :) Effectively a no-op on that endpoint
+        // Otherwise connect it
+        if ([_registry containsEndpoint:endpoint isSource:NO]) {
+            echo("...Destination Endpoint %@ already in our list", endpointObj);
+            [destEndpointsToRemove removeObject:endpointObj];
+        } else {
+            [self _connectDestinationEndpoint:endpoint];
+        }
+    }
+    
+    /////////////////////////////////////////
+    // SOURCES
+    /////////////////////////////////////////
+    
+    echo(@"...%i source(s) found", (int)sourceCnt);
+    for (NSUInteger index = 0; index < sourceCnt; ++index)
+    {
+        MIDIEndpointRef endpoint = _backend->getSource(_backend->context, index);
+        NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
+        
+        // Skip virtuals
+        if ([_registry isVirtualEndpoint:endpoint]) {
+            [destEndpointsToRemove removeObject:endpointObj]; //see notes below
+            echo("...Endpoint %@ is Virtual, skipping", endpointObj);
+            continue;
+        }
+
+        // Already exists? Remove from remove list :) Effectively a no-op on that endpoint
+        // Otherwise connect it
+        if ([_registry containsEndpoint:endpoint isSource:YES]) {
+            echo("...Source Endpoint %@ already in our list", endpointObj);
+            [srcEndpointsToRemove removeObject:endpointObj];
+        } else {
+            [self _connectSourceEndpoint:endpoint];
+        }
+    }
+    
+    // Remove the missing ones
+    // NOTE: We do this last b/c Virtual "Sources" show up as MIDIDestinations and vice versa so we need to process both before we have an accurate list to remove
+    for (NSNumber *endpointNum in destEndpointsToRemove) {
+        [self _disconnectDestinationEndpoint:(MIDIEndpointRef)endpointNum.unsignedIntegerValue];
+    }
+
+    for (NSNumber *endpointNum in srcEndpointsToRemove) {
+        [self _disconnectSourceEndpoint:(MIDIEndpointRef)endpointNum.unsignedIntegerValue];
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (NSArray *)_addNetworkConnectionWithName:(NSString *)name address:(NSString *)address port:(NSUInteger)port
+{
+    MIDINetworkHost *host = [MIDINetworkHost hostWithName:name address:address port:port];
+    return [self _addNetworkConnectionWithHost:host];
+}
+
+//---------------------------------------------------------------------
+
+/** @private See Special Notes in README about NSNetService */
+- (NSArray *)_addNetworkConnectionWithHost:(MIDINetworkHost *)host
+{
+    echo("Adding Network Source/Destination pair for host %@", host);
+    
+    // Get the endpoints for the MIDISession
+    MIDIEndpointRef srcEndpoint = [_midiNetSession sourceEndpoint];
+    MIDIEndpointRef destEndpoint = [_midiNetSession destinationEndpoint];
+    
+    // Look for a matching connection in our list
+    // We can search either list
+    _MFMIDINetworkDestination *dest = [[_MFMIDINetworkDestination alloc] initWithEndpoint:destEndpoint client:self host:host];
+    _MFMIDINetworkSource *src = [[_MFMIDINetworkSource alloc] initWithEndpoint:srcEndpoint client:self host:host];
+    
+    _MFMIDINetworkDestination *existingDest = [_registry connectionInList:_kMFConnectionListNetworkDestinations equalTo:dest]; // uses isEqual:
+    if (existingDest) {
+        return @[[_registry connectionInList:_kMFConnectionListNetworkSources equalTo:src], existingDest];
+    }
+    
+    // Add to the list and enable if auto
+    echo("...adding NetworkSource & NetworkDestination to our list.");
+    [_registry addConnection:src toList:_kMFConnectionListNetworkSources];
+    [_registry addConnection:dest toList:_kMFConnectionListNetworkDestinations];
+    [self _rebuildSendRoutes];
+    
+    // Handle autoEnable. FYI they ARENT necessarily in the MIDI session if they appear here.
+    // Do both even though they are coupled for futureproofing
+    // The enabled flag is a smart setter and handles MIDISession stuff
+    // Handle auto-enabled / restore
+    [self _setEnabledStateForConnectionBasedOnSettings:src];
+    [self _setEnabledStateForConnectionBasedOnSettings:dest];
+    
+    
+    // And the delegates
+    // NOTE: Why is delegate separate from connect here but for EndpointConnections? B/c for net conns we use the connection/disconnection for enabled/disabled where with Endpoint-based conns, they are always connected (we have no choice i dont think) and we use our enabled flag to determine whether to send. In the end its all b/c there is only 1 Endpoint for ALL network connections. Booooo.
+   [self _notifyDelegatesAboutConnection:src didConnect:YES];
+   [self _notifyDelegatesAboutConnection:dest didConnect:YES];
+    
+    return @[src, dest];
+}
+
+//---------------------------------------------------------------------
+
+static void _MFRestoreManualHostProc(const MFMIDIManualHostRecord *record, void *refCon)
+{
+    MFMIDISession *self = (__bridge MFMIDISession *)refCon;
+    NSString *name = @(record->name), *address = @(record->address);
+    if (!name || !address) return;
+    echo("Recreating Manual Network Connection '%@': %@:%u", name, address, record->port);
+    
+    NSArray *conns = [self _addNetworkConnectionWithName:name address:address port:record->port];
+    [conns[0] setIsManualConnection:YES];
+    [conns[1] setIsManualConnection:YES];
+    // It'll be enabled/disabled automatically via the Enabled State Persistence
+}
+
+/** Recreates the connections and enables/disables them according to their persisted state */
+- (void)_restoreManualNetworkConnections
+{
+    echo("Restoring persisted Manual Network Connections: ");
+    _MFConnectionStateStoreEnumerateManualHosts(_stateStore, _MFRestoreManualHostProc, (__bridge void *)self);
+}
+
+//---------------------------------------------------------------------
+
+///** Nil if not currently in our list */
+//- (_MFMIDIEndpointDestination *)_existingDestinationWithEndpoint:(MIDIEntityRef)endpoint
+//{
+//    NSArray *matching = [_destinations filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"endpoint = %u", endpoint]];
+//    if (!matching || matching.count == 0) return nil;
+//    return matching[0];
+//}
+
+//---------------------------------------------------------------------
+
+/** Internally add reference for a newly discovered/created endpoint. Notify delegates 
+    @return The created connection object or nil if it was a network endpoint
+ */
+- (_MFMIDIEndpointDestination *)_connectDestinationEndpoint:(MIDIEndpointRef)endpoint
+{
+    NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
+    
+    [_registry addEndpoint:endpoint isSource:NO];
+    
+    if (_MFEndpointInfoCacheIsNetworkSessionEndpoint(_endpointInfo, endpoint))
+    {
+        echo("Added Destination Endpoint %@ (is a Network Endpoint - NOT creating MIDIDestination)", endpointObj);
+        // Dont create our objects for Network endpoints as we treat the individual Network Hosts as "Connections" which requires some re-interpreting of how CoreMIDI works.  CoreMIDI has ALL network connections go through a single endpoint which is a bit weary IMO
+        return nil;
+    }
+    else
+    {
+        _MFMIDIEndpointDestination *dest = [[_MFMIDIEndpointDestination alloc] initWithEndpoint:endpoint client:self];
+        [_registry addConnection:dest toList:_kMFConnectionListEndpointDestinations];
+        [self _rebuildSendRoutes];
+        
+        [self _setEnabledStateForConnectionBasedOnSettings:dest];
+        
+        echo(@"Added Destination Endpoint called \"%@\" (enabled=%@)", endpointObj, dest.name, dest.enabled?@"YES":@"NO");
+        
+        // Notify delegates
+        [self _notifyDelegatesAboutConnection:dest didConnect:YES];
+        
+        return dest;
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** Internally add reference for a newly discovered/created endpoint. Notify delegates
+ @return The created connection object or nil if it was a network endpoint
+ */
+- (_MFMIDIEndpointSource *)_connectSourceEndpoint:(MIDIEndpointRef)endpoint
+{
+    NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
+    
+    [_registry addEndpoint:endpoint isSource:YES];
+    
+    if (_MFEndpointInfoCacheIsNetworkSessionEndpoint(_endpointInfo, endpoint))
     {
-        echo("NETSERVICE: All done! Cleaning up...");
-
-        // First remove manual connections so they dont get cleaned up
-        NSPredicate *pred = [NSPredicate predicateWithFormat:@"SELF.isManualConnection == 0"];
-        _netConxToRemove = [_netConxToRemove filteredArrayUsingPredicate:pred].mutableCopy;
+        echo("Added Source Endpoint %@ (is a Network Endpoint - NOT creating MIDISource)", endpointObj);
+        return nil;
+    }
+    else
+    {
+        _MFMIDIEndpointSource *src = [[_MFMIDIEndpointSource alloc] initWithEndpoint:endpoint client:self];
+        [_registry addConnection:src toList:_kMFConnectionListEndpointSources];
+        
+        [self _setEnabledStateForConnectionBasedOnSettings:src];
         
-        echo("...cleaning out old connections no longer present: %@", _netConxToRemove);
-        NSMutableArray *newSrcs, *newDests;
-        newSrcs = _networkSources.mutableCopy;
-        [newSrcs removeObjectsInArray:_netConxToRemove];
-        _networkSources = [NSArray arrayWithArray:newSrcs];
-        newDests = _networkDestinations.mutableCopy;
-        [newDests removeObjectsInArray:_netConxToRemove];
-        _networkDestinations = [NSArray arrayWithArray:newDests];
+        echo(@"Added Source Endpoint %@ called \"%@\" (enabled=%@)", endpointObj, src.name, src.enabled?@"YES":@"NO");
         
-        for (_MFMIDINetworkConnection *conx in _netConxToRemove)
-        {
-            [self _notifyDelegatesAboutConnection:conx didConnect:NO];
-        }
+        [self _notifyDelegatesAboutConnection:src didConnect:YES];
+        return src;
+    }
+}
 
+//---------------------------------------------------------------------
+
+/** Internally remove the references for an endpoint that has been removed by CoreMIDI. Notify delegates */
+- (void)_disconnectDestinationEndpoint:(MIDIEndpointRef)endpoint;
+{
+    NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
+    
+    [_registry removeEndpoint:endpoint isSource:NO];
+    echo("Disconnected Endpoint %@", endpointObj);
+    
+    // One connection per endpoint. Network ones are tracked separately
+    _MFMIDIEndpointDestination *dest = [_registry connectionInList:_kMFConnectionListEndpointDestinations withEndpoint:endpoint];
+    if (dest)
+    {
+        // Worth a try while it's in the routes, eg. if it was our own virtual source. Either way the notes are forgotten so they can't be released on a device that comes back with the same endpoint
+        [self releaseActiveNotesForConnection:dest];
         
-        echo("...updating flags, notifying delegates");
-        self.isRefreshing = NO;
-        [self _notifyDelegatesConnectionsRefreshDidEnd];
+        [_registry removeConnection:dest fromList:_kMFConnectionListEndpointDestinations];
+        [_registry removeConnection:dest fromList:_kMFConnectionListVirtualSources];
+        [self _rebuildSendRoutes];
+        echo("...and related MIDIDestination %@", dest.name);
+        
+        // Notify delegates
+        [self _notifyDelegatesAboutConnection:dest didConnect:NO];
     }
 }
 
+//---------------------------------------------------------------------
 
-/////////////////////////////////////////////////////////////////////////
-#pragma mark - Protected
-/////////////////////////////////////////////////////////////////////////
+- (void)_disconnectSourceEndpoint:(MIDIEndpointRef)endpoint;
+{
+    NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
+    
+    _backend->portDisconnectSource(_backend->context, _inputPortRef, endpoint);
+    
+    [_registry removeEndpoint:endpoint isSource:YES];
+    echo("Disconnected Endpoint %@", endpointObj);
+    
+    // One connection per endpoint. Network ones are tracked separately
+    _MFMIDIEndpointSource *src = [_registry connectionInList:_kMFConnectionListEndpointSources withEndpoint:endpoint];
+    if (src)
+    {
+        [_registry removeConnection:src fromList:_kMFConnectionListEndpointSources];
+        [_registry removeConnection:src fromList:_kMFConnectionListVirtualDestinations];
+        echo("...and related MIDISource %@", src.name);
+        
+        uint32_t receiveID = [_receiveQueue sourceIDForSource:src];
+        if (receiveID) [_receiveQueue unregisterSourceID:receiveID];
+        
+        // Notify delegates
+        [self _notifyDelegatesAboutConnection:src didConnect:NO];
+    }
+}
 
-/** Adds/removes the Connection's host to the MIDINetworkSession. Updates the enabled flag in both it and the it's corresponding source/destination pair since they are coupled */
-- (void)_setStateForNetworkConnection:(_MFMIDINetworkConnection *)conx toEnabled:(BOOL)toEnabled
+//---------------------------------------------------------------------
+
+/** Our virtual endpoints, the ports (which disconnects their sources) then the client. Once the backend returns from each, nothing calls into its procs again */
+- (void)_disposeMIDIIO
 {
-    // Check that it isn't (happens quite frequently given the coupling of NetworkDests and NetworkSources enabled states
-    if (conx.enabled == toEnabled) {
-        echo("Connection %@ is already %@abled", conx, toEnabled?@"en":@"dis");
-        return;
+    NSArray *virtuals = [self.virtualSources arrayByAddingObjectsFromArray:self.virtualDestinations];
+    for (_MFCoreMIDIConnection *conx in virtuals) {
+        _backend->endpointDispose(_backend->context, conx.endpoint);
     }
+    if (_inputPortRef) _backend->portDispose(_backend->context, _inputPortRef);
+    if (_outputPortRef) _backend->portDispose(_backend->context, _outputPortRef);
+    if (_clientRef) _backend->clientDispose(_backend->context, _clientRef);
+    _inputPortRef = _outputPortRef = 0;
+    _clientRef = 0;
+}
+
+
+//---------------------------------------------------------------------
+
+/** Shorthand. The dispatcher works out whether it's a source or destination. BOOL specifies whether it's connect or disconnect */
+- (void)_notifyDelegatesAboutConnection:(id<MFMIDIConnection>)conx didConnect:(BOOL)isConnect
+{
+    echo("...DELEGATES: Connection %@ did %@CONNECT", conx, isConnect?@"":@"DIS");
+    [_delegateDispatcher connection:conx didConnect:isConnect];
+}
+
+//---------------------------------------------------------------------
+
+- (void)_notifyDelegatesConnectionRefreshDidBegin
+{
+    [_delegateDispatcher refreshDidBegin];
+}
+
+//---------------------------------------------------------------------
+
+- (void)_notifyDelegatesConnectionRefreshDidProgressWithResolvedCount:(NSUInteger)resolvedCount pendingCount:(NSUInteger)pendingCount
+{
+    [_delegateDispatcher refreshDidProgressWithResolvedCount:resolvedCount pendingCount:pendingCount];
+}
+
+//---------------------------------------------------------------------
+
+- (void)_notifyDelegatesConnectionsRefreshDidEnd
+{
+    [_delegateDispatcher refreshDidEnd];
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)_endpointIsForVirtualConnection:(MIDIEndpointRef)endpoint
+{
+    return [_registry isVirtualEndpoint:endpoint];
+}
+
+//---------------------------------------------------------------------
+
+/** Connects/disconnects a (non-virtual) source endpoint to the input port so it's read proc fires. The source ID goes in as the srcConnRefCon */
+- (void)_setReceiveConnected:(BOOL)connected forSource:(_MFMIDIEndpointSource *)src
+{
+    uint32_t receiveID = [_receiveQueue sourceIDForSource:src];
     
-    // Find the other in the pair to update it's flag
-    _MFMIDINetworkSource *src;
-    _MFMIDINetworkDestination *dest;
-    
-    if ([conx isMemberOfClass:_MFMIDINetworkSource.class])
+    if (connected)
     {
-        src = (id)conx;
-        for (_MFMIDINetworkDestination *aDest in self.networkDestinations) {
-            if ([aDest hasSameHostAs:src])
-            {
-                dest = aDest;
-                break;
-            }
+        if (!receiveID) {
+            receiveID = [_receiveQueue reserveSourceID];
+            [self _registerReceiveSource:src forID:receiveID key:src.endpoint];
         }
-    } else {
-        dest = (id)conx;
-        for (_MFMIDINetworkSource *aSrc in self.networkSources) {
-            if ([aSrc hasSameHostAs:dest])
-            {
-                src = aSrc;
-                break;
-            }
+        OSStatus s = _backend->portConnectSource(_backend->context, _inputPortRef, src.endpoint, (void *)(uintptr_t)receiveID);
+        if (s != noErr) {
+            warn("Failed to connect Source %@ for receive (OSStatus %i)", src, (int)s);
         }
+        [self _startReceiveTimerIfNeeded];
+    }
+    else
+    {
+        _backend->portDisconnectSource(_backend->context, _inputPortRef, src.endpoint);
     }
+}
 
-    // They should ALWAYS be in pairs
-    NSAssert(src, @"Source missing from pair. Details:\nconx: %@\nsrc: %@\ndest: %@", conx, self.networkSources, self.networkDestinations);
-    NSAssert(dest, @"Destination missing from pair. Details:\nconx: %@\nsrc: %@\ndest: %@", conx, self.networkSources, self.networkDestinations);
-    
-    // Add just one as it enabled both of them
-    if (toEnabled) {
-        echo("Enabled NetworkConnection with host %@", dest.midiNetworkConnection.host);
-        [_midiNetSession addConnection:dest.midiNetworkConnection];
-    } else {
-        echo("Disabling NetworkConnection with host %@", dest.midiNetworkConnection.host);
-        [_midiNetSession removeConnection:dest.midiNetworkConnection];
+//---------------------------------------------------------------------
+
+/** Network Sources share one endpoint so it's connected while any of them is enabled */
+- (void)_updateNetworkReceiveConnection
+{
+    BOOL anyEnabled = NO;
+    for (_MFMIDINetworkSource *src in self.networkSources) {
+        if (src.enabled) {
+            anyEnabled = YES;
+            break;
+        }
     }
+    if (anyEnabled == _networkReceiveConnected) return;
     
-    // Update the flags without invoking the setters (again) and store if set to do so
-    [src _setEnabledFlag:toEnabled];
-    [dest _setEnabledFlag:toEnabled];
-    if (_restorePreviousConnectionStates)
-    {
-        [self _storeConnectionEnabledState:src];
-        [self _storeConnectionEnabledState:dest];
+    if (anyEnabled) {
+        OSStatus s = _backend->portConnectSource(_backend->context, _inputPortRef, _midiNetSession.sourceEndpoint, (void *)(uintptr_t)_networkReceiveID);
+        if (s != noErr) {
+            warn("Failed to connect the Network Session for receive (OSStatus %i)", (int)s);
+            return;
+        }
+        [self _startReceiveTimerIfNeeded];
+    } else {
+        _backend->portDisconnectSource(_backend->context, _inputPortRef, _midiNetSession.sourceEndpoint);
     }
+    _networkReceiveConnected = anyEnabled;
 }
 
 //---------------------------------------------------------------------
 
-- (void)_setStateForEndpointConnection:(_MFMIDIEndpointConnection *)conx toEnabled:(BOOL)toEnabled
+/** Lazily start draining the receive rings once there's something that can receive */
+- (void)_startReceiveTimerIfNeeded
 {
-    [conx _setEnabledFlag:toEnabled];
-    if (_restorePreviousConnectionStates)
-        [self _storeConnectionEnabledState:conx];
+    if (_receiveTimer || !_receiveDeliveryQueue) return;
+    
+    _receiveTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _receiveDeliveryQueue);
+    dispatch_source_set_timer(_receiveTimer, DISPATCH_TIME_NOW, (uint64_t)(_receivePollInterval * NSEC_PER_SEC), (uint64_t)(_receivePollInterval * 0.2 * NSEC_PER_SEC));
+    
+    @weakify(self);
+    dispatch_source_set_event_handler(_receiveTimer, ^{
+        @strongify(self);
+        [self _deliverReceivedMessagesToDelegates];
+    });
+    dispatch_resume(_receiveTimer);
 }
 
+//---------------------------------------------------------------------
 
-/////////////////////////////////////////////////////////////////////////
-#pragma mark - Additional Privates
-/////////////////////////////////////////////////////////////////////////
+- (void)_deliverReceivedMessagesToDelegates
+{
+    // Collecting UMP costs a translation of everything MIDI 1.0 so only when someone wants it
+    void (^UMPHandler)(id<MFMIDISource>, const uint32_t *, NSUInteger) = nil;
+    if ([_delegateDispatcher hasDelegateWithCapability:_kMFDelegateCapabilityDidReceiveUMP]) {
+        UMPHandler = ^(id<MFMIDISource> source, const uint32_t *words, NSUInteger count) {
+            [_delegateDispatcher enumerateDelegatesWithCapability:_kMFDelegateCapabilityDidReceiveUMP usingBlock:^(id<MFMIDIMessageReceiverDelegate> delegate) {
+                [delegate MIDISource:source didReceiveUMPWords:words count:count];
+            }];
+        };
+    }
+    
+    [self drainReceivedMessages:^(id<MFMIDISource> source, NSArray *messages) {
+        [_delegateDispatcher enumerateDelegatesWithCapability:_kMFDelegateCapabilityDidReceiveMessage usingBlock:^(id<MFMIDIMessageReceiverDelegate> delegate) {
+            for (MFMIDIMessage *message in messages) {
+                [delegate MIDISource:source didReceiveMessage:message];
+            }
+        }];
+    } UMPHandler:UMPHandler];
+}
 
-/** Scans CoreMIDIs Endpoints updating our list and making MIDIConnection objects for non-network connections. Also removes Endpoints and related Connections no longer available and notifies delegates of connection changes. Does NOT do a Bonjour rescan. This is a synchronous operation. */
-- (void)_refreshConnectionsForMIDIEndpoints
+//---------------------------------------------------------------------
+
+/** SCHEDULER QUEUE ONLY. Ensure we wake `scheduleLookahead` before the given event time. No-op if already due to wake earlier */
+- (void)_armSchedulerTimerForEventTime:(uint64_t)eventTime
 {
-    echo("Scanning Endpoints...");
+    const uint64_t lookahead = _MFHostTicksFromSeconds(_scheduleLookahead);
+    const uint64_t wakeTime = eventTime > lookahead ? eventTime - lookahead : 0;
+    if (wakeTime >= _schedulerArmedTime) return;
     
-    const NSUInteger destinationCnt = MIDIGetNumberOfDestinations();
-    const NSUInteger sourceCnt      = MIDIGetNumberOfSources();
+    if (!_schedulerTimer)
+    {
+        _schedulerTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _schedulerQueue);
+        @weakify(self);
+        dispatch_source_set_event_handler(_schedulerTimer, ^{
+            @strongify(self);
+            [self _pumpScheduler];
+        });
+        dispatch_resume(_schedulerTimer);
+    }
     
-    // Track which endpoints are added/removed so we can do our delegate notifications
-    NSMutableArray *srcEndpointsToRemove = [NSMutableArray arrayWithArray:_sourceEndpoints];
-    NSMutableArray *destEndpointsToRemove = [NSMutableArray arrayWithArray:_destinationEndpoints];
+    // One shot. Leeway is a fraction of the lookahead so the OS can coalesce wakeups without us missing the window
+    const uint64_t now = mach_absolute_time();
+    const int64_t delayNanos = wakeTime > now ? (int64_t)_MFNanosFromHostTicks(wakeTime - now) : 0;
+    dispatch_source_set_timer(_schedulerTimer,
+                              dispatch_time(DISPATCH_TIME_NOW, delayNanos),
+                              DISPATCH_TIME_FOREVER,
+                              (uint64_t)(_scheduleLookahead * 0.25 * NSEC_PER_SEC));
+    _schedulerArmedTime = wakeTime;
+}
+
+//---------------------------------------------------------------------
+
+/** Scheduled sends. As sendMIDIPacketList: but errors are logged, as there's no one to throw to and the rest of what's due still has to go */
+static void _MFMIDISessionScheduledBatchFlush(MFMIDIBatch *batch, MIDIPacketList *packetList, void *context)
+{
+    MFMIDISession *session = (__bridge MFMIDISession *)context;
+    _MFMIDISessionFlushPendingCoalesced(session);
+    OSStatus s = _MFMIDISessionSendToClasses(session, packetList, _kMFSendTargetClassAll);
+    if (s != noErr) {
+        warn("Error sending scheduled messages (OSStatus %i)", (int)s);
+    }
+}
+
+/** SCHEDULER QUEUE ONLY. Send everything due within the lookahead, timestamped, then re-arm for the next. Nothing in here throws so every event popped is sent and released whatever fails */
+- (void)_pumpScheduler
+{
+    _schedulerArmedTime = kMFMIDISchedulerNoEvent;
+    const uint64_t horizon = mach_absolute_time() + _MFHostTicksFromSeconds(_scheduleLookahead);
     
-    /////////////////////////////////////////
-    // DESTINATIONS
-    /////////////////////////////////////////
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    MFMIDIBatch batch;
+    MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _MFMIDISessionScheduledBatchFlush, (__bridge void *)self);
     
-    echo(@"...%i destination(s) found", (int)destinationCnt);
-    for (NSUInteger index = 0; index < destinationCnt; ++index)
+    MFMIDISchedulerEvent events[_SCHEDULER_POP_CHUNK];
+    size_t count;
+    while ((count = MFMIDISchedulerPopDue(_scheduler, horizon, events, _SCHEDULER_POP_CHUNK)))
     {
-        MIDIEndpointRef endpoint = MIDIGetDestination(index);
-        NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
-        
-        
-        // tmp: Log some info about the conx
-        MIDIEntityRef entity;
-        MIDIDeviceRef device;
-        OSStatus s1 = MIDIEndpointGetEntity(endpoint, &entity);
-        OSStatus s2 = MIDIEntityGetDevice(entity, &device);
-        echo("YO! Endpoint: %u %i %@", endpoint, noErr, _MFGetMIDIObjectStringProperty(endpoint, kMIDIPropertyName));
-        echo("YO! Entity: %u %i %@", entity, s1, _MFGetMIDIObjectStringProperty(entity, kMIDIPropertyName));
-        echo("YO! Device: %u %i %@", device, s2, _MFGetMIDIObjectStringProperty(device, kMIDIPropertyName));
-        
-        // Skip virtuals
-        if ([self _endpointIsForVirtualConnection:endpoint]) {
-            [srcEndpointsToRemove removeObject:endpointObj]; //see notes below
-            echo("...Endpoint %@ is Virtual, skipping", endpointObj);
-            continue;
-        }
-        
-        // Already exists? Remove from remove list :) Effectively a no-op on that endpoint
-        // Otherwise connect it
-        if ([_destinationEndpoints containsObject:endpointObj]) {
-            echo("...Destination Endpoint %@ already in our list", endpointObj);
-            [destEndpointsToRemove removeObject:endpointObj];
-        } else {
-            [self _connectDestinationEndpoint:endpoint];
+        for (size_t i=0; i<count; ++i)
+        {
+            const MFMIDIMessageValue *msg = &events[i].message;
+            const UInt8 *bytes = MFMIDIMessageValueGetBytes(msg);
+            if (!MFMIDIBatchAddBytes(&batch, events[i].hostTime, bytes, msg->length)) {
+                // Too big for a batch. Send it on its own, in order
+                MFMIDIBatchFlush(&batch);
+                OSStatus s = [self _sendBytes:bytes length:msg->length timeStamp:events[i].hostTime];
+                if (s != noErr) {
+                    warn("Error sending a scheduled message (OSStatus %i)", (int)s);
+                }
+            }
         }
+        MFMIDISchedulerReleaseEvents(events, count);
     }
+    MFMIDIBatchFlush(&batch);
     
-    /////////////////////////////////////////
-    // SOURCES
-    /////////////////////////////////////////
+    uint64_t next = MFMIDISchedulerNextEventTime(_scheduler);
+    if (next != kMFMIDISchedulerNoEvent) {
+        [self _armSchedulerTimerForEventTime:next];
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)_setCoalescingPolicy:(MFMIDICoalescingPolicy)policy forIndex:(int)idx
+{
+    _coalescingPolicies[idx] = policy;
     
-    echo(@"...%i source(s) found", (int)sourceCnt);
-    for (NSUInteger index = 0; index < sourceCnt; ++index)
-    {
-        MIDIEndpointRef endpoint = MIDIGetSource(index);
-        NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
-        
-        // Skip virtuals
-        if ([self _endpointIsForVirtualConnection:endpoint]) {
-            [destEndpointsToRemove removeObject:endpointObj]; //see notes below
-            echo("...Endpoint %@ is Virtual, skipping", endpointObj);
-            continue;
-        }
+    if (policy.interval > 0 && _coalescers[idx]) {
+        atomic_fetch_or(&_coalescedClasses, _kCoalescerTargetClass[idx]);
+    } else {
+        // Off. Don't strand anything that was waiting
+        atomic_fetch_and(&_coalescedClasses, ~(uint32_t)_kCoalescerTargetClass[idx]);
+        [self _flushCoalescerForIndex:idx withBudget:NO];
+    }
+}
 
-        // Already exists? Remove from remove list :) Effectively a no-op on that endpoint
-        // Otherwise connect it
-        if ([_sourceEndpoints containsObject:endpointObj]) {
-            echo("...Source Endpoint %@ already in our list", endpointObj);
-            [srcEndpointsToRemove removeObject:endpointObj];
-        } else {
-            [self _connectSourceEndpoint:endpoint];
-        }
+//---------------------------------------------------------------------
+
+/** Fires the timed flushes on _schedulerQueue. Resumed but unarmed until the first add */
+- (dispatch_source_t)_createCoalescerTimerForIndex:(int)idx
+{
+    dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _schedulerQueue);
+    @weakify(self);
+    dispatch_source_set_event_handler(timer, ^{
+        @strongify(self);
+        [self _flushCoalescerForIndex:idx withBudget:YES];
+    });
+    dispatch_resume(timer);
+    return timer;
+}
+
+//---------------------------------------------------------------------
+
+/** Flush on _schedulerQueue no sooner than `interval` after the last one. Straight away if it's been quiet (so an isolated change isn't delayed). Any thread. Only re-arms the preallocated timer so nothing is allocated per send */
+- (void)_scheduleCoalescerFlushForIndex:(int)idx
+{
+    const NSTimeInterval interval = _coalescingPolicies[idx].interval;
+    const uint64_t earliest = atomic_load_explicit(&_coalescerLastFlushTime[idx], memory_order_relaxed) + _MFHostTicksFromSeconds(interval);
+    const uint64_t now = mach_absolute_time();
+    const int64_t delayNanos = earliest > now ? (int64_t)_MFNanosFromHostTicks(earliest - now) : 0;
+    
+    dispatch_source_set_timer(_coalescerTimers[idx],
+                              dispatch_time(DISPATCH_TIME_NOW, delayNanos),
+                              DISPATCH_TIME_FOREVER,
+                              (uint64_t)(interval * 0.1 * NSEC_PER_SEC));
+}
+
+//---------------------------------------------------------------------
+
+typedef struct {
+    void *session;          // unretained MFMIDISession
+    uint32_t targetClass;
+} _MFCoalescerFlushContext;
+
+/** Can't throw. Runs on the scheduler queue (nothing to throw to) and ahead of a sender's own messages (which should still go) */
+static void _MFMIDISessionCoalescerBatchFlush(MFMIDIBatch *batch, MIDIPacketList *packetList, void *context)
+{
+    _MFCoalescerFlushContext *ctx = context;
+    MFMIDISession *session = (__bridge MFMIDISession *)ctx->session;
+    OSStatus s = _MFMIDISessionSendToClasses(session, packetList, ctx->targetClass);
+    if (s != noErr) {
+        warn("Error sending coalesced messages (OSStatus %i)", (int)s);
+    }
+}
+
+/** The timed flushes honour the policy's byte budget and reschedule for any leftovers. Others send everything */
+- (void)_flushCoalescerForIndex:(int)idx withBudget:(BOOL)withBudget
+{
+    if (!_coalescers[idx]) return;
+    
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    _MFCoalescerFlushContext ctx = { (__bridge void *)self, _kCoalescerTargetClass[idx] };
+    MFMIDIBatch batch;
+    MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _MFMIDISessionCoalescerBatchFlush, &ctx);
+    
+    // Clear before the coalescer clears its own flag so an add racing in sets it again. See MFMIDICoalescerAdd
+    atomic_fetch_and(&_coalescerPendingClasses, ~(uint32_t)_kCoalescerTargetClass[idx]);
+    const size_t maxBytes = withBudget ? _coalescingPolicies[idx].maxBytesPerInterval : 0;
+    const BOOL leftovers = MFMIDICoalescerFlush(_coalescers[idx], &batch, maxBytes);
+    if (leftovers) {
+        atomic_fetch_or(&_coalescerPendingClasses, _kCoalescerTargetClass[idx]);
+    }
+    MFMIDIBatchFlush(&batch);
+    
+    if (withBudget) {
+        atomic_store_explicit(&_coalescerLastFlushTime[idx], mach_absolute_time(), memory_order_relaxed);
+        if (leftovers) [self _scheduleCoalescerFlushForIndex:idx];
     }
+}
+
+/** Sender's thread. As the above without a budget, but if a flush is already underway on the scheduler queue it's left to it */
+- (void)_tryFlushCoalescerForIndex:(int)idx
+{
+    if (!_coalescers[idx]) return;
     
-    // Remove the missing ones
-    // NOTE: We do this last b/c Virtual "Sources" show up as MIDIDestinations and vice versa so we need to process both before we have an accurate list to remove
-    for (NSNumber *endpointNum in destEndpointsToRemove) {
-        [self _disconnectDestinationEndpoint:(MIDIEndpointRef)endpointNum.unsignedIntegerValue];
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    _MFCoalescerFlushContext ctx = { (__bridge void *)self, _kCoalescerTargetClass[idx] };
+    MFMIDIBatch batch;
+    MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _MFMIDISessionCoalescerBatchFlush, &ctx);
+    
+    // As the above. Put the flag back if we didn't get the lock as that flush may not take everything
+    atomic_fetch_and(&_coalescerPendingClasses, ~(uint32_t)_kCoalescerTargetClass[idx]);
+    if (MFMIDICoalescerTryFlush(_coalescers[idx], &batch)) {
+        MFMIDIBatchFlush(&batch);
+    } else {
+        atomic_fetch_or(&_coalescerPendingClasses, _kCoalescerTargetClass[idx]);
     }
+}
 
-    for (NSNumber *endpointNum in srcEndpointsToRemove) {
-        [self _disconnectSourceEndpoint:(MIDIEndpointRef)endpointNum.unsignedIntegerValue];
+//---------------------------------------------------------------------
+
+- (void)_setRunningStatusEnabled:(BOOL)enabled forClass:(_MFSendTargetClass)targetClass
+{
+    if (enabled) {
+        atomic_fetch_or(&_runningStatusClasses, targetClass);
+    } else {
+        atomic_fetch_and(&_runningStatusClasses, ~(uint32_t)targetClass);
     }
 }
 
 //---------------------------------------------------------------------
 
-- (NSArray *)_addNetworkConnectionWithName:(NSString *)name address:(NSString *)address port:(NSUInteger)port
+/** For one-off large messages which won't fit a stack batch. Goes in consecutive chunks from a fixed buffer. Doesn't throw so the scheduler and playback can carry on past a failure. @return The error that stopped it */
+- (OSStatus)_sendBytes:(const UInt8 *)bytes length:(NSUInteger)length timeStamp:(MIDITimeStamp)timeStamp
 {
-    MIDINetworkHost *host = [MIDINetworkHost hostWithName:name address:address port:port];
-    return [self _addNetworkConnectionWithHost:host];
+    // As sendMIDIPacketList:
+    _MFMIDISessionFlushPendingCoalesced(self);
+    
+    // The transforms take or leave a chunked sysex whole. Nothing more goes after an error
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    MIDIPacketList *packetList = (MIDIPacketList *)buffer;
+    size_t offset = 0;
+    OSStatus res = noErr;
+    while (res == noErr && MFMIDIPacketListFillChunk(packetList, sizeof(buffer), timeStamp, bytes, length, &offset)) {
+        res = _MFMIDISessionSendChunkToClasses(self, packetList, _kMFSendTargetClassAll, bytes[0]);
+    }
+    return res;
 }
 
 //---------------------------------------------------------------------
 
-/** @private See notes about NSNetService above. */
-- (NSArray *)_addNetworkConnectionWithHost:(MIDINetworkHost *)host
+/** The transfer's send function. Finds the destination in the current routes so one that's been removed or disabled just fails */
+static OSStatus _MFMIDISessionSysexSend(void *context, uint32_t destinationIndex, const MIDIPacketList *packetList)
 {
-    echo("Adding Network Source/Destination pair for host %@", host);
-    
-    // Get the endpoints for the MIDISession
-    MIDIEndpointRef srcEndpoint = [_midiNetSession sourceEndpoint];
-    MIDIEndpointRef destEndpoint = [_midiNetSession destinationEndpoint];
-    
-    // Look for a matching connection in our list
-    // We can search either list
-    _MFMIDINetworkDestination *dest = [[_MFMIDINetworkDestination alloc] initWithEndpoint:destEndpoint client:self host:host];
-    _MFMIDINetworkSource *src = [[_MFMIDINetworkSource alloc] initWithEndpoint:srcEndpoint client:self host:host];
+    _MFSysexTransferState *state = (__bridge _MFSysexTransferState *)context;
+    const _MFSendTarget *wanted = &((const _MFSendTarget *)state->_targets.bytes)[destinationIndex];
+    MFMIDISession *session = state->_session;
     
-    NSInteger idx = [_networkDestinations indexOfObject:dest]; // uses isEqual:
-    if (idx != NSNotFound) {
-        return @[_networkSources[idx], _networkDestinations[idx]];
+    for (uint32_t i=0; i<state->_routes->count; ++i)
+    {
+        const _MFSendTarget *target = &state->_routes->targets[i];
+        if (target->kind != wanted->kind || target->endpoint != wanted->endpoint || target->audiobusPort != wanted->audiobusPort) continue;
+        
+        // Chunks after the first are mid-sysex so the transforms can't rewrite them. They can only let it through or not
+        const MFMIDITransform *transforms[2] = { state->_routes->transform, target->transform };
+        for (int t=0; t<2; ++t) {
+            if (transforms[t] && MFMIDITransformDropsStatus(transforms[t], 0xF0)) return noErr;
+        }
+        
+        uint32_t messageCount, byteCount;
+        _MFTrafficStatsCountPacketList(packetList, &messageCount, &byteCount);
+        return _MFSendPacketListToTarget(target, session->_backend, packetList, messageCount, byteCount, session->_coreMIDISendEnabled);
+    }
+    return kMIDINoConnection;
+}
+
+/** SCHEDULER QUEUE ONLY. Send what's due then come back when more is */
+- (void)_stepSysexTransfer:(_MFSysexTransferState *)state
+{
+    if (![_sysexTransfers containsObject:state]) return;    // cancelled
+    
+    uint32_t token;
+    state->_session = self;
+    state->_routes = _MFSendRouterBeginRead(_sendRouter, &token);
+    const uint64_t now = _MFNanosFromHostTicks(mach_absolute_time());
+    const uint64_t next = MFMIDISysexTransferStep(state->_transfer, now);
+    _MFSendRouterEndRead(_sendRouter, token);
+    state->_routes = NULL;
+    
+    if (next == kMFMIDISysexTransferFinished) {
+        [self _finishSysexTransfer:state];
+        return;
     }
     
-    // Add to the list and enable if auto
-    echo("...adding NetworkSource & NetworkDestination to our list.");
-    _networkSources = [_networkSources arrayByAddingObject:src];
-    _networkDestinations = [_networkDestinations arrayByAddingObject:dest];
-    
-    // Handle autoEnable. FYI they ARENT necessarily in the MIDI session if they appear here.
-    // Do both even though they are coupled for futureproofing
-    // The enabled flag is a smart setter and handles MIDISession stuff
-    // Handle auto-enabled / restore
-    [self _setEnabledStateForConnectionBasedOnSettings:src];
-    [self _setEnabledStateForConnectionBasedOnSettings:dest];
+    if (state->_progress) {
+        size_t sent, total;
+        MFMIDISysexTransferGetProgress(state->_transfer, &sent, &total);
+        void (^progress)(NSUInteger, NSUInteger) = state->_progress;
+        dispatch_async(dispatch_get_main_queue(), ^{ progress(sent, total); });
+    }
     
+    @weakify(self);
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(next > now ? next - now : 0)), _schedulerQueue, ^{
+        @strongify(self);
+        [self _stepSysexTransfer:state];
+    });
+}
+
+/** SCHEDULER QUEUE ONLY. Final progress and the completion */
+- (void)_finishSysexTransfer:(_MFSysexTransferState *)state
+{
+    [_sysexTransfers removeObject:state];
     
-    // And the delegates
-    // NOTE: Why is delegate separate from connect here but for EndpointConnections? B/c for net conns we use the connection/disconnection for enabled/disabled where with Endpoint-based conns, they are always connected (we have no choice i dont think) and we use our enabled flag to determine whether to send. In the end its all b/c there is only 1 Endpoint for ALL network connections. Booooo.
-   [self _notifyDelegatesAboutConnection:src didConnect:YES];
-   [self _notifyDelegatesAboutConnection:dest didConnect:YES];
+    size_t sent, total;
+    MFMIDISysexTransferGetProgress(state->_transfer, &sent, &total);
+    const OSStatus status = MFMIDISysexTransferGetStatus(state->_transfer);
+    if (status != noErr && status != kMFMIDISysexTransferCancelledErr) {
+        warn("Sysex transfer failed for at least one destination (OSStatus %i)", (int)status);
+    }
     
-    return @[src, dest];
+    void (^progress)(NSUInteger, NSUInteger) = state->_progress;
+    void (^completion)(OSStatus) = state->_completion;
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (progress) progress(sent, total);
+        if (completion) completion(status);
+    });
 }
 
 //---------------------------------------------------------------------
 
-/** Recreates the connections and enables/disables them according to their persisted state */
-- (void)_restoreManualNetworkConnections
+/** SCHEDULER QUEUE ONLY. Drains the render queues every `renderQueueDrainInterval` from now till they've been idle a while. Made on first use */
+- (void)_resumeRenderQueueTimer
 {
-    echo("Restoring persisted Manual Network Connections: ");
-    NSDictionary *manualConns = [_userDefs objectForKey:_kUserDefsKeyManualConnections];
-    for (NSString *name in manualConns)
-    {
-        NSDictionary *connDetails = manualConns[name];
-        echo("Recreating Manual Network Connection '%@': %@", name, connDetails);
-        
-        NSArray *conns = [self _addNetworkConnectionWithName:name address:connDetails[@"address"] port:[connDetails[@"port"] integerValue]];
-        [conns[0] setIsManualConnection:YES];
-        [conns[1] setIsManualConnection:YES];
-        // It'll be enabled/disabled automatically via the Enabled State Persistence
+    _renderQueueIdleDrains = 0;
+    if (_renderQueueTimer && !_renderQueueTimerSuspended) return;
+    
+    if (!_renderQueueTimer) {
+        _renderQueueTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _schedulerQueue);
+        @weakify(self);
+        dispatch_source_set_event_handler(_renderQueueTimer, ^{
+            @strongify(self);
+            [self _drainRenderQueues];
+        });
     }
+    dispatch_source_set_timer(_renderQueueTimer, DISPATCH_TIME_NOW, (uint64_t)(_renderQueueDrainInterval * NSEC_PER_SEC), (uint64_t)(_renderQueueDrainInterval * 0.1 * NSEC_PER_SEC));
+    dispatch_resume(_renderQueueTimer);
+    _renderQueueTimerSuspended = NO;
 }
 
 //---------------------------------------------------------------------
 
-///** Nil if not currently in our list */
-//- (_MFMIDIEndpointDestination *)_existingDestinationWithEndpoint:(MIDIEntityRef)endpoint
-//{
-//    NSArray *matching = [_destinations filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"endpoint = %u", endpoint]];
-//    if (!matching || matching.count == 0) return nil;
-//    return matching[0];
-//}
+/** SCHEDULER QUEUE ONLY. Till the next enqueue or new queue */
+- (void)_suspendRenderQueueTimer
+{
+    if (!_renderQueueTimer || _renderQueueTimerSuspended) return;
+    dispatch_suspend(_renderQueueTimer);
+    _renderQueueTimerSuspended = YES;
+}
 
 //---------------------------------------------------------------------
 
-/** Internally add reference for a newly discovered/created endpoint. Notify delegates 
-    @return The created connection object or nil if it was a network endpoint
- */
-- (_MFMIDIEndpointDestination *)_connectDestinationEndpoint:(MIDIEndpointRef)endpoint
+/** Resumes the drain timer on _schedulerQueue when a render thread enqueues onto a sleeping queue */
+- (dispatch_source_t)_createRenderQueueWakeSource
 {
-    NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
-    
-    // Uniqueness is handled by the NSMutableArray
-    [_destinationEndpoints addObject:endpointObj];
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_OR, 0, 0, _schedulerQueue);
+    @weakify(self);
+    dispatch_source_set_event_handler(source, ^{
+        @strongify(self);
+        [self _resumeRenderQueueTimer];
+    });
+    dispatch_resume(source);
+    return source;
+}
+
+/** Render thread. Merging only sets the source's data and signals its queue: no locks or allocation */
+static void _MFMIDISessionRenderQueueWake(void *context)
+{
+    dispatch_source_merge_data((__bridge dispatch_source_t)context, 1);
+}
+
+//---------------------------------------------------------------------
+
+/** Render queue sends. There's no one to throw to so errors are logged */
+static void _MFMIDISessionRenderQueueBatchFlush(MFMIDIBatch *batch, MIDIPacketList *packetList, void *context)
+{
+    MFMIDISession *session = (__bridge MFMIDISession *)context;
+    OSStatus s = _MFMIDISessionSendToClasses(session, packetList, _kMFSendTargetClassAll);
+    if (s != noErr) {
+        warn("Error sending from a render queue (OSStatus %i)", (int)s);
+    }
+}
+
+/** SCHEDULER QUEUE ONLY. Each queue's messages go in lists of their own so every list is in time order. @return Enqueues drained */
+static size_t _MFMIDISessionDrainRenderQueues(MFMIDISession *session, NSArray *renderQueues)
+{
+    Byte buffer[kMFMIDIBatchDefaultBufferSize] __attribute__((aligned(8)));
+    MFMIDIBatch batch;
+    MFMIDIBatchInit(&batch, buffer, sizeof(buffer), _MFMIDISessionRenderQueueBatchFlush, (__bridge void *)session);
+    
+    size_t count = 0;
+    for (NSValue *val in renderQueues) {
+        const size_t drained = MFMIDIRenderQueueDrain(val.pointerValue, &batch);
+        if (drained) {
+            MFMIDIBatchFlush(&batch);
+            count += drained;
+        }
+    }
+    return count;
+}
+
+/** SCHEDULER QUEUE ONLY. The timer's handler. Stops polling once the queues have been empty for `_RENDER_QUEUE_IDLE_BEFORE_SLEEP`, or straight away if there are none */
+- (void)_drainRenderQueues
+{
+    if (_MFMIDISessionDrainRenderQueues(self, _renderQueues)) {
+        _renderQueueIdleDrains = 0;
+        return;
+    }
+    if (_renderQueues.count && ++_renderQueueIdleDrains * _renderQueueDrainInterval < _RENDER_QUEUE_IDLE_BEFORE_SLEEP) return;
     
-    if (_MFIsNetworkSessionEndpoint(endpoint))
-    {
-        echo("Added Destination Endpoint %@ (is a Network Endpoint - NOT creating MIDIDestination)", endpointObj);
-        // Dont create our objects for Network endpoints as we treat the individual Network Hosts as "Connections" which requires some re-interpreting of how CoreMIDI works.  CoreMIDI has ALL network connections go through a single endpoint which is a bit weary IMO
-        return nil;
+    // The next enqueue on any of them wakes us. One more drain for what got in before they were armed
+    for (NSValue *val in _renderQueues) {
+        MFMIDIRenderQueueSleep(val.pointerValue);
     }
-    else
-    {
-        _MFMIDIEndpointDestination *dest = [[_MFMIDIEndpointDestination alloc] initWithEndpoint:endpoint client:self];
-        _endpointDestinations = (id)[_endpointDestinations arrayByAddingObject:dest];
-        
-        [self _setEnabledStateForConnectionBasedOnSettings:dest];
-        
-        echo(@"Added Destination Endpoint called \"%@\" (enabled=%@)", endpointObj, dest.name, dest.enabled?@"YES":@"NO");
-        
-        // Notify delegates
-        [self _notifyDelegatesAboutConnection:dest didConnect:YES];
-        
-        return dest;
+    if (_MFMIDISessionDrainRenderQueues(self, _renderQueues)) {
+        // Keep polling. The queues stay armed but an early wake is harmless
+        _renderQueueIdleDrains = 0;
+        return;
     }
+    [self _suspendRenderQueueTimer];
 }
 
 //---------------------------------------------------------------------
 
-/** Internally add reference for a newly discovered/created endpoint. Notify delegates
- @return The created connection object or nil if it was a network endpoint
- */
-- (_MFMIDIEndpointSource *)_connectSourceEndpoint:(MIDIEndpointRef)endpoint
+typedef struct {
+    MFMIDIBatch *batch;
+    uint64_t startTime;
+    void *session;          // unretained MFMIDISession
+} _MFPlaybackContext;
+
+/** Into the batch, or if it won't fit one, flushed after what's ahead of it and sent on its own so nothing is silently lost */
+static void _MFPlaybackAddBytes(_MFPlaybackContext *ctx, MIDITimeStamp timeStamp, const UInt8 *bytes, uint32_t length)
 {
-    NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
+    if (MFMIDIBatchAddBytes(ctx->batch, timeStamp, bytes, length)) return;
+    
+    MFMIDIBatchFlush(ctx->batch);
+    MFMIDISession *session = (__bridge MFMIDISession *)ctx->session;
+    OSStatus s = [session _sendBytes:bytes length:length timeStamp:timeStamp];
+    if (s != noErr) {
+        warn("Error sending a MIDI file event too big for a batch (OSStatus %i)", (int)s);
+    }
+}
+
+/** Into the batch at its host time. Sysex and escapes go in chunks so any length fits */
+static void _MFPlaybackAddEvent(const MFMIDIFileEvent *event, void *context)
+{
+    _MFPlaybackContext *ctx = context;
+    const MIDITimeStamp timeStamp = ctx->startTime + _MFHostTicksFromSeconds((NSTimeInterval)event->time / NSEC_PER_SEC);
+    const UInt8 *bytes = MFMIDIMessageValueGetBytes(&event->message);
     
-    // Uniqueness is handled by the NSMutableArray
-    [_sourceEndpoints addObject:endpointObj];
+    if (event->kind == kMFMIDIFileEventMessage) {
+        _MFPlaybackAddBytes(ctx, timeStamp, bytes, event->message.length);
+        return;
+    }
     
-    if (_MFIsNetworkSessionEndpoint(endpoint))
-    {
-        echo("Added Source Endpoint %@ (is a Network Endpoint - NOT creating MIDISource)", endpointObj);
-        return nil;
+    if (event->kind == kMFMIDIFileEventSysex) {
+        const UInt8 sysexStart = 0xF0;
+        _MFPlaybackAddBytes(ctx, timeStamp, &sysexStart, 1);
     }
-    else
-    {
-        _MFMIDIEndpointSource *src = [[_MFMIDIEndpointSource alloc] initWithEndpoint:endpoint client:self];
-        _endpointSources = (id)[_endpointSources arrayByAddingObject:src];
-        
-        [self _setEnabledStateForConnectionBasedOnSettings:src];
-        
-        echo(@"Added Source Endpoint %@ called \"%@\" (enabled=%@)", endpointObj, src.name, src.enabled?@"YES":@"NO");
-        
-        [self _notifyDelegatesAboutConnection:src didConnect:YES];
-        return src;
+    for (uint32_t offset = 0; offset < event->message.length; offset += kMFMIDISysexDefaultChunkSize) {
+        _MFPlaybackAddBytes(ctx, timeStamp, bytes + offset, MIN(kMFMIDISysexDefaultChunkSize, event->message.length - offset));
     }
 }
 
-//---------------------------------------------------------------------
-
-/** Internally remove the references for an endpoint that has been removed by CoreMIDI. Notify delegates */
-- (void)_disconnectDestinationEndpoint:(MIDIEndpointRef)endpoint;
+/** SCHEDULER QUEUE ONLY. Like the scheduler, send what's due within the lookahead timestamped so CoreMIDI takes care of the timing, then come back a lookahead before the next */
+- (void)_stepPlayback:(_MFFilePlaybackState *)state
 {
-    NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
+    if (_playback != state) return;     // stopped or replaced
     
-    [_destinationEndpoints removeObject:endpointObj];
-    echo("Disconnected Endpoint %@", endpointObj);
+    const uint64_t now = mach_absolute_time();
+    const uint64_t elapsed = now > state->_startTime ? _MFNanosFromHostTicks(now - state->_startTime) : 0;
+    const uint64_t lookahead = (uint64_t)(_scheduleLookahead * NSEC_PER_SEC);
+    __block uint64_t next = kMFMIDIFilePlayerFinished;
     
-    // ~~There could be a several MIDIDestination objects with the same endpoint, particularly Network ones~~ No longer true I dont think b/c we track them in separate ivars now. But just in case we'll leave this...
-    NSPredicate *pred = [NSPredicate predicateWithFormat:@"endpoint == %u", (unsigned)endpoint];
-    NSArray *destObjects = [_endpointDestinations filteredArrayUsingPredicate:pred];
-    for (id<MFMIDIDestination>dest in destObjects)
+    @try
     {
-        NSMutableArray *dests = _endpointDestinations.mutableCopy;
-        [dests removeObject:dest];
-        _endpointDestinations = (id)[NSArray arrayWithArray:dests];
-        echo("...and related MIDIDestination %@", dest.name);
-        
-        // Notify delegates
-        [self _notifyDelegatesAboutConnection:dest didConnect:NO];
+        [self sendBatch:^(MFMIDIBatch *batch) {
+            _MFPlaybackContext ctx = { batch, state->_startTime, (__bridge void *)self };
+            next = MFMIDIFilePlayerRender(state->_player, elapsed + lookahead, _MFPlaybackAddEvent, &ctx);
+        }];
+    }
+    @catch (MFNonFatalException *e)
+    {
+        warn("Error sending MIDI file events: %@ (OSStatus %@)", e.reason, e.osStatusAsString);
+    }
+    
+    if (next == kMFMIDIFilePlayerFinished) {
+        [self _finishPlayback:state completed:YES];
+        return;
     }
+    
+    const uint64_t wake = next > lookahead ? next - lookahead : 0;
+    @weakify(self);
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(wake > elapsed ? wake - elapsed : 0)), _schedulerQueue, ^{
+        @strongify(self);
+        [self _stepPlayback:state];
+    });
 }
 
-//---------------------------------------------------------------------
-
-- (void)_disconnectSourceEndpoint:(MIDIEndpointRef)endpoint;
+/** SCHEDULER QUEUE ONLY. Anything already handed to CoreMIDI still plays */
+- (void)_finishPlayback:(_MFFilePlaybackState *)state completed:(BOOL)completed
 {
-    NSObject *endpointObj = _EP2Obj(endpoint); // normalise 32bit and 64bit heterogony
-    
-    [_sourceEndpoints removeObject:endpointObj];
-    echo("Disconnected Endpoint %@", endpointObj);
-    
-    // ~~There could be a several MIDISource objects with the same endpoint, particularly Network ones~~ No longer true I dont think b/c we track them in separate ivars now. But just in case we'll leave this...
-#if __LP64__
-    NSPredicate *pred = [NSPredicate predicateWithFormat:@"endpoint == %lu", endpoint];
-#else
-    NSPredicate *pred = [NSPredicate predicateWithFormat:@"endpoint == %p", endpoint];
-#endif 
+    if (_playback == state) _playback = nil;
     
-    NSArray *srcObjects = [_endpointSources filteredArrayUsingPredicate:pred];
-    for (id<MFMIDISource>src in srcObjects)
-    {
-        NSMutableArray *srcs = _endpointSources.mutableCopy;
-        [srcs removeObject:src];
-        _endpointSources = (id)[NSArray arrayWithArray:srcs];
-        echo("...and related MIDISource %@", src.name);
-        
-        // Notify delegates
-        [self _notifyDelegatesAboutConnection:src didConnect:NO];
+    void (^completion)(BOOL) = state->_completion;
+    if (completion) {
+        dispatch_async(dispatch_get_main_queue(), ^{ completion(completed); });
     }
 }
 
+//---------------------------------------------------------------------
+
+/** Display name via the backend. "<Unknown>" if it doesn't know the object */
+- (NSString *)_displayNameForEndpoint:(MIDIEndpointRef)endpoint
+{
+    char buffer[256];
+    if (!_MFEndpointInfoCacheGetDisplayName(_endpointInfo, endpoint, buffer, sizeof(buffer))) return @"<Unknown>";
+    return [NSString stringWithUTF8String:buffer] ?: @"<Unknown>";
+}
 
 //---------------------------------------------------------------------
 
-/** Shorthand. Checks conformity to determin if it's a source or destination. BOOL specifies whether it's connect or disconnect */
-- (void)_notifyDelegatesAboutConnection:(id<MFMIDIConnection>)conx didConnect:(BOOL)isConnect
+/** Republish the flat send target snapshot. Call whenever destinations are added, removed, enabled or disabled. Blocks briefly if a send is mid-flight on another thread */
+- (void)_rebuildSendRoutes
 {
-    echo("...DELEGATES: Connection %@ did %@CONNECT", conx, isConnect?@"":@"DIS");
+    // Most efficient is to send to the endpoints of the enabled non-network destinations, then *1* send to the network endpoint as they all share it and MIDINetworkSession fans out to the hosts itself
+    NSArray *endpointDestinations = self.endpointDestinations, *networkDestinations = self.networkDestinations;
+    NSUInteger capacity = endpointDestinations.count + 1 + _audiobusDestinations.count;
+    _MFSendRoutes *routes = _MFSendRoutesCreate((uint32_t)capacity);
+    if (!routes) {
+        warn("Failed to allocate send routes. Keeping the previous ones");
+        return;
+    }
     
-    BOOL isSource = [conx conformsToProtocol:@protocol(MFMIDISource)];
+    // Traffic stats key -> index in the targets, for the thru routes
+    NSMutableDictionary *targetIndexes = [NSMutableDictionary dictionary];
     
-    // Notify delegates
-    if (isSource && isConnect)
+    for (_MFCoreMIDIConnection *conx in endpointDestinations)
     {
-        for (id<MFMIDISessionDelegate>delegate in _delegates) {
-            if ([delegate respondsToSelector:@selector(MIDISession:didAddSource:)]) {
-                [delegate MIDISession:self didAddSource:(id)conx];
-            }
+        if (!conx.enabled) continue;
+        
+        // MIDI Source acts the other way around
+        BOOL added;
+        if (conx.isVirtualConnection) {
+            added = _MFSendRoutesAdd(routes, _kMFSendTargetKindReceived, _kMFSendTargetClassLocal, conx.endpoint, 0, NULL, [self _trafficStatsForKey:conx.endpoint], [self _activeNotesForKey:conx.endpoint], [self _transformForKey:conx.endpoint].bytes);
+        } else {
+            added = _MFSendRoutesAdd(routes, _kMFSendTargetKindSend, _kMFSendTargetClassLocal, conx.endpoint, _outputPortRef, NULL, [self _trafficStatsForKey:conx.endpoint], [self _activeNotesForKey:conx.endpoint], [self _transformForKey:conx.endpoint].bytes);
         }
+        if (added) targetIndexes[@(conx.endpoint)] = @(routes->count - 1);
     }
-    else if (isSource && !isConnect)
-    {
-        for (id<MFMIDISessionDelegate>delegate in _delegates) {
-            if ([delegate respondsToSelector:@selector(MIDISession:didRemoveSource:)]) {
-                [delegate MIDISession:self didRemoveSource:(id)conx];
-            }
+    
+    if (networkDestinations.count > 0) {
+        MIDIEndpointRef endpoint = [(_MFCoreMIDIConnection *)networkDestinations[0] endpoint];
+        if (_MFSendRoutesAdd(routes, _kMFSendTargetKindSend, _kMFSendTargetClassNetwork, endpoint, _outputPortRef, NULL, [self _trafficStatsForKey:endpoint], [self _activeNotesForKey:endpoint], [self _transformForKey:endpoint].bytes)) {
+            targetIndexes[@(endpoint)] = @(routes->count - 1);
         }
     }
-    else if (!isSource && isConnect)
-    {
-        for (id<MFMIDISessionDelegate>delegate in _delegates) {
-            if ([delegate respondsToSelector:@selector(MIDISession:didAddDestination:)]) {
-                [delegate MIDISession:self didAddDestination:(id)conx];
-            }
+    
+    for (MFAudiobusDestination *abDest in _audiobusDestinations) {
+        const uint64_t key = [self _trafficStatsKeyForConnection:abDest];
+        if (_MFSendRoutesAdd(routes, _kMFSendTargetKindAudiobus, _kMFSendTargetClassLocal, 0, 0, (__bridge void *)abDest.abMIDISenderPort, [self _trafficStatsForKey:key], [self _activeNotesForKey:key], [self _transformForKey:key].bytes)) {
+            targetIndexes[@(key)] = @(routes->count - 1);
         }
     }
-    else if (!isSource && !isConnect)
-    {
-        for (id<MFMIDISessionDelegate>delegate in _delegates) {
-            if ([delegate respondsToSelector:@selector(MIDISession:didRemoveDestination:)]) {
-                [delegate MIDISession:self didRemoveDestination:(id)conx];
-            }
-        }
+    
+    NSData *sendTransform;
+    NSMutableDictionary *thruRoutes = [NSMutableDictionary dictionary];
+    @synchronized(_connectionTransforms) {
+        sendTransform = _sendTransform;
+        routes->recorder = _recorder;
+        [_thruRoutes enumerateKeysAndObjectsUsingBlock:^(NSNumber *sourceKey, NSDictionary *destinations, BOOL *stop) {
+            thruRoutes[sourceKey] = [destinations copy];
+        }];
     }
+    _MFSendRoutesSetTransform(routes, sendTransform.bytes);
+    
+    // Those with both ends here: sources with a receive ID (ie. enabled at some point) and enabled destinations
+    [thruRoutes enumerateKeysAndObjectsUsingBlock:^(NSNumber *sourceKey, NSDictionary *destinations, BOOL *stop) {
+        const uint32_t receiveID = [self _receiveIDForSourceKey:sourceKey.unsignedLongLongValue];
+        if (!receiveID) return;
+        [destinations enumerateKeysAndObjectsUsingBlock:^(NSNumber *destinationKey, id filter, BOOL *stopDestinations) {
+            NSNumber *targetIndex = targetIndexes[destinationKey];
+            if (!targetIndex) return;
+            const MFMIDITransform *filterBytes = [filter isKindOfClass:NSData.class] ? [(NSData *)filter bytes] : NULL;
+            if (!_MFSendRoutesAddThru(routes, receiveID, targetIndex.unsignedIntValue, filterBytes)) {
+                warn("Failed to allocate a thru route. It won't forward");
+            }
+        }];
+    }];
     
+    // So the read procs look for them once they're there and stop once they aren't
+    const bool thruActive = routes->thruSourceCount > 0;
+    if (!thruActive) atomic_store(&_thruActive, false);
+    _MFSendRouterPublish(_sendRouter, routes);
+    if (thruActive) atomic_store(&_thruActive, true);
 }
 
 //---------------------------------------------------------------------
 
-- (void)_notifyDelegatesConnectionRefreshDidBegin
+/** Endpoint refs for CoreMIDI connections, the sender port's address (tagged so it can't collide with a ref) for Audiobus. Network connections all share the session's endpoints and so their counters too. 0 if unknown */
+- (uint64_t)_trafficStatsKeyForConnection:(id<MFMIDIConnection>)conx
 {
-    // Tell delegates
-    for (id<MFMIDISessionDelegate> delegate in _delegates) {
-        if ([delegate respondsToSelector:@selector(MIDISessionDidBeginConnectionRefresh:)]) {
-            [delegate MIDISessionDidBeginConnectionRefresh:self];
-        }
+    if ([conx isKindOfClass:MFAudiobusDestination.class]) {
+        return (uint64_t)(uintptr_t)(__bridge void *)[(MFAudiobusDestination *)conx abMIDISenderPort] | (1ull << 63);
+    }
+    if ([conx isKindOfClass:_MFCoreMIDIConnection.class]) {
+        return [(_MFCoreMIDIConnection *)conx endpoint];
     }
+    return 0;
 }
 
 //---------------------------------------------------------------------
 
-- (void)_notifyDelegatesConnectionsRefreshDidEnd
+/** The user's MFMIDITransform for a connection, by its traffic stats key. nil for none */
+- (NSData *)_transformForKey:(uint64_t)key
 {
-    // Tell delegates
-    for (id<MFMIDISessionDelegate> delegate in _delegates) {
-        if ([delegate respondsToSelector:@selector(MIDISessionDidEndConnectionRefresh:)]) {
-            [delegate MIDISessionDidEndConnectionRefresh:self];
-        }
+    @synchronized(_connectionTransforms) {
+        return _connectionTransforms[@(key)];
     }
 }
 
 //---------------------------------------------------------------------
 
-- (BOOL)_endpointIsForVirtualConnection:(MIDIEndpointRef)endpoint
+/** Register with the receive queue, with the source's traffic stats and any transform set for it. Thru routes from it need its ID so are rebuilt */
+- (void)_registerReceiveSource:(id)source forID:(uint32_t)receiveID key:(uint64_t)key
 {
-    NSArray *virtConx = [self->_virtualSources arrayByAddingObjectsFromArray:self->_virtualDestinations];
-    for (_MFCoreMIDIConnection *conx in virtConx) {
-        if (conx.endpoint == endpoint) return YES;
+    [_receiveQueue registerSource:source forID:receiveID stats:[self _trafficStatsForKey:key]];
+    [_receiveQueue setTransform:[self _transformForKey:key].bytes forSourceID:receiveID];
+    
+    BOOL hasThru;
+    @synchronized(_connectionTransforms) {
+        hasThru = _thruRoutes[@(key)] != nil;
+    }
+    if (hasThru) [self _rebuildSendRoutes];
+}
+
+//---------------------------------------------------------------------
+
+/** The receive queue's ID for the source with traffic stats key `key`. 0 if it hasn't one (yet) */
+- (uint32_t)_receiveIDForSourceKey:(uint64_t)key
+{
+    if (key == _midiNetSession.sourceEndpoint) return _networkReceiveID;
+    id source = [_registry connectionInList:_kMFConnectionListEndpointSources withEndpoint:(MIDIEndpointRef)key];
+    return source ? [_receiveQueue sourceIDForSource:source] : 0;
+}
+
+//---------------------------------------------------------------------
+
+/** Created on first use. The pointer stays valid for the session's lifetime. NULL (and no stats) on allocation failure */
+- (_MFTrafficStats *)_trafficStatsForKey:(uint64_t)key
+{
+    _MFTrafficStats *stats = _MFTrafficStatsTableGet(_trafficStats, key);
+    if (!stats) warn("Failed to allocate traffic stats");
+    return stats;
+}
+
+//---------------------------------------------------------------------
+
+/** As for traffic stats. NULL (and no tracking) on allocation failure */
+- (_MFActiveNotes *)_activeNotesForKey:(uint64_t)key
+{
+    _MFActiveNotes *notes = _MFActiveNotesTableGet(_activeNotes, key);
+    if (!notes) warn("Failed to allocate active note tracking");
+    return notes;
+}
+
+//---------------------------------------------------------------------
+
+/** Note offs for what's sounding on the destinations using `notes`, or on every destination for NULL. The trackers are cleared even if the send fails. Send errors are logged rather than thrown as this runs on disconnects */
+- (void)_releaseActiveNotes:(_MFActiveNotes *)notes
+{
+    uint32_t token;
+    const _MFSendRoutes *routes = _MFSendRouterBeginRead(_sendRouter, &token);
+    for (uint32_t i=0; i<routes->count; ++i)
+    {
+        const _MFSendTarget *target = &routes->targets[i];
+        if (!target->activeNotes || (notes && target->activeNotes != notes)) continue;
+        
+        uint64_t bits[_kMFActiveNotesWordCount];
+        if (!_MFActiveNotesTake(target->activeNotes, bits)) continue;
+        
+        OSStatus s = _MFSendNoteOffsToTarget(target, _backend, _coreMIDISendEnabled, bits);
+        if (s != noErr) {
+            warn("Error releasing active notes (OSStatus %i)", (int)s);
+        }
+    }
+    _MFSendRouterEndRead(_sendRouter, token);
+    
+    // Not in the routes (eg. disabled) so there's nowhere to send. Just forget them
+    if (notes) {
+        uint64_t bits[_kMFActiveNotesWordCount];
+        _MFActiveNotesTake(notes, bits);
     }
-    return NO;
 }
 
 //---------------------------------------------------------------------
 
-/** YES if there exists a userdefs value for the conx */
+/** YES if there exists a persisted value for the conx */
 - (BOOL)_hasPreviouslyStoredEnabledStateForConnection:(_MFCoreMIDIConnection *)conx
 {
     NSString *idForConx = [self _storageIDForConnection:conx];
-    NSDictionary *lookup = [_userDefs objectForKey:_kUserDefsKeyEnabledStates];
-    return [lookup objectForKey:idForConx] != nil;
+    return _MFConnectionStateStoreGetEnabled(_stateStore, idForConx.UTF8String, NULL);
 }
 
 //---------------------------------------------------------------------
@@ -1492,15 +3484,19 @@ static void _MFMIDIReadProc(const MIDIPacketList *pktlist, void *readProcRefCon,
 /** Check the persistence for the value set for the connection */
 - (void)_setEnabledStateForConnectionBasedOnSettings:(_MFCoreMIDIConnection *)conx
 {
-    NSString *idForConx = [self _storageIDForConnection:conx];
+    const char *idForConx = [self _storageIDForConnection:conx].UTF8String;
 
     // Look up the stored value.  If non use the autoEnable flags defaulting to NO if none
-    NSDictionary *lookup = [_userDefs objectForKey:_kUserDefsKeyEnabledStates];
-    if (_restorePreviousConnectionStates && [lookup objectForKey:idForConx])
+    bool storedEnabled;
+    if (_restorePreviousConnectionStates && _MFConnectionStateStoreGetEnabled(_stateStore, idForConx, &storedEnabled))
     {
-        conx.enabled = [lookup[idForConx] boolValue];
+        conx.enabled = storedEnabled;
         echo("Restored Connection <%@> enabled state to %@", conx.name, conx.enabled?@"YES":@"NO");
         
+        // Seen again so it isn't aged out
+        if (_MFConnectionStateStoreTouch(_stateStore, idForConx, [self _stateStoreNow])) {
+            [self _scheduleStateSave];
+        }
     }
     else
     {
@@ -1521,13 +3517,38 @@ static void _MFMIDIReadProc(const MIDIPacketList *pktlist, void *readProcRefCon,
 {
     echo(@"Storing Connection <%@> enabled state: %@", conx.name, conx.enabled?@"YES":@"NO");
     NSString *idForConx = [self _storageIDForConnection:conx];
-    
-    // Look for the entry creating it if needed
-    NSMutableDictionary *lookup = [[_userDefs objectForKey:_kUserDefsKeyEnabledStates] mutableCopy];
-    if (!lookup) lookup = [NSMutableDictionary dictionary];
-    lookup[idForConx] = @(conx.enabled);
-    [_userDefs setObject:lookup forKey:_kUserDefsKeyEnabledStates];
-    [_userDefs synchronize];
+    if (_MFConnectionStateStoreSetEnabled(_stateStore, idForConx.UTF8String, conx.enabled, [self _stateStoreNow])) {
+        [self _scheduleStateSave];
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (int64_t)_stateStoreNow
+{
+    return (int64_t)[NSDate date].timeIntervalSince1970;
+}
+
+//---------------------------------------------------------------------
+
+/** Write-behind. Called when the store reports it's just become dirty; later changes ride along with this save */
+- (void)_scheduleStateSave
+{
+    @weakify(self);
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_STATE_SAVE_DELAY * NSEC_PER_SEC)), _stateSaveQueue, ^{
+        @strongify(self);
+        if (!self) return;  // dealloc saves
+        [self _saveStateStore];
+    });
+}
+
+//---------------------------------------------------------------------
+
+- (void)_saveStateStore
+{
+    if (!_MFConnectionStateStoreSave(_stateStore)) {
+        warn("Failed to save connection states. Will retry with the next change");
+    }
 }
 
 //---------------------------------------------------------------------
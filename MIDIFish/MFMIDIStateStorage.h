@@ -0,0 +1,76 @@
+//
+//  MFMIDIStateStorage.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIStateStorage_h
+#define MIDIFish_MFMIDIStateStorage_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ Where MFMIDISession persists connection enabled states (with when each was last seen), manual network hosts and the last good address of each Bonjour service it has resolved.
+
+ The session reads everything once when it's created and keeps it in memory. Changes are written back as a whole, a second or so after they happen, on a background queue, so a refresh which touches dozens of connections costs one write. `MFMIDIUserDefaultsStateStorage()` is the default. Supply your own to keep the state elsewhere or, being plain C, to exercise the session's persistence logic off Apple platforms.
+
+ All functions take the storage's `context` as their first argument. `save` is called on a background queue, never concurrently with itself.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MFMIDIConnectionStateRecord {
+    const char *storageID;          // UTF-8. Identifies the connection across launches, eg. "endpoint::destination::Synth"
+    bool enabled;
+    int64_t lastSeen;               // seconds since 1970. 0 if never recorded (eg. stored by an older version)
+} MFMIDIConnectionStateRecord;
+
+typedef struct MFMIDIManualHostRecord {
+    const char *name;               // UTF-8
+    const char *address;
+    uint16_t port;
+} MFMIDIManualHostRecord;
+
+/** A network service's address as last resolved, so the next launch can connect before Bonjour has answered */
+typedef struct MFMIDIResolvedHostRecord {
+    const char *name;               // UTF-8. The Bonjour service name
+    const char *address;
+    uint16_t port;
+    int64_t lastResolved;           // seconds since 1970
+} MFMIDIResolvedHostRecord;
+
+typedef void (*MFMIDIConnectionStateLoadProc)(const MFMIDIConnectionStateRecord *record, void *refCon);
+typedef void (*MFMIDIManualHostLoadProc)(const MFMIDIManualHostRecord *record, void *refCon);
+typedef void (*MFMIDIResolvedHostLoadProc)(const MFMIDIResolvedHostRecord *record, void *refCon);
+
+typedef struct MFMIDIStateStorage {
+    const char *name;
+    void *context;
+
+    /** Call back once per stored record. The records (and their strings) need only last for the call */
+    void (*load)(void *context, MFMIDIConnectionStateLoadProc stateProc, MFMIDIManualHostLoadProc hostProc, void *refCon);
+
+    /** Replace everything stored with these. @return false on failure, which is logged and retried with the next change */
+    bool (*save)(void *context, const MFMIDIConnectionStateRecord *states, size_t stateCount, const MFMIDIManualHostRecord *hosts, size_t hostCount);
+
+    /** Optional. Leave NULL and resolved addresses are only remembered until the session goes. Otherwise as `load` and `save`, and `saveResolvedHosts` is called straight after `save` @{ */
+    void (*loadResolvedHosts)(void *context, MFMIDIResolvedHostLoadProc proc, void *refCon);
+    bool (*saveResolvedHosts)(void *context, const MFMIDIResolvedHostRecord *hosts, size_t count);
+    /** @} */
+} MFMIDIStateStorage;
+
+
+#if defined(__APPLE__)
+/** Shared instance. The same NSUserDefaults keys MIDIFish has always used, plus ones for the last seen times and resolved hosts */
+extern const MFMIDIStateStorage *MFMIDIUserDefaultsStateStorage(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
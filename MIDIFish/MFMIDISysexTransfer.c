@@ -0,0 +1,203 @@
+//
+//  MFMIDISysexTransfer.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDISysexTransfer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    size_t offset;              // bytes sent so far
+    uint64_t dueNanos;          // when the next chunk may go
+    OSStatus status;
+    bool done;
+} _MFSysexDestination;
+
+struct MFMIDISysexTransfer {
+    const uint8_t *bytes;
+    size_t length;
+    uint32_t bytesPerSecond;
+    MFMIDISysexTransferSendFunction send;
+    void *context;
+
+    MIDIPacketList *chunkList;  // reused for every chunk
+    ByteCount chunkListSize;
+
+    bool started;
+    uint32_t destinationCount;
+    _MFSysexDestination destinations[];
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Chunking
+/////////////////////////////////////////////////////////////////////////
+
+bool MFMIDIPacketListFillChunk(MIDIPacketList *packetList, ByteCount listSize, MIDITimeStamp timestamp, const uint8_t *bytes, size_t length, size_t *offset)
+{
+    if (*offset >= length) return false;
+
+    MIDIPacket *packet = MIDIPacketListInit(packetList);
+    const uintptr_t listEnd = (uintptr_t)packetList + listSize;
+    if ((uintptr_t)packet->data >= listEnd) return false;
+
+    size_t chunk = length - *offset;
+    if (chunk > listEnd - (uintptr_t)packet->data) chunk = listEnd - (uintptr_t)packet->data;
+    if (chunk > UINT16_MAX) chunk = UINT16_MAX;
+
+    packet->timeStamp = timestamp;
+    packet->length = (UInt16)chunk;
+    memcpy(packet->data, &bytes[*offset], chunk);
+    packetList->numPackets = 1;
+
+    *offset += chunk;
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+MFMIDISysexTransferRef MFMIDISysexTransferCreate(const uint8_t *bytes, size_t length, uint32_t destinationCount, size_t chunkSize, uint32_t bytesPerSecond, MFMIDISysexTransferSendFunction send, void *context)
+{
+    MFMIDISysexTransferRef transfer = calloc(1, sizeof(struct MFMIDISysexTransfer) + destinationCount * sizeof(_MFSysexDestination));
+    if (!transfer) return NULL;
+
+    // Room for exactly one chunk in one packet
+    if (!chunkSize) chunkSize = kMFMIDISysexDefaultChunkSize;
+    if (chunkSize > UINT16_MAX) chunkSize = UINT16_MAX;
+    transfer->chunkListSize = (ByteCount)(offsetof(MIDIPacketList, packet) + offsetof(MIDIPacket, data) + chunkSize);
+    transfer->chunkList = malloc(transfer->chunkListSize);
+    if (!transfer->chunkList) {
+        free(transfer);
+        return NULL;
+    }
+
+    transfer->bytes = bytes;
+    transfer->length = length;
+    transfer->bytesPerSecond = bytesPerSecond;
+    transfer->send = send;
+    transfer->context = context;
+    transfer->destinationCount = destinationCount;
+    return transfer;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDISysexTransferDestroy(MFMIDISysexTransferRef transfer)
+{
+    if (!transfer) return;
+    free(transfer->chunkList);
+    free(transfer);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Sending
+/////////////////////////////////////////////////////////////////////////
+
+uint64_t MFMIDISysexTransferStep(MFMIDISysexTransferRef transfer, uint64_t nowNanos)
+{
+    if (!transfer->started) {
+        for (uint32_t i = 0; i < transfer->destinationCount; i++) transfer->destinations[i].dueNanos = nowNanos;
+        transfer->started = true;
+    }
+
+    uint64_t next = kMFMIDISysexTransferFinished;
+    for (uint32_t i = 0; i < transfer->destinationCount; i++)
+    {
+        _MFSysexDestination *dest = &transfer->destinations[i];
+
+        while (!dest->done && dest->dueNanos <= nowNanos)
+        {
+            const size_t start = dest->offset;
+            if (!MFMIDIPacketListFillChunk(transfer->chunkList, transfer->chunkListSize, 0, transfer->bytes, transfer->length, &dest->offset)) {
+                dest->done = true;
+                break;
+            }
+
+            OSStatus s = transfer->send(transfer->context, i, transfer->chunkList);
+            if (s != noErr) {
+                dest->offset = start;
+                dest->status = s;
+                dest->done = true;
+                break;
+            }
+            if (dest->offset >= transfer->length) dest->done = true;
+
+            // Unpaced goes back to back. Paced never bursts to catch up after a late step
+            if (transfer->bytesPerSecond) {
+                const uint64_t base = dest->dueNanos > nowNanos ? dest->dueNanos : nowNanos;
+                dest->dueNanos = base + (uint64_t)(dest->offset - start) * 1000000000ull / transfer->bytesPerSecond;
+            }
+        }
+
+        if (!dest->done && dest->dueNanos < next) next = dest->dueNanos;
+    }
+    return next;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDISysexTransferCancel(MFMIDISysexTransferRef transfer, OSStatus status)
+{
+    for (uint32_t i = 0; i < transfer->destinationCount; i++)
+    {
+        _MFSysexDestination *dest = &transfer->destinations[i];
+        if (dest->done) continue;
+        dest->status = status;
+        dest->done = true;
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Status
+/////////////////////////////////////////////////////////////////////////
+
+bool MFMIDISysexTransferIsFinished(MFMIDISysexTransferRef transfer)
+{
+    for (uint32_t i = 0; i < transfer->destinationCount; i++) {
+        if (!transfer->destinations[i].done) return false;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDISysexTransferGetProgress(MFMIDISysexTransferRef transfer, size_t *outBytesSent, size_t *outTotalBytes)
+{
+    size_t sent = 0;
+    for (uint32_t i = 0; i < transfer->destinationCount; i++) {
+        const _MFSysexDestination *dest = &transfer->destinations[i];
+        sent += dest->status != noErr ? transfer->length : dest->offset;
+    }
+    *outBytesSent = sent;
+    *outTotalBytes = transfer->length * transfer->destinationCount;
+}
+
+//---------------------------------------------------------------------
+
+OSStatus MFMIDISysexTransferGetStatus(MFMIDISysexTransferRef transfer)
+{
+    for (uint32_t i = 0; i < transfer->destinationCount; i++) {
+        if (transfer->destinations[i].status != noErr) return transfer->destinations[i].status;
+    }
+    return noErr;
+}
+
+//---------------------------------------------------------------------
+
+OSStatus MFMIDISysexTransferGetDestinationStatus(MFMIDISysexTransferRef transfer, uint32_t destinationIndex, size_t *outBytesSent)
+{
+    const _MFSysexDestination *dest = &transfer->destinations[destinationIndex];
+    if (outBytesSent) *outBytesSent = dest->offset;
+    return dest->status;
+}
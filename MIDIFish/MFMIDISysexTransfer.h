@@ -0,0 +1,83 @@
+//
+//  MFMIDISysexTransfer.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDISysexTransfer_h
+#define MIDIFish_MFMIDISysexTransfer_h
+
+#include "MFMIDITypes.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Streams a large sysex message (patch banks, firmware) to several destinations in bounded chunks, each destination paced at its own bytes/sec so a slow DIN device or WiFi link isn't flooded. One reusable chunk buffer, allocated at creation, so there's no size limit beyond memory and nothing big ever goes on the stack.
+
+ It's a passive state machine: call `MFMIDISysexTransferStep` with the current time and it sends whatever is due through your send function and tells you when to call again. `-[MFMIDISession sendSysex:bytesPerSecond:progress:completion:]` drives one from a timer. Not thread safe; step, query and destroy from one thread (or queue) at a time.
+
+ Anything else sent to a destination mid-transfer lands between chunks, and on a real MIDI wire a non-realtime status byte ends the sysex there. So hold off other traffic to the destinations until it completes.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default chunk size. Around 80ms of a DIN MIDI cable's bandwidth */
+#define kMFMIDISysexDefaultChunkSize 256
+
+/** Status of destinations a cancelled transfer hadn't finished. Same value as userCanceledErr */
+#define kMFMIDISysexTransferCancelledErr (-128)
+
+/** Returned by `MFMIDISysexTransferStep` when every destination is done (or failed) */
+#define kMFMIDISysexTransferFinished UINT64_MAX
+
+/** Send one chunk to destination `destinationIndex`. Anything but noErr fails that destination and it gets no more */
+typedef OSStatus (*MFMIDISysexTransferSendFunction)(void *context, uint32_t destinationIndex, const MIDIPacketList *packetList);
+
+typedef struct MFMIDISysexTransfer *MFMIDISysexTransferRef;
+
+
+/**
+ Fill `packetList` with a single packet holding the next bytes from `*offset`, as many as fit in `listSize` (and a MIDIPacket), and advance `*offset`. For sending any long message from a fixed buffer; each call's list is sent in turn.
+ @return false when there's nothing left (or `listSize` can't hold a single byte)
+ */
+extern bool MFMIDIPacketListFillChunk(MIDIPacketList *packetList, ByteCount listSize, MIDITimeStamp timestamp, const uint8_t *bytes, size_t length, size_t *offset);
+
+
+/**
+ @param bytes The whole message, F0 to F7. NOT copied; it must stay valid until the transfer is destroyed
+ @param chunkSize Bytes per packet list. 0 for kMFMIDISysexDefaultChunkSize
+ @param bytesPerSecond Pace per destination. 0 to send chunks back to back
+ @return NULL on allocation failure
+ */
+extern MFMIDISysexTransferRef MFMIDISysexTransferCreate(const uint8_t *bytes, size_t length, uint32_t destinationCount, size_t chunkSize, uint32_t bytesPerSecond, MFMIDISysexTransferSendFunction send, void *context);
+extern void MFMIDISysexTransferDestroy(MFMIDISysexTransferRef transfer);
+
+/**
+ Send every chunk that's due by `nowNanos` (any monotonic clock, as long as it's always the same one). The first step starts the clock for all destinations.
+ @return When to step next, on the same clock, or kMFMIDISysexTransferFinished
+ */
+extern uint64_t MFMIDISysexTransferStep(MFMIDISysexTransferRef transfer, uint64_t nowNanos);
+
+/** Stop sending. Unfinished destinations are marked with `status` (which must not be noErr) and the transfer is finished */
+extern void MFMIDISysexTransferCancel(MFMIDISysexTransferRef transfer, OSStatus status);
+
+extern bool MFMIDISysexTransferIsFinished(MFMIDISysexTransferRef transfer);
+
+/** Bytes sent summed over the destinations, out of length x destinations. Failed destinations count as complete so this reaches the total when the transfer finishes */
+extern void MFMIDISysexTransferGetProgress(MFMIDISysexTransferRef transfer, size_t *outBytesSent, size_t *outTotalBytes);
+
+/** The error of the first failed destination (by index), or noErr */
+extern OSStatus MFMIDISysexTransferGetStatus(MFMIDISysexTransferRef transfer);
+
+/** How far one destination has got and its error, if any */
+extern OSStatus MFMIDISysexTransferGetDestinationStatus(MFMIDISysexTransferRef transfer, uint32_t destinationIndex, size_t *outBytesSent);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+//
+//  MFMIDITrafficStatistics.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDITrafficStatistics_h
+#define MIDIFish_MFMIDITrafficStatistics_h
+
+#include <stdint.h>
+#include "MFMIDITypes.h"
+
+/**
+ Per-connection traffic counters and timing histograms, as snapshotted by `-[MFMIDISession trafficStatisticsForConnection:]` and `-[MFMIDISession trafficStatistics]`. Collection is always on: the send path does a few relaxed atomic adds and two clock reads per destination, nothing more.
+
+ Histograms use power-of-2 microsecond buckets: bucket 0 is < 1us, bucket i is [2^(i-1), 2^i) us and the last bucket catches everything above (~262ms+).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define kMFMIDIHistogramBucketCount     20
+#define kMFMIDISendErrorSlotCount       4
+
+typedef struct MFMIDIHistogram {
+    uint64_t counts[kMFMIDIHistogramBucketCount];
+} MFMIDIHistogram;
+
+typedef struct MFMIDISendErrorCount {
+    OSStatus status;                    // 0 = unused slot
+    uint64_t count;
+} MFMIDISendErrorCount;
+
+typedef struct MFMIDITrafficStatistics {
+    // Send
+    uint64_t sentMessageCount;
+    uint64_t sentByteCount;
+    uint64_t sendErrorCount;
+    MFMIDISendErrorCount sendErrors[kMFMIDISendErrorSlotCount];     // the first distinct OSStatuses seen. Later different ones only count in sendErrorCount
+    uint64_t droppedMessageCount;       // not sent because `coreMIDISendEnabled` was NO (ie Audiobus had taken over)
+    uint64_t droppedByteCount;
+    MFMIDIHistogram sendLatency;        // duration of each backend send call
+
+    // Receive
+    uint64_t receivedPacketCount;
+    uint64_t receivedByteCount;
+    MFMIDIHistogram receiveJitter;      // |change in (arrival - packet timestamp)| between consecutive timestamped packets. Untimestamped packets are skipped
+    uint64_t receiveJitterNanos;        // smoothed as per RFC 3550, J += (|D| - J) / 16
+} MFMIDITrafficStatistics;
+
+
+/** Upper bound of a histogram bucket in nanoseconds. UINT64_MAX for the last bucket */
+static inline uint64_t MFMIDIHistogramBucketUpperBoundNanos(unsigned bucket)
+{
+    if (bucket >= kMFMIDIHistogramBucketCount - 1) return UINT64_MAX;
+    return (1ull << bucket) * 1000;
+}
+
+//---------------------------------------------------------------------
+
+static inline uint64_t MFMIDIHistogramTotal(const MFMIDIHistogram *histogram)
+{
+    uint64_t total = 0;
+    for (unsigned i = 0; i < kMFMIDIHistogramBucketCount; i++) total += histogram->counts[i];
+    return total;
+}
+
+//---------------------------------------------------------------------
+
+/** Upper bound (ns) of the bucket containing the given percentile (0..1), eg 0.99 for p99. 0 if the histogram is empty */
+static inline uint64_t MFMIDIHistogramPercentileNanos(const MFMIDIHistogram *histogram, double percentile)
+{
+    const uint64_t total = MFMIDIHistogramTotal(histogram);
+    if (!total) return 0;
+
+    const double target = percentile * (double)total;
+    uint64_t running = 0;
+    for (unsigned i = 0; i < kMFMIDIHistogramBucketCount; i++) {
+        running += histogram->counts[i];
+        if ((double)running >= target) return MFMIDIHistogramBucketUpperBoundNanos(i);
+    }
+    return UINT64_MAX;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
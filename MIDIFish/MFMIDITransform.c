@@ -0,0 +1,278 @@
+//
+//  MFMIDITransform.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDITransform.h"
+#include "MFMIDIMessageValue.h"
+#include <string.h>
+#include <math.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Compiling
+/////////////////////////////////////////////////////////////////////////
+
+static uint32_t _MFTransformTypeOfStatus(uint8_t status)
+{
+    if (status < 0xF0) return 1u << ((status >> 4) - 8);
+    switch (status) {
+        case 0xF0: return kMFMIDITransformTypeSysex;
+        case 0xF8: return kMFMIDITransformTypeClock;
+        case 0xFA: case 0xFB: case 0xFC: return kMFMIDITransformTypeTransport;
+        case 0xF9: case 0xFD: case 0xFE: return kMFMIDITransformTypeActiveSensing;
+        case 0xFF: return kMFMIDITransformTypeReset;
+        default: return kMFMIDITransformTypeSystemCommon;
+    }
+}
+
+/** Rebuild the status map from the rules. Cheap enough to do on every change */
+static void _MFTransformCompile(MFMIDITransform *t)
+{
+    memset(t->statusMap, 0, 0x80);      // data bytes never index it but keep it defined
+    for (unsigned status = 0x80; status <= 0xFF; status++)
+    {
+        uint8_t out = (uint8_t)status;
+        if (t->droppedTypes & _MFTransformTypeOfStatus(status)) {
+            out = 0;
+        } else if (status < 0xF0) {
+            const uint8_t channel = status & 0x0F;
+            out = (t->droppedChannels & (1u << channel)) ? 0 : (uint8_t)((status & 0xF0) | t->channelMap[channel]);
+        }
+        t->statusMap[status] = out;
+    }
+
+    bool isMapped = false;
+    for (uint8_t ch = 0; ch < 16; ch++) {
+        if (t->channelMap[ch] != ch) isMapped = true;
+    }
+    t->isIdentity = !t->droppedTypes && !t->droppedChannels && !isMapped && !t->velocityChannels;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Rules
+/////////////////////////////////////////////////////////////////////////
+
+void MFMIDITransformInit(MFMIDITransform *transform)
+{
+    memset(transform, 0, sizeof(*transform));
+    for (uint8_t ch = 0; ch < 16; ch++)
+    {
+        transform->channelMap[ch] = ch;
+        for (uint8_t v = 0; v < 128; v++) {
+            transform->velocity[ch][v] = v;
+        }
+    }
+    _MFTransformCompile(transform);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDITransformDropTypes(MFMIDITransform *transform, uint32_t types)
+{
+    transform->droppedTypes |= types;
+    _MFTransformCompile(transform);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDITransformDropChannels(MFMIDITransform *transform, uint16_t channels)
+{
+    transform->droppedChannels |= channels;
+    _MFTransformCompile(transform);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDITransformMapChannel(MFMIDITransform *transform, uint8_t fromChannel, uint8_t toChannel)
+{
+    transform->channelMap[fromChannel & 0x0F] = toChannel & 0x0F;
+    _MFTransformCompile(transform);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDITransformSetVelocityTable(MFMIDITransform *transform, uint16_t channels, const uint8_t table[128])
+{
+    for (uint8_t ch = 0; ch < 16; ch++)
+    {
+        if (!(channels & (1u << ch))) continue;
+
+        // Keep note ons note ons and vice versa
+        bool isIdentity = true;
+        transform->velocity[ch][0] = 0;
+        for (uint8_t v = 1; v < 128; v++)
+        {
+            uint8_t out = table[v] & 0x7F;
+            if (!out) out = 1;
+            transform->velocity[ch][v] = out;
+            if (out != v) isIdentity = false;
+        }
+
+        if (isIdentity) {
+            transform->velocityChannels &= ~(1u << ch);
+        } else {
+            transform->velocityChannels |= (1u << ch);
+        }
+    }
+    _MFTransformCompile(transform);
+}
+
+//---------------------------------------------------------------------
+
+void MFMIDITransformSetVelocityCurve(MFMIDITransform *transform, uint16_t channels, float exponent, uint8_t minVelocity, uint8_t maxVelocity)
+{
+    uint8_t table[128];
+    const float lo = minVelocity ? minVelocity : 1, hi = maxVelocity & 0x7F;
+    table[0] = 0;
+    for (unsigned v = 1; v < 128; v++)
+    {
+        const float x = (v - 1) / 126.f;
+        const float y = lo + (hi - lo) * powf(x, exponent > 0 ? exponent : 1);
+        table[v] = (uint8_t)fminf(fmaxf(roundf(y), 1), 127);
+    }
+    MFMIDITransformSetVelocityTable(transform, channels, table);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Applying
+/////////////////////////////////////////////////////////////////////////
+
+size_t MFMIDITransformApply(const MFMIDITransform *transform, MFMIDITransformState *state, uint8_t *bytes, size_t length)
+{
+    if (transform->isIdentity) return length;
+
+    // Locals for the loop. Written back at the end
+    const uint8_t *map = transform->statusMap;
+    uint8_t status = state ? state->status : 0;
+    uint8_t dataCount = state ? state->dataCount : 0;
+    uint8_t dataLength = status && status != 0xF0 ? (uint8_t)(MFMIDIMessageLengthForStatus(status) - 1) : 0;
+    size_t o = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t byte = bytes[i];
+
+        // Realtime can go anywhere and changes nothing
+        if (byte >= 0xF8) {
+            if (map[byte]) bytes[o++] = byte;
+            continue;
+        }
+
+        if (byte & 0x80)
+        {
+            // The end of a sysex goes with it
+            if (byte == 0xF7 && status == 0xF0) {
+                if (map[0xF0]) bytes[o++] = 0xF7;
+                status = 0;
+                continue;
+            }
+
+            // Anything else starts a message, cutting short one under way. Those with no data (tune request, a stray EOX) leave nothing to apply to
+            if (map[byte]) bytes[o++] = map[byte];
+            const uint32_t messageLength = MFMIDIMessageLengthForStatus(byte);
+            status = messageLength == 1 ? 0 : byte;
+            dataLength = messageLength ? (uint8_t)(messageLength - 1) : 0;
+            dataCount = 0;
+            continue;
+        }
+
+        // Data with no status to go by. Verbatim so a receiver makes of it what it would have anyway
+        if (!status) {
+            bytes[o++] = byte;
+            continue;
+        }
+
+        const uint8_t outStatus = map[status];
+        if (status == 0xF0) {
+            if (outStatus) bytes[o++] = byte;
+            continue;
+        }
+
+        // Channel voice or system common data. Note on velocity through the input channel's table
+        dataCount++;
+        if (outStatus)
+        {
+            if (dataCount == 2 && (status & 0xF0) == 0x90) byte = transform->velocity[status & 0x0F][byte];
+            bytes[o++] = byte;
+        }
+
+        // Complete. Channel messages leave running status, system common doesn't
+        if (dataCount == dataLength) {
+            dataCount = 0;
+            if (status >= 0xF0) status = 0;
+        }
+    }
+
+    if (state) {
+        state->status = status;
+        state->dataCount = dataCount;
+    }
+    return o;
+}
+
+//---------------------------------------------------------------------
+
+size_t MFMIDITransformApplyToPacketList(const MFMIDITransform *transform, MFMIDITransformState *state, MIDIPacketList *packetList)
+{
+    size_t total = 0;
+    MIDIPacket *packet = &packetList->packet[0];
+
+    if (transform->isIdentity) {
+        for (UInt32 i = 0; i < packetList->numPackets; i++) {
+            total += packet->length;
+            packet = MIDIPacketNext(packet);
+        }
+        return total;
+    }
+
+    // Packets only shrink so each is written no later than where it was read from
+    MIDIPacket *outPacket = packet;
+    UInt32 kept = 0;
+    for (UInt32 i = 0; i < packetList->numPackets; i++)
+    {
+        MIDIPacket *next = MIDIPacketNext(packet);
+        const MIDITimeStamp timeStamp = packet->timeStamp;
+        const size_t length = MFMIDITransformApply(transform, state, packet->data, packet->length);
+        if (length)
+        {
+            // Data first as the header may land on it
+            if (outPacket != packet) {
+                memmove(outPacket->data, packet->data, length);
+                outPacket->timeStamp = timeStamp;
+            }
+            outPacket->length = (UInt16)length;
+            outPacket = MIDIPacketNext(outPacket);
+            kept++;
+            total += length;
+        }
+        packet = next;
+    }
+    packetList->numPackets = kept;
+    return total;
+}
+
+//---------------------------------------------------------------------
+
+size_t MFMIDITransformApplyToMessageChunk(const MFMIDITransform *transform, uint8_t messageStatus, MIDIPacketList *packetList)
+{
+    if (messageStatus != 0xF0) {
+        return MFMIDITransformApplyToPacketList(transform, NULL, packetList);
+    }
+
+    if (MFMIDITransformDropsStatus(transform, 0xF0)) {
+        packetList->numPackets = 0;
+        return 0;
+    }
+
+    // Through as it is
+    size_t total = 0;
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 0; i < packetList->numPackets; i++) {
+        total += packet->length;
+        packet = MIDIPacketNext(packet);
+    }
+    return total;
+}
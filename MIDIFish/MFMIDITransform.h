@@ -0,0 +1,134 @@
+//
+//  MFMIDITransform.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDITransform_h
+#define MIDIFish_MFMIDITransform_h
+
+#include "MFMIDITypes.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Rewrites MIDI bytes in place: message type and channel filters, a channel map and per channel note on velocity curves.
+
+ The rules are compiled into lookup tables as they're set - a 256 entry status map (filtering and the channel map in one, 0 meaning drop) and a 128 entry velocity table per channel - so applying one is a table lookup per byte with no branching on the rules, no allocation and no locks. It's safe on the render thread. The output is never longer than the input so it works in place, and it always parses to the input's messages less the dropped ones: running status, interleaved realtime and sysex spanning calls (given an `MFMIDITransformState`) are all understood.
+
+ Decisions go by status byte, so a note on with velocity 0 counts as a note on, and channel filters and velocity curves go by the input's channel, before the channel map.
+
+ `MFMIDISession` applies them to what it sends and receives, session wide and per connection, see `setSendTransform:` etc. The struct is plain data so copy it freely, but build it with the functions below rather than writing the tables.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Message types, as bits, for `MFMIDITransformDropTypes` */
+typedef enum MFMIDITransformType {
+    kMFMIDITransformTypeNoteOff             = 1 << 0,
+    kMFMIDITransformTypeNoteOn              = 1 << 1,
+    kMFMIDITransformTypePolyPressure        = 1 << 2,
+    kMFMIDITransformTypeControlChange       = 1 << 3,
+    kMFMIDITransformTypeProgramChange       = 1 << 4,
+    kMFMIDITransformTypeChannelPressure     = 1 << 5,
+    kMFMIDITransformTypePitchBend           = 1 << 6,
+    kMFMIDITransformTypeSysex               = 1 << 7,
+    kMFMIDITransformTypeSystemCommon        = 1 << 8,   // F1-F6 and a stray F7
+    kMFMIDITransformTypeClock               = 1 << 9,   // F8
+    kMFMIDITransformTypeTransport           = 1 << 10,  // start, continue & stop
+    kMFMIDITransformTypeActiveSensing       = 1 << 11,  // FE and the undefined F9 & FD
+    kMFMIDITransformTypeReset               = 1 << 12,
+
+    kMFMIDITransformTypeChannelVoice        = 0x7F,
+    kMFMIDITransformTypeRealtime            = kMFMIDITransformTypeClock | kMFMIDITransformTypeTransport | kMFMIDITransformTypeActiveSensing | kMFMIDITransformTypeReset,
+} MFMIDITransformType;
+
+typedef struct MFMIDITransform {
+    uint8_t statusMap[256];             // output status per input status. 0 drops the message
+    uint8_t velocity[16][128];          // note on velocity per input channel
+    uint16_t velocityChannels;          // those whose table isn't the identity
+    bool isIdentity;                    // nothing to do. Applying returns straight away
+
+    // The rules the tables are compiled from
+    uint32_t droppedTypes;
+    uint16_t droppedChannels;
+    uint8_t channelMap[16];
+} MFMIDITransform;
+
+/** Where a stream of bytes is up to, for applying to consecutive chunks of it (eg. a source's packets). Zero it to start */
+typedef struct MFMIDITransformState {
+    uint8_t status;                     // the input's running status or the sysex / system common message under way. 0 if none
+    uint8_t dataCount;                  // data bytes of the current message so far
+} MFMIDITransformState;
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Rules
+/////////////////////////////////////////////////////////////////////////
+
+/** Passes everything through unchanged */
+extern void MFMIDITransformInit(MFMIDITransform *transform);
+
+/** Adds to the types dropped. `types` is MFMIDITransformType bits */
+extern void MFMIDITransformDropTypes(MFMIDITransform *transform, uint32_t types);
+
+/** Adds to the channels whose channel voice messages are dropped. Bit n is channel n (0-15) */
+extern void MFMIDITransformDropChannels(MFMIDITransform *transform, uint16_t channels);
+
+/** Channel voice messages on `fromChannel` go out on `toChannel` (both 0-15). Several can map to one */
+extern void MFMIDITransformMapChannel(MFMIDITransform *transform, uint8_t fromChannel, uint8_t toChannel);
+
+/** Note on velocities on `channels` (bits as above) are looked up in `table`. Velocity 0 stays 0 (note off) and no other maps to 0 */
+extern void MFMIDITransformSetVelocityTable(MFMIDITransform *transform, uint16_t channels, const uint8_t table[128]);
+
+/**
+ Fills the velocity table with a curve from `minVelocity` (for velocity 1) to `maxVelocity` (for 127)
+ @param exponent 1 is linear between the two, above 1 softer, below 1 harder
+ */
+extern void MFMIDITransformSetVelocityCurve(MFMIDITransform *transform, uint16_t channels, float exponent, uint8_t minVelocity, uint8_t maxVelocity);
+
+static inline bool MFMIDITransformIsIdentity(const MFMIDITransform *transform)
+{
+    return transform->isIdentity;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Applying
+/////////////////////////////////////////////////////////////////////////
+
+/**
+ Transform `bytes` in place. Real-time safe
+ @param state Carries running status and sysex over from the previous call. NULL to treat `bytes` as complete on their own
+ @return The new length, never more than `length`
+ */
+extern size_t MFMIDITransformApply(const MFMIDITransform *transform, MFMIDITransformState *state, uint8_t *bytes, size_t length);
+
+/**
+ Transform every packet of `packetList` in place, one state carried across them. Packets left empty are removed and the rest moved up, keeping their timestamps. Real-time safe
+ @return The list's data bytes afterwards
+ */
+extern size_t MFMIDITransformApplyToPacketList(const MFMIDITransform *transform, MFMIDITransformState *state, MIDIPacketList *packetList);
+
+/**
+ For one of the consecutive lists a long message goes out in (see MFMIDIPacketListFillChunk) when each is transformed on its own. Chunks after the first start mid-message so a dropped sysex's would get through as orphan data bytes. Instead sysex is dropped or left as it is whole, going by `messageStatus`. Anything else is applied as MFMIDITransformApplyToPacketList with no state. Real-time safe
+ @param messageStatus The whole message's first byte, the same for every chunk
+ @return The list's data bytes afterwards. 0 (and no packets) if it was dropped
+ */
+extern size_t MFMIDITransformApplyToMessageChunk(const MFMIDITransform *transform, uint8_t messageStatus, MIDIPacketList *packetList);
+
+/** Whether the transform drops the messages with `status`, eg. 0xF0 for sysex */
+static inline bool MFMIDITransformDropsStatus(const MFMIDITransform *transform, uint8_t status)
+{
+    return transform->statusMap[status] == 0;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+//
+//  MFMIDITypes.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDITypes.h"
+
+#if !defined(__APPLE__)
+
+#include <string.h>
+
+MIDIPacket *MIDIPacketListInit(MIDIPacketList *packetList)
+{
+    packetList->numPackets = 0;
+    return &packetList->packet[0];
+}
+
+//---------------------------------------------------------------------
+
+MIDIPacket *MIDIPacketListAdd(MIDIPacketList *packetList, ByteCount listSize, MIDIPacket *currentPacket, MIDITimeStamp timeStamp, ByteCount dataLength, const Byte *data)
+{
+    const uintptr_t listEnd = (uintptr_t)packetList + listSize;
+
+    // Append to the current packet?
+    if (packetList->numPackets > 0 &&
+        currentPacket->timeStamp == timeStamp &&
+        currentPacket->data[0] != 0xF0 && data[0] != 0xF0 &&
+        currentPacket->length + dataLength <= UINT16_MAX &&
+        (uintptr_t)&currentPacket->data[currentPacket->length + dataLength] <= listEnd)
+    {
+        memcpy(&currentPacket->data[currentPacket->length], data, dataLength);
+        currentPacket->length += (UInt16)dataLength;
+        return currentPacket;
+    }
+
+    // New packet
+    MIDIPacket *packet = packetList->numPackets ? MIDIPacketNext(currentPacket) : &packetList->packet[0];
+    if (dataLength > UINT16_MAX || (uintptr_t)&packet->data[dataLength] > listEnd) return NULL;
+
+    packet->timeStamp = timeStamp;
+    packet->length = (UInt16)dataLength;
+    memcpy(packet->data, data, dataLength);
+    packetList->numPackets++;
+    return packet;
+}
+
+//---------------------------------------------------------------------
+
+MIDIEventPacket *MIDIEventListInit(MIDIEventList *eventList, MIDIProtocolID protocol)
+{
+    eventList->protocol = protocol;
+    eventList->numPackets = 0;
+    return &eventList->packet[0];
+}
+
+//---------------------------------------------------------------------
+
+MIDIEventPacket *MIDIEventListAdd(MIDIEventList *eventList, ByteCount listSize, MIDIEventPacket *currentPacket, MIDITimeStamp timeStamp, ByteCount wordCount, const UInt32 *words)
+{
+    const uintptr_t listEnd = (uintptr_t)eventList + listSize;
+
+    if (eventList->numPackets > 0 &&
+        currentPacket->timeStamp == timeStamp &&
+        (uintptr_t)&currentPacket->words[currentPacket->wordCount + wordCount] <= listEnd)
+    {
+        memcpy(&currentPacket->words[currentPacket->wordCount], words, wordCount * sizeof(UInt32));
+        currentPacket->wordCount += (UInt32)wordCount;
+        return currentPacket;
+    }
+
+    MIDIEventPacket *packet = eventList->numPackets ? MIDIEventPacketNext(currentPacket) : &eventList->packet[0];
+    if ((uintptr_t)&packet->words[wordCount] > listEnd) return NULL;
+
+    packet->timeStamp = timeStamp;
+    packet->wordCount = (UInt32)wordCount;
+    memcpy(packet->words, words, wordCount * sizeof(UInt32));
+    eventList->numPackets++;
+    return packet;
+}
+
+#endif
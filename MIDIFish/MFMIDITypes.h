@@ -0,0 +1,124 @@
+//
+//  MFMIDITypes.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDITypes_h
+#define MIDIFish_MFMIDITypes_h
+
+/**
+ The CoreMIDI types the portable parts of MIDIFish (batches, backends, routing) are written against. On Apple platforms this is just CoreMIDI. Elsewhere it provides layout compatible stand-ins for the packet list types and functions so that code builds and runs unchanged, eg. for load testing on Linux with the loopback backend.
+ */
+
+#if defined(__APPLE__)
+
+#include <CoreMIDI/CoreMIDI.h>
+
+/** For what uses CoreMIDI's MIDI 2.0 (event list) API, which is newer than our deployment target */
+#define MF_UMP_AVAILABLE API_AVAILABLE(macos(11.0), ios(14.0))
+
+#else
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t     Byte;
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef int32_t     OSStatus;
+typedef unsigned long ByteCount;
+typedef unsigned long ItemCount;
+
+typedef uint64_t    MIDITimeStamp;
+typedef uint32_t    MIDIObjectRef;
+typedef MIDIObjectRef MIDIClientRef;
+typedef MIDIObjectRef MIDIPortRef;
+typedef MIDIObjectRef MIDIEndpointRef;
+
+#ifndef noErr
+#define noErr 0
+#endif
+
+// Same error codes as CoreMIDI so callers can treat them alike
+enum {
+    kMIDIInvalidClient      = -10830,
+    kMIDIInvalidPort        = -10831,
+    kMIDIWrongEndpointType  = -10832,
+    kMIDINoConnection       = -10833,
+    kMIDIUnknownEndpoint    = -10834,
+    kMIDINotPermitted       = -10844,
+};
+
+#pragma pack(push, 4)
+typedef struct MIDIPacket {
+    MIDITimeStamp timeStamp;
+    UInt16 length;
+    Byte data[256];             // nominal. May be longer if the list's buffer allows
+} MIDIPacket;
+
+typedef struct MIDIPacketList {
+    UInt32 numPackets;
+    MIDIPacket packet[1];
+} MIDIPacketList;
+#pragma pack(pop)
+
+typedef void (*MIDIReadProc)(const MIDIPacketList *pktlist, void *readProcRefCon, void *srcConnRefCon);
+
+#define MF_UMP_AVAILABLE
+
+/** MIDI 2.0 Universal MIDI Packets. As per CoreMIDI's MIDIEventList @{ */
+typedef int32_t     MIDIProtocolID;
+enum {
+    kMIDIProtocol_1_0       = 1,
+    kMIDIProtocol_2_0       = 2,
+};
+
+#pragma pack(push, 4)
+typedef struct MIDIEventPacket {
+    MIDITimeStamp timeStamp;
+    UInt32 wordCount;
+    UInt32 words[64];           // nominal, as above
+} MIDIEventPacket;
+
+typedef struct MIDIEventList {
+    MIDIProtocolID protocol;
+    UInt32 numPackets;
+    MIDIEventPacket packet[1];
+} MIDIEventList;
+#pragma pack(pop)
+
+static inline MIDIEventPacket *MIDIEventPacketNext(const MIDIEventPacket *packet)
+{
+    return (MIDIEventPacket *)&packet->words[packet->wordCount];
+}
+
+extern MIDIEventPacket *MIDIEventListInit(MIDIEventList *eventList, MIDIProtocolID protocol);
+
+/** As per CoreMIDI: appends to `currentPacket` if the timestamp matches, otherwise starts a new packet. `words` should be whole messages. NULL if there's no room */
+extern MIDIEventPacket *MIDIEventListAdd(MIDIEventList *eventList, ByteCount listSize, MIDIEventPacket *currentPacket, MIDITimeStamp timeStamp, ByteCount wordCount, const UInt32 *words);
+/** @} */
+
+/** Packets are 4-byte aligned as per CoreMIDI on ARM */
+static inline MIDIPacket *MIDIPacketNext(const MIDIPacket *packet)
+{
+    return (MIDIPacket *)(((uintptr_t)&packet->data[packet->length] + 3) & ~(uintptr_t)3);
+}
+
+extern MIDIPacket *MIDIPacketListInit(MIDIPacketList *packetList);
+
+/** As per CoreMIDI: appends to `currentPacket` if the timestamp matches and neither is sysex, otherwise starts a new packet. NULL if there's no room */
+extern MIDIPacket *MIDIPacketListAdd(MIDIPacketList *packetList, ByteCount listSize, MIDIPacket *currentPacket, MIDITimeStamp timeStamp, ByteCount dataLength, const Byte *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __APPLE__
+
+#endif
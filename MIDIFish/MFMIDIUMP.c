@@ -0,0 +1,375 @@
+//
+//  MFMIDIUMP.c
+//  MIDIFish
+//
+//
+
+#include "MFMIDIUMP.h"
+#include "MFMIDIMessageValue.h"
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Scaling
+/////////////////////////////////////////////////////////////////////////
+
+uint32_t MFMIDIUMPScaleUp(uint32_t value, uint8_t sourceBits, uint8_t destinationBits)
+{
+    if (sourceBits >= destinationBits) return value >> (sourceBits - destinationBits);
+
+    // Plain shift up to the center, so it stays the center
+    const uint32_t scaleBits = destinationBits - sourceBits;
+    uint32_t result = value << scaleBits;
+    if (value <= (1u << (sourceBits - 1))) return result;
+
+    // Above it, repeat the bits under the top one down into the gap so the max comes out all ones
+    const uint32_t repeatBits = sourceBits - 1;
+    uint32_t repeat = value & ((1u << repeatBits) - 1);
+    repeat = scaleBits > repeatBits ? repeat << (scaleBits - repeatBits) : repeat >> (repeatBits - scaleBits);
+    while (repeat) {
+        result |= repeat;
+        repeat >>= repeatBits;
+    }
+    return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Bytes to UMP
+/////////////////////////////////////////////////////////////////////////
+
+/** A complete non-sysex message as UMP. 0 if there isn't room */
+static inline size_t _MFMessageToUMP(MFMIDIUMPProtocol protocol, uint32_t groupBits, uint8_t status, uint8_t data1, uint8_t data2, uint32_t *out, size_t room)
+{
+    if (status >= 0xF0 || protocol != kMFMIDIUMPProtocolMIDI2)
+    {
+        if (!room) return 0;
+        const uint32_t type = status >= 0xF0 ? kMFMIDIUMPMessageTypeSystem : kMFMIDIUMPMessageTypeMIDI1ChannelVoice;
+        out[0] = type << 28 | groupBits | (uint32_t)status << 16 | (uint32_t)data1 << 8 | data2;
+        return 1;
+    }
+
+    if (room < 2) return 0;
+    uint32_t index = data1, value;
+    switch (status & 0xF0)
+    {
+        case 0x90:
+            if (data2 == 0) {
+                // Velocity 0 note on is a note off in MIDI 1.0 only
+                status = 0x80 | (status & 0x0F);
+                value = 0x8000u << 16;
+                break;
+            }
+            // fall through
+        case 0x80:
+            value = MFMIDIUMPScaleUp(data2, 7, 16) << 16;
+            break;
+        case 0xA0:
+        case 0xB0:
+            value = MFMIDIUMPScaleUp(data2, 7, 32);
+            break;
+        case 0xC0:
+            value = (uint32_t)data1 << 24;
+            index = 0;
+            break;
+        case 0xD0:
+            value = MFMIDIUMPScaleUp(data1, 7, 32);
+            index = 0;
+            break;
+        default:
+            value = MFMIDIUMPScaleUp((uint32_t)data2 << 7 | data1, 14, 32);
+            index = 0;
+            break;
+    }
+    out[0] = (uint32_t)kMFMIDIUMPMessageTypeMIDI2ChannelVoice << 28 | groupBits | (uint32_t)status << 16 | index << 8;
+    out[1] = value;
+    return 2;
+}
+
+//---------------------------------------------------------------------
+
+/** The held sysex bytes as a 64-bit packet. 0 if there isn't room */
+static inline size_t _MFSysexToUMP(MFMIDIUMPFromBytesState *state, uint32_t groupBits, bool isLast, uint32_t *out, size_t room)
+{
+    if (room < 2) return 0;
+    const uint32_t status = isLast ? (state->sysexStarted ? kMFMIDIUMPSysexEnd : kMFMIDIUMPSysexComplete)
+                                   : (state->sysexStarted ? kMFMIDIUMPSysexContinue : kMFMIDIUMPSysexStart);
+    uint8_t b[6] = {0};
+    memcpy(b, state->sysex, state->sysexCount);
+    out[0] = (uint32_t)kMFMIDIUMPMessageTypeData64 << 28 | groupBits | status << 20 | (uint32_t)state->sysexCount << 16 | (uint32_t)b[0] << 8 | b[1];
+    out[1] = (uint32_t)b[2] << 24 | (uint32_t)b[3] << 16 | (uint32_t)b[4] << 8 | b[5];
+    state->sysexStarted = !isLast;
+    state->sysexCount = 0;
+    if (isLast) state->inSysex = false;
+    return 2;
+}
+
+//---------------------------------------------------------------------
+
+size_t MFMIDIUMPFromBytes(MFMIDIUMPFromBytesState *state, MFMIDIUMPProtocol protocol, uint8_t group,
+                          const uint8_t *bytes, size_t length,
+                          uint32_t *outWords, size_t wordCapacity, size_t *outBytesConsumed)
+{
+    const uint32_t groupBits = (uint32_t)(group & 0x0F) << 24;
+    size_t i = 0, w = 0, n;
+
+    while (i < length)
+    {
+        const uint8_t byte = bytes[i];
+
+        // Fast path: a whole channel message, status given or running, with nothing under way
+        if (!state->status && !state->inSysex)
+        {
+            uint8_t status = byte;
+            size_t data = i + 1;
+            if (byte < 0x80) {
+                status = state->runningStatus;
+                data = i;
+            }
+            if (status >= 0x80 && status < 0xF0)
+            {
+                const size_t dataLength = (status & 0xE0) == 0xC0 ? 1 : 2;
+                if (length - data >= dataLength)
+                {
+                    const uint8_t data1 = bytes[data];
+                    const uint8_t data2 = dataLength == 2 ? bytes[data + 1] : 0;
+                    if (!((data1 | data2) & 0x80))
+                    {
+                        if (!(n = _MFMessageToUMP(protocol, groupBits, status, data1, data2, &outWords[w], wordCapacity - w))) break;
+                        w += n;
+                        state->runningStatus = status;
+                        i = data + dataLength;
+                        continue;
+                    }
+                }
+            }
+        }
+
+        // Otherwise a byte at a time
+        if (byte >= 0xF8)
+        {
+            // Realtime goes straight out, whatever it interrupts
+            if (!(n = _MFMessageToUMP(protocol, groupBits, byte, 0, 0, &outWords[w], wordCapacity - w))) break;
+            w += n;
+        }
+        else if (byte & 0x80)
+        {
+            // Any status ends a sysex, F7 or not
+            if (state->inSysex) {
+                if (!(n = _MFSysexToUMP(state, groupBits, true, &outWords[w], wordCapacity - w))) break;
+                w += n;
+            }
+            state->status = 0;
+            state->pendingCount = 0;
+            if (byte == 0xF0) {
+                state->inSysex = true;
+                state->sysexStarted = false;
+                state->runningStatus = 0;
+            } else if (byte < 0xF0) {
+                state->status = state->runningStatus = byte;
+            } else {
+                // System common (a stray EOX included) cancels running status. Tune request has no data and the undefined ones are dropped
+                state->runningStatus = 0;
+                if (byte == 0xF6) {
+                    if (!(n = _MFMessageToUMP(protocol, groupBits, byte, 0, 0, &outWords[w], wordCapacity - w))) break;
+                    w += n;
+                } else if (byte != 0xF7 && MFMIDIMessageLengthForStatus(byte) > 1) {
+                    state->status = byte;
+                }
+            }
+        }
+        else if (state->inSysex)
+        {
+            // Hold on to 6 before sending so we know whether they're the last. Take as many as there are in one go
+            if (state->sysexCount == 6) {
+                if (!(n = _MFSysexToUMP(state, groupBits, false, &outWords[w], wordCapacity - w))) break;
+                w += n;
+            }
+            state->sysex[state->sysexCount++] = byte;
+            while (state->sysexCount < 6 && i + 1 < length && bytes[i + 1] < 0x80) {
+                state->sysex[state->sysexCount++] = bytes[++i];
+            }
+        }
+        else
+        {
+            if (!state->status) state->status = state->runningStatus;
+            if (state->status)
+            {
+                state->pending[state->pendingCount++] = byte;
+                if ((uint32_t)state->pendingCount + 1 == MFMIDIMessageLengthForStatus(state->status))
+                {
+                    if (!(n = _MFMessageToUMP(protocol, groupBits, state->status, state->pending[0], state->pendingCount > 1 ? state->pending[1] : 0, &outWords[w], wordCapacity - w))) {
+                        state->pendingCount--;
+                        break;
+                    }
+                    w += n;
+                    state->status = 0;
+                    state->pendingCount = 0;
+                }
+            }
+            // else stray data. Drop it
+        }
+        i++;
+    }
+
+    if (outBytesConsumed) *outBytesConsumed = i;
+    return w;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - UMP to Bytes
+/////////////////////////////////////////////////////////////////////////
+
+/** A MIDI 2.0 channel voice message scaled down to MIDI 1.0. 0 bytes if there's no equivalent */
+static inline size_t _MFMIDI2ToBytes(uint32_t word0, uint32_t word1, uint8_t *out)
+{
+    const uint8_t status = (uint8_t)(word0 >> 16);
+    const uint8_t channel = status & 0x0F;
+    const uint8_t index = (word0 >> 8) & 0x7F;
+    size_t length = 0;
+
+    switch (status & 0xF0)
+    {
+        case 0x80:
+        case 0x90: {
+            uint8_t velocity = (uint8_t)(word1 >> 25);
+            if (velocity == 0 && (status & 0xF0) == 0x90) velocity = 1;     // or it'd be a note off
+            out[length++] = status; out[length++] = index; out[length++] = velocity;
+            break;
+        }
+        case 0xA0:
+        case 0xB0:
+            out[length++] = status; out[length++] = index; out[length++] = (uint8_t)(word1 >> 25);
+            break;
+        case 0xC0:
+            if (word0 & 0x01) {
+                out[length++] = 0xB0 | channel; out[length++] = 0;  out[length++] = (word1 >> 8) & 0x7F;
+                out[length++] = 0xB0 | channel; out[length++] = 32; out[length++] = word1 & 0x7F;
+            }
+            out[length++] = status; out[length++] = (word1 >> 24) & 0x7F;
+            break;
+        case 0xD0:
+            out[length++] = status; out[length++] = (uint8_t)(word1 >> 25);
+            break;
+        case 0xE0: {
+            const uint32_t bend = word1 >> 18;
+            out[length++] = status; out[length++] = bend & 0x7F; out[length++] = (uint8_t)(bend >> 7);
+            break;
+        }
+        case 0x20:
+        case 0x30: {
+            // Registered / non-registered as the parameter number CCs then data entry MSB and LSB
+            const uint8_t cc = 0xB0 | channel;
+            const bool isRegistered = (status & 0xF0) == 0x20;
+            out[length++] = cc; out[length++] = isRegistered ? 101 : 99; out[length++] = index;
+            out[length++] = cc; out[length++] = isRegistered ? 100 : 98; out[length++] = word0 & 0x7F;
+            out[length++] = cc; out[length++] = 6;  out[length++] = (uint8_t)(word1 >> 25);
+            out[length++] = cc; out[length++] = 38; out[length++] = (word1 >> 18) & 0x7F;
+            break;
+        }
+        default:
+            break;                      // per note and relative. Nothing in MIDI 1.0
+    }
+    return length;
+}
+
+//---------------------------------------------------------------------
+
+size_t MFMIDIUMPToBytes(const uint32_t *words, size_t wordCount, uint8_t *outBytes, size_t byteCapacity, size_t *outWordsConsumed)
+{
+    size_t i = 0, o = 0;
+
+    while (i < wordCount)
+    {
+        const uint32_t word0 = words[i];
+        const uint32_t type = word0 >> 28;
+
+        // Fast path: MIDI 1.0 channel voice is the bytes as they are
+        if (type == kMFMIDIUMPMessageTypeMIDI1ChannelVoice)
+        {
+            const uint8_t status = (uint8_t)(word0 >> 16) | 0x80;
+            const size_t length = (status & 0xE0) == 0xC0 ? 2 : 3;
+            if (byteCapacity - o < length) break;
+            outBytes[o] = status;
+            outBytes[o + 1] = (word0 >> 8) & 0x7F;
+            if (length == 3) outBytes[o + 2] = word0 & 0x7F;
+            o += length;
+            i++;
+            continue;
+        }
+
+        const size_t messageWords = MFMIDIUMPWordCountForFirstWord(word0);
+        if (wordCount - i < messageWords) break;        // cut off
+
+        uint8_t message[12];
+        size_t length = 0;
+        switch (type)
+        {
+            case kMFMIDIUMPMessageTypeSystem: {
+                const uint8_t status = (uint8_t)(word0 >> 16);
+                const uint32_t messageLength = status >= 0xF1 && status != 0xF7 ? MFMIDIMessageLengthForStatus(status) : 0;
+                if (messageLength) message[length++] = status;
+                if (messageLength > 1) message[length++] = (word0 >> 8) & 0x7F;
+                if (messageLength > 2) message[length++] = word0 & 0x7F;
+                break;
+            }
+            case kMFMIDIUMPMessageTypeData64: {
+                const uint32_t status = (word0 >> 20) & 0x0F;
+                uint32_t count = (word0 >> 16) & 0x0F;
+                if (status > kMFMIDIUMPSysexEnd) break;
+                if (count > 6) count = 6;
+                const uint8_t data[6] = {
+                    (word0 >> 8) & 0x7F, word0 & 0x7F,
+                    (words[i + 1] >> 24) & 0x7F, (words[i + 1] >> 16) & 0x7F, (words[i + 1] >> 8) & 0x7F, words[i + 1] & 0x7F
+                };
+                if (status == kMFMIDIUMPSysexComplete || status == kMFMIDIUMPSysexStart) message[length++] = 0xF0;
+                memcpy(&message[length], data, count);
+                length += count;
+                if (status == kMFMIDIUMPSysexComplete || status == kMFMIDIUMPSysexEnd) message[length++] = 0xF7;
+                break;
+            }
+            case kMFMIDIUMPMessageTypeMIDI2ChannelVoice:
+                length = _MFMIDI2ToBytes(word0, words[i + 1], message);
+                break;
+            default:
+                break;                  // utility, 8-bit data, stream etc.
+        }
+
+        if (byteCapacity - o < length) break;
+        memcpy(&outBytes[o], message, length);
+        o += length;
+        i += messageWords;
+    }
+
+    if (outWordsConsumed) *outWordsConsumed = i;
+    return o;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Event Lists
+/////////////////////////////////////////////////////////////////////////
+
+bool MFMIDIUMPEventListToPacketList(const MIDIEventList *eventList, MIDIPacketList *packetList, ByteCount packetListSize)
+{
+    MIDIPacket *current = MIDIPacketListInit(packetList);
+    const MIDIEventPacket *eventPacket = &eventList->packet[0];
+
+    for (UInt32 p = 0; p < eventList->numPackets; p++)
+    {
+        // A message at a time so sysex gets packets of its own
+        for (size_t i = 0; i < eventPacket->wordCount; )
+        {
+            const size_t messageWords = MFMIDIUMPWordCountForFirstWord(eventPacket->words[i]);
+            if (messageWords > eventPacket->wordCount - i) break;
+            uint8_t bytes[kMFMIDIUMPMaxBytesPerWord * 4];
+            const size_t length = MFMIDIUMPToBytes(&eventPacket->words[i], messageWords, bytes, sizeof(bytes), NULL);
+            i += messageWords;
+            if (!length) continue;
+            current = MIDIPacketListAdd(packetList, packetListSize, current, eventPacket->timeStamp, length, bytes);
+            if (!current) return false;
+        }
+        eventPacket = MIDIEventPacketNext(eventPacket);
+    }
+    return true;
+}
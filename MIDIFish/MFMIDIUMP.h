@@ -0,0 +1,231 @@
+//
+//  MFMIDIUMP.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFMIDIUMP_h
+#define MIDIFish_MFMIDIUMP_h
+
+#include "MFMIDITypes.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ MIDI 2.0 Universal MIDI Packets and translation to and from MIDI 1.0 byte streams. Plain C with no platform dependencies.
+
+ A UMP is 1 to 4 32-bit words, the message type in the top nibble of the first saying how many. `MFMIDIUMP` holds one inline, like `MFMIDIMessageValue` does for MIDI 1.0, and there are builders for the MIDI 2.0 channel voice messages with their 16-bit velocities and 32-bit controllers. For streams of them, plain `uint32_t` arrays (as in a `MIDIEventList`) are used directly.
+
+ The translators work on whole buffers. Channel messages - almost all traffic - go through a fast path which handles a complete message per step with no per byte state machine: a range check of the status, one mask test of the data and a few shifts to build the words going to UMP, and a shift and 2-3 stores coming back. Everything else (running status, sysex, realtime in the middle of things) falls back to a byte at a time. Neither allocates, and state carries across calls so buffers can split anywhere.
+
+ MIDI 1.0 values scale up to MIDI 2.0 by the spec's min-center-max method (so 64 is exactly 0x8000... and 127 all ones) and back down by shifting, so a round trip is exact.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** Top nibble of the first word */
+typedef enum MFMIDIUMPMessageType {
+    kMFMIDIUMPMessageTypeUtility            = 0x0,  // 32 bit. NOOP, jitter reduction timestamps
+    kMFMIDIUMPMessageTypeSystem             = 0x1,  // 32 bit. System common and realtime
+    kMFMIDIUMPMessageTypeMIDI1ChannelVoice  = 0x2,  // 32 bit. MIDI 1.0 channel messages as they are
+    kMFMIDIUMPMessageTypeData64             = 0x3,  // 64 bit. 7-bit sysex, 6 bytes at a time
+    kMFMIDIUMPMessageTypeMIDI2ChannelVoice  = 0x4,  // 64 bit. High resolution channel messages
+    kMFMIDIUMPMessageTypeData128            = 0x5,  // 128 bit. 8-bit sysex and mixed data sets
+} MFMIDIUMPMessageType;
+
+/** Which the byte to UMP translation produces. Values as CoreMIDI's MIDIProtocolID */
+typedef enum MFMIDIUMPProtocol {
+    kMFMIDIUMPProtocolMIDI1 = 1,        // channel messages as MIDI 1.0 channel voice UMPs (type 2)
+    kMFMIDIUMPProtocolMIDI2 = 2,        // channel messages scaled up to MIDI 2.0 channel voice UMPs (type 4)
+} MFMIDIUMPProtocol;
+
+/** Status (in bits 4-7 of the first word's second byte) of the 64-bit sysex packets */
+typedef enum MFMIDIUMPSysexStatus {
+    kMFMIDIUMPSysexComplete     = 0x0,
+    kMFMIDIUMPSysexStart        = 0x1,
+    kMFMIDIUMPSysexContinue     = 0x2,
+    kMFMIDIUMPSysexEnd          = 0x3,
+} MFMIDIUMPSysexStatus;
+
+typedef struct MFMIDIUMP {
+    uint32_t words[4];                  // those past the message's word count are 0
+} MFMIDIUMP;
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Accessors
+/////////////////////////////////////////////////////////////////////////
+
+/** Words in the UMP starting with `firstWord`: 1, 2, 3 or 4 */
+static inline uint32_t MFMIDIUMPWordCountForFirstWord(uint32_t firstWord)
+{
+    // Two bits per message type, 0-F: 1 1 1 2 2 4 1 1 2 2 2 3 3 4 4 4
+    static const uint32_t kPacked = 0xFE950D40;     // (count - 1) << (2 * type)
+    return ((kPacked >> ((firstWord >> 28) * 2)) & 3) + 1;
+}
+
+static inline uint32_t MFMIDIUMPGetWordCount(const MFMIDIUMP *ump)
+{
+    return MFMIDIUMPWordCountForFirstWord(ump->words[0]);
+}
+
+static inline MFMIDIUMPMessageType MFMIDIUMPGetMessageType(const MFMIDIUMP *ump)
+{
+    return (MFMIDIUMPMessageType)(ump->words[0] >> 28);
+}
+
+static inline uint8_t MFMIDIUMPGetGroup(const MFMIDIUMP *ump)
+{
+    return (ump->words[0] >> 24) & 0x0F;
+}
+
+/** The status byte of system and channel voice messages, eg. 0x93 for a note on on channel 4 */
+static inline uint8_t MFMIDIUMPGetStatus(const MFMIDIUMP *ump)
+{
+    return (uint8_t)(ump->words[0] >> 16);
+}
+
+static inline uint8_t MFMIDIUMPGetChannel(const MFMIDIUMP *ump)
+{
+    return (ump->words[0] >> 16) & 0x0F;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Scaling
+/////////////////////////////////////////////////////////////////////////
+
+/** MIDI 2.0 min-center-max upscaling of a `sourceBits` value to `destinationBits` (up to 32) */
+extern uint32_t MFMIDIUMPScaleUp(uint32_t value, uint8_t sourceBits, uint8_t destinationBits);
+
+static inline uint32_t MFMIDIUMPScaleDown(uint32_t value, uint8_t sourceBits, uint8_t destinationBits)
+{
+    return value >> (sourceBits - destinationBits);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Construction
+/////////////////////////////////////////////////////////////////////////
+
+/** A MIDI 1.0 channel message (type 2) or system common / realtime message (type 1) from its bytes, as they'd be sent. Data bytes are masked to 7 bits */
+static inline MFMIDIUMP MFMIDIUMPMakeMIDI1(uint8_t group, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    const uint32_t type = status >= 0xF0 ? kMFMIDIUMPMessageTypeSystem : kMFMIDIUMPMessageTypeMIDI1ChannelVoice;
+    MFMIDIUMP ump = { { type << 28 | (uint32_t)(group & 0x0F) << 24 | (uint32_t)status << 16 | (uint32_t)(data1 & 0x7F) << 8 | (data2 & 0x7F), 0, 0, 0 } };
+    return ump;
+}
+
+/** MIDI 2.0 channel voice. Channel is 0-15, notes, indexes and programs 7 bit @{ */
+static inline MFMIDIUMP MFMIDIUMPMakeMIDI2(uint8_t group, uint8_t status, uint8_t data1, uint8_t data2, uint32_t data)
+{
+    MFMIDIUMP ump = { { (uint32_t)kMFMIDIUMPMessageTypeMIDI2ChannelVoice << 28 | (uint32_t)(group & 0x0F) << 24 | (uint32_t)status << 16 | (uint32_t)data1 << 8 | data2, data, 0, 0 } };
+    return ump;
+}
+
+static inline MFMIDIUMP MFMIDIUMPMakeNoteOn(uint8_t group, uint8_t channel, uint8_t note, uint16_t velocity)
+{
+    return MFMIDIUMPMakeMIDI2(group, 0x90 | (channel & 0x0F), note & 0x7F, 0, (uint32_t)velocity << 16);
+}
+
+static inline MFMIDIUMP MFMIDIUMPMakeNoteOff(uint8_t group, uint8_t channel, uint8_t note, uint16_t velocity)
+{
+    return MFMIDIUMPMakeMIDI2(group, 0x80 | (channel & 0x0F), note & 0x7F, 0, (uint32_t)velocity << 16);
+}
+
+static inline MFMIDIUMP MFMIDIUMPMakePolyPressure(uint8_t group, uint8_t channel, uint8_t note, uint32_t pressure)
+{
+    return MFMIDIUMPMakeMIDI2(group, 0xA0 | (channel & 0x0F), note & 0x7F, 0, pressure);
+}
+
+static inline MFMIDIUMP MFMIDIUMPMakeControlChange(uint8_t group, uint8_t channel, uint8_t controller, uint32_t value)
+{
+    return MFMIDIUMPMakeMIDI2(group, 0xB0 | (channel & 0x0F), controller & 0x7F, 0, value);
+}
+
+/** `bank` is the 14-bit bank select, or -1 to leave it */
+static inline MFMIDIUMP MFMIDIUMPMakeProgramChange(uint8_t group, uint8_t channel, uint8_t program, int32_t bank)
+{
+    const uint32_t bankBits = bank < 0 ? 0 : ((uint32_t)(bank >> 7) & 0x7F) << 8 | (bank & 0x7F);
+    return MFMIDIUMPMakeMIDI2(group, 0xC0 | (channel & 0x0F), 0, bank < 0 ? 0 : 1, (uint32_t)(program & 0x7F) << 24 | bankBits);
+}
+
+static inline MFMIDIUMP MFMIDIUMPMakeChannelPressure(uint8_t group, uint8_t channel, uint32_t pressure)
+{
+    return MFMIDIUMPMakeMIDI2(group, 0xD0 | (channel & 0x0F), 0, 0, pressure);
+}
+
+/** 0x80000000 is center */
+static inline MFMIDIUMP MFMIDIUMPMakePitchBend(uint8_t group, uint8_t channel, uint32_t value)
+{
+    return MFMIDIUMPMakeMIDI2(group, 0xE0 | (channel & 0x0F), 0, 0, value);
+}
+
+/** Registered / non-registered parameters in one message rather than 4 CCs. Bank and index 7 bit */
+static inline MFMIDIUMP MFMIDIUMPMakeRPN(uint8_t group, uint8_t channel, uint8_t bank, uint8_t index, uint32_t value)
+{
+    return MFMIDIUMPMakeMIDI2(group, 0x20 | (channel & 0x0F), bank & 0x7F, index & 0x7F, value);
+}
+
+static inline MFMIDIUMP MFMIDIUMPMakeNRPN(uint8_t group, uint8_t channel, uint8_t bank, uint8_t index, uint32_t value)
+{
+    return MFMIDIUMPMakeMIDI2(group, 0x30 | (channel & 0x0F), bank & 0x7F, index & 0x7F, value);
+}
+/** @} */
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Translation
+/////////////////////////////////////////////////////////////////////////
+
+/** Where a byte stream is up to. Zero it to start */
+typedef struct MFMIDIUMPFromBytesState {
+    uint8_t runningStatus;
+    uint8_t pending[2];                 // data of the message under way
+    uint8_t pendingCount;
+    uint8_t status;                     // of the message under way. 0 if none
+    bool inSysex;
+    bool sysexStarted;                  // a start packet has gone out
+    uint8_t sysexCount;
+    uint8_t sysex[6];                   // held until we know whether it's the last of the sysex
+} MFMIDIUMPFromBytesState;
+
+/**
+ MIDI 1.0 bytes to UMP words. Channel messages as per `protocol`, system messages as type 1 and sysex as 64-bit sysex packets. Sysex goes 6 bytes to a packet so realtime in the middle of one comes out ahead of the (up to 5) sysex bytes before it in its packet. Stray data and undefined statuses are dropped. Stops early if `outWords` fills
+ @param state Carries running status, partial messages and sysex over from the previous call
+ @param outBytesConsumed Where it got to in `bytes`. Pass the rest again once there's room. May be NULL if `outWords` is big enough (2 words per input byte always is)
+ @return Words written
+ */
+extern size_t MFMIDIUMPFromBytes(MFMIDIUMPFromBytesState *state, MFMIDIUMPProtocol protocol, uint8_t group,
+                                 const uint8_t *bytes, size_t length,
+                                 uint32_t *outWords, size_t wordCapacity, size_t *outBytesConsumed);
+
+/**
+ UMP words to MIDI 1.0 bytes, whatever the group. MIDI 2.0 channel voice is scaled down, with a registered / non-registered parameter as its 4 CCs and a program change with a bank as the bank selects and then the program. Messages with no MIDI 1.0 equivalent (utility, per note controllers, 8-bit sysex etc.) are skipped. Stops early rather than split a message if `outBytes` fills
+ @param outWordsConsumed Where it got to in `words`. May be NULL
+ @return Bytes written
+ */
+extern size_t MFMIDIUMPToBytes(const uint32_t *words, size_t wordCount, uint8_t *outBytes, size_t byteCapacity, size_t *outWordsConsumed);
+
+/** Most bytes `MFMIDIUMPToBytes` produces from a word, for sizing buffers */
+#define kMFMIDIUMPMaxBytesPerWord 6
+
+/**
+ An event list as a packet list, a packet per event packet with the same timestamps, ie. for sending UMP down a MIDI 1.0 path
+ @return false if it didn't all fit, in which case the packet list holds as much as did
+ */
+extern bool MFMIDIUMPEventListToPacketList(const MIDIEventList *eventList, MIDIPacketList *packetList, ByteCount packetListSize) MF_UMP_AVAILABLE;
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
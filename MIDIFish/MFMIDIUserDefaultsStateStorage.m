@@ -0,0 +1,145 @@
+//
+//  MFMIDIUserDefaultsStateStorage.m
+//  MIDIFish
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "MFMIDIStateStorage.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+// The first two are as they've always been, so states stored by older versions carry over (and the reverse)
+static NSString * const _kUserDefsKeyEnabledStates = @"co.air-craft.MIDIFish.connectionsEnabledStates";        // storage ID -> @(BOOL)
+static NSString * const _kUserDefsKeyManualConnections = @"co.air-craft.MIDIFish.manualConnections";          // name -> @{ address, port }
+static NSString * const _kUserDefsKeyLastSeen = @"co.air-craft.MIDIFish.connectionsLastSeen";                  // storage ID -> @(seconds since 1970)
+static NSString * const _kUserDefsKeyResolvedHosts = @"co.air-craft.MIDIFish.resolvedHosts";                  // service name -> @{ address, port, lastResolved }
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Storage Functions
+/////////////////////////////////////////////////////////////////////////
+
+static void _MFUserDefaultsLoad(void *context, MFMIDIConnectionStateLoadProc stateProc, MFMIDIManualHostLoadProc hostProc, void *refCon)
+{
+    NSUserDefaults *userDefs = [NSUserDefaults standardUserDefaults];
+
+    NSDictionary *states = [userDefs dictionaryForKey:_kUserDefsKeyEnabledStates];
+    NSDictionary *lastSeen = [userDefs dictionaryForKey:_kUserDefsKeyLastSeen];
+    for (NSString *storageID in states)
+    {
+        if (![storageID isKindOfClass:NSString.class]) continue;
+        MFMIDIConnectionStateRecord record = {
+            storageID.UTF8String,
+            [states[storageID] boolValue],
+            [lastSeen[storageID] longLongValue]
+        };
+        stateProc(&record, refCon);
+    }
+
+    NSDictionary *manualConns = [userDefs dictionaryForKey:_kUserDefsKeyManualConnections];
+    for (NSString *name in manualConns)
+    {
+        NSDictionary *details = manualConns[name];
+        if (![name isKindOfClass:NSString.class] || ![details isKindOfClass:NSDictionary.class]) continue;
+        MFMIDIManualHostRecord record = {
+            name.UTF8String,
+            [details[@"address"] description].UTF8String ?: "",
+            (uint16_t)[details[@"port"] integerValue]
+        };
+        hostProc(&record, refCon);
+    }
+}
+
+//---------------------------------------------------------------------
+
+static bool _MFUserDefaultsSave(void *context, const MFMIDIConnectionStateRecord *states, size_t stateCount, const MFMIDIManualHostRecord *hosts, size_t hostCount)
+{
+    @autoreleasepool
+    {
+        NSMutableDictionary *enabledStates = [NSMutableDictionary dictionaryWithCapacity:stateCount];
+        NSMutableDictionary *lastSeen = [NSMutableDictionary dictionaryWithCapacity:stateCount];
+        for (size_t i=0; i<stateCount; ++i)
+        {
+            NSString *storageID = @(states[i].storageID);
+            if (!storageID) continue;
+            enabledStates[storageID] = @(states[i].enabled);
+            lastSeen[storageID] = @(states[i].lastSeen);
+        }
+
+        NSMutableDictionary *manualConns = [NSMutableDictionary dictionaryWithCapacity:hostCount];
+        for (size_t i=0; i<hostCount; ++i)
+        {
+            NSString *name = @(hosts[i].name);
+            NSString *address = @(hosts[i].address);
+            if (!name || !address) continue;
+            manualConns[name] = @{ @"address": address, @"port": @(hosts[i].port) };
+        }
+
+        NSUserDefaults *userDefs = [NSUserDefaults standardUserDefaults];
+        [userDefs setObject:enabledStates forKey:_kUserDefsKeyEnabledStates];
+        [userDefs setObject:lastSeen forKey:_kUserDefsKeyLastSeen];
+        [userDefs setObject:manualConns forKey:_kUserDefsKeyManualConnections];
+        return [userDefs synchronize];
+    }
+}
+
+//---------------------------------------------------------------------
+
+static void _MFUserDefaultsLoadResolvedHosts(void *context, MFMIDIResolvedHostLoadProc proc, void *refCon)
+{
+    NSDictionary *resolvedHosts = [[NSUserDefaults standardUserDefaults] dictionaryForKey:_kUserDefsKeyResolvedHosts];
+    for (NSString *name in resolvedHosts)
+    {
+        NSDictionary *details = resolvedHosts[name];
+        if (![name isKindOfClass:NSString.class] || ![details isKindOfClass:NSDictionary.class]) continue;
+        MFMIDIResolvedHostRecord record = {
+            name.UTF8String,
+            [details[@"address"] description].UTF8String ?: "",
+            (uint16_t)[details[@"port"] integerValue],
+            [details[@"lastResolved"] longLongValue]
+        };
+        proc(&record, refCon);
+    }
+}
+
+//---------------------------------------------------------------------
+
+static bool _MFUserDefaultsSaveResolvedHosts(void *context, const MFMIDIResolvedHostRecord *hosts, size_t count)
+{
+    @autoreleasepool
+    {
+        NSMutableDictionary *resolvedHosts = [NSMutableDictionary dictionaryWithCapacity:count];
+        for (size_t i=0; i<count; ++i)
+        {
+            NSString *name = @(hosts[i].name);
+            NSString *address = @(hosts[i].address);
+            if (!name || !address) continue;
+            resolvedHosts[name] = @{ @"address": address, @"port": @(hosts[i].port), @"lastResolved": @(hosts[i].lastResolved) };
+        }
+
+        NSUserDefaults *userDefs = [NSUserDefaults standardUserDefaults];
+        [userDefs setObject:resolvedHosts forKey:_kUserDefsKeyResolvedHosts];
+        return [userDefs synchronize];
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Public
+/////////////////////////////////////////////////////////////////////////
+
+const MFMIDIStateStorage *MFMIDIUserDefaultsStateStorage(void)
+{
+    static const MFMIDIStateStorage storage = {
+        .name = "NSUserDefaults",
+        .context = NULL,
+        .load = _MFUserDefaultsLoad,
+        .save = _MFUserDefaultsSave,
+        .loadResolvedHosts = _MFUserDefaultsLoadResolvedHosts,
+        .saveResolvedHosts = _MFUserDefaultsSaveResolvedHosts,
+    };
+    return &storage;
+}
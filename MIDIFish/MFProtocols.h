@@ -13,6 +13,7 @@
 #import <CoreMIDI/MIDINetworkSession.h>
 @class MFMIDIMessage;
 @class MFMIDISession;
+@class MFMIDIConnectionChanges;
 
 /** Protocols = verbs. Nouns are concrete classes. Don't rewrite until swift
     Ok I think we should unwind these protocols and make the private classes public. The confuscation isnt necessary I dont think. The key issues are around NetworkMIDIDestination (and analagously "..Source") which are at once MIDIConnections, MIDINetworkConnections, and MIDIDestination. Protocols should only be made where type genericity is required in the MIDISess or client code, e.g. to allow similar API for Endpoint and Network destinations even though they are different beasts */
@@ -77,6 +78,9 @@
 @protocol MFMIDIMessageReceiverDelegate <NSObject>
 @optional
 - (void)MIDISource:(id<MFMIDISource>)midiSource didReceiveMessage:(MFMIDIMessage *)message;
+
+/** MIDI 2.0: what arrived from the source since the last call as whole Universal MIDI Packets (see MFMIDIUMP.h). MIDI 1.0 sources' messages come translated to MIDI 2.0 channel voice. Called before, and as well as, `MIDISource:didReceiveMessage:` */
+- (void)MIDISource:(id<MFMIDISource>)midiSource didReceiveUMPWords:(const uint32_t *)words count:(NSUInteger)count;
 @end
 
 //---------------------------------------------------------------------
@@ -90,6 +94,10 @@
 /** Have the next level down as well too allow more complicated midi packets */
 - (void)sendMIDIPacketList:(MIDIPacketList *)packetList;
 
+@optional
+/** Send several messages packed into a single packet list so they go out together (one send per destination). Optional so senders written before it still conform. Check with `respondsToSelector:` when you don't know the sender's class */
+- (void)sendMIDIMessages:(NSArray *)messages;
+
 @end
 
 /////////////////////////////////////////////////////////////////////////
@@ -102,6 +110,12 @@
 - (void)MIDISessionDidBeginConnectionRefresh:(MFMIDISession *)midiSession;
 - (void)MIDISessionDidEndConnectionRefresh:(MFMIDISession *)midiSession;
 
+/** With `connectionChangeCoalescingInterval` set, sent instead of the four add/remove methods below with everything that changed over the interval */
+- (void)MIDISession:(MFMIDISession *)midiSession connectionsDidChange:(MFMIDIConnectionChanges *)changes;
+
+/** Partial results during a refresh, so UI can show hosts as they arrive rather than waiting for the end: once remembered hosts have been connected, then as each network service found resolves (or fails). Counts are of services found so far */
+- (void)MIDISession:(MFMIDISession *)midiSession connectionRefreshDidProgressWithResolvedCount:(NSUInteger)resolvedCount pendingCount:(NSUInteger)pendingCount;
+
 - (void)MIDISession:(MFMIDISession *)midiSession didAddSource:(id<MFMIDISource>)source;
 - (void)MIDISession:(MFMIDISession *)midiSession didRemoveSource:(id<MFMIDISource>)source;
 
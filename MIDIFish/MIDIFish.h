@@ -13,6 +13,26 @@
 #import "MFNonFatalException.h"
 #import "MFMIDISession.h"
 #import "MFMIDIMessage.h"
+#import "MFMIDIMessageValue.h"
+#import "MFMIDIEncoder.h"
+#import "MFMIDIParser.h"
+#import "MFMIDIBatch.h"
+#import "MFMIDIScheduler.h"
+#import "MFMIDICoalescer.h"
+#import "MFMIDIRunningStatus.h"
+#import "MFMIDITransform.h"
+#import "MFMIDISysexTransfer.h"
+#import "MFMIDIFileRecorder.h"
+#import "MFMIDIFilePlayer.h"
+#import "MFMIDIUMP.h"
+#import "MFMIDIRenderQueue.h"
+#import "MFMIDITrafficStatistics.h"
+#import "MFMIDITypes.h"
+#import "MFMIDIBackend.h"
+#import "MFMIDIStateStorage.h"
+#import "MFMIDIDiscovery.h"
+#import "MFMIDIConnectionChanges.h"
+#import "MFMIDILoopbackBackend.h"
 
 // Audiobus if supported
 //#ifdef ABSDKVersionString
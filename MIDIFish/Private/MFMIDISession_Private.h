@@ -20,5 +20,8 @@
 
 - (void)_setStateForEndpointConnection:(_MFMIDIEndpointConnection *)conx toEnabled:(BOOL)toEnabled;
 
+/** Endpoint display name from the session's backend */
+- (NSString *)_displayNameForEndpoint:(MIDIEndpointRef)endpoint;
+
 
 @end
@@ -0,0 +1,142 @@
+//
+//  _MFActiveNotes.c
+//  MIDIFish
+//
+//
+
+#include "_MFActiveNotes.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct _MFActiveNotesEntry {
+    uint64_t key;
+    _MFActiveNotes notes;
+    struct _MFActiveNotesEntry *next;
+} _MFActiveNotesEntry;
+
+struct _MFActiveNotesTable {
+    _MFActiveNotesEntry *entries;       // only ever grows
+    pthread_mutex_t lock;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Table
+/////////////////////////////////////////////////////////////////////////
+
+_MFActiveNotesTableRef _MFActiveNotesTableCreate(void)
+{
+    _MFActiveNotesTableRef table = calloc(1, sizeof(struct _MFActiveNotesTable));
+    if (!table) return NULL;
+    pthread_mutex_init(&table->lock, NULL);
+    return table;
+}
+
+//---------------------------------------------------------------------
+
+void _MFActiveNotesTableDestroy(_MFActiveNotesTableRef table)
+{
+    if (!table) return;
+    _MFActiveNotesEntry *entry = table->entries;
+    while (entry) {
+        _MFActiveNotesEntry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+//---------------------------------------------------------------------
+
+_MFActiveNotes *_MFActiveNotesTableGet(_MFActiveNotesTableRef table, uint64_t key)
+{
+    pthread_mutex_lock(&table->lock);
+    _MFActiveNotesEntry *entry = table->entries;
+    while (entry && entry->key != key) entry = entry->next;
+    if (!entry && (entry = calloc(1, sizeof(_MFActiveNotesEntry))))
+    {
+        // calloc zeroing is a valid initial state for the atomics on all our platforms
+        entry->key = key;
+        entry->next = table->entries;
+        table->entries = entry;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return entry ? &entry->notes : NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Tracking
+/////////////////////////////////////////////////////////////////////////
+
+static inline void _MFSetNote(_MFActiveNotes *notes, uint8_t channel, uint8_t note, bool isOn)
+{
+    const unsigned word = channel * 2 + (note >> 6);
+    const uint64_t bit = 1ull << (note & 63);
+    if (isOn) {
+        atomic_fetch_or_explicit(&notes->bits[word], bit, memory_order_relaxed);
+    } else {
+        atomic_fetch_and_explicit(&notes->bits[word], ~bit, memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------
+
+void _MFActiveNotesTrackPacketList(_MFActiveNotes *notes, const MIDIPacketList *packetList)
+{
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 0; i < packetList->numPackets; i++, packet = MIDIPacketNext(packet))
+    {
+        // Running status doesn't span packets. Only note messages matter; everything else just has its data skipped
+        uint8_t status = 0;
+        uint8_t data[2];
+        unsigned dataCount = 0;
+        for (UInt16 b = 0; b < packet->length; b++)
+        {
+            const uint8_t byte = packet->data[b];
+            if (byte >= 0xF8) continue;
+            if (byte & 0x80) {
+                status = byte;
+                dataCount = 0;
+                continue;
+            }
+
+            const uint8_t type = status & 0xF0;
+            if (type != 0x80 && type != 0x90) continue;
+
+            data[dataCount++] = byte;
+            if (dataCount < 2) continue;
+            dataCount = 0;
+            _MFSetNote(notes, status & 0x0F, data[0], type == 0x90 && data[1] != 0);
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+
+uint32_t _MFActiveNotesTake(_MFActiveNotes *notes, uint64_t outBits[_kMFActiveNotesWordCount])
+{
+    uint32_t count = 0;
+    for (unsigned w = 0; w < _kMFActiveNotesWordCount; w++)
+    {
+        outBits[w] = atomic_exchange_explicit(&notes->bits[w], 0, memory_order_relaxed);
+        count += (uint32_t)__builtin_popcountll(outBits[w]);
+    }
+    return count;
+}
+
+//---------------------------------------------------------------------
+
+uint32_t _MFActiveNotesCount(const _MFActiveNotes *notes)
+{
+    uint32_t count = 0;
+    for (unsigned w = 0; w < _kMFActiveNotesWordCount; w++) {
+        count += (uint32_t)__builtin_popcountll(atomic_load_explicit(&((_MFActiveNotes *)notes)->bits[w], memory_order_relaxed));
+    }
+    return count;
+}
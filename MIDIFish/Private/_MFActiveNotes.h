@@ -0,0 +1,59 @@
+//
+//  _MFActiveNotes.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish__MFActiveNotes_h
+#define MIDIFish__MFActiveNotes_h
+
+#include "MFMIDITypes.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Which notes are sounding on a destination, as a 16 channel x 128 note bitset, so a panic can send note offs for just those rather than CC 123 everywhere (which plenty of synths ignore).
+
+ The send path tracks each packet list as it goes to a destination: note ons set bits, note offs (and note ons with velocity 0) clear them. Atomic per 64-bit word so senders on several threads and a panic can all be at it together. Like traffic stats, one per endpoint (or Audiobus port) in a table which keeps them for the session's lifetime so the send routes can hold plain pointers.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define _kMFActiveNotesWordCount 32     // 2 per channel
+
+typedef struct _MFActiveNotes {
+    _Atomic uint64_t bits[_kMFActiveNotesWordCount];   // channel c note n is bit (n & 63) of word c * 2 + n / 64
+} _MFActiveNotes;
+
+typedef struct _MFActiveNotesTable *_MFActiveNotesTableRef;
+
+
+/** NULL on allocation failure */
+extern _MFActiveNotesTableRef _MFActiveNotesTableCreate(void);
+
+/** Nothing may be using its entries */
+extern void _MFActiveNotesTableDestroy(_MFActiveNotesTableRef table);
+
+/** The entry for `key`, created empty if new. NULL on allocation failure. Locks, so look up once and hold the pointer */
+extern _MFActiveNotes *_MFActiveNotesTableGet(_MFActiveNotesTableRef table, uint64_t key);
+
+
+/** Apply the note ons and offs in a packet list that went to the destination. Running status within a packet is understood. Real-time safe */
+extern void _MFActiveNotesTrackPacketList(_MFActiveNotes *notes, const MIDIPacketList *packetList);
+
+/** Atomically clear, copying out what was sounding. @return The number of notes */
+extern uint32_t _MFActiveNotesTake(_MFActiveNotes *notes, uint64_t outBits[_kMFActiveNotesWordCount]);
+
+/** Notes sounding now */
+extern uint32_t _MFActiveNotesCount(const _MFActiveNotes *notes);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+//
+//  _MFConnectionRegistry.h
+//  MIDIFish
+//
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreMIDI/CoreMIDI.h>
+
+@class _MFCoreMIDIConnection;
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** The session's connection lists. Virtual connections are in their endpoint list too (a Virtual Source is a local Endpoint Destination) */
+typedef NS_ENUM(NSUInteger, _MFConnectionList) {
+    _kMFConnectionListEndpointSources,
+    _kMFConnectionListEndpointDestinations,
+    _kMFConnectionListNetworkSources,
+    _kMFConnectionListNetworkDestinations,
+    _kMFConnectionListVirtualSources,
+    _kMFConnectionListVirtualDestinations,
+    _kMFConnectionListCount
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark -
+/////////////////////////////////////////////////////////////////////////
+
+/**
+ Everything MFMIDISession knows about its connections, indexed so lookups don't scan: endpoint lists by MIDIEndpointRef, network lists by host name (then `isEqual:`, ie. `hasSameHostAs:`), virtual lists by endpoint and name. Also the raw CoreMIDI endpoints seen by the last scan, as sets, so a refresh can diff against them.
+
+ Each list keeps its order. `connectionsInList:` returns an immutable snapshot which is built on first request after a change and then reused, so a hot-plug storm costs one copy per list rather than one per connection, and the public array properties can be handed out and enumerated while the lists change.
+
+ Mutate and look up from one thread (the session's, ie. main). Snapshots and counts are safe from any thread.
+ */
+@interface _MFConnectionRegistry : NSObject
+
+/** Immutable and in order of adding */
+- (NSArray *)connectionsInList:(_MFConnectionList)list;
+- (NSUInteger)countOfList:(_MFConnectionList)list;
+
+/** Appends. Doesn't check for duplicates; look it up first */
+- (void)addConnection:(_MFCoreMIDIConnection *)conx toList:(_MFConnectionList)list;
+
+/** @return NO if it wasn't there */
+- (BOOL)removeConnection:(_MFCoreMIDIConnection *)conx fromList:(_MFConnectionList)list;
+
+/** Not for the network lists as their connections all share the network session's endpoint */
+- (id)connectionInList:(_MFConnectionList)list withEndpoint:(MIDIEndpointRef)endpoint;
+
+/** Network and virtual lists only. Endpoint names can change under us */
+- (id)connectionInList:(_MFConnectionList)list withName:(NSString *)name;
+
+/** The connection in a network list with the same host as `conx` */
+- (id)connectionInList:(_MFConnectionList)list equalTo:(_MFCoreMIDIConnection *)conx;
+
+/** YES for the endpoint of one of our Virtual Sources/Destinations */
+- (BOOL)isVirtualEndpoint:(MIDIEndpointRef)endpoint;
+
+
+/** Raw CoreMIDI endpoints, including the network session's. `add` returns NO if it was already there @{ */
+- (BOOL)addEndpoint:(MIDIEndpointRef)endpoint isSource:(BOOL)isSource;
+- (void)removeEndpoint:(MIDIEndpointRef)endpoint isSource:(BOOL)isSource;
+- (BOOL)containsEndpoint:(MIDIEndpointRef)endpoint isSource:(BOOL)isSource;
+/** @} */
+
+/** A copy to tick off during a scan. What's left at the end has gone. [@(MIDIEndpointRef)] */
+- (NSMutableSet *)endpointsForDiffingIsSource:(BOOL)isSource;
+
+@end
@@ -0,0 +1,218 @@
+//
+//  _MFConnectionRegistry.m
+//  MIDIFish
+//
+//
+
+#import "_MFConnectionRegistry.h"
+#import "_MFCoreMIDIConnection.h"
+
+/** Normalise 32bit and 64bit heterogony. Same as the session's */
+#define _EP2Obj(endpoint) @(endpoint)
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - One List
+/////////////////////////////////////////////////////////////////////////
+
+/** @private */
+@interface _MFConnectionIndex : NSObject
+{
+@public
+    NSMutableArray *_connections;       // in order of adding
+    NSMutableDictionary *_byEndpoint;   // @(MIDIEndpointRef) -> conx. nil for network lists
+    NSMutableDictionary *_byName;       // name -> [conx]. nil for endpoint lists
+    NSArray *_snapshot;                 // nil when stale
+}
+@end
+
+@implementation _MFConnectionIndex
+@end
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark -
+/////////////////////////////////////////////////////////////////////////
+
+@implementation _MFConnectionRegistry
+{
+    _MFConnectionIndex *_lists[_kMFConnectionListCount];
+    NSMutableSet *_sourceEndpoints;         // [@(MIDIEndpointRef)]
+    NSMutableSet *_destinationEndpoints;
+}
+
+//---------------------------------------------------------------------
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self) {
+        for (NSUInteger i=0; i<_kMFConnectionListCount; i++)
+        {
+            const BOOL isNetwork = (i == _kMFConnectionListNetworkSources || i == _kMFConnectionListNetworkDestinations);
+            const BOOL isVirtual = (i == _kMFConnectionListVirtualSources || i == _kMFConnectionListVirtualDestinations);
+            _MFConnectionIndex *index = [_MFConnectionIndex new];
+            index->_connections = [NSMutableArray array];
+            index->_byEndpoint = isNetwork ? nil : [NSMutableDictionary dictionary];
+            index->_byName = (isNetwork || isVirtual) ? [NSMutableDictionary dictionary] : nil;
+            index->_snapshot = @[];
+            _lists[i] = index;
+        }
+        _sourceEndpoints = [NSMutableSet set];
+        _destinationEndpoints = [NSMutableSet set];
+    }
+    return self;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Connections
+/////////////////////////////////////////////////////////////////////////
+
+- (NSArray *)connectionsInList:(_MFConnectionList)list
+{
+    NSParameterAssert(list < _kMFConnectionListCount);
+    _MFConnectionIndex *index = _lists[list];
+    @synchronized(self) {
+        if (!index->_snapshot) index->_snapshot = [index->_connections copy];
+        return index->_snapshot;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (NSUInteger)countOfList:(_MFConnectionList)list
+{
+    NSParameterAssert(list < _kMFConnectionListCount);
+    @synchronized(self) {
+        return _lists[list]->_connections.count;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)addConnection:(_MFCoreMIDIConnection *)conx toList:(_MFConnectionList)list
+{
+    NSParameterAssert(conx && list < _kMFConnectionListCount);
+    _MFConnectionIndex *index = _lists[list];
+    @synchronized(self)
+    {
+        [index->_connections addObject:conx];
+        index->_byEndpoint[_EP2Obj(conx.endpoint)] = conx;
+        if (index->_byName)
+        {
+            NSString *name = conx.name ?: @"";
+            NSMutableArray *bucket = index->_byName[name];
+            if (!bucket) index->_byName[name] = bucket = [NSMutableArray arrayWithCapacity:1];
+            [bucket addObject:conx];
+        }
+        index->_snapshot = nil;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)removeConnection:(_MFCoreMIDIConnection *)conx fromList:(_MFConnectionList)list
+{
+    NSParameterAssert(list < _kMFConnectionListCount);
+    _MFConnectionIndex *index = _lists[list];
+    @synchronized(self)
+    {
+        const NSUInteger idx = [index->_connections indexOfObjectIdenticalTo:conx];
+        if (idx == NSNotFound) return NO;
+        [index->_connections removeObjectAtIndex:idx];
+
+        NSObject *endpointObj = _EP2Obj(conx.endpoint);
+        if (index->_byEndpoint[endpointObj] == conx) [index->_byEndpoint removeObjectForKey:endpointObj];
+        if (index->_byName)
+        {
+            // Look under its current name, falling back to all of them in case it's been renamed since it was added
+            NSString *name = conx.name ?: @"";
+            if ([index->_byName[name] indexOfObjectIdenticalTo:conx] == NSNotFound)
+            {
+                name = [index->_byName keysOfEntriesPassingTest:^BOOL(NSString *key, NSMutableArray *bucket, BOOL *stop) {
+                    return (*stop = [bucket indexOfObjectIdenticalTo:conx] != NSNotFound);
+                }].anyObject;
+            }
+            NSMutableArray *bucket = name ? index->_byName[name] : nil;
+            [bucket removeObjectIdenticalTo:conx];
+            if (bucket && !bucket.count) [index->_byName removeObjectForKey:name];
+        }
+        index->_snapshot = nil;
+        return YES;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (id)connectionInList:(_MFConnectionList)list withEndpoint:(MIDIEndpointRef)endpoint
+{
+    NSParameterAssert(list < _kMFConnectionListCount && _lists[list]->_byEndpoint);
+    return _lists[list]->_byEndpoint[_EP2Obj(endpoint)];
+}
+
+//---------------------------------------------------------------------
+
+- (id)connectionInList:(_MFConnectionList)list withName:(NSString *)name
+{
+    NSParameterAssert(list < _kMFConnectionListCount && _lists[list]->_byName);
+    return [_lists[list]->_byName[name ?: @""] firstObject];
+}
+
+//---------------------------------------------------------------------
+
+- (id)connectionInList:(_MFConnectionList)list equalTo:(_MFCoreMIDIConnection *)conx
+{
+    NSParameterAssert(list < _kMFConnectionListCount && _lists[list]->_byName);
+
+    // Equal network connections have the same name (see hasSameHostAs:) so only that bucket need be checked
+    for (_MFCoreMIDIConnection *candidate in _lists[list]->_byName[conx.name ?: @""]) {
+        if ([candidate isEqual:conx]) return candidate;
+    }
+    return nil;
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)isVirtualEndpoint:(MIDIEndpointRef)endpoint
+{
+    NSObject *endpointObj = _EP2Obj(endpoint);
+    return _lists[_kMFConnectionListVirtualSources]->_byEndpoint[endpointObj] != nil ||
+           _lists[_kMFConnectionListVirtualDestinations]->_byEndpoint[endpointObj] != nil;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Raw Endpoints
+/////////////////////////////////////////////////////////////////////////
+
+- (BOOL)addEndpoint:(MIDIEndpointRef)endpoint isSource:(BOOL)isSource
+{
+    NSMutableSet *endpoints = isSource ? _sourceEndpoints : _destinationEndpoints;
+    NSObject *endpointObj = _EP2Obj(endpoint);
+    if ([endpoints containsObject:endpointObj]) return NO;
+    [endpoints addObject:endpointObj];
+    return YES;
+}
+
+//---------------------------------------------------------------------
+
+- (void)removeEndpoint:(MIDIEndpointRef)endpoint isSource:(BOOL)isSource
+{
+    [(isSource ? _sourceEndpoints : _destinationEndpoints) removeObject:_EP2Obj(endpoint)];
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)containsEndpoint:(MIDIEndpointRef)endpoint isSource:(BOOL)isSource
+{
+    return [(isSource ? _sourceEndpoints : _destinationEndpoints) containsObject:_EP2Obj(endpoint)];
+}
+
+//---------------------------------------------------------------------
+
+- (NSMutableSet *)endpointsForDiffingIsSource:(BOOL)isSource
+{
+    return [(isSource ? _sourceEndpoints : _destinationEndpoints) mutableCopy];
+}
+
+@end
@@ -0,0 +1,571 @@
+//
+//  _MFConnectionStateStore.c
+//  MIDIFish
+//
+//
+
+#include "_MFConnectionStateStore.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+static const int64_t _kLastSeenResolution = 24 * 60 * 60;      // seconds
+static const size_t _kInitialCapacity = 64;                     // power of 2
+
+typedef struct {
+    char *storageID;                // NULL = empty slot
+    uint32_t hash;
+    bool enabled;
+    int64_t lastSeen;
+} _MFStateEntry;
+
+typedef struct {
+    char *name;
+    char *address;
+    uint16_t port;
+    int64_t lastResolved;           // resolved hosts only
+} _MFHost;
+
+typedef struct {
+    _MFHost *hosts;                 // few enough to scan
+    size_t count;
+    size_t capacity;
+} _MFHostList;
+
+struct _MFConnectionStateStore {
+    const MFMIDIStateStorage *storage;
+    pthread_mutex_t lock;
+    pthread_mutex_t saveLock;       // one save at a time, without holding up the store
+
+    // Open addressing, linear probing. Pruning rebuilds it
+    _MFStateEntry *entries;
+    size_t capacity;
+    size_t count;
+
+    _MFHostList manualHosts;
+    _MFHostList resolvedHosts;
+
+    bool dirty;                     // changes not yet handed to the storage
+    bool savePending;               // a mutator has told its caller to schedule a save which hasn't started yet
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Table Privates
+/////////////////////////////////////////////////////////////////////////
+
+/** FNV-1a */
+static uint32_t _MFHashString(const char *str)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+/** The entry for `storageID` or the empty slot it would go in */
+static _MFStateEntry *_MFFindSlot(_MFStateEntry *entries, size_t capacity, const char *storageID, uint32_t hash)
+{
+    size_t idx = hash & (capacity - 1);
+    for (;;)
+    {
+        _MFStateEntry *entry = &entries[idx];
+        if (!entry->storageID) return entry;
+        if (entry->hash == hash && strcmp(entry->storageID, storageID) == 0) return entry;
+        idx = (idx + 1) & (capacity - 1);
+    }
+}
+
+static bool _MFGrow(_MFConnectionStateStoreRef store)
+{
+    const size_t capacity = store->capacity * 2;
+    _MFStateEntry *entries = calloc(capacity, sizeof(_MFStateEntry));
+    if (!entries) return false;
+
+    for (size_t i = 0; i < store->capacity; i++)
+    {
+        const _MFStateEntry *old = &store->entries[i];
+        if (!old->storageID) continue;
+        *_MFFindSlot(entries, capacity, old->storageID, old->hash) = *old;
+    }
+    free(store->entries);
+    store->entries = entries;
+    store->capacity = capacity;
+    return true;
+}
+
+/** Existing or new (zeroed but for the ID) entry. NULL on allocation failure. Under lock */
+static _MFStateEntry *_MFGetEntry(_MFConnectionStateStoreRef store, const char *storageID, bool create)
+{
+    const uint32_t hash = _MFHashString(storageID);
+    _MFStateEntry *entry = _MFFindSlot(store->entries, store->capacity, storageID, hash);
+    if (entry->storageID || !create) return entry->storageID ? entry : NULL;
+
+    // Keep the load under 3/4
+    if ((store->count + 1) * 4 > store->capacity * 3) {
+        if (!_MFGrow(store)) return NULL;
+        entry = _MFFindSlot(store->entries, store->capacity, storageID, hash);
+    }
+
+    entry->storageID = strdup(storageID);
+    if (!entry->storageID) return NULL;
+    entry->hash = hash;
+    entry->enabled = false;
+    entry->lastSeen = 0;
+    store->count++;
+    return entry;
+}
+
+/** Under lock. @return Whether the caller should schedule a save */
+static bool _MFMarkDirty(_MFConnectionStateStoreRef store)
+{
+    store->dirty = true;
+    if (store->savePending) return false;
+    store->savePending = true;
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+static _MFHost *_MFFindHost(_MFHostList *list, const char *name)
+{
+    for (size_t i = 0; i < list->count; i++) {
+        if (strcmp(list->hosts[i].name, name) == 0) return &list->hosts[i];
+    }
+    return NULL;
+}
+
+static void _MFFreeHost(_MFHost *host)
+{
+    free(host->name);
+    free(host->address);
+}
+
+static void _MFFreeHostList(_MFHostList *list)
+{
+    for (size_t i = 0; i < list->count; i++) _MFFreeHost(&list->hosts[i]);
+    free(list->hosts);
+}
+
+/** Under lock */
+static bool _MFPutHost(_MFHostList *list, const char *name, const char *address, uint16_t port, int64_t lastResolved)
+{
+    char *addressCopy = strdup(address);
+    if (!addressCopy) return false;
+
+    _MFHost *host = _MFFindHost(list, name);
+    if (host)
+    {
+        free(host->address);
+        host->address = addressCopy;
+        host->port = port;
+        host->lastResolved = lastResolved;
+        return true;
+    }
+
+    if (list->count == list->capacity)
+    {
+        const size_t capacity = list->capacity ? list->capacity * 2 : 4;
+        _MFHost *hosts = realloc(list->hosts, capacity * sizeof(_MFHost));
+        if (!hosts) {
+            free(addressCopy);
+            return false;
+        }
+        list->hosts = hosts;
+        list->capacity = capacity;
+    }
+
+    char *nameCopy = strdup(name);
+    if (!nameCopy) {
+        free(addressCopy);
+        return false;
+    }
+    list->hosts[list->count++] = (_MFHost){ nameCopy, addressCopy, port, lastResolved };
+    return true;
+}
+
+/** Copies (strings included) so callbacks can run without the lock. Under lock. NULL if empty or on allocation failure */
+static _MFHost *_MFCopyHosts(const _MFHostList *list, size_t *outCount)
+{
+    _MFHost *copies = list->count ? calloc(list->count, sizeof(_MFHost)) : NULL;
+    for (size_t i = 0; copies && i < list->count; i++) {
+        copies[i] = list->hosts[i];
+        copies[i].name = strdup(list->hosts[i].name);
+        copies[i].address = strdup(list->hosts[i].address);
+    }
+    *outCount = copies ? list->count : 0;
+    return copies;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    _MFConnectionStateStoreRef store;
+    int64_t now;
+} _MFLoadContext;
+
+static void _MFLoadState(const MFMIDIConnectionStateRecord *record, void *refCon)
+{
+    _MFLoadContext *ctx = refCon;
+    _MFConnectionStateStoreRef store = ctx->store;
+    if (!record->storageID) return;
+
+    _MFStateEntry *entry = _MFGetEntry(store, record->storageID, true);
+    if (!entry) return;
+    entry->enabled = record->enabled;
+    entry->lastSeen = record->lastSeen;
+
+    // From before we kept times. Start their clocks now
+    if (!entry->lastSeen) {
+        entry->lastSeen = ctx->now;
+        store->dirty = true;
+    }
+}
+
+static void _MFLoadHost(const MFMIDIManualHostRecord *record, void *refCon)
+{
+    _MFLoadContext *ctx = refCon;
+    if (record->name && record->address) _MFPutHost(&ctx->store->manualHosts, record->name, record->address, record->port, 0);
+}
+
+static void _MFLoadResolvedHost(const MFMIDIResolvedHostRecord *record, void *refCon)
+{
+    _MFLoadContext *ctx = refCon;
+    if (record->name && record->address) _MFPutHost(&ctx->store->resolvedHosts, record->name, record->address, record->port, record->lastResolved ?: ctx->now);
+}
+
+//---------------------------------------------------------------------
+
+_MFConnectionStateStoreRef _MFConnectionStateStoreCreate(const MFMIDIStateStorage *storage, int64_t now)
+{
+    _MFConnectionStateStoreRef store = calloc(1, sizeof(struct _MFConnectionStateStore));
+    if (!store) return NULL;
+
+    store->storage = storage;
+    store->capacity = _kInitialCapacity;
+    store->entries = calloc(store->capacity, sizeof(_MFStateEntry));
+    if (!store->entries) {
+        free(store);
+        return NULL;
+    }
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_mutex_init(&store->saveLock, NULL);
+
+    _MFLoadContext ctx = { store, now };
+    if (storage && storage->load) storage->load(storage->context, _MFLoadState, _MFLoadHost, &ctx);
+    if (storage && storage->loadResolvedHosts) storage->loadResolvedHosts(storage->context, _MFLoadResolvedHost, &ctx);
+    return store;
+}
+
+//---------------------------------------------------------------------
+
+void _MFConnectionStateStoreDestroy(_MFConnectionStateStoreRef store)
+{
+    if (!store) return;
+    for (size_t i = 0; i < store->capacity; i++) free(store->entries[i].storageID);
+    _MFFreeHostList(&store->manualHosts);
+    _MFFreeHostList(&store->resolvedHosts);
+    free(store->entries);
+    pthread_mutex_destroy(&store->lock);
+    pthread_mutex_destroy(&store->saveLock);
+    free(store);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Enabled States
+/////////////////////////////////////////////////////////////////////////
+
+bool _MFConnectionStateStoreGetEnabled(_MFConnectionStateStoreRef store, const char *storageID, bool *outEnabled)
+{
+    pthread_mutex_lock(&store->lock);
+    const _MFStateEntry *entry = _MFGetEntry(store, storageID, false);
+    if (entry && outEnabled) *outEnabled = entry->enabled;
+    pthread_mutex_unlock(&store->lock);
+    return entry != NULL;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFConnectionStateStoreSetEnabled(_MFConnectionStateStoreRef store, const char *storageID, bool enabled, int64_t now)
+{
+    bool schedule = false;
+    pthread_mutex_lock(&store->lock);
+    _MFStateEntry *entry = _MFGetEntry(store, storageID, true);
+    if (entry && (entry->enabled != enabled || now - entry->lastSeen >= _kLastSeenResolution || !entry->lastSeen))
+    {
+        entry->enabled = enabled;
+        entry->lastSeen = now;
+        schedule = _MFMarkDirty(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return schedule;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFConnectionStateStoreTouch(_MFConnectionStateStoreRef store, const char *storageID, int64_t now)
+{
+    bool schedule = false;
+    pthread_mutex_lock(&store->lock);
+    _MFStateEntry *entry = _MFGetEntry(store, storageID, false);
+    if (entry && now - entry->lastSeen >= _kLastSeenResolution)
+    {
+        entry->lastSeen = now;
+        schedule = _MFMarkDirty(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return schedule;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFConnectionStateStorePrune(_MFConnectionStateStoreRef store, int64_t now, int64_t maxAge)
+{
+    if (maxAge <= 0) return false;
+
+    bool schedule = false;
+    pthread_mutex_lock(&store->lock);
+
+    // Open addressing can't simply empty a slot so rehash the survivors into a fresh table
+    size_t expired = 0;
+    for (size_t i = 0; i < store->capacity; i++) {
+        const _MFStateEntry *entry = &store->entries[i];
+        if (entry->storageID && now - entry->lastSeen > maxAge) expired++;
+    }
+
+    _MFStateEntry *entries = expired ? calloc(store->capacity, sizeof(_MFStateEntry)) : NULL;
+    if (entries)
+    {
+        for (size_t i = 0; i < store->capacity; i++)
+        {
+            _MFStateEntry *entry = &store->entries[i];
+            if (!entry->storageID) continue;
+            if (now - entry->lastSeen > maxAge) {
+                free(entry->storageID);
+                continue;
+            }
+            *_MFFindSlot(entries, store->capacity, entry->storageID, entry->hash) = *entry;
+        }
+        free(store->entries);
+        store->entries = entries;
+        store->count -= expired;
+        schedule = _MFMarkDirty(store);
+    }
+
+    // Resolved addresses of services long gone too
+    _MFHostList *resolved = &store->resolvedHosts;
+    for (size_t i = resolved->count; i-- > 0; )
+    {
+        if (now - resolved->hosts[i].lastResolved <= maxAge) continue;
+        _MFFreeHost(&resolved->hosts[i]);
+        resolved->hosts[i] = resolved->hosts[--resolved->count];
+        schedule = _MFMarkDirty(store) || schedule;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return schedule;
+}
+
+//---------------------------------------------------------------------
+
+size_t _MFConnectionStateStoreGetCount(_MFConnectionStateStoreRef store)
+{
+    pthread_mutex_lock(&store->lock);
+    const size_t count = store->count;
+    pthread_mutex_unlock(&store->lock);
+    return count;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Manual Hosts
+/////////////////////////////////////////////////////////////////////////
+
+bool _MFConnectionStateStoreSetManualHost(_MFConnectionStateStoreRef store, const char *name, const char *address, uint16_t port)
+{
+    pthread_mutex_lock(&store->lock);
+    const bool schedule = _MFPutHost(&store->manualHosts, name, address, port, 0) && _MFMarkDirty(store);
+    pthread_mutex_unlock(&store->lock);
+    return schedule;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFConnectionStateStoreRemoveManualHost(_MFConnectionStateStoreRef store, const char *name)
+{
+    bool schedule = false;
+    pthread_mutex_lock(&store->lock);
+    _MFHost *host = _MFFindHost(&store->manualHosts, name);
+    if (host)
+    {
+        _MFFreeHost(host);
+        *host = store->manualHosts.hosts[--store->manualHosts.count];
+        schedule = _MFMarkDirty(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return schedule;
+}
+
+//---------------------------------------------------------------------
+
+void _MFConnectionStateStoreEnumerateManualHosts(_MFConnectionStateStoreRef store, MFMIDIManualHostLoadProc proc, void *refCon)
+{
+    // Copy out so the proc can add/remove hosts
+    size_t count;
+    pthread_mutex_lock(&store->lock);
+    _MFHost *copies = _MFCopyHosts(&store->manualHosts, &count);
+    pthread_mutex_unlock(&store->lock);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (copies[i].name && copies[i].address) {
+            MFMIDIManualHostRecord record = { copies[i].name, copies[i].address, copies[i].port };
+            proc(&record, refCon);
+        }
+        _MFFreeHost(&copies[i]);
+    }
+    free(copies);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Resolved Hosts
+/////////////////////////////////////////////////////////////////////////
+
+bool _MFConnectionStateStoreSetResolvedHost(_MFConnectionStateStoreRef store, const char *name, const char *address, uint16_t port, int64_t now)
+{
+    bool schedule = false;
+    pthread_mutex_lock(&store->lock);
+    const _MFHost *host = _MFFindHost(&store->resolvedHosts, name);
+    const bool changed = !host || host->port != port || strcmp(host->address, address) != 0 || now - host->lastResolved >= _kLastSeenResolution;
+    if (changed && _MFPutHost(&store->resolvedHosts, name, address, port, now)) {
+        schedule = _MFMarkDirty(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return schedule;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFConnectionStateStoreGetResolvedHost(_MFConnectionStateStoreRef store, const char *name, char *addressBuffer, size_t bufferSize, uint16_t *outPort)
+{
+    if (!bufferSize) return false;
+
+    pthread_mutex_lock(&store->lock);
+    const _MFHost *host = _MFFindHost(&store->resolvedHosts, name);
+    if (host)
+    {
+        strncpy(addressBuffer, host->address, bufferSize - 1);
+        addressBuffer[bufferSize - 1] = '\0';
+        if (outPort) *outPort = host->port;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return host != NULL;
+}
+
+//---------------------------------------------------------------------
+
+void _MFConnectionStateStoreEnumerateResolvedHosts(_MFConnectionStateStoreRef store, MFMIDIResolvedHostLoadProc proc, void *refCon)
+{
+    size_t count;
+    pthread_mutex_lock(&store->lock);
+    _MFHost *copies = _MFCopyHosts(&store->resolvedHosts, &count);
+    pthread_mutex_unlock(&store->lock);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (copies[i].name && copies[i].address) {
+            MFMIDIResolvedHostRecord record = { copies[i].name, copies[i].address, copies[i].port, copies[i].lastResolved };
+            proc(&record, refCon);
+        }
+        _MFFreeHost(&copies[i]);
+    }
+    free(copies);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Saving
+/////////////////////////////////////////////////////////////////////////
+
+bool _MFConnectionStateStoreSave(_MFConnectionStateStoreRef store)
+{
+    if (!store->storage || !store->storage->save) return true;
+    pthread_mutex_lock(&store->saveLock);
+
+    // Snapshot (copying the strings) so the storage can take its time without the store locked
+    pthread_mutex_lock(&store->lock);
+    store->savePending = false;
+    if (!store->dirty) {
+        pthread_mutex_unlock(&store->lock);
+        pthread_mutex_unlock(&store->saveLock);
+        return true;
+    }
+
+    const size_t stateCount = store->count;
+    const size_t hostCount = store->manualHosts.count;
+    MFMIDIConnectionStateRecord *states = calloc(stateCount ?: 1, sizeof(MFMIDIConnectionStateRecord));
+    MFMIDIManualHostRecord *hosts = calloc(hostCount ?: 1, sizeof(MFMIDIManualHostRecord));
+    size_t resolvedCount = 0;
+    _MFHost *resolved = _MFCopyHosts(&store->resolvedHosts, &resolvedCount);
+    bool copied = states && hosts && resolvedCount == store->resolvedHosts.count;
+
+    size_t n = 0;
+    for (size_t i = 0; copied && i < store->capacity; i++)
+    {
+        const _MFStateEntry *entry = &store->entries[i];
+        if (!entry->storageID) continue;
+        states[n] = (MFMIDIConnectionStateRecord){ strdup(entry->storageID), entry->enabled, entry->lastSeen };
+        copied = states[n++].storageID != NULL;
+    }
+    for (size_t i = 0; copied && i < hostCount; i++)
+    {
+        const _MFHost *host = &store->manualHosts.hosts[i];
+        hosts[i] = (MFMIDIManualHostRecord){ strdup(host->name), strdup(host->address), host->port };
+        copied = hosts[i].name && hosts[i].address;
+    }
+    for (size_t i = 0; copied && i < resolvedCount; i++) {
+        copied = resolved[i].name && resolved[i].address;
+    }
+    if (copied) store->dirty = false;
+    pthread_mutex_unlock(&store->lock);
+
+    bool ok = copied && store->storage->save(store->storage->context, states, stateCount, hosts, hostCount);
+    if (ok && store->storage->saveResolvedHosts)
+    {
+        MFMIDIResolvedHostRecord *records = calloc(resolvedCount ?: 1, sizeof(MFMIDIResolvedHostRecord));
+        for (size_t i = 0; records && i < resolvedCount; i++) {
+            records[i] = (MFMIDIResolvedHostRecord){ resolved[i].name, resolved[i].address, resolved[i].port, resolved[i].lastResolved };
+        }
+        ok = records && store->storage->saveResolvedHosts(store->storage->context, records, resolvedCount);
+        free(records);
+    }
+
+    // Failed? Leave it dirty so the next change's save has another go
+    if (copied && !ok) {
+        pthread_mutex_lock(&store->lock);
+        store->dirty = true;
+        pthread_mutex_unlock(&store->lock);
+    }
+
+    for (size_t i = 0; states && i < stateCount; i++) free((char *)states[i].storageID);
+    for (size_t i = 0; hosts && i < hostCount; i++) {
+        free((char *)hosts[i].name);
+        free((char *)hosts[i].address);
+    }
+    for (size_t i = 0; i < resolvedCount; i++) _MFFreeHost(&resolved[i]);
+    free(states);
+    free(hosts);
+    free(resolved);
+
+    pthread_mutex_unlock(&store->saveLock);
+    return ok;
+}
@@ -0,0 +1,77 @@
+//
+//  _MFConnectionStateStore.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish__MFConnectionStateStore_h
+#define MIDIFish__MFConnectionStateStore_h
+
+#include "MFMIDIStateStorage.h"
+
+/**
+ In-memory copy of the persisted connection state, loaded once from an `MFMIDIStateStorage` and written back in one go by `_MFConnectionStateStoreSave`.
+
+ Enabled states are in a hash table keyed by storage ID so a refresh's lookups are cheap. Manual and resolved network hosts are in short arrays. Each state remembers when its connection was last seen so `_MFConnectionStateStorePrune` can drop ones long gone rather than the store growing forever. Last seen times are kept to the day so merely seeing a connection again doesn't make the store dirty on every refresh.
+
+ Thread safe. Mutators return true when the store has just become dirty, ie. when the caller should arrange a save; further changes before that save are picked up by it (write-behind).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _MFConnectionStateStore *_MFConnectionStateStoreRef;
+
+/**
+ Loads from `storage` straight away. NULL storage for an empty store which never saves.
+ @param now Seconds since 1970. Entries with no last seen time count as seen now
+ @return NULL on allocation failure
+ */
+extern _MFConnectionStateStoreRef _MFConnectionStateStoreCreate(const MFMIDIStateStorage *storage, int64_t now);
+
+/** Doesn't save. Do that first if need be */
+extern void _MFConnectionStateStoreDestroy(_MFConnectionStateStoreRef store);
+
+/** @return false if there's no stored state for `storageID` */
+extern bool _MFConnectionStateStoreGetEnabled(_MFConnectionStateStoreRef store, const char *storageID, bool *outEnabled);
+
+/** Store the state, which also counts as seeing it. @return true if a save should be scheduled */
+extern bool _MFConnectionStateStoreSetEnabled(_MFConnectionStateStoreRef store, const char *storageID, bool enabled, int64_t now);
+
+/** Update the last seen time of an existing entry. @return true if a save should be scheduled */
+extern bool _MFConnectionStateStoreTouch(_MFConnectionStateStoreRef store, const char *storageID, int64_t now);
+
+/** Drop enabled states last seen, and resolved hosts last resolved, more than `maxAge` seconds before `now`. maxAge 0 is a no-op. @return true if a save should be scheduled */
+extern bool _MFConnectionStateStorePrune(_MFConnectionStateStoreRef store, int64_t now, int64_t maxAge);
+
+/** Add or replace. @return true if a save should be scheduled */
+extern bool _MFConnectionStateStoreSetManualHost(_MFConnectionStateStoreRef store, const char *name, const char *address, uint16_t port);
+
+/** @return true if a save should be scheduled (ie it was there) */
+extern bool _MFConnectionStateStoreRemoveManualHost(_MFConnectionStateStoreRef store, const char *name);
+
+/** Calls back with a copy of each, so the proc is free to call back into the store */
+extern void _MFConnectionStateStoreEnumerateManualHosts(_MFConnectionStateStoreRef store, MFMIDIManualHostLoadProc proc, void *refCon);
+
+/** Remember the address a network service last resolved to. Times are kept to the day, as for last seen. @return true if a save should be scheduled */
+extern bool _MFConnectionStateStoreSetResolvedHost(_MFConnectionStateStoreRef store, const char *name, const char *address, uint16_t port, int64_t now);
+
+/** @return false if `name` hasn't been resolved (or was pruned) */
+extern bool _MFConnectionStateStoreGetResolvedHost(_MFConnectionStateStoreRef store, const char *name, char *addressBuffer, size_t bufferSize, uint16_t *outPort);
+
+/** As for manual hosts */
+extern void _MFConnectionStateStoreEnumerateResolvedHosts(_MFConnectionStateStoreRef store, MFMIDIResolvedHostLoadProc proc, void *refCon);
+
+/** Number of enabled state entries */
+extern size_t _MFConnectionStateStoreGetCount(_MFConnectionStateStoreRef store);
+
+/** Write everything to the storage if anything's changed. Blocks for the write but not other users of the store. @return false if the storage failed (it stays dirty) */
+extern bool _MFConnectionStateStoreSave(_MFConnectionStateStoreRef store);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,6 +8,7 @@
 
 #import "_MFCoreMIDIConnection.h"
 #import "_MFUtilities.h"
+#import "MFMIDISession_Private.h"
 
 @implementation _MFCoreMIDIConnection
 
@@ -37,7 +38,9 @@
 
 - (NSString *)name
 {
-    return _MFGetMIDIObjectDisplayName(self.endpoint);
+    // Via the session, which caches it and goes through its backend so it works for simulated endpoints too
+    MFMIDISession *client = self.client;
+    return client ? [client _displayNameForEndpoint:self.endpoint] : _MFGetMIDIObjectDisplayName(self.endpoint);
 }
 
 //---------------------------------------------------------------------
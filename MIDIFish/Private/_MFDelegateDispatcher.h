@@ -0,0 +1,72 @@
+//
+//  _MFDelegateDispatcher.h
+//  MIDIFish
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "MFProtocols.h"
+
+@class MFMIDISession;
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** The optional delegate methods, as bits. Worked out once per delegate when it's added */
+typedef NS_OPTIONS(uint32_t, _MFDelegateCapability) {
+    _kMFDelegateCapabilityRefreshDidBegin       = 1 << 0,
+    _kMFDelegateCapabilityRefreshDidProgress    = 1 << 1,
+    _kMFDelegateCapabilityRefreshDidEnd         = 1 << 2,
+    _kMFDelegateCapabilityDidAddSource          = 1 << 3,
+    _kMFDelegateCapabilityDidRemoveSource       = 1 << 4,
+    _kMFDelegateCapabilityDidAddDestination     = 1 << 5,
+    _kMFDelegateCapabilityDidRemoveDestination  = 1 << 6,
+    _kMFDelegateCapabilityConnectionsDidChange  = 1 << 7,
+    _kMFDelegateCapabilityDidReceiveMessage     = 1 << 8,
+    _kMFDelegateCapabilityDidReceiveUMP         = 1 << 9,
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark -
+/////////////////////////////////////////////////////////////////////////
+
+/**
+ MFMIDISession's delegates and the delivery of its connection and refresh events to them.
+
+ Delegates are kept in an immutable snapshot, with the methods each implements as a `_MFDelegateCapability` mask, so sending an event is a walk of the snapshot testing bits rather than a `respondsToSelector:` per delegate per event, and an event no delegate wants costs nothing.
+
+ Events go out synchronously on the caller's thread unless a `queue` is set, in which case they're dispatched onto it in order. With a `coalescingInterval`, connection adds/removes aren't sent one by one but collected into a single `MIDISession:connectionsDidChange:` sent that long after the first of them. Pending changes always go out ahead of a refresh event so the two stay in order.
+
+ Thread safe.
+ */
+@interface _MFDelegateDispatcher : NSObject
+
+- (instancetype)initWithSession:(MFMIDISession *)session;
+
+/** nil for synchronous delivery. Should be serial */
+@property (atomic, strong) dispatch_queue_t queue;
+
+/** 0 sends each connection change as it happens */
+@property (atomic) NSTimeInterval coalescingInterval;
+
+/** Duplicates are allowed (and all removed together), as the session has always done @{ */
+- (void)addDelegate:(id)delegate;
+- (void)removeDelegate:(id)delegate;
+/** @} */
+
+/** Whether any delegate implements the method. Cheap */
+- (BOOL)hasDelegateWithCapability:(_MFDelegateCapability)capability;
+
+/** Synchronous, on the caller's thread, whatever the queue. Delegates added or removed meanwhile don't affect it */
+- (void)enumerateDelegatesWithCapability:(_MFDelegateCapability)capability usingBlock:(void (^)(id delegate))block;
+
+/** Events @{ */
+- (void)connection:(id<MFMIDIConnection>)conx didConnect:(BOOL)isConnect;
+- (void)refreshDidBegin;
+- (void)refreshDidProgressWithResolvedCount:(NSUInteger)resolvedCount pendingCount:(NSUInteger)pendingCount;
+- (void)refreshDidEnd;
+/** @} */
+
+@end
@@ -0,0 +1,324 @@
+//
+//  _MFDelegateDispatcher.m
+//  MIDIFish
+//
+//
+
+#import "_MFDelegateDispatcher.h"
+#import "MFMIDISession.h"
+#import "MFMIDIConnectionChanges.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** @private */
+@interface _MFDelegateEntry : NSObject
+{
+@public
+    id _delegate;
+    _MFDelegateCapability _capabilities;
+}
+@end
+
+@implementation _MFDelegateEntry
+@end
+
+//---------------------------------------------------------------------
+
+static _MFDelegateCapability _MFCapabilitiesOfDelegate(id delegate)
+{
+    static const struct { SEL selector; _MFDelegateCapability capability; } map[] = {
+        { @selector(MIDISessionDidBeginConnectionRefresh:), _kMFDelegateCapabilityRefreshDidBegin },
+        { @selector(MIDISession:connectionRefreshDidProgressWithResolvedCount:pendingCount:), _kMFDelegateCapabilityRefreshDidProgress },
+        { @selector(MIDISessionDidEndConnectionRefresh:), _kMFDelegateCapabilityRefreshDidEnd },
+        { @selector(MIDISession:didAddSource:), _kMFDelegateCapabilityDidAddSource },
+        { @selector(MIDISession:didRemoveSource:), _kMFDelegateCapabilityDidRemoveSource },
+        { @selector(MIDISession:didAddDestination:), _kMFDelegateCapabilityDidAddDestination },
+        { @selector(MIDISession:didRemoveDestination:), _kMFDelegateCapabilityDidRemoveDestination },
+        { @selector(MIDISession:connectionsDidChange:), _kMFDelegateCapabilityConnectionsDidChange },
+        { @selector(MIDISource:didReceiveMessage:), _kMFDelegateCapabilityDidReceiveMessage },
+        { @selector(MIDISource:didReceiveUMPWords:count:), _kMFDelegateCapabilityDidReceiveUMP },
+    };
+    _MFDelegateCapability capabilities = 0;
+    for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+        if ([delegate respondsToSelector:map[i].selector]) capabilities |= map[i].capability;
+    }
+    return capabilities;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark -
+/////////////////////////////////////////////////////////////////////////
+
+@implementation _MFDelegateDispatcher
+{
+    __weak MFMIDISession *_session;
+    NSArray *_entries;                      // [_MFDelegateEntry]. Immutable, replaced on add/remove
+    _MFDelegateCapability _anyCapabilities; // union of the entries'
+    NSMutableDictionary *_isSourceByClass;  // Class -> @(BOOL). Saves a conformsToProtocol: per event
+
+    // Connection changes awaiting the coalescing interval. Under @synchronized(_pendingAdded)
+    NSMutableArray *_pendingAdded;
+    NSMutableArray *_pendingRemoved;
+    BOOL _flushScheduled;
+}
+
+- (instancetype)initWithSession:(MFMIDISession *)session
+{
+    self = [super init];
+    if (self) {
+        _session = session;
+        _entries = @[];
+        _isSourceByClass = [NSMutableDictionary dictionary];
+        _pendingAdded = [NSMutableArray array];
+        _pendingRemoved = [NSMutableArray array];
+    }
+    return self;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Delegates
+/////////////////////////////////////////////////////////////////////////
+
+- (void)addDelegate:(id)delegate
+{
+    NSParameterAssert(delegate);
+    _MFDelegateEntry *entry = [_MFDelegateEntry new];
+    entry->_delegate = delegate;
+    entry->_capabilities = _MFCapabilitiesOfDelegate(delegate);
+
+    @synchronized(self) {
+        _entries = [_entries arrayByAddingObject:entry];
+        _anyCapabilities |= entry->_capabilities;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)removeDelegate:(id)delegate
+{
+    @synchronized(self)
+    {
+        NSMutableArray *entries = [NSMutableArray arrayWithCapacity:_entries.count];
+        _MFDelegateCapability anyCapabilities = 0;
+        for (_MFDelegateEntry *entry in _entries)
+        {
+            if ([entry->_delegate isEqual:delegate]) continue;
+            [entries addObject:entry];
+            anyCapabilities |= entry->_capabilities;
+        }
+        _entries = [entries copy];
+        _anyCapabilities = anyCapabilities;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (BOOL)hasDelegateWithCapability:(_MFDelegateCapability)capability
+{
+    @synchronized(self) {
+        return (_anyCapabilities & capability) != 0;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)enumerateDelegatesWithCapability:(_MFDelegateCapability)capability usingBlock:(void (^)(id))block
+{
+    NSArray *entries;
+    @synchronized(self) {
+        if (!(_anyCapabilities & capability)) return;
+        entries = _entries;
+    }
+    for (_MFDelegateEntry *entry in entries) {
+        if (entry->_capabilities & capability) block(entry->_delegate);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Events
+/////////////////////////////////////////////////////////////////////////
+
+- (void)connection:(id<MFMIDIConnection>)conx didConnect:(BOOL)isConnect
+{
+    if (self.coalescingInterval > 0) {
+        [self _addPendingConnection:conx didConnect:isConnect];
+        return;
+    }
+
+    const BOOL isSource = [self _isSource:conx];
+    if (isSource && isConnect) {
+        [self _sendEventWithCapability:_kMFDelegateCapabilityDidAddSource block:^(id<MFMIDISessionDelegate> delegate, MFMIDISession *session) {
+            [delegate MIDISession:session didAddSource:(id)conx];
+        }];
+    } else if (isSource) {
+        [self _sendEventWithCapability:_kMFDelegateCapabilityDidRemoveSource block:^(id<MFMIDISessionDelegate> delegate, MFMIDISession *session) {
+            [delegate MIDISession:session didRemoveSource:(id)conx];
+        }];
+    } else if (isConnect) {
+        [self _sendEventWithCapability:_kMFDelegateCapabilityDidAddDestination block:^(id<MFMIDISessionDelegate> delegate, MFMIDISession *session) {
+            [delegate MIDISession:session didAddDestination:(id)conx];
+        }];
+    } else {
+        [self _sendEventWithCapability:_kMFDelegateCapabilityDidRemoveDestination block:^(id<MFMIDISessionDelegate> delegate, MFMIDISession *session) {
+            [delegate MIDISession:session didRemoveDestination:(id)conx];
+        }];
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)refreshDidBegin
+{
+    [self _sendEventWithCapability:_kMFDelegateCapabilityRefreshDidBegin block:^(id<MFMIDISessionDelegate> delegate, MFMIDISession *session) {
+        [delegate MIDISessionDidBeginConnectionRefresh:session];
+    }];
+}
+
+//---------------------------------------------------------------------
+
+- (void)refreshDidProgressWithResolvedCount:(NSUInteger)resolvedCount pendingCount:(NSUInteger)pendingCount
+{
+    [self _sendEventWithCapability:_kMFDelegateCapabilityRefreshDidProgress block:^(id<MFMIDISessionDelegate> delegate, MFMIDISession *session) {
+        [delegate MIDISession:session connectionRefreshDidProgressWithResolvedCount:resolvedCount pendingCount:pendingCount];
+    }];
+}
+
+//---------------------------------------------------------------------
+
+- (void)refreshDidEnd
+{
+    [self _sendEventWithCapability:_kMFDelegateCapabilityRefreshDidEnd block:^(id<MFMIDISessionDelegate> delegate, MFMIDISession *session) {
+        [delegate MIDISessionDidEndConnectionRefresh:session];
+    }];
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Privates
+/////////////////////////////////////////////////////////////////////////
+
+- (BOOL)_isSource:(id<MFMIDIConnection>)conx
+{
+    Class cls = conx.class;
+    @synchronized(_isSourceByClass)
+    {
+        NSNumber *isSource = _isSourceByClass[(id<NSCopying>)cls];
+        if (!isSource) {
+            isSource = @([conx conformsToProtocol:@protocol(MFMIDISource)]);
+            _isSourceByClass[(id<NSCopying>)cls] = isSource;
+        }
+        return isSource.boolValue;
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** Sends to the delegates (as of now) which implement it. Any coalesced changes waiting go first */
+- (void)_sendEventWithCapability:(_MFDelegateCapability)capability block:(void (^)(id delegate, MFMIDISession *session))block
+{
+    MFMIDIConnectionChanges *changes = [self _takePendingChanges];
+    NSArray *entries;
+    @synchronized(self) {
+        if (!changes && !(_anyCapabilities & capability)) return;
+        entries = _entries;
+    }
+
+    __weak MFMIDISession *weakSession = _session;
+    void (^deliver)(void) = ^{
+        MFMIDISession *session = weakSession;
+        if (!session) return;
+        for (_MFDelegateEntry *entry in entries)
+        {
+            if (changes && (entry->_capabilities & _kMFDelegateCapabilityConnectionsDidChange)) {
+                [entry->_delegate MIDISession:session connectionsDidChange:changes];
+            }
+        }
+        for (_MFDelegateEntry *entry in entries) {
+            if (entry->_capabilities & capability) block(entry->_delegate, session);
+        }
+    };
+
+    dispatch_queue_t queue = self.queue;
+    if (queue) {
+        dispatch_async(queue, deliver);
+    } else {
+        deliver();
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** Record the change, cancelling out an opposite one still pending, and arrange the flush if it's the first */
+- (void)_addPendingConnection:(id<MFMIDIConnection>)conx didConnect:(BOOL)isConnect
+{
+    BOOL scheduleFlush = NO;
+    @synchronized(_pendingAdded)
+    {
+        NSMutableArray *opposite = isConnect ? _pendingRemoved : _pendingAdded;
+        const NSUInteger idx = [opposite indexOfObjectIdenticalTo:conx];
+        if (idx != NSNotFound) {
+            [opposite removeObjectAtIndex:idx];
+        } else {
+            [(isConnect ? _pendingAdded : _pendingRemoved) addObject:conx];
+        }
+        if (!_flushScheduled) {
+            _flushScheduled = YES;
+            scheduleFlush = YES;
+        }
+    }
+    if (!scheduleFlush) return;
+
+    __weak typeof(self) weakSelf = self;
+    dispatch_queue_t queue = self.queue ?: dispatch_get_main_queue();
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.coalescingInterval * NSEC_PER_SEC)), queue, ^{
+        [weakSelf _flushPendingChanges];
+    });
+}
+
+//---------------------------------------------------------------------
+
+/** On the delivery queue (or main) */
+- (void)_flushPendingChanges
+{
+    MFMIDIConnectionChanges *changes = [self _takePendingChanges];
+    MFMIDISession *session = _session;
+    if (!changes || !session) return;
+
+    [self enumerateDelegatesWithCapability:_kMFDelegateCapabilityConnectionsDidChange usingBlock:^(id<MFMIDISessionDelegate> delegate) {
+        [delegate MIDISession:session connectionsDidChange:changes];
+    }];
+}
+
+//---------------------------------------------------------------------
+
+/** nil if there are none (or they cancelled out) */
+- (MFMIDIConnectionChanges *)_takePendingChanges
+{
+    NSArray *added, *removed;
+    @synchronized(_pendingAdded)
+    {
+        _flushScheduled = NO;
+        if (!_pendingAdded.count && !_pendingRemoved.count) return nil;
+        added = [_pendingAdded copy];
+        removed = [_pendingRemoved copy];
+        [_pendingAdded removeAllObjects];
+        [_pendingRemoved removeAllObjects];
+    }
+
+    NSMutableArray *addedSources = [NSMutableArray array], *addedDestinations = [NSMutableArray array];
+    NSMutableArray *removedSources = [NSMutableArray array], *removedDestinations = [NSMutableArray array];
+    for (id conx in added) {
+        [([self _isSource:conx] ? addedSources : addedDestinations) addObject:conx];
+    }
+    for (id conx in removed) {
+        [([self _isSource:conx] ? removedSources : removedDestinations) addObject:conx];
+    }
+    return [[MFMIDIConnectionChanges alloc] initWithAddedSources:addedSources removedSources:removedSources addedDestinations:addedDestinations removedDestinations:removedDestinations];
+}
+
+@end
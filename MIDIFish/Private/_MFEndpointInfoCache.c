@@ -0,0 +1,209 @@
+//
+//  _MFEndpointInfoCache.c
+//  MIDIFish
+//
+//
+
+#include "_MFEndpointInfoCache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+static const size_t _kInitialCapacity = 64;     // power of 2
+
+/** Room for a display name fetched from the backend */
+#define _NAME_BUFFER_SIZE 256
+
+typedef struct {
+    MIDIEndpointRef endpoint;       // 0 = empty slot
+    uint32_t generation;            // bumped on invalidation so in-flight queries don't store stale results
+    char *displayName;              // NULL until fetched
+    bool hasNetworkFlag;
+    bool isNetworkSessionEndpoint;
+} _MFEndpointInfo;
+
+struct _MFEndpointInfoCache {
+    const MFMIDIBackend *backend;
+    pthread_mutex_t lock;
+    uint32_t generation;            // bumped on invalidating everything
+    _MFEndpointInfo *entries;       // open addressing, linear probing. Slots are never emptied, only cleared
+    size_t capacity;
+    size_t count;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Table Privates
+/////////////////////////////////////////////////////////////////////////
+
+static size_t _MFHashEndpoint(MIDIEndpointRef endpoint)
+{
+    // Refs are often sequential. Spread them (Knuth's multiplicative hash)
+    return (size_t)((uint32_t)endpoint * 2654435761u);
+}
+
+static _MFEndpointInfo *_MFFindSlot(_MFEndpointInfo *entries, size_t capacity, MIDIEndpointRef endpoint)
+{
+    size_t idx = _MFHashEndpoint(endpoint) & (capacity - 1);
+    while (entries[idx].endpoint && entries[idx].endpoint != endpoint) {
+        idx = (idx + 1) & (capacity - 1);
+    }
+    return &entries[idx];
+}
+
+/** LOCKED. NULL on allocation failure */
+static _MFEndpointInfo *_MFGetInfo(_MFEndpointInfoCacheRef cache, MIDIEndpointRef endpoint)
+{
+    _MFEndpointInfo *info = _MFFindSlot(cache->entries, cache->capacity, endpoint);
+    if (info->endpoint) return info;
+
+    // Keep the load under 3/4
+    if ((cache->count + 1) * 4 > cache->capacity * 3)
+    {
+        const size_t capacity = cache->capacity * 2;
+        _MFEndpointInfo *entries = calloc(capacity, sizeof(_MFEndpointInfo));
+        if (!entries) return NULL;
+        for (size_t i = 0; i < cache->capacity; i++) {
+            if (cache->entries[i].endpoint) *_MFFindSlot(entries, capacity, cache->entries[i].endpoint) = cache->entries[i];
+        }
+        free(cache->entries);
+        cache->entries = entries;
+        cache->capacity = capacity;
+        info = _MFFindSlot(entries, capacity, endpoint);
+    }
+
+    info->endpoint = endpoint;
+    cache->count++;
+    return info;
+}
+
+static void _MFClearInfo(_MFEndpointInfo *info)
+{
+    free(info->displayName);
+    info->displayName = NULL;
+    info->hasNetworkFlag = false;
+    info->generation++;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+_MFEndpointInfoCacheRef _MFEndpointInfoCacheCreate(const MFMIDIBackend *backend)
+{
+    _MFEndpointInfoCacheRef cache = calloc(1, sizeof(struct _MFEndpointInfoCache));
+    if (!cache) return NULL;
+    cache->backend = backend;
+    cache->capacity = _kInitialCapacity;
+    cache->entries = calloc(cache->capacity, sizeof(_MFEndpointInfo));
+    if (!cache->entries) {
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+//---------------------------------------------------------------------
+
+void _MFEndpointInfoCacheDestroy(_MFEndpointInfoCacheRef cache)
+{
+    if (!cache) return;
+    for (size_t i = 0; i < cache->capacity; i++) free(cache->entries[i].displayName);
+    free(cache->entries);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Lookups
+/////////////////////////////////////////////////////////////////////////
+
+bool _MFEndpointInfoCacheGetDisplayName(_MFEndpointInfoCacheRef cache, MIDIEndpointRef endpoint, char *buffer, size_t bufferSize)
+{
+    if (!bufferSize) return false;
+
+    pthread_mutex_lock(&cache->lock);
+    _MFEndpointInfo *info = _MFGetInfo(cache, endpoint);
+    if (info && info->displayName)
+    {
+        strncpy(buffer, info->displayName, bufferSize - 1);
+        buffer[bufferSize - 1] = '\0';
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+    }
+    const uint32_t generation = info ? info->generation : 0;
+    const uint32_t cacheGeneration = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+
+    // Miss. Ask the backend (in full, so a later caller with a bigger buffer isn't short changed)
+    char name[_NAME_BUFFER_SIZE];
+    if (!cache->backend->getDisplayName(cache->backend->context, endpoint, name, sizeof(name))) return false;
+    strncpy(buffer, name, bufferSize - 1);
+    buffer[bufferSize - 1] = '\0';
+
+    pthread_mutex_lock(&cache->lock);
+    info = info ? _MFGetInfo(cache, endpoint) : NULL;
+    if (info && !info->displayName && info->generation == generation && cache->generation == cacheGeneration) {
+        info->displayName = strdup(name);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFEndpointInfoCacheIsNetworkSessionEndpoint(_MFEndpointInfoCacheRef cache, MIDIEndpointRef endpoint)
+{
+    pthread_mutex_lock(&cache->lock);
+    _MFEndpointInfo *info = _MFGetInfo(cache, endpoint);
+    if (info && info->hasNetworkFlag)
+    {
+        const bool isNetwork = info->isNetworkSessionEndpoint;
+        pthread_mutex_unlock(&cache->lock);
+        return isNetwork;
+    }
+    const uint32_t generation = info ? info->generation : 0;
+    const uint32_t cacheGeneration = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+
+    const bool isNetwork = cache->backend->isNetworkSessionEndpoint(cache->backend->context, endpoint);
+
+    pthread_mutex_lock(&cache->lock);
+    info = info ? _MFGetInfo(cache, endpoint) : NULL;
+    if (info && info->generation == generation && cache->generation == cacheGeneration) {
+        info->isNetworkSessionEndpoint = isNetwork;
+        info->hasNetworkFlag = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return isNetwork;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Invalidation
+/////////////////////////////////////////////////////////////////////////
+
+void _MFEndpointInfoCacheInvalidate(_MFEndpointInfoCacheRef cache, MIDIEndpointRef endpoint)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (endpoint)
+    {
+        _MFEndpointInfo *info = _MFFindSlot(cache->entries, cache->capacity, endpoint);
+        if (info->endpoint) _MFClearInfo(info);
+    }
+    else
+    {
+        for (size_t i = 0; i < cache->capacity; i++) {
+            if (cache->entries[i].endpoint) _MFClearInfo(&cache->entries[i]);
+        }
+        cache->generation++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
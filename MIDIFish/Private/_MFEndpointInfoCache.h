@@ -0,0 +1,41 @@
+//
+//  _MFEndpointInfoCache.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish__MFEndpointInfoCache_h
+#define MIDIFish__MFEndpointInfoCache_h
+
+#include "MFMIDIBackend.h"
+
+/**
+ Per-endpoint copy of the properties the session reads (display name, network session flag) so connection names, storage IDs, logging and refresh scans don't each round-trip to the MIDI server. Each property is fetched from the backend on first use and kept until invalidated, which the session does on the backend's property changed and endpoint removed notifications.
+
+ Thread safe. Backend queries are made without the lock held, and a result is only kept if nothing invalidated the endpoint meanwhile.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _MFEndpointInfoCache *_MFEndpointInfoCacheRef;
+
+/** @param backend Must outlive the cache. @return NULL on allocation failure */
+extern _MFEndpointInfoCacheRef _MFEndpointInfoCacheCreate(const MFMIDIBackend *backend);
+extern void _MFEndpointInfoCacheDestroy(_MFEndpointInfoCacheRef cache);
+
+/** As the backend's getDisplayName. @return false if unknown (which isn't cached) */
+extern bool _MFEndpointInfoCacheGetDisplayName(_MFEndpointInfoCacheRef cache, MIDIEndpointRef endpoint, char *buffer, size_t bufferSize);
+
+extern bool _MFEndpointInfoCacheIsNetworkSessionEndpoint(_MFEndpointInfoCacheRef cache, MIDIEndpointRef endpoint);
+
+/** Forget what's cached for `endpoint`, or for every endpoint if 0 */
+extern void _MFEndpointInfoCacheInvalidate(_MFEndpointInfoCacheRef cache, MIDIEndpointRef endpoint);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
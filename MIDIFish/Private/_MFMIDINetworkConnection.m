@@ -99,6 +99,14 @@ static NSMutableArray *_tmpRetainer;
 
 //---------------------------------------------------------------------
 
+/** @override Equal connections always have the same name (see `hasSameHostAs:`) so they can go in sets and key dictionaries */
+- (NSUInteger)hash
+{
+    return self.name.hash;
+}
+
+//---------------------------------------------------------------------
+
 - (void)setEnabled:(BOOL)enabled
 {
     // Everything runs through the client
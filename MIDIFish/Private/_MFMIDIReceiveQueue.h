@@ -0,0 +1,98 @@
+//
+//  _MFMIDIReceiveQueue.h
+//  MIDIFish
+//
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreMIDI/CoreMIDI.h>
+#import "MFProtocols.h"
+#import "MFMIDISession.h"
+#import "_MFRingBuffer.h"
+#import "_MFTrafficStats.h"
+#import "MFMIDITransform.h"
+#import "MFMIDIFileRecorder.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** What we hand CoreMIDI as the read proc refCon. Plain C so the read thread never touches ObjC */
+typedef struct _MFMIDIReceiveContext {
+    _MFRingBufferRef ring;
+    uint32_t sourceID;      // for read procs that don't get a srcConnRefCon (virtual destinations). 0 for the input port
+    void *thruRefCon;       // the owner's, for forwarding from the read proc before queuing (see MFMIDISession's thru routes). Set before the context goes to CoreMIDI. NULL for none
+} _MFMIDIReceiveContext;
+
+/** The ID of the source a read proc call is for */
+static inline uint32_t _MFMIDIReceiveContextSourceID(const _MFMIDIReceiveContext *context, void *srcConnRefCon)
+{
+    return srcConnRefCon ? (uint32_t)(uintptr_t)srcConnRefCon : context->sourceID;
+}
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Call from the read proc. Copies each packet into the context's ring. The source ID is taken from `srcConnRefCon` if set. Real-time safe */
+extern void _MFMIDIReceiveContextWritePacketList(_MFMIDIReceiveContext *context, const MIDIPacketList *packetList, void *srcConnRefCon);
+
+/** As above from an event list read proc. The words are queued as they are and translated when drained */
+extern void _MFMIDIReceiveContextWriteEventList(_MFMIDIReceiveContext *context, const MIDIEventList *eventList, void *srcConnRefCon) MF_UMP_AVAILABLE;
+
+#ifdef __cplusplus
+}
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark -
+/////////////////////////////////////////////////////////////////////////
+
+/**
+ Consumer side of the receive path. CoreMIDI's read thread copies raw packets (or UMP event packets, which are translated here) into preallocated SPSC rings (one per read proc); this drains them on another thread, parses per source (so sysex can span packets) and hands back batches of MFMIDIMessages.
+
+ Source registration and draining are thread-safe with respect to each other. Only one thread drains at a time.
+ */
+@interface _MFMIDIReceiveQueue : NSObject
+
+- (instancetype)initWithRingCapacity:(size_t)capacity;
+
+/** Context for the shared Input Port. Pass as the readProcRefCon and a source ID as srcConnRefCon when connecting sources */
+@property (nonatomic, readonly) _MFMIDIReceiveContext *inputPortContext;
+
+/** Reserves a new ID (never 0). Use with `registerSource:forID:` once the source object exists */
+- (uint32_t)reserveSourceID;
+
+/** Associate an object with an ID. The object is weakly held. It's usually an id<MFMIDISource> but needn't be. Received packets are counted into `stats` (if not NULL) which must outlive the registration */
+- (void)registerSource:(id)source forID:(uint32_t)sourceID stats:(_MFTrafficStats *)stats;
+
+/** 0 if not registered */
+- (uint32_t)sourceIDForSource:(id)source;
+
+/** Drops the association and any parser state. Anything still queued for it is discarded on the next drain */
+- (void)unregisterSourceID:(uint32_t)sourceID;
+
+/** Creates a dedicated ring (and context) for a read proc other than the input port's, eg. a virtual destination's. Owned by the receiver */
+- (_MFMIDIReceiveContext *)addContextForSourceID:(uint32_t)sourceID;
+
+/** Run everything from the source through `transform` (copied, NULL for none) before parsing. Applies from the next drain */
+- (void)setTransform:(const MFMIDITransform *)transform forSourceID:(uint32_t)sourceID;
+
+/** As above for all sources, after their own */
+- (void)setTransform:(const MFMIDITransform *)transform;
+
+/** Record every message received, after the transforms, to `track` of `recorder` (NULL to stop). Takes effect between drains so once this returns the previous recorder is no longer in use */
+- (void)setRecorder:(MFMIDIFileRecorderRef)recorder track:(uint16_t)track;
+
+/** Drains all rings. The handler is called once per source per drain with the messages in arrival order. @return Number of messages delivered */
+- (NSUInteger)drainWithHandler:(void (^)(id source, NSArray *messages))handler;
+
+/** As above, also collecting everything as Universal MIDI Packets for `UMPHandler` (if not nil), called once per source before `handler`. What arrived as UMP is passed on as it came, unless there's a transform for the source. MIDI 1.0 is translated to MIDI 2.0 channel voice messages */
+- (NSUInteger)drainWithHandler:(void (^)(id source, NSArray *messages))handler
+                    UMPHandler:(void (^)(id source, const uint32_t *words, NSUInteger count))UMPHandler;
+
+@property (nonatomic, readonly) MFMIDIReceiveStatistics statistics;
+
+@end
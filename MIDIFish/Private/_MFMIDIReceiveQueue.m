@@ -0,0 +1,413 @@
+//
+//  _MFMIDIReceiveQueue.m
+//  MIDIFish
+//
+//
+
+#import "_MFMIDIReceiveQueue.h"
+#import "MFMIDIMessage.h"
+#import "MFMIDIParser.h"
+#import "MFMIDIUMP.h"
+#import <mach/mach_time.h>
+
+/** Set in a record's tag (with the source ID under it) when its bytes are UMP words */
+static const uint32_t _kMFReceiveUMPTag = 1u << 31;
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Producer (CoreMIDI read thread)
+/////////////////////////////////////////////////////////////////////////
+
+void _MFMIDIReceiveContextWritePacketList(_MFMIDIReceiveContext *context, const MIDIPacketList *packetList, void *srcConnRefCon)
+{
+    // NO allocation, locks or ObjC in here
+    const uint32_t sourceID = _MFMIDIReceiveContextSourceID(context, srcConnRefCon);
+    const uint64_t arrivalTime = mach_absolute_time();      // for the jitter stats
+
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i=0; i<packetList->numPackets; ++i) {
+        _MFRingBufferWrite(context->ring, packet->timeStamp, arrivalTime, sourceID, packet->data, packet->length);
+        packet = MIDIPacketNext(packet);
+    }
+}
+
+//---------------------------------------------------------------------
+
+void _MFMIDIReceiveContextWriteEventList(_MFMIDIReceiveContext *context, const MIDIEventList *eventList, void *srcConnRefCon)
+{
+    // As above
+    const uint32_t sourceID = _MFMIDIReceiveContextSourceID(context, srcConnRefCon);
+    const uint64_t arrivalTime = mach_absolute_time();
+
+    const MIDIEventPacket *packet = &eventList->packet[0];
+    for (UInt32 i=0; i<eventList->numPackets; ++i) {
+        _MFRingBufferWrite(context->ring, packet->timeStamp, arrivalTime, sourceID | _kMFReceiveUMPTag, (const uint8_t *)packet->words, packet->wordCount * sizeof(UInt32));
+        packet = MIDIEventPacketNext(packet);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Per-Source Parse State
+/////////////////////////////////////////////////////////////////////////
+
+/** @private Parser state for one source. Lives across drains so sysex and running status carry over */
+@interface _MFMIDIReceiveStream : NSObject
+{
+@public
+    uint32_t _sourceID;
+    _MFTrafficStats *_stats;        // may be NULL
+    MFMIDIParser _parser;
+    NSData *_transform;             // MFMIDITransform. nil for none
+    MFMIDITransformState _transformState, _sharedTransformState;    // the source's own and the queue's, which follows it
+    NSMutableData *_sysex;
+    NSMutableArray *_messages;      // collected during the current drain
+    MFMIDIFileRecorderRef _recorder;    // the queue's. NULL when not recording
+    uint16_t _recorderTrack;
+    NSMutableData *_ump;            // UMP words collected during the current drain, when asked for
+    MFMIDIUMPFromBytesState _umpState;
+    BOOL _collectsUMP;              // for this drain
+    BOOL _isFeedingUMP;             // the parser's input was translated from UMP, which is collected as it came
+}
+@end
+
+@implementation _MFMIDIReceiveStream
+@end
+
+//---------------------------------------------------------------------
+
+/** MIDI 1.0 bytes from the parser as MIDI 2.0 UMP words */
+static void _MFReceiveStreamCollectUMP(_MFMIDIReceiveStream *stream, const uint8_t *bytes, size_t length)
+{
+    uint32_t words[64];
+    while (length)
+    {
+        size_t consumed;
+        const size_t count = MFMIDIUMPFromBytes(&stream->_umpState, kMFMIDIUMPProtocolMIDI2, 0, bytes, length, words, sizeof(words) / sizeof(words[0]), &consumed);
+        [stream->_ump appendBytes:words length:count * sizeof(uint32_t)];
+        bytes += consumed;
+        length -= consumed;
+    }
+}
+
+static void _MFReceiveStreamCollectMessage(const MFMIDIParserEvent *event, void *context)
+{
+    _MFMIDIReceiveStream *stream = (__bridge _MFMIDIReceiveStream *)context;
+    const MFMIDIMessageValue *value = &event->message;
+
+    if (stream->_collectsUMP && !stream->_isFeedingUMP) _MFReceiveStreamCollectUMP(stream, MFMIDIMessageValueGetBytes(value), value->length);
+
+    if (!event->sysexFlags) {
+        [stream->_messages addObject:[MFMIDIMessage messageWithValue:*value]];
+        if (stream->_recorder) MFMIDIFileRecorderRecord(stream->_recorder, stream->_recorderTrack, event->timestamp, MFMIDIMessageValueGetBytes(value), value->length);
+        return;
+    }
+
+    // Stitch the sysex fragments back together. Recorded whole so another source's messages can't land inside it
+    [stream->_sysex appendBytes:MFMIDIMessageValueGetBytes(value) length:value->length];
+    if ((event->sysexFlags & kMFMIDIParserSysexEnds) && stream->_sysex.length) {
+        [stream->_messages addObject:[MFMIDIMessage messageWithData:[NSMutableData dataWithData:stream->_sysex]]];
+        if (stream->_recorder) MFMIDIFileRecorderRecord(stream->_recorder, stream->_recorderTrack, event->timestamp, stream->_sysex.bytes, stream->_sysex.length);
+        stream->_sysex.length = 0;
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark -
+/////////////////////////////////////////////////////////////////////////
+
+@implementation _MFMIDIReceiveQueue
+{
+    size_t _ringCapacity;
+    NSMutableArray *_contexts;          // [NSValue(_MFMIDIReceiveContext *)]. Index 0 is the input port
+    NSMapTable *_sources;               // @(sourceID) -> weak source
+    NSMutableDictionary *_streams;      // @(sourceID) -> _MFMIDIReceiveStream
+    uint32_t _lastSourceID;
+    NSData *_transform;                 // MFMIDITransform for all sources. nil for none
+    NSMutableData *_scratch;            // transforms work in place so records are copied here first
+    NSMutableData *_umpWords;           // UMP records copied out of the ring, aligned
+    NSMutableData *_umpBytes;           // and translated to MIDI 1.0 for the parser
+    MFMIDIFileRecorderRef _recorder;    // NULL when not recording. Each stream has it too
+    uint16_t _recorderTrack;
+}
+
+- (instancetype)initWithRingCapacity:(size_t)capacity
+{
+    self = [super init];
+    if (self) {
+        _ringCapacity = capacity;
+        _contexts = [NSMutableArray array];
+        _sources = [NSMapTable strongToWeakObjectsMapTable];
+        _streams = [NSMutableDictionary dictionary];
+        _scratch = [NSMutableData data];
+        _umpWords = [NSMutableData data];
+        _umpBytes = [NSMutableData data];
+        _inputPortContext = [self addContextForSourceID:0];
+    }
+    return self;
+}
+
+//---------------------------------------------------------------------
+
+- (void)dealloc
+{
+    // The session has disposed of the ports and virtual destinations writing into these by now
+    for (NSValue *val in _contexts) {
+        _MFMIDIReceiveContext *context = val.pointerValue;
+        _MFRingBufferDestroy(context->ring);
+        free(context);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Public Methods
+/////////////////////////////////////////////////////////////////////////
+
+- (uint32_t)reserveSourceID
+{
+    @synchronized(self) {
+        return ++_lastSourceID;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)registerSource:(id)source forID:(uint32_t)sourceID stats:(_MFTrafficStats *)stats
+{
+    NSParameterAssert(sourceID != 0);
+
+    _MFMIDIReceiveStream *stream = [_MFMIDIReceiveStream new];
+    stream->_sourceID = sourceID;
+    stream->_stats = stats;
+    stream->_sysex = [NSMutableData data];
+    stream->_messages = [NSMutableArray array];
+    stream->_ump = [NSMutableData data];
+    MFMIDIParserInit(&stream->_parser, _MFReceiveStreamCollectMessage, (__bridge void *)stream);
+
+    @synchronized(self) {
+        stream->_recorder = _recorder;
+        stream->_recorderTrack = _recorderTrack;
+        [_sources setObject:source forKey:@(sourceID)];
+        _streams[@(sourceID)] = stream;
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (uint32_t)sourceIDForSource:(id)source
+{
+    @synchronized(self) {
+        for (NSNumber *sourceID in _sources) {
+            if ([_sources objectForKey:sourceID] == source) return sourceID.unsignedIntValue;
+        }
+    }
+    return 0;
+}
+
+//---------------------------------------------------------------------
+
+- (void)unregisterSourceID:(uint32_t)sourceID
+{
+    @synchronized(self) {
+        [_sources removeObjectForKey:@(sourceID)];
+        [_streams removeObjectForKey:@(sourceID)];
+    }
+}
+
+//---------------------------------------------------------------------
+
+/** nil for NULL or the identity, which needn't be applied */
+static NSData *_MFTransformData(const MFMIDITransform *transform)
+{
+    if (!transform || MFMIDITransformIsIdentity(transform)) return nil;
+    return [NSData dataWithBytes:transform length:sizeof(MFMIDITransform)];
+}
+
+- (void)setTransform:(const MFMIDITransform *)transform forSourceID:(uint32_t)sourceID
+{
+    NSData *data = _MFTransformData(transform);
+    @synchronized(self) {
+        _MFMIDIReceiveStream *stream = _streams[@(sourceID)];
+        if (!stream) return;
+        stream->_transform = data;
+        stream->_transformState = (MFMIDITransformState){0};
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)setTransform:(const MFMIDITransform *)transform
+{
+    NSData *data = _MFTransformData(transform);
+    @synchronized(self) {
+        _transform = data;
+        for (_MFMIDIReceiveStream *stream in _streams.allValues) {
+            stream->_sharedTransformState = (MFMIDITransformState){0};
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (void)setRecorder:(MFMIDIFileRecorderRef)recorder track:(uint16_t)track
+{
+    @synchronized(self) {
+        _recorder = recorder;
+        _recorderTrack = track;
+        for (_MFMIDIReceiveStream *stream in _streams.allValues) {
+            stream->_recorder = recorder;
+            stream->_recorderTrack = track;
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+
+- (_MFMIDIReceiveContext *)addContextForSourceID:(uint32_t)sourceID
+{
+    _MFMIDIReceiveContext *context = calloc(1, sizeof(_MFMIDIReceiveContext));
+    context->ring = _MFRingBufferCreate(_ringCapacity);
+    context->sourceID = sourceID;
+    NSAssert(context->ring, @"Failed to allocate receive ring");
+
+    @synchronized(self) {
+        [_contexts addObject:[NSValue valueWithPointer:context]];
+    }
+    return context;
+}
+
+//---------------------------------------------------------------------
+
+- (NSUInteger)drainWithHandler:(void (^)(id, NSArray *))handler
+{
+    return [self drainWithHandler:handler UMPHandler:nil];
+}
+
+//---------------------------------------------------------------------
+
+- (NSUInteger)drainWithHandler:(void (^)(id, NSArray *))handler UMPHandler:(void (^)(id, const uint32_t *, NSUInteger))UMPHandler
+{
+    NSMutableArray *batches = [NSMutableArray array];   // [[source, messages, UMP words]]
+    NSUInteger count = 0;
+
+    @synchronized(self)
+    {
+        NSMutableArray *touched = [NSMutableArray array];
+
+        for (NSValue *val in _contexts)
+        {
+            _MFMIDIReceiveContext *context = val.pointerValue;
+            _MFRingBufferRecord record;
+            while (_MFRingBufferPeek(context->ring, &record))
+            {
+                // Unknown IDs are stale data from a source that's gone. Drop it
+                _MFMIDIReceiveStream *stream = _streams[@(record.tag & ~_kMFReceiveUMPTag)];
+                if (stream) {
+                    const BOOL wasTouched = stream->_messages.count || stream->_ump.length;
+                    // UMP is passed on as it came, unless a transform has had its say on the MIDI 1.0 in which case that's translated back
+                    const BOOL isUMP = (record.tag & _kMFReceiveUMPTag) != 0;
+                    const BOOL isTransformed = stream->_transform || _transform;
+                    stream->_collectsUMP = UMPHandler != nil;
+                    stream->_isFeedingUMP = isUMP && !isTransformed;
+                    const uint8_t *bytes = record.bytes;
+                    size_t length = record.length;
+                    if (isUMP) {
+                        length = [self _translateUMPRecord:&record forStream:stream];
+                        bytes = _umpBytes.bytes;
+                    }
+                    if (stream->_stats) _MFTrafficStatsRecordReceive(stream->_stats, (uint32_t)length, record.timestamp, record.arrivalTime);
+                    if (isTransformed) {
+                        length = [self _transformBytes:bytes length:length forStream:stream];
+                        bytes = _scratch.bytes;
+                    }
+                    // Immediate packets have no timestamp. Arrival is close enough for the recorder
+                    MFMIDIParserFeed(&stream->_parser, bytes, length, record.timestamp ? record.timestamp : record.arrivalTime);
+                    if (!wasTouched && (stream->_messages.count || stream->_ump.length)) [touched addObject:stream];
+                }
+                _MFRingBufferConsume(context->ring);
+            }
+        }
+
+        for (_MFMIDIReceiveStream *stream in touched)
+        {
+            id source = [_sources objectForKey:@(stream->_sourceID)];
+            NSArray *messages = stream->_messages.copy;
+            NSData *words = stream->_ump.copy;
+            [stream->_messages removeAllObjects];
+            stream->_ump.length = 0;
+            if (!source) continue;
+
+            [batches addObject:@[source, messages, words]];
+            count += messages.count;
+        }
+    }
+
+    // Call out without the lock held
+    for (NSArray *batch in batches) {
+        NSArray *messages = batch[1];
+        NSData *words = batch[2];
+        if (words.length) UMPHandler(batch[0], words.bytes, words.length / sizeof(uint32_t));
+        if (messages.count) handler(batch[0], messages);
+    }
+    return count;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Privates
+/////////////////////////////////////////////////////////////////////////
+
+/** LOCKED. Collects the record's words if the stream wants UMP and translates them to MIDI 1.0 in `_umpBytes`. @return The length of that */
+- (size_t)_translateUMPRecord:(const _MFRingBufferRecord *)record forStream:(_MFMIDIReceiveStream *)stream
+{
+    // The ring only guarantees byte alignment
+    const size_t wordCount = record->length / sizeof(uint32_t);
+    if (_umpWords.length < record->length) _umpWords.length = record->length;
+    memcpy(_umpWords.mutableBytes, record->bytes, wordCount * sizeof(uint32_t));
+    if (stream->_collectsUMP && stream->_isFeedingUMP) [stream->_ump appendBytes:_umpWords.bytes length:wordCount * sizeof(uint32_t)];
+
+    const size_t capacity = wordCount * kMFMIDIUMPMaxBytesPerWord;
+    if (_umpBytes.length < capacity) _umpBytes.length = capacity;
+    return MFMIDIUMPToBytes(_umpWords.bytes, wordCount, _umpBytes.mutableBytes, capacity, NULL);
+}
+
+//---------------------------------------------------------------------
+
+/** LOCKED. The source's transform then the queue's, on a copy in `_scratch`. @return The length left */
+- (size_t)_transformBytes:(const uint8_t *)source length:(size_t)sourceLength forStream:(_MFMIDIReceiveStream *)stream
+{
+    if (_scratch.length < sourceLength) _scratch.length = sourceLength;
+    uint8_t *bytes = _scratch.mutableBytes;
+    memcpy(bytes, source, sourceLength);
+
+    size_t length = sourceLength;
+    if (stream->_transform) length = MFMIDITransformApply(stream->_transform.bytes, &stream->_transformState, bytes, length);
+    if (_transform) length = MFMIDITransformApply(_transform.bytes, &stream->_sharedTransformState, bytes, length);
+    return length;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Properties
+/////////////////////////////////////////////////////////////////////////
+
+- (MFMIDIReceiveStatistics)statistics
+{
+    MFMIDIReceiveStatistics stats = {0};
+    @synchronized(self) {
+        for (NSValue *val in _contexts) {
+            _MFRingBufferStats ringStats;
+            _MFRingBufferGetStats(((_MFMIDIReceiveContext *)val.pointerValue)->ring, &ringStats);
+            stats.receivedPacketCount += ringStats.writtenRecordCount;
+            stats.receivedByteCount += ringStats.writtenByteCount;
+            stats.droppedPacketCount += ringStats.droppedRecordCount;
+            stats.droppedByteCount += ringStats.droppedByteCount;
+            stats.highWaterMark = MAX(stats.highWaterMark, ringStats.highWaterMark);
+        }
+    }
+    return stats;
+}
+
+
+@end
@@ -0,0 +1,345 @@
+//
+//  _MFNetDiscovery.c
+//  MIDIFish
+//
+//
+
+#include "_MFNetDiscovery.h"
+#include <stdlib.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** Room for a dotted IPv4 (or IPv6, should a discovery ever report one) */
+#define _ADDRESS_BUFFER_SIZE 64
+
+typedef struct {
+    char *name;
+    char *domain;
+    double deadline;
+    bool settled;
+    bool hasCached;                 // we'd an address for it before it was found
+    uint16_t cachedPort;
+    char cachedAddress[_ADDRESS_BUFFER_SIZE];
+} _MFService;
+
+struct _MFNetDiscovery {
+    const MFMIDIDiscovery *discovery;
+    _MFConnectionStateStoreRef store;
+    _MFNetDiscoveryCallbacks callbacks;
+    MFMIDIDiscoveryCallbacks discoveryCallbacks;
+    void *refCon;
+
+    bool refreshing;
+    bool browsing;
+    char *excludeName;
+    double resolveTimeout;
+    double cachedResolveDeadline;
+    double beganAt;                 // monotonic and wall clock, to date what we resolve @{
+    int64_t beganAtWallClock;       // @}
+
+    _MFService *services;           // found this refresh. A handful, so scanned
+    size_t serviceCount;
+    size_t serviceCapacity;
+    size_t settledCount;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Privates
+/////////////////////////////////////////////////////////////////////////
+
+static _MFService *_MFFindService(_MFNetDiscoveryRef d, const char *name)
+{
+    for (size_t i = 0; i < d->serviceCount; i++) {
+        if (strcmp(d->services[i].name, name) == 0) return &d->services[i];
+    }
+    return NULL;
+}
+
+static void _MFClearServices(_MFNetDiscoveryRef d)
+{
+    for (size_t i = 0; i < d->serviceCount; i++) {
+        free(d->services[i].name);
+        free(d->services[i].domain);
+    }
+    d->serviceCount = 0;
+    d->settledCount = 0;
+}
+
+/** Stop resolves still in flight without reporting them */
+static void _MFCancelOutstanding(_MFNetDiscoveryRef d)
+{
+    for (size_t i = 0; i < d->serviceCount; i++)
+    {
+        if (d->services[i].settled) continue;
+        d->services[i].settled = true;
+        d->settledCount++;
+        d->discovery->cancelResolve(d->discovery->context, d->services[i].name);
+    }
+}
+
+static void _MFEndIfDone(_MFNetDiscoveryRef d)
+{
+    if (!d->refreshing || d->browsing || d->settledCount < d->serviceCount) return;
+    d->refreshing = false;
+    d->callbacks.didEnd(d->refCon);
+}
+
+static void _MFReportProgress(_MFNetDiscoveryRef d)
+{
+    if (d->refreshing && (d->browsing || d->settledCount < d->serviceCount)) {
+        d->callbacks.progress(d->settledCount, d->serviceCount - d->settledCount, d->refCon);
+    }
+}
+
+/** Mark settled and fall back on the remembered address if there is one. Reports progress / the end */
+static void _MFSettleUnresolved(_MFNetDiscoveryRef d, _MFService *service)
+{
+    service->settled = true;
+    d->settledCount++;
+
+    // Copy out. The callbacks may find more services and move the array
+    char *name = strdup(service->name);
+    char *domain = strdup(service->domain);
+    char address[_ADDRESS_BUFFER_SIZE];
+    const bool hasCached = service->hasCached;
+    const uint16_t port = service->cachedPort;
+    memcpy(address, service->cachedAddress, sizeof(address));
+
+    if (name && domain)
+    {
+        if (hasCached) {
+            d->callbacks.hostAvailable(name, address, port, true, d->refCon);
+        } else {
+            d->callbacks.hostUnresolved(name, domain, d->refCon);
+        }
+    }
+    free(name);
+    free(domain);
+
+    _MFReportProgress(d);
+    _MFEndIfDone(d);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Discovery Callbacks
+/////////////////////////////////////////////////////////////////////////
+
+static void _MFServiceFound(const char *name, const char *domain, bool moreComing, void *refCon)
+{
+    _MFNetDiscoveryRef d = refCon;
+    if (!d->refreshing || !d->browsing) return;
+
+    const bool isExcluded = d->excludeName && strcmp(name, d->excludeName) == 0;
+    if (!isExcluded && !_MFFindService(d, name))    // eg. in more than one domain
+    {
+        if (d->serviceCount == d->serviceCapacity)
+        {
+            const size_t capacity = d->serviceCapacity ? d->serviceCapacity * 2 : 8;
+            _MFService *services = realloc(d->services, capacity * sizeof(_MFService));
+            if (services) {
+                d->services = services;
+                d->serviceCapacity = capacity;
+            }
+        }
+
+        char *nameCopy = strdup(name);
+        char *domainCopy = strdup(domain ? domain : "");
+        if (d->serviceCount < d->serviceCapacity && nameCopy && domainCopy)
+        {
+            _MFService *service = &d->services[d->serviceCount++];
+            memset(service, 0, sizeof(*service));
+            service->name = nameCopy;
+            service->domain = domainCopy;
+            service->hasCached = _MFConnectionStateStoreGetResolvedHost(d->store, name, service->cachedAddress, sizeof(service->cachedAddress), &service->cachedPort);
+            service->deadline = d->callbacks.now(d->refCon) + (service->hasCached ? d->cachedResolveDeadline : d->resolveTimeout);
+
+            // It's in the list first as the discovery may call back from inside
+            const size_t idx = d->serviceCount - 1;
+            if (!d->discovery->resolve(d->discovery->context, name, domainCopy, d->resolveTimeout) && !d->services[idx].settled) {
+                _MFSettleUnresolved(d, &d->services[idx]);
+            }
+        }
+        else
+        {
+            free(nameCopy);
+            free(domainCopy);
+        }
+    }
+
+    // The browse is ours to stop
+    if (!moreComing && d->refreshing && d->browsing) {
+        d->discovery->stopBrowse(d->discovery->context);
+    }
+}
+
+//---------------------------------------------------------------------
+
+static void _MFBrowseDidStop(void *refCon)
+{
+    _MFNetDiscoveryRef d = refCon;
+    if (!d->browsing) return;
+    d->browsing = false;
+    _MFEndIfDone(d);
+}
+
+//---------------------------------------------------------------------
+
+static void _MFServiceDidResolve(const char *name, const char *address, uint16_t port, void *refCon)
+{
+    _MFNetDiscoveryRef d = refCon;
+    _MFService *service = d->refreshing ? _MFFindService(d, name) : NULL;
+    if (!service || service->settled) return;
+    service->settled = true;
+    d->settledCount++;
+
+    const int64_t resolvedAt = d->beganAtWallClock + (int64_t)(d->callbacks.now(d->refCon) - d->beganAt);
+    if (_MFConnectionStateStoreSetResolvedHost(d->store, name, address, port, resolvedAt)) {
+        d->callbacks.storeNeedsSave(d->refCon);
+    }
+    d->callbacks.hostAvailable(name, address, port, true, d->refCon);
+
+    _MFReportProgress(d);
+    _MFEndIfDone(d);
+}
+
+//---------------------------------------------------------------------
+
+static void _MFServiceDidNotResolve(const char *name, void *refCon)
+{
+    _MFNetDiscoveryRef d = refCon;
+    _MFService *service = d->refreshing ? _MFFindService(d, name) : NULL;
+    if (!service || service->settled) return;
+    _MFSettleUnresolved(d, service);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Warm Start
+/////////////////////////////////////////////////////////////////////////
+
+static void _MFConnectRemembered(const MFMIDIResolvedHostRecord *record, void *refCon)
+{
+    _MFNetDiscoveryRef d = refCon;
+    if (d->excludeName && strcmp(record->name, d->excludeName) == 0) return;
+    d->callbacks.hostAvailable(record->name, record->address, record->port, false, d->refCon);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+_MFNetDiscoveryRef _MFNetDiscoveryCreate(const MFMIDIDiscovery *discovery, _MFConnectionStateStoreRef store, const _MFNetDiscoveryCallbacks *callbacks, void *refCon)
+{
+    _MFNetDiscoveryRef d = calloc(1, sizeof(struct _MFNetDiscovery));
+    if (!d) return NULL;
+    d->discovery = discovery;
+    d->store = store;
+    d->callbacks = *callbacks;
+    d->refCon = refCon;
+    d->discoveryCallbacks = (MFMIDIDiscoveryCallbacks){
+        .serviceFound = _MFServiceFound,
+        .browseDidStop = _MFBrowseDidStop,
+        .serviceDidResolve = _MFServiceDidResolve,
+        .serviceDidNotResolve = _MFServiceDidNotResolve,
+    };
+    return d;
+}
+
+//---------------------------------------------------------------------
+
+void _MFNetDiscoveryDestroy(_MFNetDiscoveryRef d)
+{
+    if (!d) return;
+    if (d->refreshing)
+    {
+        d->refreshing = false;
+        if (d->browsing) d->discovery->stopBrowse(d->discovery->context);
+        _MFCancelOutstanding(d);
+    }
+    _MFClearServices(d);
+    free(d->services);
+    free(d->excludeName);
+    free(d);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Refresh
+/////////////////////////////////////////////////////////////////////////
+
+bool _MFNetDiscoveryBegin(_MFNetDiscoveryRef d, const char *excludeName, double resolveTimeout, double cachedResolveDeadline, int64_t wallClockNow)
+{
+    if (d->refreshing) return false;
+
+    _MFClearServices(d);
+    free(d->excludeName);
+    d->excludeName = excludeName ? strdup(excludeName) : NULL;
+    d->resolveTimeout = resolveTimeout;
+    d->cachedResolveDeadline = cachedResolveDeadline < resolveTimeout ? cachedResolveDeadline : resolveTimeout;
+    d->beganAt = d->callbacks.now(d->refCon);
+    d->beganAtWallClock = wallClockNow;
+    d->refreshing = true;
+    d->browsing = true;
+
+    // Connect to what we had last time while Bonjour gets going
+    _MFConnectionStateStoreEnumerateResolvedHosts(d->store, _MFConnectRemembered, d);
+    d->callbacks.progress(0, 0, d->refCon);
+
+    if (!d->discovery->startBrowse(d->discovery->context, &d->discoveryCallbacks, d)) {
+        d->browsing = false;
+    }
+    _MFEndIfDone(d);
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+void _MFNetDiscoveryCancel(_MFNetDiscoveryRef d)
+{
+    if (!d->refreshing) return;
+
+    // Not browsing first so the stop's callback (should it come from inside) doesn't end it before we've cancelled the resolves
+    const bool wasBrowsing = d->browsing;
+    d->browsing = false;
+    if (wasBrowsing) d->discovery->stopBrowse(d->discovery->context);
+    _MFCancelOutstanding(d);
+    _MFEndIfDone(d);
+}
+
+//---------------------------------------------------------------------
+
+double _MFNetDiscoveryCheckDeadlines(_MFNetDiscoveryRef d)
+{
+    if (!d->refreshing) return 0;
+
+    // By index and re-checking the count as the callbacks may find more
+    const double now = d->callbacks.now(d->refCon);
+    for (size_t i = 0; i < d->serviceCount && d->refreshing; i++)
+    {
+        _MFService *service = &d->services[i];
+        if (service->settled || service->deadline > now) continue;
+        d->discovery->cancelResolve(d->discovery->context, service->name);
+        if (!d->services[i].settled) _MFSettleUnresolved(d, &d->services[i]);
+    }
+
+    double next = 0;
+    for (size_t i = 0; i < d->serviceCount && d->refreshing; i++)
+    {
+        const _MFService *service = &d->services[i];
+        if (!service->settled && (next == 0 || service->deadline < next)) next = service->deadline;
+    }
+    return next;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFNetDiscoveryIsRefreshing(_MFNetDiscoveryRef d)
+{
+    return d->refreshing;
+}
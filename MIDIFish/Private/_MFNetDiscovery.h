@@ -0,0 +1,77 @@
+//
+//  _MFNetDiscovery.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish__MFNetDiscovery_h
+#define MIDIFish__MFNetDiscovery_h
+
+#include "MFMIDIDiscovery.h"
+#include "_MFConnectionStateStore.h"
+#include <stddef.h>
+
+/**
+ Runs the network half of a session refresh over an `MFMIDIDiscovery`, using the state store's resolved hosts as a warm start.
+
+ At `_MFNetDiscoveryBegin` every remembered host is reported straight away (unconfirmed) so the session can connect before Bonjour has said anything. Then each service the browse finds is resolved, all at once, against its own deadline: short if we've an address for it already (we're connected on that, the resolve only checks it), the full resolve timeout if not. Whatever a service settles on - resolved, failed or timed out onto its remembered address - is reported confirmed, and fresh addresses go back into the store. The refresh ends as soon as the browse has stopped and every service found has settled, rather than when the slowest resolve gives up.
+
+ Not thread safe. Call everything, and have the discovery call back, on one thread (the session's). The callbacks may call back in, other than to destroy it.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _MFNetDiscovery *_MFNetDiscoveryRef;
+
+typedef struct {
+    /** Monotonic seconds, for the deadlines */
+    double (*now)(void *refCon);
+
+    /** Connect `name` at this address. Unconfirmed for a remembered address the browse hasn't found (yet) - drop those connections if the refresh ends without confirming them */
+    void (*hostAvailable)(const char *name, const char *address, uint16_t port, bool confirmed, void *refCon);
+
+    /** Found but not resolved, with no address remembered. Connect by service name as a fallback */
+    void (*hostUnresolved)(const char *name, const char *domain, void *refCon);
+
+    /** Partial results: after the warm start and each time a service settles while others are outstanding */
+    void (*progress)(size_t settled, size_t outstanding, void *refCon);
+
+    /** The browse has stopped and every service found has settled, or the refresh was cancelled */
+    void (*didEnd)(void *refCon);
+
+    /** The store's resolved hosts changed and it wants a save (see the store's mutators) */
+    void (*storeNeedsSave)(void *refCon);
+} _MFNetDiscoveryCallbacks;
+
+/** @param discovery, store Must outlive it. @return NULL on allocation failure */
+extern _MFNetDiscoveryRef _MFNetDiscoveryCreate(const MFMIDIDiscovery *discovery, _MFConnectionStateStoreRef store, const _MFNetDiscoveryCallbacks *callbacks, void *refCon);
+
+/** Cancels any refresh (without calling didEnd) */
+extern void _MFNetDiscoveryDestroy(_MFNetDiscoveryRef discovery);
+
+/**
+ Warm start then browse. didEnd may be called before this returns, eg. if the browse can't start
+ @param excludeName Optional. A service name to ignore (ourselves)
+ @param resolveTimeout Seconds for services with no remembered address
+ @param cachedResolveDeadline Seconds for ones with
+ @param wallClockNow Seconds since 1970, for the store's resolved times
+ @return false if already refreshing
+ */
+extern bool _MFNetDiscoveryBegin(_MFNetDiscoveryRef discovery, const char *excludeName, double resolveTimeout, double cachedResolveDeadline, int64_t wallClockNow);
+
+/** Stop browsing and resolving. Services still outstanding are dropped unreported. Calls didEnd if it was refreshing */
+extern void _MFNetDiscoveryCancel(_MFNetDiscoveryRef discovery);
+
+/** Give up on services past their deadlines. @return The next deadline (as per `now`), or 0 if nothing is outstanding */
+extern double _MFNetDiscoveryCheckDeadlines(_MFNetDiscoveryRef discovery);
+
+extern bool _MFNetDiscoveryIsRefreshing(_MFNetDiscoveryRef discovery);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+//
+//  _MFRingBuffer.c
+//  MIDIFish
+//
+//
+
+#include "_MFRingBuffer.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+/** Header stored in front of each record's bytes. A length of _kPadMarker means "skip to the start of the buffer" */
+typedef struct {
+    uint32_t length;
+    uint32_t tag;
+    uint64_t timestamp;
+    uint64_t arrivalTime;
+} _MFRingBufferHeader;
+
+static const uint32_t _kPadMarker = UINT32_MAX;
+
+#define _MF_ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+struct _MFRingBuffer {
+    uint8_t *buffer;
+    size_t capacity;            // power of 2
+    size_t mask;
+
+    // Free running byte positions. Each is written by one side only. Kept on separate cache lines
+    _Alignas(64) _Atomic uint64_t writePos;      // producer
+    _Alignas(64) _Atomic uint64_t readPos;       // consumer
+    size_t peekedSize;                           // consumer
+
+    // Stats. Producer writes, anyone reads
+    _Alignas(64) _Atomic uint64_t writtenRecordCount;
+    _Atomic uint64_t writtenByteCount;
+    _Atomic uint64_t droppedRecordCount;
+    _Atomic uint64_t droppedByteCount;
+    _Atomic size_t highWaterMark;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Life Cycle
+/////////////////////////////////////////////////////////////////////////
+
+_MFRingBufferRef _MFRingBufferCreate(size_t capacity)
+{
+    size_t size = 64;
+    while (size < capacity) size <<= 1;
+
+    _MFRingBufferRef ring = calloc(1, sizeof(struct _MFRingBuffer));
+    if (!ring) return NULL;
+
+    ring->buffer = calloc(1, size);
+    if (!ring->buffer) {
+        free(ring);
+        return NULL;
+    }
+    ring->capacity = size;
+    ring->mask = size - 1;
+    atomic_init(&ring->writePos, 0);
+    atomic_init(&ring->readPos, 0);
+    return ring;
+}
+
+//---------------------------------------------------------------------
+
+void _MFRingBufferDestroy(_MFRingBufferRef ring)
+{
+    if (!ring) return;
+    free(ring->buffer);
+    free(ring);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Producer
+/////////////////////////////////////////////////////////////////////////
+
+bool _MFRingBufferWrite(_MFRingBufferRef ring, uint64_t timestamp, uint64_t arrivalTime, uint32_t tag, const uint8_t *bytes, uint32_t length)
+{
+    const size_t recordSize = _MF_ALIGN8(sizeof(_MFRingBufferHeader) + (size_t)length);
+
+    const uint64_t writePos = atomic_load_explicit(&ring->writePos, memory_order_relaxed);
+    const uint64_t readPos = atomic_load_explicit(&ring->readPos, memory_order_acquire);
+
+    // Records never wrap. If it won't fit before the end we pad it out and start from the top
+    const size_t offset = (size_t)(writePos & ring->mask);
+    const size_t untilEnd = ring->capacity - offset;
+    const size_t padding = (untilEnd < recordSize) ? untilEnd : 0;
+    const size_t used = (size_t)(writePos - readPos);
+
+    if (length == _kPadMarker || recordSize + padding > ring->capacity - used)
+    {
+        atomic_fetch_add_explicit(&ring->droppedRecordCount, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&ring->droppedByteCount, length, memory_order_relaxed);
+        return false;
+    }
+
+    uint8_t *dst = ring->buffer + offset;
+    if (padding) {
+        memcpy(dst, &_kPadMarker, sizeof(_kPadMarker));     // untilEnd is always a multiple of 8 so there's room
+        dst = ring->buffer;
+    }
+
+    _MFRingBufferHeader header = { length, tag, timestamp, arrivalTime };
+    memcpy(dst, &header, sizeof(header));
+    if (length) memcpy(dst + sizeof(header), bytes, length);
+
+    // Publish
+    atomic_store_explicit(&ring->writePos, writePos + padding + recordSize, memory_order_release);
+
+    atomic_fetch_add_explicit(&ring->writtenRecordCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ring->writtenByteCount, length, memory_order_relaxed);
+    const size_t nowUsed = used + padding + recordSize;
+    if (nowUsed > atomic_load_explicit(&ring->highWaterMark, memory_order_relaxed)) {
+        atomic_store_explicit(&ring->highWaterMark, nowUsed, memory_order_relaxed);
+    }
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Consumer
+/////////////////////////////////////////////////////////////////////////
+
+bool _MFRingBufferPeek(_MFRingBufferRef ring, _MFRingBufferRecord *outRecord)
+{
+    uint64_t readPos = atomic_load_explicit(&ring->readPos, memory_order_relaxed);
+    const uint64_t writePos = atomic_load_explicit(&ring->writePos, memory_order_acquire);
+
+    while (readPos != writePos)
+    {
+        const size_t offset = (size_t)(readPos & ring->mask);
+        _MFRingBufferHeader header;
+        memcpy(&header.length, ring->buffer + offset, sizeof(header.length));
+
+        // Skip the padding and hand the space back
+        if (header.length == _kPadMarker) {
+            readPos += ring->capacity - offset;
+            atomic_store_explicit(&ring->readPos, readPos, memory_order_release);
+            continue;
+        }
+
+        memcpy(&header, ring->buffer + offset, sizeof(header));
+        outRecord->timestamp = header.timestamp;
+        outRecord->arrivalTime = header.arrivalTime;
+        outRecord->tag = header.tag;
+        outRecord->length = header.length;
+        outRecord->bytes = ring->buffer + offset + sizeof(header);
+        ring->peekedSize = _MF_ALIGN8(sizeof(header) + (size_t)header.length);
+        return true;
+    }
+    return false;
+}
+
+//---------------------------------------------------------------------
+
+void _MFRingBufferConsume(_MFRingBufferRef ring)
+{
+    if (!ring->peekedSize) return;
+    const uint64_t readPos = atomic_load_explicit(&ring->readPos, memory_order_relaxed);
+    atomic_store_explicit(&ring->readPos, readPos + ring->peekedSize, memory_order_release);
+    ring->peekedSize = 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Stats
+/////////////////////////////////////////////////////////////////////////
+
+void _MFRingBufferGetStats(_MFRingBufferRef ring, _MFRingBufferStats *outStats)
+{
+    outStats->writtenRecordCount = atomic_load_explicit(&ring->writtenRecordCount, memory_order_relaxed);
+    outStats->writtenByteCount = atomic_load_explicit(&ring->writtenByteCount, memory_order_relaxed);
+    outStats->droppedRecordCount = atomic_load_explicit(&ring->droppedRecordCount, memory_order_relaxed);
+    outStats->droppedByteCount = atomic_load_explicit(&ring->droppedByteCount, memory_order_relaxed);
+    outStats->highWaterMark = atomic_load_explicit(&ring->highWaterMark, memory_order_relaxed);
+    outStats->capacity = ring->capacity;
+}
@@ -0,0 +1,67 @@
+//
+//  _MFRingBuffer.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish__MFRingBuffer_h
+#define MIDIFish__MFRingBuffer_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ Lock-free single-producer/single-consumer ring of variable length records (timestamp + arrival time + tag + bytes).
+
+ Memory is allocated once on create. After that the producer side (`_MFRingBufferWrite`) never allocates, locks or blocks so it's safe from the CoreMIDI read thread or an audio render callback. If there isn't room the record is dropped and counted.
+
+ Exactly one thread may write and exactly one thread may read at a time. Plain C11 so it builds anywhere.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _MFRingBuffer *_MFRingBufferRef;
+
+typedef struct _MFRingBufferRecord {
+    uint64_t timestamp;
+    uint64_t arrivalTime;       // when the producer wrote it, if it said. 0 otherwise
+    uint32_t tag;               // user defined, eg a source ID
+    uint32_t length;
+    const uint8_t *bytes;       // points into the ring. Valid until _MFRingBufferConsume
+} _MFRingBufferRecord;
+
+typedef struct _MFRingBufferStats {
+    uint64_t writtenRecordCount;
+    uint64_t writtenByteCount;
+    uint64_t droppedRecordCount;        // overflows
+    uint64_t droppedByteCount;
+    size_t highWaterMark;               // most bytes ever in use at once
+    size_t capacity;
+} _MFRingBufferStats;
+
+
+/** @param capacity Size in bytes. Rounded up to a power of 2. Each record costs 24 bytes + its length rounded up to 8. @return NULL on allocation failure */
+extern _MFRingBufferRef _MFRingBufferCreate(size_t capacity);
+extern void _MFRingBufferDestroy(_MFRingBufferRef ring);
+
+/** PRODUCER: Copy a record in. Returns false (and counts it) if there's no room */
+extern bool _MFRingBufferWrite(_MFRingBufferRef ring, uint64_t timestamp, uint64_t arrivalTime, uint32_t tag, const uint8_t *bytes, uint32_t length);
+
+/** CONSUMER: Get the oldest record without removing it. Returns false when empty */
+extern bool _MFRingBufferPeek(_MFRingBufferRef ring, _MFRingBufferRecord *outRecord);
+
+/** CONSUMER: Release the record returned by the last successful Peek */
+extern void _MFRingBufferConsume(_MFRingBufferRef ring);
+
+/** Safe from any thread. Counters are individually (not collectively) consistent */
+extern void _MFRingBufferGetStats(_MFRingBufferRef ring, _MFRingBufferStats *outStats);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
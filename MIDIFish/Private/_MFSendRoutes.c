@@ -0,0 +1,225 @@
+//
+//  _MFSendRoutes.c
+//  MIDIFish
+//
+//
+
+#include "_MFSendRoutes.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+struct _MFSendRouter {
+    _Atomic(_MFSendRoutes *) current;
+
+    // Readers register against the epoch's parity. A publish flips the epoch and waits for the old parity to drain. New readers land on the new parity so the wait always ends
+    atomic_uint epoch;
+    atomic_uint readers[2];
+
+    pthread_mutex_t publishLock;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Routes
+/////////////////////////////////////////////////////////////////////////
+
+_MFSendRoutes *_MFSendRoutesCreate(uint32_t capacity)
+{
+    _MFSendRoutes *routes = malloc(sizeof(_MFSendRoutes) + capacity * sizeof(_MFSendTarget));
+    if (!routes) return NULL;
+    routes->transform = NULL;
+    routes->recorder = NULL;
+    routes->thruSources = NULL;
+    routes->thruSourceCount = 0;
+    routes->thruRoutes = NULL;
+    routes->thruRouteCount = 0;
+    routes->count = 0;
+    routes->capacity = capacity;
+    return routes;
+}
+
+//---------------------------------------------------------------------
+
+void _MFSendRoutesDestroy(_MFSendRoutes *routes)
+{
+    if (!routes) return;
+    for (uint32_t i = 0; i < routes->count; i++) {
+        free((void *)routes->targets[i].transform);
+    }
+    for (uint32_t i = 0; i < routes->thruRouteCount; i++) {
+        free((void *)routes->thruRoutes[i].filter);
+    }
+    free(routes->thruRoutes);
+    free(routes->thruSources);
+    free((void *)routes->transform);
+    free(routes);
+}
+
+//---------------------------------------------------------------------
+
+/** Heap copy for a snapshot to own. `*outCopy` is NULL when there's nothing to do. @return false on allocation failure */
+static bool _MFCopyTransform(const MFMIDITransform *transform, const MFMIDITransform **outCopy)
+{
+    *outCopy = NULL;
+    if (!transform || MFMIDITransformIsIdentity(transform)) return true;
+
+    MFMIDITransform *copy = malloc(sizeof(MFMIDITransform));
+    if (!copy) return false;
+    memcpy(copy, transform, sizeof(MFMIDITransform));
+    *outCopy = copy;
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFSendRoutesAdd(_MFSendRoutes *routes, _MFSendTargetKind kind, _MFSendTargetClass targetClass, MIDIEndpointRef endpoint, MIDIPortRef port, void *audiobusPort, _MFTrafficStats *stats, _MFActiveNotes *activeNotes, const MFMIDITransform *transform)
+{
+    if (routes->count == routes->capacity) return false;
+
+    const MFMIDITransform *copy;
+    if (!_MFCopyTransform(transform, &copy)) return false;
+
+    _MFSendTarget *target = &routes->targets[routes->count++];
+    target->kind = kind;
+    target->targetClass = targetClass;
+    target->endpoint = endpoint;
+    target->port = port;
+    target->audiobusPort = audiobusPort;
+    target->stats = stats;
+    target->activeNotes = activeNotes;
+    target->transform = copy;
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFSendRoutesSetTransform(_MFSendRoutes *routes, const MFMIDITransform *transform)
+{
+    const MFMIDITransform *copy;
+    if (!_MFCopyTransform(transform, &copy)) return false;
+    free((void *)routes->transform);
+    routes->transform = copy;
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+bool _MFSendRoutesAddThru(_MFSendRoutes *routes, uint32_t sourceID, uint32_t targetIndex, const MFMIDITransform *filter)
+{
+    if (targetIndex >= routes->count) return false;
+
+    // Grown one at a time. Snapshots are built off the real-time path and routes are few
+    _MFThruRoute *thruRoutes = realloc(routes->thruRoutes, (routes->thruRouteCount + 1) * sizeof(_MFThruRoute));
+    if (!thruRoutes) return false;
+    routes->thruRoutes = thruRoutes;
+
+    _MFThruSource *source = routes->thruSourceCount ? &routes->thruSources[routes->thruSourceCount - 1] : NULL;
+    if (!source || source->sourceID != sourceID)
+    {
+        _MFThruSource *thruSources = realloc(routes->thruSources, (routes->thruSourceCount + 1) * sizeof(_MFThruSource));
+        if (!thruSources) return false;
+        routes->thruSources = thruSources;
+
+        source = &routes->thruSources[routes->thruSourceCount++];
+        source->sourceID = sourceID;
+        source->firstRoute = routes->thruRouteCount;
+        source->routeCount = 0;
+        source->filterState = (MFMIDITransformState){ 0 };
+    }
+
+    const MFMIDITransform *copy;
+    if (!_MFCopyTransform(filter, &copy)) return false;
+
+    _MFThruRoute *route = &routes->thruRoutes[routes->thruRouteCount++];
+    route->targetIndex = targetIndex;
+    route->filter = copy;
+    source->routeCount++;
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Router
+/////////////////////////////////////////////////////////////////////////
+
+_MFSendRouterRef _MFSendRouterCreate(void)
+{
+    _MFSendRouterRef router = calloc(1, sizeof(struct _MFSendRouter));
+    if (!router) return NULL;
+
+    _MFSendRoutes *empty = _MFSendRoutesCreate(0);
+    if (!empty) {
+        free(router);
+        return NULL;
+    }
+
+    atomic_init(&router->current, empty);
+    atomic_init(&router->epoch, 0);
+    atomic_init(&router->readers[0], 0);
+    atomic_init(&router->readers[1], 0);
+    pthread_mutex_init(&router->publishLock, NULL);
+    return router;
+}
+
+//---------------------------------------------------------------------
+
+void _MFSendRouterDestroy(_MFSendRouterRef router)
+{
+    if (!router) return;
+    _MFSendRoutesDestroy(atomic_load(&router->current));
+    pthread_mutex_destroy(&router->publishLock);
+    free(router);
+}
+
+//---------------------------------------------------------------------
+
+void _MFSendRouterPublish(_MFSendRouterRef router, _MFSendRoutes *routes)
+{
+    pthread_mutex_lock(&router->publishLock);
+
+    // Swap first so anyone arriving from here on sees the new one...
+    _MFSendRoutes *old = atomic_exchange(&router->current, routes);
+
+    // ...then wait out those who may have picked up the old one. A reader could be counted under either parity (it may have loaded a snapshot published since it registered) so drain both, flipping each time so new arrivals don't hold us up
+    for (int phase = 0; phase < 2; phase++)
+    {
+        unsigned oldEpoch = atomic_fetch_add(&router->epoch, 1);
+        while (atomic_load(&router->readers[oldEpoch & 1]) != 0) {
+            sched_yield();
+        }
+    }
+
+    pthread_mutex_unlock(&router->publishLock);
+    _MFSendRoutesDestroy(old);
+}
+
+//---------------------------------------------------------------------
+
+const _MFSendRoutes *_MFSendRouterBeginRead(_MFSendRouterRef router, uint32_t *token)
+{
+    // Seq-cst throughout: the counter increment must be visible before we load `current`, so a publisher either waits for us or we see its new snapshot. If the epoch moved while registering, re-register on the new parity so we don't prolong a publisher's wait
+    unsigned parity;
+    for (;;)
+    {
+        parity = atomic_load(&router->epoch) & 1;
+        atomic_fetch_add(&router->readers[parity], 1);
+        if ((atomic_load(&router->epoch) & 1) == parity) break;
+        atomic_fetch_sub(&router->readers[parity], 1);
+    }
+    *token = parity;
+    return atomic_load(&router->current);
+}
+
+//---------------------------------------------------------------------
+
+void _MFSendRouterEndRead(_MFSendRouterRef router, uint32_t token)
+{
+    atomic_fetch_sub_explicit(&router->readers[token], 1, memory_order_release);
+}
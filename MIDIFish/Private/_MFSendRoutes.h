@@ -0,0 +1,126 @@
+//
+//  _MFSendRoutes.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish__MFSendRoutes_h
+#define MIDIFish__MFSendRoutes_h
+
+#include "MFMIDITypes.h"
+#include "_MFTrafficStats.h"
+#include "MFMIDITransform.h"
+#include "_MFActiveNotes.h"
+#include "MFMIDIFileRecorder.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ Immutable, flat snapshot of everywhere a send should go, so the send path is a plain C loop with no ObjC calls and no walking of the connection arrays.
+
+ The session rebuilds a snapshot whenever connections come and go, are enabled/disabled or have their transforms changed and publishes it to a `_MFSendRouter`. Senders on any thread bracket their use of it with Begin/EndRead. Publishing swaps the pointer atomically and then waits for any senders still using the previous snapshot before freeing it (reader counts split by epoch parity, RCU style), so readers never lock or allocate and are never starved by a stream of new readers.
+
+ The thru routes ride along: per receive source, which of the targets its read proc forwards to and through what filter. Connection changes reindex the targets so they're rebuilt with them.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum _MFSendTargetKind {
+    _kMFSendTargetKindSend,             // MIDISend() through `port`
+    _kMFSendTargetKindReceived,         // MIDIReceived() on one of our virtual sources
+    _kMFSendTargetKindAudiobus,         // ABMIDIPortSendPacketList() on `audiobusPort`
+} _MFSendTargetKind;
+
+/** Destination classes, as bits, so a send can go to a subset. Eg. coalescing holds messages back from one class but not another */
+typedef enum _MFSendTargetClass {
+    _kMFSendTargetClassLocal    = 1 << 0,       // hardware, app & virtual endpoints and Audiobus
+    _kMFSendTargetClassNetwork  = 1 << 1,       // the MIDINetworkSession endpoint
+    _kMFSendTargetClassAll      = _kMFSendTargetClassLocal | _kMFSendTargetClassNetwork,
+} _MFSendTargetClass;
+
+typedef struct _MFSendTarget {
+    _MFSendTargetKind kind;
+    _MFSendTargetClass targetClass;
+    MIDIEndpointRef endpoint;
+    MIDIPortRef port;
+    void *audiobusPort;                 // unretained ABMIDISenderPort. The session keeps its destinations alive
+    _MFTrafficStats *stats;             // owned by the session's stats table which outlives any snapshot. May be NULL
+    const MFMIDITransform *transform;   // the destination's own, after the session's. Owned by the snapshot. NULL for none
+    _MFActiveNotes *activeNotes;        // owned by the session's table like `stats`. May be NULL
+} _MFSendTarget;
+
+/** Forwarding from a receive source straight to one of the targets, from its read proc */
+typedef struct _MFThruRoute {
+    uint32_t targetIndex;               // into `targets`
+    const MFMIDITransform *filter;      // owned by the snapshot. NULL passes everything
+} _MFThruRoute;
+
+/** A source's thru routes: `routeCount` of them from `thruRoutes[firstRoute]` */
+typedef struct _MFThruSource {
+    uint32_t sourceID;                  // the receive queue's
+    uint32_t firstRoute;
+    uint32_t routeCount;
+    MFMIDITransformState filterState;   // where the source's stream is up to, for the filters. Only its read proc touches it so it's the one mutable part of a snapshot
+} _MFThruSource;
+
+typedef struct _MFSendRoutes {
+    const MFMIDITransform *transform;   // the session's, for every target. Owned by the snapshot. NULL for none
+    MFMIDIFileRecorderRef recorder;     // what's sent goes to its track 0. Not owned: the session finishes it once a snapshot without it is published. NULL when not recording
+    _MFThruSource *thruSources;         // owned. NULL for none
+    uint32_t thruSourceCount;
+    _MFThruRoute *thruRoutes;           // owned
+    uint32_t thruRouteCount;
+    uint32_t count;
+    uint32_t capacity;
+    _MFSendTarget targets[];
+} _MFSendRoutes;
+
+typedef struct _MFSendRouter *_MFSendRouterRef;
+
+
+/** An empty snapshot with room for `capacity` targets. NULL on allocation failure */
+extern _MFSendRoutes *_MFSendRoutesCreate(uint32_t capacity);
+
+/** Frees it and the transforms it owns */
+extern void _MFSendRoutesDestroy(_MFSendRoutes *routes);
+
+/** Appends if there's room. `transform` is copied unless it's NULL or the identity. @return false if full (or the copy can't be allocated) */
+extern bool _MFSendRoutesAdd(_MFSendRoutes *routes, _MFSendTargetKind kind, _MFSendTargetClass targetClass, MIDIEndpointRef endpoint, MIDIPortRef port, void *audiobusPort, _MFTrafficStats *stats, _MFActiveNotes *activeNotes, const MFMIDITransform *transform);
+
+/** The session wide transform, copied as above. @return false if the copy can't be allocated */
+extern bool _MFSendRoutesSetTransform(_MFSendRoutes *routes, const MFMIDITransform *transform);
+
+/** Forward what the source `sourceID` receives to `targets[targetIndex]` through `filter`, copied as above. Add a source's routes one after the other. @return false if `targetIndex` is out of range or on allocation failure */
+extern bool _MFSendRoutesAddThru(_MFSendRoutes *routes, uint32_t sourceID, uint32_t targetIndex, const MFMIDITransform *filter);
+
+/** Real-time safe. NULL if the source has no thru routes */
+static inline _MFThruSource *_MFSendRoutesFindThruSource(const _MFSendRoutes *routes, uint32_t sourceID)
+{
+    for (uint32_t i = 0; i < routes->thruSourceCount; i++) {
+        if (routes->thruSources[i].sourceID == sourceID) return &routes->thruSources[i];
+    }
+    return NULL;
+}
+
+
+/** Starts with an empty snapshot. NULL on allocation failure */
+extern _MFSendRouterRef _MFSendRouterCreate(void);
+
+/** No reads may be in progress */
+extern void _MFSendRouterDestroy(_MFSendRouterRef router);
+
+/** Takes ownership of `routes` and makes it current. Blocks until no reader is using the old one, then destroys it. Don't call from a thread that's mid-read. Publishers are serialised internally */
+extern void _MFSendRouterPublish(_MFSendRouterRef router, _MFSendRoutes *routes);
+
+/** Real-time safe. The snapshot is valid until the matching EndRead, which must be passed `token` */
+extern const _MFSendRoutes *_MFSendRouterBeginRead(_MFSendRouterRef router, uint32_t *token);
+extern void _MFSendRouterEndRead(_MFSendRouterRef router, uint32_t token);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,273 @@
+//
+//  _MFTrafficStats.c
+//  MIDIFish
+//
+//
+
+#include "_MFTrafficStats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Defs
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct _MFTrafficStatsEntry {
+    uint64_t key;
+    struct _MFTrafficStatsEntry *next;
+    _MFTrafficStats stats;
+} _MFTrafficStatsEntry;
+
+struct _MFTrafficStatsTable {
+    uint32_t timebaseNumer;
+    uint32_t timebaseDenom;
+    _MFTrafficStatsEntry *entries;      // newest first. Only ever grows
+    pthread_mutex_t lock;
+};
+
+#define _RELAXED memory_order_relaxed
+
+//---------------------------------------------------------------------
+
+static inline int64_t _NanosFromTicks(const _MFTrafficStats *stats, int64_t ticks)
+{
+    return ticks * (int64_t)stats->timebaseNumer / (int64_t)stats->timebaseDenom;
+}
+
+/** See MFMIDITrafficStatistics.h for the bucket layout */
+static inline unsigned _BucketForNanos(uint64_t nanos)
+{
+    const uint64_t micros = nanos / 1000;
+    if (!micros) return 0;
+    const unsigned bucket = 64 - (unsigned)__builtin_clzll(micros);
+    return bucket < kMFMIDIHistogramBucketCount ? bucket : kMFMIDIHistogramBucketCount - 1;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Table
+/////////////////////////////////////////////////////////////////////////
+
+_MFTrafficStatsTableRef _MFTrafficStatsTableCreate(uint32_t timebaseNumer, uint32_t timebaseDenom)
+{
+    _MFTrafficStatsTableRef table = calloc(1, sizeof(struct _MFTrafficStatsTable));
+    if (!table) return NULL;
+    table->timebaseNumer = timebaseNumer ?: 1;
+    table->timebaseDenom = timebaseDenom ?: 1;
+    pthread_mutex_init(&table->lock, NULL);
+    return table;
+}
+
+//---------------------------------------------------------------------
+
+void _MFTrafficStatsTableDestroy(_MFTrafficStatsTableRef table)
+{
+    if (!table) return;
+    _MFTrafficStatsEntry *entry = table->entries;
+    while (entry) {
+        _MFTrafficStatsEntry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+//---------------------------------------------------------------------
+
+static _MFTrafficStatsEntry *_FindEntry(_MFTrafficStatsTableRef table, uint64_t key)
+{
+    for (_MFTrafficStatsEntry *entry = table->entries; entry; entry = entry->next) {
+        if (entry->key == key) return entry;
+    }
+    return NULL;
+}
+
+//---------------------------------------------------------------------
+
+_MFTrafficStats *_MFTrafficStatsTableGet(_MFTrafficStatsTableRef table, uint64_t key)
+{
+    pthread_mutex_lock(&table->lock);
+    _MFTrafficStatsEntry *entry = _FindEntry(table, key);
+    if (!entry && (entry = calloc(1, sizeof(_MFTrafficStatsEntry))))
+    {
+        // calloc zeroing is a valid initial state for the atomics on all our platforms
+        entry->key = key;
+        entry->stats.timebaseNumer = table->timebaseNumer;
+        entry->stats.timebaseDenom = table->timebaseDenom;
+        entry->next = table->entries;
+        table->entries = entry;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return entry ? &entry->stats : NULL;
+}
+
+//---------------------------------------------------------------------
+
+_MFTrafficStats *_MFTrafficStatsTableFind(_MFTrafficStatsTableRef table, uint64_t key)
+{
+    pthread_mutex_lock(&table->lock);
+    _MFTrafficStatsEntry *entry = _FindEntry(table, key);
+    pthread_mutex_unlock(&table->lock);
+    return entry ? &entry->stats : NULL;
+}
+
+//---------------------------------------------------------------------
+
+static void _MergeErrorCount(MFMIDITrafficStatistics *into, OSStatus status, uint64_t count)
+{
+    for (unsigned i = 0; i < kMFMIDISendErrorSlotCount; i++) {
+        MFMIDISendErrorCount *slot = &into->sendErrors[i];
+        if (slot->status == status || slot->status == 0) {
+            slot->status = status;
+            slot->count += count;
+            return;
+        }
+    }
+}
+
+void _MFTrafficStatsTableSnapshotAll(_MFTrafficStatsTableRef table, MFMIDITrafficStatistics *outStats)
+{
+    memset(outStats, 0, sizeof(*outStats));
+
+    pthread_mutex_lock(&table->lock);
+    for (_MFTrafficStatsEntry *entry = table->entries; entry; entry = entry->next)
+    {
+        MFMIDITrafficStatistics s;
+        _MFTrafficStatsSnapshot(&entry->stats, &s);
+
+        outStats->sentMessageCount += s.sentMessageCount;
+        outStats->sentByteCount += s.sentByteCount;
+        outStats->sendErrorCount += s.sendErrorCount;
+        outStats->droppedMessageCount += s.droppedMessageCount;
+        outStats->droppedByteCount += s.droppedByteCount;
+        outStats->receivedPacketCount += s.receivedPacketCount;
+        outStats->receivedByteCount += s.receivedByteCount;
+        outStats->receiveJitterNanos = s.receiveJitterNanos > outStats->receiveJitterNanos ? s.receiveJitterNanos : outStats->receiveJitterNanos;    // worst
+        for (unsigned i = 0; i < kMFMIDIHistogramBucketCount; i++) {
+            outStats->sendLatency.counts[i] += s.sendLatency.counts[i];
+            outStats->receiveJitter.counts[i] += s.receiveJitter.counts[i];
+        }
+        for (unsigned i = 0; i < kMFMIDISendErrorSlotCount && s.sendErrors[i].status; i++) {
+            _MergeErrorCount(outStats, s.sendErrors[i].status, s.sendErrors[i].count);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Recording
+/////////////////////////////////////////////////////////////////////////
+
+void _MFTrafficStatsCountPacketList(const MIDIPacketList *packetList, uint32_t *outMessageCount, uint32_t *outByteCount)
+{
+    uint32_t messages = 0, bytes = 0;
+    const MIDIPacket *packet = &packetList->packet[0];
+    for (UInt32 i = 0; i < packetList->numPackets; i++)
+    {
+        for (UInt16 b = 0; b < packet->length; b++) {
+            messages += (packet->data[b] & 0x80) && packet->data[b] != 0xF7;
+        }
+        bytes += packet->length;
+        packet = MIDIPacketNext(packet);
+    }
+    *outMessageCount = messages;
+    *outByteCount = bytes;
+}
+
+//---------------------------------------------------------------------
+
+static void _RecordError(_MFTrafficStats *stats, OSStatus status)
+{
+    atomic_fetch_add_explicit(&stats->sendErrorCount, 1, _RELAXED);
+
+    // Claim or find a slot for this status. Once all are taken, new statuses are only in the total
+    for (unsigned i = 0; i < kMFMIDISendErrorSlotCount; i++)
+    {
+        OSStatus slotStatus = atomic_load_explicit(&stats->sendErrorStatus[i], _RELAXED);
+        if (slotStatus == 0) {
+            OSStatus expected = 0;
+            if (atomic_compare_exchange_strong(&stats->sendErrorStatus[i], &expected, status)) slotStatus = status;
+            else slotStatus = expected;
+        }
+        if (slotStatus == status) {
+            atomic_fetch_add_explicit(&stats->sendErrorStatusCount[i], 1, _RELAXED);
+            return;
+        }
+    }
+}
+
+void _MFTrafficStatsRecordSend(_MFTrafficStats *stats, uint32_t messageCount, uint32_t byteCount, OSStatus status, uint64_t durationTicks)
+{
+    if (status != noErr) {
+        _RecordError(stats, status);
+    } else {
+        atomic_fetch_add_explicit(&stats->sentMessageCount, messageCount, _RELAXED);
+        atomic_fetch_add_explicit(&stats->sentByteCount, byteCount, _RELAXED);
+    }
+    const unsigned bucket = _BucketForNanos((uint64_t)_NanosFromTicks(stats, (int64_t)durationTicks));
+    atomic_fetch_add_explicit(&stats->sendLatency[bucket], 1, _RELAXED);
+}
+
+//---------------------------------------------------------------------
+
+void _MFTrafficStatsRecordDrop(_MFTrafficStats *stats, uint32_t messageCount, uint32_t byteCount)
+{
+    atomic_fetch_add_explicit(&stats->droppedMessageCount, messageCount, _RELAXED);
+    atomic_fetch_add_explicit(&stats->droppedByteCount, byteCount, _RELAXED);
+}
+
+//---------------------------------------------------------------------
+
+void _MFTrafficStatsRecordReceive(_MFTrafficStats *stats, uint32_t byteCount, uint64_t timestamp, uint64_t arrivalTime)
+{
+    atomic_fetch_add_explicit(&stats->receivedPacketCount, 1, _RELAXED);
+    atomic_fetch_add_explicit(&stats->receivedByteCount, byteCount, _RELAXED);
+
+    // "Now" timestamps say nothing about the transit so leave the jitter alone
+    if (!timestamp || !arrivalTime) return;
+
+    const int64_t transit = _NanosFromTicks(stats, (int64_t)(arrivalTime - timestamp));
+    if (stats->hasLastTransit)
+    {
+        const int64_t d = transit - stats->lastTransitNanos;
+        const uint64_t absD = (uint64_t)(d < 0 ? -d : d);
+        atomic_fetch_add_explicit(&stats->receiveJitter[_BucketForNanos(absD)], 1, _RELAXED);
+
+        const int64_t jitter = (int64_t)atomic_load_explicit(&stats->receiveJitterNanos, _RELAXED);
+        atomic_store_explicit(&stats->receiveJitterNanos, (uint64_t)(jitter + ((int64_t)absD - jitter) / 16), _RELAXED);
+    }
+    stats->lastTransitNanos = transit;
+    stats->hasLastTransit = true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Snapshot
+/////////////////////////////////////////////////////////////////////////
+
+void _MFTrafficStatsSnapshot(const _MFTrafficStats *stats, MFMIDITrafficStatistics *outStats)
+{
+    // The loads don't modify anything but C11 wants non-const atomics
+    _MFTrafficStats *s = (_MFTrafficStats *)stats;
+    memset(outStats, 0, sizeof(*outStats));
+
+    outStats->sentMessageCount = atomic_load_explicit(&s->sentMessageCount, _RELAXED);
+    outStats->sentByteCount = atomic_load_explicit(&s->sentByteCount, _RELAXED);
+    outStats->sendErrorCount = atomic_load_explicit(&s->sendErrorCount, _RELAXED);
+    for (unsigned i = 0; i < kMFMIDISendErrorSlotCount; i++) {
+        outStats->sendErrors[i].status = atomic_load_explicit(&s->sendErrorStatus[i], _RELAXED);
+        outStats->sendErrors[i].count = atomic_load_explicit(&s->sendErrorStatusCount[i], _RELAXED);
+    }
+    outStats->droppedMessageCount = atomic_load_explicit(&s->droppedMessageCount, _RELAXED);
+    outStats->droppedByteCount = atomic_load_explicit(&s->droppedByteCount, _RELAXED);
+    outStats->receivedPacketCount = atomic_load_explicit(&s->receivedPacketCount, _RELAXED);
+    outStats->receivedByteCount = atomic_load_explicit(&s->receivedByteCount, _RELAXED);
+    outStats->receiveJitterNanos = atomic_load_explicit(&s->receiveJitterNanos, _RELAXED);
+    for (unsigned i = 0; i < kMFMIDIHistogramBucketCount; i++) {
+        outStats->sendLatency.counts[i] = atomic_load_explicit(&s->sendLatency[i], _RELAXED);
+        outStats->receiveJitter.counts[i] = atomic_load_explicit(&s->receiveJitter[i], _RELAXED);
+    }
+}
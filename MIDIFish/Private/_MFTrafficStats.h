@@ -0,0 +1,88 @@
+//
+//  _MFTrafficStats.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish__MFTrafficStats_h
+#define MIDIFish__MFTrafficStats_h
+
+#include "MFMIDITrafficStatistics.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/**
+ Live, lock-free counters behind MFMIDITrafficStatistics.
+
+ One `_MFTrafficStats` per endpoint (or Audiobus port), owned by a `_MFTrafficStatsTable`. They're created on first use and never freed before the table so the send routes and receive streams can hold plain pointers to them without lifetime worries. A device which comes back gets its old counters back. Memory grows with the number of distinct endpoints ever seen, which is small.
+
+ Send recording is safe from any number of threads at once. Receive recording must be from one thread at a time (it keeps the previous transit time for jitter). Times are passed in host ticks and converted with the table's timebase.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _MFTrafficStats {
+    uint32_t timebaseNumer;             // ns = ticks * numer / denom
+    uint32_t timebaseDenom;
+
+    _Atomic uint64_t sentMessageCount;
+    _Atomic uint64_t sentByteCount;
+    _Atomic uint64_t sendErrorCount;
+    _Atomic OSStatus sendErrorStatus[kMFMIDISendErrorSlotCount];
+    _Atomic uint64_t sendErrorStatusCount[kMFMIDISendErrorSlotCount];
+    _Atomic uint64_t droppedMessageCount;
+    _Atomic uint64_t droppedByteCount;
+    _Atomic uint64_t sendLatency[kMFMIDIHistogramBucketCount];
+
+    _Atomic uint64_t receivedPacketCount;
+    _Atomic uint64_t receivedByteCount;
+    _Atomic uint64_t receiveJitter[kMFMIDIHistogramBucketCount];
+    _Atomic uint64_t receiveJitterNanos;
+
+    // Receive thread only
+    int64_t lastTransitNanos;
+    bool hasLastTransit;
+} _MFTrafficStats;
+
+typedef struct _MFTrafficStatsTable *_MFTrafficStatsTableRef;
+
+
+/** @param timebaseNumer,timebaseDenom Host ticks to nanoseconds, as per mach_timebase_info. NULL on allocation failure */
+extern _MFTrafficStatsTableRef _MFTrafficStatsTableCreate(uint32_t timebaseNumer, uint32_t timebaseDenom);
+
+/** Frees all the stats. Nothing may be using them */
+extern void _MFTrafficStatsTableDestroy(_MFTrafficStatsTableRef table);
+
+/** The stats for `key`, created zeroed if new. NULL on allocation failure. Locks, so not for the send/receive paths; look up once and hold the pointer */
+extern _MFTrafficStats *_MFTrafficStatsTableGet(_MFTrafficStatsTableRef table, uint64_t key);
+
+/** As above but NULL if there's none yet */
+extern _MFTrafficStats *_MFTrafficStatsTableFind(_MFTrafficStatsTableRef table, uint64_t key);
+
+/** Sum of all entries. Error slots are merged by status */
+extern void _MFTrafficStatsTableSnapshotAll(_MFTrafficStatsTableRef table, MFMIDITrafficStatistics *outStats);
+
+
+/** Messages (status bytes other than EOX) and bytes in a packet list. Do it once per send, not per destination */
+extern void _MFTrafficStatsCountPacketList(const MIDIPacketList *packetList, uint32_t *outMessageCount, uint32_t *outByteCount);
+
+/** One packet list handed to the backend (or Audiobus) for this destination. Real-time safe */
+extern void _MFTrafficStatsRecordSend(_MFTrafficStats *stats, uint32_t messageCount, uint32_t byteCount, OSStatus status, uint64_t durationTicks);
+
+/** One packet list not sent because sending was disabled. Real-time safe */
+extern void _MFTrafficStatsRecordDrop(_MFTrafficStats *stats, uint32_t messageCount, uint32_t byteCount);
+
+/** One received packet. `timestamp` is the packet's own (0 = none), `arrivalTime` when our read proc saw it. Single thread at a time */
+extern void _MFTrafficStatsRecordReceive(_MFTrafficStats *stats, uint32_t byteCount, uint64_t timestamp, uint64_t arrivalTime);
+
+/** Safe from any thread. Counters are individually (not collectively) consistent */
+extern void _MFTrafficStatsSnapshot(const _MFTrafficStats *stats, MFMIDITrafficStatistics *outStats);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
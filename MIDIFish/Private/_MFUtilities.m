@@ -35,15 +35,10 @@ BOOL _MFIsNetworkSessionEndpoint(MIDIEndpointRef ref)
     MIDIEntityRef entity = 0;
     MIDIEndpointGetEntity(ref, &entity);
     
-    BOOL hasMidiRtpKey = NO;
-    CFPropertyListRef properties = nil;
-    OSStatus s = MIDIObjectGetProperties(entity, &properties, true);
-    if (!s)
-    {
-        NSDictionary *dictionary = (__bridge NSDictionary *)(properties);
-        hasMidiRtpKey = [dictionary valueForKey:@"apple.midirtp.session"] != nil;
-        CFRelease(properties);
-    }
-    
-    return hasMidiRtpKey;
+    // Just the one key rather than the entity's whole property tree
+    CFDictionaryRef session = NULL;
+    OSStatus s = MIDIObjectGetDictionaryProperty(entity, CFSTR("apple.midirtp.session"), &session);
+    if (s || !session) return NO;
+    CFRelease(session);
+    return YES;
 }
@@ -0,0 +1,389 @@
+//
+//  MFConnectionStateStoreTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the session's in-memory copy of the persisted connection state, against an `MFMIDIStateStorage` which keeps everything in memory and counts its calls. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish -I MIDIFish/Private \
+        Tests/MFConnectionStateStoreTests.c MIDIFish/Private/_MFConnectionStateStore.c \
+        -lpthread -o mf_state_store_tests && ./mf_state_store_tests
+ */
+
+#include "MFTest.h"
+#include "_MFConnectionStateStore.h"
+#include <stdbool.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Fake Storage
+/////////////////////////////////////////////////////////////////////////
+
+static const int64_t _kDay = 24 * 60 * 60;
+static const int64_t _kNow = 1800000000;
+
+#define _MAX_RECORDS 256
+
+/** What's "on disk", and how often it's been asked for */
+typedef struct {
+    char storageIDs[_MAX_RECORDS][64];
+    bool enabled[_MAX_RECORDS];
+    int64_t lastSeen[_MAX_RECORDS];
+    size_t stateCount;
+
+    char hostNames[_MAX_RECORDS][32];
+    char hostAddresses[_MAX_RECORDS][32];
+    uint16_t hostPorts[_MAX_RECORDS];
+    size_t hostCount;
+
+    char resolvedNames[_MAX_RECORDS][32];
+    char resolvedAddresses[_MAX_RECORDS][32];
+    uint16_t resolvedPorts[_MAX_RECORDS];
+    int64_t lastResolved[_MAX_RECORDS];
+    size_t resolvedCount;
+
+    unsigned loadCount, loadResolvedCount, saveCount, saveResolvedCount;
+    bool failSaves;
+} _FakeStorage;
+
+static void _FakeLoad(void *context, MFMIDIConnectionStateLoadProc stateProc, MFMIDIManualHostLoadProc hostProc, void *refCon)
+{
+    _FakeStorage *fake = context;
+    fake->loadCount++;
+    for (size_t i = 0; i < fake->stateCount; i++) {
+        const MFMIDIConnectionStateRecord record = { fake->storageIDs[i], fake->enabled[i], fake->lastSeen[i] };
+        stateProc(&record, refCon);
+    }
+    for (size_t i = 0; i < fake->hostCount; i++) {
+        const MFMIDIManualHostRecord record = { fake->hostNames[i], fake->hostAddresses[i], fake->hostPorts[i] };
+        hostProc(&record, refCon);
+    }
+}
+
+static bool _FakeSave(void *context, const MFMIDIConnectionStateRecord *states, size_t stateCount, const MFMIDIManualHostRecord *hosts, size_t hostCount)
+{
+    _FakeStorage *fake = context;
+    fake->saveCount++;
+    if (fake->failSaves) return false;
+    fake->stateCount = stateCount;
+    for (size_t i = 0; i < stateCount; i++) {
+        snprintf(fake->storageIDs[i], sizeof(fake->storageIDs[i]), "%s", states[i].storageID);
+        fake->enabled[i] = states[i].enabled;
+        fake->lastSeen[i] = states[i].lastSeen;
+    }
+    fake->hostCount = hostCount;
+    for (size_t i = 0; i < hostCount; i++) {
+        snprintf(fake->hostNames[i], sizeof(fake->hostNames[i]), "%s", hosts[i].name);
+        snprintf(fake->hostAddresses[i], sizeof(fake->hostAddresses[i]), "%s", hosts[i].address);
+        fake->hostPorts[i] = hosts[i].port;
+    }
+    return true;
+}
+
+static void _FakeLoadResolvedHosts(void *context, MFMIDIResolvedHostLoadProc proc, void *refCon)
+{
+    _FakeStorage *fake = context;
+    fake->loadResolvedCount++;
+    for (size_t i = 0; i < fake->resolvedCount; i++) {
+        const MFMIDIResolvedHostRecord record = { fake->resolvedNames[i], fake->resolvedAddresses[i], fake->resolvedPorts[i], fake->lastResolved[i] };
+        proc(&record, refCon);
+    }
+}
+
+static bool _FakeSaveResolvedHosts(void *context, const MFMIDIResolvedHostRecord *hosts, size_t count)
+{
+    _FakeStorage *fake = context;
+    fake->saveResolvedCount++;
+    fake->resolvedCount = count;
+    for (size_t i = 0; i < count; i++) {
+        snprintf(fake->resolvedNames[i], sizeof(fake->resolvedNames[i]), "%s", hosts[i].name);
+        snprintf(fake->resolvedAddresses[i], sizeof(fake->resolvedAddresses[i]), "%s", hosts[i].address);
+        fake->resolvedPorts[i] = hosts[i].port;
+        fake->lastResolved[i] = hosts[i].lastResolved;
+    }
+    return true;
+}
+
+static MFMIDIStateStorage _StorageForFake(_FakeStorage *fake)
+{
+    return (MFMIDIStateStorage){ "fake", fake, _FakeLoad, _FakeSave, _FakeLoadResolvedHosts, _FakeSaveResolvedHosts };
+}
+
+static void _FakeAddState(_FakeStorage *fake, const char *storageID, bool enabled, int64_t lastSeen)
+{
+    snprintf(fake->storageIDs[fake->stateCount], sizeof(fake->storageIDs[0]), "%s", storageID);
+    fake->enabled[fake->stateCount] = enabled;
+    fake->lastSeen[fake->stateCount] = lastSeen;
+    fake->stateCount++;
+}
+
+/** -1 if it isn't saved */
+static int _FakeIndexOfState(const _FakeStorage *fake, const char *storageID)
+{
+    for (size_t i = 0; i < fake->stateCount; i++) {
+        if (strcmp(fake->storageIDs[i], storageID) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static void _CountHost(const MFMIDIManualHostRecord *record, void *refCon)
+{
+    (void)record;
+    (*(unsigned *)refCon)++;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Loading
+/////////////////////////////////////////////////////////////////////////
+
+/** Everything's read when it's created and never again, however it's used */
+static void _TestLoadsOnce(void)
+{
+    _FakeStorage fake = { 0 };
+    _FakeAddState(&fake, "endpoint::destination::Synth", true, _kNow - _kDay);
+    _FakeAddState(&fake, "endpoint::source::Keys", false, _kNow - 2 * _kDay);
+    snprintf(fake.hostNames[0], 32, "Studio");
+    snprintf(fake.hostAddresses[0], 32, "10.0.0.2");
+    fake.hostPorts[0] = 5004;
+    fake.hostCount = 1;
+    snprintf(fake.resolvedNames[0], 32, "Laptop");
+    snprintf(fake.resolvedAddresses[0], 32, "10.0.0.3");
+    fake.resolvedPorts[0] = 5006;
+    fake.lastResolved[0] = _kNow - _kDay;
+    fake.resolvedCount = 1;
+    const MFMIDIStateStorage storage = _StorageForFake(&fake);
+
+    _MFConnectionStateStoreRef store = _MFConnectionStateStoreCreate(&storage, _kNow);
+    MF_CHECK_EQ(fake.loadCount, 1);
+    MF_CHECK_EQ(fake.loadResolvedCount, 1);
+    MF_CHECK_EQ(_MFConnectionStateStoreGetCount(store), 2);
+
+    bool enabled = false;
+    MF_CHECK(_MFConnectionStateStoreGetEnabled(store, "endpoint::destination::Synth", &enabled));
+    MF_CHECK(enabled);
+    MF_CHECK(_MFConnectionStateStoreGetEnabled(store, "endpoint::source::Keys", &enabled));
+    MF_CHECK(!enabled);
+    MF_CHECK(!_MFConnectionStateStoreGetEnabled(store, "endpoint::source::Nope", &enabled));
+
+    char address[32];
+    uint16_t port = 0;
+    MF_CHECK(_MFConnectionStateStoreGetResolvedHost(store, "Laptop", address, sizeof(address), &port));
+    MF_CHECK(strcmp(address, "10.0.0.3") == 0);
+    MF_CHECK_EQ(port, 5006);
+    unsigned hostCount = 0;
+    _MFConnectionStateStoreEnumerateManualHosts(store, _CountHost, &hostCount);
+    MF_CHECK_EQ(hostCount, 1);
+
+    // Changes and saves don't go back to the storage for anything
+    _MFConnectionStateStoreSetEnabled(store, "endpoint::source::Keys", true, _kNow);
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.loadCount, 1);
+    MF_CHECK_EQ(fake.loadResolvedCount, 1);
+    _MFConnectionStateStoreDestroy(store);
+}
+
+//---------------------------------------------------------------------
+
+/** Entries from before last seen times were kept start their clocks at load, which makes the store dirty without a mutator having asked for a save */
+static void _TestLoadStartsLegacyClocks(void)
+{
+    _FakeStorage fake = { 0 };
+    _FakeAddState(&fake, "legacy", true, 0);
+    const MFMIDIStateStorage storage = _StorageForFake(&fake);
+
+    _MFConnectionStateStoreRef store = _MFConnectionStateStoreCreate(&storage, _kNow);
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 1);
+    MF_CHECK_EQ(fake.lastSeen[0], _kNow);
+    _MFConnectionStateStoreDestroy(store);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Write-Behind
+/////////////////////////////////////////////////////////////////////////
+
+/** A burst of changes asks for one save, which writes them all. The next change after it asks again */
+static void _TestWriteBehindCoalesces(void)
+{
+    _FakeStorage fake = { 0 };
+    const MFMIDIStateStorage storage = _StorageForFake(&fake);
+    _MFConnectionStateStoreRef store = _MFConnectionStateStoreCreate(&storage, _kNow);
+
+    // Nothing changed, nothing written
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 0);
+
+    unsigned scheduled = 0;
+    char storageID[64];
+    for (int i = 0; i < 100; i++) {
+        snprintf(storageID, sizeof(storageID), "endpoint::destination::%d", i);
+        if (_MFConnectionStateStoreSetEnabled(store, storageID, i % 2, _kNow)) scheduled++;
+    }
+    if (_MFConnectionStateStoreSetManualHost(store, "Studio", "10.0.0.2", 5004)) scheduled++;
+    if (_MFConnectionStateStoreSetResolvedHost(store, "Laptop", "10.0.0.3", 5006, _kNow)) scheduled++;
+    MF_CHECK_EQ(scheduled, 1);
+    MF_CHECK_EQ(fake.saveCount, 0);
+
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 1);
+    MF_CHECK_EQ(fake.saveResolvedCount, 1);
+    MF_CHECK_EQ(fake.stateCount, 100);
+    MF_CHECK_EQ(fake.hostCount, 1);
+    MF_CHECK_EQ(fake.resolvedCount, 1);
+    const int index = _FakeIndexOfState(&fake, "endpoint::destination::7");
+    MF_CHECK(index >= 0 && fake.enabled[index] && fake.lastSeen[index] == _kNow);
+
+    // Saved, so nothing more to write until the next burst, which asks once again
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 1);
+    MF_CHECK(_MFConnectionStateStoreRemoveManualHost(store, "Studio"));
+    MF_CHECK(!_MFConnectionStateStoreSetEnabled(store, "endpoint::destination::0", true, _kNow));
+    MF_CHECK(!_MFConnectionStateStoreRemoveManualHost(store, "Studio"));
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 2);
+    MF_CHECK_EQ(fake.hostCount, 0);
+    _MFConnectionStateStoreDestroy(store);
+}
+
+//---------------------------------------------------------------------
+
+/** Seeing a connection again, or setting what it already was, within the day doesn't dirty the store. A day later it does */
+static void _TestUnchangedDoesNotDirty(void)
+{
+    _FakeStorage fake = { 0 };
+    const MFMIDIStateStorage storage = _StorageForFake(&fake);
+    _MFConnectionStateStoreRef store = _MFConnectionStateStoreCreate(&storage, _kNow);
+
+    MF_CHECK(_MFConnectionStateStoreSetEnabled(store, "a", true, _kNow));
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 1);
+
+    MF_CHECK(!_MFConnectionStateStoreSetEnabled(store, "a", true, _kNow + 60));
+    MF_CHECK(!_MFConnectionStateStoreTouch(store, "a", _kNow + _kDay - 1));
+    MF_CHECK(!_MFConnectionStateStoreTouch(store, "never stored", _kNow + 2 * _kDay));
+    MF_CHECK(_MFConnectionStateStoreSetResolvedHost(store, "x", "1.2.3.4", 1, _kNow));       // new, so it does
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 2);
+    MF_CHECK(!_MFConnectionStateStoreSetResolvedHost(store, "x", "1.2.3.4", 1, _kNow + 60));
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 2);
+
+    MF_CHECK(_MFConnectionStateStoreTouch(store, "a", _kNow + _kDay));
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 3);
+    MF_CHECK_EQ(fake.lastSeen[_FakeIndexOfState(&fake, "a")], _kNow + _kDay);
+    _MFConnectionStateStoreDestroy(store);
+}
+
+//---------------------------------------------------------------------
+
+/** A failed save stays dirty and the next change asks for another, which writes everything */
+static void _TestFailedSaveRetries(void)
+{
+    _FakeStorage fake = { 0 };
+    const MFMIDIStateStorage storage = _StorageForFake(&fake);
+    _MFConnectionStateStoreRef store = _MFConnectionStateStoreCreate(&storage, _kNow);
+
+    fake.failSaves = true;
+    MF_CHECK(_MFConnectionStateStoreSetEnabled(store, "a", true, _kNow));
+    MF_CHECK(!_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 1);
+    MF_CHECK_EQ(fake.saveResolvedCount, 0);
+
+    fake.failSaves = false;
+    MF_CHECK(_MFConnectionStateStoreSetEnabled(store, "b", false, _kNow));
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.saveCount, 2);
+    MF_CHECK_EQ(fake.stateCount, 2);
+    _MFConnectionStateStoreDestroy(store);
+}
+
+//---------------------------------------------------------------------
+
+/** No storage: a working store which never writes */
+static void _TestNoStorage(void)
+{
+    _MFConnectionStateStoreRef store = _MFConnectionStateStoreCreate(NULL, _kNow);
+    MF_CHECK(_MFConnectionStateStoreSetEnabled(store, "a", true, _kNow));
+    bool enabled = false;
+    MF_CHECK(_MFConnectionStateStoreGetEnabled(store, "a", &enabled) && enabled);
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    _MFConnectionStateStoreDestroy(store);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Pruning
+/////////////////////////////////////////////////////////////////////////
+
+/** Entries and resolved hosts not seen within maxAge go; the rest are all still found in the rebuilt table */
+static void _TestPruneByLastSeen(void)
+{
+    _FakeStorage fake = { 0 };
+    char storageID[64];
+    for (int i = 0; i < 200; i++) {
+        snprintf(storageID, sizeof(storageID), "endpoint::destination::%d", i);
+        _FakeAddState(&fake, storageID, i % 3 == 0, _kNow - (i % 4) * 10 * _kDay);      // 0, 10, 20 and 30 days ago
+    }
+    snprintf(fake.resolvedNames[0], 32, "Recent");
+    snprintf(fake.resolvedAddresses[0], 32, "10.0.0.3");
+    fake.lastResolved[0] = _kNow - 5 * _kDay;
+    snprintf(fake.resolvedNames[1], 32, "Old");
+    snprintf(fake.resolvedAddresses[1], 32, "10.0.0.4");
+    fake.lastResolved[1] = _kNow - 40 * _kDay;
+    fake.resolvedCount = 2;
+    const MFMIDIStateStorage storage = _StorageForFake(&fake);
+
+    _MFConnectionStateStoreRef store = _MFConnectionStateStoreCreate(&storage, _kNow);
+    MF_CHECK_EQ(_MFConnectionStateStoreGetCount(store), 200);
+    MF_CHECK(!_MFConnectionStateStorePrune(store, _kNow, 0));
+    MF_CHECK_EQ(_MFConnectionStateStoreGetCount(store), 200);
+
+    // Up to 15 days old stays
+    MF_CHECK(_MFConnectionStateStorePrune(store, _kNow, 15 * _kDay));
+    MF_CHECK_EQ(_MFConnectionStateStoreGetCount(store), 100);
+    unsigned wrong = 0;
+    for (int i = 0; i < 200; i++)
+    {
+        snprintf(storageID, sizeof(storageID), "endpoint::destination::%d", i);
+        bool enabled = false;
+        const bool found = _MFConnectionStateStoreGetEnabled(store, storageID, &enabled);
+        if (found != (i % 4 < 2) || (found && enabled != (i % 3 == 0))) wrong++;
+    }
+    MF_CHECK_EQ(wrong, 0);
+    char address[32];
+    MF_CHECK(_MFConnectionStateStoreGetResolvedHost(store, "Recent", address, sizeof(address), NULL));
+    MF_CHECK(!_MFConnectionStateStoreGetResolvedHost(store, "Old", address, sizeof(address), NULL));
+
+    // Nothing left to prune. Survivors can still be added to
+    MF_CHECK(!_MFConnectionStateStorePrune(store, _kNow, 15 * _kDay));
+    _MFConnectionStateStoreSetEnabled(store, "endpoint::destination::new", true, _kNow);
+    MF_CHECK_EQ(_MFConnectionStateStoreGetCount(store), 101);
+
+    MF_CHECK(_MFConnectionStateStoreSave(store));
+    MF_CHECK_EQ(fake.stateCount, 101);
+    MF_CHECK_EQ(fake.resolvedCount, 1);
+    MF_CHECK(_FakeIndexOfState(&fake, "endpoint::destination::2") < 0);
+    MF_CHECK(_FakeIndexOfState(&fake, "endpoint::destination::5") >= 0);
+    _MFConnectionStateStoreDestroy(store);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestLoadsOnce);
+    MF_RUN(_TestLoadStartsLegacyClocks);
+    MF_RUN(_TestWriteBehindCoalesces);
+    MF_RUN(_TestUnchangedDoesNotDirty);
+    MF_RUN(_TestFailedSaveRetries);
+    MF_RUN(_TestNoStorage);
+    MF_RUN(_TestPruneByLastSeen);
+    return MFTestFinish();
+}
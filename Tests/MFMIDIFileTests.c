@@ -0,0 +1,334 @@
+//
+//  MFMIDIFileTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the Standard MIDI File recorder and player, mostly as a round trip: record, finish, open and check what plays back. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish -I MIDIFish/Private \
+        Tests/MFMIDIFileTests.c MIDIFish/MFMIDIFileRecorder.c MIDIFish/MFMIDIFilePlayer.c \
+        MIDIFish/MFMIDIParser.c MIDIFish/MFMIDITypes.c MIDIFish/Private/_MFRingBuffer.c \
+        -lpthread -o mf_file_tests && ./mf_file_tests
+
+ Files go in $TMPDIR (or /tmp) and are removed afterwards.
+ */
+
+#include "MFTest.h"
+#include "MFMIDIFileRecorder.h"
+#include "MFMIDIFilePlayer.h"
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+/////////////////////////////////////////////////////////////////////////
+
+/** 960us a quarter note over 960 ticks puts a tick at exactly 1us, so times come back as recorded */
+static const MFMIDIFileRecorderOptions _kOptionsTemplate = { .microsecondsPerQuarterNote = 960 };
+
+#define _MAX_EVENTS 64
+
+/** Copies of what the player called back with */
+typedef struct {
+    uint64_t times[_MAX_EVENTS];
+    uint16_t tracks[_MAX_EVENTS];
+    MFMIDIFileEventKind kinds[_MAX_EVENTS];
+    uint8_t bytes[_MAX_EVENTS][16];
+    uint32_t lengths[_MAX_EVENTS];
+    unsigned count;
+} _Played;
+
+static void _Collect(const MFMIDIFileEvent *event, void *context)
+{
+    _Played *played = context;
+    if (played->count == _MAX_EVENTS) return;
+    const unsigned i = played->count++;
+    played->times[i] = event->time;
+    played->tracks[i] = event->track;
+    played->kinds[i] = event->kind;
+    played->lengths[i] = event->message.length;
+    memcpy(played->bytes[i], MFMIDIMessageValueGetBytes(&event->message), event->message.length < 16 ? event->message.length : 16);
+}
+
+/** Everything in the file, in one render */
+static void _PlayAll(const char *path, _Played *outPlayed)
+{
+    memset(outPlayed, 0, sizeof(*outPlayed));
+    MFMIDIFilePlayerRef player = MFMIDIFilePlayerOpen(path);
+    MF_CHECK(player != NULL);
+    if (!player) return;
+    MF_CHECK_EQ(MFMIDIFilePlayerRender(player, UINT64_MAX - 1, _Collect, outPlayed), kMFMIDIFilePlayerFinished);
+    MFMIDIFilePlayerClose(player);
+}
+
+static void _TempPath(char *path, size_t size, const char *name)
+{
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, size, "%s/mf_file_tests_%d_%s.mid", dir && *dir ? dir : "/tmp", (int)getpid(), name);
+}
+
+static void _WriteFile(const char *path, const uint8_t *bytes, size_t length)
+{
+    FILE *file = fopen(path, "wb");
+    MF_CHECK(file != NULL);
+    if (!file) return;
+    MF_CHECK_EQ(fwrite(bytes, 1, length, file), length);
+    fclose(file);
+}
+
+#define _CHECK_EVENT(played, i, time, track, kind, ...) do { \
+    const uint8_t _expected[] = { __VA_ARGS__ }; \
+    MF_CHECK_EQ((played).times[i], (time)); \
+    MF_CHECK_EQ((played).tracks[i], (track)); \
+    MF_CHECK_EQ((played).kinds[i], (kind)); \
+    MF_CHECK_EQ((played).lengths[i], sizeof(_expected)); \
+    MF_CHECK_BYTES((played).bytes[i], _expected, sizeof(_expected)); \
+} while (0)
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Round Trips
+/////////////////////////////////////////////////////////////////////////
+
+/** Format 0: both tracks recorded to merge into the one, running status comes back expanded, sysex split across records comes back whole and realtime as an escape */
+static void _TestRoundTripFormat0(void)
+{
+    char path[512];
+    _TempPath(path, sizeof(path), "format0");
+    MFMIDIFileRecorderOptions options = _kOptionsTemplate;
+    options.format = 0;
+    options.trackCount = 2;
+    MFMIDIFileRecorderRef recorder = MFMIDIFileRecorderCreate(path, &options, 1000);
+    MF_CHECK(recorder != NULL);
+    if (!recorder) return;
+
+    // Times are ns, so a tick is 1000
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 0, 1000, (const uint8_t[]){ 0x90, 60, 100, 64, 90 }, 5));
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 0, 3000, (const uint8_t[]){ 67, 80 }, 2));              // running status from the last record
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 1, 5000, (const uint8_t[]){ 0xF0, 0x7E, 1, 2 }, 4));
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 1, 6000, (const uint8_t[]){ 3, 4, 0xF7 }, 3));
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 0, 7000, (const uint8_t[]){ 0xF8 }, 1));
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 0, 8000, (const uint8_t[]){ 0xC2, 5 }, 2));
+    MF_CHECK(MFMIDIFileRecorderFinish(recorder));
+    MF_CHECK_EQ(MFMIDIFileRecorderDroppedCount(recorder), 0);
+    MFMIDIFileRecorderDestroy(recorder);
+
+    MFMIDIFilePlayerRef player = MFMIDIFilePlayerOpen(path);
+    MF_CHECK(player != NULL);
+    if (player) {
+        MF_CHECK_EQ(MFMIDIFilePlayerGetFormat(player), 0);
+        MF_CHECK_EQ(MFMIDIFilePlayerGetTrackCount(player), 1);
+        MF_CHECK_EQ(MFMIDIFilePlayerGetDivision(player), 960);
+        MFMIDIFilePlayerClose(player);
+    }
+
+    _Played played;
+    _PlayAll(path, &played);
+    MF_CHECK_EQ(played.count, 7);
+    _CHECK_EVENT(played, 0, 0, 0, kMFMIDIFileEventMessage, 0x90, 60, 100);
+    _CHECK_EVENT(played, 1, 0, 0, kMFMIDIFileEventMessage, 0x90, 64, 90);
+    _CHECK_EVENT(played, 2, 2000, 0, kMFMIDIFileEventMessage, 0x90, 67, 80);
+    _CHECK_EVENT(played, 3, 4000, 0, kMFMIDIFileEventSysex, 0x7E, 1, 2);
+    _CHECK_EVENT(played, 4, 5000, 0, kMFMIDIFileEventEscape, 3, 4, 0xF7);
+    _CHECK_EVENT(played, 5, 6000, 0, kMFMIDIFileEventEscape, 0xF8);
+    _CHECK_EVENT(played, 6, 7000, 0, kMFMIDIFileEventMessage, 0xC2, 5);
+    remove(path);
+}
+
+//---------------------------------------------------------------------
+
+/** Format 1: each track its own MTrk, merged back by time with ties in track order, and a long sysex out of line */
+static void _TestRoundTripFormat1(void)
+{
+    char path[512];
+    _TempPath(path, sizeof(path), "format1");
+    MFMIDIFileRecorderOptions options = _kOptionsTemplate;
+    options.format = 1;
+    options.trackCount = 3;
+    const char *names[] = { "Sent", NULL, "Received" };
+    options.trackNames = names;
+    MFMIDIFileRecorderRef recorder = MFMIDIFileRecorderCreate(path, &options, 0);
+    MF_CHECK(recorder != NULL);
+    if (!recorder) return;
+
+    uint8_t sysex[12] = { 0xF0, 0x43 };
+    for (int i = 2; i < 11; i++) sysex[i] = (uint8_t)i;
+    sysex[11] = 0xF7;
+
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 2, 10000, (const uint8_t[]){ 0xB0, 7, 100 }, 3));
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 0, 10000, (const uint8_t[]){ 0x90, 60, 100 }, 3));
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 1, 20000, sysex, sizeof(sysex)));
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 0, 30000, (const uint8_t[]){ 0x80, 60, 0 }, 3));
+    MF_CHECK(MFMIDIFileRecorderRecord(recorder, 2, 25000, (const uint8_t[]){ 7, 50 }, 2));
+    MF_CHECK(!MFMIDIFileRecorderRecord(recorder, 3, 25000, (const uint8_t[]){ 0xF8 }, 1));     // no such track
+    MF_CHECK(MFMIDIFileRecorderFinish(recorder));
+    MF_CHECK(!MFMIDIFileRecorderRecord(recorder, 0, 40000, (const uint8_t[]){ 0xF8 }, 1));     // finished
+    MFMIDIFileRecorderDestroy(recorder);
+
+    // The temp files are gone
+    char tempPath[600];
+    snprintf(tempPath, sizeof(tempPath), "%s.1.tmp", path);
+    MF_CHECK(access(tempPath, F_OK) != 0);
+
+    MFMIDIFilePlayerRef player = MFMIDIFilePlayerOpen(path);
+    MF_CHECK(player != NULL);
+    if (player) {
+        MF_CHECK_EQ(MFMIDIFilePlayerGetFormat(player), 1);
+        MF_CHECK_EQ(MFMIDIFilePlayerGetTrackCount(player), 3);
+        MFMIDIFilePlayerClose(player);
+    }
+
+    _Played played;
+    _PlayAll(path, &played);
+    MF_CHECK_EQ(played.count, 5);
+    _CHECK_EVENT(played, 0, 10000, 0, kMFMIDIFileEventMessage, 0x90, 60, 100);
+    _CHECK_EVENT(played, 1, 10000, 2, kMFMIDIFileEventMessage, 0xB0, 7, 100);
+    MF_CHECK_EQ(played.times[2], 20000);
+    MF_CHECK_EQ(played.tracks[2], 1);
+    MF_CHECK_EQ(played.kinds[2], kMFMIDIFileEventSysex);
+    MF_CHECK_EQ(played.lengths[2], sizeof(sysex) - 1);
+    MF_CHECK_BYTES(played.bytes[2], &sysex[1], sizeof(sysex) - 1);
+    _CHECK_EVENT(played, 3, 25000, 2, kMFMIDIFileEventMessage, 0xB0, 7, 50);
+    _CHECK_EVENT(played, 4, 30000, 0, kMFMIDIFileEventMessage, 0x80, 60, 0);
+    remove(path);
+}
+
+//---------------------------------------------------------------------
+
+/** A format 1 file cut off part way through its last MTrk: the other tracks play in full and the cut one up to where it stops making sense */
+static void _TestTruncatedLastTrack(void)
+{
+    char path[512];
+    _TempPath(path, sizeof(path), "truncated");
+    MFMIDIFileRecorderOptions options = _kOptionsTemplate;
+    options.format = 1;
+    options.trackCount = 2;
+    MFMIDIFileRecorderRef recorder = MFMIDIFileRecorderCreate(path, &options, 0);
+    MF_CHECK(recorder != NULL);
+    if (!recorder) return;
+    for (int i = 0; i < 4; i++) {
+        MF_CHECK(MFMIDIFileRecorderRecord(recorder, 0, (uint64_t)i * 2000, (const uint8_t[]){ 0x90, (uint8_t)(60 + i), 100 }, 3));
+        MF_CHECK(MFMIDIFileRecorderRecord(recorder, 1, (uint64_t)i * 2000 + 1000, (const uint8_t[]){ 0x91, (uint8_t)(70 + i), 100 }, 3));
+    }
+    MF_CHECK(MFMIDIFileRecorderFinish(recorder));
+    MFMIDIFileRecorderDestroy(recorder);
+
+    // Track 1 is 4 x (1 byte delta + 3) + end of track (4), so 2 bytes off the end leaves it part way through its end meta, and 6 part way through its last note
+    FILE *file = fopen(path, "rb");
+    MF_CHECK(file != NULL);
+    if (!file) return;
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fclose(file);
+
+    MF_CHECK(truncate(path, size - 2) == 0);
+    _Played played;
+    _PlayAll(path, &played);
+    MF_CHECK_EQ(played.count, 8);
+    _CHECK_EVENT(played, 7, 7000, 1, kMFMIDIFileEventMessage, 0x91, 73, 100);
+
+    MF_CHECK(truncate(path, size - 6) == 0);
+    _PlayAll(path, &played);
+    MF_CHECK_EQ(played.count, 7);
+    unsigned track0Count = 0;
+    for (unsigned i = 0; i < played.count; i++) {
+        if (played.tracks[i] == 0) track0Count++;
+    }
+    MF_CHECK_EQ(track0Count, 4);
+    _CHECK_EVENT(played, 6, 6000, 0, kMFMIDIFileEventMessage, 0x90, 63, 100);
+
+    // Cut before its chunk header's done and it isn't a track at all
+    MF_CHECK(truncate(path, size - 20 - 4) == 0);
+    MFMIDIFilePlayerRef player = MFMIDIFilePlayerOpen(path);
+    MF_CHECK(player != NULL);
+    if (player) {
+        MF_CHECK_EQ(MFMIDIFilePlayerGetTrackCount(player), 1);
+        MFMIDIFilePlayerClose(player);
+    }
+    remove(path);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Written By Hand
+/////////////////////////////////////////////////////////////////////////
+
+/** Things the recorder never writes: a tempo change part way through, and running status in the file itself, carried across a meta event but not a sysex */
+static void _TestTempoChangeAndRunningStatus(void)
+{
+    const uint8_t smf[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6,  0, 0,  0, 1,  0, 96,
+        'M', 'T', 'r', 'k', 0, 0, 0, 29,
+        0x00, 0x90, 60, 100,                        // 0
+        0x60, 62, 100,                              // 96 ticks at 120 BPM: 0.5s. Running status
+        0x00, 0xFF, 0x51, 0x03, 0x0F, 0x42, 0x40,   // now 60 BPM
+        0x60, 64, 100,                              // 96 more at 60 BPM: 1.5s. Still running across the meta
+        0x30, 0xF0, 0x02, 0x01, 0xF7,               // 48 more: 2s
+        0x00, 65, 100,                              // running status doesn't survive a sysex. Ends the track
+        0x00, 0xFF, 0x2F, 0x00,
+    };
+    char path[512];
+    _TempPath(path, sizeof(path), "tempo");
+    _WriteFile(path, smf, sizeof(smf));
+
+    MFMIDIFilePlayerRef player = MFMIDIFilePlayerOpen(path);
+    MF_CHECK(player != NULL);
+    if (!player) return;
+
+    // A bit at a time, as the session plays it
+    _Played played = { 0 };
+    MF_CHECK_EQ(MFMIDIFilePlayerRender(player, 0, _Collect, &played), 500000000);
+    MF_CHECK_EQ(played.count, 1);
+    MF_CHECK_EQ(MFMIDIFilePlayerRender(player, 1000000000, _Collect, &played), 1500000000);
+    MF_CHECK_EQ(played.count, 2);
+    MF_CHECK_EQ(MFMIDIFilePlayerRender(player, UINT64_MAX - 1, _Collect, &played), kMFMIDIFilePlayerFinished);
+    MF_CHECK_EQ(played.count, 4);
+    _CHECK_EVENT(played, 0, 0, 0, kMFMIDIFileEventMessage, 0x90, 60, 100);
+    _CHECK_EVENT(played, 1, 500000000, 0, kMFMIDIFileEventMessage, 0x90, 62, 100);
+    _CHECK_EVENT(played, 2, 1500000000, 0, kMFMIDIFileEventMessage, 0x90, 64, 100);
+    _CHECK_EVENT(played, 3, 2000000000, 0, kMFMIDIFileEventSysex, 0x01, 0xF7);
+
+    // Rewinding starts again at the original tempo
+    MFMIDIFilePlayerRewind(player);
+    memset(&played, 0, sizeof(played));
+    MF_CHECK_EQ(MFMIDIFilePlayerRender(player, UINT64_MAX - 1, _Collect, &played), kMFMIDIFilePlayerFinished);
+    MF_CHECK_EQ(played.count, 4);
+    MF_CHECK_EQ(played.times[1], 500000000);
+    MF_CHECK_EQ(played.times[2], 1500000000);
+    MFMIDIFilePlayerClose(player);
+    remove(path);
+}
+
+//---------------------------------------------------------------------
+
+static void _TestNotAFile(void)
+{
+    char path[512];
+    _TempPath(path, sizeof(path), "bad");
+    MF_CHECK(MFMIDIFilePlayerOpen(path) == NULL);           // missing
+
+    const uint8_t format2[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6,  0, 2,  0, 1,  0, 96 };
+    _WriteFile(path, format2, sizeof(format2));
+    MF_CHECK(MFMIDIFilePlayerOpen(path) == NULL);
+
+    const uint8_t riff[] = { 'R', 'I', 'F', 'F', 0, 0, 0, 6,  0, 0,  0, 1,  0, 96 };
+    _WriteFile(path, riff, sizeof(riff));
+    MF_CHECK(MFMIDIFilePlayerOpen(path) == NULL);
+    remove(path);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestRoundTripFormat0);
+    MF_RUN(_TestRoundTripFormat1);
+    MF_RUN(_TestTruncatedLastTrack);
+    MF_RUN(_TestTempoChangeAndRunningStatus);
+    MF_RUN(_TestNotAFile);
+    return MFTestFinish();
+}
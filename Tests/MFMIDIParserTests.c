@@ -0,0 +1,274 @@
+//
+//  MFMIDIParserTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the incremental byte stream parser, which `+[MFMIDIMessage messagesWithData:]` and the receive path are built on. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish \
+        Tests/MFMIDIParserTests.c MIDIFish/MFMIDIParser.c \
+        -o mf_parser_tests && ./mf_parser_tests
+ */
+
+#include "MFTest.h"
+#include "MFMIDIParser.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Collector
+/////////////////////////////////////////////////////////////////////////
+
+#define _MAX_EVENTS 512
+
+/** Copies of what the parser called back with, as sysex fragments point into the fed buffer */
+typedef struct {
+    uint8_t bytes[_MAX_EVENTS][3];
+    uint32_t lengths[_MAX_EVENTS];
+    uint32_t sysexFlags[_MAX_EVENTS];
+    bool isSysex[_MAX_EVENTS];
+    uint64_t timestamps[_MAX_EVENTS];
+    unsigned count;
+
+    uint8_t sysex[8192];            // every sysex fragment, back to back
+    size_t sysexLength;
+} _Collector;
+
+static void _Collect(const MFMIDIParserEvent *event, void *context)
+{
+    _Collector *c = context;
+    if (c->count == _MAX_EVENTS) return;
+
+    const uint8_t *bytes = MFMIDIMessageValueGetBytes(&event->message);
+    c->lengths[c->count] = event->message.length;
+    c->sysexFlags[c->count] = event->sysexFlags;
+    c->timestamps[c->count] = event->timestamp;
+    
+    // Middle fragments have no flags but, unlike every other message, start with a data byte
+    c->isSysex[c->count] = event->sysexFlags || (event->message.length && bytes[0] < 0x80);
+    if (c->isSysex[c->count]) {
+        memcpy(&c->sysex[c->sysexLength], bytes, event->message.length);
+        c->sysexLength += event->message.length;
+    } else {
+        memcpy(c->bytes[c->count], bytes, event->message.length);
+    }
+    c->count++;
+}
+
+static void _Init(MFMIDIParser *parser, _Collector *c)
+{
+    memset(c, 0, sizeof(*c));
+    MFMIDIParserInit(parser, _Collect, c);
+}
+
+/** Event i is the channel/system message `expected` */
+#define _CHECK_MESSAGE(c, i, ...) do { \
+    const uint8_t _expected[] = { __VA_ARGS__ }; \
+    MF_CHECK(!(c)->isSysex[i]); \
+    MF_CHECK_EQ((c)->lengths[i], sizeof(_expected)); \
+    MF_CHECK_BYTES((c)->bytes[i], _expected, sizeof(_expected)); \
+} while (0)
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Tests
+/////////////////////////////////////////////////////////////////////////
+
+/** A controller sweep sent with running status, split across packets mid-message */
+static void _TestRunningStatusAcrossFeeds(void)
+{
+    MFMIDIParser parser;
+    static _Collector c;
+    _Init(&parser, &c);
+
+    const uint8_t first[] = { 0xB2, 7, 100, 7 };
+    const uint8_t second[] = { 90, 7, 80 };
+    const uint8_t third[] = { 10 };              // another running status message, one data byte short
+    MFMIDIParserFeed(&parser, first, sizeof(first), 1);
+    MFMIDIParserFeed(&parser, second, sizeof(second), 2);
+    MFMIDIParserFeed(&parser, third, sizeof(third), 3);
+
+    MF_CHECK_EQ(c.count, 3);
+    _CHECK_MESSAGE(&c, 0, 0xB2, 7, 100);
+    _CHECK_MESSAGE(&c, 1, 0xB2, 7, 90);
+    _CHECK_MESSAGE(&c, 2, 0xB2, 7, 80);
+    MF_CHECK_EQ(c.timestamps[1], 2);        // the feed that completed it
+
+    // Program change, 2 bytes, with running status
+    const uint8_t programs[] = { 0xC5, 1, 2, 3 };
+    MFMIDIParserFeed(&parser, programs, sizeof(programs), 4);
+    MF_CHECK_EQ(c.count, 6);
+    _CHECK_MESSAGE(&c, 3, 0xC5, 1);
+    _CHECK_MESSAGE(&c, 5, 0xC5, 3);
+
+    // System common clears running status, so the data after it is orphaned
+    const uint8_t cleared[] = { 0xF3, 4, 60, 100 };
+    MFMIDIParserFeed(&parser, cleared, sizeof(cleared), 5);
+    MF_CHECK_EQ(c.count, 7);
+    _CHECK_MESSAGE(&c, 6, 0xF3, 4);
+    MF_CHECK_EQ(parser.droppedByteCount, 2);
+}
+
+//---------------------------------------------------------------------
+
+static void _TestRealtimeInsideChannelMessage(void)
+{
+    MFMIDIParser parser;
+    static _Collector c;
+    _Init(&parser, &c);
+
+    // Clock between status and data, and between data bytes. Delivered where it occurs, the note afterwards
+    const uint8_t bytes[] = { 0x90, 0xF8, 60, 0xFA, 100, 62, 0xFC, 101 };
+    MFMIDIParserFeed(&parser, bytes, sizeof(bytes), 0);
+
+    MF_CHECK_EQ(c.count, 5);
+    _CHECK_MESSAGE(&c, 0, 0xF8);
+    _CHECK_MESSAGE(&c, 1, 0xFA);
+    _CHECK_MESSAGE(&c, 2, 0x90, 60, 100);
+    _CHECK_MESSAGE(&c, 3, 0xFC);
+    _CHECK_MESSAGE(&c, 4, 0x90, 62, 101);     // running status survived the realtime bytes
+    MF_CHECK_EQ(parser.droppedByteCount, 0);
+}
+
+//---------------------------------------------------------------------
+
+static void _TestRealtimeInsideSysex(void)
+{
+    MFMIDIParser parser;
+    static _Collector c;
+    _Init(&parser, &c);
+
+    const uint8_t bytes[] = { 0xF0, 0x7E, 1, 0xF8, 2, 3, 0xF7, 0x80, 60, 0 };
+    MFMIDIParserFeed(&parser, bytes, sizeof(bytes), 0);
+
+    // Fragment up to the clock, the clock, the rest of the sysex, then the note off
+    MF_CHECK_EQ(c.count, 4);
+    MF_CHECK_EQ(c.sysexFlags[0], kMFMIDIParserSysexBegins);
+    MF_CHECK_EQ(c.lengths[0], 3);
+    _CHECK_MESSAGE(&c, 1, 0xF8);
+    MF_CHECK_EQ(c.sysexFlags[2], kMFMIDIParserSysexEnds);
+    MF_CHECK_EQ(c.lengths[2], 3);
+    _CHECK_MESSAGE(&c, 3, 0x80, 60, 0);
+
+    const uint8_t sysex[] = { 0xF0, 0x7E, 1, 2, 3, 0xF7 };
+    MF_CHECK_EQ(c.sysexLength, sizeof(sysex));
+    MF_CHECK_BYTES(c.sysex, sysex, sizeof(sysex));
+}
+
+//---------------------------------------------------------------------
+
+/** A dump arriving over several packets. Only the first fragment Begins and only the last Ends */
+static void _TestSysexSplitAcrossFeeds(void)
+{
+    MFMIDIParser parser;
+    static _Collector c;
+    _Init(&parser, &c);
+
+    uint8_t dump[1000];
+    dump[0] = 0xF0;
+    for (size_t i = 1; i < sizeof(dump) - 1; i++) dump[i] = i & 0x7F;
+    dump[sizeof(dump) - 1] = 0xF7;
+
+    // Uneven feeds, the last holding just the EOX
+    const size_t cuts[] = { 0, 1, 300, 301, 999, 1000 };
+    for (size_t k = 0; k + 1 < sizeof(cuts) / sizeof(cuts[0]); k++) {
+        MFMIDIParserFeed(&parser, &dump[cuts[k]], cuts[k + 1] - cuts[k], k);
+    }
+
+    MF_CHECK_EQ(c.count, 5);
+    MF_CHECK_EQ(c.sysexFlags[0], kMFMIDIParserSysexBegins);
+    for (unsigned i = 1; i < 4; i++) {
+        MF_CHECK(c.isSysex[i]);
+        MF_CHECK_EQ(c.sysexFlags[i], kMFMIDIParserSysexNone);
+    }
+    MF_CHECK_EQ(c.sysexFlags[4], kMFMIDIParserSysexEnds);
+    MF_CHECK_EQ(c.lengths[4], 1);
+    MF_CHECK_EQ(c.timestamps[4], 4);
+    MF_CHECK_EQ(c.sysexLength, sizeof(dump));
+    MF_CHECK_BYTES(c.sysex, dump, sizeof(dump));
+    MF_CHECK_EQ(parser.sysexLength, sizeof(dump));
+
+    // Interrupted by a status byte in the next feed: truncated, and the new message still parses
+    const uint8_t start[] = { 0xF0, 0x43, 0x10 };
+    const uint8_t interrupted[] = { 0x20, 0x90, 64, 127 };
+    MFMIDIParserFeed(&parser, start, sizeof(start), 10);
+    MFMIDIParserFeed(&parser, interrupted, sizeof(interrupted), 11);
+    MF_CHECK_EQ(c.count, 8);
+    MF_CHECK_EQ(c.sysexFlags[5], kMFMIDIParserSysexBegins);
+    MF_CHECK_EQ(c.sysexFlags[6], kMFMIDIParserSysexEnds | kMFMIDIParserSysexTruncated);
+    MF_CHECK_EQ(c.lengths[6], 1);
+    _CHECK_MESSAGE(&c, 7, 0x90, 64, 127);
+
+    // Or by the stream ending
+    MFMIDIParserFeed(&parser, start, sizeof(start), 12);
+    MFMIDIParserFlush(&parser, 13);
+    MF_CHECK_EQ(c.count, 10);
+    MF_CHECK_EQ(c.sysexFlags[9], kMFMIDIParserSysexEnds | kMFMIDIParserSysexTruncated);
+    MF_CHECK_EQ(c.lengths[9], 0);
+}
+
+//---------------------------------------------------------------------
+
+static void _TestStrayEOXAndOrphanDataBytes(void)
+{
+    MFMIDIParser parser;
+    static _Collector c;
+    _Init(&parser, &c);
+
+    // Data with no status yet, a stray EOX, and data after that which has no status either
+    const uint8_t bytes[] = { 10, 20, 0xF7, 30, 0x91, 60, 100, 0xF7, 61, 100 };
+    MFMIDIParserFeed(&parser, bytes, sizeof(bytes), 0);
+
+    MF_CHECK_EQ(c.count, 1);
+    _CHECK_MESSAGE(&c, 0, 0x91, 60, 100);
+    MF_CHECK_EQ(parser.droppedByteCount, 7);      // 10 20, EOX, 30, then EOX again, which also clears running status, so 61 100
+
+    // A status interrupting a half-collected message abandons it
+    const uint8_t abandoned[] = { 0x92, 60, 0x93, 62, 1 };
+    MFMIDIParserFeed(&parser, abandoned, sizeof(abandoned), 1);
+    MF_CHECK_EQ(c.count, 2);
+    _CHECK_MESSAGE(&c, 1, 0x93, 62, 1);
+}
+
+//---------------------------------------------------------------------
+
+/** `messagesWithData:` used to walk its buffer with a UInt8 offset, which wrapped at 256 and re-parsed from the start. The parser it uses now must carry on to the end */
+static void _TestLongerThan256Bytes(void)
+{
+    MFMIDIParser parser;
+    static _Collector c;
+    _Init(&parser, &c);
+
+    uint8_t bytes[3 * 150];
+    for (unsigned i = 0; i < 150; i++) {
+        bytes[i * 3] = 0x90 | (i & 0x0F);
+        bytes[i * 3 + 1] = i & 0x7F;
+        bytes[i * 3 + 2] = 1 + (i % 126);
+    }
+    MFMIDIParserFeed(&parser, bytes, sizeof(bytes), 0);
+
+    MF_CHECK_EQ(c.count, 150);
+    unsigned mismatches = 0;
+    for (unsigned i = 0; i < c.count; i++) {
+        if (c.lengths[i] != 3 || memcmp(c.bytes[i], &bytes[i * 3], 3) != 0) mismatches++;
+    }
+    MF_CHECK_EQ(mismatches, 0);
+    _CHECK_MESSAGE(&c, 149, 0x95, 149 & 0x7F, 1 + (149 % 126));   // at offset 447
+    MF_CHECK_EQ(parser.droppedByteCount, 0);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestRunningStatusAcrossFeeds);
+    MF_RUN(_TestRealtimeInsideChannelMessage);
+    MF_RUN(_TestRealtimeInsideSysex);
+    MF_RUN(_TestSysexSplitAcrossFeeds);
+    MF_RUN(_TestStrayEOXAndOrphanDataBytes);
+    MF_RUN(_TestLongerThan256Bytes);
+    return MFTestFinish();
+}
@@ -0,0 +1,299 @@
+//
+//  MFMIDIRunningStatusTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the running status encoder the session applies per destination class. Each case encodes, checks the bytes, then parses the output back with MFMIDIParser and compares it with the input's messages. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish \
+        Tests/MFMIDIRunningStatusTests.c MIDIFish/MFMIDIRunningStatus.c \
+        MIDIFish/MFMIDIParser.c MIDIFish/MFMIDITypes.c \
+        -o mf_running_status_tests && ./mf_running_status_tests
+ */
+
+#include "MFTest.h"
+#include "MFMIDIRunningStatus.h"
+#include "MFMIDIParser.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+/////////////////////////////////////////////////////////////////////////
+
+#define _MAX_EVENTS 256
+
+/** What the parser made of a stream. Sysex fragments go back to back into `sysex` */
+typedef struct {
+    uint8_t bytes[_MAX_EVENTS][3];
+    uint32_t lengths[_MAX_EVENTS];
+    unsigned count;
+    uint8_t sysex[256];
+    size_t sysexLength;
+} _Parsed;
+
+static void _Collect(const MFMIDIParserEvent *event, void *context)
+{
+    _Parsed *p = context;
+    const uint8_t *bytes = MFMIDIMessageValueGetBytes(&event->message);
+    if (event->sysexFlags || (event->message.length && bytes[0] < 0x80)) {
+        memcpy(&p->sysex[p->sysexLength], bytes, event->message.length);
+        p->sysexLength += event->message.length;
+        return;
+    }
+    if (p->count == _MAX_EVENTS) return;
+    p->lengths[p->count] = event->message.length;
+    memcpy(p->bytes[p->count], bytes, event->message.length);
+    p->count++;
+}
+
+static void _Parse(const uint8_t *bytes, size_t length, _Parsed *p)
+{
+    memset(p, 0, sizeof(*p));
+    MFMIDIParser parser;
+    MFMIDIParserInit(&parser, _Collect, p);
+    MFMIDIParserFeed(&parser, bytes, length, 0);
+    MFMIDIParserFlush(&parser, 0);
+}
+
+/** Encodes `input` and checks it comes out as `expected`, is no longer and parses back to the same messages. With note off conversion the parsed note ons must be the note offs they stand for */
+static void _CheckEncode(const uint8_t *input, size_t inputLength, const uint8_t *expected, size_t expectedLength, uint32_t options)
+{
+    uint8_t out[256];
+    const size_t length = MFMIDIRunningStatusEncode(input, inputLength, out, sizeof(out), options);
+    MF_CHECK_EQ(length, expectedLength);
+    MF_CHECK(length <= inputLength);
+    MF_CHECK_BYTES(out, expected, expectedLength < length ? expectedLength : length);
+
+    static _Parsed original, encoded;
+    _Parse(input, inputLength, &original);
+    _Parse(out, length, &encoded);
+    MF_CHECK_EQ(encoded.count, original.count);
+    MF_CHECK_EQ(encoded.sysexLength, original.sysexLength);
+    MF_CHECK_BYTES(encoded.sysex, original.sysex, original.sysexLength);
+    for (unsigned i = 0; i < original.count && i < encoded.count; i++)
+    {
+        uint8_t *message = encoded.bytes[i];
+        if ((options & kMFMIDIRunningStatusOptionNoteOffAsNoteOn) && encoded.lengths[i] == 3 &&
+            (message[0] & 0xF0) == 0x90 && message[2] == 0 && (original.bytes[i][0] & 0xF0) == 0x80)
+        {
+            message[0] = 0x80 | (message[0] & 0x0F);
+            message[2] = 64;
+        }
+        MF_CHECK_EQ(encoded.lengths[i], original.lengths[i]);
+        MF_CHECK_BYTES(message, original.bytes[i], original.lengths[i]);
+    }
+    MF_CHECK(MFMIDIRunningStatusVerify(input, inputLength, out, length, options));
+}
+
+#define _CHECK_ENCODE(options, input, expected) _CheckEncode((input), sizeof(input), (expected), sizeof(expected), (options))
+
+/** Repeatable, so a failure can be reproduced */
+static uint8_t _Rand(uint32_t *seed, uint32_t n)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return (uint8_t)((*seed >> 16) % n);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Tests
+/////////////////////////////////////////////////////////////////////////
+
+/** A fader bank on one channel, then a change of channel */
+static void _TestRunSharesStatus(void)
+{
+    const uint8_t input[] = { 0xB0, 7, 16, 0xB0, 10, 32, 0xB0, 11, 48, 0xB1, 7, 64, 0xB1, 7, 65 };
+    const uint8_t expected[] = { 0xB0, 7, 16, 10, 32, 11, 48, 0xB1, 7, 64, 7, 65 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNone, input, expected);
+
+    // Input already using running status is understood, and 2 byte messages run too
+    const uint8_t already[] = { 0xE3, 0, 64, 1, 64, 0xC3, 5, 0xC3, 6, 7 };
+    const uint8_t alreadyExpected[] = { 0xE3, 0, 64, 1, 64, 0xC3, 5, 6, 7 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNone, already, alreadyExpected);
+}
+
+//---------------------------------------------------------------------
+
+static void _TestNoteOffAsNoteOn(void)
+{
+    const uint8_t input[] = { 0x90, 60, 100, 0x80, 60, 64, 0x90, 62, 100, 0x80, 62, 20 };
+
+    // Off: every change of status goes out
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNone, input, input);
+
+    // On: the velocity 64 note off rides the note on status. The one with a real release velocity can't
+    const uint8_t expected[] = { 0x90, 60, 100, 60, 0, 62, 100, 0x80, 62, 20 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNoteOffAsNoteOn, input, expected);
+
+    // Only when it saves the status byte. A note off with no note on status before it stays one
+    const uint8_t leading[] = { 0x80, 60, 64, 0x91, 60, 100, 0x80, 60, 64 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNoteOffAsNoteOn, leading, leading);
+}
+
+//---------------------------------------------------------------------
+
+/** Clock and friends pass through where they are, including between a status and its data, without breaking the run */
+static void _TestRealtimeInterleaved(void)
+{
+    const uint8_t input[] = { 0xB0, 0xF8, 7, 16, 0xB0, 10, 0xFE, 32, 0xFA, 0xB0, 11, 48, 0xF8 };
+    const uint8_t expected[] = { 0xB0, 0xF8, 7, 16, 10, 0xFE, 32, 0xFA, 11, 48, 0xF8 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNone, input, expected);
+
+    // Between the note on status and a converted note off's data
+    const uint8_t notes[] = { 0x90, 60, 100, 0x80, 0xF8, 60, 0xF8, 64 };
+    const uint8_t notesExpected[] = { 0x90, 60, 100, 0xF8, 60, 0xF8, 0 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNoteOffAsNoteOn, notes, notesExpected);
+
+    // The parse of the encoded stream puts the realtime bytes ahead of the message they interrupted, as the input's does
+    uint8_t out[32];
+    const size_t length = MFMIDIRunningStatusEncode(input, sizeof(input), out, sizeof(out), kMFMIDIRunningStatusOptionNone);
+    static _Parsed p;
+    _Parse(out, length, &p);
+    MF_CHECK_EQ(p.count, 7);
+    MF_CHECK_EQ(p.bytes[0][0], 0xF8);
+    MF_CHECK_EQ(p.bytes[2][0], 0xFE);
+    MF_CHECK_EQ(p.bytes[3][1], 10);
+    MF_CHECK_EQ(p.bytes[4][0], 0xFA);
+}
+
+//---------------------------------------------------------------------
+
+static void _TestSysexCancelsRunningStatus(void)
+{
+    // The CC after the sysex needs its status again. Realtime inside the sysex stays inside it
+    const uint8_t input[] = { 0xB0, 7, 16, 0xF0, 0x7D, 1, 0xF8, 2, 0xF7, 0xB0, 7, 17, 0xB0, 7, 18 };
+    const uint8_t expected[] = { 0xB0, 7, 16, 0xF0, 0x7D, 1, 0xF8, 2, 0xF7, 0xB0, 7, 17, 7, 18 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNone, input, expected);
+
+    // Same for a note off after a sysex following note ons. It can't borrow a status that isn't there
+    const uint8_t notes[] = { 0x90, 60, 100, 0xF0, 0x7D, 0xF7, 0x80, 60, 64 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNoteOffAsNoteOn, notes, notes);
+}
+
+//---------------------------------------------------------------------
+
+static void _TestSystemCommonCancelsRunningStatus(void)
+{
+    // Song select (1 data byte), song position (2) and tune request (none) each reset it
+    const uint8_t input[] = {
+        0xB0, 7, 16, 0xF3, 4, 0xB0, 7, 17,
+        0xF2, 0, 8, 0xB0, 7, 18,
+        0xF6, 0xB0, 7, 19, 0xB0, 7, 20,
+    };
+    const uint8_t expected[] = {
+        0xB0, 7, 16, 0xF3, 4, 0xB0, 7, 17,
+        0xF2, 0, 8, 0xB0, 7, 18,
+        0xF6, 0xB0, 7, 19, 7, 20,
+    };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNone, input, expected);
+}
+
+//---------------------------------------------------------------------
+
+/** Where the status gets sent again: at the start of every packet, and after a message that was cut short */
+static void _TestStatusResent(void)
+{
+    // A truncated CC is abandoned by the receiver when the next status arrives, so that status can't be left out
+    const uint8_t truncated[] = { 0xB0, 7, 0xB0, 10, 32, 0xB0, 11, 48 };
+    const uint8_t truncatedExpected[] = { 0xB0, 7, 0xB0, 10, 32, 11, 48 };
+    _CHECK_ENCODE(kMFMIDIRunningStatusOptionNone, truncated, truncatedExpected);
+
+    // Running status never spans packets. Each starts with its status and keeps its timestamp
+    Byte inBuffer[256], outBuffer[256];
+    MIDIPacketList *packetList = (MIDIPacketList *)inBuffer;
+    const uint8_t run[] = { 0xB0, 7, 16, 0xB0, 10, 32 };
+    MIDIPacket *packet = MIDIPacketListInit(packetList);
+    packet = MIDIPacketListAdd(packetList, sizeof(inBuffer), packet, 100, sizeof(run), run);
+    packet = MIDIPacketListAdd(packetList, sizeof(inBuffer), packet, 200, sizeof(run), run);
+    MF_CHECK(packet != NULL);
+    MF_CHECK_EQ(packetList->numPackets, 2);
+
+    MIDIPacketList *outPacketList = (MIDIPacketList *)outBuffer;
+    MF_CHECK(MFMIDIRunningStatusEncodePacketList(packetList, outPacketList, sizeof(outBuffer), kMFMIDIRunningStatusOptionNone));
+    MF_CHECK_EQ(outPacketList->numPackets, 2);
+
+    const uint8_t expected[] = { 0xB0, 7, 16, 10, 32 };
+    const MIDIPacket *outPacket = &outPacketList->packet[0];
+    for (int i = 0; i < 2; i++) {
+        MF_CHECK_EQ(outPacket->timeStamp, 100 * (i + 1));
+        MF_CHECK_EQ(outPacket->length, sizeof(expected));
+        MF_CHECK_BYTES(outPacket->data, expected, sizeof(expected));
+        outPacket = MIDIPacketNext(outPacket);
+    }
+
+    // Too little room is reported, not overrun
+    MF_CHECK(!MFMIDIRunningStatusEncodePacketList(packetList, outPacketList, sizeof(UInt32) + 4, kMFMIDIRunningStatusOptionNone));
+    uint8_t out[4];
+    MF_CHECK_EQ(MFMIDIRunningStatusEncode(run, sizeof(run), out, sizeof(out), kMFMIDIRunningStatusOptionNone), 0);
+}
+
+//---------------------------------------------------------------------
+
+/** Pseudo-random mixes of everything above, as a batch might carry them, round tripped through the parser */
+static void _TestRandomStreams(void)
+{
+    uint32_t seed = 12345;
+    unsigned failures = 0, saved = 0;
+    for (int round = 0; round < 500; round++)
+    {
+        uint8_t input[200];
+        size_t length = 0;
+        while (length < sizeof(input) - 16)
+        {
+            const uint8_t kind = _Rand(&seed, 20);
+            if (kind < 14) {
+                // Channel messages on two channels, biased to CCs and notes so there are runs
+                static const uint8_t types[] = { 0x80, 0x90, 0x90, 0xA0, 0xB0, 0xB0, 0xB0, 0xC0, 0xD0, 0xE0 };
+                const uint8_t type = types[_Rand(&seed, sizeof(types))];
+                const uint8_t status = type | _Rand(&seed, 2);
+                input[length++] = status;
+                const uint32_t dataLength = MFMIDIMessageLengthForStatus(status) - 1;
+                for (uint32_t d = 0; d < dataLength; d++) {
+                    if (!_Rand(&seed, 8)) input[length++] = 0xF8;
+                    input[length++] = (status & 0xF0) == 0x80 && d == 1 && _Rand(&seed, 2) ? 64 : _Rand(&seed, 128);
+                }
+            } else if (kind < 16) {
+                static const uint8_t realtime[] = { 0xF8, 0xFA, 0xFC, 0xFE };
+                input[length++] = realtime[_Rand(&seed, sizeof(realtime))];
+            } else if (kind < 18) {
+                input[length++] = 0xF0;
+                for (uint8_t n = _Rand(&seed, 6); n; n--) input[length++] = _Rand(&seed, 128);
+                input[length++] = 0xF7;
+            } else {
+                static const uint8_t common[][3] = { { 0xF1, 0x10 }, { 0xF2, 0, 8 }, { 0xF3, 4 }, { 0xF6 } };
+                const uint8_t which = _Rand(&seed, 4);
+                const uint32_t commonLength = MFMIDIMessageLengthForStatus(common[which][0]);
+                memcpy(&input[length], common[which], commonLength);
+                length += commonLength;
+            }
+        }
+
+        for (uint32_t options = 0; options <= kMFMIDIRunningStatusOptionNoteOffAsNoteOn; options++)
+        {
+            uint8_t out[200];
+            const size_t outLength = MFMIDIRunningStatusEncode(input, length, out, length, options);
+            if (!outLength || outLength > length || !MFMIDIRunningStatusVerify(input, length, out, outLength, options)) failures++;
+            saved += (unsigned)(length - outLength);
+        }
+    }
+    MF_CHECK_EQ(failures, 0);
+    MF_CHECK(saved > 0);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestRunSharesStatus);
+    MF_RUN(_TestNoteOffAsNoteOn);
+    MF_RUN(_TestRealtimeInterleaved);
+    MF_RUN(_TestSysexCancelsRunningStatus);
+    MF_RUN(_TestSystemCommonCancelsRunningStatus);
+    MF_RUN(_TestStatusResent);
+    MF_RUN(_TestRandomStreams);
+    return MFTestFinish();
+}
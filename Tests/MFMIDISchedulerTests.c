@@ -0,0 +1,204 @@
+//
+//  MFMIDISchedulerTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the time-ordered event queue behind `-[MFMIDISession scheduleMIDIMessage:atHostTime:]`. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish \
+        Tests/MFMIDISchedulerTests.c MIDIFish/MFMIDIScheduler.c \
+        -lpthread -o mf_scheduler_tests && ./mf_scheduler_tests
+
+ Add -fsanitize=address to have anything not freed by `MFMIDISchedulerReleaseEvents` reported as a leak.
+ */
+
+#include "MFTest.h"
+#include "MFMIDIScheduler.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+/////////////////////////////////////////////////////////////////////////
+
+/** Past the initial 256 so the heap grows a few times */
+static const unsigned _kEventCount = 2000;
+
+/** A CC carrying the order it was scheduled in, 14 bits of it */
+static MFMIDIMessageValue _MessageForIndex(unsigned index)
+{
+    return MFMIDIMessageValueMake(0xB0, index & 0x7F, (index >> 7) & 0x7F);
+}
+
+static unsigned _IndexForMessage(const MFMIDIMessageValue *message)
+{
+    return MFMIDIMessageValueGetData1(message) | MFMIDIMessageValueGetData2(message) << 7;
+}
+
+/** Deterministic and full of repeats */
+static uint64_t _TimeForIndex(unsigned index)
+{
+    return 1000 + (index * 7919u % 97) * 10;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Ordering
+/////////////////////////////////////////////////////////////////////////
+
+/** Scheduled out of order with lots of equal times: popped by time, then in the order scheduled */
+static void _TestPopOrderWithTies(void)
+{
+    MFMIDISchedulerRef scheduler = MFMIDISchedulerCreate();
+    for (unsigned i = 0; i < _kEventCount; i++) {
+        const MFMIDIMessageValue message = _MessageForIndex(i);
+        MF_CHECK(MFMIDISchedulerSchedule(scheduler, &message, _TimeForIndex(i)));
+    }
+    MF_CHECK_EQ(MFMIDISchedulerCount(scheduler), _kEventCount);
+    MF_CHECK_EQ(MFMIDISchedulerNextEventTime(scheduler), 1000);
+
+    // Horizons part way through a run of ties, a few events at a time
+    uint64_t lastTime = 0, lastSequence = 0;
+    unsigned lastIndex = 0, popped = 0, outOfOrder = 0, pastHorizon = 0;
+    for (uint64_t horizon = 1000; popped < _kEventCount && horizon < 3000; horizon += 15)
+    {
+        MFMIDISchedulerEvent events[7];
+        size_t count;
+        while ((count = MFMIDISchedulerPopDue(scheduler, horizon, events, 7)) > 0)
+        {
+            for (size_t e = 0; e < count; e++)
+            {
+                const unsigned index = _IndexForMessage(&events[e].message);
+                if (events[e].hostTime != _TimeForIndex(index)) outOfOrder++;
+                if (events[e].hostTime > horizon) pastHorizon++;
+                if (popped) {
+                    if (events[e].hostTime < lastTime) outOfOrder++;
+                    if (events[e].hostTime == lastTime && (index < lastIndex || events[e].sequence <= lastSequence)) outOfOrder++;
+                }
+                lastTime = events[e].hostTime;
+                lastSequence = events[e].sequence;
+                lastIndex = index;
+                popped++;
+            }
+            MFMIDISchedulerReleaseEvents(events, count);
+        }
+
+        // Everything left is after the horizon
+        const uint64_t next = MFMIDISchedulerNextEventTime(scheduler);
+        MF_CHECK(next > horizon);
+    }
+    MF_CHECK_EQ(popped, _kEventCount);
+    MF_CHECK_EQ(outOfOrder, 0);
+    MF_CHECK_EQ(pastHorizon, 0);
+    MF_CHECK_EQ(MFMIDISchedulerCount(scheduler), 0);
+    MF_CHECK_EQ(MFMIDISchedulerNextEventTime(scheduler), kMFMIDISchedulerNoEvent);
+    MFMIDISchedulerDestroy(scheduler);
+}
+
+//---------------------------------------------------------------------
+
+/** A descending run, the heap's worst case, then a run all at one earlier time whose order is purely the sequence */
+static void _TestGrowthKeepsOrder(void)
+{
+    const unsigned half = _kEventCount / 2;
+    MFMIDISchedulerRef scheduler = MFMIDISchedulerCreate();
+    for (unsigned i = 0; i < _kEventCount; i++) {
+        const MFMIDIMessageValue message = _MessageForIndex(i);
+        MF_CHECK(MFMIDISchedulerSchedule(scheduler, &message, i < half ? 10000 - i : 5000));
+    }
+    MF_CHECK_EQ(MFMIDISchedulerCount(scheduler), _kEventCount);
+
+    // The ties in the order scheduled, then the descending run backwards
+    MFMIDISchedulerEvent events[2000];
+    MF_CHECK_EQ(MFMIDISchedulerPopDue(scheduler, UINT64_MAX, events, _kEventCount), _kEventCount);
+    unsigned mismatches = 0;
+    for (unsigned e = 0; e < _kEventCount; e++) {
+        const unsigned expectedIndex = e < half ? half + e : _kEventCount - 1 - e;
+        if (_IndexForMessage(&events[e].message) != expectedIndex) mismatches++;
+    }
+    MF_CHECK_EQ(mismatches, 0);
+    MF_CHECK_EQ(events[half].hostTime, 10000 - (half - 1));
+    MFMIDISchedulerReleaseEvents(events, _kEventCount);
+    MFMIDISchedulerDestroy(scheduler);
+}
+
+//---------------------------------------------------------------------
+
+/** Stops at maxEvents and leaves the rest */
+static void _TestPopLimit(void)
+{
+    MFMIDISchedulerRef scheduler = MFMIDISchedulerCreate();
+    for (unsigned i = 0; i < 10; i++) {
+        const MFMIDIMessageValue message = _MessageForIndex(i);
+        MF_CHECK(MFMIDISchedulerSchedule(scheduler, &message, 100));
+    }
+    MFMIDISchedulerEvent events[10];
+    MF_CHECK_EQ(MFMIDISchedulerPopDue(scheduler, 99, events, 10), 0);
+    MF_CHECK_EQ(MFMIDISchedulerPopDue(scheduler, 100, events, 4), 4);
+    MF_CHECK_EQ(MFMIDISchedulerCount(scheduler), 6);
+    MF_CHECK_EQ(MFMIDISchedulerPopDue(scheduler, 100, events, 0), 0);
+    MF_CHECK_EQ(MFMIDISchedulerPopDue(scheduler, 100, events, 10), 6);
+    MF_CHECK_EQ(_IndexForMessage(&events[0].message), 4);
+    MFMIDISchedulerDestroy(scheduler);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Out-of-line Bytes
+/////////////////////////////////////////////////////////////////////////
+
+/** Sysex is copied when scheduled so the caller's buffer can go, and the copy is freed on release */
+static void _TestSysexCopiedAndReleased(void)
+{
+    MFMIDISchedulerRef scheduler = MFMIDISchedulerCreate();
+    uint8_t sysex[32] = { 0xF0, 0x7D };
+    for (int i = 2; i < 31; i++) sysex[i] = (uint8_t)i;
+    sysex[31] = 0xF7;
+    uint8_t original[32];
+    memcpy(original, sysex, sizeof(sysex));
+
+    const MFMIDIMessageValue message = MFMIDIMessageValueMakeWithBytes(sysex, sizeof(sysex));
+    MF_CHECK(!MFMIDIMessageValueIsInline(&message));
+    MF_CHECK(MFMIDISchedulerSchedule(scheduler, &message, 200));
+    const MFMIDIMessageValue note = MFMIDIMessageValueMake(0x90, 60, 100);
+    MF_CHECK(MFMIDISchedulerSchedule(scheduler, &note, 100));
+    memset(sysex, 0, sizeof(sysex));            // the caller reuses its buffer
+
+    MFMIDISchedulerEvent events[2];
+    MF_CHECK_EQ(MFMIDISchedulerPopDue(scheduler, 200, events, 2), 2);
+    MF_CHECK(MFMIDIMessageValueIsInline(&events[0].message));
+    MF_CHECK_EQ(events[1].message.length, sizeof(original));
+    MF_CHECK(events[1].message.outOfLineBytes != NULL && events[1].message.outOfLineBytes != sysex);
+    MF_CHECK_BYTES(MFMIDIMessageValueGetBytes(&events[1].message), original, sizeof(original));
+
+    MFMIDISchedulerReleaseEvents(events, 2);
+    MF_CHECK(events[1].message.outOfLineBytes == NULL);
+    MF_CHECK_EQ(MFMIDIMessageValueGetStatus(&events[0].message), 0x90);      // inline ones untouched
+
+    // Those never popped are freed by RemoveAll and Destroy
+    for (int i = 0; i < 300; i++) {
+        const MFMIDIMessageValue again = MFMIDIMessageValueMakeWithBytes(original, sizeof(original));
+        MF_CHECK(MFMIDISchedulerSchedule(scheduler, &again, 1000 + (uint64_t)i));
+    }
+    MFMIDISchedulerRemoveAll(scheduler);
+    MF_CHECK_EQ(MFMIDISchedulerCount(scheduler), 0);
+    for (int i = 0; i < 300; i++) {
+        const MFMIDIMessageValue again = MFMIDIMessageValueMakeWithBytes(original, sizeof(original));
+        MF_CHECK(MFMIDISchedulerSchedule(scheduler, &again, 1000 + (uint64_t)i));
+    }
+    MFMIDISchedulerDestroy(scheduler);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestPopOrderWithTies);
+    MF_RUN(_TestGrowthKeepsOrder);
+    MF_RUN(_TestPopLimit);
+    MF_RUN(_TestSysexCopiedAndReleased);
+    return MFTestFinish();
+}
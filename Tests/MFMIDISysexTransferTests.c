@@ -0,0 +1,320 @@
+//
+//  MFMIDISysexTransferTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the chunked, paced sysex transfer behind `-[MFMIDISession sendSysex:bytesPerSecond:progress:completion:]`, and the chunking the session also uses for one-off long messages. Time is simulated, so nothing sleeps. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish \
+        Tests/MFMIDISysexTransferTests.c MIDIFish/MFMIDISysexTransfer.c MIDIFish/MFMIDITypes.c \
+        -o mf_sysex_transfer_tests && ./mf_sysex_transfer_tests
+ */
+
+#include "MFTest.h"
+#include "MFMIDISysexTransfer.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+/////////////////////////////////////////////////////////////////////////
+
+#define _MAX_DESTINATIONS 4
+#define _MAX_CHUNKS 64
+
+/** Everything the send function was given, per destination */
+typedef struct {
+    uint8_t received[_MAX_DESTINATIONS][4096];
+    size_t receivedLength[_MAX_DESTINATIONS];
+    size_t chunkLengths[_MAX_DESTINATIONS][_MAX_CHUNKS];
+    unsigned chunkCount[_MAX_DESTINATIONS];
+    unsigned sendCount;
+
+    // Fail this destination's chunk number `failAtChunk` (from 0) with `failStatus`
+    int failDestination;
+    unsigned failAtChunk;
+    OSStatus failStatus;
+} _Recorder;
+
+static OSStatus _Send(void *context, uint32_t destinationIndex, const MIDIPacketList *packetList)
+{
+    _Recorder *r = context;
+    r->sendCount++;
+    MF_CHECK_EQ(packetList->numPackets, 1);
+
+    if ((int)destinationIndex == r->failDestination && r->chunkCount[destinationIndex] == r->failAtChunk) {
+        return r->failStatus;
+    }
+
+    const MIDIPacket *packet = &packetList->packet[0];
+    memcpy(&r->received[destinationIndex][r->receivedLength[destinationIndex]], packet->data, packet->length);
+    r->receivedLength[destinationIndex] += packet->length;
+    r->chunkLengths[destinationIndex][r->chunkCount[destinationIndex]++] = packet->length;
+    return noErr;
+}
+
+static void _InitRecorder(_Recorder *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->failDestination = -1;
+}
+
+/** F0, a counting body, F7 */
+static void _MakeSysex(uint8_t *bytes, size_t length)
+{
+    bytes[0] = 0xF0;
+    for (size_t i = 1; i < length - 1; i++) bytes[i] = i & 0x7F;
+    bytes[length - 1] = 0xF7;
+}
+
+#define _MS 1000000ull
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Tests
+/////////////////////////////////////////////////////////////////////////
+
+static void _TestFillChunk(void)
+{
+    uint8_t sysex[1000];
+    _MakeSysex(sysex, sizeof(sysex));
+
+    // Room for 256 data bytes in the list's one packet
+    const ByteCount listSize = offsetof(MIDIPacketList, packet) + offsetof(MIDIPacket, data) + 256;
+    uint8_t buffer[1024];
+    MIDIPacketList *packetList = (MIDIPacketList *)buffer;
+
+    uint8_t joined[sizeof(sysex)];
+    size_t joinedLength = 0, offset = 0;
+    const size_t expected[] = { 256, 256, 256, 232 };
+    unsigned chunks = 0;
+    while (MFMIDIPacketListFillChunk(packetList, listSize, 42, sysex, sizeof(sysex), &offset))
+    {
+        const MIDIPacket *packet = &packetList->packet[0];
+        MF_CHECK_EQ(packetList->numPackets, 1);
+        MF_CHECK_EQ(packet->timeStamp, 42);
+        if (chunks < 4) MF_CHECK_EQ(packet->length, expected[chunks]);
+        memcpy(&joined[joinedLength], packet->data, packet->length);
+        joinedLength += packet->length;
+        MF_CHECK_EQ(offset, joinedLength);
+        chunks++;
+    }
+    MF_CHECK_EQ(chunks, 4);
+    MF_CHECK_EQ(joinedLength, sizeof(sysex));
+    MF_CHECK_BYTES(joined, sysex, sizeof(sysex));
+
+    // An exact multiple ends on a full chunk with no empty one after it
+    offset = 0;
+    chunks = 0;
+    while (MFMIDIPacketListFillChunk(packetList, listSize, 0, sysex, 512, &offset)) chunks++;
+    MF_CHECK_EQ(chunks, 2);
+    MF_CHECK_EQ(offset, 512);
+
+    // No room for a byte isn't progress
+    offset = 0;
+    MF_CHECK(!MFMIDIPacketListFillChunk(packetList, offsetof(MIDIPacketList, packet) + offsetof(MIDIPacket, data), 0, sysex, sizeof(sysex), &offset));
+    MF_CHECK_EQ(offset, 0);
+
+    // One byte at a time still gets there
+    offset = 0;
+    chunks = 0;
+    while (MFMIDIPacketListFillChunk(packetList, listSize - 255, 0, sysex, 10, &offset)) {
+        MF_CHECK_EQ(packetList->packet[0].length, 1);
+        chunks++;
+    }
+    MF_CHECK_EQ(chunks, 10);
+}
+
+//---------------------------------------------------------------------
+
+/** Unpaced, everything goes in the first step, in chunk sized pieces to every destination */
+static void _TestChunkBoundaries(void)
+{
+    uint8_t sysex[250];
+    _MakeSysex(sysex, sizeof(sysex));
+    static _Recorder r;
+    _InitRecorder(&r);
+
+    MFMIDISysexTransferRef transfer = MFMIDISysexTransferCreate(sysex, sizeof(sysex), 2, 100, 0, _Send, &r);
+    MF_CHECK(transfer != NULL);
+    MF_CHECK(!MFMIDISysexTransferIsFinished(transfer));
+
+    MF_CHECK(MFMIDISysexTransferStep(transfer, 1000) == kMFMIDISysexTransferFinished);
+    MF_CHECK(MFMIDISysexTransferIsFinished(transfer));
+    for (int d = 0; d < 2; d++) {
+        MF_CHECK_EQ(r.chunkCount[d], 3);
+        MF_CHECK_EQ(r.chunkLengths[d][0], 100);
+        MF_CHECK_EQ(r.chunkLengths[d][1], 100);
+        MF_CHECK_EQ(r.chunkLengths[d][2], 50);
+        MF_CHECK_EQ(r.receivedLength[d], sizeof(sysex));
+        MF_CHECK_BYTES(r.received[d], sysex, sizeof(sysex));
+    }
+    MFMIDISysexTransferDestroy(transfer);
+
+    // 0 means the default chunk size
+    _InitRecorder(&r);
+    uint8_t big[kMFMIDISysexDefaultChunkSize * 2 + 1];
+    _MakeSysex(big, sizeof(big));
+    transfer = MFMIDISysexTransferCreate(big, sizeof(big), 1, 0, 0, _Send, &r);
+    MFMIDISysexTransferStep(transfer, 0);
+    MF_CHECK_EQ(r.chunkCount[0], 3);
+    MF_CHECK_EQ(r.chunkLengths[0][0], kMFMIDISysexDefaultChunkSize);
+    MF_CHECK_EQ(r.chunkLengths[0][2], 1);
+    MFMIDISysexTransferDestroy(transfer);
+}
+
+//---------------------------------------------------------------------
+
+static void _TestPacing(void)
+{
+    uint8_t sysex[400];
+    _MakeSysex(sysex, sizeof(sysex));
+    static _Recorder r;
+    _InitRecorder(&r);
+
+    // 100 byte chunks at 1000 bytes/sec is one every 100ms
+    MFMIDISysexTransferRef transfer = MFMIDISysexTransferCreate(sysex, sizeof(sysex), 1, 100, 1000, _Send, &r);
+
+    MF_CHECK_EQ(MFMIDISysexTransferStep(transfer, 0), 100 * _MS);
+    MF_CHECK_EQ(r.chunkCount[0], 1);
+
+    // Early steps send nothing and keep the deadline
+    MF_CHECK_EQ(MFMIDISysexTransferStep(transfer, 50 * _MS), 100 * _MS);
+    MF_CHECK_EQ(r.chunkCount[0], 1);
+
+    MF_CHECK_EQ(MFMIDISysexTransferStep(transfer, 100 * _MS), 200 * _MS);
+    MF_CHECK_EQ(r.chunkCount[0], 2);
+
+    // A late step sends one chunk, not a burst to catch up, and paces from now
+    MF_CHECK_EQ(MFMIDISysexTransferStep(transfer, 350 * _MS), 450 * _MS);
+    MF_CHECK_EQ(r.chunkCount[0], 3);
+
+    size_t sent, total;
+    MFMIDISysexTransferGetProgress(transfer, &sent, &total);
+    MF_CHECK_EQ(sent, 300);
+    MF_CHECK_EQ(total, 400);
+
+    MF_CHECK(MFMIDISysexTransferStep(transfer, 450 * _MS) == kMFMIDISysexTransferFinished);
+    MF_CHECK_EQ(r.chunkCount[0], 4);
+    MF_CHECK_BYTES(r.received[0], sysex, sizeof(sysex));
+    MFMIDISysexTransferDestroy(transfer);
+
+    // The next step is the earliest of the destinations' deadlines
+    _InitRecorder(&r);
+    r.failDestination = 0;
+    r.failAtChunk = 1;
+    r.failStatus = -1;
+    transfer = MFMIDISysexTransferCreate(sysex, sizeof(sysex), 2, 100, 1000, _Send, &r);
+    MF_CHECK_EQ(MFMIDISysexTransferStep(transfer, 0), 100 * _MS);
+    MF_CHECK_EQ(MFMIDISysexTransferStep(transfer, 100 * _MS), 200 * _MS);     // destination 0 failed; 1 carries on alone
+    MFMIDISysexTransferDestroy(transfer);
+}
+
+//---------------------------------------------------------------------
+
+/** A send error stops that destination where it was. The others finish */
+static void _TestFailingSendAborts(void)
+{
+    uint8_t sysex[300];
+    _MakeSysex(sysex, sizeof(sysex));
+    static _Recorder r;
+    _InitRecorder(&r);
+    r.failDestination = 1;
+    r.failAtChunk = 1;
+    r.failStatus = -50;
+
+    MFMIDISysexTransferRef transfer = MFMIDISysexTransferCreate(sysex, sizeof(sysex), 3, 100, 0, _Send, &r);
+    MF_CHECK(MFMIDISysexTransferStep(transfer, 0) == kMFMIDISysexTransferFinished);
+    MF_CHECK(MFMIDISysexTransferIsFinished(transfer));
+
+    // No retries and nothing after the failure
+    MF_CHECK_EQ(r.chunkCount[1], 1);
+    MF_CHECK_EQ(r.sendCount, 3 + 2 + 3);
+    MF_CHECK_EQ(r.receivedLength[0], sizeof(sysex));
+    MF_CHECK_EQ(r.receivedLength[2], sizeof(sysex));
+
+    size_t destinationSent;
+    MF_CHECK_EQ(MFMIDISysexTransferGetDestinationStatus(transfer, 0, &destinationSent), noErr);
+    MF_CHECK_EQ(destinationSent, sizeof(sysex));
+    MF_CHECK_EQ(MFMIDISysexTransferGetDestinationStatus(transfer, 1, &destinationSent), -50);
+    MF_CHECK_EQ(destinationSent, 100);     // what actually went
+    MF_CHECK_EQ(MFMIDISysexTransferGetStatus(transfer), -50);
+
+    // Failed counts as complete so the progress reaches its total
+    size_t sent, total;
+    MFMIDISysexTransferGetProgress(transfer, &sent, &total);
+    MF_CHECK_EQ(sent, total);
+    MF_CHECK_EQ(total, 3 * sizeof(sysex));
+
+    // Stepping a finished transfer sends nothing
+    MF_CHECK(MFMIDISysexTransferStep(transfer, 1000 * _MS) == kMFMIDISysexTransferFinished);
+    MF_CHECK_EQ(r.sendCount, 8);
+    MFMIDISysexTransferDestroy(transfer);
+}
+
+//---------------------------------------------------------------------
+
+/** What the session's progress and completion blocks get once a step returns finished: the final progress and GetStatus. Both for a run to the end and a cancel part way */
+static void _TestCompletionAndCancel(void)
+{
+    uint8_t sysex[300];
+    _MakeSysex(sysex, sizeof(sysex));
+    static _Recorder r;
+    _InitRecorder(&r);
+
+    // Completes
+    MFMIDISysexTransferRef transfer = MFMIDISysexTransferCreate(sysex, sizeof(sysex), 1, 100, 1000, _Send, &r);
+    uint64_t now = 0;
+    unsigned steps = 0;
+    while ((now = MFMIDISysexTransferStep(transfer, now)) != kMFMIDISysexTransferFinished) steps++;
+    MF_CHECK_EQ(steps, 2);
+    MF_CHECK(MFMIDISysexTransferIsFinished(transfer));
+    MF_CHECK_EQ(MFMIDISysexTransferGetStatus(transfer), noErr);
+    size_t sent, total;
+    MFMIDISysexTransferGetProgress(transfer, &sent, &total);
+    MF_CHECK_EQ(sent, total);
+    MFMIDISysexTransferDestroy(transfer);
+
+    // Cancelled after the first chunk. A destination that had already failed keeps its own error
+    _InitRecorder(&r);
+    r.failDestination = 1;
+    r.failAtChunk = 0;
+    r.failStatus = -10;
+    transfer = MFMIDISysexTransferCreate(sysex, sizeof(sysex), 2, 100, 1000, _Send, &r);
+    MF_CHECK_EQ(MFMIDISysexTransferStep(transfer, 0), 100 * _MS);
+    MF_CHECK(!MFMIDISysexTransferIsFinished(transfer));
+
+    MFMIDISysexTransferCancel(transfer, kMFMIDISysexTransferCancelledErr);
+    MF_CHECK(MFMIDISysexTransferIsFinished(transfer));
+    size_t destinationSent;
+    MF_CHECK_EQ(MFMIDISysexTransferGetDestinationStatus(transfer, 0, &destinationSent), kMFMIDISysexTransferCancelledErr);
+    MF_CHECK_EQ(destinationSent, 100);
+    MF_CHECK_EQ(MFMIDISysexTransferGetDestinationStatus(transfer, 1, NULL), -10);
+    MF_CHECK_EQ(MFMIDISysexTransferGetStatus(transfer), kMFMIDISysexTransferCancelledErr);     // the first by index
+
+    // Nothing more goes after a cancel, even when it's due
+    const unsigned sendCount = r.sendCount;
+    MF_CHECK(MFMIDISysexTransferStep(transfer, 1000 * _MS) == kMFMIDISysexTransferFinished);
+    MF_CHECK_EQ(r.sendCount, sendCount);
+    MF_CHECK_EQ(r.receivedLength[0], 100);
+
+    // Cancelling a finished transfer changes nothing
+    MFMIDISysexTransferCancel(transfer, -1);
+    MF_CHECK_EQ(MFMIDISysexTransferGetDestinationStatus(transfer, 0, NULL), kMFMIDISysexTransferCancelledErr);
+    MFMIDISysexTransferDestroy(transfer);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestFillChunk);
+    MF_RUN(_TestChunkBoundaries);
+    MF_RUN(_TestPacing);
+    MF_RUN(_TestFailingSendAborts);
+    MF_RUN(_TestCompletionAndCancel);
+    return MFTestFinish();
+}
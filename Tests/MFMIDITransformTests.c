@@ -0,0 +1,168 @@
+//
+//  MFMIDITransformTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for applying transforms to a long message sent in chunks, as the session does for sysex too big for one packet list. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish \
+        Tests/MFMIDITransformTests.c MIDIFish/MFMIDITransform.c \
+        MIDIFish/MFMIDISysexTransfer.c MIDIFish/MFMIDITypes.c \
+        -lm -o mf_transform_tests && ./mf_transform_tests
+ */
+
+#include "MFTest.h"
+#include "MFMIDITransform.h"
+#include "MFMIDISysexTransfer.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+/////////////////////////////////////////////////////////////////////////
+
+/** As the session's send buffers */
+#define _CHUNK_LIST_SIZE 4096
+
+static uint8_t _sysex[10000];
+
+static void _MakeSysex(void)
+{
+    _sysex[0] = 0xF0;
+    for (size_t i = 1; i < sizeof(_sysex) - 1; i++) _sysex[i] = i & 0x7F;
+    _sysex[sizeof(_sysex) - 1] = 0xF7;
+}
+
+typedef size_t (*_ApplyFunction)(const MFMIDITransform *transform, MFMIDITransformState *state, MIDIPacketList *packetList);
+
+/** Chunks `_sysex` as the session does and applies `transform` to each with `apply`. What's left goes in `out`. @return The number of chunks */
+static unsigned _SendChunked(const MFMIDITransform *transform, _ApplyFunction apply, MFMIDITransformState *state, uint8_t *out, size_t *outLength)
+{
+    Byte buffer[_CHUNK_LIST_SIZE] __attribute__((aligned(8)));
+    MIDIPacketList *packetList = (MIDIPacketList *)buffer;
+    size_t offset = 0;
+    unsigned chunks = 0;
+    *outLength = 0;
+    while (MFMIDIPacketListFillChunk(packetList, sizeof(buffer), 0, _sysex, sizeof(_sysex), &offset))
+    {
+        chunks++;
+        const size_t length = apply(transform, state, packetList);
+
+        size_t listed = 0;
+        const MIDIPacket *packet = &packetList->packet[0];
+        for (UInt32 i = 0; i < packetList->numPackets; i++) {
+            memcpy(&out[*outLength], packet->data, packet->length);
+            *outLength += packet->length;
+            listed += packet->length;
+            packet = MIDIPacketNext(packet);
+        }
+        MF_CHECK_EQ(length, listed);
+    }
+    return chunks;
+}
+
+static size_t _ApplyAsChunk(const MFMIDITransform *transform, MFMIDITransformState *state, MIDIPacketList *packetList)
+{
+    (void)state;
+    return MFMIDITransformApplyToMessageChunk(transform, 0xF0, packetList);
+}
+
+static size_t _ApplyOnItsOwn(const MFMIDITransform *transform, MFMIDITransformState *state, MIDIPacketList *packetList)
+{
+    return MFMIDITransformApplyToPacketList(transform, state, packetList);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Tests
+/////////////////////////////////////////////////////////////////////////
+
+/** A transform dropping sysex drops every chunk, not just the one with the F0 */
+static void _TestChunkedSysexDroppedWhole(void)
+{
+    _MakeSysex();
+    MFMIDITransform transform;
+    MFMIDITransformInit(&transform);
+    MFMIDITransformDropTypes(&transform, kMFMIDITransformTypeSysex);
+
+    static uint8_t out[sizeof(_sysex)];
+    size_t outLength;
+    MF_CHECK_EQ(_SendChunked(&transform, _ApplyAsChunk, NULL, out, &outLength), 3);
+    MF_CHECK_EQ(outLength, 0);
+
+    // What it's for: on their own, the later chunks look like orphan data bytes and get through
+    _SendChunked(&transform, _ApplyOnItsOwn, NULL, out, &outLength);
+    MF_CHECK(outLength > 0);
+
+    // With a state carried across them it comes to the same as the whole message decision
+    MFMIDITransformState state = { 0, 0 };
+    _SendChunked(&transform, _ApplyOnItsOwn, &state, out, &outLength);
+    MF_CHECK_EQ(outLength, 0);
+}
+
+//---------------------------------------------------------------------
+
+/** One that lets sysex through leaves every chunk as it was, whatever else it does */
+static void _TestChunkedSysexKeptWhole(void)
+{
+    _MakeSysex();
+    MFMIDITransform transform;
+    MFMIDITransformInit(&transform);
+    MFMIDITransformDropTypes(&transform, kMFMIDITransformTypeClock | kMFMIDITransformTypeNoteOn);
+    MFMIDITransformDropChannels(&transform, 1 << 3);
+    MFMIDITransformMapChannel(&transform, 0, 5);
+
+    static uint8_t out[sizeof(_sysex)];
+    size_t outLength;
+    MF_CHECK_EQ(_SendChunked(&transform, _ApplyAsChunk, NULL, out, &outLength), 3);
+    MF_CHECK_EQ(outLength, sizeof(_sysex));
+    MF_CHECK_BYTES(out, _sysex, sizeof(_sysex));
+
+    // The identity transform too
+    MFMIDITransformInit(&transform);
+    _SendChunked(&transform, _ApplyAsChunk, NULL, out, &outLength);
+    MF_CHECK_EQ(outLength, sizeof(_sysex));
+}
+
+//---------------------------------------------------------------------
+
+/** A long run of anything else is whole messages so is transformed as usual */
+static void _TestChunkOfOtherMessages(void)
+{
+    MFMIDITransform transform;
+    MFMIDITransformInit(&transform);
+    MFMIDITransformDropChannels(&transform, 1 << 1);
+    MFMIDITransformMapChannel(&transform, 0, 2);
+
+    Byte buffer[256] __attribute__((aligned(8)));
+    MIDIPacketList *packetList = (MIDIPacketList *)buffer;
+    const uint8_t notes[] = { 0x90, 60, 100, 0x91, 61, 100, 0x90, 62, 100 };
+    MIDIPacket *packet = MIDIPacketListInit(packetList);
+    MIDIPacketListAdd(packetList, sizeof(buffer), packet, 0, sizeof(notes), notes);
+
+    MF_CHECK_EQ(MFMIDITransformApplyToMessageChunk(&transform, 0x90, packetList), 6);
+    const uint8_t expected[] = { 0x92, 60, 100, 0x92, 62, 100 };
+    MF_CHECK_EQ(packetList->numPackets, 1);
+    MF_CHECK_EQ(packetList->packet[0].length, sizeof(expected));
+    MF_CHECK_BYTES(packetList->packet[0].data, expected, sizeof(expected));
+
+    // Dropped entirely leaves no packets
+    MFMIDITransformDropTypes(&transform, kMFMIDITransformTypeChannelVoice);
+    packet = MIDIPacketListInit(packetList);
+    MIDIPacketListAdd(packetList, sizeof(buffer), packet, 0, sizeof(notes), notes);
+    MF_CHECK_EQ(MFMIDITransformApplyToMessageChunk(&transform, 0x90, packetList), 0);
+    MF_CHECK_EQ(packetList->numPackets, 0);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestChunkedSysexDroppedWhole);
+    MF_RUN(_TestChunkedSysexKeptWhole);
+    MF_RUN(_TestChunkOfOtherMessages);
+    return MFTestFinish();
+}
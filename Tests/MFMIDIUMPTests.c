@@ -0,0 +1,387 @@
+//
+//  MFMIDIUMPTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the MIDI 1.0 byte stream <-> UMP translators, under both protocols. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish \
+        Tests/MFMIDIUMPTests.c MIDIFish/MFMIDIUMP.c MIDIFish/MFMIDITypes.c \
+        -o mf_ump_tests && ./mf_ump_tests
+ */
+
+#include "MFTest.h"
+#include "MFMIDIUMP.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+/////////////////////////////////////////////////////////////////////////
+
+/** Bytes -> UMP -> bytes in one go. @return The bytes back */
+static size_t _RoundTrip(MFMIDIUMPProtocol protocol, const uint8_t *bytes, size_t length, uint8_t *outBytes, size_t byteCapacity)
+{
+    MFMIDIUMPFromBytesState state = { 0 };
+    uint32_t words[1024];
+    size_t consumed = 0;
+    const size_t wordCount = MFMIDIUMPFromBytes(&state, protocol, 0, bytes, length, words, 1024, &consumed);
+    MF_CHECK_EQ(consumed, length);
+
+    size_t wordsConsumed = 0;
+    const size_t byteCount = MFMIDIUMPToBytes(words, wordCount, outBytes, byteCapacity, &wordsConsumed);
+    MF_CHECK_EQ(wordsConsumed, wordCount);
+    return byteCount;
+}
+
+/** The one message `bytes` makes under MIDI2, as its 2 words */
+static void _ToMIDI2(const uint8_t *bytes, size_t length, uint32_t outWords[2])
+{
+    MFMIDIUMPFromBytesState state = { 0 };
+    MF_CHECK_EQ(MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI2, 0, bytes, length, outWords, 2, NULL), 2);
+    MF_CHECK_EQ(outWords[0] >> 28, kMFMIDIUMPMessageTypeMIDI2ChannelVoice);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Round Trips
+/////////////////////////////////////////////////////////////////////////
+
+/** Every channel message kind, running status, system common and realtime come back byte for byte. Running status comes back expanded */
+static void _TestRoundTrip(MFMIDIUMPProtocol protocol)
+{
+    const uint8_t bytes[] = {
+        0x90, 60, 100,  61, 1,          // running status
+        0x81, 60, 0,
+        0xA2, 60, 127,
+        0xB3, 7, 64,
+        0xC4, 5,
+        0xD5, 0,
+        0xE6, 0x00, 0x40,
+        0xF8,
+        0xF2, 0x10, 0x20,
+        0xFE,
+    };
+    const uint8_t expected[] = {
+        0x90, 60, 100,  0x90, 61, 1,
+        0x81, 60, 0,
+        0xA2, 60, 127,
+        0xB3, 7, 64,
+        0xC4, 5,
+        0xD5, 0,
+        0xE6, 0x00, 0x40,
+        0xF8,
+        0xF2, 0x10, 0x20,
+        0xFE,
+    };
+    uint8_t out[64];
+    const size_t length = _RoundTrip(protocol, bytes, sizeof(bytes), out, sizeof(out));
+    MF_CHECK_EQ(length, sizeof(expected));
+    MF_CHECK_BYTES(out, expected, sizeof(expected));
+}
+
+static void _TestRoundTripMIDI1(void) { _TestRoundTrip(kMFMIDIUMPProtocolMIDI1); }
+static void _TestRoundTripMIDI2(void) { _TestRoundTrip(kMFMIDIUMPProtocolMIDI2); }
+
+//---------------------------------------------------------------------
+
+/** MIDI1 carries the bytes as they are, in type 2 words */
+static void _TestMIDI1Words(void)
+{
+    const uint8_t bytes[] = { 0x93, 60, 0, 0xC1, 9 };
+    MFMIDIUMPFromBytesState state = { 0 };
+    uint32_t words[4];
+    MF_CHECK_EQ(MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI1, 5, bytes, sizeof(bytes), words, 4, NULL), 2);
+    MF_CHECK_EQ(words[0], 0x25933C00);      // velocity 0 note on stays one
+    MF_CHECK_EQ(words[1], 0x25C10900);
+}
+
+//---------------------------------------------------------------------
+
+/** Every 7 and 14-bit value survives the scale up and back down */
+static void _TestMIDI2RoundTripEveryValue(void)
+{
+    unsigned mismatches = 0;
+    for (unsigned value = 0; value < 128; value++)
+    {
+        const uint8_t messages[][3] = { { 0xB0, 74, value }, { 0xA0, 60, value }, { 0xD0, value, 0 }, { 0x80, 60, value } };
+        const size_t lengths[] = { 3, 3, 2, 3 };
+        for (size_t m = 0; m < 4; m++) {
+            uint8_t out[8];
+            if (_RoundTrip(kMFMIDIUMPProtocolMIDI2, messages[m], lengths[m], out, sizeof(out)) != lengths[m] || memcmp(out, messages[m], lengths[m])) mismatches++;
+        }
+    }
+    for (unsigned value = 0; value < 0x4000; value++) {
+        const uint8_t bend[] = { 0xE0, value & 0x7F, value >> 7 };
+        uint8_t out[8];
+        if (_RoundTrip(kMFMIDIUMPProtocolMIDI2, bend, 3, out, sizeof(out)) != 3 || memcmp(out, bend, 3)) mismatches++;
+    }
+    MF_CHECK_EQ(mismatches, 0);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Scaling
+/////////////////////////////////////////////////////////////////////////
+
+/** Min-center-max: 0 stays 0, the center is exactly the center and the max is all ones */
+static void _TestScaling(void)
+{
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0, 7, 16), 0);
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0x40, 7, 16), 0x8000);
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0x7F, 7, 16), 0xFFFF);
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0, 7, 32), 0);
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0x40, 7, 32), 0x80000000u);
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0x7F, 7, 32), 0xFFFFFFFFu);
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0, 14, 32), 0);
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0x2000, 14, 32), 0x80000000u);
+    MF_CHECK_EQ(MFMIDIUMPScaleUp(0x3FFF, 14, 32), 0xFFFFFFFFu);
+
+    // Strictly increasing, so nothing collides on the way back down
+    unsigned notIncreasing = 0;
+    for (uint32_t v = 1; v < 128; v++) {
+        if (MFMIDIUMPScaleUp(v, 7, 16) <= MFMIDIUMPScaleUp(v - 1, 7, 16)) notIncreasing++;
+        if (MFMIDIUMPScaleUp(v, 7, 32) <= MFMIDIUMPScaleUp(v - 1, 7, 32)) notIncreasing++;
+    }
+    MF_CHECK_EQ(notIncreasing, 0);
+    MF_CHECK_EQ(MFMIDIUMPScaleDown(0xFFFF, 16, 7), 0x7F);
+    MF_CHECK_EQ(MFMIDIUMPScaleDown(0x80000000u, 32, 7), 0x40);
+}
+
+//---------------------------------------------------------------------
+
+/** The same scaling as it lands in MIDI2 words */
+static void _TestMIDI2Words(void)
+{
+    uint32_t w[2];
+
+    // Velocity 7 -> 16 in the top half of the second word
+    _ToMIDI2((const uint8_t[]){ 0x91, 60, 1 }, 3, w);
+    MF_CHECK_EQ(w[0], 0x40913C00);
+    MF_CHECK_EQ(w[1], 0x02000000);
+    _ToMIDI2((const uint8_t[]){ 0x91, 60, 0x40 }, 3, w);
+    MF_CHECK_EQ(w[1], 0x80000000u);
+    _ToMIDI2((const uint8_t[]){ 0x91, 60, 0x7F }, 3, w);
+    MF_CHECK_EQ(w[1], 0xFFFF0000u);
+
+    // Velocity 0 note on is a note off at the default velocity
+    _ToMIDI2((const uint8_t[]){ 0x91, 60, 0 }, 3, w);
+    MF_CHECK_EQ(w[0], 0x40813C00);
+    MF_CHECK_EQ(w[1], 0x80000000u);
+
+    // Controllers 7 -> 32
+    _ToMIDI2((const uint8_t[]){ 0xB2, 74, 0 }, 3, w);
+    MF_CHECK_EQ(w[0], 0x40B24A00);
+    MF_CHECK_EQ(w[1], 0);
+    _ToMIDI2((const uint8_t[]){ 0xB2, 74, 0x40 }, 3, w);
+    MF_CHECK_EQ(w[1], 0x80000000u);
+    _ToMIDI2((const uint8_t[]){ 0xB2, 74, 0x7F }, 3, w);
+    MF_CHECK_EQ(w[1], 0xFFFFFFFFu);
+    _ToMIDI2((const uint8_t[]){ 0xD2, 0x7F }, 2, w);
+    MF_CHECK_EQ(w[1], 0xFFFFFFFFu);
+
+    // Pitch bend 14 -> 32
+    _ToMIDI2((const uint8_t[]){ 0xE0, 0x00, 0x00 }, 3, w);
+    MF_CHECK_EQ(w[1], 0);
+    _ToMIDI2((const uint8_t[]){ 0xE0, 0x00, 0x40 }, 3, w);
+    MF_CHECK_EQ(w[1], 0x80000000u);
+    _ToMIDI2((const uint8_t[]){ 0xE0, 0x7F, 0x7F }, 3, w);
+    MF_CHECK_EQ(w[1], 0xFFFFFFFFu);
+
+    // Program in the top byte, no bank
+    _ToMIDI2((const uint8_t[]){ 0xC3, 42 }, 2, w);
+    MF_CHECK_EQ(w[0], 0x40C30000);
+    MF_CHECK_EQ(w[1], 42u << 24);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Sysex
+/////////////////////////////////////////////////////////////////////////
+
+static uint32_t _SysexStatus(uint32_t word0) { return (word0 >> 20) & 0x0F; }
+static uint32_t _SysexCount(uint32_t word0) { return (word0 >> 16) & 0x0F; }
+
+/** Split over several calls with realtime in the middle: start / continue / end packets, 6 bytes at most each, and the same sysex back */
+static void _TestSysexChunking(MFMIDIUMPProtocol protocol)
+{
+    const uint8_t sysex[] = { 0xF0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 0xF7 };
+    const size_t splits[] = { 0, 3, 4, 11, 12, 16 };           // odd places, one a lone byte
+    MFMIDIUMPFromBytesState state = { 0 };
+    uint32_t words[16];
+    size_t wordCount = 0;
+
+    for (size_t s = 0; s + 1 < sizeof(splits) / sizeof(splits[0]); s++)
+    {
+        size_t consumed = 0;
+        wordCount += MFMIDIUMPFromBytes(&state, protocol, 3, &sysex[splits[s]], splits[s + 1] - splits[s], &words[wordCount], 16 - wordCount, &consumed);
+        MF_CHECK_EQ(consumed, splits[s + 1] - splits[s]);
+    }
+    MF_CHECK(!state.inSysex);
+
+    // 14 bytes: 6 + 6 + 2
+    MF_CHECK_EQ(wordCount, 6);
+    MF_CHECK_EQ(words[0] >> 28, kMFMIDIUMPMessageTypeData64);
+    MF_CHECK_EQ((words[0] >> 24) & 0x0F, 3);
+    MF_CHECK_EQ(_SysexStatus(words[0]), kMFMIDIUMPSysexStart);
+    MF_CHECK_EQ(_SysexCount(words[0]), 6);
+    MF_CHECK_EQ(_SysexStatus(words[2]), kMFMIDIUMPSysexContinue);
+    MF_CHECK_EQ(_SysexCount(words[2]), 6);
+    MF_CHECK_EQ(_SysexStatus(words[4]), kMFMIDIUMPSysexEnd);
+    MF_CHECK_EQ(_SysexCount(words[4]), 2);
+    MF_CHECK_EQ(words[0] & 0xFFFF, 0x0102);
+    MF_CHECK_EQ(words[1], 0x03040506);
+    MF_CHECK_EQ(words[5], 0);                       // unused bytes are 0
+
+    uint8_t out[32];
+    const size_t length = MFMIDIUMPToBytes(words, wordCount, out, sizeof(out), NULL);
+    MF_CHECK_EQ(length, sizeof(sysex));
+    MF_CHECK_BYTES(out, sysex, sizeof(sysex));
+}
+
+static void _TestSysexChunkingMIDI1(void) { _TestSysexChunking(kMFMIDIUMPProtocolMIDI1); }
+static void _TestSysexChunkingMIDI2(void) { _TestSysexChunking(kMFMIDIUMPProtocolMIDI2); }
+
+//---------------------------------------------------------------------
+
+/** Exactly 6 bytes is a single complete packet, exactly 12 a start and an end with no continue, and realtime inside goes out first */
+static void _TestSysexBoundaries(void)
+{
+    MFMIDIUMPFromBytesState state = { 0 };
+    uint32_t words[16];
+
+    const uint8_t six[] = { 0xF0, 1, 2, 3, 4, 5, 6, 0xF7 };
+    MF_CHECK_EQ(MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI1, 0, six, sizeof(six), words, 16, NULL), 2);
+    MF_CHECK_EQ(_SysexStatus(words[0]), kMFMIDIUMPSysexComplete);
+    MF_CHECK_EQ(_SysexCount(words[0]), 6);
+
+    const uint8_t twelve[] = { 0xF0, 1, 2, 3, 4, 5, 6, 0xF8, 7, 8, 9, 10, 11, 12, 0xF7 };
+    MF_CHECK_EQ(MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI1, 0, twelve, sizeof(twelve), words, 16, NULL), 5);
+    MF_CHECK_EQ(words[0], 0x10F80000);             // the clock, ahead of the bytes before it
+    MF_CHECK_EQ(_SysexStatus(words[1]), kMFMIDIUMPSysexStart);
+    MF_CHECK_EQ(_SysexStatus(words[3]), kMFMIDIUMPSysexEnd);
+    MF_CHECK_EQ(_SysexCount(words[3]), 6);
+
+    // A status other than EOX ends it too
+    const uint8_t cut[] = { 0xF0, 1, 2, 0x90, 60, 100 };
+    MF_CHECK_EQ(MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI1, 0, cut, sizeof(cut), words, 16, NULL), 3);
+    MF_CHECK_EQ(_SysexStatus(words[0]), kMFMIDIUMPSysexComplete);
+    MF_CHECK_EQ(_SysexCount(words[0]), 2);
+    MF_CHECK_EQ(words[2], 0x20903C64);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Tight Capacity
+/////////////////////////////////////////////////////////////////////////
+
+/** Fast path: stops between messages, says how far it got and the rest carries on from there */
+static void _TestTightCapacityChannel(MFMIDIUMPProtocol protocol)
+{
+    const uint8_t bytes[] = { 0x90, 60, 100, 62, 100, 64, 100, 0xC0, 3 };
+    const size_t wordsPerMessage = protocol == kMFMIDIUMPProtocolMIDI2 ? 2 : 1;
+    MFMIDIUMPFromBytesState state = { 0 };
+    uint32_t words[8];
+    size_t consumed = 0;
+
+    // Room for 1 message and not quite another
+    size_t wordCount = MFMIDIUMPFromBytes(&state, protocol, 0, bytes, sizeof(bytes), words, 2 * wordsPerMessage - 1, &consumed);
+    MF_CHECK_EQ(wordCount, wordsPerMessage);
+    MF_CHECK_EQ(consumed, 3);
+
+    // No room at all
+    size_t none = 99;
+    MF_CHECK_EQ(MFMIDIUMPFromBytes(&state, protocol, 0, &bytes[consumed], sizeof(bytes) - consumed, &words[wordCount], 0, &none), 0);
+    MF_CHECK_EQ(none, 0);
+
+    // Then the rest, on running status carried over
+    size_t rest = 0;
+    wordCount += MFMIDIUMPFromBytes(&state, protocol, 0, &bytes[consumed], sizeof(bytes) - consumed, &words[wordCount], 8 - wordCount, &rest);
+    MF_CHECK_EQ(consumed + rest, sizeof(bytes));
+    MF_CHECK_EQ(wordCount, 4 * wordsPerMessage);
+
+    const uint8_t expected[] = { 0x90, 60, 100, 0x90, 62, 100, 0x90, 64, 100, 0xC0, 3 };
+    uint8_t out[16];
+    MF_CHECK_EQ(MFMIDIUMPToBytes(words, wordCount, out, sizeof(out), NULL), sizeof(expected));
+    MF_CHECK_BYTES(out, expected, sizeof(expected));
+}
+
+static void _TestTightCapacityChannelMIDI1(void) { _TestTightCapacityChannel(kMFMIDIUMPProtocolMIDI1); }
+static void _TestTightCapacityChannelMIDI2(void) { _TestTightCapacityChannel(kMFMIDIUMPProtocolMIDI2); }
+
+//---------------------------------------------------------------------
+
+/** Byte at a time path: a message left part way by the last call, and sysex, both stop at the byte that needed the room */
+static void _TestTightCapacitySlowPath(void)
+{
+    MFMIDIUMPFromBytesState state = { 0 };
+    uint32_t words[8];
+    size_t consumed = 0;
+
+    // The status arrives alone so the data goes the slow way
+    MF_CHECK_EQ(MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI2, 0, (const uint8_t[]){ 0xB0, 7 }, 2, words, 8, &consumed), 0);
+    MF_CHECK_EQ(consumed, 2);
+    const uint8_t rest[] = { 100, 0xF0, 1, 2, 3, 4, 5, 6, 7, 0xF7 };
+    MF_CHECK_EQ(MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI2, 0, rest, sizeof(rest), words, 1, &consumed), 0);
+    MF_CHECK_EQ(consumed, 0);
+    MF_CHECK_EQ(state.pendingCount, 1);             // the 7 still held, the 100 not taken
+
+    size_t wordCount = MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI2, 0, rest, sizeof(rest), words, 3, &consumed);
+    MF_CHECK_EQ(wordCount, 2);
+    MF_CHECK_EQ(consumed, 8);                       // the first 6 sysex bytes held, stopped at the 7th
+    size_t more = 0;
+    wordCount += MFMIDIUMPFromBytes(&state, kMFMIDIUMPProtocolMIDI2, 0, &rest[consumed], sizeof(rest) - consumed, &words[wordCount], 8 - wordCount, &more);
+    MF_CHECK_EQ(consumed + more, sizeof(rest));
+    MF_CHECK_EQ(wordCount, 6);
+
+    const uint8_t expected[] = { 0xB0, 7, 100, 0xF0, 1, 2, 3, 4, 5, 6, 7, 0xF7 };
+    uint8_t out[16];
+    MF_CHECK_EQ(MFMIDIUMPToBytes(words, wordCount, out, sizeof(out), NULL), sizeof(expected));
+    MF_CHECK_BYTES(out, expected, sizeof(expected));
+}
+
+//---------------------------------------------------------------------
+
+/** Going back, a message which doesn't fit isn't split and the words consumed stop before it */
+static void _TestTightCapacityToBytes(void)
+{
+    const MFMIDIUMP note = MFMIDIUMPMakeNoteOn(0, 0, 60, 0xFFFF);
+    const MFMIDIUMP program = MFMIDIUMPMakeProgramChange(0, 1, 5, 1 << 7 | 2);     // bank selects first, so 8 bytes
+    uint32_t words[4] = { note.words[0], note.words[1], program.words[0], program.words[1] };
+    uint8_t out[16];
+    size_t wordsConsumed = 0;
+
+    MF_CHECK_EQ(MFMIDIUMPToBytes(words, 4, out, 7, &wordsConsumed), 3);
+    MF_CHECK_EQ(wordsConsumed, 2);
+    MF_CHECK_EQ(MFMIDIUMPToBytes(&words[2], 2, out, 8, &wordsConsumed), 8);
+    MF_CHECK_EQ(wordsConsumed, 2);
+    const uint8_t expected[] = { 0xB1, 0, 0x01, 0xB1, 32, 0x02, 0xC1, 5 };
+    MF_CHECK_BYTES(out, expected, sizeof(expected));
+
+    // Half a 64-bit message isn't taken
+    MF_CHECK_EQ(MFMIDIUMPToBytes(words, 1, out, sizeof(out), &wordsConsumed), 0);
+    MF_CHECK_EQ(wordsConsumed, 0);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestRoundTripMIDI1);
+    MF_RUN(_TestRoundTripMIDI2);
+    MF_RUN(_TestMIDI1Words);
+    MF_RUN(_TestMIDI2RoundTripEveryValue);
+    MF_RUN(_TestScaling);
+    MF_RUN(_TestMIDI2Words);
+    MF_RUN(_TestSysexChunkingMIDI1);
+    MF_RUN(_TestSysexChunkingMIDI2);
+    MF_RUN(_TestSysexBoundaries);
+    MF_RUN(_TestTightCapacityChannelMIDI1);
+    MF_RUN(_TestTightCapacityChannelMIDI2);
+    MF_RUN(_TestTightCapacitySlowPath);
+    MF_RUN(_TestTightCapacityToBytes);
+    return MFTestFinish();
+}
@@ -0,0 +1,429 @@
+//
+//  MFNetDiscoveryTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the network half of a session refresh, driven through a fake `MFMIDIDiscovery` browser which finds, resolves and fails services when told to, on a clock the test moves by hand. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish -I MIDIFish/Private \
+        Tests/MFNetDiscoveryTests.c MIDIFish/Private/_MFNetDiscovery.c MIDIFish/Private/_MFConnectionStateStore.c \
+        -lpthread -o mf_net_discovery_tests && ./mf_net_discovery_tests
+ */
+
+#include "MFTest.h"
+#include "_MFNetDiscovery.h"
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Fake Browser
+/////////////////////////////////////////////////////////////////////////
+
+#define _MAX_NAMES 16
+
+typedef struct {
+    const MFMIDIDiscoveryCallbacks *callbacks;
+    void *refCon;
+    bool browsing;
+    bool failStart;
+    bool failResolves;
+    unsigned startCount, stopCount;
+
+    char resolving[_MAX_NAMES][32];
+    double resolveTimeouts[_MAX_NAMES];
+    unsigned resolveCount;
+    char cancelled[_MAX_NAMES][32];
+    unsigned cancelCount;
+
+    unsigned hostsReportedAtStart;      // by the session, when the browse started
+    struct _Session *session;
+} _FakeBrowser;
+
+static void _FakeStopBrowse(void *context)
+{
+    _FakeBrowser *fake = context;
+    fake->stopCount++;
+    if (!fake->browsing) return;
+    fake->browsing = false;
+    fake->callbacks->browseDidStop(fake->refCon);         // from inside, as is allowed
+}
+
+static bool _FakeResolve(void *context, const char *name, const char *domain, double timeout)
+{
+    (void)domain;
+    _FakeBrowser *fake = context;
+    if (fake->failResolves || fake->resolveCount == _MAX_NAMES) return false;
+    snprintf(fake->resolving[fake->resolveCount], 32, "%s", name);
+    fake->resolveTimeouts[fake->resolveCount++] = timeout;
+    return true;
+}
+
+static void _FakeCancelResolve(void *context, const char *name)
+{
+    _FakeBrowser *fake = context;
+    if (fake->cancelCount < _MAX_NAMES) snprintf(fake->cancelled[fake->cancelCount++], 32, "%s", name);
+}
+
+/** The browse finding a service */
+static void _FakeFind(_FakeBrowser *fake, const char *name, bool moreComing)
+{
+    fake->callbacks->serviceFound(name, "local.", moreComing, fake->refCon);
+}
+
+static void _FakeResolved(_FakeBrowser *fake, const char *name, const char *address, uint16_t port)
+{
+    fake->callbacks->serviceDidResolve(name, address, port, fake->refCon);
+}
+
+static void _FakeNotResolved(_FakeBrowser *fake, const char *name)
+{
+    fake->callbacks->serviceDidNotResolve(name, fake->refCon);
+}
+
+static bool _FakeWasCancelled(const _FakeBrowser *fake, const char *name)
+{
+    for (unsigned i = 0; i < fake->cancelCount; i++) {
+        if (strcmp(fake->cancelled[i], name) == 0) return true;
+    }
+    return false;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Session Side
+/////////////////////////////////////////////////////////////////////////
+
+/** What the session was told, in order */
+typedef struct _Session {
+    double now;
+
+    char hostNames[_MAX_NAMES][32];
+    char hostAddresses[_MAX_NAMES][32];
+    uint16_t hostPorts[_MAX_NAMES];
+    bool hostConfirmed[_MAX_NAMES];
+    unsigned hostCount;
+
+    char unresolved[_MAX_NAMES][32];
+    unsigned unresolvedCount;
+
+    size_t lastSettled, lastOutstanding;
+    unsigned progressCount, didEndCount, saveCount;
+} _Session;
+
+static double _Now(void *refCon) { return ((_Session *)refCon)->now; }
+
+static void _HostAvailable(const char *name, const char *address, uint16_t port, bool confirmed, void *refCon)
+{
+    _Session *s = refCon;
+    if (s->hostCount == _MAX_NAMES) return;
+    snprintf(s->hostNames[s->hostCount], 32, "%s", name);
+    snprintf(s->hostAddresses[s->hostCount], 32, "%s", address);
+    s->hostPorts[s->hostCount] = port;
+    s->hostConfirmed[s->hostCount] = confirmed;
+    s->hostCount++;
+}
+
+static void _HostUnresolved(const char *name, const char *domain, void *refCon)
+{
+    _Session *s = refCon;
+    MF_CHECK(strcmp(domain, "local.") == 0);
+    if (s->unresolvedCount < _MAX_NAMES) snprintf(s->unresolved[s->unresolvedCount++], 32, "%s", name);
+}
+
+static void _Progress(size_t settled, size_t outstanding, void *refCon)
+{
+    _Session *s = refCon;
+    s->lastSettled = settled;
+    s->lastOutstanding = outstanding;
+    s->progressCount++;
+}
+
+static void _DidEnd(void *refCon) { ((_Session *)refCon)->didEndCount++; }
+static void _StoreNeedsSave(void *refCon) { ((_Session *)refCon)->saveCount++; }
+
+static bool _FakeStartBrowse(void *context, const MFMIDIDiscoveryCallbacks *callbacks, void *refCon)
+{
+    _FakeBrowser *fake = context;
+    fake->startCount++;
+    fake->hostsReportedAtStart = fake->session->hostCount;
+    if (fake->failStart) return false;
+    fake->callbacks = callbacks;
+    fake->refCon = refCon;
+    fake->browsing = true;
+    return true;
+}
+
+//---------------------------------------------------------------------
+
+static const int64_t _kWallClock = 1800000000;
+static const double _kResolveTimeout = 15;
+static const double _kCachedDeadline = 2;
+
+/** Storage remembering "Studio" at 10.0.0.2:5004, resolved a minute ago. Saves go nowhere */
+static void _LoadRemembered(void *context, MFMIDIResolvedHostLoadProc proc, void *refCon)
+{
+    (void)context;
+    const MFMIDIResolvedHostRecord record = { "Studio", "10.0.0.2", 5004, _kWallClock - 60 };
+    proc(&record, refCon);
+}
+
+static void _LoadNothing(void *context, MFMIDIConnectionStateLoadProc stateProc, MFMIDIManualHostLoadProc hostProc, void *refCon)
+{
+    (void)context; (void)stateProc; (void)hostProc; (void)refCon;
+}
+
+static bool _SaveNowhere(void *context, const MFMIDIConnectionStateRecord *states, size_t stateCount, const MFMIDIManualHostRecord *hosts, size_t hostCount)
+{
+    (void)context; (void)states; (void)stateCount; (void)hosts; (void)hostCount;
+    return true;
+}
+
+static const MFMIDIStateStorage _kStorage = { "remembered", NULL, _LoadNothing, _SaveNowhere, _LoadRemembered, NULL };
+
+/** Everything a test needs */
+typedef struct {
+    _FakeBrowser fake;
+    MFMIDIDiscovery discovery;
+    _Session session;
+    _MFConnectionStateStoreRef store;
+    _MFNetDiscoveryRef net;
+} _Fixture;
+
+static void _FixtureSetUp(_Fixture *f)
+{
+    memset(f, 0, sizeof(*f));
+    f->fake.session = &f->session;
+    f->discovery = (MFMIDIDiscovery){ "fake", &f->fake, _FakeStartBrowse, _FakeStopBrowse, _FakeResolve, _FakeCancelResolve };
+    f->session.now = 100;
+    f->store = _MFConnectionStateStoreCreate(&_kStorage, _kWallClock);
+    const _MFNetDiscoveryCallbacks callbacks = { _Now, _HostAvailable, _HostUnresolved, _Progress, _DidEnd, _StoreNeedsSave };
+    f->net = _MFNetDiscoveryCreate(&f->discovery, f->store, &callbacks, &f->session);
+}
+
+static void _FixtureTearDown(_Fixture *f)
+{
+    _MFNetDiscoveryDestroy(f->net);
+    _MFConnectionStateStoreDestroy(f->store);
+}
+
+static bool _Begin(_Fixture *f)
+{
+    return _MFNetDiscoveryBegin(f->net, "Me", _kResolveTimeout, _kCachedDeadline, _kWallClock);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Warm Start
+/////////////////////////////////////////////////////////////////////////
+
+/** Remembered hosts are connected (unconfirmed) before the browse has even started, ourselves excepted */
+static void _TestCachedHostConnectedImmediately(void)
+{
+    _Fixture f;
+    _FixtureSetUp(&f);
+    _MFConnectionStateStoreSetResolvedHost(f.store, "Me", "10.0.0.9", 5004, _kWallClock);
+
+    MF_CHECK(_Begin(&f));
+    MF_CHECK_EQ(f.fake.hostsReportedAtStart, 1);
+    MF_CHECK_EQ(f.session.hostCount, 1);
+    MF_CHECK(strcmp(f.session.hostNames[0], "Studio") == 0);
+    MF_CHECK(strcmp(f.session.hostAddresses[0], "10.0.0.2") == 0);
+    MF_CHECK_EQ(f.session.hostPorts[0], 5004);
+    MF_CHECK(!f.session.hostConfirmed[0]);
+    MF_CHECK_EQ(f.session.progressCount, 1);
+    MF_CHECK(_MFNetDiscoveryIsRefreshing(f.net));
+    MF_CHECK(!_Begin(&f));                      // already refreshing
+    MF_CHECK_EQ(f.fake.startCount, 1);
+
+    // Finding ourselves is ignored
+    _FakeFind(&f.fake, "Me", false);
+    MF_CHECK_EQ(f.fake.resolveCount, 0);
+    MF_CHECK_EQ(f.session.didEndCount, 1);
+    MF_CHECK(!_MFNetDiscoveryIsRefreshing(f.net));
+    _FixtureTearDown(&f);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Deadlines
+/////////////////////////////////////////////////////////////////////////
+
+/** A remembered service gets the short deadline and settles onto its remembered address when it passes. A new one has the full timeout and ends the refresh when it resolves */
+static void _TestCachedResolveDeadline(void)
+{
+    _Fixture f;
+    _FixtureSetUp(&f);
+    MF_CHECK(_Begin(&f));
+
+    _FakeFind(&f.fake, "Studio", true);
+    _FakeFind(&f.fake, "Laptop", false);        // that's all, so the browse is stopped
+    MF_CHECK_EQ(f.fake.stopCount, 1);
+    MF_CHECK_EQ(f.fake.resolveCount, 2);
+    MF_CHECK(f.fake.resolveTimeouts[0] == _kResolveTimeout && f.fake.resolveTimeouts[1] == _kResolveTimeout);
+
+    // Not yet
+    f.session.now = 101.9;
+    MF_CHECK(_MFNetDiscoveryCheckDeadlines(f.net) == 100 + _kCachedDeadline);
+    MF_CHECK_EQ(f.session.hostCount, 1);
+
+    // Studio's is up. Confirmed on the address we had
+    f.session.now = 102;
+    MF_CHECK(_MFNetDiscoveryCheckDeadlines(f.net) == 100 + _kResolveTimeout);
+    MF_CHECK(_FakeWasCancelled(&f.fake, "Studio"));
+    MF_CHECK_EQ(f.session.hostCount, 2);
+    MF_CHECK(strcmp(f.session.hostNames[1], "Studio") == 0);
+    MF_CHECK(strcmp(f.session.hostAddresses[1], "10.0.0.2") == 0);
+    MF_CHECK(f.session.hostConfirmed[1]);
+    MF_CHECK_EQ(f.session.lastSettled, 1);
+    MF_CHECK_EQ(f.session.lastOutstanding, 1);
+    MF_CHECK_EQ(f.session.didEndCount, 0);
+
+    // Too late to count
+    _FakeResolved(&f.fake, "Studio", "10.0.0.7", 5004);
+    MF_CHECK_EQ(f.session.hostCount, 2);
+
+    // Laptop resolves within its timeout, is remembered and is the last
+    f.session.now = 110;
+    _FakeResolved(&f.fake, "Laptop", "10.0.0.3", 5006);
+    MF_CHECK_EQ(f.session.hostCount, 3);
+    MF_CHECK(strcmp(f.session.hostNames[2], "Laptop") == 0);
+    MF_CHECK(f.session.hostConfirmed[2]);
+    MF_CHECK_EQ(f.session.saveCount, 1);
+    MF_CHECK_EQ(f.session.didEndCount, 1);
+    MF_CHECK(_MFNetDiscoveryCheckDeadlines(f.net) == 0);
+
+    char address[32];
+    uint16_t port = 0;
+    MF_CHECK(_MFConnectionStateStoreGetResolvedHost(f.store, "Laptop", address, sizeof(address), &port));
+    MF_CHECK(strcmp(address, "10.0.0.3") == 0 && port == 5006);
+    MF_CHECK(_MFConnectionStateStoreGetResolvedHost(f.store, "Studio", address, sizeof(address), &port));
+    MF_CHECK(strcmp(address, "10.0.0.2") == 0);
+    _FixtureTearDown(&f);
+}
+
+//---------------------------------------------------------------------
+
+/** Resolving before its deadline corrects a remembered address, and the refresh ends without waiting for any deadline */
+static void _TestCachedResolveCorrects(void)
+{
+    _Fixture f;
+    _FixtureSetUp(&f);
+    MF_CHECK(_Begin(&f));
+    _FakeFind(&f.fake, "Studio", false);
+
+    f.session.now = 100.5;
+    _FakeResolved(&f.fake, "Studio", "10.0.0.8", 5010);
+    MF_CHECK_EQ(f.session.hostCount, 2);
+    MF_CHECK(strcmp(f.session.hostAddresses[1], "10.0.0.8") == 0);
+    MF_CHECK_EQ(f.session.hostPorts[1], 5010);
+    MF_CHECK(f.session.hostConfirmed[1]);
+    MF_CHECK_EQ(f.session.didEndCount, 1);
+    MF_CHECK_EQ(f.fake.cancelCount, 0);
+
+    char address[32];
+    MF_CHECK(_MFConnectionStateStoreGetResolvedHost(f.store, "Studio", address, sizeof(address), NULL));
+    MF_CHECK(strcmp(address, "10.0.0.8") == 0);
+    _FixtureTearDown(&f);
+}
+
+//---------------------------------------------------------------------
+
+/** A new service which doesn't resolve in the full timeout, or fails, falls back on its name */
+static void _TestUncachedTimesOut(void)
+{
+    _Fixture f;
+    _FixtureSetUp(&f);
+    MF_CHECK(_Begin(&f));
+    _FakeFind(&f.fake, "Laptop", true);
+    _FakeFind(&f.fake, "Phone", false);
+
+    _FakeNotResolved(&f.fake, "Phone");
+    MF_CHECK_EQ(f.session.unresolvedCount, 1);
+    MF_CHECK(strcmp(f.session.unresolved[0], "Phone") == 0);
+
+    f.session.now = 100 + _kCachedDeadline;
+    MF_CHECK(_MFNetDiscoveryCheckDeadlines(f.net) == 100 + _kResolveTimeout);
+    MF_CHECK_EQ(f.session.unresolvedCount, 1);
+
+    f.session.now = 100 + _kResolveTimeout;
+    MF_CHECK(_MFNetDiscoveryCheckDeadlines(f.net) == 0);
+    MF_CHECK_EQ(f.session.unresolvedCount, 2);
+    MF_CHECK(strcmp(f.session.unresolved[1], "Laptop") == 0);
+    MF_CHECK(_FakeWasCancelled(&f.fake, "Laptop"));
+    MF_CHECK_EQ(f.session.didEndCount, 1);
+    MF_CHECK_EQ(f.session.hostCount, 1);        // just the warm start
+    _FixtureTearDown(&f);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Failures and Cancelling
+/////////////////////////////////////////////////////////////////////////
+
+/** A browse which can't start ends the refresh straight away. A resolve which can't start settles at once */
+static void _TestStartFailures(void)
+{
+    _Fixture f;
+    _FixtureSetUp(&f);
+    f.fake.failStart = true;
+    MF_CHECK(_Begin(&f));
+    MF_CHECK_EQ(f.session.didEndCount, 1);
+    MF_CHECK(!_MFNetDiscoveryIsRefreshing(f.net));
+
+    f.fake.failStart = false;
+    f.fake.failResolves = true;
+    MF_CHECK(_Begin(&f));
+    _FakeFind(&f.fake, "Studio", true);
+    MF_CHECK_EQ(f.session.hostCount, 3);        // two warm starts, then confirmed on the remembered address
+    MF_CHECK(f.session.hostConfirmed[2]);
+    _FakeFind(&f.fake, "Laptop", false);
+    MF_CHECK_EQ(f.session.unresolvedCount, 1);
+    MF_CHECK_EQ(f.session.didEndCount, 2);
+    _FixtureTearDown(&f);
+}
+
+//---------------------------------------------------------------------
+
+/** Cancelling stops the browse and drops what's outstanding unreported, and destroying mid-refresh tidies up without a didEnd */
+static void _TestCancel(void)
+{
+    _Fixture f;
+    _FixtureSetUp(&f);
+    MF_CHECK(_Begin(&f));
+    _FakeFind(&f.fake, "Studio", true);
+    _FakeFind(&f.fake, "Laptop", true);
+
+    _MFNetDiscoveryCancel(f.net);
+    MF_CHECK(!f.fake.browsing);
+    MF_CHECK(_FakeWasCancelled(&f.fake, "Studio") && _FakeWasCancelled(&f.fake, "Laptop"));
+    MF_CHECK_EQ(f.session.didEndCount, 1);
+    MF_CHECK_EQ(f.session.hostCount, 1);
+    MF_CHECK_EQ(f.session.unresolvedCount, 0);
+    _FakeResolved(&f.fake, "Laptop", "10.0.0.3", 5006);
+    MF_CHECK_EQ(f.session.hostCount, 1);
+
+    // Again, then gone
+    MF_CHECK(_Begin(&f));
+    _FakeFind(&f.fake, "Laptop", true);
+    _MFNetDiscoveryDestroy(f.net);
+    f.net = NULL;
+    MF_CHECK_EQ(f.session.didEndCount, 1);
+    MF_CHECK(!f.fake.browsing);
+    _FixtureTearDown(&f);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestCachedHostConnectedImmediately);
+    MF_RUN(_TestCachedResolveDeadline);
+    MF_RUN(_TestCachedResolveCorrects);
+    MF_RUN(_TestUncachedTimesOut);
+    MF_RUN(_TestStartFailures);
+    MF_RUN(_TestCancel);
+    return MFTestFinish();
+}
@@ -0,0 +1,272 @@
+//
+//  MFRingBufferTests.c
+//  MIDIFish
+//
+//
+
+/**
+ Tests for the SPSC ring the read procs and render queues hand records over through. From the repo root:
+
+     cc -g -std=gnu11 -Wall -Wextra -I MIDIFish -I MIDIFish/Private \
+        Tests/MFRingBufferTests.c MIDIFish/Private/_MFRingBuffer.c \
+        -lpthread -o mf_ring_buffer_tests && ./mf_ring_buffer_tests
+
+ Add -fsanitize=thread to check the producer/consumer hand-off itself.
+ */
+
+#include "MFTest.h"
+#include "_MFRingBuffer.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+/////////////////////////////////////////////////////////////////////////
+
+/** Record `sequence`'s bytes. Lengths vary so records land at every offset and wrap through the pad marker */
+static uint32_t _FillRecord(uint64_t sequence, uint8_t *bytes)
+{
+    const uint32_t length = (uint32_t)(sequence * 7 % 61);
+    for (uint32_t i = 0; i < length; i++) bytes[i] = (uint8_t)(sequence + i);
+    return length;
+}
+
+static bool _RecordMatches(const _MFRingBufferRecord *record, uint64_t sequence)
+{
+    uint8_t expected[64];
+    const uint32_t length = _FillRecord(sequence, expected);
+    return record->timestamp == sequence && record->tag == (uint32_t)(sequence & 0xFFFF) && record->length == length && memcmp(record->bytes, expected, length) == 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Single Thread
+/////////////////////////////////////////////////////////////////////////
+
+/** Small enough ring that a run of records wraps many times, each time through a pad marker as records never split */
+static void _TestWraparound(void)
+{
+    _MFRingBufferRef ring = _MFRingBufferCreate(256);
+    uint8_t bytes[64];
+    uint64_t written = 0, read = 0;
+
+    for (int round = 0; round < 200; round++)
+    {
+        // Fill until it refuses, then drain half so the write position keeps moving round
+        while (true) {
+            const uint32_t length = _FillRecord(written, bytes);
+            if (!_MFRingBufferWrite(ring, written, 0, (uint32_t)(written & 0xFFFF), bytes, length)) break;
+            written++;
+        }
+        const uint64_t target = read + (written - read) / 2 + 1;
+        _MFRingBufferRecord record;
+        while (read < target && _MFRingBufferPeek(ring, &record)) {
+            MF_CHECK(_RecordMatches(&record, read));
+            _MFRingBufferConsume(ring);
+            read++;
+        }
+    }
+
+    _MFRingBufferRecord record;
+    while (_MFRingBufferPeek(ring, &record)) {
+        MF_CHECK(_RecordMatches(&record, read));
+        _MFRingBufferConsume(ring);
+        read++;
+    }
+    MF_CHECK_EQ(read, written);
+    MF_CHECK(written > 256);        // went round plenty of times
+
+    _MFRingBufferStats stats;
+    _MFRingBufferGetStats(ring, &stats);
+    MF_CHECK_EQ(stats.writtenRecordCount, written);
+    MF_CHECK_EQ(stats.capacity, 256);
+    MF_CHECK(stats.highWaterMark <= stats.capacity);
+    _MFRingBufferDestroy(ring);
+}
+
+//---------------------------------------------------------------------
+
+/** A record which needs the space at the end plus some at the start can't go in until both are free */
+static void _TestPadMarkerNeedsRoomAtStart(void)
+{
+    _MFRingBufferRef ring = _MFRingBufferCreate(64);
+    uint8_t bytes[40] = { 0 };
+
+    // 24 + 16 = 40 bytes, leaving 24 at the end
+    MF_CHECK(_MFRingBufferWrite(ring, 1, 0, 0, bytes, 16));
+    _MFRingBufferRecord record;
+    MF_CHECK(_MFRingBufferPeek(ring, &record));
+    const uint8_t *firstBytes = record.bytes;     // just after the header at the very start
+    _MFRingBufferConsume(ring);
+
+    // 32 bytes doesn't fit the 24 left before the end so it's padded and goes at the start
+    MF_CHECK(_MFRingBufferWrite(ring, 2, 0, 0, bytes, 8));
+    MF_CHECK(_MFRingBufferPeek(ring, &record));
+    MF_CHECK_EQ(record.timestamp, 2);
+    MF_CHECK(record.bytes == firstBytes);
+    _MFRingBufferConsume(ring);
+    MF_CHECK(!_MFRingBufferPeek(ring, &record));
+
+    // Bigger than the whole ring can never go in
+    uint8_t big[64] = { 0 };
+    MF_CHECK(!_MFRingBufferWrite(ring, 3, 0, 0, big, sizeof(big)));
+    _MFRingBufferDestroy(ring);
+}
+
+//---------------------------------------------------------------------
+
+/** A stalled consumer: everything past capacity is dropped and counted, and what did go in comes out intact */
+static void _TestDropsWhenConsumerStalls(void)
+{
+    _MFRingBufferRef ring = _MFRingBufferCreate(1024);
+    const uint8_t bytes[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+    // 32 bytes a record, so 32 fit
+    uint64_t accepted = 0;
+    for (uint64_t i = 0; i < 100; i++) {
+        if (_MFRingBufferWrite(ring, i, 0, 0, bytes, sizeof(bytes))) accepted++;
+    }
+    MF_CHECK_EQ(accepted, 32);
+
+    _MFRingBufferStats stats;
+    _MFRingBufferGetStats(ring, &stats);
+    MF_CHECK_EQ(stats.writtenRecordCount, 32);
+    MF_CHECK_EQ(stats.droppedRecordCount, 68);
+    MF_CHECK_EQ(stats.droppedByteCount, 68 * sizeof(bytes));
+    MF_CHECK_EQ(stats.highWaterMark, 1024);
+
+    // The first 32 in order, then room again
+    _MFRingBufferRecord record;
+    for (uint64_t i = 0; i < 32; i++) {
+        MF_CHECK(_MFRingBufferPeek(ring, &record));
+        MF_CHECK_EQ(record.timestamp, i);
+        _MFRingBufferConsume(ring);
+    }
+    MF_CHECK(!_MFRingBufferPeek(ring, &record));
+    MF_CHECK(_MFRingBufferWrite(ring, 100, 0, 0, bytes, sizeof(bytes)));
+    _MFRingBufferGetStats(ring, &stats);
+    MF_CHECK_EQ(stats.droppedRecordCount, 68);
+    _MFRingBufferDestroy(ring);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Producer Thread
+/////////////////////////////////////////////////////////////////////////
+
+static const uint64_t _kThreadedRecordCount = 200000;
+
+typedef struct {
+    _MFRingBufferRef ring;
+    uint64_t rejectedCount;
+    bool retry;                 // spin until each record goes in rather than drop it
+    atomic_bool finished;
+} _ProducerContext;
+
+static void *_Producer(void *context)
+{
+    _ProducerContext *ctx = context;
+    uint8_t bytes[64];
+    for (uint64_t sequence = 0; sequence < _kThreadedRecordCount; sequence++)
+    {
+        const uint32_t length = _FillRecord(sequence, bytes);
+        while (!_MFRingBufferWrite(ctx->ring, sequence, 0, (uint32_t)(sequence & 0xFFFF), bytes, length))
+        {
+            ctx->rejectedCount++;
+            if (!ctx->retry) break;
+            sched_yield();
+        }
+    }
+    atomic_store(&ctx->finished, true);
+    return NULL;
+}
+
+/** Everything written by the producer thread arrives once, in order and intact, through many wraparounds */
+static void _TestProducerThreadInOrder(void)
+{
+    _ProducerContext ctx = { _MFRingBufferCreate(512), 0, true, false };
+    pthread_t thread;
+    pthread_create(&thread, NULL, _Producer, &ctx);
+
+    uint64_t expected = 0, mismatches = 0;
+    _MFRingBufferRecord record;
+    while (expected < _kThreadedRecordCount)
+    {
+        if (!_MFRingBufferPeek(ctx.ring, &record)) {
+            sched_yield();
+            continue;
+        }
+        if (!_RecordMatches(&record, expected)) mismatches++;
+        _MFRingBufferConsume(ctx.ring);
+        expected++;
+    }
+    pthread_join(thread, NULL);
+
+    MF_CHECK_EQ(mismatches, 0);
+    MF_CHECK(!_MFRingBufferPeek(ctx.ring, &record));
+
+    // Every rejection was a full ring, which the retry then got past
+    _MFRingBufferStats stats;
+    _MFRingBufferGetStats(ctx.ring, &stats);
+    MF_CHECK_EQ(stats.writtenRecordCount, _kThreadedRecordCount);
+    MF_CHECK_EQ(stats.droppedRecordCount, ctx.rejectedCount);
+    _MFRingBufferDestroy(ctx.ring);
+}
+
+//---------------------------------------------------------------------
+
+/** The producer drops rather than waits, as the read proc does. The consumer sees a strictly increasing subset and the counts add up */
+static void _TestProducerThreadDropsCounted(void)
+{
+    _ProducerContext ctx = { _MFRingBufferCreate(256), 0, false, false };
+    pthread_t thread;
+    pthread_create(&thread, NULL, _Producer, &ctx);
+
+    // A slow consumer, so plenty is dropped
+    uint64_t received = 0, outOfOrder = 0, corrupt = 0;
+    int64_t last = -1;
+    _MFRingBufferRecord record;
+    while (true)
+    {
+        // Checked first so nothing written before it finished is missed
+        const bool finished = atomic_load(&ctx.finished);
+        if (!_MFRingBufferPeek(ctx.ring, &record)) {
+            if (finished) break;
+            sched_yield();
+            continue;
+        }
+        if ((int64_t)record.timestamp <= last) outOfOrder++;
+        if (!_RecordMatches(&record, record.timestamp)) corrupt++;
+        last = (int64_t)record.timestamp;
+        _MFRingBufferConsume(ctx.ring);
+        received++;
+        if (received % 64 == 0) sched_yield();
+    }
+    pthread_join(thread, NULL);
+
+    MF_CHECK_EQ(outOfOrder, 0);
+    MF_CHECK_EQ(corrupt, 0);
+
+    _MFRingBufferStats stats;
+    _MFRingBufferGetStats(ctx.ring, &stats);
+    MF_CHECK_EQ(stats.droppedRecordCount, ctx.rejectedCount);
+    MF_CHECK_EQ(stats.writtenRecordCount, received);
+    MF_CHECK_EQ(stats.writtenRecordCount + stats.droppedRecordCount, _kThreadedRecordCount);
+    _MFRingBufferDestroy(ctx.ring);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+/////////////////////////////////////////////////////////////////////////
+
+int main(void)
+{
+    MF_RUN(_TestWraparound);
+    MF_RUN(_TestPadMarkerNeedsRoomAtStart);
+    MF_RUN(_TestDropsWhenConsumerStalls);
+    MF_RUN(_TestProducerThreadInOrder);
+    MF_RUN(_TestProducerThreadDropsCounted);
+    return MFTestFinish();
+}
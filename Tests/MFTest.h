@@ -0,0 +1,66 @@
+//
+//  MFTest.h
+//  MIDIFish
+//
+//
+
+#ifndef MIDIFish_MFTest_h
+#define MIDIFish_MFTest_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ Minimal unit test harness for the portable C layers. Each file in Tests/ is a standalone program, built with the line at its top, which runs its cases and exits non-zero if any check failed. Checks report the file and line and carry on so one run shows every failure.
+
+     static void _TestSomething(void)
+     {
+         MF_CHECK(1 + 1 == 2);
+         MF_CHECK_EQ(MFMIDIMessageLengthForStatus(0xC0), 2);
+     }
+
+     int main(void)
+     {
+         MF_RUN(_TestSomething);
+         return MFTestFinish();
+     }
+ */
+
+static unsigned MFTestCheckCount, MFTestFailureCount;
+
+#define MF_CHECK(cond) do { \
+    MFTestCheckCount++; \
+    if (!(cond)) { \
+        MFTestFailureCount++; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+/** Integers only. Prints both sides on failure */
+#define MF_CHECK_EQ(a, b) do { \
+    MFTestCheckCount++; \
+    const long long _a = (long long)(a), _b = (long long)(b); \
+    if (_a != _b) { \
+        MFTestFailureCount++; \
+        fprintf(stderr, "%s:%d: check failed: %s == %s (%lld vs %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+    } \
+} while (0)
+
+#define MF_CHECK_BYTES(a, b, length) MF_CHECK(memcmp((a), (b), (length)) == 0)
+
+#define MF_RUN(test) do { \
+    const unsigned _failuresBefore = MFTestFailureCount; \
+    test(); \
+    printf("%s %s\n", MFTestFailureCount == _failuresBefore ? "ok  " : "FAIL", #test); \
+} while (0)
+
+/** @return The exit status for main */
+static inline int MFTestFinish(void)
+{
+    printf("%u checks, %u failed\n", MFTestCheckCount, MFTestFailureCount);
+    return MFTestFailureCount ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif